@@ -0,0 +1,2609 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-io <https://github.com/NatronGitHub/openfx-io>,
+ * (C) 2018-2021 The Natron Developers
+ * (C) 2013-2018 INRIA
+ *
+ * openfx-io is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-io is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-io.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+/*
+ * OFX I/O benchmark.
+ * A minimal command-line OFX host that loads the plugin binary, renders a range of frames with one of
+ * its readers, writers or color transforms, and prints the timings as a JSON object.
+ *
+ * The writers and the filters get synthetic input images. The readers read the files written by the writers,
+ * e.g. to time WriteEXR and then ReadEXR on the same sequence:
+ *
+ *     IOBenchmark --file /tmp/bench.####.exr --size 3840x2160 fr.inria.openfx.WriteEXR
+ *     IOBenchmark --file /tmp/bench.####.exr fr.inria.openfx.ReadEXR
+ *
+ * This host only implements what the plugins of this repository need: parameters are not animated, the
+ * changes made by the plugins to their own parameters are not notified back to them, and the properties
+ * that the host does not know about read as 0 or as an empty string.
+ */
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <dlfcn.h>
+#include <sys/resource.h>
+
+#include "ofxCore.h"
+#include "ofxImageEffect.h"
+#include "ofxInteract.h"
+#include "ofxMemory.h"
+#include "ofxMessage.h"
+#include "ofxMultiThread.h"
+#include "ofxParam.h"
+#include "ofxProperty.h"
+#include "ofxTimeLine.h"
+
+using std::string;
+using std::vector;
+
+#define kBenchmarkHostName "fr.inria.openfx.IOBenchmark"
+#define kBenchmarkHostLabel "OpenFX I/O benchmark"
+
+#ifndef kOfxImageEffectFileParamName
+#define kOfxImageEffectFileParamName "filename"
+#endif
+
+// the push button of GenericReader and GenericWriter that displays the profile of the renders
+#define kParamProfileInfo "profileInfo"
+
+namespace {
+enum PropertyTypeEnum
+{
+    ePropertyTypeNone = 0,
+    ePropertyTypePointer,
+    ePropertyTypeString,
+    ePropertyTypeDouble,
+    ePropertyTypeInt
+};
+
+struct Property
+{
+    Property()
+        : type(ePropertyTypeNone)
+        , pointers()
+        , strings()
+        , doubles()
+        , ints()
+    {
+    }
+
+    PropertyTypeEnum type;
+    vector<void*> pointers;
+    vector<string> strings;
+    vector<double> doubles;
+    vector<int> ints;
+};
+
+template <typename T>
+struct PropertyValues;
+
+template <>
+struct PropertyValues<void*>
+{
+    static const PropertyTypeEnum type = ePropertyTypePointer;
+    static vector<void*>& of(Property& p) { return p.pointers; }
+    static const vector<void*>& of(const Property& p) { return p.pointers; }
+};
+
+template <>
+struct PropertyValues<string>
+{
+    static const PropertyTypeEnum type = ePropertyTypeString;
+    static vector<string>& of(Property& p) { return p.strings; }
+    static const vector<string>& of(const Property& p) { return p.strings; }
+};
+
+template <>
+struct PropertyValues<double>
+{
+    static const PropertyTypeEnum type = ePropertyTypeDouble;
+    static vector<double>& of(Property& p) { return p.doubles; }
+    static const vector<double>& of(const Property& p) { return p.doubles; }
+};
+
+template <>
+struct PropertyValues<int>
+{
+    static const PropertyTypeEnum type = ePropertyTypeInt;
+    static vector<int>& of(Property& p) { return p.ints; }
+    static const vector<int>& of(const Property& p) { return p.ints; }
+};
+
+// The properties of the host, of an effect, a clip, a parameter, an image, or the arguments of an action.
+class PropertySet
+{
+public:
+    PropertySet()
+        : _props()
+    {
+    }
+
+    virtual ~PropertySet() {}
+
+    template <typename T>
+    OfxStatus set(const char* name,
+                  int index,
+                  const T& value)
+    {
+        if ( !name || (index < 0) ) {
+            return kOfxStatErrBadIndex;
+        }
+        Property& p = _props[name];
+        if (p.type != PropertyValues<T>::type) {
+            p = Property();
+            p.type = PropertyValues<T>::type;
+        }
+        vector<T>& values = PropertyValues<T>::of(p);
+        if ( (int)values.size() <= index ) {
+            values.resize(index + 1);
+        }
+        values[index] = value;
+
+        return kOfxStatOK;
+    }
+
+    // *value is NULL if the property is unknown
+    template <typename T>
+    OfxStatus get(const char* name,
+                  int index,
+                  const T** value) const
+    {
+        *value = NULL;
+        if (!name) {
+            return kOfxStatErrBadHandle;
+        }
+        std::map<string, Property>::const_iterator found = _props.find(name);
+        if ( found == _props.end() ) {
+            return kOfxStatOK;
+        }
+        if ( (found->second.type != PropertyValues<T>::type) && (found->second.type != ePropertyTypeNone) ) {
+            return kOfxStatErrValue;
+        }
+        const vector<T>& values = PropertyValues<T>::of(found->second);
+        if ( (index < 0) || ( index >= (int)values.size() ) ) {
+            return kOfxStatErrBadIndex;
+        }
+        *value = &values[index];
+
+        return kOfxStatOK;
+    }
+
+    int getDimension(const char* name) const
+    {
+        std::map<string, Property>::const_iterator found = _props.find(name);
+        if ( found == _props.end() ) {
+            return 0;
+        }
+        switch (found->second.type) {
+        case ePropertyTypePointer:
+
+            return (int)found->second.pointers.size();
+        case ePropertyTypeString:
+
+            return (int)found->second.strings.size();
+        case ePropertyTypeDouble:
+
+            return (int)found->second.doubles.size();
+        case ePropertyTypeInt:
+
+            return (int)found->second.ints.size();
+        case ePropertyTypeNone:
+            break;
+        }
+
+        return 0;
+    }
+
+    void reset(const char* name)
+    {
+        std::map<string, Property>::iterator found = _props.find(name);
+        if ( found != _props.end() ) {
+            found->second = Property();
+        }
+    }
+
+    void setString(const char* name,
+                   const string& value,
+                   int index = 0)
+    {
+        set<string>(name, index, value);
+    }
+
+    void setDouble(const char* name,
+                   double value,
+                   int index = 0)
+    {
+        set<double>(name, index, value);
+    }
+
+    void setInt(const char* name,
+                int value,
+                int index = 0)
+    {
+        set<int>(name, index, value);
+    }
+
+    void setPointer(const char* name,
+                    void* value,
+                    int index = 0)
+    {
+        set<void*>(name, index, value);
+    }
+
+    string getString(const char* name,
+                     int index = 0) const
+    {
+        const string* value;
+
+        return ( (get<string>(name, index, &value) == kOfxStatOK) && value ) ? *value : string();
+    }
+
+    double getDouble(const char* name,
+                     int index = 0) const
+    {
+        const double* value;
+
+        return ( (get<double>(name, index, &value) == kOfxStatOK) && value ) ? *value : 0.;
+    }
+
+    int getInt(const char* name,
+               int index = 0) const
+    {
+        const int* value;
+
+        return ( (get<int>(name, index, &value) == kOfxStatOK) && value ) ? *value : 0;
+    }
+
+    bool has(const char* name) const
+    {
+        return getDimension(name) > 0;
+    }
+
+private:
+    std::map<string, Property> _props;
+};
+
+struct Effect;
+
+struct Param
+{
+    Param()
+        : name()
+        , type()
+        , props()
+        , ints()
+        , doubles()
+        , hasString(false)
+        , str()
+    {
+    }
+
+    string name;
+    string type;
+    PropertySet props;
+    // the value, as given to paramGetValue(): ints, then doubles, then a string
+    vector<int> ints;
+    vector<double> doubles;
+    bool hasString;
+    string str;
+};
+
+struct Clip
+{
+    Clip()
+        : name()
+        , props()
+        , effect(NULL)
+        , rod()
+        , synthetic()
+    {
+    }
+
+    string name;
+    PropertySet props;
+    Effect* effect;
+    OfxRectD rod;
+    vector<unsigned char> synthetic; // the input image of the writers and filters
+};
+
+// An effect descriptor, or an effect instance. It is also the handle of its parameter set.
+struct Effect
+{
+    Effect()
+        : props()
+        , paramSetProps()
+        , params()
+        , clips()
+    {
+    }
+
+    PropertySet props;
+    PropertySet paramSetProps;
+    std::map<string, std::unique_ptr<Param> > params;
+    std::map<string, std::unique_ptr<Clip> > clips;
+};
+
+struct Image
+    : public PropertySet
+{
+    vector<unsigned char> buffer; // empty if the image points to the synthetic input
+};
+
+struct ImageMemory
+{
+    vector<unsigned char> buffer;
+};
+
+// the messages sent by the plugin
+std::mutex gMessagesLock;
+vector<string> gMessages;
+
+// the images given to the plugin
+std::mutex gImagesLock;
+std::set<Image*> gImages;
+
+thread_local unsigned int gThreadIndex = 0;
+thread_local bool gThreadIsSpawned = false;
+
+PropertySet gHostProps;
+OfxHost gHost;
+
+inline PropertySet*
+toProps(OfxPropertySetHandle handle)
+{
+    return reinterpret_cast<PropertySet*>(handle);
+}
+
+inline OfxPropertySetHandle
+toHandle(PropertySet* props)
+{
+    return reinterpret_cast<OfxPropertySetHandle>(props);
+}
+
+inline Effect*
+toEffect(OfxImageEffectHandle handle)
+{
+    return reinterpret_cast<Effect*>(handle);
+}
+
+inline Effect*
+toEffect(OfxParamSetHandle handle)
+{
+    return reinterpret_cast<Effect*>(handle);
+}
+
+inline Param*
+toParam(OfxParamHandle handle)
+{
+    return reinterpret_cast<Param*>(handle);
+}
+
+inline Clip*
+toClip(OfxImageClipHandle handle)
+{
+    return reinterpret_cast<Clip*>(handle);
+}
+
+// property suite
+
+template <typename T>
+OfxStatus
+propSetValue(OfxPropertySetHandle handle,
+             const char* property,
+             int index,
+             const T& value)
+{
+    if (!handle) {
+        return kOfxStatErrBadHandle;
+    }
+
+    return toProps(handle)->set<T>(property, index, value);
+}
+
+template <typename T>
+OfxStatus
+propSetValues(OfxPropertySetHandle handle,
+              const char* property,
+              int count,
+              const T* values)
+{
+    if (!handle) {
+        return kOfxStatErrBadHandle;
+    }
+    toProps(handle)->reset(property);
+    for (int i = count - 1; i >= 0; --i) {
+        OfxStatus stat = toProps(handle)->set<T>(property, i, values[i]);
+        if (stat != kOfxStatOK) {
+            return stat;
+        }
+    }
+
+    return kOfxStatOK;
+}
+
+template <typename T>
+OfxStatus
+propGetValue(OfxPropertySetHandle handle,
+             const char* property,
+             int index,
+             T* value)
+{
+    if (!handle || !value) {
+        return kOfxStatErrBadHandle;
+    }
+    const T* found;
+    OfxStatus stat = toProps(handle)->get<T>(property, index, &found);
+    *value = found ? *found : T();
+
+    return stat;
+}
+
+OfxStatus
+propSetPointer(OfxPropertySetHandle properties,
+               const char* property,
+               int index,
+               void* value)
+{
+    return propSetValue<void*>(properties, property, index, value);
+}
+
+OfxStatus
+propSetString(OfxPropertySetHandle properties,
+              const char* property,
+              int index,
+              const char* value)
+{
+    return propSetValue<string>(properties, property, index, value ? string(value) : string());
+}
+
+OfxStatus
+propSetDouble(OfxPropertySetHandle properties,
+              const char* property,
+              int index,
+              double value)
+{
+    return propSetValue<double>(properties, property, index, value);
+}
+
+OfxStatus
+propSetInt(OfxPropertySetHandle properties,
+           const char* property,
+           int index,
+           int value)
+{
+    return propSetValue<int>(properties, property, index, value);
+}
+
+OfxStatus
+propSetPointerN(OfxPropertySetHandle properties,
+                const char* property,
+                int count,
+                void* const* value)
+{
+    return propSetValues<void*>(properties, property, count, value);
+}
+
+OfxStatus
+propSetStringN(OfxPropertySetHandle properties,
+               const char* property,
+               int count,
+               const char* const* value)
+{
+    vector<string> values(count);
+
+    for (int i = 0; i < count; ++i) {
+        values[i] = value[i] ? value[i] : "";
+    }
+
+    return propSetValues<string>(properties, property, count, values.empty() ? NULL : &values[0]);
+}
+
+OfxStatus
+propSetDoubleN(OfxPropertySetHandle properties,
+               const char* property,
+               int count,
+               const double* value)
+{
+    return propSetValues<double>(properties, property, count, value);
+}
+
+OfxStatus
+propSetIntN(OfxPropertySetHandle properties,
+            const char* property,
+            int count,
+            const int* value)
+{
+    return propSetValues<int>(properties, property, count, value);
+}
+
+OfxStatus
+propGetPointer(OfxPropertySetHandle properties,
+               const char* property,
+               int index,
+               void** value)
+{
+    return propGetValue<void*>(properties, property, index, value);
+}
+
+OfxStatus
+propGetString(OfxPropertySetHandle properties,
+              const char* property,
+              int index,
+              char** value)
+{
+    if (!properties || !value) {
+        return kOfxStatErrBadHandle;
+    }
+    const string* found;
+    OfxStatus stat = toProps(properties)->get<string>(property, index, &found);
+    // the string stays valid until the property is set again
+    *value = const_cast<char*>(found ? found->c_str() : "");
+
+    return stat;
+}
+
+OfxStatus
+propGetDouble(OfxPropertySetHandle properties,
+              const char* property,
+              int index,
+              double* value)
+{
+    return propGetValue<double>(properties, property, index, value);
+}
+
+OfxStatus
+propGetInt(OfxPropertySetHandle properties,
+           const char* property,
+           int index,
+           int* value)
+{
+    return propGetValue<int>(properties, property, index, value);
+}
+
+OfxStatus
+propGetPointerN(OfxPropertySetHandle properties,
+                const char* property,
+                int count,
+                void** value)
+{
+    for (int i = 0; i < count; ++i) {
+        OfxStatus stat = propGetPointer(properties, property, i, &value[i]);
+        if (stat != kOfxStatOK) {
+            return stat;
+        }
+    }
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+propGetStringN(OfxPropertySetHandle properties,
+               const char* property,
+               int count,
+               char** value)
+{
+    for (int i = 0; i < count; ++i) {
+        OfxStatus stat = propGetString(properties, property, i, &value[i]);
+        if (stat != kOfxStatOK) {
+            return stat;
+        }
+    }
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+propGetDoubleN(OfxPropertySetHandle properties,
+               const char* property,
+               int count,
+               double* value)
+{
+    for (int i = 0; i < count; ++i) {
+        OfxStatus stat = propGetDouble(properties, property, i, &value[i]);
+        if (stat != kOfxStatOK) {
+            return stat;
+        }
+    }
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+propGetIntN(OfxPropertySetHandle properties,
+            const char* property,
+            int count,
+            int* value)
+{
+    for (int i = 0; i < count; ++i) {
+        OfxStatus stat = propGetInt(properties, property, i, &value[i]);
+        if (stat != kOfxStatOK) {
+            return stat;
+        }
+    }
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+propReset(OfxPropertySetHandle properties,
+          const char* property)
+{
+    if (!properties) {
+        return kOfxStatErrBadHandle;
+    }
+    toProps(properties)->reset(property);
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+propGetDimension(OfxPropertySetHandle properties,
+                 const char* property,
+                 int* count)
+{
+    if (!properties || !count) {
+        return kOfxStatErrBadHandle;
+    }
+    *count = toProps(properties)->getDimension(property);
+
+    return kOfxStatOK;
+}
+
+// parameter suite
+
+// allocate the value of the parameter, and set it to its default
+void
+initParamValue(Param* param)
+{
+    const string& t = param->type;
+    int nInts = 0;
+    int nDoubles = 0;
+
+    if ( (t == kOfxParamTypeInteger) || (t == kOfxParamTypeBoolean) || (t == kOfxParamTypeChoice) ) {
+        nInts = 1;
+    } else if (t == kOfxParamTypeInteger2D) {
+        nInts = 2;
+    } else if (t == kOfxParamTypeInteger3D) {
+        nInts = 3;
+    } else if (t == kOfxParamTypeDouble) {
+        nDoubles = 1;
+    } else if (t == kOfxParamTypeDouble2D) {
+        nDoubles = 2;
+    } else if ( (t == kOfxParamTypeDouble3D) || (t == kOfxParamTypeRGB) ) {
+        nDoubles = 3;
+    } else if (t == kOfxParamTypeRGBA) {
+        nDoubles = 4;
+    } else if ( (t == kOfxParamTypeString) || (t == kOfxParamTypeCustom)
+#ifdef kOfxParamTypeStrChoice
+                || (t == kOfxParamTypeStrChoice)
+#endif
+                ) {
+        param->hasString = true;
+    }
+    param->ints.resize(nInts);
+    for (int i = 0; i < nInts; ++i) {
+        param->ints[i] = param->props.getInt(kOfxParamPropDefault, i);
+    }
+    param->doubles.resize(nDoubles);
+    for (int i = 0; i < nDoubles; ++i) {
+        param->doubles[i] = param->props.getDouble(kOfxParamPropDefault, i);
+    }
+    if (param->hasString) {
+        param->str = param->props.getString(kOfxParamPropDefault);
+    }
+}
+
+OfxStatus
+paramDefine(OfxParamSetHandle paramSet,
+            const char* paramType,
+            const char* name,
+            OfxPropertySetHandle* propertySet)
+{
+    if (!paramSet || !paramType || !name) {
+        return kOfxStatErrBadHandle;
+    }
+    std::unique_ptr<Param>& param = toEffect(paramSet)->params[name];
+    if (param) {
+        return kOfxStatErrExists;
+    }
+    param.reset(new Param);
+    param->name = name;
+    param->type = paramType;
+    param->props.setString(kOfxPropType, kOfxTypeParameter);
+    param->props.setString(kOfxPropName, name);
+    param->props.setString(kOfxPropLabel, name);
+    param->props.setString(kOfxParamPropScriptName, name);
+    param->props.setString(kOfxParamPropType, paramType);
+    initParamValue( param.get() );
+    // the default of the right type, which the plugin may then set
+    for (size_t i = 0; i < param->ints.size(); ++i) {
+        param->props.setInt(kOfxParamPropDefault, 0, (int)i);
+    }
+    for (size_t i = 0; i < param->doubles.size(); ++i) {
+        param->props.setDouble(kOfxParamPropDefault, 0., (int)i);
+    }
+    if (param->hasString) {
+        param->props.setString(kOfxParamPropDefault, "");
+    }
+    if (propertySet) {
+        *propertySet = toHandle(&param->props);
+    }
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+paramGetHandle(OfxParamSetHandle paramSet,
+               const char* name,
+               OfxParamHandle* param,
+               OfxPropertySetHandle* propertySet)
+{
+    if (!paramSet || !name || !param) {
+        return kOfxStatErrBadHandle;
+    }
+    std::map<string, std::unique_ptr<Param> >::iterator found = toEffect(paramSet)->params.find(name);
+    if ( found == toEffect(paramSet)->params.end() ) {
+        return kOfxStatErrUnknown;
+    }
+    *param = reinterpret_cast<OfxParamHandle>( found->second.get() );
+    if (propertySet) {
+        *propertySet = toHandle(&found->second->props);
+    }
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+paramSetGetPropertySet(OfxParamSetHandle paramSet,
+                       OfxPropertySetHandle* propHandle)
+{
+    if (!paramSet || !propHandle) {
+        return kOfxStatErrBadHandle;
+    }
+    *propHandle = toHandle(&toEffect(paramSet)->paramSetProps);
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+paramGetPropertySet(OfxParamHandle param,
+                    OfxPropertySetHandle* propHandle)
+{
+    if (!param || !propHandle) {
+        return kOfxStatErrBadHandle;
+    }
+    *propHandle = toHandle(&toParam(param)->props);
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+getParamValue(Param* param,
+              va_list ap)
+{
+    for (size_t i = 0; i < param->ints.size(); ++i) {
+        int* value = va_arg(ap, int*);
+        *value = param->ints[i];
+    }
+    for (size_t i = 0; i < param->doubles.size(); ++i) {
+        double* value = va_arg(ap, double*);
+        *value = param->doubles[i];
+    }
+    if (param->hasString) {
+        const char** value = va_arg(ap, const char**);
+        *value = param->str.c_str();
+    }
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+setParamValue(Param* param,
+              va_list ap)
+{
+    for (size_t i = 0; i < param->ints.size(); ++i) {
+        param->ints[i] = va_arg(ap, int);
+    }
+    for (size_t i = 0; i < param->doubles.size(); ++i) {
+        param->doubles[i] = va_arg(ap, double);
+    }
+    if (param->hasString) {
+        const char* value = va_arg(ap, const char*);
+        param->str = value ? value : "";
+    }
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+paramGetValue(OfxParamHandle paramHandle,
+              ...)
+{
+    if (!paramHandle) {
+        return kOfxStatErrBadHandle;
+    }
+    va_list ap;
+    va_start(ap, paramHandle);
+    OfxStatus stat = getParamValue(toParam(paramHandle), ap);
+    va_end(ap);
+
+    return stat;
+}
+
+// parameters are not animated: the value is the same at any time
+OfxStatus
+paramGetValueAtTime(OfxParamHandle paramHandle,
+                    OfxTime time,
+                    ...)
+{
+    if (!paramHandle) {
+        return kOfxStatErrBadHandle;
+    }
+    va_list ap;
+    va_start(ap, time);
+    OfxStatus stat = getParamValue(toParam(paramHandle), ap);
+    va_end(ap);
+
+    return stat;
+}
+
+OfxStatus
+paramGetDerivative(OfxParamHandle paramHandle,
+                   OfxTime time,
+                   ...)
+{
+    if (!paramHandle) {
+        return kOfxStatErrBadHandle;
+    }
+    va_list ap;
+    va_start(ap, time);
+    for (size_t i = 0; i < toParam(paramHandle)->doubles.size(); ++i) {
+        double* value = va_arg(ap, double*);
+        *value = 0.;
+    }
+    va_end(ap);
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+paramGetIntegral(OfxParamHandle paramHandle,
+                 OfxTime time1,
+                 OfxTime time2,
+                 ...)
+{
+    if (!paramHandle) {
+        return kOfxStatErrBadHandle;
+    }
+    va_list ap;
+    va_start(ap, time2);
+    for (size_t i = 0; i < toParam(paramHandle)->doubles.size(); ++i) {
+        double* value = va_arg(ap, double*);
+        *value = toParam(paramHandle)->doubles[i] * (time2 - time1);
+    }
+    va_end(ap);
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+paramSetValue(OfxParamHandle paramHandle,
+              ...)
+{
+    if (!paramHandle) {
+        return kOfxStatErrBadHandle;
+    }
+    va_list ap;
+    va_start(ap, paramHandle);
+    OfxStatus stat = setParamValue(toParam(paramHandle), ap);
+    va_end(ap);
+
+    return stat;
+}
+
+OfxStatus
+paramSetValueAtTime(OfxParamHandle paramHandle,
+                    OfxTime time,
+                    ...)
+{
+    if (!paramHandle) {
+        return kOfxStatErrBadHandle;
+    }
+    va_list ap;
+    va_start(ap, time);
+    OfxStatus stat = setParamValue(toParam(paramHandle), ap);
+    va_end(ap);
+
+    return stat;
+}
+
+OfxStatus
+paramGetNumKeys(OfxParamHandle paramHandle,
+                unsigned int* numberOfKeys)
+{
+    if (!paramHandle || !numberOfKeys) {
+        return kOfxStatErrBadHandle;
+    }
+    *numberOfKeys = 0;
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+paramGetKeyTime(OfxParamHandle /*paramHandle*/,
+                unsigned int /*nthKey*/,
+                OfxTime* /*time*/)
+{
+    return kOfxStatErrBadIndex;
+}
+
+OfxStatus
+paramGetKeyIndex(OfxParamHandle /*paramHandle*/,
+                 OfxTime /*time*/,
+                 int /*direction*/,
+                 int* /*index*/)
+{
+    return kOfxStatFailed;
+}
+
+OfxStatus
+paramDeleteKey(OfxParamHandle /*paramHandle*/,
+               OfxTime /*time*/)
+{
+    return kOfxStatErrBadIndex;
+}
+
+OfxStatus
+paramDeleteAllKeys(OfxParamHandle /*paramHandle*/)
+{
+    return kOfxStatOK;
+}
+
+OfxStatus
+paramCopy(OfxParamHandle paramTo,
+          OfxParamHandle paramFrom,
+          OfxTime /*dstOffset*/,
+          const OfxRangeD* /*frameRange*/)
+{
+    if (!paramTo || !paramFrom) {
+        return kOfxStatErrBadHandle;
+    }
+    Param* to = toParam(paramTo);
+    const Param* from = toParam(paramFrom);
+    if (to->type != from->type) {
+        return kOfxStatErrValue;
+    }
+    to->ints = from->ints;
+    to->doubles = from->doubles;
+    to->str = from->str;
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+paramEditBegin(OfxParamSetHandle /*paramSet*/,
+               const char* /*name*/)
+{
+    return kOfxStatOK;
+}
+
+OfxStatus
+paramEditEnd(OfxParamSetHandle /*paramSet*/)
+{
+    return kOfxStatOK;
+}
+
+// image effect suite
+
+OfxStatus
+getPropertySet(OfxImageEffectHandle imageEffect,
+               OfxPropertySetHandle* propHandle)
+{
+    if (!imageEffect || !propHandle) {
+        return kOfxStatErrBadHandle;
+    }
+    *propHandle = toHandle(&toEffect(imageEffect)->props);
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+getParamSet(OfxImageEffectHandle imageEffect,
+            OfxParamSetHandle* paramSet)
+{
+    if (!imageEffect || !paramSet) {
+        return kOfxStatErrBadHandle;
+    }
+    *paramSet = reinterpret_cast<OfxParamSetHandle>(imageEffect);
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+clipDefine(OfxImageEffectHandle imageEffect,
+           const char* name,
+           OfxPropertySetHandle* propertySet)
+{
+    if (!imageEffect || !name) {
+        return kOfxStatErrBadHandle;
+    }
+    std::unique_ptr<Clip>& clip = toEffect(imageEffect)->clips[name];
+    if (!clip) {
+        clip.reset(new Clip);
+        clip->name = name;
+        clip->effect = toEffect(imageEffect);
+        clip->props.setString(kOfxPropType, kOfxTypeClip);
+        clip->props.setString(kOfxPropName, name);
+    }
+    if (propertySet) {
+        *propertySet = toHandle(&clip->props);
+    }
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+clipGetHandle(OfxImageEffectHandle imageEffect,
+              const char* name,
+              OfxImageClipHandle* clip,
+              OfxPropertySetHandle* propertySet)
+{
+    if (!imageEffect || !name || !clip) {
+        return kOfxStatErrBadHandle;
+    }
+    std::map<string, std::unique_ptr<Clip> >::iterator found = toEffect(imageEffect)->clips.find(name);
+    if ( found == toEffect(imageEffect)->clips.end() ) {
+        return kOfxStatErrBadHandle;
+    }
+    *clip = reinterpret_cast<OfxImageClipHandle>( found->second.get() );
+    if (propertySet) {
+        *propertySet = toHandle(&found->second->props);
+    }
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+clipGetPropertySet(OfxImageClipHandle clip,
+                   OfxPropertySetHandle* propHandle)
+{
+    if (!clip || !propHandle) {
+        return kOfxStatErrBadHandle;
+    }
+    *propHandle = toHandle(&toClip(clip)->props);
+
+    return kOfxStatOK;
+}
+
+int
+componentsCount(const string& components)
+{
+    if (components == kOfxImageComponentRGBA) {
+        return 4;
+    } else if (components == kOfxImageComponentRGB) {
+        return 3;
+    } else if (components == kOfxImageComponentAlpha) {
+        return 1;
+    }
+
+    return 0;
+}
+
+int
+depthBytes(const string& depth)
+{
+    if (depth == kOfxBitDepthByte) {
+        return 1;
+    } else if ( (depth == kOfxBitDepthShort) || (depth == kOfxBitDepthHalf) ) {
+        return 2;
+    } else if (depth == kOfxBitDepthFloat) {
+        return 4;
+    }
+
+    return 0;
+}
+
+// The whole region of definition is rendered at scale 1: the images cover the region of definition of the clip.
+OfxStatus
+clipGetImage(OfxImageClipHandle clipHandle,
+             OfxTime time,
+             const OfxRectD* /*region*/,
+             OfxPropertySetHandle* imageHandle)
+{
+    if (!clipHandle || !imageHandle) {
+        return kOfxStatErrBadHandle;
+    }
+    Clip* clip = toClip(clipHandle);
+    if ( !clip->props.getInt(kOfxImageClipPropConnected) ) {
+        return kOfxStatFailed;
+    }
+    const string components = clip->props.getString(kOfxImageEffectPropComponents);
+    const string depth = clip->props.getString(kOfxImageEffectPropPixelDepth);
+    const int x1 = (int)std::floor(clip->rod.x1);
+    const int y1 = (int)std::floor(clip->rod.y1);
+    const int x2 = (int)std::ceil(clip->rod.x2);
+    const int y2 = (int)std::ceil(clip->rod.y2);
+    const int rowBytes = (x2 - x1) * componentsCount(components) * depthBytes(depth);
+    std::unique_ptr<Image> image(new Image);
+    void* data;
+
+    if ( !clip->synthetic.empty() ) {
+        data = &clip->synthetic[0];
+    } else {
+        image->buffer.resize( (size_t)rowBytes * (y2 - y1) );
+        data = image->buffer.empty() ? NULL : &image->buffer[0];
+    }
+    std::ostringstream uid;
+    uid << clip->name << '@' << time;
+    image->setString(kOfxPropType, kOfxTypeImage);
+    image->setPointer(kOfxImagePropData, data);
+    image->setString(kOfxImageEffectPropComponents, components);
+    image->setString(kOfxImageEffectPropPixelDepth, depth);
+    image->setString( kOfxImageEffectPropPreMultiplication, clip->props.getString(kOfxImageEffectPropPreMultiplication) );
+    image->setDouble(kOfxImageEffectPropRenderScale, 1., 0);
+    image->setDouble(kOfxImageEffectPropRenderScale, 1., 1);
+    image->setDouble(kOfxImagePropPixelAspectRatio, 1.);
+    image->setInt(kOfxImagePropBounds, x1, 0);
+    image->setInt(kOfxImagePropBounds, y1, 1);
+    image->setInt(kOfxImagePropBounds, x2, 2);
+    image->setInt(kOfxImagePropBounds, y2, 3);
+    image->setInt(kOfxImagePropRegionOfDefinition, x1, 0);
+    image->setInt(kOfxImagePropRegionOfDefinition, y1, 1);
+    image->setInt(kOfxImagePropRegionOfDefinition, x2, 2);
+    image->setInt(kOfxImagePropRegionOfDefinition, y2, 3);
+    image->setInt(kOfxImagePropRowBytes, rowBytes);
+    image->setString(kOfxImagePropField, kOfxImageFieldNone);
+    image->setString( kOfxImagePropUniqueIdentifier, uid.str() );
+    {
+        std::lock_guard<std::mutex> guard(gImagesLock);
+        gImages.insert( image.get() );
+    }
+    *imageHandle = toHandle( image.release() );
+
+    return kOfxStatOK;
+} // clipGetImage
+
+OfxStatus
+clipReleaseImage(OfxPropertySetHandle imageHandle)
+{
+    Image* image = static_cast<Image*>( toProps(imageHandle) );
+    {
+        std::lock_guard<std::mutex> guard(gImagesLock);
+        if ( gImages.erase(image) == 0 ) {
+            return kOfxStatErrBadHandle;
+        }
+    }
+    delete image;
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+clipGetRegionOfDefinition(OfxImageClipHandle clip,
+                          OfxTime /*time*/,
+                          OfxRectD* bounds)
+{
+    if (!clip || !bounds) {
+        return kOfxStatErrBadHandle;
+    }
+    *bounds = toClip(clip)->rod;
+
+    return kOfxStatOK;
+}
+
+int
+abortEffect(OfxImageEffectHandle /*imageEffect*/)
+{
+    return 0;
+}
+
+OfxStatus
+imageMemoryAlloc(OfxImageEffectHandle /*instanceHandle*/,
+                 size_t nBytes,
+                 OfxImageMemoryHandle* memoryHandle)
+{
+    if (!memoryHandle) {
+        return kOfxStatErrBadHandle;
+    }
+    ImageMemory* memory = new ImageMemory;
+    try {
+        memory->buffer.resize(nBytes);
+    } catch (const std::bad_alloc&) {
+        delete memory;
+
+        return kOfxStatErrMemory;
+    }
+    *memoryHandle = reinterpret_cast<OfxImageMemoryHandle>(memory);
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+imageMemoryFree(OfxImageMemoryHandle memoryHandle)
+{
+    delete reinterpret_cast<ImageMemory*>(memoryHandle);
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+imageMemoryLock(OfxImageMemoryHandle memoryHandle,
+                void** returnedPtr)
+{
+    if (!memoryHandle || !returnedPtr) {
+        return kOfxStatErrBadHandle;
+    }
+    vector<unsigned char>& buffer = reinterpret_cast<ImageMemory*>(memoryHandle)->buffer;
+    *returnedPtr = buffer.empty() ? NULL : &buffer[0];
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+imageMemoryUnlock(OfxImageMemoryHandle /*memoryHandle*/)
+{
+    return kOfxStatOK;
+}
+
+// memory suite
+
+OfxStatus
+memoryAlloc(void* /*handle*/,
+            size_t nBytes,
+            void** allocatedData)
+{
+    if (!allocatedData) {
+        return kOfxStatErrBadHandle;
+    }
+    *allocatedData = std::malloc(nBytes);
+
+    return *allocatedData ? kOfxStatOK : kOfxStatErrMemory;
+}
+
+OfxStatus
+memoryFree(void* allocatedData)
+{
+    std::free(allocatedData);
+
+    return kOfxStatOK;
+}
+
+// multi-thread suite
+
+unsigned int
+numCPUs()
+{
+    return (std::max)(1u, std::thread::hardware_concurrency());
+}
+
+OfxStatus
+multiThread(OfxThreadFunctionV1 func,
+            unsigned int nThreads,
+            void* customArg)
+{
+    if (!func) {
+        return kOfxStatFailed;
+    }
+    if (nThreads == 0) {
+        nThreads = numCPUs();
+    }
+    vector<std::thread> threads;
+    for (unsigned int i = 1; i < nThreads; ++i) {
+        threads.push_back( std::thread([func, i, nThreads, customArg]() {
+            gThreadIndex = i;
+            gThreadIsSpawned = true;
+            func(i, nThreads, customArg);
+        }) );
+    }
+    // the calling thread runs the first one
+    const bool wasSpawned = gThreadIsSpawned;
+    const unsigned int index = gThreadIndex;
+    gThreadIndex = 0;
+    gThreadIsSpawned = true;
+    func(0, nThreads, customArg);
+    gThreadIndex = index;
+    gThreadIsSpawned = wasSpawned;
+    for (size_t i = 0; i < threads.size(); ++i) {
+        threads[i].join();
+    }
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+multiThreadNumCPUs(unsigned int* nCPUs)
+{
+    if (!nCPUs) {
+        return kOfxStatErrBadHandle;
+    }
+    *nCPUs = numCPUs();
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+multiThreadIndex(unsigned int* threadIndex)
+{
+    if (!threadIndex) {
+        return kOfxStatErrBadHandle;
+    }
+    *threadIndex = gThreadIsSpawned ? gThreadIndex : 0;
+
+    return kOfxStatOK;
+}
+
+int
+multiThreadIsSpawnedThread(void)
+{
+    return gThreadIsSpawned;
+}
+
+inline std::recursive_mutex*
+toMutex(OfxMutexHandle mutex)
+{
+    return reinterpret_cast<std::recursive_mutex*>(mutex);
+}
+
+OfxStatus
+mutexCreate(OfxMutexHandle* mutex,
+            int lockCount)
+{
+    if (!mutex) {
+        return kOfxStatErrBadHandle;
+    }
+    std::recursive_mutex* m = new std::recursive_mutex;
+    for (int i = 0; i < lockCount; ++i) {
+        m->lock();
+    }
+    *mutex = reinterpret_cast<OfxMutexHandle>(m);
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+mutexDestroy(const OfxMutexHandle mutex)
+{
+    delete toMutex(mutex);
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+mutexLock(const OfxMutexHandle mutex)
+{
+    if (!mutex) {
+        return kOfxStatErrBadHandle;
+    }
+    toMutex(mutex)->lock();
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+mutexUnLock(const OfxMutexHandle mutex)
+{
+    if (!mutex) {
+        return kOfxStatErrBadHandle;
+    }
+    toMutex(mutex)->unlock();
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+mutexTryLock(const OfxMutexHandle mutex)
+{
+    if (!mutex) {
+        return kOfxStatErrBadHandle;
+    }
+
+    return toMutex(mutex)->try_lock() ? kOfxStatOK : kOfxStatFailed;
+}
+
+// message suite
+
+void
+recordMessage(const char* messageType,
+              const char* format,
+              va_list ap)
+{
+    va_list apCopy;
+    va_copy(apCopy, ap);
+    const int size = std::vsnprintf(NULL, 0, format, apCopy);
+    va_end(apCopy);
+    if (size < 0) {
+        return;
+    }
+    vector<char> text(size + 1);
+    std::vsnprintf(&text[0], text.size(), format, ap);
+    string message = messageType ? messageType : "";
+    message += ": ";
+    message += &text[0];
+    std::lock_guard<std::mutex> guard(gMessagesLock);
+    gMessages.push_back(message);
+}
+
+OfxStatus
+message(void* /*handle*/,
+        const char* messageType,
+        const char* /*messageId*/,
+        const char* format,
+        ...)
+{
+    if (!format) {
+        return kOfxStatErrBadHandle;
+    }
+    va_list ap;
+    va_start(ap, format);
+    recordMessage(messageType, format, ap);
+    va_end(ap);
+    if ( messageType && (std::strcmp(messageType, kOfxMessageQuestion) == 0) ) {
+        return kOfxStatReplyYes;
+    }
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+setPersistentMessage(void* /*handle*/,
+                     const char* messageType,
+                     const char* /*messageId*/,
+                     const char* format,
+                     ...)
+{
+    if (!format) {
+        return kOfxStatErrBadHandle;
+    }
+    va_list ap;
+    va_start(ap, format);
+    recordMessage(messageType, format, ap);
+    va_end(ap);
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+clearPersistentMessage(void* /*handle*/)
+{
+    return kOfxStatOK;
+}
+
+// interact suite: there is no viewer
+
+OfxStatus
+interactSwapBuffers(OfxInteractHandle /*interactInstance*/)
+{
+    return kOfxStatOK;
+}
+
+OfxStatus
+interactRedraw(OfxInteractHandle /*interactInstance*/)
+{
+    return kOfxStatOK;
+}
+
+OfxStatus
+interactGetPropertySet(OfxInteractHandle /*interactInstance*/,
+                       OfxPropertySetHandle* /*property*/)
+{
+    return kOfxStatErrBadHandle;
+}
+
+// timeline suite: the timeline covers the frames that are rendered
+
+double gTimeLineFirst = 1.;
+double gTimeLineLast = 1.;
+double gTimeLineTime = 1.;
+
+OfxStatus
+getTime(void* /*instance*/,
+        double* time)
+{
+    if (!time) {
+        return kOfxStatErrBadHandle;
+    }
+    *time = gTimeLineTime;
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+gotoTime(void* /*instance*/,
+         double time)
+{
+    gTimeLineTime = time;
+
+    return kOfxStatOK;
+}
+
+OfxStatus
+getTimeBounds(void* /*instance*/,
+              double* firstTime,
+              double* lastTime)
+{
+    if (!firstTime || !lastTime) {
+        return kOfxStatErrBadHandle;
+    }
+    *firstTime = gTimeLineFirst;
+    *lastTime = gTimeLineLast;
+
+    return kOfxStatOK;
+}
+
+OfxPropertySuiteV1 gPropertySuite;
+OfxParameterSuiteV1 gParameterSuite;
+OfxImageEffectSuiteV1 gImageEffectSuite;
+OfxMemorySuiteV1 gMemorySuite;
+OfxMultiThreadSuiteV1 gMultiThreadSuite;
+OfxMessageSuiteV1 gMessageSuiteV1;
+OfxMessageSuiteV2 gMessageSuiteV2;
+OfxInteractSuiteV1 gInteractSuite;
+OfxTimeLineSuiteV1 gTimeLineSuite;
+
+const void*
+fetchSuite(OfxPropertySetHandle /*host*/,
+           const char* suiteName,
+           int suiteVersion)
+{
+    if (!suiteName) {
+        return NULL;
+    }
+    const string name = suiteName;
+    if ( (name == kOfxPropertySuite) && (suiteVersion == 1) ) {
+        return &gPropertySuite;
+    } else if ( (name == kOfxParameterSuite) && (suiteVersion == 1) ) {
+        return &gParameterSuite;
+    } else if ( (name == kOfxImageEffectSuite) && (suiteVersion == 1) ) {
+        return &gImageEffectSuite;
+    } else if ( (name == kOfxMemorySuite) && (suiteVersion == 1) ) {
+        return &gMemorySuite;
+    } else if ( (name == kOfxMultiThreadSuite) && (suiteVersion == 1) ) {
+        return &gMultiThreadSuite;
+    } else if ( (name == kOfxMessageSuite) && (suiteVersion == 1) ) {
+        return &gMessageSuiteV1;
+    } else if ( (name == kOfxMessageSuite) && (suiteVersion == 2) ) {
+        return &gMessageSuiteV2;
+    } else if ( (name == kOfxInteractSuite) && (suiteVersion == 1) ) {
+        return &gInteractSuite;
+    } else if ( (name == kOfxTimeLineSuite) && (suiteVersion == 1) ) {
+        return &gTimeLineSuite;
+    }
+
+    return NULL;
+}
+
+void
+initHost()
+{
+    gPropertySuite.propSetPointer = propSetPointer;
+    gPropertySuite.propSetString = propSetString;
+    gPropertySuite.propSetDouble = propSetDouble;
+    gPropertySuite.propSetInt = propSetInt;
+    gPropertySuite.propSetPointerN = propSetPointerN;
+    gPropertySuite.propSetStringN = propSetStringN;
+    gPropertySuite.propSetDoubleN = propSetDoubleN;
+    gPropertySuite.propSetIntN = propSetIntN;
+    gPropertySuite.propGetPointer = propGetPointer;
+    gPropertySuite.propGetString = propGetString;
+    gPropertySuite.propGetDouble = propGetDouble;
+    gPropertySuite.propGetInt = propGetInt;
+    gPropertySuite.propGetPointerN = propGetPointerN;
+    gPropertySuite.propGetStringN = propGetStringN;
+    gPropertySuite.propGetDoubleN = propGetDoubleN;
+    gPropertySuite.propGetIntN = propGetIntN;
+    gPropertySuite.propReset = propReset;
+    gPropertySuite.propGetDimension = propGetDimension;
+
+    gParameterSuite.paramDefine = paramDefine;
+    gParameterSuite.paramGetHandle = paramGetHandle;
+    gParameterSuite.paramSetGetPropertySet = paramSetGetPropertySet;
+    gParameterSuite.paramGetPropertySet = paramGetPropertySet;
+    gParameterSuite.paramGetValue = paramGetValue;
+    gParameterSuite.paramGetValueAtTime = paramGetValueAtTime;
+    gParameterSuite.paramGetDerivative = paramGetDerivative;
+    gParameterSuite.paramGetIntegral = paramGetIntegral;
+    gParameterSuite.paramSetValue = paramSetValue;
+    gParameterSuite.paramSetValueAtTime = paramSetValueAtTime;
+    gParameterSuite.paramGetNumKeys = paramGetNumKeys;
+    gParameterSuite.paramGetKeyTime = paramGetKeyTime;
+    gParameterSuite.paramGetKeyIndex = paramGetKeyIndex;
+    gParameterSuite.paramDeleteKey = paramDeleteKey;
+    gParameterSuite.paramDeleteAllKeys = paramDeleteAllKeys;
+    gParameterSuite.paramCopy = paramCopy;
+    gParameterSuite.paramEditBegin = paramEditBegin;
+    gParameterSuite.paramEditEnd = paramEditEnd;
+
+    gImageEffectSuite.getPropertySet = getPropertySet;
+    gImageEffectSuite.getParamSet = getParamSet;
+    gImageEffectSuite.clipDefine = clipDefine;
+    gImageEffectSuite.clipGetHandle = clipGetHandle;
+    gImageEffectSuite.clipGetPropertySet = clipGetPropertySet;
+    gImageEffectSuite.clipGetImage = clipGetImage;
+    gImageEffectSuite.clipReleaseImage = clipReleaseImage;
+    gImageEffectSuite.clipGetRegionOfDefinition = clipGetRegionOfDefinition;
+    gImageEffectSuite.abort = abortEffect;
+    gImageEffectSuite.imageMemoryAlloc = imageMemoryAlloc;
+    gImageEffectSuite.imageMemoryFree = imageMemoryFree;
+    gImageEffectSuite.imageMemoryLock = imageMemoryLock;
+    gImageEffectSuite.imageMemoryUnlock = imageMemoryUnlock;
+
+    gMemorySuite.memoryAlloc = memoryAlloc;
+    gMemorySuite.memoryFree = memoryFree;
+
+    gMultiThreadSuite.multiThread = multiThread;
+    gMultiThreadSuite.multiThreadNumCPUs = multiThreadNumCPUs;
+    gMultiThreadSuite.multiThreadIndex = multiThreadIndex;
+    gMultiThreadSuite.multiThreadIsSpawnedThread = multiThreadIsSpawnedThread;
+    gMultiThreadSuite.mutexCreate = mutexCreate;
+    gMultiThreadSuite.mutexDestroy = mutexDestroy;
+    gMultiThreadSuite.mutexLock = mutexLock;
+    gMultiThreadSuite.mutexUnLock = mutexUnLock;
+    gMultiThreadSuite.mutexTryLock = mutexTryLock;
+
+    gMessageSuiteV1.message = message;
+    gMessageSuiteV2.message = message;
+    gMessageSuiteV2.setPersistentMessage = setPersistentMessage;
+    gMessageSuiteV2.clearPersistentMessage = clearPersistentMessage;
+
+    gInteractSuite.interactSwapBuffers = interactSwapBuffers;
+    gInteractSuite.interactRedraw = interactRedraw;
+    gInteractSuite.interactGetPropertySet = interactGetPropertySet;
+
+    gTimeLineSuite.getTime = getTime;
+    gTimeLineSuite.gotoTime = gotoTime;
+    gTimeLineSuite.getTimeBounds = getTimeBounds;
+
+    gHostProps.setString(kOfxPropType, kOfxTypeImageEffectHost);
+    gHostProps.setString(kOfxPropName, kBenchmarkHostName);
+    gHostProps.setString(kOfxPropLabel, kBenchmarkHostLabel);
+    gHostProps.setInt(kOfxPropAPIVersion, 1, 0);
+    gHostProps.setInt(kOfxPropAPIVersion, 4, 1);
+    gHostProps.setInt(kOfxPropVersion, 1, 0);
+    gHostProps.setString(kOfxPropVersionLabel, "1.0");
+    gHostProps.setInt(kOfxImageEffectHostPropIsBackground, 1);
+    gHostProps.setInt(kOfxImageEffectPropSupportsOverlays, 0);
+    gHostProps.setInt(kOfxImageEffectPropSupportsMultiResolution, 1);
+    gHostProps.setInt(kOfxImageEffectPropSupportsTiles, 0);
+    gHostProps.setInt(kOfxImageEffectPropTemporalClipAccess, 0);
+    gHostProps.setInt(kOfxImageEffectPropSupportsMultipleClipDepths, 1);
+    gHostProps.setInt(kOfxImageEffectPropSupportsMultipleClipPARs, 0);
+    gHostProps.setInt(kOfxImageEffectPropSetableFrameRate, 0);
+    gHostProps.setInt(kOfxImageEffectPropSetableFielding, 0);
+    gHostProps.setString(kOfxImageEffectPropSupportedComponents, kOfxImageComponentRGBA, 0);
+    gHostProps.setString(kOfxImageEffectPropSupportedComponents, kOfxImageComponentRGB, 1);
+    gHostProps.setString(kOfxImageEffectPropSupportedComponents, kOfxImageComponentAlpha, 2);
+    gHostProps.setString(kOfxImageEffectPropSupportedContexts, kOfxImageEffectContextReader, 0);
+    gHostProps.setString(kOfxImageEffectPropSupportedContexts, kOfxImageEffectContextWriter, 1);
+    gHostProps.setString(kOfxImageEffectPropSupportedContexts, kOfxImageEffectContextFilter, 2);
+    gHostProps.setString(kOfxImageEffectPropSupportedContexts, kOfxImageEffectContextGeneral, 3);
+    gHostProps.setString(kOfxImageEffectPropSupportedContexts, kOfxImageEffectContextGenerator, 4);
+    gHostProps.setString(kOfxImageEffectPropSupportedPixelDepths, kOfxBitDepthFloat, 0);
+    gHostProps.setString(kOfxImageEffectPropSupportedPixelDepths, kOfxBitDepthShort, 1);
+    gHostProps.setString(kOfxImageEffectPropSupportedPixelDepths, kOfxBitDepthByte, 2);
+    gHostProps.setInt(kOfxParamHostPropSupportsCustomInteract, 0);
+    gHostProps.setInt(kOfxParamHostPropSupportsStringAnimation, 0);
+    gHostProps.setInt(kOfxParamHostPropSupportsChoiceAnimation, 0);
+    gHostProps.setInt(kOfxParamHostPropSupportsBooleanAnimation, 0);
+    gHostProps.setInt(kOfxParamHostPropSupportsCustomAnimation, 0);
+    gHostProps.setInt(kOfxParamHostPropMaxParameters, -1);
+    gHostProps.setInt(kOfxParamHostPropMaxPages, 0);
+    gHostProps.setInt(kOfxParamHostPropPageRowColumnCount, 0, 0);
+    gHostProps.setInt(kOfxParamHostPropPageRowColumnCount, 0, 1);
+
+    gHost.host = toHandle(&gHostProps);
+    gHost.fetchSuite = fetchSuite;
+} // initHost
+
+// the benchmark
+
+struct Options
+{
+    Options()
+        : bundle()
+        , pluginId()
+        , context()
+        , file()
+        , width(1920)
+        , height(1080)
+        , components(kOfxImageComponentRGBA)
+        , depth(kOfxBitDepthFloat)
+        , first(1)
+        , last(10)
+        , params()
+        , list(false)
+    {
+#ifdef IOBENCHMARK_DEFAULT_BUNDLE
+        bundle = IOBENCHMARK_DEFAULT_BUNDLE;
+#endif
+    }
+
+    string bundle;
+    string pluginId;
+    string context;
+    string file;
+    int width;
+    int height;
+    string components;
+    string depth;
+    int first;
+    int last;
+    vector<std::pair<string, string> > params;
+    bool list;
+};
+
+// the time spent in each stage of the benchmark, in seconds
+class Stages
+{
+public:
+    Stages()
+        : _stages()
+    {
+    }
+
+    void add(const string& name,
+             std::chrono::steady_clock::time_point start)
+    {
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        for (size_t i = 0; i < _stages.size(); ++i) {
+            if (_stages[i].first == name) {
+                _stages[i].second += seconds;
+
+                return;
+            }
+        }
+        _stages.push_back( std::make_pair(name, seconds) );
+    }
+
+    void set(const string& name,
+             double seconds)
+    {
+        _stages.push_back( std::make_pair(name, seconds) );
+    }
+
+    const vector<std::pair<string, double> >& get() const { return _stages; }
+
+private:
+    vector<std::pair<string, double> > _stages;
+};
+
+string
+jsonString(const string& s)
+{
+    std::ostringstream oss;
+
+    oss << '"';
+    for (size_t i = 0; i < s.size(); ++i) {
+        const unsigned char c = s[i];
+        switch (c) {
+        case '"':
+            oss << "\\\"";
+            break;
+        case '\\':
+            oss << "\\\\";
+            break;
+        case '\n':
+            oss << "\\n";
+            break;
+        case '\t':
+            oss << "\\t";
+            break;
+        default:
+            if (c < 0x20) {
+                char buf[8];
+                std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+                oss << buf;
+            } else {
+                oss << c;
+            }
+            break;
+        }
+    }
+    oss << '"';
+
+    return oss.str();
+}
+
+vector<string>
+takeMessages()
+{
+    std::lock_guard<std::mutex> guard(gMessagesLock);
+    vector<string> messages;
+
+    messages.swap(gMessages);
+
+    return messages;
+}
+
+// peak resident set size of the process, in MB
+double
+peakRSSMB()
+{
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0.;
+    }
+#ifdef __APPLE__
+    // bytes on macOS
+    return usage.ru_maxrss / (1024. * 1024.);
+#else
+    // kilobytes on Linux and FreeBSD
+
+    return usage.ru_maxrss / 1024.;
+#endif
+}
+
+// Smooth gradients plus a little noise, so that the encoders do not see a flat image.
+template <typename PIX, int maxValue>
+void
+fillSynthetic(vector<unsigned char>* buffer,
+              int width,
+              int height,
+              int nComps)
+{
+    buffer->resize( (size_t)width * height * nComps * sizeof(PIX) );
+    PIX* pix = reinterpret_cast<PIX*>( &(*buffer)[0] );
+    unsigned int seed = 1;
+
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            seed = seed * 1664525u + 1013904223u;
+            const float noise = (seed >> 8) * (0.05f / 16777216.f);
+            const float rgba[4] = {
+                (float)x / width + noise,
+                (float)y / height + noise,
+                0.5f + 0.5f * std::sin(0.01f * (x + y) ) + noise,
+                1.f
+            };
+            for (int c = 0; c < nComps; ++c) {
+                float v = (nComps == 1) ? rgba[0] : rgba[c];
+                if (maxValue != 1) {
+                    v = (std::max)( 0.f, (std::min)(v, 1.f) ) * maxValue + 0.5f;
+                }
+                *pix++ = (PIX)v;
+            }
+        }
+    }
+}
+
+class Benchmark
+{
+public:
+    Benchmark(const Options& options)
+        : _options(options)
+        , _library(NULL)
+        , _getNumberOfPlugins(NULL)
+        , _getPlugin(NULL)
+        , _plugin(NULL)
+        , _descriptor()
+        , _contextDescriptor()
+        , _instance()
+        , _stages()
+        , _context()
+        , _renderWindow()
+        , _frames(0)
+        , _bytesPerFrame(0)
+        , _profile()
+    {
+    }
+
+    // load the plugin binary, and find the plugin
+    void load();
+
+    // list the plugins of the binary
+    void list();
+
+    // render the frames, and print the timings
+    void run();
+
+private:
+    OfxStatus callAction(const char* action,
+                         const void* handle,
+                         PropertySet* inArgs,
+                         PropertySet* outArgs)
+    {
+        return _plugin->mainEntry( action, handle, inArgs ? toHandle(inArgs) : NULL, outArgs ? toHandle(outArgs) : NULL );
+    }
+
+    void check(OfxStatus stat,
+               const char* action)
+    {
+        if ( (stat != kOfxStatOK) && (stat != kOfxStatReplyDefault) ) {
+            std::ostringstream oss;
+            oss << action << " failed (status " << stat << ")";
+            throw std::runtime_error( oss.str() );
+        }
+    }
+
+    OfxImageEffectHandle handle(Effect* effect)
+    {
+        return reinterpret_cast<OfxImageEffectHandle>(effect);
+    }
+
+    bool supports(const Effect& effect,
+                  const char* property,
+                  const string& value) const
+    {
+        for (int i = 0; i < effect.props.getDimension(property); ++i) {
+            if (effect.props.getString(property, i) == value) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void describe();
+
+    void createInstance();
+
+    void setParam(const string& name, const string& value);
+
+    void clipPreferences();
+
+    void regionOfDefinition();
+
+    void render();
+
+    void fetchProfile();
+
+    void destroyInstance();
+
+    void print(const string& status, const string& error);
+
+    typedef int (*GetNumberOfPluginsFunc)(void);
+    typedef OfxPlugin* (*GetPluginFunc)(int nth);
+
+    const Options& _options;
+    void* _library;
+    GetNumberOfPluginsFunc _getNumberOfPlugins;
+    GetPluginFunc _getPlugin;
+    OfxPlugin* _plugin;
+    Effect _descriptor;
+    Effect _contextDescriptor;
+    std::unique_ptr<Effect> _instance;
+    Stages _stages;
+    string _context;
+    OfxRectI _renderWindow;
+    int _frames;
+    size_t _bytesPerFrame;
+    string _profile;
+};
+
+void
+Benchmark::load()
+{
+    _library = dlopen(_options.bundle.c_str(), RTLD_LAZY | RTLD_LOCAL);
+    if (!_library) {
+        const char* error = dlerror();
+        throw std::runtime_error( "cannot load " + _options.bundle + ": " + (error ? error : "") );
+    }
+    _getNumberOfPlugins = (GetNumberOfPluginsFunc)dlsym(_library, "OfxGetNumberOfPlugins");
+    _getPlugin = (GetPluginFunc)dlsym(_library, "OfxGetPlugin");
+    if (!_getNumberOfPlugins || !_getPlugin) {
+        throw std::runtime_error(_options.bundle + " is not an OpenFX plugin binary");
+    }
+}
+
+void
+Benchmark::list()
+{
+    const int n = _getNumberOfPlugins();
+
+    for (int i = 0; i < n; ++i) {
+        const OfxPlugin* plugin = _getPlugin(i);
+        if (plugin) {
+            std::printf("%s %u.%u\n", plugin->pluginIdentifier, plugin->pluginVersionMajor, plugin->pluginVersionMinor);
+        }
+    }
+}
+
+void
+Benchmark::describe()
+{
+    const int n = _getNumberOfPlugins();
+
+    for (int i = 0; i < n; ++i) {
+        OfxPlugin* plugin = _getPlugin(i);
+        // the most recent version of the plugin
+        if ( plugin && (_options.pluginId == plugin->pluginIdentifier) &&
+             ( !_plugin || (plugin->pluginVersionMajor > _plugin->pluginVersionMajor) ) ) {
+            _plugin = plugin;
+        }
+    }
+    if (!_plugin) {
+        throw std::runtime_error("plugin " + _options.pluginId + " not found in " + _options.bundle);
+    }
+    if ( std::strcmp(_plugin->pluginApi, kOfxImageEffectPluginApi) != 0 ) {
+        throw std::runtime_error(_options.pluginId + " is not an image effect");
+    }
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    _plugin->setHost(&gHost);
+    check(callAction(kOfxActionLoad, NULL, NULL, NULL), kOfxActionLoad);
+    _descriptor.props.setString(kOfxPropType, kOfxTypeImageEffect);
+    check(callAction(kOfxActionDescribe, handle(&_descriptor), NULL, NULL), kOfxActionDescribe);
+
+    _context = _options.context;
+    if ( _context.empty() ) {
+        const char* contexts[] = {
+            kOfxImageEffectContextReader, kOfxImageEffectContextWriter, kOfxImageEffectContextFilter,
+            kOfxImageEffectContextGeneral, kOfxImageEffectContextGenerator, NULL
+        };
+        for (int i = 0; contexts[i] && _context.empty(); ++i) {
+            if ( supports(_descriptor, kOfxImageEffectPropSupportedContexts, contexts[i]) ) {
+                _context = contexts[i];
+            }
+        }
+    } else {
+        _context = "OfxImageEffectContext" + string(1, (char)std::toupper(_context[0])) + _context.substr(1);
+    }
+    if ( !supports(_descriptor, kOfxImageEffectPropSupportedContexts, _context) ) {
+        throw std::runtime_error(_options.pluginId + " does not support the " + _context + " context");
+    }
+    _contextDescriptor.props = _descriptor.props;
+    _contextDescriptor.props.setString(kOfxImageEffectPropContext, _context);
+    PropertySet inArgs;
+    inArgs.setString(kOfxImageEffectPropContext, _context);
+    check(callAction(kOfxImageEffectActionDescribeInContext, handle(&_contextDescriptor), &inArgs, NULL), kOfxImageEffectActionDescribeInContext);
+    _stages.add("load", start);
+} // Benchmark::describe
+
+void
+Benchmark::createInstance()
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    _instance.reset(new Effect);
+    Effect* instance = _instance.get();
+    instance->props = _contextDescriptor.props;
+    instance->props.setString(kOfxPropType, kOfxTypeImageEffectInstance);
+    instance->props.setPointer(kOfxPropInstanceData, NULL);
+    instance->props.setDouble(kOfxImageEffectPropProjectSize, _options.width, 0);
+    instance->props.setDouble(kOfxImageEffectPropProjectSize, _options.height, 1);
+    instance->props.setDouble(kOfxImageEffectPropProjectOffset, 0., 0);
+    instance->props.setDouble(kOfxImageEffectPropProjectOffset, 0., 1);
+    instance->props.setDouble(kOfxImageEffectPropProjectExtent, _options.width, 0);
+    instance->props.setDouble(kOfxImageEffectPropProjectExtent, _options.height, 1);
+    instance->props.setDouble(kOfxImageEffectPropProjectPixelAspectRatio, 1.);
+    instance->props.setDouble(kOfxImageEffectInstancePropEffectDuration, _options.last - _options.first + 1);
+    instance->props.setInt(kOfxImageEffectInstancePropSequentialRender, 0);
+    instance->props.setDouble(kOfxImageEffectPropFrameRate, 24.);
+    instance->props.setInt(kOfxPropIsInteractive, 0);
+    instance->paramSetProps = _contextDescriptor.paramSetProps;
+    for (std::map<string, std::unique_ptr<Param> >::const_iterator it = _contextDescriptor.params.begin(); it != _contextDescriptor.params.end(); ++it) {
+        std::unique_ptr<Param>& param = instance->params[it->first];
+        param.reset( new Param(*it->second) );
+        initParamValue( param.get() );
+    }
+    for (std::map<string, std::unique_ptr<Clip> >::const_iterator it = _contextDescriptor.clips.begin(); it != _contextDescriptor.clips.end(); ++it) {
+        std::unique_ptr<Clip>& clip = instance->clips[it->first];
+        clip.reset(new Clip);
+        clip->name = it->first;
+        clip->effect = instance;
+        clip->props = it->second->props;
+        // only the output and the main input are connected
+        const bool connected = (it->first == kOfxImageEffectOutputClipName) ||
+                               ( (it->first == kOfxImageEffectSimpleSourceClipName) && (_context != kOfxImageEffectContextReader) );
+        clip->props.setInt(kOfxImageClipPropConnected, connected);
+        clip->props.setString(kOfxImageEffectPropComponents, _options.components);
+        clip->props.setString(kOfxImageEffectPropPixelDepth, _options.depth);
+        clip->props.setString(kOfxImageClipPropUnmappedComponents, _options.components);
+        clip->props.setString(kOfxImageClipPropUnmappedPixelDepth, _options.depth);
+        clip->props.setString(kOfxImageEffectPropPreMultiplication, _options.components == kOfxImageComponentRGBA ? kOfxImagePreMultiplied : kOfxImageOpaque);
+        clip->props.setDouble(kOfxImagePropPixelAspectRatio, 1.);
+        clip->props.setDouble(kOfxImageEffectPropFrameRate, 24.);
+        clip->props.setDouble(kOfxImageEffectPropUnmappedFrameRate, 24.);
+        clip->props.setDouble(kOfxImageEffectPropFrameRange, _options.first, 0);
+        clip->props.setDouble(kOfxImageEffectPropFrameRange, _options.last, 1);
+        clip->props.setDouble(kOfxImageEffectPropUnmappedFrameRange, _options.first, 0);
+        clip->props.setDouble(kOfxImageEffectPropUnmappedFrameRange, _options.last, 1);
+        clip->props.setString(kOfxImageClipPropFieldOrder, kOfxImageFieldNone);
+        clip->props.setInt(kOfxImageClipPropContinuousSamples, 0);
+        clip->rod.x1 = clip->rod.y1 = 0.;
+        clip->rod.x2 = _options.width;
+        clip->rod.y2 = _options.height;
+    }
+    check(callAction(kOfxActionCreateInstance, handle(instance), NULL, NULL), kOfxActionCreateInstance);
+    _stages.add("createInstance", start);
+} // Benchmark::createInstance
+
+// set a parameter from its text, as if the user had edited it
+void
+Benchmark::setParam(const string& name,
+                    const string& value)
+{
+    std::map<string, std::unique_ptr<Param> >::iterator found = _instance->params.find(name);
+
+    if ( found == _instance->params.end() ) {
+        throw std::runtime_error(_options.pluginId + " has no parameter " + name);
+    }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    Param* param = found->second.get();
+    if (param->hasString) {
+        param->str = value;
+    } else {
+        std::istringstream iss(value);
+        string item;
+        size_t i = 0;
+        while ( std::getline(iss, item, ',') ) {
+            char* end = NULL;
+            const double number = std::strtod(item.c_str(), &end);
+            const bool isNumber = ( end && (end != item.c_str()) && (*end == '\0') );
+            if ( i < param->ints.size() ) {
+                if (isNumber) {
+                    param->ints[i] = (int)number;
+                } else if (param->type == kOfxParamTypeChoice) {
+                    // a choice param may be given by the label of its option
+                    const int nOptions = param->props.getDimension(kOfxParamPropChoiceOption);
+                    int option = 0;
+                    while ( (option < nOptions) && (param->props.getString(kOfxParamPropChoiceOption, option) != item) ) {
+                        ++option;
+                    }
+                    if (option == nOptions) {
+                        throw std::runtime_error("parameter " + name + " has no option " + item);
+                    }
+                    param->ints[i] = option;
+                } else if (param->type == kOfxParamTypeBoolean) {
+                    param->ints[i] = (item == "true");
+                } else {
+                    throw std::runtime_error("invalid value " + item + " for parameter " + name);
+                }
+            } else if ( isNumber && ( i - param->ints.size() < param->doubles.size() ) ) {
+                param->doubles[i - param->ints.size()] = number;
+            } else {
+                throw std::runtime_error("invalid value " + value + " for parameter " + name);
+            }
+            ++i;
+        }
+    }
+
+    PropertySet reasonArgs;
+    reasonArgs.setString(kOfxPropChangeReason, kOfxChangeUserEdited);
+    PropertySet inArgs;
+    inArgs.setString(kOfxPropType, kOfxTypeParameter);
+    inArgs.setString(kOfxPropName, name);
+    inArgs.setString(kOfxPropChangeReason, kOfxChangeUserEdited);
+    inArgs.setDouble(kOfxPropTime, _options.first);
+    inArgs.setDouble(kOfxImageEffectPropRenderScale, 1., 0);
+    inArgs.setDouble(kOfxImageEffectPropRenderScale, 1., 1);
+    check(callAction(kOfxActionBeginInstanceChanged, handle( _instance.get() ), &reasonArgs, NULL), kOfxActionBeginInstanceChanged);
+    check(callAction(kOfxActionInstanceChanged, handle( _instance.get() ), &inArgs, NULL), kOfxActionInstanceChanged);
+    check(callAction(kOfxActionEndInstanceChanged, handle( _instance.get() ), &reasonArgs, NULL), kOfxActionEndInstanceChanged);
+    _stages.add("setParams", start);
+} // Benchmark::setParam
+
+void
+Benchmark::clipPreferences()
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    PropertySet outArgs;
+
+    for (std::map<string, std::unique_ptr<Clip> >::const_iterator it = _instance->clips.begin(); it != _instance->clips.end(); ++it) {
+        outArgs.setString( ("OfxImageClipPropComponents_" + it->first).c_str(), it->second->props.getString(kOfxImageEffectPropComponents) );
+        outArgs.setString( ("OfxImageClipPropDepth_" + it->first).c_str(), it->second->props.getString(kOfxImageEffectPropPixelDepth) );
+        outArgs.setDouble( ("OfxImageClipPropPAR_" + it->first).c_str(), 1. );
+    }
+    outArgs.setString( kOfxImageEffectPropPreMultiplication, _instance->clips[kOfxImageEffectOutputClipName]->props.getString(kOfxImageEffectPropPreMultiplication) );
+    outArgs.setString(kOfxImageClipPropFieldOrder, kOfxImageFieldNone);
+    outArgs.setDouble(kOfxImageEffectPropFrameRate, 24.);
+    outArgs.setInt(kOfxImageClipPropContinuousSamples, 0);
+    outArgs.setInt(kOfxImageEffectFrameVarying, 1);
+    check(callAction(kOfxImageEffectActionGetClipPreferences, handle( _instance.get() ), NULL, &outArgs), kOfxImageEffectActionGetClipPreferences);
+
+    for (std::map<string, std::unique_ptr<Clip> >::const_iterator it = _instance->clips.begin(); it != _instance->clips.end(); ++it) {
+        PropertySet& props = it->second->props;
+        props.setString( kOfxImageEffectPropComponents, outArgs.getString( ("OfxImageClipPropComponents_" + it->first).c_str() ) );
+        props.setString( kOfxImageEffectPropPixelDepth, outArgs.getString( ("OfxImageClipPropDepth_" + it->first).c_str() ) );
+        if (it->first == kOfxImageEffectOutputClipName) {
+            props.setString( kOfxImageEffectPropPreMultiplication, outArgs.getString(kOfxImageEffectPropPreMultiplication) );
+            props.setDouble( kOfxImageEffectPropFrameRate, outArgs.getDouble(kOfxImageEffectPropFrameRate) );
+        }
+        const string depth = props.getString(kOfxImageEffectPropPixelDepth);
+        if ( props.getInt(kOfxImageClipPropConnected) && !supports(*_instance, kOfxImageEffectPropSupportedPixelDepths, depth) ) {
+            throw std::runtime_error(_options.pluginId + " does not support the " + depth + " pixel depth");
+        }
+    }
+
+    // the synthetic input, in the format requested by the plugin
+    std::map<string, std::unique_ptr<Clip> >::iterator source = _instance->clips.find(kOfxImageEffectSimpleSourceClipName);
+    if ( ( source != _instance->clips.end() ) && source->second->props.getInt(kOfxImageClipPropConnected) ) {
+        Clip* clip = source->second.get();
+        const string depth = clip->props.getString(kOfxImageEffectPropPixelDepth);
+        const int nComps = componentsCount( clip->props.getString(kOfxImageEffectPropComponents) );
+        if (depth == kOfxBitDepthByte) {
+            fillSynthetic<unsigned char, 255>(&clip->synthetic, _options.width, _options.height, nComps);
+        } else if (depth == kOfxBitDepthShort) {
+            fillSynthetic<unsigned short, 65535>(&clip->synthetic, _options.width, _options.height, nComps);
+        } else if (depth == kOfxBitDepthFloat) {
+            fillSynthetic<float, 1>(&clip->synthetic, _options.width, _options.height, nComps);
+        } else {
+            throw std::runtime_error("no synthetic input for the " + depth + " pixel depth");
+        }
+    }
+    _stages.add("clipPreferences", start);
+} // Benchmark::clipPreferences
+
+void
+Benchmark::regionOfDefinition()
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    PropertySet inArgs;
+
+    inArgs.setDouble(kOfxPropTime, _options.first);
+    inArgs.setDouble(kOfxImageEffectPropRenderScale, 1., 0);
+    inArgs.setDouble(kOfxImageEffectPropRenderScale, 1., 1);
+    PropertySet outArgs;
+    // the default is the project extent, which is also the size of the synthetic input
+    outArgs.setDouble(kOfxImageEffectPropRegionOfDefinition, 0., 0);
+    outArgs.setDouble(kOfxImageEffectPropRegionOfDefinition, 0., 1);
+    outArgs.setDouble(kOfxImageEffectPropRegionOfDefinition, _options.width, 2);
+    outArgs.setDouble(kOfxImageEffectPropRegionOfDefinition, _options.height, 3);
+    check(callAction(kOfxImageEffectActionGetRegionOfDefinition, handle( _instance.get() ), &inArgs, &outArgs), kOfxImageEffectActionGetRegionOfDefinition);
+
+    Clip* output = _instance->clips[kOfxImageEffectOutputClipName].get();
+    output->rod.x1 = outArgs.getDouble(kOfxImageEffectPropRegionOfDefinition, 0);
+    output->rod.y1 = outArgs.getDouble(kOfxImageEffectPropRegionOfDefinition, 1);
+    output->rod.x2 = outArgs.getDouble(kOfxImageEffectPropRegionOfDefinition, 2);
+    output->rod.y2 = outArgs.getDouble(kOfxImageEffectPropRegionOfDefinition, 3);
+    _renderWindow.x1 = (int)std::floor(output->rod.x1);
+    _renderWindow.y1 = (int)std::floor(output->rod.y1);
+    _renderWindow.x2 = (int)std::ceil(output->rod.x2);
+    _renderWindow.y2 = (int)std::ceil(output->rod.y2);
+    if ( (_renderWindow.x2 <= _renderWindow.x1) || (_renderWindow.y2 <= _renderWindow.y1) ) {
+        throw std::runtime_error("empty region of definition");
+    }
+
+    // the writers are timed on the images they encode, the other plugins on the images they produce
+    const Clip* timed = output;
+    std::map<string, std::unique_ptr<Clip> >::const_iterator source = _instance->clips.find(kOfxImageEffectSimpleSourceClipName);
+    if ( (_context == kOfxImageEffectContextWriter) && ( source != _instance->clips.end() ) ) {
+        timed = source->second.get();
+    }
+    _bytesPerFrame = (size_t)(_renderWindow.x2 - _renderWindow.x1) * (_renderWindow.y2 - _renderWindow.y1) *
+                     componentsCount( timed->props.getString(kOfxImageEffectPropComponents) ) *
+                     depthBytes( timed->props.getString(kOfxImageEffectPropPixelDepth) );
+    _stages.add("regionOfDefinition", start);
+} // Benchmark::regionOfDefinition
+
+void
+Benchmark::render()
+{
+    PropertySet sequenceArgs;
+
+    sequenceArgs.setDouble(kOfxImageEffectPropFrameRange, _options.first, 0);
+    sequenceArgs.setDouble(kOfxImageEffectPropFrameRange, _options.last, 1);
+    sequenceArgs.setDouble(kOfxImageEffectPropFrameStep, 1.);
+    sequenceArgs.setInt(kOfxPropIsInteractive, 0);
+    sequenceArgs.setDouble(kOfxImageEffectPropRenderScale, 1., 0);
+    sequenceArgs.setDouble(kOfxImageEffectPropRenderScale, 1., 1);
+    sequenceArgs.setInt(kOfxImageEffectPropSequentialRenderStatus, 1);
+    sequenceArgs.setInt(kOfxImageEffectPropInteractiveRenderStatus, 0);
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    check(callAction(kOfxImageEffectActionBeginSequenceRender, handle( _instance.get() ), &sequenceArgs, NULL), kOfxImageEffectActionBeginSequenceRender);
+    _stages.add("beginSequenceRender", start);
+
+    double renderMin = 0.;
+    double renderMax = 0.;
+    _frames = 0;
+    for (int frame = _options.first; frame <= _options.last; ++frame) {
+        PropertySet inArgs;
+        inArgs.setDouble(kOfxPropTime, frame);
+        inArgs.setString(kOfxImageEffectPropFieldToRender, kOfxImageFieldNone);
+        inArgs.setInt(kOfxImageEffectPropRenderWindow, _renderWindow.x1, 0);
+        inArgs.setInt(kOfxImageEffectPropRenderWindow, _renderWindow.y1, 1);
+        inArgs.setInt(kOfxImageEffectPropRenderWindow, _renderWindow.x2, 2);
+        inArgs.setInt(kOfxImageEffectPropRenderWindow, _renderWindow.y2, 3);
+        inArgs.setDouble(kOfxImageEffectPropRenderScale, 1., 0);
+        inArgs.setDouble(kOfxImageEffectPropRenderScale, 1., 1);
+        inArgs.setInt(kOfxImageEffectPropSequentialRenderStatus, 1);
+        inArgs.setInt(kOfxImageEffectPropInteractiveRenderStatus, 0);
+        gTimeLineTime = frame;
+
+        start = std::chrono::steady_clock::now();
+        check(callAction(kOfxImageEffectActionRender, handle( _instance.get() ), &inArgs, NULL), kOfxImageEffectActionRender);
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        _stages.add("render", start);
+        renderMin = (_frames == 0) ? seconds : (std::min)(renderMin, seconds);
+        renderMax = (std::max)(renderMax, seconds);
+        ++_frames;
+    }
+    _stages.set("renderMin", renderMin);
+    _stages.set("renderMax", renderMax);
+
+    start = std::chrono::steady_clock::now();
+    check(callAction(kOfxImageEffectActionEndSequenceRender, handle( _instance.get() ), &sequenceArgs, NULL), kOfxImageEffectActionEndSequenceRender);
+    _stages.add("endSequenceRender", start);
+} // Benchmark::render
+
+// the timings of the stages of GenericReader and GenericWriter, if OFX_IO_PROFILE is set
+void
+Benchmark::fetchProfile()
+{
+    std::map<string, std::unique_ptr<Param> >::const_iterator found = _instance->params.find(kParamProfileInfo);
+
+    if ( ( found == _instance->params.end() ) || (found->second->type != kOfxParamTypePushButton) ) {
+        return;
+    }
+    vector<string> messages = takeMessages();
+    setParam(kParamProfileInfo, "");
+    vector<string> profile = takeMessages();
+    for (size_t i = 0; i < profile.size(); ++i) {
+        _profile += profile[i];
+    }
+    std::lock_guard<std::mutex> guard(gMessagesLock);
+    gMessages.insert( gMessages.begin(), messages.begin(), messages.end() );
+}
+
+void
+Benchmark::destroyInstance()
+{
+    if (_instance) {
+        callAction( kOfxActionDestroyInstance, handle( _instance.get() ), NULL, NULL );
+        _instance.reset();
+    }
+    if (_plugin) {
+        callAction(kOfxActionUnload, NULL, NULL, NULL);
+    }
+}
+
+void
+Benchmark::print(const string& status,
+                 const string& error)
+{
+    double renderSeconds = 0.;
+
+    for (size_t i = 0; i < _stages.get().size(); ++i) {
+        if (_stages.get()[i].first == "render") {
+            renderSeconds = _stages.get()[i].second;
+        }
+    }
+    std::ostringstream oss;
+    oss << "{\"plugin\":" << jsonString(_options.pluginId);
+    if (_plugin) {
+        oss << ",\"version\":\"" << _plugin->pluginVersionMajor << '.' << _plugin->pluginVersionMinor << '"';
+    }
+    oss << ",\"context\":" << jsonString(_context);
+    oss << ",\"file\":" << jsonString(_options.file);
+    oss << ",\"width\":" << (_renderWindow.x2 - _renderWindow.x1);
+    oss << ",\"height\":" << (_renderWindow.y2 - _renderWindow.y1);
+    if (_instance) {
+        const PropertySet& output = _instance->clips[kOfxImageEffectOutputClipName]->props;
+        oss << ",\"components\":" << jsonString( output.getString(kOfxImageEffectPropComponents) );
+        oss << ",\"depth\":" << jsonString( output.getString(kOfxImageEffectPropPixelDepth) );
+    }
+    oss << ",\"frames\":" << _frames;
+    oss << ",\"seconds\":" << renderSeconds;
+    oss << ",\"fps\":" << ( (renderSeconds > 0.) ? _frames / renderSeconds : 0. );
+    oss << ",\"MBps\":" << ( (renderSeconds > 0.) ? _frames * (double)_bytesPerFrame / (1024. * 1024.) / renderSeconds : 0. );
+    oss << ",\"peakRSSMB\":" << peakRSSMB();
+    oss << ",\"stages\":{";
+    for (size_t i = 0; i < _stages.get().size(); ++i) {
+        oss << (i ? "," : "") << jsonString(_stages.get()[i].first) << ':' << _stages.get()[i].second;
+    }
+    oss << '}';
+    oss << ",\"profile\":" << jsonString(_profile);
+    oss << ",\"messages\":[";
+    vector<string> messages = takeMessages();
+    for (size_t i = 0; i < messages.size(); ++i) {
+        oss << (i ? "," : "") << jsonString(messages[i]);
+    }
+    oss << ']';
+    oss << ",\"status\":" << jsonString(status);
+    if ( !error.empty() ) {
+        oss << ",\"error\":" << jsonString(error);
+    }
+    oss << '}';
+    std::printf( "%s\n", oss.str().c_str() );
+} // Benchmark::print
+
+void
+Benchmark::run()
+{
+    gTimeLineFirst = gTimeLineTime = _options.first;
+    gTimeLineLast = _options.last;
+    string error;
+    try {
+        describe();
+        createInstance();
+        if ( !_options.file.empty() ) {
+            setParam(kOfxImageEffectFileParamName, _options.file);
+        }
+        for (size_t i = 0; i < _options.params.size(); ++i) {
+            setParam(_options.params[i].first, _options.params[i].second);
+        }
+        clipPreferences();
+        regionOfDefinition();
+        render();
+        fetchProfile();
+    } catch (const std::exception& e) {
+        error = e.what();
+    }
+    print(error.empty() ? "ok" : "failed", error);
+    destroyInstance();
+    if ( !error.empty() ) {
+        throw std::runtime_error(error);
+    }
+}
+
+void
+usage(const char* argv0)
+{
+    std::fprintf(stderr,
+                 "Usage: %s [options] <plugin identifier>\n"
+                 "Render frames with an OpenFX plugin, and print the timings as a JSON object.\n"
+                 "Options:\n"
+                 "  --bundle <file>         the plugin binary%s%s%s\n"
+                 "  --context <context>     reader, writer, filter, general or generator (default: the first one\n"
+                 "                          the plugin supports, in that order)\n"
+                 "  --file <filename>       the file to read or write, e.g. a sequence such as /tmp/bench.####.exr\n"
+                 "  --size <w>x<h>          the size of the synthetic input images (default: 1920x1080)\n"
+                 "  --components <c>        RGBA, RGB or Alpha: the components of the synthetic input (default: RGBA)\n"
+                 "  --depth <d>             byte, short or float: the depth of the synthetic input (default: float)\n"
+                 "  --frames <first>-<last> the frames to render (default: 1-10)\n"
+                 "  --param <name>=<value>  set a parameter, e.g. --param dataType=\"16 bit half\"\n"
+                 "  --list                  list the plugins of the binary\n"
+                 "The OFX_IO_PROFILE environment variable is set, so that the JSON object also holds the timings of the\n"
+                 "stages of the readers and writers. Set OFX_IO_PROFILE=0 to time the renders without profiling.\n",
+                 argv0,
+#ifdef IOBENCHMARK_DEFAULT_BUNDLE
+                 " (default: ", IOBENCHMARK_DEFAULT_BUNDLE, ")"
+#else
+                 "", "", ""
+#endif
+                 );
+}
+
+string
+toComponents(const string& value)
+{
+    if (value == "RGBA") {
+        return kOfxImageComponentRGBA;
+    } else if (value == "RGB") {
+        return kOfxImageComponentRGB;
+    } else if (value == "Alpha") {
+        return kOfxImageComponentAlpha;
+    }
+    throw std::runtime_error("invalid components " + value);
+}
+
+string
+toDepth(const string& value)
+{
+    if (value == "byte") {
+        return kOfxBitDepthByte;
+    } else if (value == "short") {
+        return kOfxBitDepthShort;
+    } else if (value == "float") {
+        return kOfxBitDepthFloat;
+    }
+    throw std::runtime_error("invalid depth " + value);
+}
+
+Options
+parseOptions(int argc,
+             char* argv[])
+{
+    Options options;
+
+    for (int i = 1; i < argc; ++i) {
+        const string arg = argv[i];
+        if (arg == "--list") {
+            options.list = true;
+            continue;
+        }
+        if ( (arg.size() < 2) || (arg.compare(0, 2, "--") != 0) ) {
+            if ( !options.pluginId.empty() ) {
+                throw std::runtime_error("unexpected argument " + arg);
+            }
+            options.pluginId = arg;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            throw std::runtime_error("missing value for " + arg);
+        }
+        const string value = argv[++i];
+        if (arg == "--bundle") {
+            options.bundle = value;
+        } else if (arg == "--context") {
+            options.context = value;
+        } else if (arg == "--file") {
+            options.file = value;
+        } else if (arg == "--size") {
+            if ( (std::sscanf(value.c_str(), "%dx%d", &options.width, &options.height) != 2) || (options.width <= 0) || (options.height <= 0) ) {
+                throw std::runtime_error("invalid size " + value);
+            }
+        } else if (arg == "--components") {
+            options.components = toComponents(value);
+        } else if (arg == "--depth") {
+            options.depth = toDepth(value);
+        } else if (arg == "--frames") {
+            if ( (std::sscanf(value.c_str(), "%d-%d", &options.first, &options.last) != 2) || (options.last < options.first) ) {
+                throw std::runtime_error("invalid frame range " + value);
+            }
+        } else if (arg == "--param") {
+            const size_t equal = value.find('=');
+            if ( (equal == string::npos) || (equal == 0) ) {
+                throw std::runtime_error("invalid parameter " + value);
+            }
+            options.params.push_back( std::make_pair( value.substr(0, equal), value.substr(equal + 1) ) );
+        } else {
+            throw std::runtime_error("unknown option " + arg);
+        }
+    }
+    if ( options.bundle.empty() || (options.pluginId.empty() && !options.list) ) {
+        throw std::runtime_error("missing plugin binary or plugin identifier");
+    }
+
+    return options;
+} // parseOptions
+} // namespace
+
+int
+main(int argc,
+     char* argv[])
+{
+    Options options;
+
+    try {
+        options = parseOptions(argc, argv);
+    } catch (const std::exception& e) {
+        std::fprintf(stderr, "%s: %s\n", argv[0], e.what() );
+        usage(argv[0]);
+
+        return 2;
+    }
+
+    // the profile of the readers and writers is only recorded if this is set before they are loaded
+    setenv("OFX_IO_PROFILE", "1", 0);
+    initHost();
+    try {
+        Benchmark benchmark(options);
+        benchmark.load();
+        if (options.list) {
+            benchmark.list();
+        } else {
+            benchmark.run();
+        }
+    } catch (const std::exception& e) {
+        std::fprintf(stderr, "%s: %s\n", argv[0], e.what() );
+
+        return 1;
+    }
+
+    return 0;
+}
@@ -23,6 +23,11 @@
  */
 
 #include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
 #ifdef DEBUG
 #include <iostream>
 #endif
@@ -47,14 +52,14 @@ GCC_DIAG_OFF(deprecated)
 #include <ImfHeader.h>
 #include <ImfInputFile.h>
 #include <ImfPixelType.h>
+#include <ImfThreading.h>
 GCC_DIAG_ON(deprecated)
 
-#ifdef OFX_IO_MT_EXR
 #include <ofxsMultiThread.h>
-#endif
 
 #include "GenericOCIO.h"
 #include "GenericReader.h"
+#include "IOLRUCache.h"
 
 using namespace OFX;
 using namespace OFX::IO;
@@ -102,7 +107,11 @@ public:
 private:
     virtual bool isVideoStream(const string& /*filename*/) OVERRIDE FINAL { return false; }
 
-    virtual void decode(const string& filename, OfxTime time, int /*view*/, bool isPlayback, const OfxRectI& renderWindow, const OfxPointD& renderScale, float* pixelData, const OfxRectI& bounds, PixelComponentEnum pixelComponents, int pixelComponentCount, int rowBytes) OVERRIDE FINAL;
+    virtual void clearAnyCache() OVERRIDE FINAL;
+
+    virtual string getCacheStatistics() OVERRIDE FINAL;
+
+    virtual void decode(const string& filename, OfxTime time, int /*view*/, bool isPlayback, const OfxRectI& renderWindow, const OfxPointD& renderScale, float* pixelData, const OfxRectI& bounds, PixelComponentEnum pixelComponents, int pixelComponentCount, int rowBytes, FusedColorConversion* colorConversion) OVERRIDE FINAL;
     virtual bool getFrameBounds(const string& /*filename*/, OfxTime time, int view, OfxRectI* bounds, OfxRectI* format, double* par, string* error, int* tile_width, int* tile_height) OVERRIDE FINAL;
 
     /**
@@ -439,20 +448,94 @@ File::~File()
     delete inputfile;
 }
 
+// Rough estimate of the memory used by an open InputFile: the line (or tile) buffers
+// hold compressed and uncompressed data for a block of lines, one per thread.
+static size_t
+estimateFileBytes(const Imf_::Header& header)
+{
+    const Imath::Box2i& dw = header.dataWindow();
+    size_t bytesPerPixel = 0;
+    const Imf_::ChannelList& imfchannels = header.channels();
+    for (Imf_::ChannelList::ConstIterator chan = imfchannels.begin(); chan != imfchannels.end(); ++chan) {
+        bytesPerPixel += (chan.channel().type == Imf_::HALF) ? 2 : 4;
+    }
+    size_t linesPerBlock;
+    switch (header.compression()) {
+    case Imf_::NO_COMPRESSION:
+    case Imf_::RLE_COMPRESSION:
+    case Imf_::ZIPS_COMPRESSION:
+        linesPerBlock = 1;
+        break;
+    case Imf_::ZIP_COMPRESSION:
+    case Imf_::PXR24_COMPRESSION:
+        linesPerBlock = 16;
+        break;
+    case Imf_::PIZ_COMPRESSION:
+    case Imf_::B44_COMPRESSION:
+    case Imf_::B44A_COMPRESSION:
+        linesPerBlock = 32;
+        break;
+    default:
+        // DWAA uses 32 lines, DWAB 256 lines
+        linesPerBlock = 256;
+        break;
+    }
+    size_t nBuffers = (std::max)(1, Imf_::globalThreadCount());
+
+    return sizeof(File) + 2 * nBuffers * linesPerBlock * bytesPerPixel * (size_t)(dw.max.x - dw.min.x + 1);
+}
+
+// maximum number of files kept open when they are not in use
+#define kFileManagerMaxOpenFiles 32
+// maximum estimated memory used by the files kept open when they are not in use
+#define kFileManagerMaxBytes (size_t(512) * 1024 * 1024)
+// files that were not accessed for that many seconds are closed
+#define kFileManagerExpireSeconds 60
+
+// An Exr::File, shared by the FileRefs that read it.
+// Opening a file (which may be slow on network storage) only locks that file, not the whole cache.
+struct OpenFile {
+    OpenFile()
+        : file(NULL)
+        , openLock()
+    {
+    }
+
+    ~OpenFile()
+    {
+        delete file;
+    }
+
+    File* file; // set under openLock, stable once set
+    MultiThread::Mutex openLock;
+};
+
+typedef std::shared_ptr<OpenFile> OpenFilePtr;
+
+// a file is in use while a FileRef holds it: it is never closed
+struct OpenFileInUse {
+    bool operator()(const OpenFilePtr& f) const { return f.use_count() > 1; }
+};
+
 // Keeps track of all Exr::File mapped against file name.
+// Files are kept in a LRU cache, bounded by the number of open files, their estimated memory
+// use, and the time since they were last accessed.
 class FileManager {
-    typedef map<string, File*> FilesMap;
+    typedef IO::LRUCache<string, OpenFilePtr, OpenFileInUse> FilesCache;
 
-    FilesMap _files;
+    FilesCache* _files; ///< created in initialize(), since its lock uses the OpenFX multithread suite
     bool _isLoaded; ///< register all "global" flags to ffmpeg outside of the constructor to allow
     /// all OpenFX related stuff (which depend on another singleton) to be allocated.
 
-#ifdef OFX_IO_MT_EXR
-    // internal lock
-    MultiThread::Mutex* _lock;
-#endif
-
 public:
+    struct Stats {
+        size_t openFiles;
+        size_t bytes;
+        unsigned long long hits;
+        unsigned long long misses;
+        unsigned long long evictions;
+    };
+
     // singleton
     static FileManager s_readerManager;
 
@@ -463,61 +546,143 @@ public:
 
     void initialize();
 
-    // get a specific reader
-    File* get(const string& filename);
+    // get a specific reader, which stays open while the returned pointer is held. Use FileRef instead.
+    OpenFilePtr acquire(const string& filename);
+
+    // close the files that are not in use any more, if the cache is out of its bounds
+    void release();
+
+    // close all the files that are not currently in use
+    void purge();
+
+    Stats getStats() const;
 };
 
 FileManager FileManager::s_readerManager;
 
 // constructor
 FileManager::FileManager()
-    : _files()
+    : _files(NULL)
     , _isLoaded(false)
-#ifdef OFX_IO_MT_EXR
-    , _lock(NULL)
-#endif
 {
 }
 
 FileManager::~FileManager()
 {
-    for (FilesMap::iterator it = _files.begin(); it != _files.end(); ++it) {
-        delete it->second;
-    }
-#ifdef OFX_IO_MT_EXR
-    delete _lock;
-#endif
+    delete _files;
 }
 
 void
 FileManager::initialize()
 {
     if (!_isLoaded) {
-#ifdef OFX_IO_MT_EXR
-        _lock = new MultiThread::Mutex();
-#endif
+        _files = new FilesCache(kFileManagerMaxOpenFiles, kFileManagerMaxBytes, "Open files (ReadEXR)", MemoryGovernor::ePriorityNormal);
+        // Let OpenEXR decompress line blocks in parallel (the files opened after this call
+        // use the global thread count). This is what OIIO does with exr_threads=0.
+        if (Imf_::globalThreadCount() == 0) {
+            Imf_::setGlobalThreadCount((std::max)(1u, MultiThread::getNumCPUs()));
+        }
         _isLoaded = true;
     }
 }
 
-// get a specific reader
-File*
-FileManager::get(const string& filename)
+OpenFilePtr
+FileManager::acquire(const string& filename)
 {
     assert(_isLoaded);
-#ifdef OFX_IO_MT_EXR
-    MultiThread::AutoMutex g(*_lock);
-#endif
-    FilesMap::iterator it = _files.find(filename);
-    if (it == _files.end()) {
-        pair<FilesMap::iterator, bool> ret = _files.insert(make_pair(string(filename), new File(filename)));
-        assert(ret.second);
+    _files->evictUnusedSince(std::chrono::steady_clock::now() - std::chrono::seconds(kFileManagerExpireSeconds));
 
-        return ret.first->second;
-    } else {
-        return it->second;
+    OpenFilePtr f;
+    if (!_files->get(filename, &f)) {
+        // another thread may have inserted it meanwhile: insert() returns the one in the cache
+        f = _files->insert(filename, std::make_shared<OpenFile>());
     }
+
+    string error;
+    size_t openedBytes = 0;
+    {
+        MultiThread::AutoMutex l(f->openLock);
+        if (!f->file) {
+            try {
+                f->file = new File(filename);
+                openedBytes = estimateFileBytes(f->file->inputfile->header());
+            } catch (const std::exception& ex) {
+                error = ex.what();
+            }
+        }
+        if (!f->file) {
+            // opening failed: forget about this file, the next acquire() tries again
+            _files->eraseIf([&f](const string&, const OpenFilePtr& v) { return v == f; });
+            throw std::runtime_error(error);
+        }
+    }
+    if (openedBytes > 0) {
+        _files->setBytes(filename, openedBytes);
+    }
+
+    return f;
+}
+
+void
+FileManager::release()
+{
+    _files->evictUnusedSince(std::chrono::steady_clock::now() - std::chrono::seconds(kFileManagerExpireSeconds));
+    _files->trim();
 }
+
+void
+FileManager::purge()
+{
+    if (!_isLoaded) {
+        return;
+    }
+    _files->purge();
+}
+
+FileManager::Stats
+FileManager::getStats() const
+{
+    Stats stats;
+    if (!_isLoaded) {
+        stats.openFiles = stats.bytes = 0;
+        stats.hits = stats.misses = stats.evictions = 0;
+
+        return stats;
+    }
+    FilesCache::Stats cacheStats = _files->getStats();
+    stats.openFiles = cacheStats.entries;
+    stats.bytes = cacheStats.bytes;
+    stats.hits = cacheStats.hits;
+    stats.misses = cacheStats.misses;
+    stats.evictions = cacheStats.evictions;
+
+    return stats;
+}
+
+// Holds a reference to an open Exr::File for the duration of a decode or a header query.
+class FileRef {
+public:
+    FileRef(const string& filename)
+        : _file(FileManager::s_readerManager.acquire(filename))
+    {
+    }
+
+    ~FileRef()
+    {
+        _file.reset();
+        FileManager::s_readerManager.release();
+    }
+
+    File* get() const { return _file->file; }
+
+    File* operator->() const { return _file->file; }
+
+private:
+    FileRef(const FileRef&);
+    FileRef& operator=(const FileRef&);
+
+    OpenFilePtr _file;
+};
 } // namespace Exr
 
 ReadEXRPlugin::ReadEXRPlugin(OfxImageEffectHandle handle,
@@ -538,11 +703,28 @@ ReadEXRPlugin::changedParam(const InstanceChangedArgs& args,
     GenericReaderPlugin::changedParam(args, paramName);
 }
 
-struct DecodingChannelsMap {
-    float* buf;
-    bool subsampled;
-    string channelName;
-};
+void
+ReadEXRPlugin::clearAnyCache()
+{
+    Exr::FileManager::s_readerManager.purge();
+}
+
+// statistics about the open files cache, which is shared by all ReadEXR instances
+string
+ReadEXRPlugin::getCacheStatistics()
+{
+    Exr::FileManager::Stats stats = Exr::FileManager::s_readerManager.getStats();
+    std::ostringstream oss;
+
+    oss << "Open files cache (ReadEXR):" << std::endl;
+    oss << "Open files: " << stats.openFiles << " (max. " << kFileManagerMaxOpenFiles << ")" << std::endl;
+    oss << "Estimated memory: " << stats.bytes / (1024 * 1024) << " MB (max. " << kFileManagerMaxBytes / (1024 * 1024) << " MB)" << std::endl;
+    oss << "Hits: " << stats.hits << std::endl;
+    oss << "Misses: " << stats.misses << std::endl;
+    oss << "Evictions: " << stats.evictions;
+
+    return oss.str();
+}
 
 void
 ReadEXRPlugin::decode(const string& filename,
@@ -555,7 +737,8 @@ ReadEXRPlugin::decode(const string& filename,
                       const OfxRectI& bounds,
                       PixelComponentEnum pixelComponents,
                       int pixelComponentCount,
-                      int rowBytes)
+                      int rowBytes,
+                      FusedColorConversion* /*colorConversion*/)
 {
     assert(renderScale.x == 1. && renderScale.y == 1.);
     unused(renderScale);
@@ -566,59 +749,52 @@ ReadEXRPlugin::decode(const string& filename,
         return;
     }
 
-    Exr::File* file = Exr::FileManager::s_readerManager.get(filename);
+    Exr::FileRef file(filename);
     OfxRectI roi = bounds; // used to be dstImg->getRegionOfDefinition(); why?
     assert(kSupportsTiles || (renderWindow.x1 == file->dataWindow.x1 && renderWindow.x2 == file->dataWindow.x2 && renderWindow.y1 == file->dataWindow.y1 && renderWindow.y2 == file->dataWindow.y2));
 
-    for (int y = roi.y1; y < roi.y2; ++y) {
-        map<Exr::Channel, DecodingChannelsMap> channels;
-        for (Exr::File::ChannelsMap::const_iterator it = file->channel_map.begin(); it != file->channel_map.end(); ++it) {
-            DecodingChannelsMap d;
-
-            /// This line means we only support FLOAT dst images with the RGBA format.
-            d.buf = (float*)((char*)pixelData + (y - roi.y1) * rowBytes) + (int)it->first;
-
-            d.subsampled = it->second == "BY" || it->second == "RY";
-            d.channelName = it->second;
-            channels.insert(make_pair(it->first, d));
-        }
-
-        const Imath::Box2i& dispwin = file->inputfile->header().displayWindow();
-        const Imath::Box2i& datawin = file->inputfile->header().dataWindow();
-        int exrY = dispwin.max.y - y;
-        // int r = roi.x2;
-        // int x = roi.x1;
+    const Imath::Box2i& dispwin = file->inputfile->header().displayWindow();
+    const Imath::Box2i& datawin = file->inputfile->header().dataWindow();
 
-        // const int X = (std::max)(x, datawin.min.x + file->dataOffset);
-        // const int R = (std::min)(r, datawin.max.x + file->dataOffset + 1);
+    // Range of EXR scanlines covered by the destination rows, clipped to the data window.
+    // Destination row y maps to EXR scanline dispwin.max.y - y (EXR is top-down).
+    const int exrYMin = (std::max)(datawin.min.y, dispwin.max.y - (roi.y2 - 1));
+    const int exrYMax = (std::min)(datawin.max.y, dispwin.max.y - roi.y1);
+    if (exrYMin > exrYMax) {
+        return;
+    }
 
-        // if we're below or above the data window
-        if ((exrY < datawin.min.y) || (exrY > datawin.max.y) /* || R <= X*/) {
-            continue;
+    // Build a single frame buffer covering the whole range, so that OpenEXR can decode
+    // each line block only once and spread the decompression over its global thread pool.
+    // The slices use a negative y stride, so that scanline exrY lands in row
+    // (dispwin.max.y - exrY - roi.y1) of the destination buffer.
+    char* base = (char*)pixelData + (ptrdiff_t)(dispwin.max.y - roi.y1) * rowBytes;
+    Imf_::FrameBuffer fbuf;
+    for (Exr::File::ChannelsMap::const_iterator it = file->channel_map.begin(); it != file->channel_map.end(); ++it) {
+        /// This line means we only support FLOAT dst images with the RGBA format.
+        char* chanBase = base + (int)it->first * sizeof(float);
+        bool subsampled = it->second == "BY" || it->second == "RY";
+        if (!subsampled) {
+            fbuf.insert(it->second.c_str(),
+                        Imf_::Slice(Imf_::FLOAT, chanBase, sizeof(float) * 4, -(ptrdiff_t)rowBytes));
+        } else {
+            // subsampled lines are only present for even y, and OpenEXR divides y by ySampling
+            fbuf.insert(it->second.c_str(),
+                        Imf_::Slice(Imf_::FLOAT, chanBase, sizeof(float) * 4, -2 * (ptrdiff_t)rowBytes, 2, 2));
         }
+    }
 
-        Imf_::FrameBuffer fbuf;
-        for (map<Exr::Channel, DecodingChannelsMap>::const_iterator z = channels.begin(); z != channels.end(); ++z) {
-            if (!z->second.subsampled) {
-                fbuf.insert(z->second.channelName.c_str(),
-                            Imf_::Slice(Imf_::FLOAT, (char*)(z->second.buf /*+ file->dataOffset*/), sizeof(float) * 4, 0));
-            } else {
-                fbuf.insert(z->second.channelName.c_str(),
-                            Imf_::Slice(Imf_::FLOAT, (char*)(z->second.buf /*+ file->dataOffset*/), sizeof(float) * 4, 0, 2, 2));
-            }
-        }
-        {
+    {
 #ifdef OFX_IO_MT_EXR
-            MultiThread::AutoMutex locker(file->lock);
+        MultiThread::AutoMutex locker(file->lock);
 #endif
-            try {
-                file->inputfile->setFrameBuffer(fbuf);
-                file->inputfile->readPixels(exrY);
-            } catch (const std::exception& e) {
-                setPersistentMessage(Message::eMessageError, "", string("OpenEXR error") + ": " + e.what());
+        try {
+            file->inputfile->setFrameBuffer(fbuf);
+            file->inputfile->readPixels(exrYMin, exrYMax);
+        } catch (const std::exception& e) {
+            setPersistentMessage(Message::eMessageError, "", string("OpenEXR error") + ": " + e.what());
 
-                return;
-            }
+            return;
         }
     }
 } // ReadEXRPlugin::decode
@@ -651,10 +827,10 @@ ReadEXRPlugin::guessParamsFromFilename(const string& newFile,
 {
     assert(colorspace && filePremult && components && componentCount);
 
-    Exr::File* file = newFile.empty() ? NULL : Exr::FileManager::s_readerManager.get(newFile);
-    if (!file) {
+    if (newFile.empty()) {
         return false;
     }
+    Exr::FileRef file(newFile);
 
 #ifdef OFX_IO_USING_OCIO
     // Unless otherwise specified, exr files are assumed to be linear.
@@ -715,8 +891,8 @@ ReadEXRPlugin::getFrameBounds(const string& filename,
                               int* tile_height)
 {
     assert(bounds && par);
-    Exr::File* file = Exr::FileManager::s_readerManager.get(filename);
-    if (!file) {
+    Exr::FileRef file(filename);
+    if (!file.get()) {
         if (error) {
             *error = "No such file";
         }
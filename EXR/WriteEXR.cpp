@@ -22,10 +22,13 @@
  * Writes a an output image using the OpenEXR library.
  */
 
+#include <algorithm>
+#include <cstddef>
 #include <memory>
 
 #include "ofxsFileOpen.h"
 #include "ofxsMacros.h"
+#include "ofxsMultiThread.h"
 
 GCC_DIAG_OFF(deprecated)
 #include <IlmThreadPool.h>
@@ -36,6 +39,9 @@ GCC_DIAG_OFF(deprecated)
 #include <ImfFrameBuffer.h>
 #include <ImfHeader.h>
 #include <ImfOutputFile.h>
+#include <ImfThreading.h>
+#include <ImfTileDescription.h>
+#include <ImfTiledOutputFile.h>
 #include <half.h>
 GCC_DIAG_ON(deprecated)
 
@@ -64,6 +70,27 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kParamWriteEXRCompression "compression"
 #define kParamWriteEXRDataType "dataType"
 
+#define kParamWriteEXRTileSize "tileSize"
+#define kParamWriteEXRTileSizeLabel "Tile Size"
+#define kParamWriteEXRTileSizeHint "Size of a tile in the output file. If scan-line based, the image is written as a scan-line file."
+#define kParamWriteEXRTileSizeOptionScanLineBased "Scan-Line Based", "", "0"
+#define kParamWriteEXRTileSizeOption32 "32", "", "32"
+#define kParamWriteEXRTileSizeOption64 "64", "", "64"
+#define kParamWriteEXRTileSizeOption128 "128", "", "128"
+#define kParamWriteEXRTileSizeOption256 "256", "", "256"
+
+enum EParamTileSize {
+    eParamTileSizeScanLineBased = 0,
+    eParamTileSize32,
+    eParamTileSize64,
+    eParamTileSize128,
+    eParamTileSize256
+};
+
+#define kParamWriteEXRMipmaps "mipmaps"
+#define kParamWriteEXRMipmapsLabel "Mipmaps"
+#define kParamWriteEXRMipmapsHint "Write a mip-mapped tiled file, where each level is half the size of the previous one (box-filtered). Only used if the tile size is not scan-line based."
+
 #ifndef OPENEXR_IMF_NAMESPACE
 #define OPENEXR_IMF_NAMESPACE Imf
 #endif
@@ -125,6 +152,50 @@ depthNameToInt(const string& name)
         return 32;
     }
 }
+
+// Convert a bottom-up OFX buffer to a contiguous top-down half buffer, in a single pass.
+static void
+floatToHalf(const float* pixelData,
+            int width,
+            int height,
+            int nComps,
+            int rowBytes,
+            half* dst)
+{
+    const int rowElems = width * nComps;
+    for (int row = 0; row < height; ++row) {
+        const float* src = (const float*)((const char*)pixelData + (ptrdiff_t)(height - 1 - row) * rowBytes);
+        half* dstRow = dst + (ptrdiff_t)row * rowElems;
+        for (int i = 0; i < rowElems; ++i) {
+            dstRow[i] = src[i];
+        }
+    }
+}
+
+// Compute the next mipmap level (ROUND_DOWN rounding mode) from a contiguous interleaved buffer, using a box filter.
+template <typename PIX>
+static void
+halveLevel(const PIX* src,
+           int srcWidth,
+           int srcHeight,
+           int nComps,
+           PIX* dst,
+           int dstWidth,
+           int dstHeight)
+{
+    for (int y = 0; y < dstHeight; ++y) {
+        const PIX* src0 = src + (ptrdiff_t)(2 * y) * srcWidth * nComps;
+        const PIX* src1 = (2 * y + 1 < srcHeight) ? src0 + (ptrdiff_t)srcWidth * nComps : src0;
+        PIX* dstRow = dst + (ptrdiff_t)y * dstWidth * nComps;
+        for (int x = 0; x < dstWidth; ++x) {
+            const int x0 = 2 * x * nComps;
+            const int x1 = (2 * x + 1 < srcWidth) ? x0 + nComps : x0;
+            for (int c = 0; c < nComps; ++c) {
+                dstRow[x * nComps + c] = ((float)src0[x0 + c] + (float)src0[x1 + c] + (float)src1[x0 + c] + (float)src1[x1 + c]) * 0.25f;
+            }
+        }
+    }
+}
 }
 
 class WriteEXRPlugin
@@ -134,10 +205,11 @@ public:
 
     virtual ~WriteEXRPlugin();
 
-    // virtual void changedParam(const InstanceChangedArgs &args, const string &paramName);
+    virtual void changedParam(const InstanceChangedArgs& args, const string& paramName) OVERRIDE FINAL;
 
 private:
-    virtual void encode(const string& filename,
+    virtual void encode(void* user_data,
+                        const string& filename,
                         const OfxTime time,
                         const string& viewName,
                         const float* pixelData,
@@ -147,6 +219,8 @@ private:
                         const int dstNCompsStartIndex,
                         const int dstNComps,
                         const int rowBytes) OVERRIDE FINAL;
+    virtual void* allocateEncodeUserData(OfxTime time) OVERRIDE FINAL;
+    virtual void destroyEncodeUserData(void* data) OVERRIDE FINAL;
     virtual bool isImageFile(const string& fileExtension) const OVERRIDE FINAL;
     virtual PreMultiplicationEnum getExpectedInputPremultiplication() const OVERRIDE FINAL { return eImagePreMultiplied; }
 
@@ -157,8 +231,24 @@ private:
      **/
     virtual bool supportsAlpha(const std::string&) const OVERRIDE FINAL { return kSupportsRGBA; }
 
+    template <typename PIX>
+    void writeTiled(const string& filename, const Imf_::Header& exrheader, const char* chanNames[4], Imf_::PixelType pixelType, const PIX* levelData, int nComps);
+
+    // the parameter values used by encode(), which may run in a writer thread
+    struct EncodeParams {
+        int compressionIndex;
+        int depthIndex;
+        int tileSizeIndex;
+        bool mipmaps;
+    };
+
+    // mipmaps are only written in tiled files
+    void refreshMipmapsEnabled();
+
     ChoiceParam* _compression;
     ChoiceParam* _bitDepth;
+    ChoiceParam* _tileSize;
+    BooleanParam* _mipmaps;
 };
 
 WriteEXRPlugin::WriteEXRPlugin(OfxImageEffectHandle handle,
@@ -166,21 +256,70 @@ WriteEXRPlugin::WriteEXRPlugin(OfxImageEffectHandle handle,
     : GenericWriterPlugin(handle, extensions, kSupportsRGBA, kSupportsRGB, kSupportsXY, kSupportsAlpha)
     , _compression(NULL)
     , _bitDepth(NULL)
+    , _tileSize(NULL)
+    , _mipmaps(NULL)
 {
     _compression = fetchChoiceParam(kParamWriteEXRCompression);
     _bitDepth = fetchChoiceParam(kParamWriteEXRDataType);
+    _tileSize = fetchChoiceParam(kParamWriteEXRTileSize);
+    _mipmaps = fetchBooleanParam(kParamWriteEXRMipmaps);
+    assert(_compression && _bitDepth && _tileSize && _mipmaps);
+    refreshMipmapsEnabled();
+
+    // Let OpenEXR compress line blocks/tiles in parallel (the files created after this call
+    // use the global thread count).
+    if (Imf_::globalThreadCount() == 0) {
+        Imf_::setGlobalThreadCount((std::max)(1u, MultiThread::getNumCPUs()));
+    }
 }
 
 WriteEXRPlugin::~WriteEXRPlugin()
 {
+    stopWriteBehind();
 }
 
-// void WriteEXRPlugin::changedParam(const InstanceChangedArgs &/*args*/, const string &paramName)
-//{
-// }
+void
+WriteEXRPlugin::changedParam(const InstanceChangedArgs& args,
+                             const string& paramName)
+{
+    if (paramName == kParamWriteEXRTileSize) {
+        refreshMipmapsEnabled();
+    }
+
+    GenericWriterPlugin::changedParam(args, paramName);
+}
 
 void
-WriteEXRPlugin::encode(const string& filename,
+WriteEXRPlugin::refreshMipmapsEnabled()
+{
+    int tileSizeIndex;
+
+    _tileSize->getValue(tileSizeIndex);
+    _mipmaps->setEnabled((EParamTileSize)tileSizeIndex != eParamTileSizeScanLineBased);
+}
+
+void*
+WriteEXRPlugin::allocateEncodeUserData(OfxTime time)
+{
+    EncodeParams* params = new EncodeParams;
+
+    _compression->getValueAtTime(time, params->compressionIndex);
+    _bitDepth->getValueAtTime(time, params->depthIndex);
+    _tileSize->getValueAtTime(time, params->tileSizeIndex);
+    _mipmaps->getValueAtTime(time, params->mipmaps);
+
+    return params;
+}
+
+void
+WriteEXRPlugin::destroyEncodeUserData(void* data)
+{
+    delete (EncodeParams*)data;
+}
+
+void
+WriteEXRPlugin::encode(void* user_data,
+                       const string& filename,
                        const OfxTime /*time*/,
                        const string& /*viewName*/,
                        const float* pixelData,
@@ -194,13 +333,14 @@ WriteEXRPlugin::encode(const string& filename,
     /// FIXME: WriteEXR should not disregard dstNComps
 
     if ((pixelDataNComps != 4) && (pixelDataNComps != 3) && (pixelDataNComps != 1)) {
-        setPersistentMessage(Message::eMessageError, "", "EXR: can only write RGBA, RGB, or Alpha components images");
-        throwSuiteStatusException(kOfxStatErrFormat);
+        throwEncodeError("EXR: can only write RGBA, RGB, or Alpha components images", kOfxStatErrFormat);
 
         return;
     }
 
     assert(pixelDataNComps);
+    assert(user_data);
+    const EncodeParams& params = *(const EncodeParams*)user_data;
 
     // If the file exists (which means "overwrite" was checked), remove it first.
     // See https://github.com/NatronGitHub/Natron/issues/666
@@ -209,15 +349,9 @@ WriteEXRPlugin::encode(const string& filename,
     }
 
     try {
-        int compressionIndex;
-        _compression->getValue(compressionIndex);
-
-        Imf_::Compression compression(Exr::stringToCompression(Exr::compressionNames[compressionIndex]));
-
-        int depthIndex;
-        _bitDepth->getValue(depthIndex);
+        Imf_::Compression compression(Exr::stringToCompression(Exr::compressionNames[params.compressionIndex]));
 
-        int depth = Exr::depthNameToInt(Exr::depthNames[depthIndex]);
+        int depth = Exr::depthNameToInt(Exr::depthNames[params.depthIndex]);
         Imath::Box2i exrDataW;
 
         exrDataW.min.x = bounds.x1;
@@ -250,45 +384,123 @@ WriteEXRPlugin::encode(const string& filename,
             exrheader.channels().insert(chanNames[chan], Imf_::Channel(pixelType));
         }
 
-        Imf_::OutputFile outputFile(filename.c_str(), exrheader);
-
-        for (int y = bounds.y1; y < bounds.y2; ++y) {
-            /*First we create a row that will serve as the output buffer.
-               We copy the scan-line (with y inverted) in the inputImage to the row.*/
-            int exrY = bounds.y2 - y - 1;
-            float* src_pixels = (float*)((char*)pixelData + (exrY - bounds.y1) * rowBytes);
+        const int width = bounds.x2 - bounds.x1;
+        const int height = bounds.y2 - bounds.y1;
+
+        int tileSize = 0;
+        switch ((EParamTileSize)params.tileSizeIndex) {
+        case eParamTileSize32:
+            tileSize = 32;
+            break;
+        case eParamTileSize64:
+            tileSize = 64;
+            break;
+        case eParamTileSize128:
+            tileSize = 128;
+            break;
+        case eParamTileSize256:
+            tileSize = 256;
+            break;
+        case eParamTileSizeScanLineBased:
+            break;
+        }
 
-            /*we create the frame buffer*/
-            Imf_::FrameBuffer fbuf;
+        if (tileSize > 0) {
+            exrheader.setTileDescription(Imf_::TileDescription(tileSize, tileSize,
+                                                               params.mipmaps ? Imf_::MIPMAP_LEVELS : Imf_::ONE_LEVEL,
+                                                               Imf_::ROUND_DOWN));
+            // tiled files are written from a contiguous top-down buffer, which is also used to compute the mipmap levels
             if (depth == 32) {
-                for (int chan = 0; chan < pixelDataNComps; ++chan) {
-                    fbuf.insert(chanNames[chan], Imf_::Slice(Imf_::FLOAT, (char*)src_pixels + chan, sizeof(float) * pixelDataNComps, 0));
+                vector<float> levelData((size_t)width * height * pixelDataNComps);
+                for (int row = 0; row < height; ++row) {
+                    const float* src = (const float*)((const char*)pixelData + (ptrdiff_t)(height - 1 - row) * rowBytes);
+                    std::copy(src, src + width * pixelDataNComps, &levelData[(size_t)row * width * pixelDataNComps]);
                 }
+                writeTiled(filename, exrheader, chanNames, pixelType, &levelData[0], pixelDataNComps);
             } else {
-                Imf_::Array2D<half> halfwriterow(pixelDataNComps, bounds.x2 - bounds.x1);
-
-                for (int chan = 0; chan < pixelDataNComps; ++chan) {
-                    fbuf.insert(chanNames[chan],
-                                Imf_::Slice(Imf_::HALF,
-                                            (char*)(&halfwriterow[chan][0] - exrDataW.min.x),
-                                            sizeof(halfwriterow[chan][0]), 0));
-                    const float* from = src_pixels + chan;
-                    for (int i = exrDataW.min.x, f = exrDataW.min.x; i < exrDataW.max.x; ++i, f += pixelDataNComps) {
-                        halfwriterow[chan][i - exrDataW.min.x] = from[f];
-                    }
-                }
+                vector<half> levelData((size_t)width * height * pixelDataNComps);
+                Exr::floatToHalf(pixelData, width, height, pixelDataNComps, rowBytes, &levelData[0]);
+                writeTiled(filename, exrheader, chanNames, pixelType, &levelData[0], pixelDataNComps);
             }
-            outputFile.setFrameBuffer(fbuf);
-            outputFile.writePixels(1);
+
+            return;
         }
+
+        Imf_::OutputFile outputFile(filename.c_str(), exrheader);
+
+        // Set the frame buffer once and write all scanlines with a single writePixels() call, so that
+        // OpenEXR compresses the line blocks in parallel using its global thread pool.
+        Imf_::FrameBuffer fbuf;
+        vector<half> halfData;
+        if (depth == 32) {
+            // Write directly from the OFX buffer: scanline exrY is row (bounds.y2 - 1 - exrY) of the bottom-up buffer.
+            const size_t xStride = sizeof(float) * pixelDataNComps;
+            char* base = (char*)pixelData + (ptrdiff_t)(bounds.y2 - 1) * rowBytes - (ptrdiff_t)bounds.x1 * xStride;
+            for (int chan = 0; chan < pixelDataNComps; ++chan) {
+                fbuf.insert(chanNames[chan], Imf_::Slice(Imf_::FLOAT, base + chan * sizeof(float), xStride, -(ptrdiff_t)rowBytes));
+            }
+        } else {
+            // Convert the whole image to half in one pass, into a contiguous top-down buffer.
+            halfData.resize((size_t)width * height * pixelDataNComps);
+            Exr::floatToHalf(pixelData, width, height, pixelDataNComps, rowBytes, &halfData[0]);
+            const size_t xStride = sizeof(half) * pixelDataNComps;
+            const size_t yStride = xStride * width;
+            char* base = (char*)&halfData[0] - (ptrdiff_t)bounds.x1 * xStride - (ptrdiff_t)bounds.y1 * yStride;
+            for (int chan = 0; chan < pixelDataNComps; ++chan) {
+                fbuf.insert(chanNames[chan], Imf_::Slice(Imf_::HALF, base + chan * sizeof(half), xStride, yStride));
+            }
+        }
+        outputFile.setFrameBuffer(fbuf);
+        outputFile.writePixels(height);
     } catch (const std::exception& e) {
-        setPersistentMessage(Message::eMessageError, "", string("OpenEXR error") + ": " + e.what());
-        throwSuiteStatusException(kOfxStatFailed);
+        throwEncodeError(string("OpenEXR error") + ": " + e.what());
 
         return;
     }
 } // WriteEXRPlugin::encode
 
+// Write a tiled file from a contiguous top-down level 0 buffer. If the header has mipmap levels,
+// each level is computed from the previous one and written with a single writeTiles() call.
+template <typename PIX>
+void
+WriteEXRPlugin::writeTiled(const string& filename,
+                           const Imf_::Header& exrheader,
+                           const char* chanNames[4],
+                           Imf_::PixelType pixelType,
+                           const PIX* levelData,
+                           int nComps)
+{
+    Imf_::TiledOutputFile outputFile(filename.c_str(), exrheader);
+    const Imath::Box2i& dataW = exrheader.dataWindow();
+    vector<PIX> curLevel;
+    vector<PIX> nextLevel;
+    const PIX* cur = levelData;
+    int curWidth = dataW.max.x - dataW.min.x + 1;
+    int curHeight = dataW.max.y - dataW.min.y + 1;
+
+    for (int level = 0; level < outputFile.numLevels(); ++level) {
+        if (level > 0) {
+            const int w = outputFile.levelWidth(level);
+            const int h = outputFile.levelHeight(level);
+            nextLevel.resize((size_t)w * h * nComps);
+            Exr::halveLevel(cur, curWidth, curHeight, nComps, &nextLevel[0], w, h);
+            curLevel.swap(nextLevel);
+            cur = &curLevel[0];
+            curWidth = w;
+            curHeight = h;
+        }
+        const size_t xStride = sizeof(PIX) * nComps;
+        const size_t yStride = xStride * curWidth;
+        char* base = (char*)cur - (ptrdiff_t)dataW.min.x * xStride - (ptrdiff_t)dataW.min.y * yStride;
+        Imf_::FrameBuffer fbuf;
+        for (int chan = 0; chan < nComps; ++chan) {
+            fbuf.insert(chanNames[chan], Imf_::Slice(pixelType, base + chan * sizeof(PIX), xStride, yStride));
+        }
+        outputFile.setFrameBuffer(fbuf);
+        outputFile.writeTiles(0, outputFile.numXTiles(level) - 1, 0, outputFile.numYTiles(level) - 1, level);
+    }
+}
+
 bool
 WriteEXRPlugin::isImageFile(const string& /*fileExtension*/) const
 {
@@ -370,6 +582,39 @@ WriteEXRPluginFactory::describeInContext(ImageEffectDescriptor& desc,
         }
     }
 
+    ////////Tile size
+    {
+        ChoiceParamDescriptor* param = desc.defineChoiceParam(kParamWriteEXRTileSize);
+        param->setLabel(kParamWriteEXRTileSizeLabel);
+        param->setHint(kParamWriteEXRTileSizeHint);
+        assert(param->getNOptions() == eParamTileSizeScanLineBased);
+        param->appendOption(kParamWriteEXRTileSizeOptionScanLineBased);
+        assert(param->getNOptions() == eParamTileSize32);
+        param->appendOption(kParamWriteEXRTileSizeOption32);
+        assert(param->getNOptions() == eParamTileSize64);
+        param->appendOption(kParamWriteEXRTileSizeOption64);
+        assert(param->getNOptions() == eParamTileSize128);
+        param->appendOption(kParamWriteEXRTileSizeOption128);
+        assert(param->getNOptions() == eParamTileSize256);
+        param->appendOption(kParamWriteEXRTileSizeOption256);
+        param->setDefault(eParamTileSizeScanLineBased);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+
+    ////////Mipmaps
+    {
+        BooleanParamDescriptor* param = desc.defineBooleanParam(kParamWriteEXRMipmaps);
+        param->setLabel(kParamWriteEXRMipmapsLabel);
+        param->setHint(kParamWriteEXRMipmapsHint);
+        param->setDefault(false);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+
+    GenericWriterDescribeWriteBehind(desc, page);
     GenericWriterDescribeInContextEnd(desc, context, page);
 }
 
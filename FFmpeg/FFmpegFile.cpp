@@ -40,10 +40,16 @@
 #define __STDC_CONSTANT_MACROS // ...or stdint.h wont' define UINT64_C, needed by libavutil
 #endif
 #include "FFmpegFile.h"
+#include "IOProfiler.h"
+#include "IOUtility.h"
 
 #include <algorithm>
 #include <cmath>
+#include <cstdlib>
+#include <fstream>
 #include <iostream>
+#include <sstream>
+
 
 #include <ofxsImageEffect.h>
 #include <ofxsMacros.h>
@@ -189,8 +195,16 @@ const FilterEntry kCodecWhitelist[] = {
     { "gif", true, false }, // GIF (Graphics Interchange Format) - write not supported as 8-bit only.
     { "h263p", true, true }, // H.263+ / H.263-1998 / H.263 version 2
     { "h264", true, false }, // H.264 / AVC / MPEG-4 AVC / MPEG-4 part 10 (the encoder is libx264)
+    { "h264_nvenc", false, true }, // NVIDIA NVENC H.264 encoder (falls back to libx264 if no device is available)
+    { "h264_qsv", false, true }, // Intel Quick Sync Video H.264 encoder (falls back to libx264 if no device is available)
+    { "h264_vaapi", false, true }, // VAAPI H.264 encoder (falls back to libx264 if no device is available)
+    { "h264_videotoolbox", false, true }, // VideoToolbox H.264 encoder (falls back to libx264 if no device is available)
     { "hap", true, true }, // Vidvox Hap
     { "hevc", true, false }, // H.265 / HEVC (High Efficiency Video Coding) (the encoder is libx265)
+    { "hevc_nvenc", false, true }, // NVIDIA NVENC HEVC encoder (falls back to libx265 if no device is available)
+    { "hevc_qsv", false, true }, // Intel Quick Sync Video HEVC encoder (falls back to libx265 if no device is available)
+    { "hevc_vaapi", false, true }, // VAAPI HEVC encoder (falls back to libx265 if no device is available)
+    { "hevc_videotoolbox", false, true }, // VideoToolbox HEVC encoder (falls back to libx265 if no device is available)
     { "hq_hqa", true, false }, // Canopus HQ/HQA
     { "hqx", true, false }, // Canopus HQX
     { "huffyuv", true, UNSAFEQT0&& UNSAFEVLC }, // HuffYUV - write not supported as not official qt readable.
@@ -634,6 +648,14 @@ FFmpegFile::getStreamFrames(Stream& stream)
 #endif
     }
 
+    // If the number of frames is still unknown, use the last frame PTS from the keyframe index, if any.
+    if (frames <= 0 && stream._index.maxPts != int64_t(AV_NOPTS_VALUE)) {
+        frames = 1 + stream.ptsToFrame(stream._index.maxPts);
+#if TRACE_FILE_OPEN
+        std::cout << "        Calculated from indexed PTS range=";
+#endif
+    }
+
     // If the number of frames is still unknown, attempt to measure it from the last frame PTS for the stream in the
     // file relative to first (which we know from earlier).
     if (frames <= 0) {
@@ -720,8 +742,86 @@ CheckStreamPropertiesMatch(const AVStream* streamA,
     return (codecA->codec_id == codecB->codec_id) && (codecA->bits_per_raw_sample == codecB->bits_per_raw_sample) && (codecA->width == codecB->width) && (codecA->height == codecB->height) && (codecA->sample_aspect_ratio.num == codecB->sample_aspect_ratio.num) && (codecA->sample_aspect_ratio.den == codecB->sample_aspect_ratio.den) && (pixFmtDescA->nb_components == pixFmtDescB->nb_components) && (streamA->sample_aspect_ratio.num == streamB->sample_aspect_ratio.num) && (streamA->sample_aspect_ratio.den == streamB->sample_aspect_ratio.den) && (streamA->time_base.num == streamB->time_base.num) && (streamA->time_base.den == streamB->time_base.den) && (streamA->start_time == streamB->start_time) && (streamA->duration == streamB->duration) && (streamA->nb_frames == streamB->nb_frames) && (streamA->r_frame_rate.num == streamB->r_frame_rate.num) && (streamA->r_frame_rate.den == streamB->r_frame_rate.den);
 }
 
+static AVHWDeviceType
+hwAccelDeviceType(FFmpegFile::HWAccelEnum hwAccel)
+{
+    switch (hwAccel) {
+    case FFmpegFile::eHWAccelCUDA:
+        return AV_HWDEVICE_TYPE_CUDA;
+    case FFmpegFile::eHWAccelVAAPI:
+        return AV_HWDEVICE_TYPE_VAAPI;
+    case FFmpegFile::eHWAccelVideoToolbox:
+        return AV_HWDEVICE_TYPE_VIDEOTOOLBOX;
+    case FFmpegFile::eHWAccelD3D11VA:
+        return AV_HWDEVICE_TYPE_D3D11VA;
+    case FFmpegFile::eHWAccelNone:
+    case FFmpegFile::eHWAccelAuto:
+    default:
+        break;
+    }
+
+    return AV_HWDEVICE_TYPE_NONE;
+}
+
+// Create a hardware device usable by the decoder, or return nullptr if there is none.
+static AVBufferRef*
+createHWDevice(const AVCodec* codec,
+               FFmpegFile::HWAccelEnum hwAccel)
+{
+    AVHWDeviceType wantedType = hwAccelDeviceType(hwAccel);
+
+    for (int i = 0;; ++i) {
+        const AVCodecHWConfig* config = avcodec_get_hw_config(codec, i);
+        if (!config) {
+            break;
+        }
+        if (!(config->methods & AV_CODEC_HW_CONFIG_METHOD_HW_DEVICE_CTX) ||
+            ((hwAccel != FFmpegFile::eHWAccelAuto) && (config->device_type != wantedType))) {
+            continue;
+        }
+        AVBufferRef* device = nullptr;
+        if (av_hwdevice_ctx_create(&device, config->device_type, nullptr, nullptr, 0) >= 0) {
+            return device;
+        }
+    }
+
+    return nullptr;
+}
+
+// AVCodecContext::get_format callback: select the surface format of the hardware device,
+// or fall back to software decoding if the device cannot decode this stream (e.g. unsupported profile).
+static AVPixelFormat
+getHWPixelFormat(AVCodecContext* codecCtx,
+                 const AVPixelFormat* pixFmts)
+{
+    if (codecCtx->hw_device_ctx) {
+        AVHWDeviceType type = ((AVHWDeviceContext*)codecCtx->hw_device_ctx->data)->type;
+        for (const AVPixelFormat* p = pixFmts; *p != AV_PIX_FMT_NONE; ++p) {
+            for (int i = 0;; ++i) {
+                const AVCodecHWConfig* config = avcodec_get_hw_config(codecCtx->codec, i);
+                if (!config) {
+                    break;
+                }
+                if ((config->methods & AV_CODEC_HW_CONFIG_METHOD_HW_DEVICE_CTX) && (config->device_type == type) && (config->pix_fmt == *p)) {
+                    return *p;
+                }
+            }
+        }
+    }
+    for (const AVPixelFormat* p = pixFmts; *p != AV_PIX_FMT_NONE; ++p) {
+        const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(*p);
+        if (desc && !(desc->flags & AV_PIX_FMT_FLAG_HWACCEL)) {
+            return *p;
+        }
+    }
+
+    return AV_PIX_FMT_NONE;
+}
+
 // constructor
-FFmpegFile::FFmpegFile(const string& filename)
+FFmpegFile::FFmpegFile(const string& filename,
+                       FrameIndexModeEnum indexMode,
+                       HWAccelEnum hwAccel)
     : _filename(filename)
     , _context(nullptr)
     , _streams()
@@ -732,6 +832,27 @@ FFmpegFile::FFmpegFile(const string& filename)
     , _lock()
     , _invalidStateLock()
 #endif
+    , _readAheadThread(nullptr)
+    , _readAheadMutex()
+    , _readAheadCond()
+    , _readAheadLastRequest()
+    , _readAheadExited(false)
+    , _readAheadRing()
+    , _readAheadPlayhead(INT_MIN)
+    , _readAheadDirection(1)
+    , _readAheadDepth(0)
+    , _readAheadStreamIdx(-1)
+    , _readAheadLastFrame(0)
+    , _readAheadQuit(false)
+    , _floatOutput(nullptr)
+    , _decodedOutput(nullptr)
+    , _floatOutputDone(false)
+    , _floatFallbackBuffer()
+    , _indexThread(nullptr)
+    , _indexMutex()
+    , _indexQuit(false)
+    , _pendingIndex()
+    , _pendingIndexReady(false)
 {
 #ifdef OFX_IO_MT_FFMPEG
     // MultiThread::AutoMutex guard(_lock); // not needed in a constructor: we are the only owner
@@ -766,6 +887,19 @@ FFmpegFile::FFmpegFile(const string& filename)
 
     CHECK(avformat_find_stream_info(_context, nullptr));
 
+    // get the keyframe index from the cache, or build it now if asked to
+    StreamIndexMap indices;
+    bool hasIndex = false;
+    if (indexMode != eFrameIndexModeNone) {
+        hasIndex = loadIndex(&indices);
+        if (!hasIndex && indexMode == eFrameIndexModeOnOpen) {
+            hasIndex = buildIndex(&indices);
+            if (hasIndex) {
+                saveIndex(indices);
+            }
+        }
+    }
+
 #if TRACE_FILE_OPEN
     std::cout << "  " << _context->nb_streams << " streams:" << std::endl;
 #endif
@@ -845,7 +979,7 @@ FFmpegFile::FFmpegFile(const string& filename)
 
             // Some codecs support multi-threaded decoding (eg mpeg). Its fast but causes problems when opening many readers
             // simultaneously since each opens as many threads as you have cores. This leads to resource starvation and failed reads.
-            // Hopefully, getNumCPUs() will give us the right number of usable cores
+            // The threads of all the decoders and encoders of the process share a budget, see FFmpegThreadBudget.
 
             // Activate multithreaded decoding. This must be done before opening the codec; see
             // http://lists.gnu.org/archive/html/bino-list/2011-08/msg00019.html
@@ -855,16 +989,7 @@ FFmpegFile::FFmpegFile(const string& filename)
             //    avstream->codec->thread_count = 0;
             //} else
 #endif
-            {
-                codecCtx->thread_count = (std::min)((int)MultiThread::getNumCPUs(), OFX_FFMPEG_MAX_THREADS); // ask for the number of available cores for multithreading
-#ifdef AV_CODEC_CAP_SLICE_THREADS
-                if (codecCtx->codec && (codecCtx->codec->capabilities & AV_CODEC_CAP_SLICE_THREADS)) {
-                    // multiple threads are used to decode a single frame. Reduces delay
-                    codecCtx->thread_type = FF_THREAD_SLICE;
-                }
-#endif
-                // avstream->codec->thread_count = video_decoding_threads(); // bino's strategy (disabled)
-            }
+            FFmpegThreadBudget::instance().setupThreads(codecCtx, videoCodec);
             // Set CODEC_FLAG_EMU_EDGE in the same situations in which ffplay sets it.
             // I don't know what exactly this does, but it is necessary to fix the problem
             // described in this thread: http://lists.nongnu.org/archive/html/bino-list/2012-02/msg00039.html
@@ -879,12 +1004,41 @@ FFmpegFile::FFmpegFile(const string& filename)
 #endif
         }
 
+        // optional hardware-accelerated decoding
+        AVBufferRef* hwDeviceCtx = nullptr;
+        const int swThreadCount = codecCtx->thread_count;
+        if (hwAccel != eHWAccelNone) {
+            hwDeviceCtx = createHWDevice(videoCodec, hwAccel);
+            if (hwDeviceCtx) {
+                codecCtx->hw_device_ctx = av_buffer_ref(hwDeviceCtx);
+                codecCtx->get_format = getHWPixelFormat;
+                // decoding is done by the device, don't use the CPU cores
+                codecCtx->thread_count = 1;
+#if TRACE_FILE_OPEN
+                std::cout << "Using hardware device \"" << av_hwdevice_get_type_name(((AVHWDeviceContext*)hwDeviceCtx->data)->type) << "\"... ";
+#endif
+            }
+        }
+
         // skip if the codec can't be open
         if (avcodec_open2(codecCtx, videoCodec, nullptr) < 0) {
+            bool opened = false;
+            if (hwDeviceCtx) {
+                // retry with software decoding: only undo the device setup, so that the context keeps
+                // the parameters and options that were applied above
+                av_buffer_unref(&codecCtx->hw_device_ctx);
+                av_buffer_unref(&hwDeviceCtx);
+                codecCtx->get_format = avcodec_default_get_format;
+                codecCtx->thread_count = swThreadCount;
+                opened = (avcodec_open2(codecCtx, videoCodec, nullptr) >= 0);
+            }
+            if (!opened) {
 #if TRACE_FILE_OPEN
-            std::cout << "Decoder \"" << videoCodec->name << "\" failed to open, skipping..." << std::endl;
+                std::cout << "Decoder \"" << videoCodec->name << "\" failed to open, skipping..." << std::endl;
 #endif
-            continue;
+                avcodec_free_context(&codecCtx);
+                continue;
+            }
         }
 
 #if TRACE_FILE_OPEN
@@ -901,6 +1055,9 @@ FFmpegFile::FFmpegFile(const string& filename)
 #if TRACE_FILE_OPEN
                 std::cout << "Stream properties do not match those of first video stream, ignoring this stream." << std::endl;
 #endif
+                if (hwDeviceCtx) {
+                    av_buffer_unref(&hwDeviceCtx);
+                }
                 continue;
             }
         }
@@ -908,9 +1065,14 @@ FFmpegFile::FFmpegFile(const string& filename)
         stream->_idx = i;
         stream->_avstream = avstream;
         stream->_codecContext = codecCtx;
+        FFmpegThreadBudget::instance().add(codecCtx);
         stream->_videoCodec = videoCodec;
         stream->_avFrame = av_frame_alloc(); // avcodec_alloc_frame();
         stream->_avIntermediateFrame = av_frame_alloc();
+        stream->_hwDeviceCtx = hwDeviceCtx;
+        if (hwDeviceCtx) {
+            stream->_avHWTransferFrame = av_frame_alloc();
+        }
 
         {
             // In |engine| the output bit depth was hard coded to 16-bits.
@@ -986,6 +1148,10 @@ FFmpegFile::FFmpegFile(const string& filename)
 
         // set stream start time and numbers of frames
         stream->_startPTS = getStreamStartTime(*stream);
+        StreamIndexMap::const_iterator indexIt = indices.find(stream->_idx);
+        if (indexIt != indices.end()) {
+            stream->_index = indexIt->second;
+        }
         stream->_frames = getStreamFrames(*stream);
 
         // save the stream
@@ -1004,12 +1170,31 @@ FFmpegFile::FFmpegFile(const string& filename)
         } else {
             _selectedStream = _streams[0];
         }
+
+        // the index is not needed for intra-only streams, where seeking is always exact
+        if (!hasIndex && indexMode == eFrameIndexModeBackground && _selectedStream->_codecContext->gop_size != 0) {
+            _indexThread = new tthread::thread(indexThreadFunction, this);
+        }
     }
 }
 
 // destructor
 FFmpegFile::~FFmpegFile()
 {
+    // the read-ahead thread uses the decoder: stop it first
+    stopReadAhead();
+
+    // abort building the index
+    if (_indexThread) {
+        {
+            tthread::lock_guard<tthread::mutex> guard(_indexMutex);
+            _indexQuit = true;
+        }
+        _indexThread->join();
+        delete _indexThread;
+        _indexThread = nullptr;
+    }
+
 #ifdef OFX_IO_MT_FFMPEG
     AutoMutex guard(_lock);
 #endif
@@ -1166,6 +1351,7 @@ FFmpegFile::seekFrame(int frame,
 {
     /// Private should not lock
 
+    IO::profileCount("ffmpegSeeks");
     avcodec_flush_buffers(stream->_codecContext);
     int64_t timestamp = stream->frameToDts(frame);
     int error = av_seek_frame(_context, stream->_idx, timestamp, AVSEEK_FLAG_BACKWARD);
@@ -1190,6 +1376,112 @@ FFmpegFile::decode(const ImageEffect* /*plugin*/,
     AutoMutex guard(_lock);
 #endif
 
+    return decodeLocked(frame, loadNearest, buffer);
+}
+
+// decode a single frame directly into a float image, thread safe
+bool
+FFmpegFile::decodeFloat(const ImageEffect* /*plugin*/,
+                        int frame,
+                        bool loadNearest,
+                        const FloatImage& dst)
+{
+#ifdef OFX_IO_MT_FFMPEG
+    AutoMutex guard(_lock);
+#endif
+
+    if (_streams.empty()) {
+        return false;
+    }
+
+    // the frame is decoded to the RGB buffer if its pixel format cannot be converted directly
+    _floatFallbackBuffer.resize(getBufferBytesCount());
+    _floatOutput = &dst;
+    _floatOutputDone = false;
+    bool hasPicture = false;
+    try {
+        hasPicture = decodeLocked(frame, loadNearest, &_floatFallbackBuffer[0]);
+    } catch (...) {
+        _floatOutput = nullptr;
+        throw;
+    }
+    _floatOutput = nullptr;
+    if (!hasPicture || _floatOutputDone) {
+        return hasPicture;
+    }
+
+    return convertBufferToFloat(&_floatFallbackBuffer[0], dst);
+} // FFmpegFile::decodeFloat
+
+// convert an RGB frame output by decodeLocked() to a float image
+bool
+FFmpegFile::convertBufferToFloat(const unsigned char* buffer,
+                                 const FloatImage& dst)
+{
+    Stream* stream = _selectedStream;
+    AVFrame* rgbFrame = av_frame_alloc();
+
+    if (!rgbFrame) {
+        return false;
+    }
+    rgbFrame->format = stream->_outputPixelFormat;
+    rgbFrame->width = stream->_width;
+    rgbFrame->height = stream->_height;
+    av_image_fill_arrays(rgbFrame->data, rgbFrame->linesize, buffer, stream->_outputPixelFormat, stream->_width, stream->_height, 1);
+    bool converted = convertToFloat(rgbFrame, dst);
+    av_frame_free(&rgbFrame); // does not own the data
+
+    return converted;
+}
+
+// decode a frame for the read-ahead ring buffer, thread safe. The slot keeps a reference to the decoded
+// frame if it can be converted directly to float, or else the RGB frame, as decodeFloat() would convert it
+bool
+FFmpegFile::decodeReadAhead(int frame,
+                            ReadAheadFrame* slot)
+{
+#ifdef OFX_IO_MT_FFMPEG
+    AutoMutex guard(_lock);
+#endif
+
+    if (_streams.empty()) {
+        return false;
+    }
+    if (!slot->decoded) {
+        slot->decoded = av_frame_alloc();
+        if (!slot->decoded) {
+            return false;
+        }
+    }
+    av_frame_unref(slot->decoded);
+
+    _floatFallbackBuffer.resize(getBufferBytesCount());
+    _decodedOutput = slot->decoded;
+    _floatOutputDone = false;
+    bool hasPicture = false;
+    try {
+        hasPicture = decodeLocked(frame, false, &_floatFallbackBuffer[0]);
+    } catch (...) {
+        _decodedOutput = nullptr;
+        throw;
+    }
+    _decodedOutput = nullptr;
+    if (hasPicture && !_floatOutputDone) {
+        // keep the RGB frame
+        slot->data.swap(_floatFallbackBuffer);
+    } else {
+        std::vector<unsigned char>().swap(slot->data);
+    }
+
+    return hasPicture;
+} // FFmpegFile::decodeReadAhead
+
+// decode a single frame into the buffer, the caller must hold _lock
+bool
+FFmpegFile::decodeLocked(int frame,
+                         bool loadNearest,
+                         unsigned char* buffer)
+{
     if (_streams.empty()) {
         return false;
     }
@@ -1241,7 +1533,17 @@ FFmpegFile::decode(const ImageEffect* /*plugin*/,
     // This may come back to haunt us one day.
 
     // Only seek and reset for non-sequential frames as this can be very costly.
-    if (stream->ptsToFrame(avFrameOut->pts) + 1 != frame) {
+    // If the keyframe index is available, never seek when decoding forward within the same GOP,
+    // and otherwise seek straight to the keyframe that starts the GOP containing the frame.
+    installPendingIndex();
+    int keyframe = stream->indexedKeyframeForFrame(frame);
+    if (keyframe >= 0) {
+        int currentFrame = stream->ptsToFrame(avFrameOut->pts);
+        bool forward = (avFrameOut->pts != int64_t(AV_NOPTS_VALUE)) && (currentFrame < frame) && (stream->indexedKeyframeForFrame(currentFrame) == keyframe);
+        if (!forward) {
+            seekToIndexedKeyframe(keyframe);
+        }
+    } else if (stream->ptsToFrame(avFrameOut->pts) + 1 != frame) {
         seekToFrame(stream->frameToPts(frame), AVSEEK_FLAG_BACKWARD);
     }
 
@@ -1269,20 +1571,26 @@ FFmpegFile::decode(const ImageEffect* /*plugin*/,
         return false;
     }
 
+    bool retriedKeyframe = (keyframe <= 0);
     bool retriedSeek = false;
-    bool retriedDecode = false;
 
-    while (!retriedDecode) {
-
-        retriedDecode = retriedSeek ? true : false;
-
-        hasPicture = demuxAndDecode(avFrameOut, frame);
-
-        // A last ditch effot to get a frame out for non-intra codecs.
-        // This will perform a seek to the start of the file. which is
-        // the only reliable way to get frame accurate seeking in a
-        // stream with B-frames.
-        if (!hasPicture && !isIntraOnly && !retriedSeek) {
+    for (;;) {
+        {
+            IO::ProfileScope profiling("ffmpegDecode");
+            hasPicture = demuxAndDecode(avFrameOut, frame);
+        }
+        if (hasPicture || isIntraOnly) {
+            break;
+        }
+        if (!retriedKeyframe) {
+            // In open GOPs, the leading frames may reference the previous GOP: start from the previous keyframe.
+            retriedKeyframe = true;
+            seekToIndexedKeyframe(keyframe - 1);
+        } else if (!retriedSeek) {
+            // A last ditch effot to get a frame out for non-intra codecs.
+            // This will perform a seek to the start of the file. which is
+            // the only reliable way to get frame accurate seeking in a
+            // stream with B-frames.
             retriedSeek = true;
             seekToFrame(0, AVSEEK_FLAG_FRAME | AVSEEK_FLAG_BACKWARD);
         } else {
@@ -1291,152 +1599,692 @@ FFmpegFile::decode(const ImageEffect* /*plugin*/,
     }
 
     return hasPicture;
-} // FFmpegFile::decode
+} // FFmpegFile::decodeLocked
 
 bool
-FFmpegFile::seekToFrame(int64_t frame, int seekFlags)
+FFmpegFile::decodePlayback(const ImageEffect* plugin,
+                           int frame,
+                           bool loadNearest,
+                           int readAheadDepth,
+                           const FloatImage& dst)
 {
-    Stream* stream = _selectedStream;
-
-    avcodec_flush_buffers(stream->_codecContext);
-    int res = 0;
-
-    if ((res = av_seek_frame(_context, stream->_idx, frame, seekFlags)) < 0) {
-        setInternalError(res, "FFmpeg Reader Failed to seek frame: ");
-        return false;
+    if ((readAheadDepth <= 0) || _streams.empty() || !_selectedStream) {
+        return decodeFloat(plugin, frame, loadNearest, dst);
     }
 
-    return true;
-}
+    std::size_t grownBytes = 0;
+    bool found = false;
+    ReadAheadFrame ready; // the decoded frame, taken from the ring buffer
+    {
+        std::unique_lock<tthread::mutex> lock(_readAheadMutex);
 
-// avcodec_send_packet() and avcodec_receive_frame() replace avcodec_decode_video2(), see
-// https://github.com/FFmpeg/FFmpeg/blob/9e30859cb60b915f237581e3ce91b0d31592edc0/libavcodec/decode.c#L748
-// Doc for the new AVCodec API: https://blogs.gentoo.org/lu_zero/2016/03/29/new-avcodec-api/
-static int
-mov64_av_decode(AVCodecContext* avctx, AVFrame* frame,
-                int* got_frame, const AVPacket* pkt)
-{
-    int ret;
+        _readAheadLastRequest = std::chrono::steady_clock::now();
+        if ((_readAheadPlayhead != INT_MIN) && (frame != _readAheadPlayhead)) {
+            _readAheadDirection = (frame < _readAheadPlayhead) ? -1 : 1;
+        }
+        _readAheadPlayhead = frame;
+        _readAheadDepth = readAheadDepth;
+        _readAheadStreamIdx = _selectedStream->_idx;
+        _readAheadLastFrame = (int)_selectedStream->_frames;
+
+        // grow the ring buffer if the depth was increased (slots are never moved, so that the
+        // read-ahead thread may keep using a slot while we do this). The read-ahead thread allocates
+        // the frames, count them as RGB frames.
+        const std::size_t frameBytes = getBufferBytesCount();
+        while ((int)_readAheadRing.size() < readAheadDepth) {
+            _readAheadRing.push_back(new ReadAheadFrame);
+            grownBytes += frameBytes;
+        }
 
-    ret = avcodec_send_packet(avctx, pkt);
-    if (ret < 0) {
-        *got_frame = 0;
-        if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF)
-            return ret;
+        if (_readAheadThread && _readAheadExited) {
+            // the thread stopped after a pause in playback: it does not need the lock to finish
+            _readAheadThread->join();
+            delete _readAheadThread;
+            _readAheadThread = nullptr;
+        }
+        if (!_readAheadThread) {
+            _readAheadQuit = false;
+            _readAheadExited = false;
+            _readAheadThread = new tthread::thread(readAheadThreadFunction, this);
+        }
+        // wake up the read-ahead thread: the window moved
+        _readAheadCond.notify_all();
+
+        for (;;) {
+            ReadAheadFrame* slot = nullptr;
+            for (std::vector<ReadAheadFrame*>::iterator it = _readAheadRing.begin(); it != _readAheadRing.end(); ++it) {
+                if (((*it)->frame == frame) && ((*it)->streamIdx == _readAheadStreamIdx)) {
+                    slot = *it;
+                    break;
+                }
+            }
+            if (!slot) {
+                break;
+            }
+            if (slot->busy) {
+                // the read-ahead thread is decoding this frame: wait for it rather than decoding it twice
+                _readAheadCond.wait(lock);
+                continue;
+            }
+            // take the frame and convert it without holding the lock
+            if ( slot->decoded && slot->decoded->data[0] ) {
+                std::swap(ready.decoded, slot->decoded);
+                found = true;
+            } else if (slot->data.size() == frameBytes) {
+                ready.data.swap(slot->data);
+                found = true;
+            }
+            slot->frame = INT_MIN;
+            break;
+        }
+    }
+    if (grownBytes > 0) {
+        // the governor reads getReadAheadBytesCount(): call it without holding _readAheadMutex
+        OFX::IO::MemoryGovernor::instance().grew(grownBytes);
     }
+    if (found) {
+        // same conversion as decodeFloat() (the stream properties it uses do not change once the file is opened)
+        if (ready.decoded) {
+            return convertToFloat(ready.decoded, dst);
+        }
 
-    ret = avcodec_receive_frame(avctx, frame);
-    if (ret < 0) {
-        *got_frame = 0;
-        if (ret == AVERROR(EAGAIN))
-            return 0;
-        return ret;
+        return convertBufferToFloat(&ready.data[0], dst);
     }
 
-    *got_frame = 1;
+    // not decoded yet: decode it now
+    return decodeFloat(plugin, frame, loadNearest, dst);
+} // FFmpegFile::decodePlayback
 
-    return 0;
+void
+FFmpegFile::stopReadAhead()
+{
+    tthread::thread* thread = nullptr;
+    {
+        tthread::lock_guard<tthread::mutex> guard(_readAheadMutex);
+        thread = _readAheadThread;
+        _readAheadThread = nullptr;
+        _readAheadQuit = true;
+        _readAheadCond.notify_all();
+    }
+    if (thread) {
+        thread->join();
+        delete thread;
+    }
+    tthread::lock_guard<tthread::mutex> guard(_readAheadMutex);
+    for (std::vector<ReadAheadFrame*>::iterator it = _readAheadRing.begin(); it != _readAheadRing.end(); ++it) {
+        assert(!(*it)->busy);
+        delete *it;
+    }
+    _readAheadRing.clear();
+    _readAheadPlayhead = INT_MIN;
+    _readAheadExited = false;
 }
 
-bool
-FFmpegFile::demuxAndDecode(AVFrame* avFrameOut, int64_t frame)
+std::size_t
+FFmpegFile::getReadAheadBytesCount()
 {
-    Stream* stream = _selectedStream;
-    MyAVPacket avPacket;
-
-    av_frame_unref(stream->_avIntermediateFrame);
-
-    int res = 0;
-    bool hasPicture = false;
-    int frameDecoded = 0;
-    AVFrame* avFrameDecodeDst = stream->_avIntermediateFrame;
-
-    auto foundCorrectFrame = [this, stream](AVFrame* decodedFrame, int64_t targetFrameIdx) -> bool {
-        bool found = false;
-
-        // Fallback to using the DTS from the AVPacket that triggered returning this frame if no PTS is found
-        // Original code, which doesn't work (AVI/m1v):
-        // if (decodedFrame->pts == AV_NOPTS_VALUE) {
-        //     decodedFrame->pts = decodedFrame->pkt_dts;
-        // }
-        decodedFrame->pts = decodedFrame->best_effort_timestamp;
-        if (decodedFrame->pts == AV_NOPTS_VALUE) {
-            // A given framme cannot be read from a video with no timestamps.
-            // H.264 elementary packets have no timestamp.
-            // See https://libav-user.ffmpeg.narkive.com/HhouRdWQ/pts-from-best-effort-timestamp
-            setInternalError(-1, "FFmpeg Reader Video frames have no timestamp: ");
-            return false;
-        }
-
-        int64_t decodedFrameIdx = stream->ptsToFrame(decodedFrame->pts);
+    tthread::lock_guard<tthread::mutex> guard(_readAheadMutex);
+    std::size_t bytes = 0;
 
-        if (decodedFrameIdx == targetFrameIdx) {
-            found = true;
-        }
-        // If the current frame needs to be displayed longer than current_pts - prev_pts
-        else if ((decodedFrameIdx < targetFrameIdx) && (stream->ptsToFrame(decodedFrame->pts + decodedFrame->pkt_duration) > targetFrameIdx)) {
-            found = true;
+    for (std::vector<ReadAheadFrame*>::const_iterator it = _readAheadRing.begin(); it != _readAheadRing.end(); ++it) {
+        if ((*it)->busy) {
+            // the read-ahead thread is filling it without holding the lock
+            bytes += getBufferBytesCount();
+            continue;
         }
-
-        return found;
-    };
-
-    // Begin reading from the newly seeked position
-    while ((res = av_read_frame(_context, avPacket.pkt())) >= 0) {
-
-        if (avPacket->stream_index == stream->_idx) {
-
-            if ((res = mov64_av_decode(stream->_codecContext, avFrameDecodeDst, &frameDecoded, avPacket.pkt())) < 0) {
-                setInternalError(res, "FFmpeg Reader Failed to decode packet: ");
-                return false;
-            }
-
-            if (frameDecoded) {
-                if (foundCorrectFrame(avFrameDecodeDst, frame)) {
-                    hasPicture = imageConvert(avFrameDecodeDst, avFrameOut);
-                    return hasPicture;
+        bytes += (*it)->data.size();
+        if ((*it)->decoded) {
+            for (int i = 0; i < AV_NUM_DATA_POINTERS; ++i) {
+                if ((*it)->decoded->buf[i]) {
+                    bytes += (*it)->decoded->buf[i]->size;
                 }
             }
         }
     }
 
-    // Check for any read failures
-    if (res < 0 && res != AVERROR_EOF) {
-        setInternalError(res, "FFmpeg Reader Failed to read frame: ");
-        return false;
-    }
-
-    // Flush the decoder of remaining frames
-    if (res == AVERROR_EOF) {
-        while (1) {
+    return bytes;
+}
 
-            if ((res = mov64_av_decode(stream->_codecContext, avFrameDecodeDst, &frameDecoded, nullptr)) < 0) {
-                setInternalError(res, "FFmpeg Reader Failed to flush the decoder of remaing frames: ");
-                return false;
-            }
+bool
+FFmpegFile::isReadingAhead()
+{
+    tthread::lock_guard<tthread::mutex> guard(_readAheadMutex);
 
-            if (frameDecoded) {
-                if (foundCorrectFrame(avFrameDecodeDst, frame)) {
-                    return imageConvert(avFrameDecodeDst, avFrameOut);
-                }
-            } else {
-                break;
-            }
-        }
-    }
+    return _readAheadThread && !_readAheadExited;
+}
 
-    return hasPicture;
+void
+FFmpegFile::readAheadThreadFunction(void* arg)
+{
+    static_cast<FFmpegFile*>(arg)->readAheadLoop();
 }
 
+// Must be called with _readAheadMutex held.
 bool
-FFmpegFile::imageConvert(AVFrame* avFrameIn, AVFrame* avFrameOut)
+FFmpegFile::isInReadAheadWindow(int frame) const
 {
-    if (!avFrameIn || !avFrameOut) {
-        setError("mov64Reader no input or output frame provided for conversion");
+    if ((_readAheadPlayhead == INT_MIN) || (frame < 1) || (frame > _readAheadLastFrame)) {
         return false;
     }
+    int offset = (frame - _readAheadPlayhead) * _readAheadDirection;
 
-    Stream* stream = _selectedStream;
+    return (offset > 0) && (offset <= _readAheadDepth);
+}
+
+void
+FFmpegFile::readAheadLoop()
+{
+    std::unique_lock<tthread::mutex> lock(_readAheadMutex);
+    const std::chrono::seconds idleDuration(OFX_FFMPEG_READAHEAD_IDLE_SECONDS);
+
+    while (!_readAheadQuit) {
+        // find the nearest frame ahead of the playhead that is not decoded yet
+        int target = INT_MIN;
+        for (int i = 1; i <= _readAheadDepth && _readAheadPlayhead != INT_MIN; ++i) {
+            int f = _readAheadPlayhead + i * _readAheadDirection;
+            if (!isInReadAheadWindow(f)) {
+                break;
+            }
+            bool decoded = false;
+            for (std::vector<ReadAheadFrame*>::const_iterator it = _readAheadRing.begin(); it != _readAheadRing.end(); ++it) {
+                if (((*it)->frame == f) && ((*it)->streamIdx == _readAheadStreamIdx)) {
+                    decoded = true;
+                    break;
+                }
+            }
+            if (!decoded) {
+                target = f;
+                break;
+            }
+        }
+
+        // find a free slot, or a slot holding a frame that is not needed anymore
+        ReadAheadFrame* slot = nullptr;
+        if (target != INT_MIN) {
+            for (std::vector<ReadAheadFrame*>::iterator it = _readAheadRing.begin(); it != _readAheadRing.end(); ++it) {
+                if (!(*it)->busy && (((*it)->frame == INT_MIN) || ((*it)->streamIdx != _readAheadStreamIdx) || !isInReadAheadWindow((*it)->frame))) {
+                    slot = *it;
+                    break;
+                }
+            }
+        }
+
+        if (!slot) {
+            // nothing to do until the playhead moves
+            if ( (_readAheadCond.wait_for(lock, idleDuration) == std::cv_status::timeout) &&
+                 (std::chrono::steady_clock::now() - _readAheadLastRequest >= idleDuration) ) {
+                // playback stopped: free the buffers, decodePlayback() restarts the thread when needed
+                for (std::vector<ReadAheadFrame*>::iterator it = _readAheadRing.begin(); it != _readAheadRing.end(); ++it) {
+                    assert(!(*it)->busy);
+                    delete *it;
+                }
+                _readAheadRing.clear();
+                _readAheadPlayhead = INT_MIN;
+                _readAheadExited = true;
+                break;
+            }
+            continue;
+        }
+
+        // the slot holds the target while it is busy, so that decodePlayback() waits for it
+        slot->busy = true;
+        slot->frame = target;
+        slot->streamIdx = _readAheadStreamIdx;
+        const int streamIdx = _readAheadStreamIdx;
+
+        // decode without holding the ring buffer lock, so that decodePlayback() can still copy ready frames
+        lock.unlock();
+        bool ok = false;
+        try {
+            ok = decodeReadAhead(target, slot);
+        } catch (const std::exception&) {
+            // missing frame
+            ok = false;
+        }
+        lock.lock();
+
+        slot->busy = false;
+        if (!ok || (streamIdx != _readAheadStreamIdx)) {
+            slot->frame = INT_MIN;
+        }
+        if (!ok) {
+            // stop reading ahead until the next request
+            _readAheadPlayhead = INT_MIN;
+        }
+        _readAheadCond.notify_all();
+    }
+} // FFmpegFile::readAheadLoop
+
+bool
+FFmpegFile::seekToFrame(int64_t frame, int seekFlags)
+{
+    Stream* stream = _selectedStream;
+
+    IO::profileCount("ffmpegSeeks");
+    avcodec_flush_buffers(stream->_codecContext);
+    int res = 0;
+
+    if ((res = av_seek_frame(_context, stream->_idx, frame, seekFlags)) < 0) {
+        setInternalError(res, "FFmpeg Reader Failed to seek frame: ");
+        return false;
+    }
+
+    return true;
+}
+
+bool
+FFmpegFile::seekToIndexedKeyframe(int keyframe)
+{
+    Stream* stream = _selectedStream;
+
+    assert(keyframe >= 0 && keyframe < (int)stream->_index.keyframes.size());
+    const IndexEntry& entry = stream->_index.keyframes[keyframe];
+    // av_seek_frame() positions the demuxer using decoding timestamps for most formats
+    int64_t timestamp = (entry.dts != int64_t(AV_NOPTS_VALUE)) ? entry.dts : entry.pts;
+
+    return seekToFrame(timestamp, AVSEEK_FLAG_BACKWARD);
+}
+
+// 64-bit FNV-1a hash, used to name the index cache files
+static uint64_t
+fnv1aHash(const string& str)
+{
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (string::const_iterator it = str.begin(); it != str.end(); ++it) {
+        hash ^= (unsigned char)*it;
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+#define kIndexCacheMagic "ofx-ffmpeg-index 1"
+
+// The index cache directory is given by the OFX_IO_FFMPEG_INDEX_DIR environment variable,
+// or else the temporary directory is used.
+string
+FFmpegFile::getIndexCacheFilename() const
+{
+    const char* dir = std::getenv("OFX_IO_FFMPEG_INDEX_DIR");
+    const char* tmpVars[] = { "TMPDIR", "TEMP", "TMP", nullptr };
+
+    for (int i = 0; (!dir || !*dir) && tmpVars[i]; ++i) {
+        dir = std::getenv(tmpVars[i]);
+    }
+    string dirname = (dir && *dir) ? dir : "/tmp";
+    std::ostringstream ss;
+    ss << dirname << '/' << "ofx-ffmpeg-index-" << std::hex << fnv1aHash(_filename) << ".txt";
+
+    return ss.str();
+}
+
+bool
+FFmpegFile::loadIndex(StreamIndexMap* indices) const
+{
+    long long size, mtime;
+
+    // the index cache is keyed by path, file size and modification time
+    if (!OFX::IO::getFileStamp(_filename, &mtime, &size)) {
+        return false;
+    }
+    std::ifstream in(getIndexCacheFilename().c_str());
+    if (!in) {
+        return false;
+    }
+    string line;
+    if (!std::getline(in, line) || line != kIndexCacheMagic) {
+        return false;
+    }
+    if (!std::getline(in, line) || line != _filename) {
+        return false;
+    }
+    long long cachedSize, cachedMtime;
+    int nStreams;
+    if (!(in >> cachedSize >> cachedMtime >> nStreams) || cachedSize != size || cachedMtime != mtime || nStreams < 0) {
+        return false;
+    }
+    StreamIndexMap result;
+    for (int i = 0; i < nStreams; ++i) {
+        int streamIdx;
+        long long maxPts;
+        long long nKeyframes;
+        if (!(in >> streamIdx >> maxPts >> nKeyframes) || nKeyframes < 0) {
+            return false;
+        }
+        StreamIndex& index = result[streamIdx];
+        index.maxPts = maxPts;
+        index.keyframes.resize((size_t)nKeyframes);
+        for (long long k = 0; k < nKeyframes; ++k) {
+            long long pts, dts;
+            if (!(in >> pts >> dts)) {
+                return false;
+            }
+            index.keyframes[k].pts = pts;
+            index.keyframes[k].dts = dts;
+        }
+    }
+    indices->swap(result);
+
+    return true;
+} // FFmpegFile::loadIndex
+
+void
+FFmpegFile::saveIndex(const StreamIndexMap& indices) const
+{
+    long long size, mtime;
+
+    // the index cache is keyed by path, file size and modification time
+    if (!OFX::IO::getFileStamp(_filename, &mtime, &size)) {
+        return;
+    }
+    // write to a temporary file and rename it, so that concurrent readers never see a partial index
+    string cacheFilename = getIndexCacheFilename();
+    std::ostringstream tmpss;
+    tmpss << cacheFilename << '.' << (const void*)this << ".tmp";
+    string tmpFilename = tmpss.str();
+    {
+        std::ofstream out(tmpFilename.c_str());
+        if (!out) {
+            return;
+        }
+        out << kIndexCacheMagic << '\n' << _filename << '\n' << size << ' ' << mtime << ' ' << indices.size() << '\n';
+        for (StreamIndexMap::const_iterator it = indices.begin(); it != indices.end(); ++it) {
+            const StreamIndex& index = it->second;
+            out << it->first << ' ' << (long long)index.maxPts << ' ' << index.keyframes.size() << '\n';
+            for (std::vector<IndexEntry>::const_iterator e = index.keyframes.begin(); e != index.keyframes.end(); ++e) {
+                out << (long long)e->pts << ' ' << (long long)e->dts << '\n';
+            }
+        }
+        if (!out) {
+            out.close();
+            std::remove(tmpFilename.c_str());
+
+            return;
+        }
+    }
+#if defined(_WIN32) || defined(__WIN32__) || defined(WIN32) || defined(WIN64)
+    std::remove(cacheFilename.c_str()); // rename() does not overwrite on Windows
+#endif
+    if (std::rename(tmpFilename.c_str(), cacheFilename.c_str()) != 0) {
+        std::remove(tmpFilename.c_str());
+    }
+} // FFmpegFile::saveIndex
+
+int
+FFmpegFile::indexInterruptCallback(void* arg)
+{
+    FFmpegFile* file = (FFmpegFile*)arg;
+    tthread::lock_guard<tthread::mutex> guard(file->_indexMutex);
+
+    return file->_indexQuit ? 1 : 0;
+}
+
+// Build the keyframe index of all video streams by demuxing the whole file once.
+// Only packets are read, nothing is decoded. A separate demuxer is used, so that this can
+// run in a background thread while frames are being decoded.
+bool
+FFmpegFile::buildIndex(StreamIndexMap* indices)
+{
+    AVFormatContext* context = avformat_alloc_context();
+
+    if (!context) {
+        return false;
+    }
+    context->interrupt_callback.callback = indexInterruptCallback;
+    context->interrupt_callback.opaque = this;
+    AVDictionary* demuxerOptions = nullptr;
+    av_dict_set(&demuxerOptions, "enable_drefs", "1", 0);
+    int res = avformat_open_input(&context, _filename.c_str(), nullptr, &demuxerOptions); // frees context on failure
+    av_dict_free(&demuxerOptions);
+    if (res < 0) {
+        return false;
+    }
+    if (avformat_find_stream_info(context, nullptr) < 0) {
+        avformat_close_input(&context);
+
+        return false;
+    }
+
+    StreamIndexMap result;
+    for (unsigned i = 0; i < context->nb_streams; ++i) {
+        if (context->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+            result[i] = StreamIndex();
+        } else {
+            context->streams[i]->discard = AVDISCARD_ALL;
+        }
+    }
+
+    MyAVPacket avPacket;
+    while ((res = av_read_frame(context, avPacket.pkt())) >= 0) {
+        StreamIndexMap::iterator it = result.find(avPacket->stream_index);
+        if (it != result.end()) {
+            StreamIndex& index = it->second;
+            int64_t pts = (avPacket->pts != int64_t(AV_NOPTS_VALUE)) ? avPacket->pts : avPacket->dts;
+            if (pts != int64_t(AV_NOPTS_VALUE)) {
+                if ((index.maxPts == int64_t(AV_NOPTS_VALUE)) || (pts > index.maxPts)) {
+                    index.maxPts = pts;
+                }
+                if (avPacket->flags & AV_PKT_FLAG_KEY) {
+                    IndexEntry entry;
+                    entry.pts = pts;
+                    entry.dts = avPacket->dts;
+                    index.keyframes.push_back(entry);
+                }
+            }
+        }
+        av_packet_unref(avPacket.pkt());
+    }
+    avformat_close_input(&context);
+
+    // interrupted or failed before the end of the file: the index is incomplete
+    if (res != AVERROR_EOF) {
+        return false;
+    }
+
+    for (StreamIndexMap::iterator it = result.begin(); it != result.end(); ++it) {
+        std::vector<IndexEntry>& keyframes = it->second.keyframes;
+        std::sort(keyframes.begin(), keyframes.end(), [](const IndexEntry& a, const IndexEntry& b) { return a.pts < b.pts; });
+    }
+    indices->swap(result);
+
+    return true;
+} // FFmpegFile::buildIndex
+
+void
+FFmpegFile::indexThreadFunction(void* arg)
+{
+    FFmpegFile* file = (FFmpegFile*)arg;
+    StreamIndexMap indices;
+
+    if (file->buildIndex(&indices)) {
+        file->saveIndex(indices);
+        tthread::lock_guard<tthread::mutex> guard(file->_indexMutex);
+        file->_pendingIndex.swap(indices);
+        file->_pendingIndexReady = true;
+    }
+}
+
+// give the index built in the background to the streams (the caller must hold _lock)
+void
+FFmpegFile::installPendingIndex()
+{
+    tthread::lock_guard<tthread::mutex> guard(_indexMutex);
+
+    if (!_pendingIndexReady) {
+        return;
+    }
+    for (unsigned int i = 0; i < _streams.size(); ++i) {
+        StreamIndexMap::iterator it = _pendingIndex.find(_streams[i]->_idx);
+        if (it != _pendingIndex.end()) {
+            _streams[i]->_index.keyframes.swap(it->second.keyframes);
+            _streams[i]->_index.maxPts = it->second.maxPts;
+        }
+    }
+    _pendingIndex.clear();
+    _pendingIndexReady = false;
+}
+
+// avcodec_send_packet() and avcodec_receive_frame() replace avcodec_decode_video2(), see
+// https://github.com/FFmpeg/FFmpeg/blob/9e30859cb60b915f237581e3ce91b0d31592edc0/libavcodec/decode.c#L748
+// Doc for the new AVCodec API: https://blogs.gentoo.org/lu_zero/2016/03/29/new-avcodec-api/
+static int
+mov64_av_decode(AVCodecContext* avctx, AVFrame* frame,
+                int* got_frame, const AVPacket* pkt)
+{
+    int ret;
+
+    FFmpegThreadBudget::instance().touch(avctx);
+    ret = avcodec_send_packet(avctx, pkt);
+    if (ret < 0) {
+        *got_frame = 0;
+        if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF)
+            return ret;
+    }
+
+    ret = avcodec_receive_frame(avctx, frame);
+    if (ret < 0) {
+        *got_frame = 0;
+        if (ret == AVERROR(EAGAIN))
+            return 0;
+        return ret;
+    }
+
+    *got_frame = 1;
+
+    return 0;
+}
+
+bool
+FFmpegFile::demuxAndDecode(AVFrame* avFrameOut, int64_t frame)
+{
+    Stream* stream = _selectedStream;
+    MyAVPacket avPacket;
+
+    av_frame_unref(stream->_avIntermediateFrame);
+
+    int res = 0;
+    bool hasPicture = false;
+    int frameDecoded = 0;
+    AVFrame* avFrameDecodeDst = stream->_avIntermediateFrame;
+
+    auto foundCorrectFrame = [this, stream](AVFrame* decodedFrame, int64_t targetFrameIdx) -> bool {
+        bool found = false;
+
+        // Fallback to using the DTS from the AVPacket that triggered returning this frame if no PTS is found
+        // Original code, which doesn't work (AVI/m1v):
+        // if (decodedFrame->pts == AV_NOPTS_VALUE) {
+        //     decodedFrame->pts = decodedFrame->pkt_dts;
+        // }
+        decodedFrame->pts = decodedFrame->best_effort_timestamp;
+        if (decodedFrame->pts == AV_NOPTS_VALUE) {
+            // A given framme cannot be read from a video with no timestamps.
+            // H.264 elementary packets have no timestamp.
+            // See https://libav-user.ffmpeg.narkive.com/HhouRdWQ/pts-from-best-effort-timestamp
+            setInternalError(-1, "FFmpeg Reader Video frames have no timestamp: ");
+            return false;
+        }
+
+        int64_t decodedFrameIdx = stream->ptsToFrame(decodedFrame->pts);
+
+        if (decodedFrameIdx == targetFrameIdx) {
+            found = true;
+        }
+        // If the current frame needs to be displayed longer than current_pts - prev_pts
+        else if ((decodedFrameIdx < targetFrameIdx) && (stream->ptsToFrame(decodedFrame->pts + decodedFrame->pkt_duration) > targetFrameIdx)) {
+            found = true;
+        }
+
+        return found;
+    };
+
+    // Begin reading from the newly seeked position
+    while ((res = av_read_frame(_context, avPacket.pkt())) >= 0) {
+        IO::profileCount("ffmpegPacketBytes", avPacket->size);
+
+        if (avPacket->stream_index == stream->_idx) {
+
+            if ((res = mov64_av_decode(stream->_codecContext, avFrameDecodeDst, &frameDecoded, avPacket.pkt())) < 0) {
+                setInternalError(res, "FFmpeg Reader Failed to decode packet: ");
+                return false;
+            }
+
+            if (frameDecoded) {
+                if (foundCorrectFrame(avFrameDecodeDst, frame)) {
+                    AVFrame* avFrameSW = downloadHWFrame(avFrameDecodeDst);
+                    hasPicture = avFrameSW && imageConvert(avFrameSW, avFrameOut);
+                    return hasPicture;
+                }
+            }
+        }
+    }
+
+    // Check for any read failures
+    if (res < 0 && res != AVERROR_EOF) {
+        setInternalError(res, "FFmpeg Reader Failed to read frame: ");
+        return false;
+    }
+
+    // Flush the decoder of remaining frames
+    if (res == AVERROR_EOF) {
+        while (1) {
+
+            if ((res = mov64_av_decode(stream->_codecContext, avFrameDecodeDst, &frameDecoded, nullptr)) < 0) {
+                setInternalError(res, "FFmpeg Reader Failed to flush the decoder of remaing frames: ");
+                return false;
+            }
+
+            if (frameDecoded) {
+                if (foundCorrectFrame(avFrameDecodeDst, frame)) {
+                    AVFrame* avFrameSW = downloadHWFrame(avFrameDecodeDst);
+                    return avFrameSW && imageConvert(avFrameSW, avFrameOut);
+                }
+            } else {
+                break;
+            }
+        }
+    }
+
+    return hasPicture;
+}
+
+// Download a frame decoded by the hardware device to system memory.
+// Returns the frame to convert, which is avFrame itself if it was decoded in software.
+AVFrame*
+FFmpegFile::downloadHWFrame(AVFrame* avFrame)
+{
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get((AVPixelFormat)avFrame->format);
+
+    if (!desc || !(desc->flags & AV_PIX_FMT_FLAG_HWACCEL)) {
+        return avFrame;
+    }
+
+    Stream* stream = _selectedStream;
+    AVFrame* avFrameSW = stream->_avHWTransferFrame;
+    assert(avFrameSW);
+    av_frame_unref(avFrameSW);
+    int res = av_hwframe_transfer_data(avFrameSW, avFrame, 0);
+    if (res < 0) {
+        setInternalError(res, "FFmpeg Reader Failed to download hardware frame: ");
+        return nullptr;
+    }
+    // pts, color range, etc.
+    av_frame_copy_props(avFrameSW, avFrame);
+
+    return avFrameSW;
+}
+
+bool
+FFmpegFile::imageConvert(AVFrame* avFrameIn, AVFrame* avFrameOut)
+{
+    IO::ProfileScope profiling("ffmpegConvert");
+
+    if (!avFrameIn || !avFrameOut) {
+        setError("mov64Reader no input or output frame provided for conversion");
+        return false;
+    }
+
+    Stream* stream = _selectedStream;
 
     AVPixelFormat dstPixFmt = (AVPixelFormat)avFrameOut->format;
     AVPixelFormat srcPixFmt = (AVPixelFormat)avFrameIn->format;
@@ -1445,6 +2293,19 @@ FFmpegFile::imageConvert(AVFrame* avFrameIn, AVFrame* avFrameOut)
     avFrameOut->pkt_dts = avFrameIn->pkt_dts;
     avFrameOut->pkt_duration = avFrameIn->pkt_duration;
 
+    // decodeFloat(): skip the intermediate RGB frame if possible
+    if (_floatOutput && canConvertToFloat(avFrameIn)) {
+        _floatOutputDone = convertToFloat(avFrameIn, *_floatOutput);
+
+        return _floatOutputDone;
+    }
+    // read-ahead: keep the decoded frame, decodePlayback() converts it like decodeFloat()
+    if ( _decodedOutput && canConvertToFloat(avFrameIn) && (av_frame_ref(_decodedOutput, avFrameIn) >= 0) ) {
+        _floatOutputDone = true;
+
+        return true;
+    }
+
     if (!avFrameOut->data[0]) {
         int res = av_image_alloc(avFrameOut->data, avFrameOut->linesize, avFrameOut->width, avFrameOut->height, dstPixFmt, 32);
         if (res <= 0) {
@@ -1481,6 +2342,342 @@ FFmpegFile::imageConvert(AVFrame* avFrameIn, AVFrame* avFrameOut)
     return true;
 }
 
+// Converts a decoded frame to a float image (bottom-up rows), in horizontal bands processed
+// in parallel. Source frames are either planar YUV, with an optional alpha plane and with 4:2:0,
+// 4:2:2 or 4:4:4 chroma subsampling, or packed RGB(A). All samples are 8 bits (SRCPIX = uint8_t),
+// or 9 to 16 bits (SRCPIX = uint16_t). The inner loops work on float rows, so that the compiler
+// can vectorize them.
+template <typename SRCPIX>
+class FloatConverterProcessor
+    : public MultiThread::Processor
+{
+public:
+    FloatConverterProcessor(const AVFrame* avFrame,
+                            const FFmpegFile::FloatImage& dst,
+                            bool fullRange,
+                            bool rec709)
+        : _avFrame(avFrame)
+        , _desc(av_pix_fmt_desc_get((AVPixelFormat)avFrame->format))
+        , _dst(dst)
+        , _isYUV(false)
+        , _hasAlpha(false)
+        , _nSrcComps(0)
+        , _yScale(1.f)
+        , _yOffset(0.f)
+        , _cScale(1.f)
+        , _cOffset(0.f)
+        , _aScale(1.f)
+        , _crR(0.f)
+        , _cbG(0.f)
+        , _crG(0.f)
+        , _cbB(0.f)
+        , _chromaX0()
+        , _chromaX1()
+        , _chromaXW()
+    {
+        assert(_desc);
+        const int depth = _desc->comp[0].depth;
+        const float maxValue = (float)((1 << depth) - 1);
+        _isYUV = !(_desc->flags & AV_PIX_FMT_FLAG_RGB);
+        _hasAlpha = (_desc->nb_components == 4);
+        _nSrcComps = _desc->nb_components;
+        _aScale = 1.f / maxValue;
+        if (!_isYUV) {
+            _yScale = 1.f / maxValue;
+
+            return;
+        }
+
+        // normalization, from swscale's sws_setColorspaceDetails()
+        if (fullRange) {
+            _yScale = 1.f / maxValue;
+            _cScale = 1.f / maxValue;
+        } else {
+            _yOffset = (float)(16 << (depth - 8));
+            _yScale = 1.f / (219 << (depth - 8));
+            _cScale = 1.f / (224 << (depth - 8));
+        }
+        _cOffset = (float)(1 << (depth - 1));
+
+        // Y'CbCr to R'G'B' matrix
+        const float kr = rec709 ? 0.2126f : 0.299f;
+        const float kb = rec709 ? 0.0722f : 0.114f;
+        const float kg = 1.f - kr - kb;
+        _crR = 2.f * (1.f - kr);
+        _cbB = 2.f * (1.f - kb);
+        _cbG = -2.f * kb * (1.f - kb) / kg;
+        _crG = -2.f * kr * (1.f - kr) / kg;
+
+        // horizontal chroma upsampling: bilinear, chroma sited on even luma samples (MPEG-2, H.264)
+        // or between luma samples (MPEG-1, JPEG)
+        const int width = _avFrame->width;
+        const int shiftW = _desc->log2_chroma_w;
+        const int chromaWidth = AV_CEIL_RSHIFT(width, shiftW);
+        const bool centered = (_avFrame->chroma_location == AVCHROMA_LOC_CENTER);
+        _chromaX0.resize(width);
+        _chromaX1.resize(width);
+        _chromaXW.resize(width);
+        for (int x = 0; x < width; ++x) {
+            if (!shiftW) {
+                _chromaX0[x] = _chromaX1[x] = x;
+                _chromaXW[x] = 0.f;
+                continue;
+            }
+            float cx = centered ? (x * 0.5f - 0.25f) : (x * 0.5f);
+            int x0 = (int)std::floor(cx);
+            _chromaXW[x] = cx - x0;
+            _chromaX0[x] = (std::max)(0, (std::min)(x0, chromaWidth - 1));
+            _chromaX1[x] = (std::max)(0, (std::min)(x0 + 1, chromaWidth - 1));
+        }
+    }
+
+    virtual void multiThreadFunction(unsigned int threadID,
+                                     unsigned int nThreads) OVERRIDE FINAL
+    {
+        const int y1 = _dst.renderWindow.y1;
+        const int h = _dst.renderWindow.y2 - y1;
+        const int bandY1 = y1 + (int)(((int64_t)h * threadID) / nThreads);
+        const int bandY2 = y1 + (int)(((int64_t)h * (threadID + 1)) / nThreads);
+        const int width = _avFrame->width;
+        std::vector<float> rows(_isYUV ? 5 * width : 0);
+        float* yRow = rows.empty() ? nullptr : &rows[0];
+        float* cbRow = yRow + width;
+        float* crRow = cbRow + width;
+        float* cbOut = crRow + width;
+        float* crOut = cbOut + width;
+
+        for (int y = bandY1; y < bandY2; ++y) {
+            float* dstPix = (float*)((char*)_dst.pixelData + (size_t)(y - _dst.bounds.y1) * _dst.rowBytes);
+            // FFmpeg frames are top-down
+            const int srcY = (_dst.bounds.y2 - 1 - y) - _dst.bounds.y1;
+            if ((srcY < 0) || (srcY >= _avFrame->height)) {
+                std::fill(dstPix + (_dst.renderWindow.x1 - _dst.bounds.x1) * _dst.nComps,
+                          dstPix + (_dst.renderWindow.x2 - _dst.bounds.x1) * _dst.nComps, 0.f);
+                continue;
+            }
+            if (_isYUV) {
+                convertYUVRow(srcY, yRow, cbRow, crRow, cbOut, crOut, dstPix);
+            } else {
+                convertRGBRow(srcY, dstPix);
+            }
+        }
+    }
+
+private:
+    const SRCPIX* srcRow(int plane,
+                         int srcY) const
+    {
+        return (const SRCPIX*)(_avFrame->data[plane] + (ptrdiff_t)srcY * _avFrame->linesize[plane]);
+    }
+
+    // vertically interpolated chroma row, with the offset removed and normalized
+    void chromaRow(int plane,
+                   int srcY,
+                   float* out) const
+    {
+        const int shiftH = _desc->log2_chroma_h;
+        const int chromaWidth = AV_CEIL_RSHIFT(_avFrame->width, _desc->log2_chroma_w);
+
+        if (!shiftH) {
+            const SRCPIX* src = srcRow(plane, srcY);
+            for (int x = 0; x < chromaWidth; ++x) {
+                out[x] = (src[x] - _cOffset) * _cScale;
+            }
+
+            return;
+        }
+        // chroma rows are sited between luma rows
+        const int chromaHeight = AV_CEIL_RSHIFT(_avFrame->height, shiftH);
+        const int c = srcY >> 1;
+        const int cOther = (std::max)(0, (std::min)((srcY & 1) ? c + 1 : c - 1, chromaHeight - 1));
+        const SRCPIX* src0 = srcRow(plane, c);
+        const SRCPIX* src1 = srcRow(plane, cOther);
+        for (int x = 0; x < chromaWidth; ++x) {
+            out[x] = ((0.75f * src0[x] + 0.25f * src1[x]) - _cOffset) * _cScale;
+        }
+    }
+
+    void convertYUVRow(int srcY,
+                       float* yRow,
+                       float* cbRow,
+                       float* crRow,
+                       float* cbOut,
+                       float* crOut,
+                       float* dstPix) const
+    {
+        const int width = _avFrame->width;
+        const SRCPIX* srcLuma = srcRow(0, srcY);
+
+        for (int x = 0; x < width; ++x) {
+            yRow[x] = (srcLuma[x] - _yOffset) * _yScale;
+        }
+        chromaRow(1, srcY, cbRow);
+        chromaRow(2, srcY, crRow);
+        for (int x = 0; x < width; ++x) {
+            const float w = _chromaXW[x];
+            cbOut[x] = cbRow[_chromaX0[x]] * (1.f - w) + cbRow[_chromaX1[x]] * w;
+            crOut[x] = crRow[_chromaX0[x]] * (1.f - w) + crRow[_chromaX1[x]] * w;
+        }
+        const SRCPIX* srcAlpha = _hasAlpha ? srcRow(3, srcY) : nullptr;
+        const int nComps = _dst.nComps;
+        for (int x = _dst.renderWindow.x1; x < _dst.renderWindow.x2; ++x) {
+            float* pix = dstPix + (x - _dst.bounds.x1) * nComps;
+            const int srcX = x - _dst.bounds.x1;
+            if ((srcX < 0) || (srcX >= width)) {
+                for (int c = 0; c < nComps; ++c) {
+                    pix[c] = 0.f;
+                }
+                continue;
+            }
+            const float a = srcAlpha ? srcAlpha[srcX] * _aScale : 1.f;
+            if (nComps == 1) {
+                pix[0] = srcAlpha ? a : 0.f;
+                continue;
+            }
+            const float luma = yRow[srcX];
+            const float cb = cbOut[srcX];
+            const float cr = crOut[srcX];
+            pix[0] = clamp01(luma + _crR * cr);
+            pix[1] = clamp01(luma + _cbG * cb + _crG * cr);
+            pix[2] = clamp01(luma + _cbB * cb);
+            if (nComps == 4) {
+                pix[3] = a;
+            }
+        }
+    } // convertYUVRow
+
+    void convertRGBRow(int srcY,
+                       float* dstPix) const
+    {
+        const SRCPIX* src = srcRow(0, srcY);
+        const int nComps = _dst.nComps;
+
+        for (int x = _dst.renderWindow.x1; x < _dst.renderWindow.x2; ++x) {
+            float* pix = dstPix + (x - _dst.bounds.x1) * nComps;
+            const int srcX = x - _dst.bounds.x1;
+            if ((srcX < 0) || (srcX >= _avFrame->width)) {
+                for (int c = 0; c < nComps; ++c) {
+                    pix[c] = 0.f;
+                }
+                continue;
+            }
+            const SRCPIX* srcPix = src + srcX * _nSrcComps;
+            if (nComps == 1) {
+                pix[0] = _hasAlpha ? srcPix[3] * _aScale : 0.f;
+                continue;
+            }
+            pix[0] = srcPix[0] * _yScale;
+            pix[1] = srcPix[1] * _yScale;
+            pix[2] = srcPix[2] * _yScale;
+            if (nComps == 4) {
+                pix[3] = _hasAlpha ? srcPix[3] * _aScale : 1.f;
+            }
+        }
+    }
+
+    static float clamp01(float v)
+    {
+        return (std::max)(0.f, (std::min)(v, 1.f));
+    }
+
+    const AVFrame* _avFrame;
+    const AVPixFmtDescriptor* _desc;
+    const FFmpegFile::FloatImage& _dst;
+    bool _isYUV;
+    bool _hasAlpha;
+    int _nSrcComps;
+    float _yScale;
+    float _yOffset;
+    float _cScale;
+    float _cOffset;
+    float _aScale;
+    float _crR;
+    float _cbG;
+    float _crG;
+    float _cbB;
+    std::vector<int> _chromaX0; // for each luma sample, left chroma sample
+    std::vector<int> _chromaX1; // for each luma sample, right chroma sample
+    std::vector<float> _chromaXW; // for each luma sample, weight of the right chroma sample
+};
+
+// true if the frame can be converted by FloatConverterProcessor
+bool
+FFmpegFile::canConvertToFloat(const AVFrame* avFrame) const
+{
+    AVPixelFormat pixFmt = (AVPixelFormat)avFrame->format;
+
+    // the packed RGB formats output by imageConvert()
+    if ((pixFmt == AV_PIX_FMT_RGB24) || (pixFmt == AV_PIX_FMT_RGBA) || (pixFmt == AV_PIX_FMT_RGB48LE) || (pixFmt == AV_PIX_FMT_RGBA64LE)) {
+        return true;
+    }
+
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(pixFmt);
+    if (!desc || (desc->flags & (AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_BITSTREAM | AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_BE))) {
+        return false;
+    }
+    if (!(desc->flags & AV_PIX_FMT_FLAG_PLANAR) || (desc->nb_components < 3) || (desc->log2_chroma_w > 1) || (desc->log2_chroma_h > 1)) {
+        return false;
+    }
+    const int depth = desc->comp[0].depth;
+    if ((depth < 8) || (depth > 16)) {
+        return false;
+    }
+    for (int c = 0; c < desc->nb_components; ++c) {
+        const AVComponentDescriptor& comp = desc->comp[c];
+        if ((comp.plane != c) || (comp.depth != depth) || (comp.step != ((depth > 8) ? 2 : 1)) || comp.shift || comp.offset) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool
+FFmpegFile::convertToFloat(const AVFrame* avFrame,
+                           const FloatImage& dst)
+{
+    IO::ProfileScope profiling("ffmpegConvert");
+
+    Stream* stream = _selectedStream;
+    AVPixelFormat pixFmt = (AVPixelFormat)avFrame->format;
+
+    // same colorspace and range logic as Stream::getConvertCtx()
+    bool rec709 = stream->isRec709Format();
+    if (stream->_colorMatrixTypeOverride > 0) {
+        rec709 = (stream->_colorMatrixTypeOverride == 1);
+    }
+    int colorRange = avFrame->color_range;
+    if ((colorRange == AVCOL_RANGE_UNSPECIFIED) &&
+        ((pixFmt == AV_PIX_FMT_YUVJ420P) || (pixFmt == AV_PIX_FMT_YUVJ422P) || (pixFmt == AV_PIX_FMT_YUVJ444P) || (pixFmt == AV_PIX_FMT_YUVJ440P))) {
+        colorRange = AVCOL_RANGE_JPEG;
+    }
+    bool fullRange;
+    switch (colorRange) {
+    case AVCOL_RANGE_MPEG:
+        fullRange = false;
+        break;
+    case AVCOL_RANGE_JPEG:
+        fullRange = true;
+        break;
+    case AVCOL_RANGE_UNSPECIFIED:
+    default:
+        fullRange = !stream->isYUV();
+        break;
+    }
+
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(pixFmt);
+    assert(desc);
+    if (desc->comp[0].depth > 8) {
+        FloatConverterProcessor<uint16_t> processor(avFrame, dst, fullRange, rec709);
+        processor.multiThread();
+    } else {
+        FloatConverterProcessor<uint8_t> processor(avFrame, dst, fullRange, rec709);
+        processor.multiThread();
+    }
+
+    return true;
+} // FFmpegFile::convertToFloat
+
 bool
 FFmpegFile::getFPS(double& fps,
                    unsigned streamIdx)
@@ -1539,20 +2736,129 @@ FFmpegFile::getBufferBytesCount() const
     return stream->_width * stream->_height * stream->_numberOfComponents * pixelDepth;
 }
 
+FFmpegThreadBudget::FFmpegThreadBudget()
+    : _lock()
+    , _codecs()
+{
+}
+
+FFmpegThreadBudget&
+FFmpegThreadBudget::instance()
+{
+    static FFmpegThreadBudget budget;
+
+    return budget;
+}
+
+int
+FFmpegThreadBudget::getBudget() const
+{
+    static const int budget = []() {
+        const char* threads = std::getenv("OFX_FFMPEG_THREADS");
+        int n = threads ? std::atoi(threads) : 0;
+
+        return (n > 0) ? n : (std::max)(1, (int)MultiThread::getNumCPUs());
+    }();
+
+    return budget;
+}
+
+int
+FFmpegThreadBudget::getThreadCount() const
+{
+    const int budget = getBudget();
+    const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    int active = 1; // the codec being opened
+    int used = 0;
+    {
+        AutoMutex guard(_lock);
+        for (std::map<const AVCodecContext*, CodecState>::const_iterator it = _codecs.begin(); it != _codecs.end(); ++it) {
+            if (now - it->second.lastUsed < std::chrono::seconds(OFX_FFMPEG_THREADS_ACTIVE_SECONDS)) {
+                ++active;
+                used += it->second.threads;
+            }
+        }
+    }
+    // at least the fair share, or what the active codecs leave
+    const int count = (std::max)(budget / active, budget - used);
+
+    return (std::max)(1, (std::min)(count, OFX_FFMPEG_MAX_THREADS));
+}
+
+void
+FFmpegThreadBudget::setupThreads(AVCodecContext* codecCtx,
+                                 const AVCodec* codec)
+{
+    const int count = getThreadCount();
+
+    codecCtx->thread_count = count;
+    if ((count <= 1) || !codec) {
+        return;
+    }
+    const bool sliceThreads = (codec->capabilities & AV_CODEC_CAP_SLICE_THREADS) != 0;
+    const bool frameThreads = (codec->capabilities & AV_CODEC_CAP_FRAME_THREADS) != 0;
+    const AVCodecDescriptor* desc = avcodec_descriptor_get(codec->id);
+    const bool intraOnly = desc && (desc->props & AV_CODEC_PROP_INTRA_ONLY);
+    if (sliceThreads && (!frameThreads || intraOnly || (count < OFX_FFMPEG_FRAME_THREADS_MIN))) {
+        // multiple threads are used to decode a single frame. Reduces delay
+        // also, mjpeg prefers this, see libavfocodec/frame_thread_encoder.c:ff_frame_thread_encoder_init()
+        codecCtx->thread_type = FF_THREAD_SLICE;
+    } else if (frameThreads) {
+        // consecutive frames are decoded in parallel, which adds thread_count frames of delay (see getCodecDelay())
+        codecCtx->thread_type = FF_THREAD_FRAME;
+    }
+}
+
+void
+FFmpegThreadBudget::add(const AVCodecContext* codecCtx)
+{
+    AutoMutex guard(_lock);
+    CodecState& state = _codecs[codecCtx];
+
+    state.threads = (std::max)(1, codecCtx->thread_count);
+    state.lastUsed = std::chrono::steady_clock::now();
+}
+
+void
+FFmpegThreadBudget::remove(const AVCodecContext* codecCtx)
+{
+    AutoMutex guard(_lock);
+
+    _codecs.erase(codecCtx);
+}
+
+void
+FFmpegThreadBudget::touch(const AVCodecContext* codecCtx)
+{
+    AutoMutex guard(_lock);
+    std::map<const AVCodecContext*, CodecState>::iterator it = _codecs.find(codecCtx);
+
+    if (it != _codecs.end()) {
+        it->second.lastUsed = std::chrono::steady_clock::now();
+    }
+}
+
 FFmpegFileManager::FFmpegFileManager()
     : _files()
     , _lock(nullptr)
+    , _decoders()
+    , _decodersBytes(0)
 {
 }
 
 FFmpegFileManager::~FFmpegFileManager()
 {
+    if (_lock) {
+        OFX::IO::MemoryGovernor::instance().remove(this);
+    }
     for (FilesMap::iterator it = _files.begin(); it != _files.end(); ++it) {
         for (std::list<FFmpegFile*>::iterator it2 = it->second.begin(); it2 != it->second.end(); ++it2) {
             delete *it2;
         }
     }
     _files.clear();
+    _decoders.clear();
+    _decodersBytes = 0;
     delete _lock;
 }
 
@@ -1560,6 +2866,69 @@ void
 FFmpegFileManager::init()
 {
     _lock = new FFmpegFile::Mutex;
+    OFX::IO::MemoryGovernor::instance().add(this, "Video decoders (ReadFFmpeg)", OFX::IO::MemoryGovernor::ePriorityHigh);
+}
+
+// open a new instance of the file and add it to the pool (the caller must hold _lock)
+FFmpegFile*
+FFmpegFileManager::createLocked(std::list<FFmpegFile*>& fileList,
+                                const string& filename,
+                                FFmpegFile::FrameIndexModeEnum indexMode,
+                                FFmpegFile::HWAccelEnum hwAccel) const
+{
+    FFmpegFile* file = new FFmpegFile(filename, indexMode, hwAccel);
+
+    fileList.push_back(file);
+    DecoderState& state = _decoders[file];
+    state.bytes = file->getBufferBytesCount() * OFX_FFMPEG_POOL_DECODER_FRAMES;
+    _decodersBytes += state.bytes;
+
+    return file;
+}
+
+// delete the file if it is not in use, return false if it is (the caller must hold _lock)
+bool
+FFmpegFileManager::destroyLocked(FFmpegFile* file) const
+{
+    DecoderStateMap::iterator state = _decoders.find(file);
+
+    if (state != _decoders.end()) {
+        if (state->second.users > 0) {
+            return false;
+        }
+        assert(_decodersBytes >= state->second.bytes);
+        _decodersBytes -= state->second.bytes;
+        _decoders.erase(state);
+    }
+    delete file;
+
+    return true;
+}
+
+// true if the file was removed by clear() while in use (the caller must hold _lock)
+bool
+FFmpegFileManager::isStaleLocked(const FFmpegFile* file) const
+{
+    DecoderStateMap::const_iterator state = _decoders.find(file);
+
+    return (state != _decoders.end()) && state->second.stale;
+}
+
+// remove the file from the list of its plug-in instance, without deleting it (the caller must hold _lock)
+void
+FFmpegFileManager::eraseLocked(const FFmpegFile* file) const
+{
+    for (FilesMap::iterator it = _files.begin(); it != _files.end(); ++it) {
+        std::list<FFmpegFile*>::iterator found = std::find(it->second.begin(), it->second.end(), file);
+        if (found != it->second.end()) {
+            it->second.erase(found);
+            if ( it->second.empty() ) {
+                _files.erase(it);
+            }
+
+            return;
+        }
+    }
 }
 
 void
@@ -1569,10 +2938,18 @@ FFmpegFileManager::clear(void const* plugin)
     FFmpegFile::AutoMutex guard(*_lock);
     FilesMap::iterator found = _files.find(plugin);
     if (found != _files.end()) {
-        for (std::list<FFmpegFile*>::iterator it = found->second.begin(); it != found->second.end(); ++it) {
-            delete *it;
+        for (std::list<FFmpegFile*>::iterator it = found->second.begin(); it != found->second.end();) {
+            if ( destroyLocked(*it) ) {
+                it = found->second.erase(it);
+            } else {
+                // still acquired by a render: mark it stale, it is closed by its last release()
+                _decoders[*it].stale = true;
+                ++it;
+            }
+        }
+        if ( found->second.empty() ) {
+            _files.erase(found);
         }
-        _files.erase(found);
     }
 }
 
@@ -1588,10 +2965,11 @@ FFmpegFileManager::get(void const* plugin,
     FilesMap::iterator found = _files.find(plugin);
     if (found != _files.end()) {
         for (std::list<FFmpegFile*>::iterator it = found->second.begin(); it != found->second.end(); ++it) {
-            if ((*it)->getFilename() == filename) {
+            if (((*it)->getFilename() == filename) && !isStaleLocked(*it)) {
                 if ((*it)->isInvalid()) {
-                    delete *it;
-                    found->second.erase(it);
+                    if (destroyLocked(*it)) {
+                        found->second.erase(it);
+                    }
                     break;
                 } else {
                     return *it;
@@ -1605,36 +2983,242 @@ FFmpegFileManager::get(void const* plugin,
 
 FFmpegFile*
 FFmpegFileManager::getOrCreate(void const* plugin,
-                               const string& filename) const
+                               const string& filename,
+                               FFmpegFile::FrameIndexModeEnum indexMode,
+                               FFmpegFile::HWAccelEnum hwAccel) const
 {
     if (filename.empty() || !plugin) {
         return 0;
     }
     assert(_lock);
-    FFmpegFile::AutoMutex guard(*_lock);
-    FilesMap::iterator found = _files.find(plugin);
-    if (found != _files.end()) {
-        for (std::list<FFmpegFile*>::iterator it = found->second.begin(); it != found->second.end(); ++it) {
-            if ((*it)->getFilename() == filename) {
+    FFmpegFile* file = nullptr;
+    std::size_t createdBytes = 0;
+    {
+        FFmpegFile::AutoMutex guard(*_lock);
+        std::list<FFmpegFile*>& fileList = _files[plugin];
+        for (std::list<FFmpegFile*>::iterator it = fileList.begin(); it != fileList.end(); ++it) {
+            if (((*it)->getFilename() == filename) && !isStaleLocked(*it)) {
                 if ((*it)->isInvalid()) {
-                    delete *it;
-                    found->second.erase(it);
+                    if (destroyLocked(*it)) {
+                        fileList.erase(it);
+                    }
                     break;
                 } else {
                     return *it;
                 }
             }
         }
-    }
 
-    FFmpegFile* file = new FFmpegFile(filename);
-    if (found == _files.end()) {
-        std::list<FFmpegFile*> fileList;
-        fileList.push_back(file);
-        _files.insert(make_pair(plugin, fileList));
-    } else {
-        found->second.push_back(file);
+        file = createLocked(fileList, filename, indexMode, hwAccel);
+        createdBytes = _decoders[file].bytes;
+    }
+    if (createdBytes > 0) {
+        // the first decoder cannot be evicted, but it counts in the budget of the other caches
+        OFX::IO::MemoryGovernor::instance().grew(createdBytes);
     }
 
     return file;
 }
+
+// cost of decoding the given frame with a decoder positioned at the given frame, 1 per decoded frame
+static int
+decoderSeekCost(int position,
+                int frame)
+{
+    const int seekCost = 1 << 20;
+
+    if (position == INT_MIN) {
+        return seekCost;
+    }
+    if (frame >= position) {
+        // decode forward
+        return frame - position;
+    }
+
+    return seekCost + (position - frame);
+}
+
+FFmpegFile*
+FFmpegFileManager::acquire(void const* plugin,
+                           const string& filename,
+                           int frame,
+                           int maxDecoders,
+                           FFmpegFile::FrameIndexModeEnum indexMode,
+                           FFmpegFile::HWAccelEnum hwAccel) const
+{
+    if (filename.empty() || !plugin) {
+        return 0;
+    }
+    assert(_lock);
+    FFmpegFile* acquired = nullptr;
+    std::size_t createdBytes = 0;
+    {
+        FFmpegFile::AutoMutex guard(*_lock);
+        std::list<FFmpegFile*>& fileList = _files[plugin];
+        FFmpegFile* bestIdle = nullptr;
+        int bestIdleCost = INT_MAX;
+        FFmpegFile* bestBusy = nullptr;
+        int bestBusyUsers = INT_MAX;
+        int bestBusyCost = INT_MAX;
+        int nDecoders = 0;
+
+        for (std::list<FFmpegFile*>::iterator it = fileList.begin(); it != fileList.end();) {
+            FFmpegFile* file = *it;
+            if ((file->getFilename() != filename) || isStaleLocked(file)) {
+                ++it;
+                continue;
+            }
+            if (file->isInvalid()) {
+                if (destroyLocked(file)) {
+                    it = fileList.erase(it);
+                } else {
+                    ++it;
+                }
+                continue;
+            }
+            ++nDecoders;
+            const DecoderState& state = _decoders[file];
+            int cost = decoderSeekCost(state.position, frame);
+            // the read-ahead thread of the first decoder counts as a user: its decodes would serialize with
+            // this render, and this render would move the decoder away from the playhead
+            const int users = state.users + ( ( !state.extra && file->isReadingAhead() ) ? 1 : 0 );
+            if (users == 0) {
+                if (cost < bestIdleCost) {
+                    bestIdle = file;
+                    bestIdleCost = cost;
+                }
+            } else if ((users < bestBusyUsers) || ((users == bestBusyUsers) && (cost < bestBusyCost))) {
+                bestBusy = file;
+                bestBusyUsers = users;
+                bestBusyCost = cost;
+            }
+            ++it;
+        }
+
+        FFmpegFile* file = nullptr;
+        // the first decoder of a file is always opened, others only within the pool budget
+        // (a new decoder uses as much memory as the existing ones)
+        FFmpegFile* existing = bestIdle ? bestIdle : bestBusy;
+        bool canCreate = (nDecoders == 0) ||
+                         ((nDecoders < maxDecoders) &&
+                          (_decoders.size() < OFX_FFMPEG_POOL_MAX_DECODERS) &&
+                          (_decodersBytes + _decoders[existing].bytes <= OFX_FFMPEG_POOL_MAX_BYTES));
+        if (bestIdle && (bestIdleCost <= OFX_FFMPEG_POOL_NEAR_FRAMES)) {
+            file = bestIdle;
+        } else if (canCreate) {
+            file = createLocked(fileList, filename, indexMode, hwAccel);
+            _decoders[file].extra = (nDecoders > 0);
+            createdBytes = _decoders[file].bytes;
+        } else {
+            file = existing;
+        }
+        assert(file);
+        DecoderState& state = _decoders[file];
+        ++state.users;
+        state.position = frame;
+        acquired = file;
+    }
+    if (createdBytes > 0) {
+        // the governor may close idle decoders: call it without holding _lock
+        OFX::IO::MemoryGovernor::instance().grew(createdBytes);
+    }
+
+    return acquired;
+} // FFmpegFileManager::acquire
+
+void
+FFmpegFileManager::release(FFmpegFile* file) const
+{
+    assert(_lock);
+    FFmpegFile::AutoMutex guard(*_lock);
+    DecoderStateMap::iterator state = _decoders.find(file);
+    if ((state != _decoders.end()) && (state->second.users > 0)) {
+        --state->second.users;
+        state->second.lastUsed = std::chrono::steady_clock::now();
+        if ((state->second.users == 0) && state->second.stale) {
+            // the plug-in instance cleared its files while this render was using it
+            eraseLocked(file);
+            destroyLocked(file);
+        }
+    }
+}
+
+FFmpegFileManager::DecoderStateMap::iterator
+FFmpegFileManager::findOldestIdleLocked() const
+{
+    DecoderStateMap::iterator oldest = _decoders.end();
+
+    for (DecoderStateMap::iterator it = _decoders.begin(); it != _decoders.end(); ++it) {
+        if (it->second.extra && (it->second.users == 0) && ((oldest == _decoders.end()) || (it->second.lastUsed < oldest->second.lastUsed))) {
+            oldest = it;
+        }
+    }
+
+    return oldest;
+}
+
+std::size_t
+FFmpegFileManager::getMemoryBytes()
+{
+    FFmpegFile::AutoMutex guard(*_lock);
+    // the first decoder of each file is counted, even though only the extra decoders can be evicted
+    std::size_t bytes = _decodersBytes;
+
+    for (FilesMap::const_iterator it = _files.begin(); it != _files.end(); ++it) {
+        for (std::list<FFmpegFile*>::const_iterator it2 = it->second.begin(); it2 != it->second.end(); ++it2) {
+            bytes += (*it2)->getReadAheadBytesCount();
+        }
+    }
+
+    return bytes;
+}
+
+bool
+FFmpegFileManager::getOldestUse(std::chrono::steady_clock::time_point* lastUse)
+{
+    FFmpegFile::AutoMutex guard(*_lock);
+    DecoderStateMap::iterator oldest = findOldestIdleLocked();
+
+    if (oldest == _decoders.end()) {
+        return false;
+    }
+    *lastUse = oldest->second.lastUsed;
+
+    return true;
+}
+
+std::size_t
+FFmpegFileManager::evictOldest()
+{
+    FFmpegFile::AutoMutex guard(*_lock);
+    DecoderStateMap::iterator oldest = findOldestIdleLocked();
+
+    if (oldest == _decoders.end()) {
+        return 0;
+    }
+    FFmpegFile* file = const_cast<FFmpegFile*>(oldest->first);
+    const std::size_t bytes = oldest->second.bytes;
+    // the plug-in instance gets a new decoder at its next render
+    eraseLocked(file);
+    destroyLocked(file);
+
+    return bytes;
+}
+
+void
+FFmpegFileManager::purge()
+{
+    FFmpegFile::AutoMutex guard(*_lock);
+
+    // the first decoder of each file may be used without acquire(): it is closed by clear()
+    for (FilesMap::iterator it = _files.begin(); it != _files.end(); ++it) {
+        for (std::list<FFmpegFile*>::iterator it2 = it->second.begin(); it2 != it->second.end();) {
+            DecoderStateMap::iterator state = _decoders.find(*it2);
+            if ((state != _decoders.end()) && state->second.extra && destroyLocked(*it2)) {
+                it2 = it->second.erase(it2);
+            } else {
+                ++it2;
+            }
+        }
+    }
+}
@@ -33,6 +33,9 @@
 #endif
 
 #include <algorithm>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
 #include <cstdio>
 #include <list>
 #include <locale>
@@ -46,6 +49,7 @@ extern "C" {
 #include <libavformat/avio.h>
 #include <libavutil/avutil.h>
 #include <libavutil/error.h>
+#include <libavutil/hwcontext.h>
 #include <libavutil/imgutils.h>
 #include <libavutil/opt.h>
 #include <libswscale/swscale.h>
@@ -57,6 +61,9 @@ extern "C" {
 // prefer using the fast mutex by Marcus Geelnard http://tinythreadpp.bitsnbites.eu/
 #include "fast_mutex.h"
 #endif
+#include "tinythread.h" // for tthread::thread and tthread::mutex
+
+#include "IOMemoryGovernor.h"
 
 #define CHECKMSG(x, msg)         \
     {                            \
@@ -89,6 +96,17 @@ extern "C" {
 
 #define OFX_FFMPEG_MAX_THREADS 16 // MAX_AUTO_THREADS in libavcodec/pthread_internal.h. 32 in libavcodec/mpegvideo.h, 16 in libavcodec/hevcdec.h, 8 in libavcodec/vp8.h
 
+// Codec thread budget, see FFmpegThreadBudget
+#define OFX_FFMPEG_THREADS_ACTIVE_SECONDS 10 // a codec is active if it decoded or encoded in the last seconds
+#define OFX_FFMPEG_FRAME_THREADS_MIN 4 // inter-frame codecs use frame threading if they get at least that many threads
+
+// Decoder pool, see FFmpegFileManager::acquire()
+#define OFX_FFMPEG_POOL_MAX_DECODERS 16 // maximum number of pooled decoders, for all files
+#define OFX_FFMPEG_POOL_MAX_BYTES (std::size_t(2) << 30) // maximum estimated memory used by pooled decoders, for all files
+#define OFX_FFMPEG_POOL_DECODER_FRAMES 8 // estimated number of frames held by a decoder (references, threads)
+#define OFX_FFMPEG_POOL_NEAR_FRAMES 32 // a decoder is reused without opening another one if it is at most that many frames before the requested frame
+#define OFX_FFMPEG_READAHEAD_IDLE_SECONDS 5 // the read-ahead thread stops and frees its buffers after that many seconds without playback
+
 ////////////////////////////////////////////////////////////////////////////////
 // Chunksize static names.
 ////////////////////////////////////////////////////////////////////////////////
@@ -124,6 +142,59 @@ private:
     AVPacket* _pkt;
 };
 
+/**
+ * @brief Process-wide budget of the threads of the codecs opened by all the ReadFFmpeg and WriteFFmpeg instances.
+ * Each codec would otherwise use getNumCPUs() threads, and a comp with many readers runs hundreds of threads.
+ *
+ * The thread count of a codec cannot change once it is opened: when a codec is opened, it gets its share
+ * of the budget among the codecs that are active (that decoded or encoded recently), or more if the active
+ * codecs leave threads unused. Idle codecs are not counted, so that readers of a comp which are not rendered
+ * do not reduce the threads of the others.
+ *
+ * The budget is the number of CPUs, or the value of the OFX_FFMPEG_THREADS environment variable.
+ */
+class FFmpegThreadBudget {
+public:
+    static FFmpegThreadBudget& instance();
+
+    /// the number of threads shared by all codecs
+    int getBudget() const;
+
+    /// Set the thread count and threading type of a codec context that is about to be opened.
+    /// Slice threading has no latency, but long-GOP formats usually have few slices per frame: these
+    /// use frame threading if they get enough threads, and intra-only formats use slice threading.
+    void setupThreads(AVCodecContext* codecCtx, const AVCodec* codec);
+
+    /// register an opened codec context, which must be removed before it is freed
+    void add(const AVCodecContext* codecCtx);
+    void remove(const AVCodecContext* codecCtx);
+
+    /// mark the codec context as active, called for each decoded or encoded packet
+    void touch(const AVCodecContext* codecCtx);
+
+private:
+#ifdef OFX_USE_MULTITHREAD_MUTEX
+    typedef OFX::MultiThread::Mutex Mutex;
+    typedef OFX::MultiThread::AutoMutex AutoMutex;
+#else
+    typedef tthread::fast_mutex Mutex;
+    typedef OFX::MultiThread::AutoMutexT<tthread::fast_mutex> AutoMutex;
+#endif
+
+    struct CodecState {
+        int threads;
+        std::chrono::steady_clock::time_point lastUsed;
+    };
+
+    FFmpegThreadBudget();
+
+    /// the number of threads for a codec that is about to be opened
+    int getThreadCount() const;
+
+    mutable Mutex _lock;
+    std::map<const AVCodecContext*, CodecState> _codecs;
+};
+
 class FFmpegFile {
 public:
 #ifdef OFX_USE_MULTITHREAD_MUTEX
@@ -134,7 +205,55 @@ public:
     typedef OFX::MultiThread::AutoMutexT<tthread::fast_mutex> AutoMutex;
 #endif
 
+    // How the keyframe index of a file is obtained, see FFmpegFile::StreamIndex
+    enum FrameIndexModeEnum {
+        eFrameIndexModeNone = 0, // do not use an index
+        eFrameIndexModeOnOpen, // build the index when opening the file, if not in the cache
+        eFrameIndexModeBackground, // build the index in a background thread, if not in the cache
+    };
+
+    // Hardware-accelerated decoding device. Decoding falls back to software if the device is
+    // not available or the codec/profile is not supported by the device.
+    enum HWAccelEnum {
+        eHWAccelNone = 0, // software decoding
+        eHWAccelAuto, // first device type supported by the decoder that can be opened
+        eHWAccelCUDA, // NVDEC
+        eHWAccelVAAPI,
+        eHWAccelVideoToolbox,
+        eHWAccelD3D11VA,
+    };
+
+    // Destination of decodeFloat(): a host image, with rows stored bottom-up.
+    struct FloatImage {
+        float* pixelData;
+        OfxRectI bounds; // bounds of pixelData
+        OfxRectI renderWindow; // part of the image to fill
+        int nComps; // 1 (Alpha), 3 (RGB) or 4 (RGBA)
+        int rowBytes;
+    };
+
 private:
+    // timestamps of a keyframe in a stream
+    struct IndexEntry {
+        int64_t pts;
+        int64_t dts;
+    };
+
+    // Keyframe index of a stream, obtained by demuxing the whole file once. It is stored in an index
+    // cache file keyed by the file path, size and modification time, so that it is only built once.
+    struct StreamIndex {
+        StreamIndex()
+            : keyframes()
+            , maxPts(AV_NOPTS_VALUE)
+        {
+        }
+
+        std::vector<IndexEntry> keyframes; // sorted by pts
+        int64_t maxPts; // largest pts in the stream, AV_NOPTS_VALUE if unknown
+    };
+
+    typedef std::map<int, StreamIndex> StreamIndexMap; // stream index -> keyframe index
+
     struct Stream {
         int _idx; // stream index
         AVStream* _avstream; // video stream
@@ -142,6 +261,8 @@ private:
         const AVCodec* _videoCodec;
         AVFrame* _avFrame; // decoding frame
         AVFrame* _avIntermediateFrame; // decode into this if an image conversion is required
+        AVFrame* _avHWTransferFrame; // hardware frames are downloaded into this before conversion
+        AVBufferRef* _hwDeviceCtx; // hardware device used by the decoder, or nullptr for software decoding
         SwsContext* _convertCtx;
         bool _resetConvertCtx;
 
@@ -175,6 +296,7 @@ private:
         int _accumDecodeLatency; // The number of frames that have been input without any frame being output so far in this stream
         // since the last seek. This is part of a guard mechanism to detect when decode appears to have
         // stalled and ensure that FFmpegFile::decode() does not loop indefinitely.
+        StreamIndex _index; // keyframe index, empty if not built (yet)
 
         Stream()
             : _idx(0)
@@ -183,6 +305,8 @@ private:
             , _videoCodec(nullptr)
             , _avFrame(nullptr)
             , _avIntermediateFrame(nullptr)
+            , _avHWTransferFrame(nullptr)
+            , _hwDeviceCtx(nullptr)
             , _convertCtx(nullptr)
             , _resetConvertCtx(true)
             , _fpsNum(1)
@@ -203,6 +327,7 @@ private:
             , _decodeNextFrameIn(-1)
             , _decodeNextFrameOut(-1)
             , _accumDecodeLatency(0)
+            , _index()
         {
             // The purpose of this is to avoid an RGB->RGB conversion.
             // This saves memory and improves performance. For example
@@ -223,11 +348,20 @@ private:
                 av_free(_avFrame);
             }
 
+            if (_avHWTransferFrame) {
+                av_frame_free(&_avHWTransferFrame);
+            }
+
             if (_codecContext) {
+                FFmpegThreadBudget::instance().remove(_codecContext);
                 avcodec_flush_buffers(_codecContext);
                 avcodec_free_context(&_codecContext);
             }
 
+            if (_hwDeviceCtx) {
+                av_buffer_unref(&_hwDeviceCtx);
+            }
+
             if (_convertCtx) {
                 sws_freeContext(_convertCtx);
             }
@@ -257,7 +391,7 @@ private:
             // guard against division by zero
             assert(denominator);
 
-            return _startPTS + denominator ? (numerator / denominator) : numerator;
+            return _startPTS + (denominator ? (numerator / denominator) : numerator);
         }
 
         int ptsToFrame(int64_t pts) const
@@ -271,6 +405,16 @@ private:
             return static_cast<int>(denominator ? (numerator / denominator) : numerator);
         }
 
+        // Return the position in _index.keyframes of the last keyframe at or before the given 0-based
+        // frame, or -1 if there is no index or the frame is before the first keyframe.
+        int indexedKeyframeForFrame(int frame) const
+        {
+            std::vector<IndexEntry>::const_iterator it = std::upper_bound(_index.keyframes.begin(), _index.keyframes.end(), frame,
+                                                                          [this](int f, const IndexEntry& e) { return f < ptsToFrame(e.pts); });
+
+            return (int)(it - _index.keyframes.begin()) - 1;
+        }
+
         bool isRec709Format()
         {
             // First check for codecs which require special handling:
@@ -289,7 +433,12 @@ private:
         bool isYUV() const
         {
             // from swscale_internal.h
-            const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(_codecContext->pix_fmt);
+            AVPixelFormat pixFmt = _codecContext->pix_fmt;
+            if (_hwDeviceCtx && (_codecContext->sw_pix_fmt != AV_PIX_FMT_NONE)) {
+                // pix_fmt is the hardware surface format once decoding started
+                pixFmt = _codecContext->sw_pix_fmt;
+            }
+            const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(pixFmt);
 
             return !(desc->flags & AV_PIX_FMT_FLAG_RGB) && desc->nb_components >= 2;
         }
@@ -334,6 +483,56 @@ private:
     mutable Mutex _invalidStateLock;
 #endif
 
+    // Playback read-ahead: a background thread decodes the frames following the playhead
+    // into a ring buffer, see decodePlayback(). The frames are converted to float by the render,
+    // the same way as in decodeFloat().
+    struct ReadAheadFrame {
+        ReadAheadFrame()
+            : frame(INT_MIN)
+            , streamIdx(-1)
+            , busy(false)
+            , decoded(nullptr)
+            , data()
+        {
+        }
+
+        ~ReadAheadFrame()
+        {
+            av_frame_free(&decoded);
+        }
+
+        int frame; // 1-based frame index (being decoded if busy), INT_MIN if the slot is free
+        int streamIdx; // index of the stream the frame was decoded from
+        bool busy; // true while the read-ahead thread decodes into this slot
+        AVFrame* decoded; // reference to the decoded frame, if convertToFloat() can convert it
+        std::vector<unsigned char> data; // RGB frame otherwise
+    };
+
+    tthread::thread* _readAheadThread;
+    tthread::mutex _readAheadMutex; // protects all the _readAhead* members below
+    std::condition_variable_any _readAheadCond; // tinythread has no timed wait
+    std::chrono::steady_clock::time_point _readAheadLastRequest; // last call to decodePlayback()
+    bool _readAheadExited; // true if the read-ahead thread stopped by itself because playback was idle
+    std::vector<ReadAheadFrame*> _readAheadRing;
+    int _readAheadPlayhead; // last frame requested by decodePlayback(), INT_MIN if idle
+    int _readAheadDirection; // 1 when playing forward, -1 when playing backward
+    int _readAheadDepth; // number of frames to decode ahead of the playhead
+    int _readAheadStreamIdx; // stream selected when the playhead was set
+    int _readAheadLastFrame; // last frame of the selected stream
+    bool _readAheadQuit;
+
+    // direct conversion to float, see decodeFloat()
+    const FloatImage* _floatOutput; // destination of the frame being decoded by decodeFloat(), or nullptr
+    AVFrame* _decodedOutput; // slot of the frame being decoded by the read-ahead thread, or nullptr
+    bool _floatOutputDone; // true if the frame was converted directly to _floatOutput, or referenced by _decodedOutput
+    std::vector<unsigned char> _floatFallbackBuffer; // RGB frame, for pixel formats that cannot be converted directly
+
+    bool decodeLocked(int frame, bool loadNearest, unsigned char* buffer);
+    bool decodeReadAhead(int frame, ReadAheadFrame* slot);
+    bool canConvertToFloat(const AVFrame* avFrame) const;
+    bool convertToFloat(const AVFrame* avFrame, const FloatImage& dst);
+    bool convertBufferToFloat(const unsigned char* buffer, const FloatImage& dst);
+
     // set reader error
     void setError(const char* msg, const char* prefix = 0);
 
@@ -355,11 +554,26 @@ private:
 
     bool seekFrame(int frame, Stream* stream);
 
+    // keyframe index management
+    tthread::thread* _indexThread; // builds the index in the background
+    tthread::mutex _indexMutex; // protects _indexQuit, _pendingIndex and _pendingIndexReady
+    bool _indexQuit;
+    StreamIndexMap _pendingIndex; // index built by _indexThread, not yet given to the streams
+    bool _pendingIndexReady;
+
+    std::string getIndexCacheFilename() const;
+    bool loadIndex(StreamIndexMap* indices) const;
+    void saveIndex(const StreamIndexMap& indices) const;
+    bool buildIndex(StreamIndexMap* indices);
+    void installPendingIndex();
+    static void indexThreadFunction(void* arg);
+    static int indexInterruptCallback(void* arg);
+
 public:
     // FFmpegFile();
 
     // constructor
-    FFmpegFile(const std::string& filename);
+    FFmpegFile(const std::string& filename, FrameIndexModeEnum indexMode = eFrameIndexModeNone, HWAccelEnum hwAccel = eHWAccelNone);
 
     // destructor
     ~FFmpegFile();
@@ -506,6 +720,25 @@ public:
     // decode a single frame into the buffer. Thread safe
     bool decode(const OFX::ImageEffect* plugin, int frame, bool loadNearest, unsigned char* buffer);
 
+    // Decode a single frame directly into a float image. Planar YUV frames are converted in a single
+    // multithreaded pass, without the intermediate 8/16-bit RGB frame. Thread safe
+    bool decodeFloat(const OFX::ImageEffect* plugin, int frame, bool loadNearest, const FloatImage& dst);
+
+    // decode a single frame into a float image during playback. If readAheadDepth > 0, a background
+    // thread decodes the readAheadDepth frames following (in the playback direction) the requested
+    // frame, so that the next calls usually only convert an already decoded frame, with the same
+    // conversion as decodeFloat(). Thread safe
+    bool decodePlayback(const OFX::ImageEffect* plugin, int frame, bool loadNearest, int readAheadDepth, const FloatImage& dst);
+
+    // stop the read-ahead thread and free the read-ahead buffers
+    void stopReadAhead();
+
+    // memory used by the read-ahead buffers, in bytes. Thread safe
+    std::size_t getReadAheadBytesCount();
+
+    // true while the read-ahead thread runs, i.e. while it may use the decoder. Thread safe
+    bool isReadingAhead();
+
     // get stream information
     bool getFPS(double& fps,
                 unsigned streamIdx = 0);
@@ -531,19 +764,72 @@ public:
     static bool isCodecWhitelistedForWriting(const char* name);
 
 private:
+    static void readAheadThreadFunction(void* arg);
+
+    void readAheadLoop();
+
+    bool isInReadAheadWindow(int frame) const;
+
     bool seekToFrame(int64_t frame, int seekFlags);
 
+    bool seekToIndexedKeyframe(int keyframe);
+
     bool demuxAndDecode(AVFrame* avFrameOut, int64_t frame);
 
     bool imageConvert(AVFrame* avFrameIn, AVFrame* avFrameOut);
+
+    AVFrame* downloadHWFrame(AVFrame* avFrame);
 };
 
-class FFmpegFileManager {
-    /// For each plug-in instance, a list of opened files
+// The idle extra decoders of the pool are also closed by the MemoryGovernor when the caches of the plugins exceed their budget.
+class FFmpegFileManager
+    : private OFX::IO::MemoryGovernor::Client {
+    /// For each plug-in instance, a list of opened files. The same file may be opened several times
+    /// (the decoder pool, see acquire()).
     typedef std::map<void const*, std::list<FFmpegFile*>> FilesMap;
     mutable FilesMap _files;
     mutable FFmpegFile::Mutex* _lock;
 
+    // state of each opened file in the decoder pool
+    struct DecoderState {
+        DecoderState()
+            : users(0)
+            , position(INT_MIN)
+            , bytes(0)
+            , lastUsed()
+            , extra(false)
+            , stale(false)
+        {
+        }
+
+        int users; // number of acquire() not released yet
+        int position; // last frame acquired for, INT_MIN if none
+        std::size_t bytes; // estimated memory used by the decoder
+        std::chrono::steady_clock::time_point lastUsed; // last release()
+        bool extra; // not the first decoder of the file, which get() and getOrCreate() return without counting users
+        bool stale; // removed by clear() while still acquired: closed by its last release(), never returned again
+    };
+
+    typedef std::map<const FFmpegFile*, DecoderState> DecoderStateMap;
+    mutable DecoderStateMap _decoders;
+    mutable std::size_t _decodersBytes; // sum of DecoderState::bytes
+
+    FFmpegFile* createLocked(std::list<FFmpegFile*>& fileList,
+                             const std::string& filename,
+                             FFmpegFile::FrameIndexModeEnum indexMode,
+                             FFmpegFile::HWAccelEnum hwAccel) const;
+    bool destroyLocked(FFmpegFile* file) const;
+    bool isStaleLocked(const FFmpegFile* file) const;
+    void eraseLocked(const FFmpegFile* file) const;
+
+    // the least recently used idle extra decoder, _decoders.end() if there is none (the caller must hold _lock)
+    DecoderStateMap::iterator findOldestIdleLocked() const;
+
+    virtual std::size_t getMemoryBytes() OVERRIDE FINAL;
+    virtual bool getOldestUse(std::chrono::steady_clock::time_point* lastUse) OVERRIDE FINAL;
+    virtual std::size_t evictOldest() OVERRIDE FINAL;
+    virtual void purge() OVERRIDE FINAL;
+
 public:
     FFmpegFileManager();
 
@@ -554,7 +840,45 @@ public:
     void clear(void const* plugin);
 
     FFmpegFile* get(void const* plugin, const std::string& filename) const;
-    FFmpegFile* getOrCreate(void const* plugin, const std::string& filename) const;
+    FFmpegFile* getOrCreate(void const* plugin,
+                            const std::string& filename,
+                            FFmpegFile::FrameIndexModeEnum indexMode = FFmpegFile::eFrameIndexModeNone,
+                            FFmpegFile::HWAccelEnum hwAccel = FFmpegFile::eHWAccelNone) const;
+
+    // Get the opened instance of the file that is best suited to decode the given frame, without waiting
+    // for another render or for the read-ahead thread: an idle decoder positioned a few frames before it, or else a new decoder if the
+    // file has less than maxDecoders instances and the global pool budget allows it, or else the
+    // nearest idle decoder, or else the least used one (whose lock will serialize decodes).
+    // The returned file must be given back with release().
+    FFmpegFile* acquire(void const* plugin,
+                        const std::string& filename,
+                        int frame,
+                        int maxDecoders,
+                        FFmpegFile::FrameIndexModeEnum indexMode = FFmpegFile::eFrameIndexModeNone,
+                        FFmpegFile::HWAccelEnum hwAccel = FFmpegFile::eHWAccelNone) const;
+    void release(FFmpegFile* file) const;
+
+    // releases a file acquired with acquire() when going out of scope
+    class AutoRelease {
+    public:
+        AutoRelease(const FFmpegFileManager& manager,
+                    FFmpegFile* file)
+            : _manager(manager)
+            , _file(file)
+        {
+        }
+
+        ~AutoRelease()
+        {
+            if (_file) {
+                _manager.release(_file);
+            }
+        }
+
+    private:
+        const FFmpegFileManager& _manager;
+        FFmpegFile* _file;
+    };
 };
 
 #endif /* defined(__Io__FFmpegHandler__) */
@@ -93,6 +93,36 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kParamFirstTrackOnly "firstTrackOnly"
 #define kParamFirstTrackOnlyLabelAndHint "First Track Only", "Causes the reader to ignore all but the first video track it finds in the file. This should be selected in a multiview project if the file happens to contain multiple video tracks that don't correspond to different views."
 
+#define kParamPlaybackReadAhead "playbackReadAhead"
+#define kParamPlaybackReadAheadLabel "Playback Read-Ahead"
+#define kParamPlaybackReadAheadHint "Number of frames decoded ahead of the playhead by a background thread during playback. " \
+                                    "This uses the memory of that many decoded frames per opened video file. 0 disables read-ahead."
+
+#define kParamDecoders "decoders"
+#define kParamDecodersLabel "Decoder Instances"
+#define kParamDecodersHint "Maximum number of decoders opened on the video file. When the host renders several distant frames concurrently, each render uses the decoder nearest to its frame, instead of waiting for a single decoder that keeps seeking back and forth. " \
+                           "The total number of decoders and their memory usage is limited for all readers."
+
+#define kParamFrameIndex "frameIndex"
+#define kParamFrameIndexLabel "Frame Index"
+#define kParamFrameIndexHint "Index of the keyframes in the video, used to seek directly to the keyframe preceding any frame, which makes random access and scrubbing much faster for long-GOP codecs (H.264, HEVC, MPEG-2...). " \
+                             "The index is built by reading the whole file once, and is stored in an index cache (in the directory given by the OFX_IO_FFMPEG_INDEX_DIR environment variable, or the temporary directory), so that it is only built once for each file."
+#define kParamFrameIndexOptionOff "Off", "Do not use a frame index.", "off"
+#define kParamFrameIndexOptionOnOpen "Build When Opening", "If the index is not in the cache, build it when the file is opened.", "onopen"
+#define kParamFrameIndexOptionBackground "Build in Background", "If the index is not in the cache, build it in a background thread. Seeking is done as without an index until it is available.", "background"
+#define kParamFrameIndexDefault FFmpegFile::eFrameIndexModeNone
+
+#define kParamHWAccel "hwAccel"
+#define kParamHWAccelLabel "Hardware Decoding"
+#define kParamHWAccelHint "Decode the video using a hardware decoder (GPU). If the device is not available on this system, or cannot decode this video (codec, profile or bit depth not supported), the video is decoded in software."
+#define kParamHWAccelOptionNone "Off", "Decode in software.", "none"
+#define kParamHWAccelOptionAuto "Auto", "Use the first hardware device that supports the video codec.", "auto"
+#define kParamHWAccelOptionCUDA "NVDEC", "NVIDIA GPUs (CUDA).", "cuda"
+#define kParamHWAccelOptionVAAPI "VAAPI", "Video Acceleration API (Linux).", "vaapi"
+#define kParamHWAccelOptionVideoToolbox "VideoToolbox", "Apple VideoToolbox (macOS).", "videotoolbox"
+#define kParamHWAccelOptionD3D11VA "D3D11VA", "Direct3D 11 Video Acceleration (Windows).", "d3d11va"
+#define kParamHWAccelDefault FFmpegFile::eHWAccelNone
+
 #define kParamLibraryInfo "libraryInfo"
 #define kParamLibraryInfoLabel "FFmpeg Info...", "Display information about the underlying library."
 
@@ -106,6 +136,10 @@ class ReadFFmpegPlugin
     : public GenericReaderPlugin {
     FFmpegFileManager& _manager;
     BooleanParam* _firstTrackOnly;
+    IntParam* _playbackReadAhead;
+    ChoiceParam* _frameIndex;
+    ChoiceParam* _hwAccel;
+    IntParam* _decoders;
 
 public:
     ReadFFmpegPlugin(FFmpegFileManager& manager, OfxImageEffectHandle handle, const vector<string>& extensions);
@@ -116,6 +150,10 @@ public:
 
     bool loadNearestFrame() const;
 
+    FFmpegFile* getOrCreateFile(const string& filename) const;
+
+    FFmpegFile* acquireFile(const string& filename, int frame) const;
+
     /**
      * @brief Restore any state from the parameters set
      * Called from createInstance() and changedParam() (via changedFilename()), must restore the
@@ -148,10 +186,16 @@ private:
      * When reading an image sequence, this is called only for the first image when the user actually selects the new sequence.
      **/
     virtual bool guessParamsFromFilename(const string& filename, string* colorspace, PreMultiplicationEnum* filePremult, PixelComponentEnum* components, int* componentCount) OVERRIDE FINAL;
-    virtual void decode(const string& filename, OfxTime time, int view, bool isPlayback, const OfxRectI& renderWindow, const OfxPointD& renderScale, float* pixelData, const OfxRectI& bounds, PixelComponentEnum pixelComponents, int pixelComponentCount, int rowBytes) OVERRIDE FINAL;
+    virtual void decode(const string& filename, OfxTime time, int view, bool isPlayback, const OfxRectI& renderWindow, const OfxPointD& renderScale, float* pixelData, const OfxRectI& bounds, PixelComponentEnum pixelComponents, int pixelComponentCount, int rowBytes, FusedColorConversion* colorConversion) OVERRIDE FINAL;
     virtual bool getSequenceTimeDomain(const string& filename, OfxRangeI& range) OVERRIDE FINAL;
     virtual bool getFrameBounds(const string& filename, OfxTime time, int view, OfxRectI* bounds, OfxRectI* format, double* par, string* error, int* tile_width, int* tile_height) OVERRIDE FINAL;
     virtual bool getFrameRate(const string& filename, double* fps) const OVERRIDE FINAL;
+
+    virtual void getDecodeCacheKey(double time, string* key) const OVERRIDE FINAL
+    {
+        // the selected video track depends on firstTrackOnly
+        *key += _firstTrackOnly->getValueAtTime(time) ? "firstTrackOnly" : "";
+    }
 };
 
 ReadFFmpegPlugin::ReadFFmpegPlugin(FFmpegFileManager& manager,
@@ -160,9 +204,17 @@ ReadFFmpegPlugin::ReadFFmpegPlugin(FFmpegFileManager& manager,
     : GenericReaderPlugin(handle, extensions, kSupportsRGBA, kSupportsRGB, kSupportsXY, kSupportsAlpha, kSupportsTiles, false)
     , _manager(manager)
     , _firstTrackOnly(NULL)
+    , _playbackReadAhead(NULL)
+    , _frameIndex(NULL)
+    , _hwAccel(NULL)
+    , _decoders(NULL)
 {
     _firstTrackOnly = fetchBooleanParam(kParamFirstTrackOnly);
-    assert(_firstTrackOnly);
+    _playbackReadAhead = fetchIntParam(kParamPlaybackReadAhead);
+    _frameIndex = fetchChoiceParam(kParamFrameIndex);
+    _hwAccel = fetchChoiceParam(kParamHWAccel);
+    _decoders = fetchIntParam(kParamDecoders);
+    assert(_firstTrackOnly && _playbackReadAhead && _frameIndex && _hwAccel && _decoders);
     int originalFrameRangeMin, originalFrameRangeMax;
     _originalFrameRange->getValue(originalFrameRangeMin, originalFrameRangeMax);
     if (originalFrameRangeMin == 0) {
@@ -227,12 +279,36 @@ ffmpeg_versions()
     return oss.str();
 }
 
+FFmpegFile*
+ReadFFmpegPlugin::getOrCreateFile(const string& filename) const
+{
+    FFmpegFile::FrameIndexModeEnum indexMode = (FFmpegFile::FrameIndexModeEnum)_frameIndex->getValue();
+    FFmpegFile::HWAccelEnum hwAccel = (FFmpegFile::HWAccelEnum)_hwAccel->getValue();
+
+    return _manager.getOrCreate(this, filename, indexMode, hwAccel);
+}
+
+// get a decoder from the pool, to be released with FFmpegFileManager::release()
+FFmpegFile*
+ReadFFmpegPlugin::acquireFile(const string& filename,
+                              int frame) const
+{
+    FFmpegFile::FrameIndexModeEnum indexMode = (FFmpegFile::FrameIndexModeEnum)_frameIndex->getValue();
+    FFmpegFile::HWAccelEnum hwAccel = (FFmpegFile::HWAccelEnum)_hwAccel->getValue();
+    int maxDecoders = _decoders->getValue();
+
+    return _manager.acquire(this, filename, frame, maxDecoders, indexMode, hwAccel);
+}
+
 void
 ReadFFmpegPlugin::changedParam(const InstanceChangedArgs& args,
                                const string& paramName)
 {
     if (paramName == kParamLibraryInfo) {
         sendMessage(Message::eMessageMessage, "", ffmpeg_versions());
+    } else if ((paramName == kParamFrameIndex) || (paramName == kParamHWAccel)) {
+        // these are used when opening files: reopen them
+        _manager.clear(this);
     } else {
         GenericReaderPlugin::changedParam(args, paramName);
     }
@@ -269,7 +345,7 @@ ReadFFmpegPlugin::guessParamsFromFilename(const string& filename,
     if (!file) {
         // Clear all opened files by this plug-in since the user changed the selected file/sequence
         _manager.clear(this);
-        file = _manager.getOrCreate(this, filename);
+        file = getOrCreateFile(filename);
     }
 
     if (!file || file->isInvalid()) {
@@ -326,16 +402,20 @@ void
 ReadFFmpegPlugin::decode(const string& filename,
                          OfxTime time,
                          int view,
-                         bool /*isPlayback*/,
+                         bool isPlayback,
                          const OfxRectI& renderWindow,
-                         const OfxPointD& renderScale,
+                         const OfxPointD& /*renderScale*/,
                          float* pixelData,
                          const OfxRectI& imgBounds,
                          PixelComponentEnum pixelComponents,
                          int pixelComponentCount,
-                         int rowBytes)
+                         int rowBytes,
+                         FusedColorConversion* /*colorConversion*/)
 {
-    FFmpegFile* file = _manager.getOrCreate(this, filename);
+    // The read-ahead ring buffer belongs to the first decoder of the file. Other renders use the decoder pool.
+    int readAheadDepth = isPlayback ? _playbackReadAhead->getValueAtTime(time) : 0;
+    FFmpegFile* file = (readAheadDepth > 0) ? getOrCreateFile(filename) : acquireFile(filename, (int)time);
+    FFmpegFileManager::AutoRelease fileRelease(_manager, (readAheadDepth > 0) ? nullptr : file);
 
     if (file && file->isInvalid()) {
         setPersistentMessage(Message::eMessageError, "", file->getError());
@@ -383,28 +463,16 @@ ReadFFmpegPlugin::decode(const string& filename,
         return;
     }
 
-    // not in FFmpeg Reader: initialize the output buffer
-    // TODO: use avpicture_get_size? see WriteFFmpeg
-    unsigned int numComponents = file->getNumberOfComponents();
-    assert(numComponents == 3 || numComponents == 4);
-
-    std::size_t sizeOfData = file->getSizeOfData();
-    assert(sizeOfData == sizeof(unsigned char) || sizeOfData == sizeof(unsigned short));
-
-    int srcRowBytes = width * numComponents * sizeOfData;
-    std::size_t bufferSize = height * srcRowBytes;
-
-    RamBuffer bufferRaii(bufferSize);
-    unsigned char* buffer = bufferRaii.getData();
-    if (!buffer) {
-        throwSuiteStatusException(kOfxStatErrMemory);
-
-        return;
-    }
-    // this is the first stream (in fact the only one we consider for now), allocate the output buffer according to the bitdepth
-
+    // decode and convert directly into the host image (during playback, a frame decoded ahead is
+    // converted the same way)
+    FFmpegFile::FloatImage dst;
+    dst.pixelData = pixelData;
+    dst.bounds = imgBounds;
+    dst.renderWindow = renderWindow;
+    dst.nComps = pixelComponentCount;
+    dst.rowBytes = rowBytes;
     try {
-        if (!file->decode(this, (int)time, loadNearestFrame(), buffer)) {
+        if (!file->decodePlayback(this, (int)time, loadNearestFrame(), readAheadDepth, dst)) {
             if (abort()) {
                 // decode() probably existed because plugin was aborted
                 return;
@@ -426,8 +494,6 @@ ReadFFmpegPlugin::decode(const string& filename,
 
         return;
     }
-
-    convertDepthAndComponents(buffer, renderWindow, renderScale, imgBounds, numComponents == 3 ? ePixelComponentRGB : ePixelComponentRGBA, sizeOfData == sizeof(unsigned char) ? eBitDepthUByte : eBitDepthUShort, srcRowBytes, pixelData, imgBounds, pixelComponents, rowBytes);
 } // ReadFFmpegPlugin::decode
 
 bool
@@ -442,7 +508,7 @@ ReadFFmpegPlugin::getSequenceTimeDomain(const string& filename,
 
     int width, height, frames;
     double ap;
-    FFmpegFile* file = _manager.getOrCreate(this, filename);
+    FFmpegFile* file = getOrCreateFile(filename);
     if (!file || file->isInvalid()) {
         range.min = range.max = 0.;
 
@@ -462,7 +528,7 @@ ReadFFmpegPlugin::getFrameRate(const string& filename,
 {
     assert(fps);
 
-    FFmpegFile* file = _manager.getOrCreate(this, filename);
+    FFmpegFile* file = getOrCreateFile(filename);
     if (!file || file->isInvalid()) {
         return false;
     }
@@ -484,7 +550,7 @@ ReadFFmpegPlugin::getFrameBounds(const string& filename,
                                  int* tile_height)
 {
     assert(bounds && par);
-    FFmpegFile* file = _manager.getOrCreate(this, filename);
+    FFmpegFile* file = getOrCreateFile(filename);
     if (!file || file->isInvalid()) {
         if (error && file) {
             *error = file->getError();
@@ -939,6 +1005,68 @@ ReadFFmpegPluginFactory::describeInContext(ImageEffectDescriptor& desc,
             page->addChild(*param);
         }
     }
+    {
+        IntParamDescriptor* param = desc.defineIntParam(kParamPlaybackReadAhead);
+        param->setLabel(kParamPlaybackReadAheadLabel);
+        param->setHint(kParamPlaybackReadAheadHint);
+        param->setRange(0, 64);
+        param->setDisplayRange(0, 16);
+        param->setAnimates(false);
+        param->setDefault(0);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+    {
+        IntParamDescriptor* param = desc.defineIntParam(kParamDecoders);
+        param->setLabel(kParamDecodersLabel);
+        param->setHint(kParamDecodersHint);
+        param->setRange(1, OFX_FFMPEG_POOL_MAX_DECODERS);
+        param->setDisplayRange(1, 8);
+        param->setAnimates(false);
+        param->setDefault(1);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+    {
+        ChoiceParamDescriptor* param = desc.defineChoiceParam(kParamFrameIndex);
+        param->setLabel(kParamFrameIndexLabel);
+        param->setHint(kParamFrameIndexHint);
+        assert(param->getNOptions() == FFmpegFile::eFrameIndexModeNone);
+        param->appendOption(kParamFrameIndexOptionOff);
+        assert(param->getNOptions() == FFmpegFile::eFrameIndexModeOnOpen);
+        param->appendOption(kParamFrameIndexOptionOnOpen);
+        assert(param->getNOptions() == FFmpegFile::eFrameIndexModeBackground);
+        param->appendOption(kParamFrameIndexOptionBackground);
+        param->setAnimates(false);
+        param->setDefault((int)kParamFrameIndexDefault);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+    {
+        ChoiceParamDescriptor* param = desc.defineChoiceParam(kParamHWAccel);
+        param->setLabel(kParamHWAccelLabel);
+        param->setHint(kParamHWAccelHint);
+        assert(param->getNOptions() == FFmpegFile::eHWAccelNone);
+        param->appendOption(kParamHWAccelOptionNone);
+        assert(param->getNOptions() == FFmpegFile::eHWAccelAuto);
+        param->appendOption(kParamHWAccelOptionAuto);
+        assert(param->getNOptions() == FFmpegFile::eHWAccelCUDA);
+        param->appendOption(kParamHWAccelOptionCUDA);
+        assert(param->getNOptions() == FFmpegFile::eHWAccelVAAPI);
+        param->appendOption(kParamHWAccelOptionVAAPI);
+        assert(param->getNOptions() == FFmpegFile::eHWAccelVideoToolbox);
+        param->appendOption(kParamHWAccelOptionVideoToolbox);
+        assert(param->getNOptions() == FFmpegFile::eHWAccelD3D11VA);
+        param->appendOption(kParamHWAccelOptionD3D11VA);
+        param->setAnimates(false);
+        param->setDefault((int)kParamHWAccelDefault);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
     {
         BooleanParamDescriptor* param = desc.defineBooleanParam(kParamFirstTrackOnly);
         param->setLabelAndHint(kParamFirstTrackOnlyLabelAndHint);
@@ -41,7 +41,9 @@
 #include <cfloat> // DBL_MAX
 #include <climits> // INT_MAX
 #include <cstdio>
+#include <ctime>
 #include <cstring> // strncpy
+#include <list>
 #include <sstream>
 #include <string>
 #ifdef DEBUG
@@ -59,8 +61,9 @@
 #define snprintf _snprintf
 #endif
 #else
+#include <signal.h> // for kill()
 #include <time.h>
-#include <unistd.h> // for sysconf()
+#include <unistd.h> // for sysconf(), getpid(), gethostname()
 #endif
 
 extern "C" {
@@ -70,9 +73,11 @@ extern "C" {
 #include <libavformat/avio.h>
 #include <libavutil/avutil.h>
 #include <libavutil/error.h>
+#include <libavutil/hwcontext.h>
 #include <libavutil/imgutils.h>
 #include <libavutil/mathematics.h>
 #include <libavutil/opt.h>
+#include <libavutil/pixdesc.h>
 #include <libswscale/swscale.h>
 }
 #include "IOUtility.h"
@@ -95,6 +100,7 @@ extern "C" {
 #define OFX_FFMPEG_TIMECODE 0 // timecode support
 #define OFX_FFMPEG_AUDIO 0 // audio support
 #define OFX_FFMPEG_MBDECISION 0 // add the macroblock decision parameter
+#define OFX_FFMPEG_SEGMENTS_JOIN_TIMEOUT (6 * 60 * 60) // seconds after which a segments join lock file is considered stale
 
 #if OFX_FFMPEG_PRINT_CODECS
 #include <iostream>
@@ -253,6 +259,31 @@ enum PrefBitDepthEnum {
     "Write decoding critical metadata (moov atom) at beginning of the file to " \
     "allow playback when streaming."
 
+#define kParamEncodeQueueSize "encodeQueueSize"
+#define kParamEncodeQueueSizeLabel "Encode Queue"
+#define kParamEncodeQueueSizeHint                                                       \
+    "Maximum number of rendered frames waiting to be encoded. When non-zero, frames "   \
+    "are color-converted, encoded and written to the file by a separate thread, so "    \
+    "that the host can render the next frames while the encoder is busy. Each queued " \
+    "frame holds an RGB copy of the image. 0 (the default) encodes each frame before "  \
+    "returning from the render."
+#define kParamEncodeQueueSizeDefault 0
+#define kParamEncodeQueueSizeMax 16
+
+#define kParamSegmented "segmented"
+#define kParamSegmentedLabel "Segmented Encoding"
+#define kParamSegmentedHint                                                                                  \
+    "Encode the frame range as separate segment files of Segment Length frames each, which are joined "     \
+    "into the output file without re-encoding when all of them have been rendered. The segments may be "   \
+    "rendered by separate processes or farm tasks, which should each render a frame range made of whole " \
+    "segments. Segment files are named after the output file, e.g. movie.seg0003.mov.\n"                   \
+    "This is only possible with intra-only codecs (e.g. ProRes, DNxHD/DNxHR, Photo JPEG, FFV1), or with "   \
+    "a keyframe interval of 1 and no B-frames, else the frames are encoded in a single file."
+#define kParamSegmentLength "segmentLength"
+#define kParamSegmentLengthLabel "Segment Length"
+#define kParamSegmentLengthHint "Number of frames in each segment file, when Segmented Encoding is checked. With a frame step, only the rendered frames are counted."
+#define kParamSegmentLengthDefault 100
+
 #define kParamAdvanced "advanced"
 #define kParamAdvancedLabel "Advanced"
 
@@ -577,7 +608,15 @@ CreateCodecKnobLabelsMap()
     m["flv"] = "FLV1\tFLV / Sorenson Spark / Sorenson H.263 (Flash Video)";
     m["gif"] = "gif \tGIF (Graphics Interchange Format)";
     m["h263p"] = "H263\tH.263+ / H.263-1998 / H.263 version 2";
+    m["h264_nvenc"] = "avc1\tH.264 / AVC (NVIDIA NVENC hardware encoder)";
+    m["h264_qsv"] = "avc1\tH.264 / AVC (Intel Quick Sync Video hardware encoder)";
+    m["h264_vaapi"] = "avc1\tH.264 / AVC (VAAPI hardware encoder)";
+    m["h264_videotoolbox"] = "avc1\tH.264 / AVC (VideoToolbox hardware encoder)";
     m["hap"] = "Hap1\tVidvox Hap";
+    m["hevc_nvenc"] = "hev1\tH.265 / HEVC (NVIDIA NVENC hardware encoder)";
+    m["hevc_qsv"] = "hev1\tH.265 / HEVC (Intel Quick Sync Video hardware encoder)";
+    m["hevc_vaapi"] = "hev1\tH.265 / HEVC (VAAPI hardware encoder)";
+    m["hevc_videotoolbox"] = "hev1\tH.265 / HEVC (VideoToolbox hardware encoder)";
     m["huffyuv"] = "HFYU\tHuffYUV";
     m["jpeg2000"] = "mjp2\tJPEG 2000"; // disabled in whitelist (bad quality)
     m["jpegls"] = "MJLS\tJPEG-LS"; // disabled in whitelist
@@ -687,6 +726,264 @@ getCodecKnobLabel(const char* codecShortName)
     }
 }
 
+// Hardware encoders.
+// They are selected like any other encoder in the Codec menu, and the H.264/HEVC
+// software encoder is used instead if no device is present (see beginEncode()).
+enum HWEncoderEnum {
+    eHWEncoderNone = 0,
+    eHWEncoderNVENC,
+    eHWEncoderQSV,
+    eHWEncoderVAAPI,
+    eHWEncoderVideoToolbox,
+};
+
+static HWEncoderEnum
+getHWEncoder(const string& codecShortName)
+{
+    struct HWEncoderSuffix {
+        const char* suffix;
+        HWEncoderEnum e;
+    };
+    static const HWEncoderSuffix suffixes[] = {
+        { "_nvenc", eHWEncoderNVENC },
+        { "_qsv", eHWEncoderQSV },
+        { "_vaapi", eHWEncoderVAAPI },
+        { "_videotoolbox", eHWEncoderVideoToolbox },
+        { nullptr, eHWEncoderNone }
+    };
+
+    for (const HWEncoderSuffix* it = suffixes; it->suffix != nullptr; ++it) {
+        const size_t len = strlen(it->suffix);
+        if ((codecShortName.size() > len) && (codecShortName.compare(codecShortName.size() - len, len, it->suffix) == 0)) {
+            return it->e;
+        }
+    }
+
+    return eHWEncoderNone;
+}
+
+static AVHWDeviceType
+getHWEncoderDeviceType(HWEncoderEnum e)
+{
+    switch (e) {
+    case eHWEncoderNVENC:
+        return AV_HWDEVICE_TYPE_CUDA;
+    case eHWEncoderQSV:
+        return AV_HWDEVICE_TYPE_QSV;
+    case eHWEncoderVAAPI:
+        return AV_HWDEVICE_TYPE_VAAPI;
+    case eHWEncoderVideoToolbox:
+        return AV_HWDEVICE_TYPE_VIDEOTOOLBOX;
+    case eHWEncoderNone:
+        break;
+    }
+
+    return AV_HWDEVICE_TYPE_NONE;
+}
+
+// the software encoder used when the hardware encoder cannot be opened
+static const AVCodec*
+getHWEncoderFallback(AVCodecID codecId)
+{
+    const AVCodec* codec = nullptr;
+
+    if (codecId == AV_CODEC_ID_H264) {
+        codec = avcodec_find_encoder_by_name("libx264");
+        if (!codec) {
+            codec = avcodec_find_encoder_by_name("libopenh264");
+        }
+    } else if (codecId == AV_CODEC_ID_HEVC) {
+        codec = avcodec_find_encoder_by_name("libx265");
+    }
+
+    return codec;
+}
+
+// true if the encoder only accepts frames in hardware memory (e.g. VAAPI),
+// in which case frames are uploaded before encoding
+static bool
+hwEncoderNeedsUpload(const AVCodec* codec)
+{
+    if (!codec || !codec->pix_fmts || (getHWEncoder(codec->name) == eHWEncoderNone)) {
+        return false;
+    }
+    for (const AVPixelFormat* f = codec->pix_fmts; *f != AV_PIX_FMT_NONE; ++f) {
+        const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(*f);
+        if (desc && !(desc->flags & AV_PIX_FMT_FLAG_HWACCEL)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// The pixel formats swscale can convert to for this encoder, terminated by AV_PIX_FMT_NONE.
+// Hardware pixel formats are removed, and replaced by the formats that can be
+// uploaded for encoders that only take hardware frames.
+static void
+getSoftwarePixelFormats(const AVCodec* codec,
+                        vector<AVPixelFormat>& formats)
+{
+    formats.clear();
+    if (codec->pix_fmts) {
+        for (const AVPixelFormat* f = codec->pix_fmts; *f != AV_PIX_FMT_NONE; ++f) {
+            const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(*f);
+            if (desc && !(desc->flags & AV_PIX_FMT_FLAG_HWACCEL)) {
+                formats.push_back(*f);
+            }
+        }
+    }
+    if (formats.empty() && hwEncoderNeedsUpload(codec)) {
+        formats.push_back(AV_PIX_FMT_NV12);
+        if (codec->id == AV_CODEC_ID_HEVC) {
+            formats.push_back(AV_PIX_FMT_P010LE);
+        }
+    }
+    formats.push_back(AV_PIX_FMT_NONE);
+}
+
+// Attach the hardware device to the encoder context, and for encoders that take
+// hardware frames, create the pool of frames the images are uploaded to.
+static int
+setupHWEncoderContext(AVCodecContext* avCodecContext,
+                      const AVCodec* avCodec,
+                      AVBufferRef* hwDeviceCtx,
+                      AVPixelFormat swPixelFormat)
+{
+    if (!hwDeviceCtx) {
+        return 0;
+    }
+    if (!hwEncoderNeedsUpload(avCodec)) {
+        // the encoder uploads software frames itself, but it may use our device
+        if (getHWEncoder(avCodec->name) != eHWEncoderVideoToolbox) {
+            avCodecContext->hw_device_ctx = av_buffer_ref(hwDeviceCtx);
+        }
+
+        return 0;
+    }
+    AVBufferRef* hwFramesRef = av_hwframe_ctx_alloc(hwDeviceCtx);
+    if (!hwFramesRef) {
+        return AVERROR(ENOMEM);
+    }
+    AVHWFramesContext* hwFramesCtx = (AVHWFramesContext*)hwFramesRef->data;
+    hwFramesCtx->format = avCodec->pix_fmts[0];
+    hwFramesCtx->sw_format = swPixelFormat;
+    hwFramesCtx->width = avCodecContext->width;
+    hwFramesCtx->height = avCodecContext->height;
+    hwFramesCtx->initial_pool_size = 20;
+    int ret = av_hwframe_ctx_init(hwFramesRef);
+    if (ret < 0) {
+        av_buffer_unref(&hwFramesRef);
+
+        return ret;
+    }
+    avCodecContext->hw_frames_ctx = hwFramesRef;
+    avCodecContext->pix_fmt = hwFramesCtx->format;
+
+    return 0;
+}
+
+// Check that the hardware encoder can be opened with these settings, by opening
+// a temporary encoder. On success, the device to use is returned in hwDeviceCtx.
+static bool
+probeHWEncoder(const AVCodec* avCodec,
+               AVPixelFormat swPixelFormat,
+               int width,
+               int height,
+               AVBufferRef** hwDeviceCtx)
+{
+    *hwDeviceCtx = nullptr;
+    AVHWDeviceType deviceType = getHWEncoderDeviceType(getHWEncoder(avCodec->name));
+    if (deviceType == AV_HWDEVICE_TYPE_NONE) {
+        return false;
+    }
+    AVBufferRef* device = nullptr;
+    if (av_hwdevice_ctx_create(&device, deviceType, nullptr, nullptr, 0) < 0) {
+        return false;
+    }
+    AVCodecContext* avCodecContext = avcodec_alloc_context3(avCodec);
+    if (!avCodecContext) {
+        av_buffer_unref(&device);
+
+        return false;
+    }
+    avCodecContext->width = width;
+    avCodecContext->height = height;
+    avCodecContext->pix_fmt = swPixelFormat;
+    avCodecContext->time_base = av_make_q(1, 25);
+    avCodecContext->framerate = av_make_q(25, 1);
+    bool ok = (setupHWEncoderContext(avCodecContext, avCodec, device, swPixelFormat) >= 0) && (avcodec_open2(avCodecContext, avCodec, nullptr) >= 0);
+    avcodec_free_context(&avCodecContext);
+    if (ok) {
+        *hwDeviceCtx = device;
+    } else {
+        av_buffer_unref(&device);
+    }
+
+    return ok;
+}
+
+// Constant quality and speed options of hardware encoders, from the CRF and preset values of x264/x265
+static void
+setHWEncoderQuality(AVCodecContext* avCodecContext,
+                    HWEncoderEnum e,
+                    int crf)
+{
+    switch (e) {
+    case eHWEncoderNVENC:
+        if (crf == 0) {
+            av_opt_set(avCodecContext->priv_data, "rc", "constqp", 0);
+            av_opt_set_int(avCodecContext->priv_data, "qp", 0, 0);
+#if (LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(58, 91, 100))
+            av_opt_set(avCodecContext->priv_data, "tune", "lossless", 0);
+#endif
+        } else {
+            av_opt_set(avCodecContext->priv_data, "rc", "vbr", 0);
+            av_opt_set_int(avCodecContext->priv_data, "cq", crf, 0);
+            avCodecContext->bit_rate = 0;
+        }
+        break;
+    case eHWEncoderQSV:
+        // ICQ mode
+        avCodecContext->global_quality = (std::max)(1, crf);
+        break;
+    case eHWEncoderVAAPI:
+        av_opt_set(avCodecContext->priv_data, "rc_mode", "CQP", 0);
+        av_opt_set_int(avCodecContext->priv_data, "qp", (std::max)(1, crf), 0);
+        break;
+    case eHWEncoderVideoToolbox: {
+        // quality is between 0 and 100, see libavcodec/videotoolboxenc.c
+        int quality = (std::max)(1, (std::min)(100, 100 - (crf * 100) / 51));
+        avCodecContext->flags |= AV_CODEC_FLAG_QSCALE;
+        avCodecContext->global_quality = quality * FF_QP2LAMBDA;
+        break;
+    }
+    case eHWEncoderNone:
+        break;
+    }
+}
+
+static const char*
+getHWEncoderPreset(HWEncoderEnum e,
+                   X26xSpeedEnum speed)
+{
+    if (e == eHWEncoderNVENC) {
+#if (LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(58, 91, 100))
+        static const char* presets[] = { "p1", "p2", "p3", "p3", "p4", "p5", "p6", "p7" };
+#else
+        static const char* presets[] = { "fast", "fast", "fast", "fast", "medium", "slow", "slow", "slow" };
+#endif
+
+        return presets[speed];
+    } else if (e == eHWEncoderQSV) {
+        static const char* presets[] = { "veryfast", "veryfast", "faster", "fast", "medium", "slow", "slower", "veryslow" };
+
+        return presets[speed];
+    }
+
+    return nullptr;
+}
+
 static const char*
 getCodecFromShortName(const string& name)
 {
@@ -1037,7 +1334,19 @@ private:
     virtual void beginEdit(void) OVERRIDE FINAL;
     virtual void beginEncode(const string& filename, const OfxRectI& rodPixel, float pixelAspectRatio, const BeginSequenceRenderArguments& args) OVERRIDE FINAL;
     virtual void endEncode(const EndSequenceRenderArguments& args) OVERRIDE FINAL;
-    virtual void encode(const string& filename,
+    void beginEncodeFile(const string& filename, const OfxRectI& rodPixel, float pixelAspectRatio, int firstFrame, int lastFrame, int frameStep);
+    bool endEncodeFile();
+
+    // segmented encoding, see kParamSegmentedHint
+    bool canEncodeSegments(string* reason) const;
+    int getSegment(int frame) const;
+    int getSegmentFirstFrame(int segment) const;
+    string getSegmentFilename(int segment) const;
+    void beginSegment(int segment, int firstFrame);
+    void endSegment();
+    void joinSegments();
+    virtual void encode(void* user_data,
+                        const string& filename,
                         const OfxTime time,
                         const string& viewName,
                         const float* pixelData,
@@ -1080,10 +1389,18 @@ private:
     void addStream(AVFormatContext* avFormatContext, enum AVCodecID avCodecId, const AVCodec** pavCodec, MyAVStream* myStreamOut);
     int openCodec(AVFormatContext* avFormatContext, const AVCodec* avCodec, MyAVStream* myAVStream);
     int writeAudio(AVFormatContext* avFormatContext, AVStream* avStream, bool flush);
-    int writeVideo(AVFormatContext* avFormatContext, MyAVStream* myAVStream, bool flush, double time, const float* pixelData = nullptr, const OfxRectI* bounds = nullptr, int pixelDataNComps = 0, int dstNComps = 0, int rowBytes = 0);
+    std::shared_ptr<AVFrame> makeInputFrame(const float* pixelData, const OfxRectI& bounds, int pixelDataNComps, int rowBytes);
+    int writeVideo(AVFormatContext* avFormatContext, MyAVStream* myAVStream, bool flush, double time, const std::shared_ptr<AVFrame>& inputFrame = std::shared_ptr<AVFrame>());
     int encodeVideo(AVCodecContext* avCodecContext, const AVFrame* avFrame, AVPacket* avPacketOut);
 
-    int writeToFile(AVFormatContext* avFormatContext, bool finalise, double time, const float* pixelData = nullptr, const OfxRectI* bounds = nullptr, int pixelDataNComps = 0, int dstNComps = 0, int rowBytes = 0);
+    int writeToFile(AVFormatContext* avFormatContext, bool finalise, double time, const std::shared_ptr<AVFrame>& inputFrame = std::shared_ptr<AVFrame>());
+
+    // asynchronous encoding, see encode()
+    static void encodeThreadFunction(void* arg);
+    void encodeLoop();
+    void stopEncodeThread(bool drain);
+    void setEncodeError(const string& message);
+    string getEncodeError();
 
     int colourSpaceConvert(AVFrame* avFrameIn, AVFrame* avFrameOut, AVPixelFormat srcPixelFormat, AVPixelFormat dstPixelFormat, AVCodecContext* avCodecContext);
 
@@ -1108,6 +1425,7 @@ private:
     WriterError _error;
     AVFormatContext* _formatContext;
     SwsContext* _convertCtx;
+    AVBufferRef* _hwDeviceCtx; // device of the hardware encoder, if any
     MyAVStream _streamVideo;
     MyAVStream _streamAudio;
     AVStream* _streamTimecode;
@@ -1150,6 +1468,40 @@ private:
     BooleanParam* _writeTimecode;
 #endif
     BooleanParam* _fastStart;
+    IntParam* _encodeQueueSize;
+    BooleanParam* _segmented;
+    IntParam* _segmentLength;
+
+    // Segmented encoding: the frames of the [_segmentsFirstFrame, _segmentsLastFrame] range of the output,
+    // every _segmentsFrameStep frames, are split in segments of _segmentsLength frames, and _segment is
+    // the one being encoded.
+    bool _segmentsEnabled;
+    int _segmentsFirstFrame;
+    int _segmentsLastFrame;
+    int _segmentsLength;
+    int _segmentsFrameStep;
+    int _segment;
+
+    // Asynchronous encoding: encode() converts the image to RGB and pushes it to _encodeQueue,
+    // and _encodeThread does the colorspace conversion, encoding and muxing, in frame order.
+    // All members below are protected by _encodeQueueMutex, except _isRec709, which is set in
+    // beginEncode() before the thread starts. The encoder thread must not use the OFX suites.
+    struct EncodeQueueItem
+    {
+        double time;
+        std::shared_ptr<AVFrame> frame;
+    };
+
+    tthread::thread* _encodeThread;
+    tthread::mutex _encodeQueueMutex;
+    tthread::condition_variable _encodeQueueCond; // signaled when an item is pushed, popped or encoded
+    std::list<EncodeQueueItem> _encodeQueue;
+    int _encodeQueueMax; // max number of items in the queue, 0 if not encoding asynchronously
+    bool _encodeQueueBusy; // the encoder thread is encoding an item that was popped
+    bool _encodeQueueQuit; // the encoder thread should exit
+    bool _encodeFailed; // an asynchronous encode failed, see _encodeErrorMessage
+    string _encodeErrorMessage;
+    bool _isRec709;
 
 #if OFX_FFMPEG_SCRATCHBUFFER
     // Used in writeVideo as a contiguous buffer. The size of the buffer remains throughout
@@ -1383,6 +1735,7 @@ WriteFFmpegPlugin::WriteFFmpegPlugin(OfxImageEffectHandle handle,
     , _error(IGNORE_FINISH)
     , _formatContext(nullptr)
     , _convertCtx(nullptr)
+    , _hwDeviceCtx(nullptr)
     , _streamVideo({ nullptr, nullptr })
     , _streamAudio({ nullptr, nullptr })
     , _streamTimecode(nullptr)
@@ -1420,6 +1773,26 @@ WriteFFmpegPlugin::WriteFFmpegPlugin(OfxImageEffectHandle handle,
 #if OFX_FFMPEG_MBDECISION
     , _mbDecision(nullptr)
 #endif
+    , _fastStart(nullptr)
+    , _encodeQueueSize(nullptr)
+    , _segmented(nullptr)
+    , _segmentLength(nullptr)
+    , _segmentsEnabled(false)
+    , _segmentsFirstFrame(0)
+    , _segmentsLastFrame(0)
+    , _segmentsLength(1)
+    , _segmentsFrameStep(1)
+    , _segment(0)
+    , _encodeThread(nullptr)
+    , _encodeQueueMutex()
+    , _encodeQueueCond()
+    , _encodeQueue()
+    , _encodeQueueMax(0)
+    , _encodeQueueBusy(false)
+    , _encodeQueueQuit(false)
+    , _encodeFailed(false)
+    , _encodeErrorMessage()
+    , _isRec709(false)
 #if OFX_FFMPEG_SCRATCHBUFFER
     , _scratchBuffer(nullptr)
     , _scratchBufferSize(0)
@@ -1459,6 +1832,9 @@ WriteFFmpegPlugin::WriteFFmpegPlugin(OfxImageEffectHandle handle,
     _writeTimecode = fetchBooleanParam(kParamWriteTimeCode);
 #endif
     _fastStart = fetchBooleanParam(kParamFastStart);
+    _encodeQueueSize = fetchIntParam(kParamEncodeQueueSize);
+    _segmented = fetchBooleanParam(kParamSegmented);
+    _segmentLength = fetchIntParam(kParamSegmentLength);
 
     // finally
     syncPrivateData();
@@ -1466,6 +1842,7 @@ WriteFFmpegPlugin::WriteFFmpegPlugin(OfxImageEffectHandle handle,
 
 WriteFFmpegPlugin::~WriteFFmpegPlugin()
 {
+    stopEncodeThread(false);
 #if OFX_FFMPEG_SCRATCHBUFFER
     delete[] _scratchBuffer;
     _scratchBufferSize = 0;
@@ -1729,7 +2106,9 @@ WriteFFmpegPlugin::getPixelFormats(const AVCodec* videoCodec,
     } else if (videoCodec->pix_fmts != nullptr) {
         // This is the most frequent path, where we can guess best pix format using ffmpeg.
         // find highest bit depth pix fmt.
-        const AVPixelFormat* currPixFormat = videoCodec->pix_fmts;
+        vector<AVPixelFormat> codecPixFormats;
+        getSoftwarePixelFormats(videoCodec, codecPixFormats);
+        const AVPixelFormat* currPixFormat = &codecPixFormats[0];
 
         int prefBPP = FFmpeg::pixelFormatBPPFromSpec(prefPixelCoding, prefBitDepth, prefAlpha);
 
@@ -1811,7 +2190,7 @@ WriteFFmpegPlugin::getPixelFormats(const AVCodec* videoCodec,
         } else {
             // gather the formats that have the target BPP (avcodec_find_best_pix_fmt_of_list doesn't do the best job: it prefers yuv422p over yuv422p10)
             vector<AVPixelFormat> bestFormats;
-            currPixFormat = videoCodec->pix_fmts;
+            currPixFormat = &codecPixFormats[0];
             while (*currPixFormat != -1) {
                 int currBPP = FFmpeg::pixelFormatBPP(*currPixFormat);
                 if (currBPP == selectedBPP) {
@@ -1874,7 +2253,7 @@ WriteFFmpegPlugin::getPixelFormats(const AVCodec* videoCodec,
                 // supported by the QT RLE codec and force the output pixel
                 // format.
                 //
-                currPixFormat = videoCodec->pix_fmts;
+                currPixFormat = &codecPixFormats[0];
                 while (*currPixFormat != -1) {
                     AVPixelFormat avPixelFormat = *currPixFormat++;
                     if ((AV_PIX_FMT_ARGB == avPixelFormat) || (AV_PIX_FMT_RGBA == avPixelFormat) || (AV_PIX_FMT_ABGR == avPixelFormat) || (AV_PIX_FMT_BGRA == avPixelFormat)) {
@@ -2023,6 +2402,17 @@ WriteFFmpegPlugin::GetCodecSupportedParams(const AVCodec* codec,
             p->qrange = false;
             p->interGOP = false;
             p->interB = false;
+        } else if (getHWEncoder(codecShortName) != eHWEncoderNone) {
+            // hardware encoders, see setHWEncoderQuality() and getHWEncoderPreset()
+            const HWEncoderEnum e = getHWEncoder(codecShortName);
+            p->crf = true;
+            p->x26xSpeed = (e == eHWEncoderNVENC || e == eHWEncoderQSV);
+            p->bitrate = true;
+            p->bitrateTol = false;
+            p->qscale = false;
+            p->qrange = false;
+            p->interGOP = true;
+            p->interB = (e != eHWEncoderVideoToolbox || codec->id == AV_CODEC_ID_H264);
         } else if (codecShortName == "libopenh264") {
             // libopenh264enc.c
             // https://www.mankier.com/1/ffmpeg-codecs#Video_Encoders-libopenh264
@@ -2350,9 +2740,14 @@ WriteFFmpegPlugin::configureVideoStream(const AVCodec* avCodec,
             crf = 32;
             break;
         }
+        const HWEncoderEnum hwEncoder = avCodec ? getHWEncoder(avCodec->name) : eHWEncoderNone;
         if (crf >= 0) {
             setqscale = setbitrate = false;
-            av_opt_set_int(avCodecContext->priv_data, "crf", crf, 0);
+            if (hwEncoder != eHWEncoderNone) {
+                setHWEncoderQuality(avCodecContext, hwEncoder, crf);
+            } else {
+                av_opt_set_int(avCodecContext->priv_data, "crf", crf, 0);
+            }
             if (crf == 0 && AV_CODEC_ID_VP9 == avCodecContext->codec_id) {
                 // set the lossless flag for VP90, see https://trac.ffmpeg.org/wiki/Encode/VP9
                 av_opt_set_int(avCodecContext->priv_data, "lossless", 1, 0);
@@ -2393,6 +2788,9 @@ WriteFFmpegPlugin::configureVideoStream(const AVCodec* avCodec,
                     preset = "veryslow";
                     break;
                 }
+                if (hwEncoder != eHWEncoderNone) {
+                    preset = getHWEncoderPreset(hwEncoder, e);
+                }
                 if (preset != nullptr) {
                     av_opt_set(avCodecContext->priv_data, "preset", preset, 0);
                 }
@@ -2972,7 +3370,10 @@ WriteFFmpegPlugin::addStream(AVFormatContext* avFormatContext,
     const AVCodec* avCodec = nullptr;
 
     // Find the encoder.
-    if (avCodecId == AV_CODEC_ID_PRORES) {
+    if (pavCodec && *pavCodec && (*pavCodec)->id == avCodecId) {
+        // use the encoder selected by the caller (there may be several encoders for a codec)
+        avCodec = *pavCodec;
+    } else if (avCodecId == AV_CODEC_ID_PRORES) {
         // use prores_ks instead of prores
         avCodec = avcodec_find_encoder_by_name(kProresCodec);
     } else {
@@ -3071,6 +3472,8 @@ WriteFFmpegPlugin::openCodec(AVFormatContext* avFormatContext,
         // Timecode codecs.
     }
 
+    FFmpegThreadBudget::instance().add(avCodecContext);
+
     // see ffmpeg.c:3042 from ffmpeg 3.2.2
     int ret = avcodec_parameters_from_context(myAVStream->stream->codecpar, avCodecContext);
     if (ret < 0) {
@@ -3093,6 +3496,7 @@ mov64_av_encode(AVCodecContext* avctx,
 {
     int ret;
 
+    FFmpegThreadBudget::instance().touch(avctx);
     ret = avcodec_send_frame(avctx, frame);
     if (ret < 0) {
         *got_packet_ptr = 0;
@@ -3220,7 +3624,7 @@ WriteFFmpegPlugin::colourSpaceConvert(AVFrame* avFrameIn,
         // Only apply colorspace conversions for YUV.
         if (FFmpeg::pixelFormatIsYUV(dstPixelFormat)) {
             // Set up the sws (SoftWareScaler) to convert colourspaces correctly, in the sws_scale function below
-            const int colorspace = isRec709Format(height) ? SWS_CS_ITU709 : SWS_CS_ITU601;
+            const int colorspace = _isRec709 ? SWS_CS_ITU709 : SWS_CS_ITU601;
             const int dstRange = (avCodecContext->codec_id == AV_CODEC_ID_MJPEG || avCodecContext->codec_id == AV_CODEC_ID_MJPEGB) ? 1 : 0; // 0 = 16..235, 1 = 0..255
 
             ret = sws_setColorspaceDetails(_convertCtx,
@@ -3261,18 +3665,113 @@ WriteFFmpegPlugin::numberOfDestChannels() const
     return alphaEnabled() ? 4 : 3;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// makeInputFrame
+//
+// Convert Nuke float RGB values to 16-bit or 8-bit RGB, in a new frame that
+// owns its data. This is the only part of the encoding done in the render
+// thread when frames are queued for the encoder thread.
+//
+// @return the frame, or an empty pointer if allocation failed.
+//
+std::shared_ptr<AVFrame>
+WriteFFmpegPlugin::makeInputFrame(const float* pixelData,
+                                  const OfxRectI& bounds,
+                                  int pixelDataNComps,
+                                  int rowBytes)
+{
+    std::shared_ptr<AVFrame> inputFrame;
+    AVCodecContext* avCodecContext = _streamVideo.codecContext;
+
+    assert(avCodecContext && pixelData);
+    assert(bounds.x1 == _rodPixel.x1 && bounds.x2 == _rodPixel.x2 && bounds.y1 == _rodPixel.y1 && bounds.y2 == _rodPixel.y2);
+    unused(bounds);
+    int width = _rodPixel.x2 - _rodPixel.x1;
+    int height = _rodPixel.y2 - _rodPixel.y1;
+
+    const bool hasAlpha = alphaEnabled();
+    AVPixelFormat pixelFormatNuke;
+    if (hasAlpha) {
+        pixelFormatNuke = (avCodecContext->bits_per_raw_sample > 8) ? AV_PIX_FMT_RGBA64 : AV_PIX_FMT_RGBA;
+    } else {
+        pixelFormatNuke = (avCodecContext->bits_per_raw_sample > 8) ? AV_PIX_FMT_RGB48 : AV_PIX_FMT_RGB24;
+    }
+
+    inputFrame.reset(av_frame_alloc(), [](AVFrame* frame) { av_freep(&frame->data[0]); av_frame_free(&frame); });
+    if (!inputFrame) {
+        return inputFrame;
+    }
+    if (av_image_alloc(inputFrame->data, inputFrame->linesize, width, height, pixelFormatNuke, 32) < 0) {
+        inputFrame.reset();
+
+        return inputFrame;
+    }
+    inputFrame->format = pixelFormatNuke;
+    inputFrame->width = width;
+    inputFrame->height = height;
+
+    // Convert floating point values to unsigned values.
+    assert(rowBytes && rowBytes >= (int)sizeof(float) * width * pixelDataNComps);
+    const int numDestChannels = hasAlpha ? 4 : 3;
+
+    for (int y = 0; y < height; ++y) {
+        int srcY = height - 1 - y;
+        const float* src_pixels = (float*)((char*)pixelData + srcY * rowBytes);
+
+        if (avCodecContext->bits_per_raw_sample > 8) {
+            assert(pixelFormatNuke == AV_PIX_FMT_RGBA64 || pixelFormatNuke == AV_PIX_FMT_RGB48);
+
+            // avPicture.linesize is in bytes, but stride is U16 (2 bytes), so divide linesize by 2
+            assert(inputFrame->linesize[0] / 2 >= width * numDestChannels);
+            unsigned short* dst_pixels = reinterpret_cast<unsigned short*>(inputFrame->data[0]) + y * (inputFrame->linesize[0] / 2);
+
+            for (int x = 0; x < width; ++x) {
+                int srcCol = x * pixelDataNComps;
+                int dstCol = x * numDestChannels;
+                dst_pixels[dstCol + 0] = floatToInt<65536>(src_pixels[srcCol + 0]);
+                dst_pixels[dstCol + 1] = floatToInt<65536>(src_pixels[srcCol + 1]);
+                dst_pixels[dstCol + 2] = floatToInt<65536>(src_pixels[srcCol + 2]);
+                if (hasAlpha) {
+                    dst_pixels[dstCol + 3] = floatToInt<65536>((pixelDataNComps == 4) ? src_pixels[srcCol + 3] : 1.);
+                }
+            }
+        } else {
+            assert(pixelFormatNuke == AV_PIX_FMT_RGBA || pixelFormatNuke == AV_PIX_FMT_RGB24);
+
+            assert(inputFrame->linesize[0] >= width * numDestChannels);
+            unsigned char* dst_pixels = inputFrame->data[0] + y * inputFrame->linesize[0];
+
+            for (int x = 0; x < width; ++x) {
+                int srcCol = x * pixelDataNComps;
+                int dstCol = x * numDestChannels;
+                dst_pixels[dstCol + 0] = floatToInt<256>(src_pixels[srcCol + 0]);
+                dst_pixels[dstCol + 1] = floatToInt<256>(src_pixels[srcCol + 1]);
+                dst_pixels[dstCol + 2] = floatToInt<256>(src_pixels[srcCol + 2]);
+                if (hasAlpha) {
+                    dst_pixels[dstCol + 3] = floatToInt<256>((pixelDataNComps == 4) ? src_pixels[srcCol + 3] : 1.);
+                }
+            }
+        }
+    }
+
+    return inputFrame;
+} // WriteFFmpegPlugin::makeInputFrame
+
 ////////////////////////////////////////////////////////////////////////////////
 // writeVideo
 //
-// * Convert Nuke float RGB values to the ffmpeg pixel format of the encoder.
+// * Convert the RGB frame made by makeInputFrame() to the ffmpeg pixel format of the encoder.
 // * Encode.
 // * Write to file.
 //
+// This may run in the encoder thread (see encodeLoop()), and must not use the OFX suites.
+//
 // @param avFormatContext A reference to an AVFormatContext of the file.
 // @param avStream A reference to an AVStream of a video stream.
 // @param flush A boolean value to flag that any remaining frames in the internal
 //              queue of the encoder should be written to the file. No new
 //              frames will be queued for encoding.
+// @param inputFrame The 8 or 16 bits RGB(A) frame to encode, if not flushing.
 //
 // @return 0 if successful,
 //         <0 otherwise for any failure to convert the pixel format, encode the
@@ -3283,13 +3782,8 @@ WriteFFmpegPlugin::writeVideo(AVFormatContext* avFormatContext,
                               MyAVStream* myAVStream,
                               bool flush,
                               double /*time*/,
-                              const float* pixelData,
-                              const OfxRectI* bounds,
-                              int pixelDataNComps,
-                              int dstNComps,
-                              int rowBytes)
+                              const std::shared_ptr<AVFrame>& inputFrame)
 {
-    assert(dstNComps == 3 || dstNComps == 4 || dstNComps == 0);
     // FIXME enum needed for error codes.
     if (!_isOpen) {
         return -5; // writer is not open!
@@ -3299,12 +3793,11 @@ WriteFFmpegPlugin::writeVideo(AVFormatContext* avFormatContext,
         return -6;
     }
     assert(avFormatContext);
-    if (!avFormatContext || (!flush && (!pixelData || !bounds))) {
+    if (!avFormatContext || (!flush && !inputFrame)) {
         return -7;
     }
+    ProfileScope profiling("ffmpegWriteVideo");
     int ret = 0;
-    // First convert from Nuke floating point RGB to either 16-bit or 8-bit RGB.
-    // Create a buffer to hold either  16-bit or 8-bit RGB.
     AVCodecContext* avCodecContext = myAVStream->codecContext;
     assert(avCodecContext);
     if (!avCodecContext) {
@@ -3312,109 +3805,56 @@ WriteFFmpegPlugin::writeVideo(AVFormatContext* avFormatContext,
     }
     // Create another buffer to convert from either 16-bit or 8-bit RGB
     // to the input pixel format required by the encoder.
+    // For hardware encoders that take hardware frames, this is the format of the frames that are uploaded.
     AVPixelFormat pixelFormatCodec = avCodecContext->pix_fmt;
-    int width = _rodPixel.x2 - _rodPixel.x1;
-    int height = _rodPixel.y2 - _rodPixel.y1;
+    if (avCodecContext->hw_frames_ctx) {
+        pixelFormatCodec = ((AVHWFramesContext*)avCodecContext->hw_frames_ctx->data)->sw_format;
+    }
+    std::shared_ptr<AVFrame> hwFrame;
 
     if (!flush) {
-        assert(pixelData && bounds);
-        assert(bounds->x1 == _rodPixel.x1 && bounds->x2 == _rodPixel.x2 && bounds->y1 == _rodPixel.y1 && bounds->y2 == _rodPixel.y2);
-
-        const bool hasAlpha = alphaEnabled();
-        AVPixelFormat pixelFormatNuke;
-        if (hasAlpha) {
-            pixelFormatNuke = (avCodecContext->bits_per_raw_sample > 8) ? AV_PIX_FMT_RGBA64 : AV_PIX_FMT_RGBA;
-        } else {
-            pixelFormatNuke = (avCodecContext->bits_per_raw_sample > 8) ? AV_PIX_FMT_RGB48 : AV_PIX_FMT_RGB24;
-        }
+        inputFrame_ = inputFrame;
+        AVPixelFormat pixelFormatNuke = (AVPixelFormat)inputFrame_->format;
 
-        inputFrame_.reset(av_frame_alloc(), [](AVFrame* frame) { av_freep(&frame->data[0]); av_frame_free(&frame); });
-        ret = av_image_alloc(inputFrame_->data, inputFrame_->linesize, width, height, pixelFormatNuke, 32);
-
-        if (ret < 0) {
-            inputFrame_.reset();
-        }
-        if (inputFrame_) {
-            ret = 0;
-            // Convert floating point values to unsigned values.
-            assert(rowBytes && rowBytes >= (int)sizeof(float) * width * pixelDataNComps);
-            const int numDestChannels = hasAlpha ? 4 : 3;
-
-            for (int y = 0; y < height; ++y) {
-                int srcY = height - 1 - y;
-                const float* src_pixels = (float*)((char*)pixelData + srcY * rowBytes);
-
-                if (avCodecContext->bits_per_raw_sample > 8) {
-                    assert(pixelFormatNuke == AV_PIX_FMT_RGBA64 || pixelFormatNuke == AV_PIX_FMT_RGB48);
-
-                    // avPicture.linesize is in bytes, but stride is U16 (2 bytes), so divide linesize by 2
-                    assert(inputFrame_->linesize[0] / 2 >= width * numDestChannels);
-                    unsigned short* dst_pixels = reinterpret_cast<unsigned short*>(inputFrame_->data[0]) + y * (inputFrame_->linesize[0] / 2);
-
-                    for (int x = 0; x < width; ++x) {
-                        int srcCol = x * pixelDataNComps;
-                        int dstCol = x * numDestChannels;
-                        dst_pixels[dstCol + 0] = floatToInt<65536>(src_pixels[srcCol + 0]);
-                        dst_pixels[dstCol + 1] = floatToInt<65536>(src_pixels[srcCol + 1]);
-                        dst_pixels[dstCol + 2] = floatToInt<65536>(src_pixels[srcCol + 2]);
-                        if (hasAlpha) {
-                            dst_pixels[dstCol + 3] = floatToInt<65536>((pixelDataNComps == 4) ? src_pixels[srcCol + 3] : 1.);
-                        }
-                    }
-                } else {
-                    assert(pixelFormatNuke == AV_PIX_FMT_RGBA || pixelFormatNuke == AV_PIX_FMT_RGB24);
-
-                    assert(inputFrame_->linesize[0] >= width * numDestChannels);
-                    unsigned char* dst_pixels = inputFrame_->data[0] + y * inputFrame_->linesize[0];
-
-                    for (int x = 0; x < width; ++x) {
-                        int srcCol = x * pixelDataNComps;
-                        int dstCol = x * numDestChannels;
-                        dst_pixels[dstCol + 0] = floatToInt<256>(src_pixels[srcCol + 0]);
-                        dst_pixels[dstCol + 1] = floatToInt<256>(src_pixels[srcCol + 1]);
-                        dst_pixels[dstCol + 2] = floatToInt<256>(src_pixels[srcCol + 2]);
-                        if (hasAlpha) {
-                            dst_pixels[dstCol + 3] = floatToInt<256>((pixelDataNComps == 4) ? src_pixels[srcCol + 3] : 1.);
-                        }
-                    }
-                }
-            }
+        // For any codec an
+        // intermediate buffer is allocated for the
+        // colour space conversion.
 
-            assert(inputFrame_);
-            if (!inputFrame_) {
-                ret = -1;
-            } else {
-                // For any codec an
-                // intermediate buffer is allocated for the
-                // colour space conversion.
+        if (!outputFrame_) {
+            outputFrame_.reset(av_frame_alloc(), [](AVFrame* frame) { av_freep(&frame->data[0]); av_frame_free(&frame); });
 
-                if (!outputFrame_) {
-                    outputFrame_.reset(av_frame_alloc(), [](AVFrame* frame) { av_freep(&frame->data[0]); av_frame_free(&frame); });
+            outputFrame_->width = avCodecContext->width;
+            outputFrame_->height = avCodecContext->height;
+            outputFrame_->format = pixelFormatCodec;
 
-                    outputFrame_->width = avCodecContext->width;
-                    outputFrame_->height = avCodecContext->height;
-                    outputFrame_->format = avCodecContext->pix_fmt;
+            int bufferSize = av_image_alloc(outputFrame_->data, outputFrame_->linesize, outputFrame_->width, outputFrame_->height, pixelFormatCodec, 32);
 
-                    int bufferSize = av_image_alloc(outputFrame_->data, outputFrame_->linesize, outputFrame_->width, outputFrame_->height, pixelFormatCodec, 32);
+            if (bufferSize < 0) {
+                outputFrame_.reset();
+            }
+        }
 
-                    if (bufferSize < 0) {
-                        outputFrame_.reset();
-                    }
-                }
+        if (outputFrame_) {
+            colourSpaceConvert(inputFrame_.get(), outputFrame_.get(), pixelFormatNuke, pixelFormatCodec, avCodecContext);
 
-                if (outputFrame_) {
-                    colourSpaceConvert(inputFrame_.get(), outputFrame_.get(), pixelFormatNuke, pixelFormatCodec, avCodecContext);
+            // see ffmpeg.c:1199 from ffmpeg 3.2.2
+            // MJPEG ignores global_quality, and only uses the quality setting in the pictures.
+            outputFrame_->quality = avCodecContext->global_quality;
+            outputFrame_->pict_type = AV_PICTURE_TYPE_NONE;
+            outputFrame_->pts = _pts_counter;
 
-                    // see ffmpeg.c:1199 from ffmpeg 3.2.2
-                    // MJPEG ignores global_quality, and only uses the quality setting in the pictures.
-                    outputFrame_->quality = avCodecContext->global_quality;
-                    outputFrame_->pict_type = AV_PICTURE_TYPE_NONE;
-                    outputFrame_->pts = _pts_counter;
-                } else {
-                    // av_image_alloc failed.
+            if (avCodecContext->hw_frames_ctx) {
+                // upload to a frame from the encoder's pool
+                hwFrame.reset(av_frame_alloc(), [](AVFrame* frame) { av_frame_free(&frame); });
+                if (!hwFrame || (av_hwframe_get_buffer(avCodecContext->hw_frames_ctx, hwFrame.get(), 0) < 0) || (av_hwframe_transfer_data(hwFrame.get(), outputFrame_.get(), 0) < 0) || (av_frame_copy_props(hwFrame.get(), outputFrame_.get()) < 0)) {
+                    setEncodeError("Cannot upload frame to the hardware encoder");
+                    hwFrame.reset();
                     ret = -1;
                 }
             }
+        } else {
+            // av_image_alloc failed.
+            ret = -1;
         }
     } else {
         inputFrame_.reset();
@@ -3439,7 +3879,11 @@ WriteFFmpegPlugin::writeVideo(AVFormatContext* avFormatContext,
         //       alloc will not have been called.
 
         _pts_counter++;
-        const int bytesEncoded = encodeVideo(avCodecContext, outputFrame_.get(), pkt.pkt());
+        int bytesEncoded;
+        {
+            ProfileScope encodeProfiling("ffmpegEncode");
+            bytesEncoded = encodeVideo(avCodecContext, hwFrame ? hwFrame.get() : outputFrame_.get(), pkt.pkt());
+        }
         const bool encodeSucceeded = (bytesEncoded > 0);
         if (encodeSucceeded) {
             // Each of these packets should consist of a single frame therefore each one
@@ -3462,6 +3906,7 @@ WriteFFmpegPlugin::writeVideo(AVFormatContext* avFormatContext,
 
             pkt->stream_index = avStream->index;
 
+            profileCount("ffmpegPacketBytes", pkt->size);
             const int writeResult = av_write_frame(avFormatContext, pkt.pkt());
 
             const bool writeSucceeded = (writeResult == 0);
@@ -3469,7 +3914,7 @@ WriteFFmpegPlugin::writeVideo(AVFormatContext* avFormatContext,
                 // Report the error.
                 char szError[1024];
                 av_strerror(bytesEncoded, szError, 1024);
-                setPersistentMessage(Message::eMessageError, "", string("Cannot write frame: ") + szError);
+                setEncodeError(string("Cannot write frame: ") + szError);
                 error = true;
             }
         } else {
@@ -3481,7 +3926,7 @@ WriteFFmpegPlugin::writeVideo(AVFormatContext* avFormatContext,
                 // Report the error.
                 char szError[1024];
                 av_strerror(bytesEncoded, szError, 1024);
-                setPersistentMessage(Message::eMessageError, "", string("Cannot encode frame: ") + szError);
+                setEncodeError(string("Cannot encode frame: ") + szError);
                 error = true;
             } else if (flush) {
                 // Flag that the flush is complete.
@@ -3547,11 +3992,7 @@ int
 WriteFFmpegPlugin::writeToFile(AVFormatContext* avFormatContext,
                                bool finalise,
                                double time,
-                               const float* pixelData,
-                               const OfxRectI* bounds,
-                               int pixelDataNComps,
-                               int dstNComps,
-                               int rowBytes)
+                               const std::shared_ptr<AVFrame>& inputFrame)
 {
 #if OFX_FFMPEG_AUDIO
     // Write interleaved audio and video if an audio file has
@@ -3585,11 +4026,11 @@ WriteFFmpegPlugin::writeToFile(AVFormatContext* avFormatContext,
         return -6;
     }
     assert(avFormatContext);
-    if (!avFormatContext || (!finalise && (!pixelData || !bounds))) {
+    if (!avFormatContext || (!finalise && !inputFrame)) {
         return -7;
     }
 
-    return writeVideo(avFormatContext, &_streamVideo, finalise, time, pixelData, bounds, pixelDataNComps, dstNComps, rowBytes);
+    return writeVideo(avFormatContext, &_streamVideo, finalise, time, inputFrame);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -3620,17 +4061,63 @@ WriteFFmpegPlugin::beginEncode(const string& filename,
         return;
     }
 
-    assert(!_convertCtx);
-
     // first, check that the codec setting is OK
     checkCodec();
 
+    _filename = filename;
+    _segmentsEnabled = false;
+    string segmentsDisabledReason;
+    if (_segmented->getValue()) {
+        if (canEncodeSegments(&segmentsDisabledReason)) {
+            // the segments cover the whole output frame range, not only the frames rendered by this process
+            OfxRangeD range;
+            if (!getTimeDomain(range)) {
+                range = _inputClip->getFrameRange();
+            }
+            _segmentsEnabled = true;
+            _segmentsFirstFrame = (int)range.min;
+            _segmentsLastFrame = (int)range.max;
+            _segmentsLength = (std::max)(1, _segmentLength->getValue());
+        }
+    }
+    _rodPixel = rodPixel;
+    _pixelAspectRatio = pixelAspectRatio;
+    _segmentsFrameStep = (std::max)(1, (int)args.frameStep);
+    if (_segmentsEnabled) {
+        beginSegment(getSegment((int)args.frameRange.min), (int)args.frameRange.min);
+    } else {
+        beginEncodeFile(filename, rodPixel, pixelAspectRatio, (int)args.frameRange.min, (int)args.frameRange.max, (int)args.frameStep);
+        if (_isOpen && !segmentsDisabledReason.empty()) {
+            setPersistentMessage(Message::eMessageWarning, "", "Segmented encoding is disabled: " + segmentsDisabledReason);
+        }
+    }
+}
+
+// Open a file and start the encoder.
+// This is the whole output file, or one segment file if _segmentsEnabled.
+void
+WriteFFmpegPlugin::beginEncodeFile(const string& filename,
+                                   const OfxRectI& rodPixel,
+                                   float pixelAspectRatio,
+                                   int firstFrame,
+                                   int lastFrame,
+                                   int frameStep)
+{
+    assert(!_convertCtx);
+
+    // errors of the previous file were reported by endEncodeFile()
+    {
+        tthread::lock_guard<tthread::mutex> guard(_encodeQueueMutex);
+        _encodeFailed = false;
+        _encodeErrorMessage.clear();
+    }
+
     ////////////////////                        ////////////////////
     //////////////////// INITIALIZE FORMAT       ////////////////////
 
-    _filename = filename;
     _rodPixel = rodPixel;
     _pixelAspectRatio = pixelAspectRatio;
+    _isRec709 = isRec709Format(_rodPixel.y2 - _rodPixel.y1);
 
 #if (LIBAVFORMAT_VERSION_MAJOR > 58)
     const AVOutputFormat* avOutputFormat = initFormat(/* reportErrors = */ true);
@@ -3695,14 +4182,9 @@ WriteFFmpegPlugin::beginEncode(const string& filename,
                 }
                 // Activate multithreaded decoding. This must be done before opening the codec; see
                 // http://lists.gnu.org/archive/html/bino-list/2011-08/msg00019.html
-#ifdef AV_CODEC_CAP_AUTO_THREADS
-                if (avCodecContext->codec->capabilities & AV_CODEC_CAP_AUTO_THREADS) {
-                    avCodecContext->thread_count = 0;
-                } else
-#endif
-                {
-                    avCodecContext->thread_count = (std::min)((int)MultiThread::getNumCPUs(), OFX_FFMPEG_MAX_THREADS);
-                }
+                // The threads of all the decoders and encoders share a budget, including the codecs with
+                // AV_CODEC_CAP_AUTO_THREADS, which would otherwise use all the cores.
+                FFmpegThreadBudget::instance().setupThreads(avCodecContext, audioCodec);
 
                 avcodec_parameters_from_context(_streamAudio.stream->codecpar, _streamAudio.codecContext);
 
@@ -3797,6 +4279,27 @@ WriteFFmpegPlugin::beginEncode(const string& filename,
     AVPixelFormat targetPixelFormat = AV_PIX_FMT_YUV422P;
     AVPixelFormat rgbBufferPixelFormat = AV_PIX_FMT_RGB24;
     getPixelFormats(videoCodec, pixelCoding, bitdepth, alpha, rgbBufferPixelFormat, targetPixelFormat);
+
+    // Check that the hardware encoder has a device and accepts these settings,
+    // else use the software encoder for the same codec.
+    if (_hwDeviceCtx) {
+        av_buffer_unref(&_hwDeviceCtx);
+    }
+    if (getHWEncoder(videoCodec->name) != eHWEncoderNone) {
+        if (!probeHWEncoder(videoCodec, targetPixelFormat, rodPixel.x2 - rodPixel.x1, rodPixel.y2 - rodPixel.y1, &_hwDeviceCtx)) {
+            const AVCodec* fallbackCodec = getHWEncoderFallback(videoCodec->id);
+            if (!fallbackCodec) {
+                setPersistentMessage(Message::eMessageError, "", string("The hardware encoder ") + videoCodec->name + " is not available, and there is no software encoder for this codec");
+                freeFormat();
+                throwSuiteStatusException(kOfxStatFailed);
+
+                return;
+            }
+            setPersistentMessage(Message::eMessageWarning, "", string("The hardware encoder ") + videoCodec->name + " is not available, using " + fallbackCodec->name + " instead");
+            videoCodec = fallbackCodec;
+            getPixelFormats(videoCodec, pixelCoding, bitdepth, alpha, rgbBufferPixelFormat, targetPixelFormat);
+        }
+    }
     assert(!_streamVideo.stream);
     if (!_streamVideo.stream) {
         addStream(_formatContext, codecId, &videoCodec, &_streamVideo);
@@ -3809,6 +4312,18 @@ WriteFFmpegPlugin::beginEncode(const string& filename,
 
         AVCodecContext* avCodecContext = _streamVideo.codecContext;
         avCodecContext->pix_fmt = targetPixelFormat;
+        if (_hwDeviceCtx) {
+            int error = setupHWEncoderContext(avCodecContext, videoCodec, _hwDeviceCtx, targetPixelFormat);
+            if (error < 0) {
+                char szError[1024] = { 0 };
+                av_strerror(error, szError, sizeof(szError));
+                setPersistentMessage(Message::eMessageError, "", string("Unable to initialize the hardware encoder: ") + szError);
+                freeFormat();
+                throwSuiteStatusException(kOfxStatFailed);
+
+                return;
+            }
+        }
 
 #if OFX_FFMPEG_SCRATCHBUFFER
         std::size_t picSize = av_image_get_buffer_size(targetPixelFormat,
@@ -3865,21 +4380,9 @@ WriteFFmpegPlugin::beginEncode(const string& filename,
 
         // Activate multithreaded decoding. This must be done before opening the codec; see
         // http://lists.gnu.org/archive/html/bino-list/2011-08/msg00019.html
-#ifdef AV_CODEC_CAP_AUTO_THREADS
-        if (avCodecContext->codec->capabilities & AV_CODEC_CAP_AUTO_THREADS) {
-            avCodecContext->thread_count = 0;
-        } else
-#endif
-        {
-            avCodecContext->thread_count = (std::min)((int)MultiThread::getNumCPUs(), OFX_FFMPEG_MAX_THREADS);
-        }
-#ifdef AV_CODEC_CAP_SLICE_THREADS
-        if (avCodecContext->codec->capabilities & AV_CODEC_CAP_SLICE_THREADS) {
-            // multiple threads are used to decode a single frame. Reduces delay
-            // also, mjpeg prefers this, see libavfocodec/frame_thread_encoder.c:ff_frame_thread_encoder_init()
-            avCodecContext->thread_type = FF_THREAD_SLICE;
-        }
-#endif
+        // The threads of all the decoders and encoders share a budget, including the codecs with
+        // AV_CODEC_CAP_AUTO_THREADS, which would otherwise use all the cores.
+        FFmpegThreadBudget::instance().setupThreads(avCodecContext, videoCodec);
 
 #if OFX_FFMPEG_PRINT_CODECS
         std::cout << "Format: " << _formatContext->oformat->name << " Codec: " << videoCodec->name << " rgbBufferPixelFormat: " << av_get_pix_fmt_name(rgbBufferPixelFormat) << " targetPixelFormat: " << av_get_pix_fmt_name(targetPixelFormat) << " infoBitDepth: " << _infoBitDepth->getValue() << " Profile: " << _streamVideo->codec->profile << std::endl;
@@ -4081,16 +4584,126 @@ WriteFFmpegPlugin::beginEncode(const string& filename,
     // Flag that we didn't encode any frame yet
     {
         tthread::lock_guard<tthread::mutex> guard(_nextFrameToEncodeMutex);
-        _nextFrameToEncode = (int)args.frameRange.min;
-        _firstFrameToEncode = (int)args.frameRange.min;
-        _lastFrameToEncode = (int)args.frameRange.max;
-        _frameStep = (int)args.frameStep;
+        _nextFrameToEncode = firstFrame;
+        _firstFrameToEncode = firstFrame;
+        _lastFrameToEncode = lastFrame;
+        _frameStep = frameStep;
         _nextFrameToEncodeCond.notify_all();
     }
 
     _isOpen = true;
     _error = CLEANUP;
-} // WriteFFmpegPlugin::beginEncode
+
+    // Start the encoder thread, if frames should be encoded asynchronously
+    assert(!_encodeThread);
+    {
+        tthread::lock_guard<tthread::mutex> guard(_encodeQueueMutex);
+        _encodeQueue.clear();
+        _encodeQueueMax = (std::max)(0, _encodeQueueSize->getValue());
+        _encodeQueueBusy = false;
+        _encodeQueueQuit = false;
+    }
+    if (_encodeQueueMax > 0) {
+        _encodeThread = new tthread::thread(encodeThreadFunction, this);
+    }
+} // WriteFFmpegPlugin::beginEncodeFile
+
+void
+WriteFFmpegPlugin::setEncodeError(const string& message)
+{
+    tthread::lock_guard<tthread::mutex> guard(_encodeQueueMutex);
+    _encodeErrorMessage = message;
+}
+
+string
+WriteFFmpegPlugin::getEncodeError()
+{
+    tthread::lock_guard<tthread::mutex> guard(_encodeQueueMutex);
+
+    return _encodeErrorMessage;
+}
+
+void
+WriteFFmpegPlugin::encodeThreadFunction(void* arg)
+{
+    WriteFFmpegPlugin* instance = static_cast<WriteFFmpegPlugin*>(arg);
+
+    instance->encodeLoop();
+}
+
+// Pop frames from the queue and write them to the file, until asked to quit.
+// After an error, the remaining frames are discarded and encode() fails.
+void
+WriteFFmpegPlugin::encodeLoop()
+{
+    for (;;) {
+        EncodeQueueItem item;
+        {
+            tthread::lock_guard<tthread::mutex> guard(_encodeQueueMutex);
+            while (_encodeQueue.empty() && !_encodeQueueQuit) {
+                _encodeQueueCond.wait(guard);
+            }
+            if (_encodeQueue.empty()) {
+                // quit, and nothing left to encode
+                return;
+            }
+            item = _encodeQueue.front();
+            _encodeQueue.pop_front();
+            _encodeQueueBusy = true;
+            _encodeQueueCond.notify_all();
+        }
+        int ret = -1;
+        if (_formatContext && _streamVideo.stream) {
+            // the render that queued the frame has returned: time the encoding separately
+            ProfilerRenderScope profiling(_profiler.get(), "asyncEncode");
+            ret = writeToFile(_formatContext, false, item.time, item.frame);
+        }
+        item.frame.reset();
+        {
+            tthread::lock_guard<tthread::mutex> guard(_encodeQueueMutex);
+            _encodeQueueBusy = false;
+            if (ret) {
+                _encodeFailed = true;
+                _encodeQueue.clear();
+                if ( _encodeErrorMessage.empty() ) {
+                    stringstream ss;
+                    ss << "Cannot encode frame " << item.time;
+                    _encodeErrorMessage = ss.str();
+                }
+            }
+            _encodeQueueCond.notify_all();
+        }
+    }
+}
+
+// Stop the encoder thread. If drain is true, the frames in the queue are encoded
+// first, else they are discarded. Must be called from the host thread, with no
+// render in progress.
+void
+WriteFFmpegPlugin::stopEncodeThread(bool drain)
+{
+    if (!_encodeThread) {
+        return;
+    }
+    {
+        tthread::lock_guard<tthread::mutex> guard(_encodeQueueMutex);
+        if (!drain) {
+            _encodeQueue.clear();
+        }
+        _encodeQueueQuit = true;
+        _encodeQueueCond.notify_all();
+    }
+    _encodeThread->join();
+    delete _encodeThread;
+    _encodeThread = nullptr;
+    {
+        tthread::lock_guard<tthread::mutex> guard(_encodeQueueMutex);
+        _encodeQueue.clear();
+        _encodeQueueMax = 0;
+        _encodeQueueBusy = false;
+        _encodeQueueQuit = false;
+    }
+}
 
 #define checkAvError()                                              \
     if (error < 0) {                                                \
@@ -4102,7 +4715,8 @@ WriteFFmpegPlugin::beginEncode(const string& filename,
     }
 
 void
-WriteFFmpegPlugin::encode(const string& filename,
+WriteFFmpegPlugin::encode(void* /*user_data*/,
+                          const string& filename,
                           const OfxTime time,
                           const string& /*viewName*/,
                           const float* pixelData,
@@ -4132,9 +4746,9 @@ WriteFFmpegPlugin::encode(const string& filename,
 
         return;
     }
-    if (filename != string(_formatContext->url)) {
+    if (filename != _filename) {
         stringstream ss;
-        ss << "Trying to render " << filename << " but another active render is rendering " << string(_formatContext->url);
+        ss << "Trying to render " << filename << " but another active render is rendering " << _filename;
         setPersistentMessage(Message::eMessageError, "", ss.str());
         throwSuiteStatusException(kOfxStatFailed);
 
@@ -4148,6 +4762,25 @@ WriteFFmpegPlugin::encode(const string& filename,
         return;
     }
 
+    if (_segmentsEnabled) {
+        // Frames are rendered sequentially: when the next frame is past the current segment,
+        // the segment is complete and the next segment file is opened.
+        bool nextSegment;
+        {
+            tthread::lock_guard<tthread::mutex> guard(_nextFrameToEncodeMutex);
+            nextSegment = (_nextFrameToEncode == time && time > _lastFrameToEncode);
+        }
+        if (nextSegment) {
+            endSegment();
+            beginSegment(getSegment((int)time), (int)time);
+            if (!_isOpen) {
+                throwSuiteStatusException(kOfxStatFailed);
+
+                return;
+            }
+        }
+    }
+
     /// Check that we're really encoding in sequential order
     {
         tthread::lock_guard<tthread::mutex> guard(_nextFrameToEncodeMutex);
@@ -4177,13 +4810,43 @@ WriteFFmpegPlugin::encode(const string& filename,
                     return;
                 }
                 assert(_formatContext);
-                if (!writeToFile(_formatContext, false, time, pixelData, &bounds, pixelDataNComps, dstNComps, rowBytes)) {
+                std::shared_ptr<AVFrame> inputFrame = makeInputFrame(pixelData, bounds, pixelDataNComps, rowBytes);
+                if (!inputFrame) {
+                    setPersistentMessage(Message::eMessageError, "", "Cannot allocate frame");
+                    throwSuiteStatusException(kOfxStatErrMemory);
+
+                    return;
+                }
+                bool written = false;
+                if (_encodeThread) {
+                    // queue the frame for the encoder thread, waiting while the queue is full
+                    tthread::lock_guard<tthread::mutex> queueGuard(_encodeQueueMutex);
+                    while (!_encodeFailed && (int)_encodeQueue.size() >= _encodeQueueMax && !abort()) {
+                        _encodeQueueCond.wait(queueGuard);
+                    }
+                    if (!_encodeFailed && !abort()) {
+                        EncodeQueueItem item;
+                        item.time = time;
+                        item.frame = inputFrame;
+                        _encodeQueue.push_back(item);
+                        _encodeQueueCond.notify_all();
+                        written = true;
+                    }
+                } else {
+                    written = !writeToFile(_formatContext, false, time, inputFrame);
+                }
+                inputFrame.reset();
+                if (written) {
                     _error = SUCCESS;
                     _nextFrameToEncode = (int)time + _frameStep;
                     if (abort()) {
                         _nextFrameToEncode = INT_MIN;
                     }
                 } else {
+                    string message = getEncodeError();
+                    if ( !message.empty() ) {
+                        setPersistentMessage(Message::eMessageError, "", message);
+                    }
                     throwSuiteStatusException(kOfxStatFailed);
 
                     return;
@@ -4210,15 +4873,49 @@ WriteFFmpegPlugin::encode(const string& filename,
 //
 void
 WriteFFmpegPlugin::endEncode(const EndSequenceRenderArguments& /*args*/)
+{
+    if (_segmentsEnabled) {
+        endSegment();
+        joinSegments();
+        _segmentsEnabled = false;
+    } else {
+        endEncodeFile();
+    }
+    // a frame that failed to encode asynchronously was already reported as rendered to the host
+    bool encodeFailed;
+    {
+        tthread::lock_guard<tthread::mutex> guard(_encodeQueueMutex);
+        encodeFailed = _encodeFailed;
+    }
+    if (encodeFailed) {
+        throwSuiteStatusException(kOfxStatFailed);
+    }
+}
+
+// Flush the encoder and close the file.
+// @return true if the file was finalised.
+bool
+WriteFFmpegPlugin::endEncodeFile()
 {
     if (!_formatContext) {
-        return;
+        return false;
     }
 
     if (_error == IGNORE_FINISH) {
         freeFormat();
 
-        return;
+        return false;
+    }
+
+    // Encode the frames that are still queued
+    stopEncodeThread(true);
+    bool encodeFailed;
+    {
+        tthread::lock_guard<tthread::mutex> guard(_encodeQueueMutex);
+        encodeFailed = _encodeFailed;
+        if (encodeFailed) {
+            setPersistentMessage(Message::eMessageError, "", _encodeErrorMessage);
+        }
     }
 
     bool flushFrames = true;
@@ -4252,13 +4949,353 @@ WriteFFmpegPlugin::endEncode(const EndSequenceRenderArguments& /*args*/)
 #endif
 
     // Finalise the movie.
-    av_write_trailer(_formatContext);
+    int error = av_write_trailer(_formatContext);
 
     freeFormat();
 
     _pts_counter = 0;
+
+    // the file is closed anyway, but it misses the frames that the encoder thread could not encode
+    return (error >= 0) && !encodeFailed;
+} // WriteFFmpegPlugin::endEncodeFile
+
+// Segments can be encoded separately and joined if all frames are keyframes.
+// This uses the same codec properties as the visibility of the GOP parameters.
+bool
+WriteFFmpegPlugin::canEncodeSegments(string* reason) const
+{
+    const AVOutputFormat* avOutputFormat = initFormat(/* reportErrors = */ false);
+    AVCodecID codecId = AV_CODEC_ID_NONE;
+    const AVCodec* videoCodec = nullptr;
+
+    if (!avOutputFormat || !initCodec(avOutputFormat, codecId, videoCodec) || !videoCodec) {
+        *reason = "unknown codec";
+
+        return false;
+    }
+    if (avOutputFormat->flags & AVFMT_NOFILE) {
+        *reason = string("the ") + avOutputFormat->name + " format does not write a single file";
+
+        return false;
+    }
+    CodecParams p;
+    GetCodecSupportedParams(videoCodec, &p);
+    bool intraOnly = !p.interGOP;
+    if (!intraOnly) {
+        intraOnly = (_gopSize->getValue() == 1) && (!p.interB || (_bFrames->getValue() == 0));
+    }
+    if (!intraOnly) {
+        *reason = string("the ") + videoCodec->name + " codec is not used in intra-only mode (set the Keyframe Interval to 1 and Max B-Frames to 0)";
+
+        return false;
+    }
+
+    return true;
 }
 
+// the segment containing the given frame: segments contain _segmentsLength of the frames that are
+// rendered, i.e. one every _segmentsFrameStep frames from _segmentsFirstFrame
+int
+WriteFFmpegPlugin::getSegment(int frame) const
+{
+    const int frameIndex = (frame - _segmentsFirstFrame) / _segmentsFrameStep;
+
+    return frameIndex / _segmentsLength;
+}
+
+int
+WriteFFmpegPlugin::getSegmentFirstFrame(int segment) const
+{
+    return _segmentsFirstFrame + segment * _segmentsLength * _segmentsFrameStep;
+}
+
+// e.g. "movie.seg0003.mov" for segment 3 of "movie.mov"
+string
+WriteFFmpegPlugin::getSegmentFilename(int segment) const
+{
+    const size_t extLength = extension(_filename).size();
+    const string base = extLength ? _filename.substr(0, _filename.size() - extLength - 1) : _filename;
+    char segmentStr[32];
+
+    std::snprintf(segmentStr, sizeof(segmentStr), ".seg%04d", segment);
+
+    return base + segmentStr + (extLength ? _filename.substr(_filename.size() - extLength - 1) : string());
+}
+
+// Open the file of the given segment, to encode from firstFrame to the end of the segment (or of
+// the output frame range). The file is written with a ".part" suffix until it contains all its frames.
+void
+WriteFFmpegPlugin::beginSegment(int segment,
+                                int firstFrame)
+{
+    _segment = segment;
+    const int segmentFirstFrame = getSegmentFirstFrame(segment);
+    const int segmentLastFrame = (std::min)(getSegmentFirstFrame(segment + 1) - 1, _segmentsLastFrame);
+    beginEncodeFile(getSegmentFilename(segment) + ".part", _rodPixel, _pixelAspectRatio, firstFrame, segmentLastFrame, _segmentsFrameStep);
+    if (_isOpen && firstFrame != segmentFirstFrame) {
+        setPersistentMessage(Message::eMessageWarning, "", "The rendered frame range does not start at a segment boundary, so " + getSegmentFilename(segment) + " will not be written");
+    }
+}
+
+// Close the current segment file, and rename it if all its frames were encoded.
+void
+WriteFFmpegPlugin::endSegment()
+{
+    if (!_formatContext) {
+        return;
+    }
+    const string partFilename = _formatContext->url;
+    const int segmentFirstFrame = getSegmentFirstFrame(_segment);
+    bool complete;
+    {
+        tthread::lock_guard<tthread::mutex> guard(_nextFrameToEncodeMutex);
+        complete = (_firstFrameToEncode == segmentFirstFrame && _nextFrameToEncode != INT_MIN && _nextFrameToEncode > _lastFrameToEncode);
+    }
+    bool written = endEncodeFile();
+    {
+        // _nextFrameToEncode counts the frames queued, not the frames encoded by the encoder thread
+        tthread::lock_guard<tthread::mutex> guard(_encodeQueueMutex);
+        complete = complete && !_encodeFailed;
+    }
+    const string segmentFilename = getSegmentFilename(_segment);
+    if (complete && written) {
+        if (OFX::exists_utf8(segmentFilename.c_str())) {
+            OFX::remove_utf8(segmentFilename.c_str());
+        }
+#if defined(_WIN32) || defined(__WIN32__) || defined(WIN32)
+        const bool renamed = (_wrename(utf8ToUtf16(partFilename).c_str(), utf8ToUtf16(segmentFilename).c_str()) == 0);
+#else
+        const bool renamed = (std::rename(partFilename.c_str(), segmentFilename.c_str()) == 0);
+#endif
+        if (!renamed) {
+            setPersistentMessage(Message::eMessageError, "", "Cannot rename " + partFilename + " to " + segmentFilename);
+        }
+    } else {
+        OFX::remove_utf8(partFilename.c_str());
+    }
+}
+
+// name of this host, to tell whether the process that created a join lock file runs here
+static string
+getHostName()
+{
+    char name[256] = { 0 };
+#if defined(_WIN32) || defined(__WIN32__) || defined(WIN32)
+    DWORD size = sizeof(name);
+    if ( !GetComputerNameA(name, &size) ) {
+        name[0] = 0;
+    }
+#else
+    if (gethostname(name, sizeof(name) - 1) != 0) {
+        name[0] = 0;
+    }
+#endif
+
+    return name;
+}
+
+static bool
+isProcessRunning(long pid)
+{
+#if defined(_WIN32) || defined(__WIN32__) || defined(WIN32)
+    HANDLE process = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, (DWORD)pid);
+    if (!process) {
+        return false;
+    }
+    DWORD exitCode = 0;
+    bool running = GetExitCodeProcess(process, &exitCode) && (exitCode == STILL_ACTIVE);
+    CloseHandle(process);
+
+    return running;
+#else
+
+    return (kill( (pid_t)pid, 0 ) == 0) || (errno == EPERM);
+#endif
+}
+
+static long
+getProcessId()
+{
+#if defined(_WIN32) || defined(__WIN32__) || defined(WIN32)
+
+    return (long)GetCurrentProcessId();
+#else
+
+    return (long)getpid();
+#endif
+}
+
+// The join lock file contains the PID and host of the process that joins the segments, and the time it started.
+// It is stale if that process does not run anymore, or if it is older than OFX_FFMPEG_SEGMENTS_JOIN_TIMEOUT
+// (a process on another host may have crashed).
+static bool
+isJoinLockStale(const string& lockFilename)
+{
+    std::FILE* lock = OFX::fopen_utf8(lockFilename.c_str(), "r");
+    if (!lock) {
+        // removed in the meantime
+        return true;
+    }
+    long pid = 0;
+    long long startTime = 0;
+    char host[256] = { 0 };
+    int n = std::fscanf(lock, "%ld %lld %255s", &pid, &startTime, host);
+    std::fclose(lock);
+    if (n < 2) {
+        // being written by the process that created it
+        return false;
+    }
+    if ( (long long)std::time(nullptr) - startTime > OFX_FFMPEG_SEGMENTS_JOIN_TIMEOUT ) {
+        return true;
+    }
+
+    return (n == 3) && (getHostName() == host) && !isProcessRunning(pid);
+}
+
+// If all segment files exist, remux them into the output file without re-encoding,
+// offsetting the timestamps of each segment by the duration of the previous ones.
+// Several processes may finish their last segment at the same time: a lock file makes sure
+// that only one of them joins the segments.
+// Only the video stream is remuxed. The timecode of the first segment is kept as the "timecode"
+// metadata of the video stream, from which the QuickTime muxer writes the timecode track.
+void
+WriteFFmpegPlugin::joinSegments()
+{
+    const int nSegments = getSegment(_segmentsLastFrame) + 1;
+
+    for (int segment = 0; segment < nSegments; ++segment) {
+        if (!OFX::exists_utf8(getSegmentFilename(segment).c_str())) {
+            // other segments are still being rendered
+            return;
+        }
+    }
+    const string lockFilename = _filename + ".join";
+    std::FILE* lock = OFX::fopen_utf8(lockFilename.c_str(), "wx");
+    if ( !lock && isJoinLockStale(lockFilename) ) {
+        // left by a process that crashed or was killed while joining
+        OFX::remove_utf8(lockFilename.c_str());
+        lock = OFX::fopen_utf8(lockFilename.c_str(), "wx");
+    }
+    if (!lock) {
+        // another process is joining the segments
+        return;
+    }
+    std::fprintf(lock, "%ld %lld %s\n", getProcessId(), (long long)std::time(nullptr), getHostName().c_str());
+    std::fflush(lock);
+
+    const AVOutputFormat* avOutputFormat = initFormat(/* reportErrors = */ true);
+    AVFormatContext* outContext = nullptr;
+    AVStream* outStream = nullptr;
+    int64_t offset = 0; // start of the current segment, in outStream->time_base
+    string error;
+    if (OFX::exists_utf8(_filename.c_str())) {
+        OFX::remove_utf8(_filename.c_str());
+    }
+    if (!avOutputFormat || avformat_alloc_output_context2(&outContext, avOutputFormat, nullptr, _filename.c_str()) < 0 || !outContext) {
+        error = "Cannot create the output format context";
+    }
+    for (int segment = 0; segment < nSegments && error.empty(); ++segment) {
+        const string segmentFilename = getSegmentFilename(segment);
+        AVFormatContext* inContext = nullptr;
+        if (avformat_open_input(&inContext, segmentFilename.c_str(), nullptr, nullptr) < 0) {
+            error = "Cannot open " + segmentFilename;
+            break;
+        }
+        int videoIndex = -1;
+        if (avformat_find_stream_info(inContext, nullptr) >= 0) {
+            videoIndex = av_find_best_stream(inContext, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+        }
+        if (videoIndex < 0) {
+            error = "No video stream in " + segmentFilename;
+            avformat_close_input(&inContext);
+            break;
+        }
+        AVStream* inStream = inContext->streams[videoIndex];
+        if (!outStream) {
+            // the first segment gives the stream parameters and the metadata
+            outStream = avformat_new_stream(outContext, nullptr);
+            if (!outStream || avcodec_parameters_copy(outStream->codecpar, inStream->codecpar) < 0) {
+                error = "Cannot create the output stream";
+            } else {
+                outStream->time_base = inStream->time_base;
+                outStream->avg_frame_rate = inStream->avg_frame_rate;
+                outStream->r_frame_rate = inStream->r_frame_rate;
+                outStream->sample_aspect_ratio = inStream->sample_aspect_ratio;
+                av_dict_copy(&outStream->metadata, inStream->metadata, 0);
+                av_dict_copy(&outContext->metadata, inContext->metadata, 0);
+                if ( !av_dict_get(outStream->metadata, "timecode", nullptr, 0) ) {
+                    // the timecode track is a data stream of the segment, which is not remuxed
+                    for (unsigned int i = 0; i < inContext->nb_streams; ++i) {
+                        AVDictionaryEntry* timecode = av_dict_get(inContext->streams[i]->metadata, "timecode", nullptr, 0);
+                        if (timecode) {
+                            av_dict_set(&outStream->metadata, "timecode", timecode->value, 0);
+                            break;
+                        }
+                    }
+                }
+                if (!(outContext->oformat->flags & AVFMT_NOFILE) && avio_open(&outContext->pb, _filename.c_str(), AVIO_FLAG_WRITE) < 0) {
+                    error = "Unable to open file " + _filename;
+                } else {
+                    std::string movflags = "write_colr";
+                    if (_fastStart->getValue()) {
+                        movflags += "+faststart";
+                    }
+                    AVDictionary* headerParams = nullptr;
+                    av_dict_set(&headerParams, "movflags", movflags.c_str(), 0);
+                    if (avformat_write_header(outContext, &headerParams) < 0) {
+                        error = "Unable to write file header";
+                    }
+                    av_dict_free(&headerParams);
+                }
+            }
+        }
+        int64_t segmentEnd = offset;
+        AVPacket* pkt = av_packet_alloc();
+        while (error.empty() && pkt && av_read_frame(inContext, pkt) >= 0) {
+            if (pkt->stream_index == videoIndex) {
+                av_packet_rescale_ts(pkt, inStream->time_base, outStream->time_base);
+                if ((int64_t)pkt->pts != AV_NOPTS_VALUE) {
+                    pkt->pts += offset;
+                }
+                if ((int64_t)pkt->dts != AV_NOPTS_VALUE) {
+                    pkt->dts += offset;
+                }
+                const int64_t ts = ((int64_t)pkt->pts != AV_NOPTS_VALUE) ? pkt->pts : pkt->dts;
+                if (ts != AV_NOPTS_VALUE) {
+                    segmentEnd = (std::max)(segmentEnd, ts + (std::max)(pkt->duration, (int64_t)1));
+                }
+                pkt->stream_index = outStream->index;
+                pkt->pos = -1;
+                if (av_interleaved_write_frame(outContext, pkt) < 0) {
+                    error = "Cannot write frame from " + segmentFilename;
+                }
+            }
+            av_packet_unref(pkt);
+        }
+        av_packet_free(&pkt);
+        avformat_close_input(&inContext);
+        offset = segmentEnd;
+    }
+    if (error.empty() && outStream && av_write_trailer(outContext) < 0) {
+        error = "Cannot write the file trailer";
+    }
+    if (outContext) {
+        if (outContext->pb && !(outContext->oformat->flags & AVFMT_NOFILE)) {
+            avio_closep(&outContext->pb);
+        }
+        avformat_free_context(outContext);
+    }
+    if (error.empty()) {
+        for (int segment = 0; segment < nSegments; ++segment) {
+            OFX::remove_utf8(getSegmentFilename(segment).c_str());
+        }
+    } else {
+        setPersistentMessage(Message::eMessageError, "", "Cannot join the segments: " + error);
+    }
+    std::fclose(lock);
+    OFX::remove_utf8(lockFilename.c_str());
+} // WriteFFmpegPlugin::joinSegments
+
 void
 WriteFFmpegPlugin::setOutputFrameRate(double fps)
 {
@@ -4846,7 +5883,9 @@ WriteFFmpegPlugin::changedClip(const InstanceChangedArgs& /*args*/,
 void
 WriteFFmpegPlugin::freeFormat()
 {
+    stopEncodeThread(false);
     if (_streamVideo.stream) {
+        FFmpegThreadBudget::instance().remove(_streamVideo.codecContext);
         avcodec_free_context(&_streamVideo.codecContext);
         _streamVideo.codecContext = nullptr;
         _streamVideo.stream = nullptr;
@@ -4855,6 +5894,7 @@ WriteFFmpegPlugin::freeFormat()
     }
 #if OFX_FFMPEG_AUDIO
     if (_streamAudio.stream) {
+        FFmpegThreadBudget::instance().remove(_streamAudio.codecContext);
         avcodec_free_context(&_streamAudio.codecContext);
         _streamAudio.codecContext = nullptr;
         _streamAudio.stream = nullptr;
@@ -4873,6 +5913,9 @@ WriteFFmpegPlugin::freeFormat()
         sws_freeContext(_convertCtx);
         _convertCtx = nullptr;
     }
+    if (_hwDeviceCtx) {
+        av_buffer_unref(&_hwDeviceCtx);
+    }
     {
         tthread::lock_guard<tthread::mutex> guard(_nextFrameToEncodeMutex);
         _nextFrameToEncode = INT_MIN;
@@ -5512,6 +6555,45 @@ WriteFFmpegPluginFactory::describeInContext(ImageEffectDescriptor& desc,
         }
     }
 
+    ///////////Encode Queue
+    {
+        IntParamDescriptor* param = desc.defineIntParam(kParamEncodeQueueSize);
+        param->setLabel(kParamEncodeQueueSizeLabel);
+        param->setHint(kParamEncodeQueueSizeHint);
+        param->setRange(0, kParamEncodeQueueSizeMax);
+        param->setDisplayRange(0, kParamEncodeQueueSizeMax);
+        param->setDefault(kParamEncodeQueueSizeDefault);
+        param->setAnimates(false);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+
+    ///////////Segmented Encoding
+    {
+        BooleanParamDescriptor* param = desc.defineBooleanParam(kParamSegmented);
+        param->setLabel(kParamSegmentedLabel);
+        param->setHint(kParamSegmentedHint);
+        param->setDefault(false);
+        param->setAnimates(false);
+        param->setLayoutHint(eLayoutHintNoNewLine, 1);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+    {
+        IntParamDescriptor* param = desc.defineIntParam(kParamSegmentLength);
+        param->setLabel(kParamSegmentLengthLabel);
+        param->setHint(kParamSegmentLengthHint);
+        param->setRange(1, INT_MAX);
+        param->setDisplayRange(1, 1000);
+        param->setDefault(kParamSegmentLengthDefault);
+        param->setAnimates(false);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+
     /////////// Advanced group
     {
         GroupParamDescriptor* group = desc.defineGroupParam(kParamAdvanced);
@@ -23,6 +23,8 @@
  */
 
 #include "GenericOCIO.h"
+#include "IOLRUCache.h"
+#include "IOProfiler.h"
 
 /*
    http://opencolorio.org/userguide/config_syntax.html#roles
@@ -42,6 +44,7 @@
 
 #include <cstdlib>
 #include <cstring>
+#include <sstream>
 #ifdef DEBUG
 #include <cstdio>
 #define DBG(x) x
@@ -266,6 +269,7 @@ GenericOCIO::GenericOCIO(ImageEffect* parent)
     , _contextValue3(NULL)
     , _contextKey4(NULL)
     , _contextValue4(NULL)
+    , _precision(NULL)
     , _config()
 #endif
 {
@@ -311,6 +315,9 @@ GenericOCIO::GenericOCIO(ImageEffect* parent)
         assert(_contextKey1 && _contextKey2 && _contextKey3 && _contextKey4);
         assert(_contextValue1 && _contextValue2 && _contextValue3 && _contextValue4);
     }
+    if (_parent->paramExists(kOCIOParamPrecision)) {
+        _precision = _parent->fetchChoiceParam(kOCIOParamPrecision);
+    }
 #endif
     // setup the GUI
     // setValue() may be called from createInstance, according to
@@ -601,7 +608,7 @@ GenericOCIO::isIdentity(double time) const
     try {
         // maybe the names are not the same, but it's still a no-op (e.g. "scene_linear" and "linear")
         OCIO::ConstContextRcPtr context = getLocalContext(time); //_config->getCurrentContext();
-        OCIO::ConstProcessorRcPtr proc = _config->getProcessor(context, inputSpace.c_str(), outputSpace.c_str());
+        OCIO::ConstProcessorRcPtr proc = getCachedProcessor(_config, context, inputSpace, outputSpace);
 
         return proc->isNoOp();
     } catch (const std::exception& e) {
@@ -759,11 +766,300 @@ GenericOCIO::setValues(const OCIO::ConstContextRcPtr& context,
 {
     AutoMutex guard(_procMutex);
 
-    if (!_proc || (context != _procContext) || (inputSpace != _procInputSpace) || (outputSpace != _procOutputSpace)) {
-        _procContext = context;
+    if (_proc && (_config == _procConfig) && (context == _procContext) && (inputSpace == _procInputSpace) && (outputSpace == _procOutputSpace)) {
+        return;
+    }
+    // getLocalContext() returns a new context each time context variables are set: compare their cache IDs
+    string contextCacheID = context ? context->getCacheID() : "";
+    if (!_proc || (_config != _procConfig) || (contextCacheID != _procContextCacheID) || (inputSpace != _procInputSpace) || (outputSpace != _procOutputSpace)) {
+        _proc = getCachedProcessor(_config, context, inputSpace, outputSpace);
+        _procConfig = _config;
+        _procContextCacheID = contextCacheID;
         _procInputSpace = inputSpace;
         _procOutputSpace = outputSpace;
-        _proc = _config->getProcessor(context, inputSpace.c_str(), outputSpace.c_str());
+    }
+    _procContext = context;
+}
+
+namespace {
+// processors are cheap to keep, but the keys of contexts that vary over time are not bounded
+const size_t kProcessorCacheMaxSize = 256;
+
+// processors shared by all GenericOCIO instances
+struct ProcessorCache {
+    ProcessorCache()
+        : processors(kProcessorCacheMaxSize, 0)
+#if OCIO_VERSION_HEX >= 0x02000000
+        , cpuProcessors(kProcessorCacheMaxSize, 0)
+#endif
+    {
+    }
+
+    LRUCache<string, OCIO::ConstProcessorRcPtr> processors;
+#if OCIO_VERSION_HEX >= 0x02000000
+    LRUCache<string, OCIO::ConstCPUProcessorRcPtr> cpuProcessors;
+#endif
+};
+
+ProcessorCache&
+processorCache()
+{
+    static ProcessorCache cache;
+
+    return cache;
+}
+}
+
+OCIO::ConstProcessorRcPtr
+GenericOCIO::getCachedProcessor(const OCIO::ConstConfigRcPtr& config,
+                                const OCIO::ConstContextRcPtr& context,
+                                const string& inputSpace,
+                                const string& outputSpace)
+{
+    assert(config);
+    string key;
+    {
+        AutoSetAndRestoreThreadLocale locale;
+        key = string(context ? config->getCacheID(context) : config->getCacheID()) + '|' + inputSpace + '|' + outputSpace;
+    }
+    ProcessorCache& cache = processorCache();
+    OCIO::ConstProcessorRcPtr proc;
+    if ( cache.processors.get(key, &proc) ) {
+        return proc;
+    }
+    proc = context ? config->getProcessor(context, inputSpace.c_str(), outputSpace.c_str()) : config->getProcessor(inputSpace.c_str(), outputSpace.c_str());
+
+    return cache.processors.insert(key, proc);
+}
+
+#if OCIO_VERSION_HEX >= 0x02000000
+OCIO::ConstCPUProcessorRcPtr
+GenericOCIO::getCachedCPUProcessor(const OCIO::ConstProcessorRcPtr& proc)
+{
+    assert(proc);
+    // only the float to float processor with the default optimization is used
+    const string key = proc->getCacheID();
+    ProcessorCache& cache = processorCache();
+    OCIO::ConstCPUProcessorRcPtr cpuproc;
+    if ( cache.cpuProcessors.get(key, &cpuproc) ) {
+        return cpuproc;
+    }
+    {
+        AutoSetAndRestoreThreadLocale locale;
+        cpuproc = proc->getOptimizedCPUProcessor(OCIO::BIT_DEPTH_F32, OCIO::BIT_DEPTH_F32,
+                                                 OCIO::OPTIMIZATION_DEFAULT);
+    }
+
+    return cache.cpuProcessors.insert(key, cpuproc);
+}
+#endif
+
+void
+GenericOCIO::clearProcessorCache()
+{
+    ProcessorCache& cache = processorCache();
+
+    cache.processors.clear();
+#if OCIO_VERSION_HEX >= 0x02000000
+    cache.cpuProcessors.clear();
+#endif
+}
+
+void
+OCIOProcessor::setProcessor(const OCIO::ConstProcessorRcPtr& proc)
+{
+    _proc = proc;
+#if OCIO_VERSION_HEX >= 0x02000000
+    _cpuProc.reset();
+    if (proc) {
+        try {
+            // build it once for all tiles
+            _cpuProc = GenericOCIO::getCachedCPUProcessor(proc);
+        } catch (const std::exception&) {
+            // the error is reported by multiThreadProcessImages()
+        }
+    }
+#endif
+}
+
+OCIOBakedLut::OCIOBakedLut(const OCIO::ConstProcessorRcPtr& proc,
+                           int size)
+    : _size(size)
+    , _lut((size_t)size * size * size * 3)
+{
+    assert(size >= 2);
+    // the LUT points, red varying fastest
+    std::vector<float> domain(size);
+    for (int i = 0; i < size; ++i) {
+        domain[i] = unshape(i / (float)(size - 1));
+    }
+    float* p = &_lut[0];
+    for (int b = 0; b < size; ++b) {
+        for (int g = 0; g < size; ++g) {
+            for (int r = 0; r < size; ++r, p += 3) {
+                p[0] = domain[r];
+                p[1] = domain[g];
+                p[2] = domain[b];
+            }
+        }
+    }
+    AutoSetAndRestoreThreadLocale locale;
+    OCIO::PackedImageDesc img(&_lut[0], size, size * size, 3);
+#if OCIO_VERSION_HEX >= 0x02000000
+    GenericOCIO::getCachedCPUProcessor(proc)->apply(img);
+#else
+    proc->apply(img);
+#endif
+}
+
+// maps [0,kOCIOBakedLutMaxInput] to [0,1]
+float
+OCIOBakedLut::shape(float x)
+{
+    x = (std::max)(0.f, (std::min)(x, kOCIOBakedLutMaxInput));
+
+    return x / (1.f + x) * ((1.f + kOCIOBakedLutMaxInput) / kOCIOBakedLutMaxInput);
+}
+
+float
+OCIOBakedLut::unshape(float s)
+{
+    s *= kOCIOBakedLutMaxInput / (1.f + kOCIOBakedLutMaxInput);
+
+    return s / (1.f - s);
+}
+
+void
+OCIOBakedLut::apply(float* pix,
+                    int n,
+                    int nComponents) const
+{
+    const int size = _size;
+    const float scale = (float)(size - 1);
+    const float* lut = &_lut[0];
+    const size_t dg = (size_t)size * 3;
+    const size_t db = (size_t)size * size * 3;
+
+    for (int x = 0; x < n; ++x, pix += nComponents) {
+        const float r = shape(pix[0]) * scale;
+        const float g = shape(pix[1]) * scale;
+        const float b = shape(pix[2]) * scale;
+        const int ri = (std::min)((int)r, size - 2);
+        const int gi = (std::min)((int)g, size - 2);
+        const int bi = (std::min)((int)b, size - 2);
+        const float fr = r - ri;
+        const float fg = g - gi;
+        const float fb = b - bi;
+        const float* c000 = lut + (bi * db + gi * dg + ri * 3);
+        const float* c111 = c000 + db + dg + 3;
+        const float* c1;
+        const float* c2;
+        float w0, w1, w2, w3;
+        // the tetrahedron containing the point, from the ordering of the fractional parts
+        if (fr > fg) {
+            if (fg > fb) {
+                c1 = c000 + 3;
+                c2 = c000 + dg + 3;
+                w0 = 1.f - fr;
+                w1 = fr - fg;
+                w2 = fg - fb;
+                w3 = fb;
+            } else if (fr > fb) {
+                c1 = c000 + 3;
+                c2 = c000 + db + 3;
+                w0 = 1.f - fr;
+                w1 = fr - fb;
+                w2 = fb - fg;
+                w3 = fg;
+            } else {
+                c1 = c000 + db;
+                c2 = c000 + db + 3;
+                w0 = 1.f - fb;
+                w1 = fb - fr;
+                w2 = fr - fg;
+                w3 = fg;
+            }
+        } else {
+            if (fb > fg) {
+                c1 = c000 + db;
+                c2 = c000 + db + dg;
+                w0 = 1.f - fb;
+                w1 = fb - fg;
+                w2 = fg - fr;
+                w3 = fr;
+            } else if (fb > fr) {
+                c1 = c000 + dg;
+                c2 = c000 + db + dg;
+                w0 = 1.f - fg;
+                w1 = fg - fb;
+                w2 = fb - fr;
+                w3 = fr;
+            } else {
+                c1 = c000 + dg;
+                c2 = c000 + dg + 3;
+                w0 = 1.f - fg;
+                w1 = fg - fr;
+                w2 = fr - fb;
+                w3 = fb;
+            }
+        }
+        for (int c = 0; c < 3; ++c) {
+            pix[c] = w0 * c000[c] + w1 * c1[c] + w2 * c2[c] + w3 * c111[c];
+        }
+    }
+}
+
+namespace {
+// the baked LUTs, keyed by processor cache ID and size. They are bigger than the processors, keep only a few of them
+const size_t kBakedLutCacheMaxSize = 8;
+
+typedef LRUCache<string, std::shared_ptr<const OCIOBakedLut> > BakedLutCache;
+
+BakedLutCache&
+bakedLutCache()
+{
+    static BakedLutCache cache(kBakedLutCacheMaxSize, 0, "Baked LUTs (OCIO)", MemoryGovernor::ePriorityNormal);
+
+    return cache;
+}
+}
+
+std::shared_ptr<const OCIOBakedLut>
+OCIOBakedLut::get(const OCIO::ConstProcessorRcPtr& proc,
+                  int size)
+{
+    static GenericOCIO::Mutex bakeMutex;
+
+    std::ostringstream ss;
+    ss << proc->getCacheID() << '|' << size;
+    const string key = ss.str();
+    BakedLutCache& cache = bakedLutCache();
+    std::shared_ptr<const OCIOBakedLut> lut;
+    if ( cache.get(key, &lut) ) {
+        return lut;
+    }
+    // bake under the lock, so that concurrent renders wait for the same LUT instead of baking it again
+    GenericOCIO::AutoMutex guard(bakeMutex);
+    if ( cache.get(key, &lut) ) {
+        return lut;
+    }
+    lut = std::make_shared<OCIOBakedLut>(proc, size);
+
+    return cache.insert(key, lut, (size_t)size * size * size * 3 * sizeof(float));
+}
+
+void
+OCIOProcessor::setLutSize(int lutSize)
+{
+    _lut.reset();
+    if (!_proc || (lutSize <= 0)) {
+        return;
+    }
+    try {
+        _lut = OCIOBakedLut::get(_proc, lutSize);
+    } catch (const std::exception&) {
+        // apply the exact transform, which reports the error
+        _lut.reset();
     }
 }
 
@@ -800,6 +1096,16 @@ OCIOProcessor::multiThreadProcessImages(const OfxRectI& renderWindow, const OfxP
     pixelBytes = numChannels * sizeof(float);
     size_t pixelDataOffset = (size_t)(renderWindow.y1 - _dstBounds.y1) * _dstRowBytes + (size_t)(renderWindow.x1 - _dstBounds.x1) * pixelBytes;
     float* pix = (float*)(((char*)_dstPixelData) + pixelDataOffset); // (char*)dstImg->getPixelAddress(renderWindow.x1, renderWindow.y1);
+    if (_lut) {
+        for (int y = renderWindow.y1; y < renderWindow.y2; ++y) {
+            if (_effect.abort()) {
+                break;
+            }
+            _lut->apply((float*)((char*)pix + (size_t)(y - renderWindow.y1) * _dstRowBytes), renderWindow.x2 - renderWindow.x1, numChannels);
+        }
+
+        return;
+    }
     try {
         AutoSetAndRestoreThreadLocale locale;
         if (_proc) {
@@ -807,8 +1113,8 @@ OCIOProcessor::multiThreadProcessImages(const OfxRectI& renderWindow, const OfxP
             OCIO::PackedImageDesc img(pix, renderWindow.x2 - renderWindow.x1, renderWindow.y2 - renderWindow.y1, numChannels,
                                       OCIO::BIT_DEPTH_F32, // For now, only float
                                       sizeof(float), pixelBytes, _dstRowBytes);
-            OCIO::ConstCPUProcessorRcPtr cpuproc = _proc->getOptimizedCPUProcessor(OCIO::BIT_DEPTH_F32, OCIO::BIT_DEPTH_F32,
-                                                                                   OCIO::OPTIMIZATION_DEFAULT);
+            OCIO::ConstCPUProcessorRcPtr cpuproc = _cpuProc ? _cpuProc : _proc->getOptimizedCPUProcessor(OCIO::BIT_DEPTH_F32, OCIO::BIT_DEPTH_F32,
+                                                                                                    OCIO::OPTIMIZATION_DEFAULT);
             cpuproc->apply(img);
 #else
             OCIO::PackedImageDesc img(pix, renderWindow.x2 - renderWindow.x1, renderWindow.y2 - renderWindow.y1, numChannels, sizeof(float), pixelBytes, _dstRowBytes);
@@ -855,6 +1161,7 @@ GenericOCIO::apply(double time,
 {
     assert(_created);
 #ifdef OFX_IO_USING_OCIO
+    ProfileScope profiling("ocio");
 
     if (!_created) {
         return;
@@ -886,6 +1193,7 @@ GenericOCIO::apply(double time,
     processor.setDstImg(pixelData, bounds, pixelComponents, pixelComponentCount, eBitDepthFloat, rowBytes);
 
     processor.setProcessor(proc);
+    processor.setLutSize(getLutSize(time));
 
     // set the render window
     processor.setRenderWindow(renderWindow, renderScale);
@@ -1297,6 +1605,7 @@ void
 GenericOCIO::purgeCaches()
 {
 #ifdef OFX_IO_USING_OCIO
+    clearProcessorCache();
     OCIO::ClearAllCaches();
 #endif
 }
@@ -1546,6 +1855,64 @@ GenericOCIO::describeInContextContext(ImageEffectDescriptor& desc,
 #endif // ifdef OFX_IO_USING_OCIO
 } // GenericOCIO::describeInContextContext
 
+void
+GenericOCIO::describeInContextPrecision(ImageEffectDescriptor& desc,
+                                        ContextEnum /*context*/,
+                                        PageParamDescriptor* page)
+{
+#ifdef OFX_IO_USING_OCIO
+    ChoiceParamDescriptor* param = desc.defineChoiceParam(kOCIOParamPrecision);
+    param->setLabelAndHint(kOCIOParamPrecisionLabel, kOCIOParamPrecisionHint);
+    assert(param->getNOptions() == eOCIOPrecisionExact);
+    param->appendOption(kOCIOParamPrecisionOptionExact);
+    assert(param->getNOptions() == eOCIOPrecisionLut33);
+    param->appendOption(kOCIOParamPrecisionOptionLut33);
+    assert(param->getNOptions() == eOCIOPrecisionLut65);
+    param->appendOption(kOCIOParamPrecisionOptionLut65);
+    param->setDefault(eOCIOPrecisionExact);
+    param->setAnimates(false);
+    if (page) {
+        page->addChild(*param);
+    }
+#else
+    unused(desc);
+    unused(page);
+#endif
+}
+
+int
+GenericOCIO::getLutSize(double time) const
+{
+#ifdef OFX_IO_USING_OCIO
+    return getLutSize(_precision, time);
+#else
+    unused(time);
+
+    return 0;
+#endif
+}
+
+int
+GenericOCIO::getLutSize(const ChoiceParam* precision,
+                        double time)
+{
+    if (!precision) {
+        return 0;
+    }
+    switch ((OCIOPrecisionEnum)precision->getValueAtTime(time)) {
+    case eOCIOPrecisionExact:
+        break;
+    case eOCIOPrecisionLut33:
+
+        return 33;
+    case eOCIOPrecisionLut65:
+
+        return 65;
+    }
+
+    return 0;
+}
+
 // Helper class to set the C locale when doing OCIO calls.
 // See https://github.com/AcademySoftwareFoundation/OpenColorIO/issues/297#issuecomment-505636123
 AutoSetAndRestoreThreadLocale::AutoSetAndRestoreThreadLocale()
@@ -33,6 +33,8 @@
 #include <xlocale.h>
 #endif
 
+#include <list>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -104,12 +106,31 @@ NAMESPACE_OFX_IO_ENTER
 #define kOCIOParamContextKey4 "key4"
 #define kOCIOParamContextValue4 "value4"
 
+#define kOCIOParamPrecision "ocioPrecision"
+#define kOCIOParamPrecisionLabel "OCIO Precision"
+#define kOCIOParamPrecisionHint \
+    "Precision of the color transform. The transform may be baked into a 3D LUT, which is much faster for complex transforms (chained LUTs, ACES) but slightly less accurate. Input values are clamped to [0," kOCIOBakedLutMaxInputString "]. This is meant for review and proxy work."
+#define kOCIOParamPrecisionOptionExact "Exact", "Apply the full transform.", "exact"
+#define kOCIOParamPrecisionOptionLut33 "3D LUT 33", "Bake the transform into a 33x33x33 3D LUT.", "lut33"
+#define kOCIOParamPrecisionOptionLut65 "3D LUT 65", "Bake the transform into a 65x65x65 3D LUT.", "lut65"
+#define kOCIOBakedLutMaxInput 64.f
+#define kOCIOBakedLutMaxInputString "64"
+
+enum OCIOPrecisionEnum
+{
+    eOCIOPrecisionExact = 0,
+    eOCIOPrecisionLut33,
+    eOCIOPrecisionLut65,
+};
+
 #if defined(OFX_IO_USING_OCIO)
 class OCIOOpenGLContextData {
 public:
 #if OCIO_VERSION_HEX >= 0x02000000
-    std::string processorCacheID;
-    OCIO_NAMESPACE::OpenGLBuilderRcPtr glBuilder;
+    // the compiled programs and their LUT textures, keyed by processor cache ID, most recently used first,
+    // so that switching between a few transforms (e.g. displays or looks) does not rebuild them
+    std::list<std::pair<std::string, OCIO_NAMESPACE::OpenGLBuilderRcPtr> > glBuilders;
+    static const std::size_t kMaxGLBuilders = 8;
 #else
     std::vector<float> procLut3D; //!< storage for the LUT3D so that the allocation of the LUT only occurs once.
     std::string procShaderCacheID; //!< pass a string that will be used as a key to cache the shader so that internally the function may determine if generating and compiling the shader again is required. If the shader cache ID did not change, the shader passed by shaderProgramIDParam will be used as-is.
@@ -158,6 +179,16 @@ public:
     OCIO_NAMESPACE::ConstProcessorRcPtr getProcessor() const;
     OCIO_NAMESPACE::ConstProcessorRcPtr getOrCreateProcessor(double time);
 
+    // Processors are shared by all instances: the cache is keyed by the config and context cache ID and the colorspaces.
+    static OCIO_NAMESPACE::ConstProcessorRcPtr getCachedProcessor(const OCIO_NAMESPACE::ConstConfigRcPtr& config,
+                                                                  const OCIO_NAMESPACE::ConstContextRcPtr& context,
+                                                                  const std::string& inputSpace,
+                                                                  const std::string& outputSpace);
+#if OCIO_VERSION_HEX >= 0x02000000
+    // The optimized float CPU processor, built once per processor (keyed by the processor cache ID) and shared by all tiles.
+    static OCIO_NAMESPACE::ConstCPUProcessorRcPtr getCachedCPUProcessor(const OCIO_NAMESPACE::ConstProcessorRcPtr& proc);
+#endif
+    static void clearProcessorCache();
 #endif
     bool configIsDefault() const;
 
@@ -165,6 +196,11 @@ public:
     static void describeInContextInput(OFX::ImageEffectDescriptor& desc, OFX::ContextEnum context, OFX::PageParamDescriptor* page, const char* inputSpaceNameDefault, const char* inputSpaceLabel = kOCIOParamInputSpaceLabel);
     static void describeInContextOutput(OFX::ImageEffectDescriptor& desc, OFX::ContextEnum context, OFX::PageParamDescriptor* page, const char* outputSpaceNameDefault, const char* outputSpaceLabel = kOCIOParamOutputSpaceLabel);
     static void describeInContextContext(OFX::ImageEffectDescriptor& desc, OFX::ContextEnum context, OFX::PageParamDescriptor* page);
+    static void describeInContextPrecision(OFX::ImageEffectDescriptor& desc, OFX::ContextEnum context, OFX::PageParamDescriptor* page);
+
+    // the size of the baked 3D LUT selected by the precision parameter, or 0 if the exact transform must be applied
+    int getLutSize(double time) const;
+    static int getLutSize(const OFX::ChoiceParam* precision, double time);
 
 #ifdef OFX_IO_USING_OCIO
     void setValues(const std::string& inputSpace, const std::string& outputSpace);
@@ -213,12 +249,15 @@ private:
     OFX::StringParam* _contextValue3;
     OFX::StringParam* _contextKey4;
     OFX::StringParam* _contextValue4;
+    OFX::ChoiceParam* _precision;
 
     OCIO_NAMESPACE::ConstConfigRcPtr _config;
 
     mutable Mutex _procMutex;
     OCIO_NAMESPACE::ConstProcessorRcPtr _proc;
     OCIO_NAMESPACE::ConstContextRcPtr _procContext;
+    OCIO_NAMESPACE::ConstConfigRcPtr _procConfig;
+    std::string _procContextCacheID;
     std::string _procInputSpace;
     std::string _procOutputSpace;
     // OCIO_NAMESPACE::ConstTransformRcPtr _procTransform;
@@ -226,6 +265,31 @@ private:
 };
 
 #ifdef OFX_IO_USING_OCIO
+/**
+ * @brief A processor baked into a 3D LUT, applied with tetrahedral interpolation (see kOCIOParamPrecision).
+ *
+ * The input values are first mapped to [0,1] by the shaper x/(1+x), scaled so that kOCIOBakedLutMaxInput maps to 1,
+ * which gives more LUT points to the shadows and midtones of scene-linear data than to the highlights.
+ **/
+class OCIOBakedLut {
+public:
+    OCIOBakedLut(const OCIO_NAMESPACE::ConstProcessorRcPtr& proc, int size);
+
+    // apply the LUT to the RGB components of n pixels
+    void apply(float* pix, int n, int nComponents) const;
+
+    // the LUT for this processor and size, baked once and shared by all instances and threads
+    static std::shared_ptr<const OCIOBakedLut> get(const OCIO_NAMESPACE::ConstProcessorRcPtr& proc, int size);
+
+private:
+    static float shape(float x);
+    static float unshape(float s);
+
+    const int _size;
+    std::vector<float> _lut;
+};
+
+
 class OCIOProcessor
     : public OFX::PixelProcessor {
 public:
@@ -240,13 +304,18 @@ public:
     // and do some processing
     void multiThreadProcessImages(const OfxRectI& procWindow, const OfxPointD& rs);
 
-    void setProcessor(const OCIO_NAMESPACE::ConstProcessorRcPtr& proc)
-    {
-        _proc = proc;
-    }
+    void setProcessor(const OCIO_NAMESPACE::ConstProcessorRcPtr& proc);
+
+    // apply the processor baked into a 3D LUT of the given size (see OCIOPrecisionEnum), or exactly if lutSize is 0.
+    // Must be called after setProcessor().
+    void setLutSize(int lutSize);
 
 private:
     OCIO_NAMESPACE::ConstProcessorRcPtr _proc;
+#if OCIO_VERSION_HEX >= 0x02000000
+    OCIO_NAMESPACE::ConstCPUProcessorRcPtr _cpuProc;
+#endif
+    std::shared_ptr<const OCIOBakedLut> _lut;
     OFX::ImageEffect* _instance;
 };
 #endif
@@ -26,6 +26,8 @@
 
 #include <cstdlib>
 #include <cstring>
+#include <list>
+#include <utility>
 #ifdef DEBUG
 #include <cstdio>
 #define DBG(x) x
@@ -96,7 +98,7 @@ OCIOOpenGLContextData::OCIOOpenGLContextData()
 OCIOOpenGLContextData::~OCIOOpenGLContextData()
 {
 #if OCIO_VERSION_HEX >= 0x02000000
-    glBuilder.reset();
+    glBuilders.clear();
 #else
     if (procLut3DID != 0) {
         glDeleteTextures(1, &procLut3DID);
@@ -203,13 +205,19 @@ GenericOCIO::applyGL(const Texture* srcImg,
 #if OCIO_VERSION_HEX >= 0x02000000
     // See https://github.com/imageworks/OpenColorIO/blob/master/src/apps/ociodisplay/main.cpp
 
-    // Create an OpenGL helper, this should be done only once
+    // Create an OpenGL helper, this should be done only once per processor and OpenGL context
     OCIO::OpenGLBuilderRcPtr glBuilder;
+    const string cacheID = processor->getCacheID();
     if (contextData) {
-        if (contextData->processorCacheID != processor->getCacheID()) {
-            contextData->glBuilder.reset();
+        std::list<std::pair<string, OCIO::OpenGLBuilderRcPtr> >& builders = contextData->glBuilders;
+        for (std::list<std::pair<string, OCIO::OpenGLBuilderRcPtr> >::iterator it = builders.begin(); it != builders.end(); ++it) {
+            if (it->first == cacheID) {
+                glBuilder = it->second;
+                // move it to the front
+                builders.splice(builders.begin(), builders, it);
+                break;
+            }
         }
-        glBuilder = contextData->glBuilder;
     }
     if (!glBuilder) {
         // Extract the shader information.
@@ -230,8 +238,12 @@ GenericOCIO::applyGL(const Texture* srcImg,
         // Step 3: Use the helper OpenGL builder
         glBuilder = OCIO::OpenGLBuilder::Create(shaderDesc);
         if (contextData) {
-            contextData->processorCacheID = processor->getCacheID();
-            contextData->glBuilder = glBuilder;
+            std::list<std::pair<string, OCIO::OpenGLBuilderRcPtr> >& builders = contextData->glBuilders;
+            builders.push_front(std::make_pair(cacheID, glBuilder));
+            // the OpenGL context is current: the program and textures of the least recently used builders can be deleted now
+            while (builders.size() > OCIOOpenGLContextData::kMaxGLBuilders) {
+                builders.pop_back();
+            }
         }
 
         // Step 4: Allocate & upload all the LUTs
@@ -28,8 +28,19 @@
 #include <cfloat> // DBL_MAX
 #include <climits>
 #include <cmath>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
+#include <list>
 #include <memory>
+#include <sstream>
+#include <typeinfo>
+#include <vector>
+#include <ctime>
+#if !(defined(_WIN32) || defined(__WIN32__) || defined(WIN32))
+#include <dirent.h>
+#endif
 #if defined(DEBUG) && defined(DEBUG_READER)
 #include <cstdio>
 #define DBG(x) x
@@ -45,6 +56,7 @@
 #include "ofxsCopier.h"
 #include "ofxsLog.h"
 #include "ofxsMacros.h"
+#include "ofxsMultiThread.h"
 
 #ifdef OFX_EXTENSIONS_TUTTLE
 #include <tuttle/ofxReadWrite.h>
@@ -56,6 +68,8 @@
 #ifdef OFX_IO_USING_OCIO
 #include "GenericOCIO.h"
 #endif
+#include "IOLRUCache.h"
+#include "IOMemoryGovernor.h"
 #include "IOUtility.h"
 
 #ifdef OFX_IO_USING_OCIO
@@ -220,11 +234,35 @@ enum MissingEnum {
 
 #define kParamGuessedParams "ParamExistingInstance" // was guessParamsFromFilename already successfully called once on this instance
 
+#define kParamSharedCache "sharedCache"
+#define kParamSharedCacheLabel "Shared Cache"
+#define kParamSharedCacheHint "Keep decoded frames in a memory cache shared by all readers, so that reading the same frame again (from this or any other reader, " \
+    "e.g. several Read nodes on the same file) does not decode the file again. Frames are cached after colorspace conversion and premultiplication, " \
+    "and are automatically invalidated when the file is modified. The cache size in megabytes can be set using the OFX_IO_READER_CACHE_SIZE " \
+    "environment variable (default is 512)."
+
+#define kParamReadAhead "readAhead"
+#define kParamReadAheadLabel "Read Ahead"
+#define kParamReadAheadHint "Number of frames of the image sequence that are read in advance from the disk into the system file cache while the current frame " \
+    "is decoded, in the direction of playback. This hides the latency of network storage. At most OFX_IO_READ_AHEAD_SIZE megabytes are read in advance " \
+    "(default is 256). 0 disables read-ahead. Video files and proxy files are not read in advance."
+
+#define kParamSharedCacheInfo "sharedCacheInfo"
+#define kParamSharedCacheInfoLabel "Cache Info..."
+#define kParamSharedCacheInfoHint "Display statistics (hits, misses, memory usage) about the shared decoded-frame cache and the caches of this reader, and the memory used by the caches of all the plugins."
+
+#define kParamProfileInfo "profileInfo"
+#define kParamProfileInfoLabel "Profile Info..."
+#define kParamProfileInfoHint "Display the time spent in each stage of the render (reading the file, color conversion, premultiplication, scaling...) " \
+    "and the counters (cache hits, decoded bytes, seeks...) of this reader. Only available if the OFX_IO_PROFILE environment variable is set, " \
+    "see also OFX_IO_PROFILE_TRACE to write a Chrome trace file."
+
 #ifdef OFX_IO_USING_OCIO
 #define kParamInputSpaceSet "ocioInputSpaceSet" // was the input colorspace set by user?
 #endif
 
 #define MISSING_FRAME_NEAREST_RANGE 100
+#define DIRECTORY_LISTING_CACHE_MAX_ENTRIES 64 // number of directories in the listing cache
 
 #define kSupportsMultiResolution 1
 #define kSupportsRenderScale 1 // GenericReader supports render scale: it scales images and uses proxy image when applicable
@@ -232,6 +270,7 @@ enum MissingEnum {
 #define GENERIC_READER_USE_MULTI_THREAD
 
 static bool gHostIsNatron = false;
+static int gReaderInstanceCount = 0; // used to name the profilers
 static bool gHostSupportsRGBA = false;
 static bool gHostSupportsRGB = false;
 static bool gHostSupportsXY = false;
@@ -268,6 +307,7 @@ GenericReaderPlugin::GenericReaderPlugin(OfxImageEffectHandle handle,
     , _inputSpaceSet(NULL)
     , _ocio(new GenericOCIO(this))
 #endif
+    , _profiler(Profiler::isEnabled() ? new Profiler("Reader " + std::to_string(++gReaderInstanceCount)) : NULL)
     , _syncClip(NULL)
     , _outputClip(NULL)
     , _fileParam(NULL)
@@ -291,6 +331,9 @@ GenericReaderPlugin::GenericReaderPlugin(OfxImageEffectHandle handle,
     , _fps(NULL)
     , _sublabel(NULL)
     , _guessedParams(NULL)
+    , _sharedCache(NULL)
+    , _readAheadFrames(NULL)
+    , _readAhead(new ReadAhead)
     , _extensions(extensions)
     , _supportsRGBA(supportsRGBA)
     , _supportsRGB(supportsRGB)
@@ -327,6 +370,8 @@ GenericReaderPlugin::GenericReaderPlugin(OfxImageEffectHandle handle,
         assert(_sublabel);
     }
     _guessedParams = fetchBooleanParam(kParamGuessedParams);
+    _sharedCache = fetchBooleanParam(kParamSharedCache);
+    _readAheadFrames = fetchIntParam(kParamReadAhead);
 
 #ifdef OFX_IO_USING_OCIO
     _inputSpaceSet = fetchBooleanParam(kParamInputSpaceSet);
@@ -442,6 +487,8 @@ GenericReaderPlugin::getTimeDomain(OfxRangeD& range)
     return ret;
 }
 
+static bool getSequenceFramesFromPattern(const string& pattern, std::vector<int>* frames);
+
 bool
 GenericReaderPlugin::getSequenceTimeDomainInternal(OfxRangeI& range,
                                                    bool canSetOriginalFrameRange)
@@ -498,13 +545,22 @@ GenericReaderPlugin::getSequenceTimeDomainInternal(OfxRangeI& range,
                                                       numHashes,
                                                       &pattern);
 
-        SequenceParsing::SequenceFromPattern sequenceFromFiles;
-        SequenceParsing::filesListFromPattern_slow(pattern, &sequenceFromFiles);
-
         range.min = range.max = 1;
-        if (sequenceFromFiles.size() > 1) {
-            range.min = sequenceFromFiles.begin()->first;
-            range.max = sequenceFromFiles.rbegin()->first;
+        std::vector<int> frames;
+        if ( getSequenceFramesFromPattern(pattern, &frames) ) {
+            // use the cached listing of the directory rather than scanning it again
+            if (frames.size() > 1) {
+                range.min = frames.front();
+                range.max = frames.back();
+            }
+        } else {
+            SequenceParsing::SequenceFromPattern sequenceFromFiles;
+            SequenceParsing::filesListFromPattern_slow(pattern, &sequenceFromFiles);
+
+            if (sequenceFromFiles.size() > 1) {
+                range.min = sequenceFromFiles.begin()->first;
+                range.max = sequenceFromFiles.rbegin()->first;
+            }
         }
     }
 
@@ -715,20 +771,6 @@ GenericReaderPlugin::getSequenceTime(double t,
     return eGetSequenceTimeError;
 }
 
-#if (defined(_WIN32) || defined(__WIN32__) || defined(WIN32))
-std::wstring
-utf8ToUtf16(const string& str)
-{
-    std::wstring native;
-
-    native.resize(MultiByteToWideChar(CP_UTF8, 0, str.c_str(), -1, NULL, 0));
-    MultiByteToWideChar(CP_UTF8, 0, str.c_str(), -1, &native[0], (int)native.size());
-
-    return native;
-}
-
-#endif
-
 static bool
 checkIfFileExists(const string& path)
 {
@@ -751,6 +793,574 @@ checkIfFileExists(const string& path)
 #endif
 }
 
+#if (defined(_WIN32) || defined(__WIN32__) || defined(WIN32))
+static string
+utf16ToUtf8(const std::wstring& str)
+{
+    string utf8;
+    int size = WideCharToMultiByte(CP_UTF8, 0, str.c_str(), -1, NULL, 0, NULL, NULL);
+
+    if (size > 1) {
+        utf8.resize(size - 1);
+        WideCharToMultiByte(CP_UTF8, 0, str.c_str(), -1, &utf8[0], size, NULL, NULL);
+    }
+
+    return utf8;
+}
+
+#endif
+
+/**
+ * @brief A process-wide cache of directory listings, used to resolve image sequences.
+ *
+ * Finding the nearest existing frame of a sequence with gaps, or guessing the frame range of a
+ * sequence, would otherwise probe the files one by one, which is a slow metadata round-trip on
+ * network storage. A directory is read once, and its listing is trusted for a few seconds. After
+ * that, it is only read again if the modification time of the directory changed.
+ * The time to live (in seconds) can be set with the OFX_IO_DIRECTORY_CACHE_TTL environment
+ * variable (default is 2, 0 disables the cache). The least recently used listings are evicted, and they
+ * count in the memory budget of the MemoryGovernor (a directory may contain many thousand files).
+ **/
+class DirectoryListingCache {
+public:
+    static DirectoryListingCache& instance()
+    {
+        static DirectoryListingCache cache;
+
+        return cache;
+    }
+
+    // returns true if the file is in the listing of its directory.
+    // *listed is set to false if the directory could not be listed, in which case the caller has to check the file itself.
+    bool contains(const string& path,
+                  bool* listed)
+    {
+        string dir, name;
+
+        splitPath(path, &dir, &name);
+        ListingPtr listing = getListing(dir);
+        *listed = (bool)listing;
+        if (!listing) {
+            return false;
+        }
+
+        return std::binary_search( listing->names.begin(), listing->names.end(), normalizeName(name) );
+    }
+
+    // get the frame numbers of the files matching the pattern, in which the frame number is given as a run of hashes (e.g. "img.####.exr").
+    // returns false if the pattern is not supported (e.g. it also contains views) or the directory could not be listed.
+    bool getSequenceFrames(const string& pattern,
+                           std::vector<int>* frames)
+    {
+        string dir, name;
+
+        splitPath(pattern, &dir, &name);
+        if (name.find('%') != string::npos) {
+            return false;
+        }
+        size_t first = name.find('#');
+        if (first == string::npos) {
+            return false;
+        }
+        size_t last = name.find_first_not_of('#', first);
+        if (last == string::npos) {
+            last = name.size();
+        }
+        if (name.find('#', last) != string::npos) {
+            return false;
+        }
+        ListingPtr listing = getListing(dir);
+        if (!listing) {
+            return false;
+        }
+        const string prefix = normalizeName( name.substr(0, first) );
+        const string suffix = normalizeName( name.substr(last) );
+        const size_t hashes = last - first;
+
+        frames->clear();
+        for (std::vector<string>::const_iterator it = listing->names.begin(); it != listing->names.end(); ++it) {
+            const string& s = *it;
+            if ( (s.size() <= prefix.size() + suffix.size()) ||
+                 (s.compare(0, prefix.size(), prefix) != 0) ||
+                 (s.compare(s.size() - suffix.size(), suffix.size(), suffix) != 0) ) {
+                continue;
+            }
+            const string digits = s.substr(prefix.size(), s.size() - prefix.size() - suffix.size());
+            // the frame number is padded to the number of hashes, and longer numbers have no leading zero
+            if ( (digits.find_first_not_of("0123456789") != string::npos) || (digits.size() > 9) ||
+                 (digits.size() < hashes) || ( (digits.size() > hashes) && (digits[0] == '0') ) ) {
+                continue;
+            }
+            frames->push_back( std::atoi( digits.c_str() ) );
+        }
+        std::sort( frames->begin(), frames->end() );
+        frames->erase( std::unique( frames->begin(), frames->end() ), frames->end() );
+
+        return true;
+    }
+
+    // forget the listing of the directory containing path, e.g. because a file was found that is not listed
+    void invalidate(const string& path)
+    {
+        string dir, name;
+
+        splitPath(path, &dir, &name);
+        _listings.erase(dir);
+    }
+
+    void clear()
+    {
+        _listings.clear();
+    }
+
+private:
+    struct Listing {
+        long long mtime; // modification time of the directory when it was read
+        std::time_t listedAt;
+        std::time_t checkedAt;
+        std::vector<string> names; // sorted
+    };
+
+    typedef std::shared_ptr<const Listing> ListingPtr;
+    typedef LRUCache<string, ListingPtr> ListingLRUCache;
+
+    DirectoryListingCache()
+        : _listings(DIRECTORY_LISTING_CACHE_MAX_ENTRIES, 0, "Directory listings (readers)", MemoryGovernor::ePriorityLow)
+        , _ttl(2)
+    {
+        const char* ttl = std::getenv("OFX_IO_DIRECTORY_CACHE_TTL");
+
+        if (ttl) {
+            _ttl = std::atol(ttl);
+        }
+    }
+
+    static void splitPath(const string& path,
+                          string* dir,
+                          string* name)
+    {
+#if (defined(_WIN32) || defined(__WIN32__) || defined(WIN32))
+        size_t pos = path.find_last_of("/\\");
+#else
+        size_t pos = path.find_last_of('/');
+#endif
+        if (pos == string::npos) {
+            *dir = "./";
+            *name = path;
+        } else {
+            *dir = path.substr(0, pos + 1);
+            *name = path.substr(pos + 1);
+        }
+    }
+
+    // file names are compared case-insensitively on Windows
+    static string normalizeName(const string& name)
+    {
+#if (defined(_WIN32) || defined(__WIN32__) || defined(WIN32))
+        string lower(name);
+        for (size_t i = 0; i < lower.size(); ++i) {
+            if ( (lower[i] >= 'A') && (lower[i] <= 'Z') ) {
+                lower[i] = lower[i] - 'A' + 'a';
+            }
+        }
+
+        return lower;
+#else
+
+        return name;
+#endif
+    }
+
+    static bool getDirectoryModificationTime(const string& dir,
+                                             long long* mtime)
+    {
+        long long size;
+        string path(dir);
+
+        // stat() fails on Windows if the path of a directory ends with a separator
+        if ( (path.size() > 1) && ( (path[path.size() - 1] == '/') || (path[path.size() - 1] == '\\') ) && (path[path.size() - 2] != ':') ) {
+            path.erase(path.size() - 1);
+        }
+
+        return getFileStamp(path, mtime, &size);
+    }
+
+    static bool readDirectory(const string& dir,
+                              std::vector<string>* names)
+    {
+        names->clear();
+#if (defined(_WIN32) || defined(__WIN32__) || defined(WIN32))
+        WIN32_FIND_DATAW findData;
+        std::wstring wpattern = utf8ToUtf16(dir + "*");
+        HANDLE handle = FindFirstFileW(wpattern.c_str(), &findData);
+        if (handle == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+        do {
+            names->push_back( normalizeName( utf16ToUtf8(findData.cFileName) ) );
+        } while ( FindNextFileW(handle, &findData) );
+        FindClose(handle);
+#else
+        DIR* d = opendir( dir.c_str() );
+        if (!d) {
+            return false;
+        }
+        struct dirent* entry;
+        while ( ( entry = readdir(d) ) != NULL ) {
+            names->push_back(entry->d_name);
+        }
+        closedir(d);
+#endif
+        std::sort( names->begin(), names->end() );
+
+        return true;
+    }
+
+    ListingPtr getListing(const string& dir)
+    {
+        if (_ttl <= 0) {
+            return ListingPtr();
+        }
+        const std::time_t now = std::time(NULL);
+        ListingPtr listing;
+        if ( _listings.get(dir, &listing) && (now - listing->checkedAt < _ttl) ) {
+            return listing;
+        }
+
+        // the directory is read or checked outside of the lock of the cache, so that a slow file server does not block the other readers
+        long long mtime;
+        if ( !getDirectoryModificationTime(dir, &mtime) ) {
+            return ListingPtr();
+        }
+        // if the directory was modified during the second it was read, the listing may miss files
+        if ( listing && (listing->mtime == mtime) && (mtime < listing->listedAt) ) {
+            std::shared_ptr<Listing> checked = std::make_shared<Listing>(*listing);
+            checked->checkedAt = now;
+            listing = checked;
+        } else {
+            std::shared_ptr<Listing> read = std::make_shared<Listing>();
+            if ( !readDirectory(dir, &read->names) ) {
+                return ListingPtr();
+            }
+            read->mtime = mtime;
+            read->listedAt = read->checkedAt = now;
+            listing = read;
+        }
+
+        // the listing that was just read or checked replaces the previous one
+        return _listings.insertIf(dir, listing, getListingBytes(*listing), [](const ListingPtr&) {
+            return true;
+        });
+    }
+
+    static size_t getListingBytes(const Listing& listing)
+    {
+        size_t bytes = sizeof(Listing) + listing.names.capacity() * sizeof(string);
+
+        for (std::vector<string>::const_iterator it = listing.names.begin(); it != listing.names.end(); ++it) {
+            bytes += it->capacity();
+        }
+
+        return bytes;
+    }
+
+    ListingLRUCache _listings;
+    long _ttl; // seconds
+};
+
+// check if a file exists using the cached directory listings.
+// If verifyMissing is true, a file that is not in the listing is also checked on disk, since it may have been
+// written since the directory was read (e.g. the frame requested by a render, while the sequence is being written).
+static bool
+checkIfFileIsListed(const string& path,
+                    bool verifyMissing)
+{
+    DirectoryListingCache& cache = DirectoryListingCache::instance();
+    bool listed;
+
+    if ( cache.contains(path, &listed) ) {
+        return true;
+    }
+    if (listed && !verifyMissing) {
+        return false;
+    }
+    bool exists = checkIfFileExists(path);
+    if (exists && listed) {
+        // the listing is out of date
+        cache.invalidate(path);
+    }
+
+    return exists;
+}
+
+static bool
+getSequenceFramesFromPattern(const string& pattern,
+                             std::vector<int>* frames)
+{
+    return DirectoryListingCache::instance().getSequenceFrames(pattern, frames);
+}
+
+/**
+ * @brief A process-wide cache of decoded frames, shared by all reader instances.
+ *
+ * Frames are stored as they are written to the output image, i.e. after colorspace conversion,
+ * premultiplication and downscaling, so that a cache hit is a plain copy. Entries are evicted in
+ * LRU order when the memory budget is exceeded. The budget (in megabytes) can be set with the
+ * OFX_IO_READER_CACHE_SIZE environment variable. The cache also shares the budget of the MemoryGovernor
+ * with the other caches of the plugins.
+ **/
+class DecodedFrameCache {
+public:
+    static DecodedFrameCache& instance()
+    {
+        static DecodedFrameCache cache;
+
+        return cache;
+    }
+
+    // copy the renderWindow part of a cached frame to dstPixelData, if it is available
+    bool get(const string& key,
+             const OfxRectI& renderWindow,
+             float* dstPixelData,
+             const OfxRectI& dstBounds,
+             int pixelBytes,
+             int dstRowBytes)
+    {
+        FramePtr frame;
+
+        if ( !_frames.getIf(key, &frame, [&](const FramePtr& cached) {
+            return (cached->pixelBytes == pixelBytes) &&
+                   (renderWindow.x1 >= cached->bounds.x1) && (renderWindow.x2 <= cached->bounds.x2) &&
+                   (renderWindow.y1 >= cached->bounds.y1) && (renderWindow.y2 <= cached->bounds.y2);
+        }) ) {
+            return false;
+        }
+        // the frame data is immutable once inserted: copy outside of the lock
+        copyRect(renderWindow, &frame->data[0], frame->bounds, frame->rowBytes, (unsigned char*)dstPixelData, dstBounds, dstRowBytes, pixelBytes);
+
+        return true;
+    }
+
+    // store the renderWindow part of srcPixelData
+    void insert(const string& key,
+                const OfxRectI& renderWindow,
+                const float* srcPixelData,
+                const OfxRectI& srcBounds,
+                int pixelBytes,
+                int srcRowBytes)
+    {
+        const int rowBytes = (renderWindow.x2 - renderWindow.x1) * pixelBytes;
+        const size_t frameSize = (size_t)(renderWindow.y2 - renderWindow.y1) * (size_t)rowBytes;
+
+        // a budget of 0 disables the cache
+        if ( (frameSize == 0) || ( frameSize > _frames.getMaxBytes() ) ) {
+            return;
+        }
+        std::shared_ptr<Frame> frame = std::make_shared<Frame>();
+        frame->bounds = renderWindow;
+        frame->pixelBytes = pixelBytes;
+        frame->rowBytes = rowBytes;
+        frame->data.resize(frameSize);
+        copyRect(renderWindow, (const unsigned char*)srcPixelData, srcBounds, srcRowBytes, &frame->data[0], renderWindow, rowBytes, pixelBytes);
+
+        // keep the largest of the two windows (e.g. a full frame rather than a tile)
+        const size_t area = (size_t)(renderWindow.x2 - renderWindow.x1) * (size_t)(renderWindow.y2 - renderWindow.y1);
+        _frames.insertIf(key, frame, frameSize, [area](const FramePtr& cached) {
+            return (size_t)(cached->bounds.x2 - cached->bounds.x1) * (size_t)(cached->bounds.y2 - cached->bounds.y1) < area;
+        });
+    }
+
+    void clear()
+    {
+        _frames.clear();
+    }
+
+    string getStatistics()
+    {
+        const FrameLRUCache::Stats stats = _frames.getStats();
+        std::ostringstream ss;
+        unsigned long long lookups = stats.hits + stats.misses;
+
+        ss << "Decoded-frame cache (shared by all readers with \"" kParamSharedCacheLabel "\" checked):\n";
+        ss << "Hits: " << stats.hits << '\n';
+        ss << "Misses: " << stats.misses << '\n';
+        if (lookups > 0) {
+            ss << "Hit ratio: " << (int)(100. * stats.hits / lookups + 0.5) << "%\n";
+        }
+        ss << "Frames: " << stats.entries << '\n';
+        ss << "Memory: " << (stats.bytes >> 20) << " MB / " << (_frames.getMaxBytes() >> 20) << " MB";
+
+        return ss.str();
+    }
+
+private:
+    struct Frame {
+        OfxRectI bounds;
+        int pixelBytes;
+        int rowBytes;
+        std::vector<unsigned char> data;
+    };
+
+    typedef std::shared_ptr<const Frame> FramePtr;
+    typedef LRUCache<string, FramePtr> FrameLRUCache;
+
+    DecodedFrameCache()
+        : _frames(0, getMaxBytes(), "Decoded frames (readers)", MemoryGovernor::ePriorityHigh)
+    {
+    }
+
+    static size_t getMaxBytes()
+    {
+        const char* size = std::getenv("OFX_IO_READER_CACHE_SIZE");
+
+        if (size) {
+            long mb = std::atol(size);
+            if (mb >= 0) {
+                return (size_t)mb << 20;
+            }
+        }
+
+        return (size_t)512 << 20;
+    }
+
+    static void copyRect(const OfxRectI& rect,
+                         const unsigned char* src,
+                         const OfxRectI& srcBounds,
+                         int srcRowBytes,
+                         unsigned char* dst,
+                         const OfxRectI& dstBounds,
+                         int dstRowBytes,
+                         int pixelBytes)
+    {
+        const size_t lineBytes = (size_t)(rect.x2 - rect.x1) * pixelBytes;
+
+        for (int y = rect.y1; y < rect.y2; ++y) {
+            const unsigned char* srcLine = src + (std::ptrdiff_t)(y - srcBounds.y1) * srcRowBytes + (std::ptrdiff_t)(rect.x1 - srcBounds.x1) * pixelBytes;
+            unsigned char* dstLine = dst + (std::ptrdiff_t)(y - dstBounds.y1) * dstRowBytes + (std::ptrdiff_t)(rect.x1 - dstBounds.x1) * pixelBytes;
+            std::memcpy(dstLine, srcLine, lineBytes);
+        }
+    }
+
+    FrameLRUCache _frames;
+};
+
+#if defined(OFX_IO_USING_OCIO) && (OCIO_VERSION_HEX >= 0x02000000)
+/**
+ * @brief Lets the depth conversion done by the readers (see convertDepthAndComponents()) also apply the
+ * OCIO color conversion, using lookup tables indexed by the 8-bit or 16-bit file values, so that the
+ * frame does not need a separate OCIO pass. This is only possible if the OCIO processor has no channel
+ * crosstalk (each output channel only depends on the same input channel), e.g. sRGB or Rec.709 to linear.
+ *
+ * render() passes the conversion of each plane to decode(), which passes it to convertDepthAndComponents().
+ * Fetching the tables marks the color conversion as done. Readers that do not use convertDepthAndComponents()
+ * are not affected.
+ **/
+class FusedColorConversion {
+public:
+    FusedColorConversion()
+        : _proc()
+        , _lut()
+    {
+    }
+
+    void set(const OCIO::ConstProcessorRcPtr& proc)
+    {
+        assert(proc);
+        _proc = proc;
+        _lut.reset();
+    }
+
+    // was the color conversion applied by the reader?
+    bool applied() const
+    {
+        return (bool)_lut;
+    }
+
+    // get the RGB lookup tables (3 consecutive tables of 2^depth values) for data of the given depth, or
+    // NULL if there is no color conversion to apply. The tables are valid as long as this object.
+    const float* getLut(BitDepthEnum depth)
+    {
+        int n;
+        switch (depth) {
+        case eBitDepthUByte:
+            n = 256;
+            break;
+        case eBitDepthUShort:
+            n = 65536;
+            break;
+        default:
+
+            return NULL;
+        }
+        if (!_proc) {
+            return NULL;
+        }
+        if (_lut) {
+            // e.g. the reader converts the image by bands of rows
+            return (_lut->size() == (size_t)n * 3) ? &(*_lut)[0] : NULL;
+        }
+        std::ostringstream ss;
+        ss << _proc->getCacheID() << '/' << n;
+        const string key = ss.str();
+        LutCache& luts = lutCache();
+        LutPtr lut;
+        if ( !luts.get(key, &lut) ) {
+            // bake the tables, the processor being applied separately to each channel
+            try {
+                lut = bakeLut(_proc, n);
+            } catch (const std::exception&) {
+                // let render() apply the color conversion (and report the error)
+                return NULL;
+            }
+            lut = luts.insert(key, lut, (size_t)n * 3 * sizeof(float));
+        }
+        _lut = lut;
+
+        return &(*_lut)[0];
+    }
+
+private:
+    typedef std::shared_ptr<const std::vector<float> > LutPtr;
+    typedef LRUCache<string, LutPtr> LutCache;
+
+    static const size_t kMaxLuts = 8;
+
+    static LutPtr bakeLut(const OCIO::ConstProcessorRcPtr& proc,
+                          int n)
+    {
+        std::vector<float> ramp((size_t)n * 3);
+        for (int i = 0; i < n; ++i) {
+            ramp[3 * i] = ramp[3 * i + 1] = ramp[3 * i + 2] = i / (float)(n - 1);
+        }
+        {
+            AutoSetAndRestoreThreadLocale locale;
+            OCIO::PackedImageDesc img(&ramp[0], n, 1, 3);
+            GenericOCIO::getCachedCPUProcessor(proc)->apply(img);
+        }
+        std::shared_ptr<std::vector<float> > lut = std::make_shared<std::vector<float> >((size_t)n * 3);
+        for (int c = 0; c < 3; ++c) {
+            float* table = &(*lut)[(size_t)c * n];
+            for (int i = 0; i < n; ++i) {
+                table[i] = ramp[3 * i + c];
+            }
+        }
+
+        return lut;
+    }
+
+    // the tables shared by all readers, keyed by processor cache ID and size
+    static LutCache& lutCache()
+    {
+        static LutCache c(kMaxLuts, 0, "Color LUTs (readers)", MemoryGovernor::ePriorityNormal);
+
+        return c;
+    }
+
+    OCIO::ConstProcessorRcPtr _proc;
+    LutPtr _lut; // set when the tables were fetched
+};
+#endif // defined(OFX_IO_USING_OCIO) && (OCIO_VERSION_HEX >= 0x02000000)
+
 GenericReaderPlugin::GetFilenameRetCodeEnum
 GenericReaderPlugin::getFilenameAtSequenceTime(double sequenceTime,
                                                bool proxyFiles,
@@ -776,7 +1386,8 @@ GenericReaderPlugin::getFilenameAtSequenceTime(double sequenceTime,
             return eGetFileNameBlack; // if filename is empty, just return a black frame. this happens eg when the plugin is created
         } else {
             if (checkForExistingFile) {
-                filenameGood = checkIfFileExists(*filename);
+                // the other frames are only searched for in the directory listing
+                filenameGood = checkIfFileIsListed(*filename, offset == 0);
             }
         }
         if (filenameGood) {
@@ -790,7 +1401,7 @@ GenericReaderPlugin::getFilenameAtSequenceTime(double sequenceTime,
                     proxyGood = false;
                 } else {
                     if (checkForExistingFile) {
-                        proxyGood = checkIfFileExists(proxyFileName);
+                        proxyGood = checkIfFileIsListed(proxyFileName, offset == 0);
                     }
                 }
                 if (proxyGood) {
@@ -883,6 +1494,32 @@ GenericReaderPlugin::getFilenameAtTime(double t,
     return kOfxStatOK;
 }
 
+// Prefetch the files of the frames that follow time in the direction of playback.
+// filename is the file of the frame at time, which is being decoded.
+void
+GenericReaderPlugin::prefetchNextFrames(double time,
+                                        bool isPlayback,
+                                        int frames,
+                                        const string& filename)
+{
+    const int direction = _readAhead->getDirection(time, isPlayback);
+
+    if (direction == 0) {
+        return;
+    }
+    std::vector<string> filenames;
+    string previousFilename = filename;
+    for (int i = 1; i <= frames; ++i) {
+        string nextFilename;
+        if ( (getFilenameAtTime(time + i * direction, &nextFilename) == kOfxStatOK) && (nextFilename != previousFilename) ) {
+            // a held frame (e.g. a missing frame or after the last frame) is only read once
+            filenames.push_back(nextFilename);
+            previousFilename = nextFilename;
+        }
+    }
+    _readAhead->prefetch(filenames);
+}
+
 int
 GenericReaderPlugin::getStartingTime() const
 {
@@ -909,6 +1546,8 @@ GenericReaderPlugin::copyPixelData(const OfxRectI& renderWindow,
                                    BitDepthEnum dstBitDepth,
                                    int dstRowBytes)
 {
+    ProfileScope profiling("copy");
+
     assert(srcPixelData && dstPixelData);
     assert(srcBounds.y1 <= renderWindow.y1 && renderWindow.y1 <= renderWindow.y2 && renderWindow.y2 <= srcBounds.y2);
     assert(srcBounds.x1 <= renderWindow.x1 && renderWindow.x1 <= renderWindow.x2 && renderWindow.x2 <= srcBounds.x2);
@@ -924,144 +1563,140 @@ GenericReaderPlugin::copyPixelData(const OfxRectI& renderWindow,
 #endif
 }
 
-// update the window of dst defined by nextRenderWindow by halving the corresponding area in src.
-// proofread and fixed by F. Devernay on 3/10/2014
-template <typename PIX>
-static void
-halveWindow(const OfxRectI& nextRenderWindow,
-            const PIX* srcPixels,
-            const OfxRectI& srcBounds,
-            int srcRowBytes,
-            PIX* dstPixels,
-            const OfxRectI& dstBounds,
-            int dstRowBytes,
-            int nComponents)
-{
-    int srcRowSize = srcRowBytes / sizeof(PIX);
-    int dstRowSize = dstRowBytes / sizeof(PIX);
-    const PIX* srcData = srcPixels - (srcBounds.x1 * nComponents + srcRowSize * srcBounds.y1);
-    PIX* dstData = dstPixels - (dstBounds.x1 * nComponents + dstRowSize * dstBounds.y1);
-
-    assert(nextRenderWindow.x1 * 2 >= (srcBounds.x1 - 1) && (nextRenderWindow.x2 - 1) * 2 < srcBounds.x2 && nextRenderWindow.y1 * 2 >= (srcBounds.y1 - 1) && (nextRenderWindow.y2 - 1) * 2 < srcBounds.y2);
-    for (int y = nextRenderWindow.y1; y < nextRenderWindow.y2; ++y) {
-        const PIX* srcLineStart = srcData + y * 2 * srcRowSize;
-        PIX* dstLineStart = dstData + y * dstRowSize;
-        bool pickNextRow = (y * 2) < (srcBounds.y2 - 1);
-        bool pickThisRow = (y * 2) >= (srcBounds.y1);
-        int sumH = (int)pickNextRow + (int)pickThisRow;
-        assert(sumH == 1 || sumH == 2);
-        for (int x = nextRenderWindow.x1; x < nextRenderWindow.x2; ++x) {
-            bool pickNextCol = (x * 2) < (srcBounds.x2 - 1);
-            bool pickThisCol = (x * 2) >= (srcBounds.x1);
-            int sumW = (int)pickThisCol + (int)pickNextCol;
-            assert(sumW == 1 || sumW == 2);
-            for (int k = 0; k < nComponents; ++k) {
-                /// a b
-                /// c d
-
-                PIX a = (pickThisCol && pickThisRow) ? srcLineStart[x * 2 * nComponents + k] : 0;
-                PIX b = (pickNextCol && pickThisRow) ? srcLineStart[(x * 2 + 1) * nComponents + k] : 0;
-                PIX c = (pickThisCol && pickNextRow) ? srcLineStart[(x * 2 * nComponents) + srcRowSize + k] : 0;
-                PIX d = (pickNextCol && pickNextRow) ? srcLineStart[(x * 2 + 1) * nComponents + srcRowSize + k] : 0;
-
-                assert(sumW == 2 || (sumW == 1 && ((a == 0 && c == 0) || (b == 0 && d == 0))));
-                assert(sumH == 2 || (sumH == 1 && ((a == 0 && b == 0) || (c == 0 && d == 0))));
-                int sum = sumH * sumW;
-                // guard against division by zero
-                assert(sum);
-                dstLineStart[x * nComponents + k] = sum ? ((a + b + c + d) / sum) : 0;
-            }
-        }
+// Downscale src by 2^level using a box filter, in a single pass.
+// Each destination pixel is the average of the 2^level x 2^level source pixels it covers,
+// restricted to srcBounds (pixels outside of the source data are not taken into account).
+// Rows are first summed into an accumulator line, which is a contiguous loop that the compiler vectorizes,
+// and the accumulated line is then summed horizontally.
+// nComponents is 0 for an arbitrary number of components (given in the constructor).
+template <int nComponents>
+class BoxDownscaleProcessor
+    : public PixelProcessor {
+    const float* _srcPixelData;
+    OfxRectI _srcBufferBounds;
+    int _srcBufferRowBytes;
+    int _dstBufferRowBytes;
+    unsigned int _level;
+    int _nComps;
+
+public:
+    BoxDownscaleProcessor(ImageEffect& instance,
+                          int nComps)
+        : PixelProcessor(instance)
+        , _srcPixelData(NULL)
+        , _srcBufferRowBytes(0)
+        , _dstBufferRowBytes(0)
+        , _level(0)
+        , _nComps(nComponents ? nComponents : nComps)
+    {
+        _srcBufferBounds.x1 = _srcBufferBounds.y1 = _srcBufferBounds.x2 = _srcBufferBounds.y2 = 0;
     }
-}
 
-template <typename PIX>
-static void
-buildMipMapLevelGeneric(ImageEffect* instance,
-                        const OfxRectI& originalRenderWindow,
-                        const OfxRectI& renderWindowFullRes,
-                        unsigned int level,
-                        const PIX* srcPixels,
-                        const OfxRectI& srcBounds,
-                        int srcRowBytes,
-                        PIX* dstPixels,
-                        const OfxRectI& dstBounds,
-                        int dstRowBytes,
-                        int nComponents)
-{
-    assert(level > 0);
+    void setValues(unsigned int level,
+                   const float* srcPixelData,
+                   const OfxRectI& srcBounds,
+                   int srcRowBytes,
+                   float* dstPixelData,
+                   const OfxRectI& dstBounds,
+                   int dstRowBytes)
+    {
+        _level = level;
+        _srcPixelData = srcPixelData;
+        _srcBufferBounds = srcBounds;
+        _srcBufferRowBytes = srcRowBytes;
+        _dstPixelData = dstPixelData;
+        _dstBounds = dstBounds;
+        _dstBufferRowBytes = dstRowBytes;
+    }
 
-    auto_ptr<ImageMemory> tmpMem;
-    size_t tmpMemSize = 0;
-    PIX* nextImg = NULL;
-    const PIX* previousImg = srcPixels;
-    OfxRectI previousBounds = srcBounds;
-    int previousRowBytes = srcRowBytes;
-    OfxRectI nextRenderWindow = renderWindowFullRes;
-
-    /// Build all the mipmap levels until we reach the one we are interested in
-    for (unsigned int i = 1; i < level; ++i) {
-        // loop invariant:
-        // - previousImg, previousBounds, previousRowBytes describe the data ate the level before i
-        // - nextRenderWindow contains the renderWindow at the level before i
-        //
-        /// Halve the smallest enclosing po2 rect as we need to render a minimum of the renderWindow
-        nextRenderWindow = downscalePowerOfTwoSmallestEnclosing(nextRenderWindow, 1);
-#ifdef DEBUG
-        {
-            // check that doing i times 1 level is the same as doing i levels
-            OfxRectI nrw = downscalePowerOfTwoSmallestEnclosing(renderWindowFullRes, i);
-            assert(nrw.x1 == nextRenderWindow.x1 && nrw.x2 == nextRenderWindow.x2 && nrw.y1 == nextRenderWindow.y1 && nrw.y2 == nextRenderWindow.y2);
-        }
-#endif
-        /// Allocate a temporary image if necessary, or reuse the previously allocated buffer
-        int nextRowBytes = (nextRenderWindow.x2 - nextRenderWindow.x1) * nComponents * sizeof(PIX);
-        size_t newMemSize = (size_t)(nextRenderWindow.y2 - nextRenderWindow.y1) * (size_t)nextRowBytes;
-        if (!tmpMem.get()) {
-            // there should be enough memory: no need to reallocate
-            assert(tmpMemSize >= newMemSize);
-        } else {
-            tmpMem.reset(new ImageMemory(newMemSize, instance));
-            tmpMemSize = newMemSize;
+    void multiThreadProcessImages(const OfxRectI& procWindow, const OfxPointD& rs)
+    {
+        unused(rs);
+        const int nComps = nComponents ? nComponents : _nComps;
+        // the source columns covered by procWindow
+        const int sx1 = (std::max)(procWindow.x1 << _level, _srcBufferBounds.x1);
+        const int sx2 = (std::min)(procWindow.x2 << _level, _srcBufferBounds.x2);
+        if (sx2 <= sx1) {
+            assert(false);
+
+            return;
         }
-        nextImg = (float*)tmpMem->lock();
+        const int lineSize = (sx2 - sx1) * nComps;
+        std::vector<float> acc(lineSize);
 
-        halveWindow<PIX>(nextRenderWindow, previousImg, previousBounds, previousRowBytes, nextImg, nextRenderWindow, nextRowBytes, nComponents);
+        for (int y = procWindow.y1; y < procWindow.y2; ++y) {
+            if (_effect.abort()) {
+                break;
+            }
 
-        /// Switch for next pass
-        previousBounds = nextRenderWindow;
-        previousRowBytes = nextRowBytes;
-        previousImg = nextImg;
-    }
-    // here:
-    // - previousImg, previousBounds, previousRowBytes describe the data ate the level before 'level'
-    // - nextRenderWindow contains the renderWindow at the level before 'level'
+            const int sy1 = (std::max)(y << _level, _srcBufferBounds.y1);
+            const int sy2 = (std::min)((y + 1) << _level, _srcBufferBounds.y2);
+            float* dstPix = (float*)((char*)_dstPixelData + (size_t)_dstBufferRowBytes * (y - _dstBounds.y1)) + (size_t)(procWindow.x1 - _dstBounds.x1) * nComps;
+            if (sy1 >= sy2) {
+                // no source data for this row
+                std::fill(dstPix, dstPix + (size_t)(procWindow.x2 - procWindow.x1) * nComps, 0.f);
+                continue;
+            }
 
-    /// On the last iteration halve directly into the dstPixels
-    /// The nextRenderWindow should be equal to the original render window.
-    nextRenderWindow = downscalePowerOfTwoSmallestEnclosing(nextRenderWindow, 1);
-    assert(originalRenderWindow.x1 == nextRenderWindow.x1 && originalRenderWindow.x2 == nextRenderWindow.x2 && originalRenderWindow.y1 == nextRenderWindow.y1 && originalRenderWindow.y2 == nextRenderWindow.y2);
+            // vertical pass: sum the source rows
+            std::fill(acc.begin(), acc.end(), 0.f);
+            for (int sy = sy1; sy < sy2; ++sy) {
+                const float* srcLine = (const float*)((const char*)_srcPixelData + (size_t)_srcBufferRowBytes * (sy - _srcBufferBounds.y1)) + (size_t)(sx1 - _srcBufferBounds.x1) * nComps;
+                float* a = &acc[0];
+                for (int i = 0; i < lineSize; ++i) {
+                    a[i] += srcLine[i];
+                }
+            }
 
-    halveWindow<PIX>(nextRenderWindow, previousImg, previousBounds, previousRowBytes, dstPixels, dstBounds, dstRowBytes, nComponents);
-    // mem and tmpMem are freed at destruction
-} // buildMipMapLevelGeneric
+            // horizontal pass: sum the columns and normalize
+            for (int x = procWindow.x1; x < procWindow.x2; ++x, dstPix += nComps) {
+                const int cx1 = (std::max)(x << _level, sx1);
+                const int cx2 = (std::min)((x + 1) << _level, sx2);
+                for (int k = 0; k < nComps; ++k) {
+                    dstPix[k] = 0.f;
+                }
+                if (cx1 >= cx2) {
+                    continue;
+                }
+                const float norm = 1.f / ((float)(sy2 - sy1) * (cx2 - cx1));
+                const float* a = &acc[(size_t)(cx1 - sx1) * nComps];
+                for (int cx = cx1; cx < cx2; ++cx, a += nComps) {
+                    for (int k = 0; k < nComps; ++k) {
+                        dstPix[k] += a[k];
+                    }
+                }
+                for (int k = 0; k < nComps; ++k) {
+                    dstPix[k] *= norm;
+                }
+            }
+        }
+    } // multiThreadProcessImages
+};
 
-// update the window of dst defined by originalRenderWindow by mipmapping the windows of src defined by renderWindowFullRes
-// proofread and fixed by F. Devernay on 3/10/2014
-template <typename PIX, int nComponents>
+// update the window of dst defined by originalRenderWindow by downscaling src by 2^level
+template <int nComponents>
 static void
 buildMipMapLevel(ImageEffect* instance,
                  const OfxRectI& originalRenderWindow,
-                 const OfxRectI& renderWindowFullRes,
+                 const OfxPointD& renderScale,
                  unsigned int level,
-                 const PIX* srcPixels,
+                 const float* srcPixels,
                  const OfxRectI& srcBounds,
                  int srcRowBytes,
-                 PIX* dstPixels,
+                 float* dstPixels,
                  const OfxRectI& dstBounds,
-                 int dstRowBytes)
+                 int dstRowBytes,
+                 int nComps)
 {
-    buildMipMapLevelGeneric<PIX>(instance, originalRenderWindow, renderWindowFullRes, level, srcPixels, srcBounds, srcRowBytes, dstPixels, dstBounds, dstRowBytes, nComponents);
+    assert(level > 0);
+    // every pixel of the window must cover at least one source pixel
+    assert(((originalRenderWindow.x1 + 1) << level) > srcBounds.x1 && ((originalRenderWindow.x2 - 1) << level) < srcBounds.x2 &&
+           ((originalRenderWindow.y1 + 1) << level) > srcBounds.y1 && ((originalRenderWindow.y2 - 1) << level) < srcBounds.y2);
+
+    BoxDownscaleProcessor<nComponents> p(*instance, nComps);
+    p.setValues(level, srcPixels, srcBounds, srcRowBytes, dstPixels, dstBounds, dstRowBytes);
+    p.setRenderWindow(originalRenderWindow, renderScale);
+    p.process();
 }
 
 void
@@ -1082,7 +1717,9 @@ GenericReaderPlugin::scalePixelData(const OfxRectI& originalRenderWindow,
                                     const OfxRectI& dstBounds,
                                     int dstRowBytes)
 {
-    unused(renderScale);
+    ProfileScope profiling("scale");
+
+    unused(renderWindow);
     assert(srcPixelData && dstPixelData);
 
     // do the rendering
@@ -1098,37 +1735,37 @@ GenericReaderPlugin::scalePixelData(const OfxRectI& originalRenderWindow,
 
             return;
         }
-        buildMipMapLevel<float, 4>(this, originalRenderWindow, renderWindow, levels, (const float*)srcPixelData,
-                                   srcBounds, srcRowBytes, (float*)dstPixelData, dstBounds, dstRowBytes);
+        buildMipMapLevel<4>(this, originalRenderWindow, renderScale, levels, (const float*)srcPixelData,
+                            srcBounds, srcRowBytes, (float*)dstPixelData, dstBounds, dstRowBytes, 4);
     } else if (dstPixelComponents == ePixelComponentRGB) {
         if (!_supportsRGB) {
             throwSuiteStatusException(kOfxStatErrFormat);
 
             return;
         }
-        buildMipMapLevel<float, 3>(this, originalRenderWindow, renderWindow, levels, (const float*)srcPixelData,
-                                   srcBounds, srcRowBytes, (float*)dstPixelData, dstBounds, dstRowBytes);
+        buildMipMapLevel<3>(this, originalRenderWindow, renderScale, levels, (const float*)srcPixelData,
+                            srcBounds, srcRowBytes, (float*)dstPixelData, dstBounds, dstRowBytes, 3);
     } else if (dstPixelComponents == ePixelComponentXY) {
         if (!_supportsXY) {
             throwSuiteStatusException(kOfxStatErrFormat);
 
             return;
         }
-        buildMipMapLevel<float, 2>(this, originalRenderWindow, renderWindow, levels, (const float*)srcPixelData,
-                                   srcBounds, srcRowBytes, (float*)dstPixelData, dstBounds, dstRowBytes);
+        buildMipMapLevel<2>(this, originalRenderWindow, renderScale, levels, (const float*)srcPixelData,
+                            srcBounds, srcRowBytes, (float*)dstPixelData, dstBounds, dstRowBytes, 2);
     } else if (dstPixelComponents == ePixelComponentAlpha) {
         if (!_supportsAlpha) {
             throwSuiteStatusException(kOfxStatErrFormat);
 
             return;
         }
-        buildMipMapLevel<float, 1>(this, originalRenderWindow, renderWindow, levels, (const float*)srcPixelData,
-                                   srcBounds, srcRowBytes, (float*)dstPixelData, dstBounds, dstRowBytes);
+        buildMipMapLevel<1>(this, originalRenderWindow, renderScale, levels, (const float*)srcPixelData,
+                            srcBounds, srcRowBytes, (float*)dstPixelData, dstBounds, dstRowBytes, 1);
     } else {
         assert(dstPixelComponents == ePixelComponentCustom);
 
-        buildMipMapLevelGeneric<float>(this, originalRenderWindow, renderWindow, levels, (const float*)srcPixelData,
-                                       srcBounds, srcRowBytes, (float*)dstPixelData, dstBounds, dstRowBytes, dstPixelComponentCount);
+        buildMipMapLevel<0>(this, originalRenderWindow, renderScale, levels, (const float*)srcPixelData,
+                            srcBounds, srcRowBytes, (float*)dstPixelData, dstBounds, dstRowBytes, dstPixelComponentCount);
     }
 } // GenericReaderPlugin::scalePixelData
 
@@ -1224,6 +1861,8 @@ GenericReaderPlugin::unPremultPixelData(const OfxRectI& renderWindow,
                                         BitDepthEnum dstBitDepth,
                                         int dstRowBytes)
 {
+    ProfileScope profiling("unpremult");
+
     assert(srcPixelData && dstPixelData);
 
     // do the rendering
@@ -1262,6 +1901,8 @@ GenericReaderPlugin::premultPixelData(const OfxRectI& renderWindow,
                                       BitDepthEnum dstBitDepth,
                                       int dstRowBytes)
 {
+    ProfileScope profiling("premult");
+
     assert(srcPixelData && dstPixelData);
 
     // do the rendering
@@ -1285,6 +1926,209 @@ GenericReaderPlugin::premultPixelData(const OfxRectI& renderWindow,
     }
 }
 
+/**
+ * @brief The post-decode stages (copy from the decode buffer, unpremultiplication, OCIO transform and
+ * premultiplication), applied block by block so that each pixel is loaded and stored once, while
+ * the block is still in cache. The source may be the destination buffer itself.
+ **/
+template <int nComponents>
+class PostDecodeProcessor
+    : public PixelProcessor {
+    const float* _srcPixelData;
+    OfxRectI _srcBufferBounds;
+    int _srcBufferRowBytes;
+    int _dstBufferRowBytes;
+    bool _unpremult;
+    bool _premult;
+#ifdef OFX_IO_USING_OCIO
+    OCIO::ConstProcessorRcPtr _proc;
+    std::shared_ptr<const OCIOBakedLut> _lut;
+#endif
+
+    // number of pixels processed by each stage before moving on to the next stage
+    static const int kBlockPixels = 16384;
+
+public:
+    // ctor
+    PostDecodeProcessor(ImageEffect& instance)
+        : PixelProcessor(instance)
+        , _srcPixelData(NULL)
+        , _srcBufferRowBytes(0)
+        , _dstBufferRowBytes(0)
+        , _unpremult(false)
+        , _premult(false)
+    {
+        _srcBufferBounds.x1 = _srcBufferBounds.y1 = _srcBufferBounds.x2 = _srcBufferBounds.y2 = 0;
+    }
+
+    void setValues(const float* srcPixelData,
+                   const OfxRectI& srcBufferBounds,
+                   int srcBufferRowBytes,
+                   float* dstPixelData,
+                   const OfxRectI& dstBufferBounds,
+                   int dstBufferRowBytes,
+                   bool unpremult,
+                   bool premult)
+    {
+        _srcPixelData = srcPixelData;
+        _srcBufferBounds = srcBufferBounds;
+        _srcBufferRowBytes = srcBufferRowBytes;
+        _dstPixelData = dstPixelData;
+        _dstBounds = dstBufferBounds;
+        _dstBufferRowBytes = dstBufferRowBytes;
+        _unpremult = unpremult && nComponents == 4;
+        _premult = premult && nComponents == 4;
+    }
+
+#ifdef OFX_IO_USING_OCIO
+    // the OCIO transform, or NULL if there is no color conversion, and optionally the same transform baked into a 3D LUT
+    void setProcessor(const OCIO::ConstProcessorRcPtr& proc,
+                      const std::shared_ptr<const OCIOBakedLut>& lut)
+    {
+        _proc = proc;
+        _lut = lut;
+    }
+#endif
+
+    // and do some processing
+    void multiThreadProcessImages(const OfxRectI& procWindow, const OfxPointD& rs)
+    {
+        unused(rs);
+        // pixels outside of the source buffer are black
+        OfxRectI srcWindow;
+        if (!intersect(procWindow, _srcBufferBounds, &srcWindow)) {
+            srcWindow.x1 = srcWindow.x2 = procWindow.x1;
+            srcWindow.y1 = srcWindow.y2 = procWindow.y1;
+        }
+        for (int y = procWindow.y1; y < procWindow.y2; ++y) {
+            float* dst = (float*)((char*)_dstPixelData + (size_t)_dstBufferRowBytes * (y - _dstBounds.y1));
+            if ((y < srcWindow.y1) || (y >= srcWindow.y2)) {
+                std::fill(dst + (size_t)(procWindow.x1 - _dstBounds.x1) * nComponents, dst + (size_t)(procWindow.x2 - _dstBounds.x1) * nComponents, 0.f);
+            } else {
+                std::fill(dst + (size_t)(procWindow.x1 - _dstBounds.x1) * nComponents, dst + (size_t)(srcWindow.x1 - _dstBounds.x1) * nComponents, 0.f);
+                std::fill(dst + (size_t)(srcWindow.x2 - _dstBounds.x1) * nComponents, dst + (size_t)(procWindow.x2 - _dstBounds.x1) * nComponents, 0.f);
+            }
+        }
+        if ((srcWindow.x2 <= srcWindow.x1) || (srcWindow.y2 <= srcWindow.y1)) {
+            return;
+        }
+#ifdef OFX_IO_USING_OCIO
+        try {
+            AutoSetAndRestoreThreadLocale locale;
+            processBlocks(srcWindow);
+        } catch (OCIO::Exception& e) {
+            _effect.setPersistentMessage(Message::eMessageError, "", string("OpenColorIO error: ") + e.what());
+            throw std::runtime_error(string("OpenColorIO error: ") + e.what());
+        }
+#else
+        processBlocks(srcWindow);
+#endif
+    } // multiThreadProcessImages
+
+private:
+    void processBlocks(const OfxRectI& procWindow)
+    {
+        const int width = procWindow.x2 - procWindow.x1;
+        const int blockRows = (std::max)(1, kBlockPixels / width);
+        const size_t rowSize = (size_t)width * nComponents * sizeof(float);
+
+#if defined(OFX_IO_USING_OCIO) && (OCIO_VERSION_HEX >= 0x02000000)
+        OCIO::ConstCPUProcessorRcPtr cpuproc;
+        if (_proc && !_lut) {
+            cpuproc = GenericOCIO::getCachedCPUProcessor(_proc);
+        }
+#endif
+
+        for (int y1 = procWindow.y1; y1 < procWindow.y2; y1 += blockRows) {
+            if (_effect.abort()) {
+                break;
+            }
+            const int y2 = (std::min)(y1 + blockRows, procWindow.y2);
+            float* dstBlock = (float*)((char*)_dstPixelData + (size_t)_dstBufferRowBytes * (y1 - _dstBounds.y1))
+                + (size_t)(procWindow.x1 - _dstBounds.x1) * nComponents;
+
+            // copy and unpremult
+            for (int y = y1; y < y2; ++y) {
+                const float* src = (const float*)((const char*)_srcPixelData + (size_t)_srcBufferRowBytes * (y - _srcBufferBounds.y1))
+                    + (size_t)(procWindow.x1 - _srcBufferBounds.x1) * nComponents;
+                float* dst = (float*)((char*)dstBlock + (size_t)_dstBufferRowBytes * (y - y1));
+                if (src != dst) {
+                    std::memcpy(dst, src, rowSize);
+                }
+                if (_unpremult) {
+                    // pixels with a null alpha are left unchanged
+                    for (int x = 0; x < width; ++x, dst += nComponents) {
+                        const float a = dst[nComponents - 1];
+                        if (a > 0.f) {
+                            const float inva = 1.f / a;
+                            dst[0] *= inva;
+                            dst[1] *= inva;
+                            dst[2] *= inva;
+                        }
+                    }
+                }
+            }
+
+#ifdef OFX_IO_USING_OCIO
+            if (_lut) {
+                for (int y = y1; y < y2; ++y) {
+                    _lut->apply((float*)((char*)dstBlock + (size_t)_dstBufferRowBytes * (y - y1)), width, nComponents);
+                }
+            } else if (_proc) {
+#if OCIO_VERSION_HEX >= 0x02000000
+                OCIO::PackedImageDesc img(dstBlock, width, y2 - y1, nComponents,
+                                          OCIO::BIT_DEPTH_F32, // For now, only float
+                                          sizeof(float), nComponents * sizeof(float), _dstBufferRowBytes);
+                cpuproc->apply(img);
+#else
+                OCIO::PackedImageDesc img(dstBlock, width, y2 - y1, nComponents, sizeof(float), nComponents * sizeof(float), _dstBufferRowBytes);
+                _proc->apply(img);
+#endif
+            }
+#endif
+
+            if (_premult) {
+                for (int y = y1; y < y2; ++y) {
+                    float* dst = (float*)((char*)dstBlock + (size_t)_dstBufferRowBytes * (y - y1));
+                    for (int x = 0; x < width; ++x, dst += nComponents) {
+                        const float a = dst[nComponents - 1];
+                        dst[0] *= a;
+                        dst[1] *= a;
+                        dst[2] *= a;
+                    }
+                }
+            }
+        }
+    }
+};
+
+template <int nComponents>
+static void
+processDecodedPixelData(ImageEffect& effect,
+                        const OfxRectI& renderWindow,
+                        const OfxPointD& renderScale,
+                        const float* srcPixelData,
+                        const OfxRectI& srcBounds,
+                        int srcRowBytes,
+                        float* dstPixelData,
+                        const OfxRectI& dstBounds,
+                        int dstRowBytes,
+                        bool unpremult,
+#ifdef OFX_IO_USING_OCIO
+                        const OCIO::ConstProcessorRcPtr& proc,
+                        const std::shared_ptr<const OCIOBakedLut>& lut,
+#endif
+                        bool premult)
+{
+    PostDecodeProcessor<nComponents> p(effect);
+    p.setValues(srcPixelData, srcBounds, srcRowBytes, dstPixelData, dstBounds, dstRowBytes, unpremult, premult);
+#ifdef OFX_IO_USING_OCIO
+    p.setProcessor(proc, lut);
+#endif
+    p.setRenderWindow(renderWindow, renderScale);
+    p.process();
+}
+
 bool
 GenericReaderPlugin::getRegionOfDefinition(const RegionOfDefinitionArguments& args,
                                            OfxRectD& rod)
@@ -1393,6 +2237,44 @@ public:
     }
 };
 
+// the state of a plane, kept by render() between the decoding and the post-decode stages
+struct DecodedPlaneState {
+    PixelComponentEnum remappedComponents;
+    bool isColor;
+    bool isOCIOIdentity;
+    PreMultiplicationEnum filePremult;
+    bool mustPremult;
+    bool cached; // the plane was fetched from the decoded-frame cache
+    bool direct; // the plane is decoded to the destination, without any post-decode stage
+    bool fusedPostDecode;
+    bool decodeToDst;
+    int pixelBytes;
+    string planeCacheKey;
+    std::shared_ptr<ImageMemory> mem;
+    float* tmpPixelData;
+    OfxRectI tmpBounds;
+    int tmpRowBytes;
+
+    DecodedPlaneState()
+        : remappedComponents(ePixelComponentNone)
+        , isColor(false)
+        , isOCIOIdentity(true)
+        , filePremult(eImageUnPreMultiplied)
+        , mustPremult(false)
+        , cached(false)
+        , direct(false)
+        , fusedPostDecode(false)
+        , decodeToDst(false)
+        , pixelBytes(0)
+        , planeCacheKey()
+        , mem()
+        , tmpPixelData(NULL)
+        , tmpBounds()
+        , tmpRowBytes(0)
+    {
+    }
+};
+
 void
 GenericReaderPlugin::render(const RenderArguments& args)
 {
@@ -1409,6 +2291,7 @@ GenericReaderPlugin::render(const RenderArguments& args)
     }
 
     assert(kSupportsRenderScale || (args.renderScale.x == 1. && args.renderScale.y == 1.));
+    ProfilerRenderScope renderProfiling(_profiler.get());
     /// The image will have the appropriate size since we support the render scale (multi-resolution)
     OutputImagesHolder_RAII outputImagesHolder;
 #ifdef OFX_EXTENSIONS_NUKE
@@ -1637,7 +2520,7 @@ GenericReaderPlugin::render(const RenderArguments& args)
     }
     assert(downscaleLevels >= 0);
 
-    if (filename.empty() || !checkIfFileExists(filename)) {
+    if (filename.empty() || !checkIfFileIsListed(filename, true)) {
         for (std::list<PlaneToRender>::iterator it = planes.begin(); it != planes.end(); ++it) {
             fillWithBlack(args.renderWindow, args.renderScale, it->pixelData, firstBounds, it->comps, it->numChans, firstDepth, it->rowBytes);
         }
@@ -1645,6 +2528,28 @@ GenericReaderPlugin::render(const RenderArguments& args)
         return;
     }
 
+    // prefetch the files of the next frames while this one is decoded
+    if ( !useProxy || proxyFile.empty() ) {
+        int readAheadFrames = _readAheadFrames->getValueAtTime(args.time);
+        if ( (readAheadFrames > 0) && !isVideoStream(filename) ) {
+            prefetchNextFrames(args.time, args.sequentialRenderStatus, readAheadFrames, filename);
+        }
+    }
+
+    // the part of the decoded-frame cache key shared by all planes
+    string cacheKey;
+    if (_sharedCache->getValueAtTime(args.time)) {
+        long long mtime, size;
+        if (getFileStamp(filename, &mtime, &size)) {
+            std::ostringstream ss;
+            string decodeKey;
+            getDecodeCacheKey(args.time, &decodeKey);
+            ss << typeid(*this).name() << '|' << filename << '|' << mtime << '|' << size << '|' << sequenceTime << '|' << args.renderView
+               << '|' << renderMipmapLevel << '|' << downscaleLevels << '|' << decodeKey;
+            cacheKey = ss.str();
+        }
+    }
+
     OfxRectI renderWindowFullRes, renderWindowNotRounded;
     OfxRectI frameBounds, format;
     double par = 1.;
@@ -1668,23 +2573,50 @@ GenericReaderPlugin::render(const RenderArguments& args)
     assert(renderWindowFullRes.x1 >= frameBounds.x1 - std::pow(2., (double)downscaleLevels) + 1 && renderWindowFullRes.x2 <= frameBounds.x2 + std::pow(2., (double)downscaleLevels) - 1 && renderWindowFullRes.y1 >= frameBounds.y1 - std::pow(2., (double)downscaleLevels) + 1 && renderWindowFullRes.y2 <= frameBounds.y2 + std::pow(2., (double)downscaleLevels) - 1);
     intersect(renderWindowFullRes, frameBounds, &renderWindowFullRes);
 
+    // If the reader can decode the file directly at a reduced resolution, work in the pixel coordinates
+    // of that level, and only downscale the remaining levels.
+    unsigned int nativeLevels = 0;
+    OfxPointD decodeScale = { 1., 1. };
+    if (kSupportsRenderScale && (downscaleLevels > 0)) {
+        nativeLevels = (std::min)(getNativeDecodeLevels(filename, sequenceTime, args.renderView, (unsigned int)downscaleLevels), (unsigned int)downscaleLevels);
+        if (nativeLevels > 0) {
+            frameBounds = downscalePowerOfTwoSmallestEnclosing(frameBounds, nativeLevels);
+            renderWindowFullRes = downscalePowerOfTwoSmallestEnclosing(renderWindowFullRes, nativeLevels);
+            downscaleLevels -= nativeLevels;
+            decodeScale.x = decodeScale.y = getScaleFromMipMapLevel(nativeLevels);
+        }
+    }
+
     // See below: we round the render window to the tile size
     renderWindowNotRounded = renderWindowFullRes;
 
-    for (std::list<PlaneToRender>::iterator it = planes.begin(); it != planes.end(); ++it) {
+    // First pass: decide how each plane is decoded, and set up its decode buffer.
+    // All the planes are then decoded in a single call to decodePlanes(), which lets the reader
+    // decode them in a single pass over the file, before the post-decode stages of each plane.
+    std::vector<DecodedPlaneState> states(planes.size());
+#if defined(OFX_IO_USING_OCIO) && (OCIO_VERSION_HEX >= 0x02000000)
+    std::vector<FusedColorConversion> fusedColorConversions(planes.size());
+#endif
+    std::vector<PlaneToDecode> planesToDecode;
+    planesToDecode.reserve(planes.size());
+    std::size_t planeIndex = 0;
+    for (std::list<PlaneToRender>::iterator it = planes.begin(); it != planes.end(); ++it, ++planeIndex) {
+        DecodedPlaneState& state = states[planeIndex];
+
         // Read into a temporary image, apply colorspace conversion, then copy
-        bool isOCIOIdentity = true;
+        state.isOCIOIdentity = true;
 
         // if components are custom, remap it to a OFX components with the same number of channels
-        PixelComponentEnum remappedComponents = it->comps;
+        state.remappedComponents = it->comps;
+        PixelComponentEnum& remappedComponents = state.remappedComponents;
 
-        bool isColor = (it->comps == ePixelComponentRGB) || (it->comps == ePixelComponentRGBA);
+        state.isColor = (it->comps == ePixelComponentRGB) || (it->comps == ePixelComponentRGBA);
         bool isCustom = false;
         if (remappedComponents == ePixelComponentCustom) {
             MultiPlane::ImagePlaneDesc plane, pairedPlane;
             MultiPlane::ImagePlaneDesc::mapOFXComponentsTypeStringToPlanes(it->rawComps, &plane, &pairedPlane);
             const std::vector<std::string>& channels = plane.getChannels();
-            isColor = ((channels.size() == 3 && channels[0] == "R" && channels[1] == "G" && channels[2] == "B") || (channels.size() == 4 && channels[0] == "R" && channels[1] == "G" && channels[2] == "B" && channels[3] == "A"));
+            state.isColor = ((channels.size() == 3 && channels[0] == "R" && channels[1] == "G" && channels[2] == "B") || (channels.size() == 4 && channels[0] == "R" && channels[1] == "G" && channels[2] == "B" && channels[3] == "A"));
             isCustom = true;
 
             if (it->numChans == 3) {
@@ -1697,11 +2629,13 @@ GenericReaderPlugin::render(const RenderArguments& args)
                 remappedComponents = ePixelComponentAlpha;
             }
         }
+        const bool isColor = state.isColor;
 #ifdef OFX_IO_USING_OCIO
         if (isColor) {
-            isOCIOIdentity = _ocio->isIdentity(args.time);
+            state.isOCIOIdentity = _ocio->isIdentity(args.time);
         }
 #endif
+        const bool isOCIOIdentity = state.isOCIOIdentity;
 
         PreMultiplicationEnum filePremult = eImageUnPreMultiplied;
         PreMultiplicationEnum outputPremult = eImageUnPreMultiplied;
@@ -1718,6 +2652,7 @@ GenericReaderPlugin::render(const RenderArguments& args)
             _outputPremult->getValue(oPremult_i);
             outputPremult = (PreMultiplicationEnum)oPremult_i;
         }
+        state.filePremult = filePremult;
 
         // we have to do the final premultiplication if:
         // - pixelComponents is RGBA
@@ -1725,17 +2660,61 @@ GenericReaderPlugin::render(const RenderArguments& args)
         //   - buffer is PreMultiplied AND OCIO is not identity (OCIO works only on unpremultiplied data)
         //   OR
         //   - premult is unpremultiplied
-        bool mustPremult = (isColor && (remappedComponents == ePixelComponentRGBA) && ((filePremult == eImageUnPreMultiplied || !isOCIOIdentity) && outputPremult == eImagePreMultiplied));
+        state.mustPremult = (isColor && (remappedComponents == ePixelComponentRGBA) && ((filePremult == eImageUnPreMultiplied || !isOCIOIdentity) && outputPremult == eImagePreMultiplied));
+        const bool mustPremult = state.mustPremult;
+
+        if (!cacheKey.empty()) {
+            std::ostringstream ss;
+            ss << cacheKey << '|' << it->rawComps << '|' << it->numChans << '|' << (int)filePremult << '|' << (int)outputPremult;
+            bool canCache = true;
+#ifdef OFX_IO_USING_OCIO
+            if (!isOCIOIdentity && isColor) {
+                try {
+                    string inputSpace, outputSpace;
+                    _ocio->getInputColorspaceAtTime(args.time, inputSpace);
+                    _ocio->getOutputColorspaceAtTime(args.time, outputSpace);
+                    ss << '|' << inputSpace << '|' << outputSpace << '|' << _ocio->getLutSize(args.time);
+                    OCIO::ConstConfigRcPtr config = _ocio->getConfig();
+                    if (config) {
+                        ss << '|' << config->getCacheID(_ocio->getLocalContext(args.time));
+                    }
+                } catch (const std::exception&) {
+                    // we cannot identify the color transform: do not cache
+                    canCache = false;
+                }
+            }
+#endif
+            if (canCache) {
+                state.planeCacheKey = ss.str();
+                bool hit;
+                {
+                    ProfileScope profiling("cache");
+                    hit = DecodedFrameCache::instance().get(state.planeCacheKey, args.renderWindow, it->pixelData, firstBounds, it->numChans * (int)sizeof(float), it->rowBytes);
+                }
+                profileCount(hit ? "cacheHits" : "cacheMisses");
+                if (hit) {
+                    DBG(std::printf("decoded-frame cache hit\n"));
+                    state.cached = true;
+                    continue;
+                }
+            }
+        }
 
-        if (!mustPremult && isOCIOIdentity && (!kSupportsRenderScale || (renderMipmapLevel == 0))) {
+        PlaneToDecode planeToDecode;
+        planeToDecode.numChans = it->numChans;
+        planeToDecode.comps = it->comps;
+        planeToDecode.remappedComps = remappedComponents;
+        planeToDecode.rawComps = it->rawComps;
+        planeToDecode.colorConversion = NULL;
+
+        if (!mustPremult && isOCIOIdentity && (!kSupportsRenderScale || (renderMipmapLevel == nativeLevels))) {
             // no colorspace conversion, no premultiplication, no proxy, just read file
             DBG(std::printf("decode (to dst)\n"));
-
-            if (!_isMultiPlanar) {
-                decode(filename, sequenceTime, args.renderView, args.sequentialRenderStatus, args.renderWindow, args.renderScale, it->pixelData, firstBounds, it->comps, it->numChans, it->rowBytes);
-            } else {
-                decodePlane(filename, sequenceTime, args.renderView, args.sequentialRenderStatus, args.renderWindow, args.renderScale, it->pixelData, firstBounds, it->comps, remappedComponents, it->numChans, it->rawComps, it->rowBytes);
-            }
+            state.direct = true;
+            planeToDecode.pixelData = it->pixelData;
+            planeToDecode.renderWindow = args.renderWindow;
+            planeToDecode.bounds = firstBounds;
+            planeToDecode.rowBytes = it->rowBytes;
         } else {
             int pixelBytes;
             if (it->comps == ePixelComponentCustom) {
@@ -1744,6 +2723,7 @@ GenericReaderPlugin::render(const RenderArguments& args)
                 pixelBytes = it->numChans * getComponentBytes(firstDepth);
             }
             assert(pixelBytes > 0);
+            state.pixelBytes = pixelBytes;
 
             /*
                If tile_width and tile_height is set, round the renderWindow to the enclosing tile size to make sure the plug-in has a buffer
@@ -1779,90 +2759,214 @@ GenericReaderPlugin::render(const RenderArguments& args)
                 }
             }
 
-            int tmpRowBytes = (renderWindowFullRes.x2 - renderWindowFullRes.x1) * pixelBytes;
-            size_t memSize = (size_t)(renderWindowFullRes.y2 - renderWindowFullRes.y1) * (size_t)tmpRowBytes;
-            ImageMemory mem(memSize, this);
-            float* tmpPixelData = (float*)mem.lock();
+            // Without downscaling, the post-decode stages of color planes are done in a single pass (see PostDecodeProcessor).
+            // The file can then be decoded directly to the destination if it covers exactly the render window
+            // (pixels outside of the render window must not be written, since other threads may be rendering them).
+            state.fusedPostDecode = isColor && !(kSupportsRenderScale && (downscaleLevels > 0)) &&
+                                    ((remappedComponents == ePixelComponentRGB) || (remappedComponents == ePixelComponentRGBA));
+            state.decodeToDst = (state.fusedPostDecode && (pixelBytes == it->numChans * (int)sizeof(float)) &&
+                                 (renderWindowFullRes.x1 == args.renderWindow.x1) && (renderWindowFullRes.x2 == args.renderWindow.x2) &&
+                                 (renderWindowFullRes.y1 == args.renderWindow.y1) && (renderWindowFullRes.y2 == args.renderWindow.y2));
+            if (state.decodeToDst) {
+                state.tmpPixelData = it->pixelData;
+                state.tmpBounds = firstBounds;
+                state.tmpRowBytes = it->rowBytes;
+            } else {
+                state.tmpBounds = renderWindowFullRes;
+                state.tmpRowBytes = (renderWindowFullRes.x2 - renderWindowFullRes.x1) * pixelBytes;
+                size_t memSize = (size_t)(renderWindowFullRes.y2 - renderWindowFullRes.y1) * (size_t)state.tmpRowBytes;
+                state.mem = std::make_shared<ImageMemory>(memSize, this);
+                state.tmpPixelData = (float*)state.mem->lock();
+            }
+
+#if defined(OFX_IO_USING_OCIO) && (OCIO_VERSION_HEX >= 0x02000000)
+            // if the OCIO transform works on each channel separately and the data is not premultiplied,
+            // the reader may apply it while converting 8-bit or 16-bit data to float (see convertDepthAndComponents())
+            if (!isOCIOIdentity && isColor && (filePremult != eImagePreMultiplied)) {
+                OCIO::ConstProcessorRcPtr proc;
+                try {
+                    proc = _ocio->getOrCreateProcessor(args.time);
+                } catch (const std::exception&) {
+                    // the error is reported below by _ocio->apply()
+                }
+                if (proc && !proc->hasChannelCrosstalk()) {
+                    fusedColorConversions[planeIndex].set(proc);
+                    planeToDecode.colorConversion = &fusedColorConversions[planeIndex];
+                }
+            }
+#endif
 
-            // read file
-            DBG(std::printf("decode (to tmp)\n"));
+            DBG(std::printf(state.decodeToDst ? "decode (to dst)\n" : "decode (to tmp)\n"));
+            planeToDecode.pixelData = state.tmpPixelData;
+            planeToDecode.renderWindow = renderWindowFullRes;
+            planeToDecode.bounds = state.tmpBounds;
+            planeToDecode.rowBytes = state.tmpRowBytes;
+        }
+        planesToDecode.push_back(planeToDecode);
+    }
 
-            if (!_isMultiPlanar) {
-                decode(filename, sequenceTime, args.renderView, args.sequentialRenderStatus, renderWindowFullRes, args.renderScale, tmpPixelData, renderWindowFullRes, it->comps, it->numChans, tmpRowBytes);
-            } else {
-                decodePlane(filename, sequenceTime, args.renderView, args.sequentialRenderStatus, renderWindowFullRes, args.renderScale, tmpPixelData, renderWindowFullRes, it->comps, remappedComponents, it->numChans, it->rawComps, tmpRowBytes);
+    // read file
+    if (!planesToDecode.empty()) {
+        ProfileScope profiling("read");
+        for (std::vector<PlaneToDecode>::const_iterator it = planesToDecode.begin(); it != planesToDecode.end(); ++it) {
+            profileCount("decodedBytes", (double)(it->renderWindow.y2 - it->renderWindow.y1) * it->rowBytes);
+        }
+        if (!_isMultiPlanar) {
+            for (std::vector<PlaneToDecode>::const_iterator it = planesToDecode.begin(); it != planesToDecode.end(); ++it) {
+                decode(filename, sequenceTime, args.renderView, args.sequentialRenderStatus, it->renderWindow, decodeScale, it->pixelData, it->bounds, it->comps, it->numChans, it->rowBytes, it->colorConversion);
             }
+        } else {
+            decodePlanes(filename, sequenceTime, args.renderView, args.sequentialRenderStatus, decodeScale, planesToDecode);
+        }
 
-            if (abort()) {
-                return;
+        if (abort()) {
+            return;
+        }
+    }
+
+    // Second pass: post-decode stages of each plane
+    planeIndex = 0;
+    for (std::list<PlaneToRender>::iterator it = planes.begin(); it != planes.end(); ++it, ++planeIndex) {
+        const DecodedPlaneState& state = states[planeIndex];
+        if (state.cached) {
+            continue;
+        }
+
+        if (!state.direct) {
+            const PixelComponentEnum remappedComponents = state.remappedComponents;
+            const bool isColor = state.isColor;
+            const bool isOCIOIdentity = state.isOCIOIdentity;
+            const PreMultiplicationEnum filePremult = state.filePremult;
+            const bool mustPremult = state.mustPremult;
+            const int pixelBytes = state.pixelBytes;
+            const OfxRectI& tmpBounds = state.tmpBounds;
+            const int tmpRowBytes = state.tmpRowBytes;
+            float* tmpPixelData = state.tmpPixelData;
+
+            bool colorConverted = false;
+#if defined(OFX_IO_USING_OCIO) && (OCIO_VERSION_HEX >= 0x02000000)
+            colorConverted = fusedColorConversions[planeIndex].applied();
+            if (colorConverted) {
+                DBG(std::printf("OCIO (fused with depth conversion)\n"));
             }
+#endif
 
-            /// do the color-space conversion
-            if (!isOCIOIdentity && isColor) {
-                if (filePremult == eImagePreMultiplied) {
-                    assert(remappedComponents == ePixelComponentRGBA);
-                    DBG(std::printf("unpremult (tmp in-place)\n"));
-                    // tmpPixelData[0] = tmpPixelData[1] = tmpPixelData[2] = tmpPixelData[3] = 0.5;
-                    unPremultPixelData(renderWindowNotRounded, args.renderScale, tmpPixelData, renderWindowFullRes, remappedComponents, it->numChans, firstDepth, tmpRowBytes, tmpPixelData, renderWindowFullRes, remappedComponents, it->numChans, firstDepth, tmpRowBytes);
+            if (state.fusedPostDecode) {
+                // unpremult, color conversion and premult in a single pass, from tmp (or dst itself) to dst
+                const bool applyOCIO = !isOCIOIdentity && !colorConverted;
+                const bool unpremult = applyOCIO && (filePremult == eImagePreMultiplied);
+#ifdef OFX_IO_USING_OCIO
+                OCIO::ConstProcessorRcPtr proc;
+                std::shared_ptr<const OCIOBakedLut> lut;
+                if (applyOCIO) {
+                    proc = _ocio->getOrCreateProcessor(args.time);
+                    if (!proc) {
+                        setPersistentMessage(Message::eMessageError, "", "Cannot create OCIO processor");
+                        throwSuiteStatusException(kOfxStatFailed);
 
-                    if (abort()) {
                         return;
                     }
-
-                    // assert(tmpPixelData[0] == 1. && tmpPixelData[1] == 1. && tmpPixelData[2] == 1. && tmpPixelData[3] == 0.5);
+                    int lutSize = _ocio->getLutSize(args.time);
+                    if (lutSize > 0) {
+                        try {
+                            lut = OCIOBakedLut::get(proc, lutSize);
+                        } catch (const std::exception&) {
+                            // apply the exact transform, which reports the error
+                        }
+                    }
                 }
+#endif
+                DBG(std::printf("post-decode (fused, %s to dst)\n", state.decodeToDst ? "dst" : "tmp"));
+                ProfileScope profiling("postDecode");
+                if (remappedComponents == ePixelComponentRGBA) {
+                    processDecodedPixelData<4>(*this, args.renderWindow, args.renderScale, tmpPixelData, tmpBounds, tmpRowBytes, it->pixelData, firstBounds, it->rowBytes, unpremult,
 #ifdef OFX_IO_USING_OCIO
-                DBG(std::printf("OCIO (tmp in-place)\n"));
-                _ocio->apply(args.time, renderWindowFullRes, args.renderScale, tmpPixelData, renderWindowFullRes, remappedComponents, it->numChans, tmpRowBytes);
+                                               proc,
+                                               lut,
 #endif
-            }
-
-            if (kSupportsRenderScale && (downscaleLevels > 0)) {
-                if (!mustPremult) {
-                    // we can write directly to dstPixelData
-                    /// adjust the scale to match the given output image
-                    DBG(std::printf("scale (no premult, tmp to dst)\n"));
-                    scalePixelData(args.renderWindow, args.renderScale, renderWindowNotRounded, (unsigned int)downscaleLevels, tmpPixelData, remappedComponents,
-                                   it->numChans, firstDepth, renderWindowFullRes, tmpRowBytes, it->pixelData,
-                                   remappedComponents, it->numChans, firstDepth, firstBounds, it->rowBytes);
+                                               mustPremult);
                 } else {
-                    // allocate a temporary image (we must avoid reading from dstPixelData, in case several threads are rendering the same area)
-                    int mem2RowBytes = (firstBounds.x2 - firstBounds.x1) * pixelBytes;
-                    size_t mem2Size = (size_t)(firstBounds.y2 - firstBounds.y1) * (size_t)mem2RowBytes;
-                    ImageMemory mem2(mem2Size, this);
-                    float* scaledPixelData = (float*)mem2.lock();
-
-                    /// adjust the scale to match the given output image
-                    DBG(std::printf("scale (tmp to scaled)\n"));
-                    scalePixelData(args.renderWindow, args.renderScale, renderWindowNotRounded, (unsigned int)downscaleLevels, tmpPixelData,
-                                   remappedComponents, it->numChans, firstDepth,
-                                   renderWindowFullRes, tmpRowBytes, scaledPixelData,
-                                   remappedComponents, it->numChans, firstDepth,
-                                   firstBounds, mem2RowBytes);
-
-                    if (abort()) {
-                        return;
-                    }
-
-                    // apply premult
-                    DBG(std::printf("premult (scaled to dst)\n"));
-                    // scaledPixelData[0] = scaledPixelData[1] = scaledPixelData[2] = 1.; scaledPixelData[3] = 0.5;
-                    premultPixelData(args.renderWindow, args.renderScale, scaledPixelData, firstBounds, remappedComponents, it->numChans, firstDepth, mem2RowBytes, it->pixelData, firstBounds, remappedComponents, it->numChans, firstDepth, it->rowBytes);
-                    // assert(dstPixelDataF[0] == 0.5 && dstPixelDataF[1] == 0.5 && dstPixelDataF[2] == 0.5 && dstPixelDataF[3] == 0.5);
+                    processDecodedPixelData<3>(*this, args.renderWindow, args.renderScale, tmpPixelData, tmpBounds, tmpRowBytes, it->pixelData, firstBounds, it->rowBytes, false,
+#ifdef OFX_IO_USING_OCIO
+                                               proc,
+                                               lut,
+#endif
+                                               false);
                 }
             } else {
-                // copy
-                if (mustPremult) {
-                    DBG(std::printf("premult (no scale, tmp to dst)\n"));
-                    // tmpPixelData[0] = tmpPixelData[1] = tmpPixelData[2] = 1.; tmpPixelData[3] = 0.5;
-                    premultPixelData(args.renderWindow, args.renderScale, tmpPixelData, renderWindowFullRes, remappedComponents, it->numChans, firstDepth, tmpRowBytes, it->pixelData, firstBounds, remappedComponents, it->numChans, firstDepth, it->rowBytes);
-                    // assert(dstPixelDataF[0] == 0.5 && dstPixelDataF[1] == 0.5 && dstPixelDataF[2] == 0.5 && dstPixelDataF[3] == 0.5);
+                /// do the color-space conversion
+                if (!isOCIOIdentity && isColor && !colorConverted) {
+                    if (filePremult == eImagePreMultiplied) {
+                        assert(remappedComponents == ePixelComponentRGBA);
+                        DBG(std::printf("unpremult (tmp in-place)\n"));
+                        // tmpPixelData[0] = tmpPixelData[1] = tmpPixelData[2] = tmpPixelData[3] = 0.5;
+                        unPremultPixelData(renderWindowNotRounded, args.renderScale, tmpPixelData, renderWindowFullRes, remappedComponents, it->numChans, firstDepth, tmpRowBytes, tmpPixelData, renderWindowFullRes, remappedComponents, it->numChans, firstDepth, tmpRowBytes);
+
+                        if (abort()) {
+                            return;
+                        }
+
+                        // assert(tmpPixelData[0] == 1. && tmpPixelData[1] == 1. && tmpPixelData[2] == 1. && tmpPixelData[3] == 0.5);
+                    }
+#ifdef OFX_IO_USING_OCIO
+                    DBG(std::printf("OCIO (tmp in-place)\n"));
+                    _ocio->apply(args.time, renderWindowFullRes, args.renderScale, tmpPixelData, renderWindowFullRes, remappedComponents, it->numChans, tmpRowBytes);
+#endif
+                }
+
+                if (kSupportsRenderScale && (downscaleLevels > 0)) {
+                    if (!mustPremult) {
+                        // we can write directly to dstPixelData
+                        /// adjust the scale to match the given output image
+                        DBG(std::printf("scale (no premult, tmp to dst)\n"));
+                        scalePixelData(args.renderWindow, args.renderScale, renderWindowNotRounded, (unsigned int)downscaleLevels, tmpPixelData, remappedComponents,
+                                       it->numChans, firstDepth, renderWindowFullRes, tmpRowBytes, it->pixelData,
+                                       remappedComponents, it->numChans, firstDepth, firstBounds, it->rowBytes);
+                    } else {
+                        // allocate a temporary image (we must avoid reading from dstPixelData, in case several threads are rendering the same area)
+                        int mem2RowBytes = (firstBounds.x2 - firstBounds.x1) * pixelBytes;
+                        size_t mem2Size = (size_t)(firstBounds.y2 - firstBounds.y1) * (size_t)mem2RowBytes;
+                        ImageMemory mem2(mem2Size, this);
+                        float* scaledPixelData = (float*)mem2.lock();
+
+                        /// adjust the scale to match the given output image
+                        DBG(std::printf("scale (tmp to scaled)\n"));
+                        scalePixelData(args.renderWindow, args.renderScale, renderWindowNotRounded, (unsigned int)downscaleLevels, tmpPixelData,
+                                       remappedComponents, it->numChans, firstDepth,
+                                       renderWindowFullRes, tmpRowBytes, scaledPixelData,
+                                       remappedComponents, it->numChans, firstDepth,
+                                       firstBounds, mem2RowBytes);
+
+                        if (abort()) {
+                            return;
+                        }
+
+                        // apply premult
+                        DBG(std::printf("premult (scaled to dst)\n"));
+                        // scaledPixelData[0] = scaledPixelData[1] = scaledPixelData[2] = 1.; scaledPixelData[3] = 0.5;
+                        premultPixelData(args.renderWindow, args.renderScale, scaledPixelData, firstBounds, remappedComponents, it->numChans, firstDepth, mem2RowBytes, it->pixelData, firstBounds, remappedComponents, it->numChans, firstDepth, it->rowBytes);
+                        // assert(dstPixelDataF[0] == 0.5 && dstPixelDataF[1] == 0.5 && dstPixelDataF[2] == 0.5 && dstPixelDataF[3] == 0.5);
+                    }
                 } else {
-                    DBG(std::printf("copy (no premult no scale, tmp to dst)\n"));
-                    copyPixelData(args.renderWindow, args.renderScale, tmpPixelData, renderWindowFullRes, remappedComponents, it->numChans, firstDepth, tmpRowBytes, it->pixelData, firstBounds, remappedComponents, it->numChans, firstDepth, it->rowBytes);
+                    // copy
+                    if (mustPremult) {
+                        DBG(std::printf("premult (no scale, tmp to dst)\n"));
+                        // tmpPixelData[0] = tmpPixelData[1] = tmpPixelData[2] = 1.; tmpPixelData[3] = 0.5;
+                        premultPixelData(args.renderWindow, args.renderScale, tmpPixelData, renderWindowFullRes, remappedComponents, it->numChans, firstDepth, tmpRowBytes, it->pixelData, firstBounds, remappedComponents, it->numChans, firstDepth, it->rowBytes);
+                        // assert(dstPixelDataF[0] == 0.5 && dstPixelDataF[1] == 0.5 && dstPixelDataF[2] == 0.5 && dstPixelDataF[3] == 0.5);
+                    } else {
+                        DBG(std::printf("copy (no premult no scale, tmp to dst)\n"));
+                        copyPixelData(args.renderWindow, args.renderScale, tmpPixelData, renderWindowFullRes, remappedComponents, it->numChans, firstDepth, tmpRowBytes, it->pixelData, firstBounds, remappedComponents, it->numChans, firstDepth, it->rowBytes);
+                    }
                 }
             }
-            mem.unlock();
+            if (state.mem) {
+                state.mem->unlock();
+            }
+        }
+
+        if (!state.planeCacheKey.empty() && !abort()) {
+            DecodedFrameCache::instance().insert(state.planeCacheKey, args.renderWindow, it->pixelData, firstBounds, it->numChans * (int)sizeof(float), it->rowBytes);
         }
     } // for (std::list<PlaneToRender>::iterator it = planes.begin(); it!=planes.end(); ++it) {
 }
@@ -1878,7 +2982,8 @@ GenericReaderPlugin::decode(const string& /*filename*/,
                             const OfxRectI& /*bounds*/,
                             PixelComponentEnum /*pixelComponents*/,
                             int /*pixelComponentCount*/,
-                            int /*rowBytes*/)
+                            int /*rowBytes*/,
+                            FusedColorConversion* /*colorConversion*/)
 {
     // does nothing
 }
@@ -1901,6 +3006,22 @@ GenericReaderPlugin::decodePlane(const string& /*filename*/,
     // does nothing
 }
 
+void
+GenericReaderPlugin::decodePlanes(const string& filename,
+                                  OfxTime time,
+                                  int view,
+                                  bool isPlayback,
+                                  const OfxPointD& renderScale,
+                                  const std::vector<PlaneToDecode>& planes)
+{
+    for (std::vector<PlaneToDecode>::const_iterator it = planes.begin(); it != planes.end(); ++it) {
+        decodePlane(filename, time, view, isPlayback, it->renderWindow, renderScale, it->pixelData, it->bounds, it->comps, it->remappedComps, it->numChans, it->rawComps, it->rowBytes);
+        if (abort()) {
+            return;
+        }
+    }
+}
+
 bool
 GenericReaderPlugin::checkExtension(const string& ext)
 {
@@ -1939,6 +3060,9 @@ GenericReaderPlugin::changedFilename(const InstanceChangedArgs& args)
         return;
     }
 
+    // the directory may have changed since it was listed, e.g. the file was just written
+    DirectoryListingCache::instance().invalidate(filename);
+
     OfxRangeI sequenceTimeDomain;
     bool gotSequenceTimeDomain = getSequenceTimeDomainInternal(sequenceTimeDomain, true);
     if (!gotSequenceTimeDomain) {
@@ -2260,6 +3384,17 @@ GenericReaderPlugin::changedParam(const InstanceChangedArgs& args,
                 }
             }
         }
+    } else if (paramName == kParamSharedCacheInfo) {
+        string info = DecodedFrameCache::instance().getStatistics();
+        const string readerInfo = getCacheStatistics();
+        if ( !readerInfo.empty() ) {
+            info += "\n\n" + readerInfo;
+        }
+        sendMessage(Message::eMessageMessage, "", info + "\n\n" + MemoryGovernor::instance().getStatistics());
+    } else if ((paramName == kParamProfileInfo) && (args.reason == eChangeUserEdit)) {
+        if (_profiler.get()) {
+            sendMessage(Message::eMessageMessage, "", _profiler->getStatistics());
+        }
 #ifdef OFX_IO_USING_OCIO
     } else if (((paramName == kOCIOParamInputSpace) || (paramName == kOCIOParamInputSpaceChoice)) && (args.reason == eChangeUserEdit)) {
         // set the inputSpaceSet param to true https://github.com/MrKepzie/Natron/issues/1492
@@ -2392,6 +3527,10 @@ void
 GenericReaderPlugin::purgeCaches()
 {
     clearAnyCache();
+    DecodedFrameCache::instance().clear();
+    DirectoryListingCache::instance().clear();
+    // the host is low on memory: also free the caches of the other plugins
+    MemoryGovernor::instance().purgeAll();
 #ifdef OFX_IO_USING_OCIO
     _ocio->purgeCaches();
 #endif
@@ -2490,6 +3629,36 @@ class PixelConverterProcessor
     int _dstBufferRowBytes;
     int _srcBufferRowBytes;
     OfxRectI _srcBufferBounds;
+    const float* _lut;
+
+    // the source component copied to destination component c, or kZero/kOne if it is set to a constant.
+    // This only depends on template parameters, so that the per-pixel loop has no branches and can be vectorized.
+    enum {
+        kZero = -1,
+        kOne = -2
+    };
+
+    static int srcComponent(int c)
+    {
+        switch (nSrcComp) {
+        case 1:
+            // alpha goes to the last component of Alpha and RGBA
+            return (nDstComp == 1 || (nDstComp == 4 && c == 3)) ? 0 : kZero;
+        case 2:
+            // XY
+            return (nDstComp == 1) ? kZero : (c < 2) ? c : (c == 3) ? kOne : kZero;
+        case 3:
+            // RGB
+            return (nDstComp == 1) ? kZero : (c < 3) ? c : kOne;
+        case 4:
+            // RGBA: Alpha gets the alpha channel
+            return (nDstComp == 1) ? 3 : c;
+        default:
+            assert(false);
+
+            return kZero;
+        }
+    }
 
 public:
     // ctor
@@ -2498,6 +3667,7 @@ public:
         , _srcPixelData(NULL)
         , _dstBufferRowBytes(0)
         , _srcBufferRowBytes(0)
+        , _lut(NULL)
     {
         assert(srcMaxValue);
         _srcBufferBounds.x1 = _srcBufferBounds.y1 = _srcBufferBounds.x2 = _srcBufferBounds.y2 = 0;
@@ -2519,12 +3689,33 @@ public:
         _dstPixelData = dstPixelData;
     }
 
+    // lookup tables (srcMaxValue + 1 values for each of R, G and B) used instead of the linear
+    // conversion for the color components, e.g. to also linearize the data. Alpha is never looked up.
+    void setLut(const float* lut)
+    {
+        _lut = lut;
+    }
+
     // and do some processing
     void multiThreadProcessImages(const OfxRectI& procWindow, const OfxPointD& rs)
     {
         unused(rs);
         assert(nSrcComp == 1 || nSrcComp == 2 || nSrcComp == 3 || nSrcComp == 4);
         assert(nDstComp == 1 || nDstComp == 2 || nDstComp == 3 || nDstComp == 4);
+        assert(!_lut || (nSrcComp >= 3 && nDstComp >= 3 && srcMaxValue > 1));
+
+        if (_lut) {
+            processRows<true>(procWindow);
+        } else {
+            processRows<false>(procWindow);
+        }
+    } // multiThreadProcessImages
+
+private:
+    template <bool useLut>
+    void processRows(const OfxRectI& procWindow)
+    {
+        const int width = procWindow.x2 - procWindow.x1;
 
         for (int dsty = procWindow.y1; dsty < procWindow.y2; ++dsty) {
             if (_effect.abort()) {
@@ -2533,145 +3724,40 @@ public:
 
             int srcY = _dstBounds.y2 - dsty - 1;
             float* dst_pixels = (float*)((char*)_dstPixelData + (size_t)_dstBufferRowBytes * (dsty - _dstBounds.y1))
-                + (_dstBounds.x1 * nDstComp);
+                + (procWindow.x1 - _dstBounds.x1) * nDstComp;
             const SRCPIX* src_pixels = (const SRCPIX*)((const char*)_srcPixelData + (size_t)_srcBufferRowBytes * (srcY - _srcBufferBounds.y1))
-                + (_srcBufferBounds.x1 * nSrcComp);
+                + (procWindow.x1 - _srcBufferBounds.x1) * nSrcComp;
 
             assert(dst_pixels && src_pixels);
 
-            for (int x = procWindow.x1; x < procWindow.x2; ++x) {
-                int srcCol = x * nSrcComp;
-                int dstCol = x * nDstComp;
-
-                switch (nSrcComp) {
-                case 1:
-                    // alpha
-                    switch (nDstComp) {
-                    case 1:
-                        dst_pixels[dstCol + 0] = src_pixels[srcCol + 0] * (1.f / srcMaxValue);
-                        break;
-                    case 2:
-                        dst_pixels[dstCol + 0] = 0.;
-                        dst_pixels[dstCol + 1] = 0.;
-                        break;
-
-                    case 3:
-                        dst_pixels[dstCol + 0] = 0.;
-                        dst_pixels[dstCol + 1] = 0.;
-                        dst_pixels[dstCol + 2] = 0.;
-                        break;
-
-                    case 4:
-                        dst_pixels[dstCol + 0] = 0.;
-                        dst_pixels[dstCol + 1] = 0.;
-                        dst_pixels[dstCol + 2] = 0.;
-                        dst_pixels[dstCol + 3] = src_pixels[srcCol + 0] * (1.f / srcMaxValue);
-                        break;
-                    default:
-                        assert(false);
-
-                        return;
-                    }
-                    break;
-                case 2:
-                    // XY
-                    switch (nDstComp) {
-                    case 1:
-                        dst_pixels[dstCol + 0] = 0.;
-                        break;
-                    case 2:
-                        dst_pixels[dstCol + 0] = src_pixels[srcCol + 0] * (1.f / srcMaxValue);
-                        dst_pixels[dstCol + 1] = src_pixels[srcCol + 1] * (1.f / srcMaxValue);
-                        break;
-
-                    case 3:
-                        dst_pixels[dstCol + 0] = src_pixels[srcCol + 0] * (1.f / srcMaxValue);
-                        dst_pixels[dstCol + 1] = src_pixels[srcCol + 1] * (1.f / srcMaxValue);
-                        dst_pixels[dstCol + 2] = 0;
-                        break;
-
-                    case 4:
-                        dst_pixels[dstCol + 0] = src_pixels[srcCol + 0] * (1.f / srcMaxValue);
-                        dst_pixels[dstCol + 1] = src_pixels[srcCol + 1] * (1.f / srcMaxValue);
-                        dst_pixels[dstCol + 2] = 0.;
-                        dst_pixels[dstCol + 3] = 1.f;
-                        break;
-                    default:
-                        assert(false);
-
-                        return;
-                    }
-
-                    break;
-                case 3:
-                    // RGB
-                    switch (nDstComp) {
-                    case 1: {
-                        dst_pixels[dstCol + 0] = 0.;
-                        break;
-                    }
-                    case 2:
-                        dst_pixels[dstCol + 0] = src_pixels[srcCol + 0] * (1.f / srcMaxValue);
-                        dst_pixels[dstCol + 1] = src_pixels[srcCol + 1] * (1.f / srcMaxValue);
-                        break;
-
-                    case 3:
-                        dst_pixels[dstCol + 0] = src_pixels[srcCol + 0] * (1.f / srcMaxValue);
-                        dst_pixels[dstCol + 1] = src_pixels[srcCol + 1] * (1.f / srcMaxValue);
-                        dst_pixels[dstCol + 2] = src_pixels[srcCol + 2] * (1.f / srcMaxValue);
-                        break;
-
-                    case 4:
-                        dst_pixels[dstCol + 0] = src_pixels[srcCol + 0] * (1.f / srcMaxValue);
-                        dst_pixels[dstCol + 1] = src_pixels[srcCol + 1] * (1.f / srcMaxValue);
-                        dst_pixels[dstCol + 2] = src_pixels[srcCol + 2] * (1.f / srcMaxValue);
-                        dst_pixels[dstCol + 3] = 1.f;
-                        break;
-                    default:
-                        assert(false);
-
-                        return;
-                    }
-
-                    break;
-
-                case 4:
-                    switch (nDstComp) {
-                    case 1:
-                        dst_pixels[dstCol + 0] = src_pixels[srcCol + 3] * (1.f / srcMaxValue);
-                        break;
-                    case 2:
-                        dst_pixels[dstCol + 0] = src_pixels[srcCol + 0] * (1.f / srcMaxValue);
-                        dst_pixels[dstCol + 1] = src_pixels[srcCol + 1] * (1.f / srcMaxValue);
-                        break;
-
-                    case 3:
-                        dst_pixels[dstCol + 0] = src_pixels[srcCol + 0] * (1.f / srcMaxValue);
-                        dst_pixels[dstCol + 1] = src_pixels[srcCol + 1] * (1.f / srcMaxValue);
-                        dst_pixels[dstCol + 2] = src_pixels[srcCol + 2] * (1.f / srcMaxValue);
-                        break;
-
-                    case 4:
-                        dst_pixels[dstCol + 0] = src_pixels[srcCol + 0] * (1.f / srcMaxValue);
-                        dst_pixels[dstCol + 1] = src_pixels[srcCol + 1] * (1.f / srcMaxValue);
-                        dst_pixels[dstCol + 2] = src_pixels[srcCol + 2] * (1.f / srcMaxValue);
-                        dst_pixels[dstCol + 3] = src_pixels[srcCol + 3] * (1.f / srcMaxValue);
-                        break;
-                    default:
-                        assert(false);
-
-                        return;
-                    }
-
-                    break;
-                default:
-                    assert(false);
+            processRow<useLut>(src_pixels, dst_pixels, width);
+        }
+    }
 
-                    return;
-                } // switch
+    template <bool useLut>
+    void processRow(const SRCPIX* src,
+                    float* dst,
+                    int width) const
+    {
+        const float norm = 1.f / srcMaxValue;
+        const float* lut = _lut;
+
+        // the inner loop has a constant trip count and is fully unrolled
+        for (int x = 0; x < width; ++x, src += nSrcComp, dst += nDstComp) {
+            for (int c = 0; c < nDstComp; ++c) {
+                const int s = srcComponent(c);
+                if (s == kZero) {
+                    dst[c] = 0.f;
+                } else if (s == kOne) {
+                    dst[c] = 1.f;
+                } else if (useLut && c < 3) {
+                    dst[c] = lut[c * (srcMaxValue + 1) + (int)src[s]];
+                } else {
+                    dst[c] = src[s] * norm;
+                }
             }
         }
-    } // multiThreadProcessImages
+    }
 };
 
 template <typename SRCPIX, int srcMaxValue, int nSrcComp, int nDstComp>
@@ -2684,10 +3770,12 @@ convertForDstNComps(ImageEffect* effect,
                     int srcRowBytes,
                     float* dstPixelData,
                     const OfxRectI& dstBounds,
-                    int dstRowBytes)
+                    int dstRowBytes,
+                    const float* lut)
 {
     PixelConverterProcessor<SRCPIX, srcMaxValue, nSrcComp, nDstComp> p(*effect);
     p.setValues(srcPixelData, srcBounds, srcRowBytes, dstPixelData, dstRowBytes, dstBounds);
+    p.setLut(lut);
     p.setRenderWindow(renderWindow, renderScale);
     p.process();
 }
@@ -2703,23 +3791,24 @@ convertForSrcNComps(ImageEffect* effect,
                     float* dstPixelData,
                     const OfxRectI& dstBounds,
                     PixelComponentEnum dstPixelComponents,
-                    int dstRowBytes)
+                    int dstRowBytes,
+                    const float* lut)
 {
     switch (dstPixelComponents) {
     case ePixelComponentAlpha: {
-        convertForDstNComps<SRCPIX, srcMaxValue, nSrcComp, 1>(effect, srcPixelData, renderWindow, renderScale, srcBounds, srcRowBytes, dstPixelData, dstBounds, dstRowBytes);
+        convertForDstNComps<SRCPIX, srcMaxValue, nSrcComp, 1>(effect, srcPixelData, renderWindow, renderScale, srcBounds, srcRowBytes, dstPixelData, dstBounds, dstRowBytes, lut);
         break;
     }
     case ePixelComponentXY: {
-        convertForDstNComps<SRCPIX, srcMaxValue, nSrcComp, 2>(effect, srcPixelData, renderWindow, renderScale, srcBounds, srcRowBytes, dstPixelData, dstBounds, dstRowBytes);
+        convertForDstNComps<SRCPIX, srcMaxValue, nSrcComp, 2>(effect, srcPixelData, renderWindow, renderScale, srcBounds, srcRowBytes, dstPixelData, dstBounds, dstRowBytes, lut);
         break;
     }
     case ePixelComponentRGB: {
-        convertForDstNComps<SRCPIX, srcMaxValue, nSrcComp, 3>(effect, srcPixelData, renderWindow, renderScale, srcBounds, srcRowBytes, dstPixelData, dstBounds, dstRowBytes);
+        convertForDstNComps<SRCPIX, srcMaxValue, nSrcComp, 3>(effect, srcPixelData, renderWindow, renderScale, srcBounds, srcRowBytes, dstPixelData, dstBounds, dstRowBytes, lut);
         break;
     }
     case ePixelComponentRGBA: {
-        convertForDstNComps<SRCPIX, srcMaxValue, nSrcComp, 4>(effect, srcPixelData, renderWindow, renderScale, srcBounds, srcRowBytes, dstPixelData, dstBounds, dstRowBytes);
+        convertForDstNComps<SRCPIX, srcMaxValue, nSrcComp, 4>(effect, srcPixelData, renderWindow, renderScale, srcBounds, srcRowBytes, dstPixelData, dstBounds, dstRowBytes, lut);
         break;
     }
     default:
@@ -2740,20 +3829,21 @@ convertForDepth(ImageEffect* effect,
                 float* dstPixelData,
                 const OfxRectI& dstBounds,
                 PixelComponentEnum dstPixelComponents,
-                int dstRowBytes)
+                int dstRowBytes,
+                const float* lut)
 {
     switch (srcPixelComponents) {
     case ePixelComponentAlpha:
-        convertForSrcNComps<SRCPIX, srcMaxValue, 1>(effect, srcPixelData, renderWindow, renderScale, srcBounds, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstRowBytes);
+        convertForSrcNComps<SRCPIX, srcMaxValue, 1>(effect, srcPixelData, renderWindow, renderScale, srcBounds, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstRowBytes, lut);
         break;
     case ePixelComponentXY:
-        convertForSrcNComps<SRCPIX, srcMaxValue, 2>(effect, srcPixelData, renderWindow, renderScale, srcBounds, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstRowBytes);
+        convertForSrcNComps<SRCPIX, srcMaxValue, 2>(effect, srcPixelData, renderWindow, renderScale, srcBounds, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstRowBytes, lut);
         break;
     case ePixelComponentRGB:
-        convertForSrcNComps<SRCPIX, srcMaxValue, 3>(effect, srcPixelData, renderWindow, renderScale, srcBounds, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstRowBytes);
+        convertForSrcNComps<SRCPIX, srcMaxValue, 3>(effect, srcPixelData, renderWindow, renderScale, srcBounds, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstRowBytes, lut);
         break;
     case ePixelComponentRGBA:
-        convertForSrcNComps<SRCPIX, srcMaxValue, 4>(effect, srcPixelData, renderWindow, renderScale, srcBounds, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstRowBytes);
+        convertForSrcNComps<SRCPIX, srcMaxValue, 4>(effect, srcPixelData, renderWindow, renderScale, srcBounds, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstRowBytes, lut);
         break;
     default:
         assert(false);
@@ -2772,17 +3862,30 @@ GenericReaderPlugin::convertDepthAndComponents(const void* srcPixelData,
                                                float* dstPixelData,
                                                const OfxRectI& dstBounds,
                                                PixelComponentEnum dstPixelComponents,
-                                               int dstRowBytes)
+                                               int dstRowBytes,
+                                               FusedColorConversion* colorConversion)
 {
+    ProfileScope profiling("convert");
+    const float* lut = NULL;
+#if defined(OFX_IO_USING_OCIO) && (OCIO_VERSION_HEX >= 0x02000000)
+    if ( colorConversion &&
+         (srcPixelComponents == ePixelComponentRGB || srcPixelComponents == ePixelComponentRGBA) &&
+         (dstPixelComponents == ePixelComponentRGB || dstPixelComponents == ePixelComponentRGBA) ) {
+        // render() lets us apply the color conversion
+        lut = colorConversion->getLut(srcBitDepth);
+    }
+#else
+    unused(colorConversion);
+#endif
     switch (srcBitDepth) {
     case eBitDepthFloat:
-        convertForDepth<float, 1>(this, (const float*)srcPixelData, renderWindow, renderScale, srcBounds, srcPixelComponents, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstRowBytes);
+        convertForDepth<float, 1>(this, (const float*)srcPixelData, renderWindow, renderScale, srcBounds, srcPixelComponents, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstRowBytes, NULL);
         break;
     case eBitDepthUShort:
-        convertForDepth<unsigned short, 65535>(this, (const unsigned short*)srcPixelData, renderWindow, renderScale, srcBounds, srcPixelComponents, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstRowBytes);
+        convertForDepth<unsigned short, 65535>(this, (const unsigned short*)srcPixelData, renderWindow, renderScale, srcBounds, srcPixelComponents, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstRowBytes, lut);
         break;
     case eBitDepthUByte:
-        convertForDepth<unsigned char, 255>(this, (const unsigned char*)srcPixelData, renderWindow, renderScale, srcBounds, srcPixelComponents, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstRowBytes);
+        convertForDepth<unsigned char, 255>(this, (const unsigned char*)srcPixelData, renderWindow, renderScale, srcBounds, srcPixelComponents, srcRowBytes, dstPixelData, dstBounds, dstPixelComponents, dstRowBytes, lut);
         break;
     default:
         assert(false);
@@ -3254,6 +4357,52 @@ GenericReaderDescribeInContextBegin(ImageEffectDescriptor& desc,
         }
     }
 
+    /// Read-ahead of the next frames of the sequence
+    {
+        IntParamDescriptor* param = desc.defineIntParam(kParamReadAhead);
+        param->setLabel(kParamReadAheadLabel);
+        param->setHint(kParamReadAheadHint);
+        param->setEvaluateOnChange(false);
+        param->setAnimates(false);
+        param->setDefault(0);
+        param->setRange(0, 64);
+        param->setDisplayRange(0, 16);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+
+    /// Shared decoded-frame cache
+    {
+        BooleanParamDescriptor* param = desc.defineBooleanParam(kParamSharedCache);
+        param->setLabel(kParamSharedCacheLabel);
+        param->setHint(kParamSharedCacheHint);
+        param->setEvaluateOnChange(false);
+        param->setAnimates(false);
+        param->setDefault(false);
+        param->setLayoutHint(eLayoutHintNoNewLine, 1);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+    {
+        PushButtonParamDescriptor* param = desc.definePushButtonParam(kParamSharedCacheInfo);
+        param->setLabel(kParamSharedCacheInfoLabel);
+        param->setHint(kParamSharedCacheInfoHint);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+    {
+        PushButtonParamDescriptor* param = desc.definePushButtonParam(kParamProfileInfo);
+        param->setLabel(kParamProfileInfoLabel);
+        param->setHint(kParamProfileInfoHint);
+        param->setIsSecretAndDisabled(!Profiler::isEnabled());
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+
     // sublabel
     if (gHostIsNatron) {
         StringParamDescriptor* param = desc.defineStringParam(kNatronOfxParamStringSublabelName);
@@ -3302,6 +4451,7 @@ GenericReaderDescribeInContextEnd(ImageEffectDescriptor& desc,
     }
     GenericOCIO::describeInContextOutput(desc, context, page, outputSpaceNameDefault);
     GenericOCIO::describeInContextContext(desc, context, page);
+    GenericOCIO::describeInContextPrecision(desc, context, page);
     {
         PushButtonParamDescriptor* param = desc.definePushButtonParam(kOCIOHelpButton);
         param->setLabel(kOCIOHelpButtonLabel);
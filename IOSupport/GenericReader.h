@@ -25,8 +25,11 @@
 #ifndef Io_GenericReader_h
 #define Io_GenericReader_h
 
+#include "IOProfiler.h"
+#include "IOReadAhead.h"
 #include "IOUtility.h"
 #include <memory>
+#include <vector>
 #include <ofxsImageEffect.h>
 #include <ofxsMacros.h>
 
@@ -40,6 +43,7 @@ NAMESPACE_OFX_IO_ENTER
 #ifdef OFX_IO_USING_OCIO
 class GenericOCIO;
 #endif
+class FusedColorConversion;
 
 /**
  * @brief A generic reader plugin, derive this to create a new reader for a specific file format.
@@ -167,6 +171,23 @@ protected:
         std::string rawComps;
     };
 
+    // a plane to be decoded by decodePlanes(): all the planes of a render are decoded in a single call
+    struct PlaneToDecode {
+        float* pixelData;
+        OfxRectI renderWindow;
+        OfxRectI bounds;
+        int rowBytes;
+        int numChans;
+        OFX::PixelComponentEnum comps;
+        OFX::PixelComponentEnum remappedComps;
+        std::string rawComps;
+        FusedColorConversion* colorConversion; // see decode()
+    };
+
+    /**
+     * @brief Convert the decoded data to float. If colorConversion is the one passed to decode(), the OCIO
+     * color conversion may also be applied, in which case render() does not apply it.
+     **/
     void convertDepthAndComponents(const void* srcPixelData,
                                    const OfxRectI& renderWindow,
                                    const OfxPointD& renderScale,
@@ -177,7 +198,8 @@ protected:
                                    float* dstPixelData,
                                    const OfxRectI& dstBounds,
                                    OFX::PixelComponentEnum dstPixelComponents,
-                                   int dstRowBytes);
+                                   int dstRowBytes,
+                                   FusedColorConversion* colorConversion);
 
 private:
     /**
@@ -211,6 +233,20 @@ private:
      **/
     virtual void clearAnyCache() { }
 
+    /**
+     * @brief Override to return statistics about any cache you may have, which are displayed with
+     * the statistics of the shared caches (see the "Cache Info..." button).
+     **/
+    virtual std::string getCacheStatistics() { return std::string(); }
+
+    /**
+     * @brief Override to append to key the value of any format-specific parameter that changes
+     * the decoded image (e.g. raw development settings), so that frames are not wrongly shared
+     * through the decoded-frame cache (see kParamSharedCache).
+     **/
+    virtual void getDecodeCacheKey(double /*time*/,
+                                   std::string* /*key*/) const { }
+
     /**
      * @brief Overload this function to extract the bound of the pixel data
      * in pixel coordinates and the pixel aspect ratio out of the header
@@ -233,6 +269,20 @@ private:
      */
     virtual bool isTileOrientationTopDown() const { return true; }
 
+    /**
+     * @brief Override if the reader can decode the image directly at a reduced resolution, e.g. from a
+     * mipmap level stored in the file, which is much faster than decoding at full resolution and downscaling.
+     * levels is the number of times the image has to be halved. Returns the number of levels (at most levels)
+     * that decode() and decodePlane() can read directly. They are then called with a renderScale of 1/2^n,
+     * and the renderWindow and bounds are in the pixel coordinates of that level, i.e. the full-resolution
+     * coordinates divided by 2^n and rounded to the enclosing rectangle (see downscalePowerOfTwoSmallestEnclosing()).
+     * The remaining levels are computed by the GenericReader using a box filter.
+     **/
+    virtual unsigned int getNativeDecodeLevels(const std::string& /*filename*/,
+                                               OfxTime /*time*/,
+                                               int /*view*/,
+                                               unsigned int /*levels*/) { return 0; }
+
     virtual bool getFrameRate(const std::string& /*filename*/,
                               double* /*fps*/) const { return false; }
 
@@ -244,12 +294,21 @@ private:
      * You can always skip the color-space conversion, but for all linear hosts it would produce either
      * false colors or sub-par performances in the case the end-user has to append a color-space conversion
      * effect her/himself.
+     * colorConversion is NULL, or the OCIO color conversion that the reader may apply by passing it to
+     * convertDepthAndComponents().
      **/
-    virtual void decode(const std::string& filename, OfxTime time, int view, bool isPlayback, const OfxRectI& renderWindow, const OfxPointD& renderScale, float* pixelData, const OfxRectI& bounds, OFX::PixelComponentEnum pixelComponents, int pixelComponentCount, int rowBytes);
+    virtual void decode(const std::string& filename, OfxTime time, int view, bool isPlayback, const OfxRectI& renderWindow, const OfxPointD& renderScale, float* pixelData, const OfxRectI& bounds, OFX::PixelComponentEnum pixelComponents, int pixelComponentCount, int rowBytes, FusedColorConversion* colorConversion);
     virtual void decodePlane(const std::string& filename, OfxTime time, int view, bool isPlayback, const OfxRectI& renderWindow, const OfxPointD& renderScale, float* pixelData, const OfxRectI& bounds,
                              OFX::PixelComponentEnum pixelComponents, OFX::PixelComponentEnum remappedComponents,
                              int pixelComponentCount, const std::string& rawComponents, int rowBytes);
 
+    /**
+     * @brief Decode all the planes requested by a render of a multi-planar reader.
+     * The default implementation calls decodePlane() for each plane. Override it if the file format
+     * can decode several planes in a single pass over the file.
+     **/
+    virtual void decodePlanes(const std::string& filename, OfxTime time, int view, bool isPlayback, const OfxPointD& renderScale, const std::vector<PlaneToDecode>& planes);
+
     /**
      * @brief Override to indicate the time domain. Return false if you know that the
      * file isn't a video-stream, true when you can find-out the frame range.
@@ -380,6 +439,8 @@ private:
 
     void refreshSubLabel(OfxTime time);
 
+    void prefetchNextFrames(double time, bool isPlayback, int frames, const std::string& filename);
+
     bool checkExtension(const std::string& ext);
 
 protected:
@@ -387,6 +448,7 @@ protected:
     OFX::BooleanParam* _inputSpaceSet;
     auto_ptr<GenericOCIO> _ocio;
 #endif
+    auto_ptr<Profiler> _profiler; //!< timings and counters of this instance, NULL unless profiling is enabled
 
     OFX::Clip* _syncClip; //< Mantated input clip
     OFX::Clip* _outputClip; //< Mandated output clip
@@ -424,6 +486,9 @@ private:
 
     OFX::StringParam* _sublabel;
     OFX::BooleanParam* _guessedParams; //!< was guessParamsFromFilename already successfully called once on this instance
+    OFX::BooleanParam* _sharedCache; //!< store and fetch decoded frames in the process-wide decoded-frame cache
+    OFX::IntParam* _readAheadFrames; //!< number of frames prefetched ahead of the rendered frame
+    auto_ptr<ReadAhead> _readAhead;
 
     const std::vector<std::string>& _extensions;
 
@@ -26,9 +26,14 @@
 
 #include <algorithm>
 #include <cfloat> // DBL_MAX
+#include <cstdlib> // posix_memalign, free
 #include <cstring> // memset
+#if defined(_WIN32) || defined(__WIN32__) || defined(WIN32)
+#include <malloc.h> // _aligned_malloc
+#endif
 #include <locale>
 #include <sstream>
+#include <stdexcept>
 
 #include "ofxsCoords.h"
 #include "ofxsCopier.h"
@@ -46,6 +51,7 @@
 #ifdef OFX_IO_USING_OCIO
 #include "GenericOCIO.h"
 #endif
+#include "IOMemoryGovernor.h"
 
 #ifdef OFX_IO_USING_OCIO
 namespace OCIO = OCIO_NAMESPACE;
@@ -134,6 +140,24 @@ enum FormatTypeEnum {
 #define kParamClipInfoLabel "Clip Info..."
 #define kParamClipInfoHint "Display information about the inputs"
 
+#define kParamProfileInfo "profileInfo"
+#define kParamProfileInfoLabel "Profile Info..."
+#define kParamProfileInfoHint "Display the time spent in each stage of the render (fetching the input, color conversion, premultiplication, encoding...) " \
+    "and the counters of this writer. Only available if the OFX_IO_PROFILE environment variable is set, " \
+    "see also OFX_IO_PROFILE_TRACE to write a Chrome trace file."
+
+#define kParamWriteBehind "writeBehind"
+#define kParamWriteBehindLabel "Write Behind"
+#define kParamWriteBehindHint "Maximum number of frames of the image sequence that are encoded and written in background threads, " \
+    "while the host renders the next frames. 0 writes each frame before the render returns. " \
+    "Write errors are reported when rendering a later frame, or at the end of the sequence render. " \
+    "Frames are only written in the background during a sequence render, and if a single view and layer is written."
+
+#define kWriteBehindMaxThreads 4 // max number of writer threads per instance
+
+#define kScratchBufferAlignment 64 // cache line size, and enough for AVX-512
+#define kScratchBufferPoolMaxFree 8 // max number of unused scratch buffers kept by each instance
+
 #define kParamOutputSpaceLabel "File Colorspace"
 
 #define kParamClipToRoD "clipToRoD"
@@ -159,6 +183,8 @@ static bool gHostIsNatron = false;
 static bool gHostIsNatronVersion3OrGreater = false;
 static bool gHostIsMultiPlanar = false;
 static bool gHostIsMultiView = false;
+static int gWriterInstanceCount = 0; // used to name the profilers
+static thread_local bool gIsWriteBehindThread = false; // true in the writer threads, see throwEncodeError()
 
 template <typename T>
 static inline void
@@ -194,12 +220,23 @@ GenericWriterPlugin::GenericWriterPlugin(OfxImageEffectHandle handle,
     , _outputSpaceSet(NULL)
     , _ocio(new GenericOCIO(this))
 #endif
+    , _profiler(Profiler::isEnabled() ? new Profiler("Writer " + std::to_string(++gWriterInstanceCount)) : NULL)
     , _extensions(extensions)
     , _supportsRGBA(supportsRGBA)
     , _supportsRGB(supportsRGB)
     , _supportsXY(supportsXY)
     , _supportsAlpha(supportsAlpha)
     , _outputComponentsTable()
+    , _scratchBuffers()
+    , _writeBehind(NULL)
+    , _writeBehindThreads()
+    , _writeBehindMutex()
+    , _writeBehindCond()
+    , _writeBehindQueue()
+    , _writeBehindBusy()
+    , _writeBehindError()
+    , _writeBehindQuit(false)
+    , _sequenceRenders(0)
 {
     _inputClip = fetchClip(kOfxImageEffectSimpleSourceClipName);
     _outputClip = fetchClip(kOfxImageEffectOutputClipName);
@@ -221,6 +258,9 @@ GenericWriterPlugin::GenericWriterPlugin(OfxImageEffectHandle handle,
     if (paramExists(kParamClipToRoD)) {
         _clipToRoD = fetchBooleanParam(kParamClipToRoD);
     }
+    if (paramExists(kParamWriteBehind)) {
+        _writeBehind = fetchIntParam(kParamWriteBehind);
+    }
 
     if (gHostIsNatron) {
         _sublabel = fetchStringParam(kNatronOfxParamStringSublabelName);
@@ -277,6 +317,7 @@ GenericWriterPlugin::GenericWriterPlugin(OfxImageEffectHandle handle,
 
 GenericWriterPlugin::~GenericWriterPlugin()
 {
+    stopWriteBehind();
 }
 
 /**
@@ -325,7 +366,138 @@ GenericWriterPlugin::isIdentity(const IsIdentityArguments& args,
     return false;
 }
 
-GenericWriterPlugin::InputImagesHolder::InputImagesHolder()
+static void*
+alignedMalloc(size_t size)
+{
+#if defined(_WIN32) || defined(__WIN32__) || defined(WIN32)
+    return _aligned_malloc(size, kScratchBufferAlignment);
+#else
+    void* data = NULL;
+    if (posix_memalign(&data, kScratchBufferAlignment, size) != 0) {
+        return NULL;
+    }
+
+    return data;
+#endif
+}
+
+static void
+alignedFree(void* data)
+{
+#if defined(_WIN32) || defined(__WIN32__) || defined(WIN32)
+    _aligned_free(data);
+#else
+    std::free(data);
+#endif
+}
+
+GenericWriterPlugin::ScratchBufferPool::ScratchBufferPool()
+    : _mutex()
+    , _buffers()
+{
+}
+
+GenericWriterPlugin::ScratchBufferPool::~ScratchBufferPool()
+{
+    for (std::list<Buffer>::iterator it = _buffers.begin(); it != _buffers.end(); ++it) {
+        assert(!it->inUse);
+        alignedFree(it->data);
+    }
+}
+
+void*
+GenericWriterPlugin::ScratchBufferPool::acquire(size_t size)
+{
+    {
+        tthread::lock_guard<tthread::mutex> guard(_mutex);
+        // take the smallest unused buffer that is large enough, but not one that would waste more than half of its size
+        std::list<Buffer>::iterator best = _buffers.end();
+        for (std::list<Buffer>::iterator it = _buffers.begin(); it != _buffers.end(); ++it) {
+            if (!it->inUse && (it->size >= size) && (it->size / 2 <= size) && ((best == _buffers.end()) || (it->size < best->size))) {
+                best = it;
+            }
+        }
+        if (best != _buffers.end()) {
+            best->inUse = true;
+            profileCount("scratchBufferReuses");
+
+            return best->data;
+        }
+    }
+
+    // allocate outside of the lock: the system may take a while to map large buffers
+    Buffer buffer;
+    buffer.data = alignedMalloc(size ? size : 1);
+    buffer.size = size;
+    buffer.inUse = true;
+    if (!buffer.data) {
+        // free the unused buffers and try again
+        clear();
+        buffer.data = alignedMalloc(size ? size : 1);
+        if (!buffer.data) {
+            return NULL;
+        }
+    }
+    profileCount("scratchBufferAllocations");
+    tthread::lock_guard<tthread::mutex> guard(_mutex);
+    _buffers.push_front(buffer);
+
+    return buffer.data;
+}
+
+void
+GenericWriterPlugin::ScratchBufferPool::release(void* data)
+{
+    std::list<void*> toFree;
+    {
+        tthread::lock_guard<tthread::mutex> guard(_mutex);
+        int nFree = 0;
+        for (std::list<Buffer>::iterator it = _buffers.begin(); it != _buffers.end(); ++it) {
+            if (it->data == data) {
+                it->inUse = false;
+                _buffers.splice(_buffers.begin(), _buffers, it);
+                break;
+            }
+        }
+        // forget the least recently used buffers beyond kScratchBufferPoolMaxFree
+        for (std::list<Buffer>::iterator it = _buffers.begin(); it != _buffers.end();) {
+            if (!it->inUse && (++nFree > kScratchBufferPoolMaxFree)) {
+                toFree.push_back(it->data);
+                it = _buffers.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    for (std::list<void*>::iterator it = toFree.begin(); it != toFree.end(); ++it) {
+        alignedFree(*it);
+    }
+}
+
+void
+GenericWriterPlugin::ScratchBufferPool::clear()
+{
+    std::list<void*> toFree;
+    {
+        tthread::lock_guard<tthread::mutex> guard(_mutex);
+        for (std::list<Buffer>::iterator it = _buffers.begin(); it != _buffers.end();) {
+            if (!it->inUse) {
+                toFree.push_back(it->data);
+                it = _buffers.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    for (std::list<void*>::iterator it = toFree.begin(); it != toFree.end(); ++it) {
+        alignedFree(*it);
+    }
+}
+
+GenericWriterPlugin::InputImagesHolder::InputImagesHolder(ScratchBufferPool& pool)
+    : _imgs()
+    , _scratch()
+    , _pool(pool)
 {
 }
 
@@ -335,10 +507,16 @@ GenericWriterPlugin::InputImagesHolder::addImage(const Image* img)
     _imgs.push_back(img);
 }
 
-void
-GenericWriterPlugin::InputImagesHolder::addMemory(ImageMemory* mem)
+float*
+GenericWriterPlugin::InputImagesHolder::allocate(size_t size)
 {
-    _mems.push_back(mem);
+    void* data = _pool.acquire(size);
+
+    if (data) {
+        _scratch.push_back(data);
+    }
+
+    return (float*)data;
 }
 
 GenericWriterPlugin::InputImagesHolder::~InputImagesHolder()
@@ -346,8 +524,8 @@ GenericWriterPlugin::InputImagesHolder::~InputImagesHolder()
     for (std::list<const Image*>::iterator it = _imgs.begin(); it != _imgs.end(); ++it) {
         delete *it;
     }
-    for (std::list<ImageMemory*>::iterator it = _mems.begin(); it != _mems.end(); ++it) {
-        delete *it;
+    for (std::list<void*>::iterator it = _scratch.begin(); it != _scratch.end(); ++it) {
+        _pool.release(*it);
     }
 }
 
@@ -401,15 +579,15 @@ GenericWriterPlugin::fetchPlaneConvertAndCopy(const string& plane,
                                               const bool alphaOK,
                                               InputImagesHolder* srcImgsHolder, // must be deleted by caller
                                               OfxRectI* bounds,
-                                              ImageMemory** tmpMem, // owned by srcImgsHolder
                                               const Image** inputImage, // owned by srcImgsHolder
                                               float** tmpMemPtr, // owned by srcImgsHolder
                                               int* rowBytes,
                                               PixelComponentEnum* mappedComponents,
                                               int* mappedComponentsCount)
 {
+    ProfileScope profiling("prepare");
+
     *inputImage = 0;
-    *tmpMem = 0;
     *tmpMemPtr = 0;
     *mappedComponentsCount = 0;
 
@@ -420,7 +598,11 @@ GenericWriterPlugin::fetchPlaneConvertAndCopy(const string& plane,
     OfxRectD inputBounds;
     double inputPar = _inputClip->getPixelAspectRatio();
     Coords::toCanonical(renderWindow, renderScale, inputPar, &inputBounds);
-    const Image* srcImg = _inputClip->fetchImagePlane(time, view, plane.c_str(), inputBounds);
+    const Image* srcImg;
+    {
+        ProfileScope profiling("fetch");
+        srcImg = _inputClip->fetchImagePlane(time, view, plane.c_str(), inputBounds);
+    }
     *inputImage = srcImg;
     if (!srcImg) {
         if (failIfNoSrcImg) {
@@ -475,13 +657,14 @@ GenericWriterPlugin::fetchPlaneConvertAndCopy(const string& plane,
     assert(srcMappedComponentsCount != 0 && srcMappedComponents != ePixelComponentNone);
 
     bool renderWindowIsBounds = renderWindow.x1 == bounds->x1 && renderWindow.y1 == bounds->y1 && renderWindow.x2 == bounds->x2 && renderWindow.y2 == bounds->y2;
+    bool renderWindowInBounds = renderWindow.x1 >= bounds->x1 && renderWindow.y1 >= bounds->y1 && renderWindow.x2 <= bounds->x2 && renderWindow.y2 <= bounds->y2;
 
-    if (renderWindowIsBounds && isOCIOIdentity && (noPremult || (userPremult == pluginExpectedPremult))) {
-        // Render window is of the same size as the input image and we don't need to apply colorspace conversion
-        // or premultiplication operations.
+    if (renderWindowInBounds && isOCIOIdentity && (noPremult || (userPremult == pluginExpectedPremult))) {
+        // Render window is inside the input image and we don't need to apply colorspace conversion
+        // or premultiplication operations: the encoder reads the host image directly (zero-copy).
 
-        *tmpMemPtr = (float*)srcPixelData;
         *rowBytes = srcRowBytes;
+        profileCount("zeroCopyFrames");
 
         // copy to dstImg if necessary
         if ((renderRequestedView == view) && _outputClip && _outputClip->isConnected()) {
@@ -513,13 +696,18 @@ GenericWriterPlugin::fetchPlaneConvertAndCopy(const string& plane,
             // copy the source image (the writer is a no-op)
             copyPixelData(renderWindow, renderScale,
                           srcPixelData,
-                          renderWindow,
+                          *bounds,
                           pixelComponents /* could also be srcMappedComponents */,
                           srcMappedComponentsCount,
                           bitDepth,
                           srcRowBytes,
                           dstImg.get());
         }
+
+        // point to the render window in the source image
+        *tmpMemPtr = (float*)((char*)srcPixelData + (ptrdiff_t)(renderWindow.y1 - bounds->y1) * srcRowBytes
+                              + (ptrdiff_t)(renderWindow.x1 - bounds->x1) * srcMappedComponentsCount * getComponentBytes(bitDepth));
+        *bounds = renderWindow;
     } else {
         // generic case: some conversions are needed.
 
@@ -528,9 +716,7 @@ GenericWriterPlugin::fetchPlaneConvertAndCopy(const string& plane,
         int tmpRowBytes = (renderWindow.x2 - renderWindow.x1) * pixelBytes;
         *rowBytes = tmpRowBytes;
         size_t memSize = (size_t)(renderWindow.y2 - renderWindow.y1) * (size_t)tmpRowBytes;
-        *tmpMem = new ImageMemory(memSize, this);
-        srcImgsHolder->addMemory(*tmpMem);
-        *tmpMemPtr = (float*)(*tmpMem)->lock();
+        *tmpMemPtr = srcImgsHolder->allocate(memSize);
         if (!*tmpMemPtr) {
             throwSuiteStatusException(kOfxStatErrMemory);
 
@@ -702,15 +888,13 @@ GenericWriterPlugin::fetchPlaneConvertAndCopy(const string& plane,
             }
         }
         *bounds = renderWindow;
-    } // if (renderWindowIsBounds && isOCIOIdentity && (noPremult || userPremult == pluginExpectedPremult))
+    } // if (renderWindowInBounds && isOCIOIdentity && (noPremult || userPremult == pluginExpectedPremult))
 
     if (doAnyPacking && (!packingContiguous || ((int)packingMapping.size() != srcMappedComponentsCount))) {
         int pixelBytes = packingMapping.size() * getComponentBytes(bitDepth);
         int tmpRowBytes = (renderWindow.x2 - renderWindow.x1) * pixelBytes;
         size_t memSize = (size_t)(renderWindow.y2 - renderWindow.y1) * (size_t)tmpRowBytes;
-        ImageMemory* packingBufferMem = new ImageMemory(memSize, this);
-        srcImgsHolder->addMemory(packingBufferMem);
-        float* packingBufferData = (float*)packingBufferMem->lock();
+        float* packingBufferData = srcImgsHolder->allocate(memSize);
         if (!packingBufferData) {
             throwSuiteStatusException(kOfxStatErrMemory);
 
@@ -790,6 +974,11 @@ GenericWriterPlugin::render(const RenderArguments& args)
         return;
     }
 
+    ProfilerRenderScope renderProfiling(_profiler.get());
+
+    // report the errors of the frames written in the background
+    reportWriteBehindError();
+
     if (!_inputClip) {
         throwSuiteStatusException(kOfxStatFailed);
 
@@ -995,17 +1184,25 @@ GenericWriterPlugin::render(const RenderArguments& args)
     if ((viewNames.size() == 1) && (args.planes.size() == 1)) {
         // Regular case, just do a simple part
         int viewIndex = viewNames.begin()->first;
-        InputImagesHolder dataHolder; // owns srcImg and tmpMem
+        InputImagesHolder dataHolder(_scratchBuffers); // owns srcImg and the scratch buffers
         const Image* srcImg; // owned by dataHolder, no need to delete
-        ImageMemory* tmpMem; // owned by dataHolder, no need to delete
         ImageData data;
         // NOTE: failIfNoSrcImg=true causes the writer to fail if the src RoD is empty, see https://github.com/MrKepzie/Natron/issues/1617
-        fetchPlaneConvertAndCopy(args.planes.front(), /*failIfNoSrcImg=*/false, viewIndex, args.renderView, time, args.renderWindow, args.renderScale, args.fieldToRender, pluginExpectedPremult, userPremult, isOCIOIdentity, doAnyPacking, packingContiguous, packingMapping, alphaOK, &dataHolder, &data.bounds, &tmpMem, &srcImg, &data.srcPixelData, &data.rowBytes, &data.pixelComponents, &data.pixelComponentsCount);
+        fetchPlaneConvertAndCopy(args.planes.front(), /*failIfNoSrcImg=*/false, viewIndex, args.renderView, time, args.renderWindow, args.renderScale, args.fieldToRender, pluginExpectedPremult, userPremult, isOCIOIdentity, doAnyPacking, packingContiguous, packingMapping, alphaOK, &dataHolder, &data.bounds, &srcImg, &data.srcPixelData, &data.rowBytes, &data.pixelComponents, &data.pixelComponentsCount);
 
         int dstNComps = doAnyPacking ? packingMapping.size() : data.pixelComponentsCount;
         int dstNCompsStartIndex = doAnyPacking ? packingMapping[0] : 0;
 
-        encode(filename, time, viewNames[0], data.srcPixelData, args.renderWindow, pixelAspectRatio, data.pixelComponentsCount, dstNCompsStartIndex, dstNComps, data.rowBytes);
+        // the parameters of the encoder are read here, in the render thread, even if the frame is written behind
+        EncodeLocalData_RAII encodeData(this, time);
+        if (queueWriteBehind(encodeData.getData(), filename, time, viewNames[0], data.srcPixelData, args.renderWindow, pixelAspectRatio, data.pixelComponentsCount, dstNCompsStartIndex, dstNComps, data.rowBytes)) {
+            // the job owns the data
+            encodeData.release();
+        } else {
+            ProfileScope profiling("encode");
+            profileCount("encodedBytes", (double)(args.renderWindow.y2 - args.renderWindow.y1) * data.rowBytes);
+            encode(encodeData.getData(), filename, time, viewNames[0], data.srcPixelData, args.renderWindow, pixelAspectRatio, data.pixelComponentsCount, dstNCompsStartIndex, dstNComps, data.rowBytes);
+        }
     } else {
         /*
            Use the beginEncodeParts/encodePart/endEncodeParts API when there are multiple views/planes to render
@@ -1027,7 +1224,7 @@ GenericWriterPlugin::render(const RenderArguments& args)
                We have to aggregate all views/layers into a single buffer and write it all at once.
              */
             int nChannels = 0;
-            InputImagesHolder dataHolder; // owns all tmpMem and srcImg
+            InputImagesHolder dataHolder(_scratchBuffers); // owns all srcImg and scratch buffers
             std::list<ImageData> planesData;
 
             // The list of actual planes that could be fetched
@@ -1043,10 +1240,9 @@ GenericWriterPlugin::render(const RenderArguments& args)
                 }
 
                 for (std::list<string>::const_iterator plane = planesToFetch->begin(); plane != planesToFetch->end(); ++plane) {
-                    ImageMemory* tmpMem; // owned by dataHolder, no need to delete
                     const Image* srcImg; // owned by dataHolder, no need to delete
                     ImageData data;
-                    fetchPlaneConvertAndCopy(*plane, /*failIfNoSrcImg=*/false, view->first, args.renderView, time, args.renderWindow, args.renderScale, args.fieldToRender, pluginExpectedPremult, userPremult, isOCIOIdentity, doAnyPacking, packingContiguous, packingMapping, alphaOK, &dataHolder, &data.bounds, &tmpMem, &srcImg, &data.srcPixelData, &data.rowBytes, &data.pixelComponents, &data.pixelComponentsCount);
+                    fetchPlaneConvertAndCopy(*plane, /*failIfNoSrcImg=*/false, view->first, args.renderView, time, args.renderWindow, args.renderScale, args.fieldToRender, pluginExpectedPremult, userPremult, isOCIOIdentity, doAnyPacking, packingContiguous, packingMapping, alphaOK, &dataHolder, &data.bounds, &srcImg, &data.srcPixelData, &data.rowBytes, &data.pixelComponents, &data.pixelComponentsCount);
                     if (!data.srcPixelData) {
                         continue;
                     }
@@ -1071,8 +1267,7 @@ GenericWriterPlugin::render(const RenderArguments& args)
             int pixelBytes = nChannels * getComponentBytes(eBitDepthFloat);
             int tmpRowBytes = (args.renderWindow.x2 - args.renderWindow.x1) * pixelBytes;
             size_t memSize = (size_t)(args.renderWindow.y2 - args.renderWindow.y1) * (size_t)tmpRowBytes;
-            ImageMemory interleavedMem(memSize, this);
-            float* tmpMemPtr = (float*)interleavedMem.lock();
+            float* tmpMemPtr = dataHolder.allocate(memSize);
             if (!tmpMemPtr) {
                 throwSuiteStatusException(kOfxStatErrMemory);
 
@@ -1112,7 +1307,10 @@ GenericWriterPlugin::render(const RenderArguments& args)
             }
 
             beginEncodeParts(encodeData.getData(), filename, time, pixelAspectRatio, partsSplit, viewNames, actualPlanes, doAnyPacking && !packingContiguous, packingMapping, args.renderWindow);
-            encodePart(encodeData.getData(), filename, tmpMemPtr, nChannels, 0, tmpRowBytes);
+            {
+                ProfileScope profiling("encode");
+                encodePart(encodeData.getData(), filename, tmpMemPtr, nChannels, 0, tmpRowBytes);
+            }
 
             break;
         }
@@ -1134,14 +1332,13 @@ GenericWriterPlugin::render(const RenderArguments& args)
                 }
 
                 int nChannels = 0;
-                InputImagesHolder dataHolder; // owns all tmpMem and srcImg
+                InputImagesHolder dataHolder(_scratchBuffers); // owns all srcImg and scratch buffers
 
                 std::list<ImageData> planesData;
                 for (std::list<string>::const_iterator plane = planesToFetch->begin(); plane != planesToFetch->end(); ++plane) {
-                    ImageMemory* tmpMem; // owned by dataHolder, no need to delete
                     const Image* srcImg; // owned by dataHolder, no need to delete
                     ImageData data;
-                    fetchPlaneConvertAndCopy(*plane, /*failIfNoSrcImg=*/false, view->first, args.renderView, time, args.renderWindow, args.renderScale, args.fieldToRender, pluginExpectedPremult, userPremult, isOCIOIdentity, doAnyPacking, packingContiguous, packingMapping, alphaOK, &dataHolder, &data.bounds, &tmpMem, &srcImg, &data.srcPixelData, &data.rowBytes, &data.pixelComponents, &data.pixelComponentsCount);
+                    fetchPlaneConvertAndCopy(*plane, /*failIfNoSrcImg=*/false, view->first, args.renderView, time, args.renderWindow, args.renderScale, args.fieldToRender, pluginExpectedPremult, userPremult, isOCIOIdentity, doAnyPacking, packingContiguous, packingMapping, alphaOK, &dataHolder, &data.bounds, &srcImg, &data.srcPixelData, &data.rowBytes, &data.pixelComponents, &data.pixelComponentsCount);
                     if (!data.srcPixelData) {
                         continue;
                     }
@@ -1166,8 +1363,7 @@ GenericWriterPlugin::render(const RenderArguments& args)
                 int pixelBytes = nChannels * getComponentBytes(eBitDepthFloat);
                 int tmpRowBytes = (args.renderWindow.x2 - args.renderWindow.x1) * pixelBytes;
                 size_t memSize = (size_t)(args.renderWindow.y2 - args.renderWindow.y1) * (size_t)tmpRowBytes;
-                ImageMemory interleavedMem(memSize, this);
-                float* tmpMemPtr = (float*)interleavedMem.lock();
+                float* tmpMemPtr = dataHolder.allocate(memSize);
                 if (!tmpMemPtr) {
                     throwSuiteStatusException(kOfxStatErrMemory);
 
@@ -1210,7 +1406,10 @@ GenericWriterPlugin::render(const RenderArguments& args)
                     beginEncodeParts(encodeData.getData(), filename, time, pixelAspectRatio, partsSplit, viewNames, actualPlanes, doAnyPacking && !packingContiguous, packingMapping, args.renderWindow);
                 }
 
-                encodePart(encodeData.getData(), filename, tmpMemPtr, nChannels, partIndex, tmpRowBytes);
+                {
+                    ProfileScope profiling("encode");
+                    encodePart(encodeData.getData(), filename, tmpMemPtr, nChannels, partIndex, tmpRowBytes);
+                }
 
                 ++partIndex;
             } // for each view
@@ -1226,7 +1425,7 @@ GenericWriterPlugin::render(const RenderArguments& args)
 
             int partIndex = 0;
             for (map<int, string>::const_iterator view = viewNames.begin(); view != viewNames.end(); ++view) {
-                InputImagesHolder dataHolder; // owns all tmpMem and srcImg
+                InputImagesHolder dataHolder(_scratchBuffers); // owns all srcImg and scratch buffers
                 vector<ImageData> datas;
 
                 // The first view determines the planes that could be fetched. Other views just attempt to fetch the exact same planes.
@@ -1238,10 +1437,9 @@ GenericWriterPlugin::render(const RenderArguments& args)
                 }
 
                 for (std::list<string>::const_iterator plane = planesToFetch->begin(); plane != planesToFetch->end(); ++plane) {
-                    ImageMemory* tmpMem; // owned by dataHolder, no need to delete
                     const Image* srcImg; // owned by dataHolder, no need to delete
                     ImageData data;
-                    fetchPlaneConvertAndCopy(*plane, /*failIfNoSrcImg=*/false, view->first, args.renderView, time, args.renderWindow, args.renderScale, args.fieldToRender, pluginExpectedPremult, userPremult, isOCIOIdentity, doAnyPacking, packingContiguous, packingMapping, alphaOK, &dataHolder, &data.bounds, &tmpMem, &srcImg, &data.srcPixelData, &data.rowBytes, &data.pixelComponents, &data.pixelComponentsCount);
+                    fetchPlaneConvertAndCopy(*plane, /*failIfNoSrcImg=*/false, view->first, args.renderView, time, args.renderWindow, args.renderScale, args.fieldToRender, pluginExpectedPremult, userPremult, isOCIOIdentity, doAnyPacking, packingContiguous, packingMapping, alphaOK, &dataHolder, &data.bounds, &srcImg, &data.srcPixelData, &data.rowBytes, &data.pixelComponents, &data.pixelComponentsCount);
                     if (!data.srcPixelData) {
                         continue;
                     }
@@ -1255,7 +1453,10 @@ GenericWriterPlugin::render(const RenderArguments& args)
                     beginEncodeParts(encodeData.getData(), filename, time, pixelAspectRatio, partsSplit, viewNames, actualPlanes, doAnyPacking && !packingContiguous, packingMapping, args.renderWindow);
                 }
                 for (vector<ImageData>::iterator it = datas.begin(); it != datas.end(); ++it) {
-                    encodePart(encodeData.getData(), filename, it->srcPixelData, it->pixelComponentsCount, partIndex, it->rowBytes);
+                    {
+                        ProfileScope profiling("encode");
+                        encodePart(encodeData.getData(), filename, it->srcPixelData, it->pixelComponentsCount, partIndex, it->rowBytes);
+                    }
                     ++partIndex;
                 }
             } // for each view
@@ -1265,6 +1466,7 @@ GenericWriterPlugin::render(const RenderArguments& args)
         } // switch
         ;
 
+        ProfileScope profiling("encode");
         endEncodeParts(encodeData.getData());
     }
 
@@ -1568,6 +1770,8 @@ GenericWriterPlugin::interleavePixelBuffers(const OfxRectI& renderWindow,
                                             const int dstRowBytes,
                                             void* dstPixelData)
 {
+    ProfileScope profiling("interleave");
+
     assert((dstPixelComponentStartIndex + desiredSrcNComps) <= dstPixelComponentCount);
     assert(renderWindow.x1 >= bounds.x1 && renderWindow.x2 <= bounds.x2 && renderWindow.y1 >= bounds.y1 && renderWindow.y2 <= bounds.y2);
     assert(renderWindow.x1 >= dstBounds.x1 && renderWindow.x2 <= dstBounds.x2 && renderWindow.y1 >= dstBounds.y1 && renderWindow.y2 <= dstBounds.y2);
@@ -1617,6 +1821,13 @@ GenericWriterPlugin::beginSequenceRender(const BeginSequenceRenderArguments& arg
     Coords::toPixelEnclosing(rod, args.renderScale, par, &rodPixel);
 
     beginEncode(filename, rodPixel, par, args);
+
+    tthread::lock_guard<tthread::mutex> guard(_writeBehindMutex);
+    if (_sequenceRenders == 0) {
+        // errors of a previous sequence render were already reported
+        _writeBehindError.clear();
+    }
+    ++_sequenceRenders;
 }
 
 void
@@ -1628,7 +1839,228 @@ GenericWriterPlugin::endSequenceRender(const EndSequenceRenderArguments& args)
         return;
     }
 
+    waitForWriteBehind();
+    bool lastSequenceRender;
+    {
+        tthread::lock_guard<tthread::mutex> guard(_writeBehindMutex);
+        if (_sequenceRenders > 0) {
+            --_sequenceRenders;
+        }
+        lastSequenceRender = (_sequenceRenders == 0);
+    }
+    if (lastSequenceRender) {
+        // the scratch buffers are only kept while rendering a sequence
+        _scratchBuffers.clear();
+    }
     endEncode(args);
+    reportWriteBehindError();
+}
+
+void
+GenericWriterPlugin::throwEncodeError(const string& message,
+                                      OfxStatus status)
+{
+    if (gIsWriteBehindThread) {
+        // caught by writeBehindLoop()
+        throw std::runtime_error(message);
+    }
+    setPersistentMessage(Message::eMessageError, "", message);
+    throwSuiteStatusException(status);
+}
+
+// Queue a copy of the frame, to be encoded by a writer thread (see kParamWriteBehind).
+// Returns false if write-behind is not enabled, in which case the caller must encode the frame.
+bool
+GenericWriterPlugin::queueWriteBehind(void* userData,
+                                      const string& filename,
+                                      OfxTime time,
+                                      const string& viewName,
+                                      const float* pixelData,
+                                      const OfxRectI& bounds,
+                                      float pixelAspectRatio,
+                                      int pixelDataNComps,
+                                      int dstNCompsStartIndex,
+                                      int dstNComps,
+                                      int rowBytes)
+{
+    const int maxFrames = _writeBehind ? _writeBehind->getValueAtTime(time) : 0;
+
+    if (maxFrames <= 0) {
+        return false;
+    }
+    {
+        tthread::lock_guard<tthread::mutex> guard(_writeBehindMutex);
+        if (_sequenceRenders <= 0) {
+            // single frame renders are written synchronously, since endSequenceRender() is where the queue is waited for
+            return false;
+        }
+    }
+
+    // the input image is released when render() returns: copy the frame, with packed rows, to a scratch buffer
+    const size_t rowElements = (size_t)(bounds.x2 - bounds.x1) * pixelDataNComps;
+    float* copy = (float*)_scratchBuffers.acquire(rowElements * (bounds.y2 - bounds.y1) * sizeof(float));
+    if (!copy) {
+        // out of memory: encode the frame synchronously
+        return false;
+    }
+    WriteBehindJob job;
+    job.filename = filename;
+    job.time = time;
+    job.viewName = viewName;
+    job.userData = userData;
+    job.pixelData = copy;
+    job.bounds = bounds;
+    job.pixelAspectRatio = pixelAspectRatio;
+    job.pixelDataNComps = pixelDataNComps;
+    job.dstNCompsStartIndex = dstNCompsStartIndex;
+    job.dstNComps = dstNComps;
+    job.rowBytes = (bounds.x2 - bounds.x1) * pixelDataNComps * sizeof(float);
+    {
+        ProfileScope profiling("writeBehindCopy");
+        for (int y = bounds.y1; y < bounds.y2; ++y) {
+            const float* src = (const float*)((const char*)pixelData + (ptrdiff_t)(y - bounds.y1) * rowBytes);
+            std::copy(src, src + rowElements, copy + (size_t)(y - bounds.y1) * rowElements);
+        }
+    }
+
+    ProfileScope profiling("writeBehindWait");
+    tthread::lock_guard<tthread::mutex> guard(_writeBehindMutex);
+    const int nThreads = (std::min)(maxFrames, kWriteBehindMaxThreads);
+    while ((int)_writeBehindThreads.size() < nThreads) {
+        _writeBehindThreads.push_back(new tthread::thread(writeBehindThreadFunction, this));
+    }
+    // wait for a free slot, and for the previous write of the same file (e.g. if the filename has no frame number)
+    while (((int)(_writeBehindQueue.size() + _writeBehindBusy.size()) >= maxFrames) || isWritingBehind(filename)) {
+        _writeBehindCond.wait(guard);
+    }
+    _writeBehindQueue.push_back(job);
+    _writeBehindCond.notify_all();
+
+    return true;
+} // GenericWriterPlugin::queueWriteBehind
+
+// must be called with _writeBehindMutex held
+bool
+GenericWriterPlugin::isWritingBehind(const string& filename) const
+{
+    for (std::list<WriteBehindJob>::const_iterator it = _writeBehindQueue.begin(); it != _writeBehindQueue.end(); ++it) {
+        if (it->filename == filename) {
+            return true;
+        }
+    }
+
+    return std::find(_writeBehindBusy.begin(), _writeBehindBusy.end(), filename) != _writeBehindBusy.end();
+}
+
+void
+GenericWriterPlugin::writeBehindThreadFunction(void* arg)
+{
+    GenericWriterPlugin* instance = static_cast<GenericWriterPlugin*>(arg);
+
+    gIsWriteBehindThread = true;
+    instance->writeBehindLoop();
+}
+
+// Pop frames from the queue and encode them, until asked to quit.
+void
+GenericWriterPlugin::writeBehindLoop()
+{
+    for (;;) {
+        WriteBehindJob job;
+        {
+            tthread::lock_guard<tthread::mutex> guard(_writeBehindMutex);
+            while (_writeBehindQueue.empty() && !_writeBehindQuit) {
+                _writeBehindCond.wait(guard);
+            }
+            if (_writeBehindQueue.empty()) {
+                return;
+            }
+            job = _writeBehindQueue.front();
+            _writeBehindQueue.pop_front();
+            _writeBehindBusy.push_back(job.filename);
+            _writeBehindCond.notify_all();
+        }
+        string error;
+        try {
+            // the render that queued the frame has returned: time the encoding separately
+            ProfilerRenderScope profiling(_profiler.get(), "writeBehindEncode");
+            profileCount("encodedBytes", (double)(job.bounds.y2 - job.bounds.y1) * job.rowBytes);
+            encode(job.userData, job.filename, job.time, job.viewName, job.pixelData, job.bounds, job.pixelAspectRatio,
+                   job.pixelDataNComps, job.dstNCompsStartIndex, job.dstNComps, job.rowBytes);
+        } catch (const std::exception& e) {
+            error = e.what();
+        } catch (...) {
+            error = "Cannot write file \"" + job.filename + "\"";
+        }
+        releaseWriteBehindJob(job);
+        tthread::lock_guard<tthread::mutex> guard(_writeBehindMutex);
+        _writeBehindBusy.erase(std::find(_writeBehindBusy.begin(), _writeBehindBusy.end(), job.filename));
+        if (!error.empty() && _writeBehindError.empty()) {
+            _writeBehindError = error;
+        }
+        _writeBehindCond.notify_all();
+    }
+} // GenericWriterPlugin::writeBehindLoop
+
+// wait until all the queued frames are written
+void
+GenericWriterPlugin::waitForWriteBehind()
+{
+    tthread::lock_guard<tthread::mutex> guard(_writeBehindMutex);
+
+    while (!_writeBehindQueue.empty() || !_writeBehindBusy.empty()) {
+        _writeBehindCond.wait(guard);
+    }
+}
+
+// stop the writer threads, discarding the frames that were not written
+void
+GenericWriterPlugin::stopWriteBehind()
+{
+    std::vector<tthread::thread*> threads;
+    std::list<WriteBehindJob> discarded;
+    {
+        tthread::lock_guard<tthread::mutex> guard(_writeBehindMutex);
+        discarded.swap(_writeBehindQueue);
+        _writeBehindQuit = true;
+        _writeBehindCond.notify_all();
+        threads.swap(_writeBehindThreads);
+    }
+    for (std::vector<tthread::thread*>::iterator it = threads.begin(); it != threads.end(); ++it) {
+        (*it)->join();
+        delete *it;
+    }
+    for (std::list<WriteBehindJob>::iterator it = discarded.begin(); it != discarded.end(); ++it) {
+        releaseWriteBehindJob(*it);
+    }
+    tthread::lock_guard<tthread::mutex> guard(_writeBehindMutex);
+    _writeBehindQuit = false;
+}
+
+// free the copy of the frame and the data of the encoder
+void
+GenericWriterPlugin::releaseWriteBehindJob(WriteBehindJob& job)
+{
+    _scratchBuffers.release(job.pixelData);
+    job.pixelData = NULL;
+    if (job.userData) {
+        destroyEncodeUserData(job.userData);
+        job.userData = NULL;
+    }
+}
+
+void
+GenericWriterPlugin::reportWriteBehindError()
+{
+    string error;
+    {
+        tthread::lock_guard<tthread::mutex> guard(_writeBehindMutex);
+        error.swap(_writeBehindError);
+    }
+    if (!error.empty()) {
+        setPersistentMessage(Message::eMessageError, "", error);
+        throwSuiteStatusException(kOfxStatFailed);
+    }
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -1693,6 +2125,8 @@ GenericWriterPlugin::unPremultPixelData(const OfxRectI& renderWindow,
                                         BitDepthEnum dstBitDepth,
                                         int dstRowBytes)
 {
+    ProfileScope profiling("unpremult");
+
     assert(srcPixelData && dstPixelData);
 
     // do the rendering
@@ -1726,6 +2160,8 @@ GenericWriterPlugin::premultPixelData(const OfxRectI& renderWindow,
                                       BitDepthEnum dstBitDepth,
                                       int dstRowBytes)
 {
+    ProfileScope profiling("premult");
+
     assert(srcPixelData && dstPixelData);
 
     // do the rendering
@@ -1868,7 +2304,8 @@ GenericWriterPlugin::getRegionsOfInterest(const OFX::RegionsOfInterestArguments&
 }
 
 void
-GenericWriterPlugin::encode(const string& /*filename*/,
+GenericWriterPlugin::encode(void* /*user_data*/,
+                            const string& /*filename*/,
                             const OfxTime /*time*/,
                             const string& /*viewName*/,
                             const float* /*pixelData*/,
@@ -2167,6 +2604,10 @@ GenericWriterPlugin::changedParam(const InstanceChangedArgs& args,
         assert(par != -1);
         _outputFormatPar->setValue(par);
         _outputFormatSize->setValue(w, h);
+    } else if ((paramName == kParamProfileInfo) && (args.reason == eChangeUserEdit)) {
+        if (_profiler.get()) {
+            sendMessage(Message::eMessageMessage, "", _profiler->getStatistics());
+        }
     } else if ((paramName == kParamClipInfo) && (args.reason == eChangeUserEdit)) {
         string msg;
         msg += "Input: ";
@@ -2354,6 +2795,9 @@ void
 GenericWriterPlugin::purgeCaches()
 {
     clearAnyCache();
+    _scratchBuffers.clear();
+    // the host is low on memory: also free the caches of the other plugins
+    MemoryGovernor::instance().purgeAll();
 #ifdef OFX_IO_USING_OCIO
     _ocio->purgeCaches();
 #endif
@@ -2694,6 +3138,7 @@ GenericWriterDescribeInContextBegin(ImageEffectDescriptor& desc,
         }
     }
     GenericOCIO::describeInContextContext(desc, context, page);
+    GenericOCIO::describeInContextPrecision(desc, context, page);
     {
         PushButtonParamDescriptor* param = desc.definePushButtonParam(kOCIOHelpButton);
         param->setLabel(kOCIOHelpButtonLabel);
@@ -2731,6 +3176,16 @@ GenericWriterDescribeInContextBegin(ImageEffectDescriptor& desc,
         }
     }
 
+    {
+        PushButtonParamDescriptor* param = desc.definePushButtonParam(kParamProfileInfo);
+        param->setLabel(kParamProfileInfoLabel);
+        param->setHint(kParamProfileInfoHint);
+        param->setIsSecretAndDisabled(!Profiler::isEnabled());
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+
     ///////////Frame range choosal
     {
         ChoiceParamDescriptor* param = desc.defineChoiceParam(kParamFrameRange);
@@ -2801,5 +3256,23 @@ GenericWriterDescribeInContextEnd(ImageEffectDescriptor& /*desc*/,
 {
 }
 
+void
+GenericWriterDescribeWriteBehind(ImageEffectDescriptor& desc,
+                                 PageParamDescriptor* page)
+{
+    IntParamDescriptor* param = desc.defineIntParam(kParamWriteBehind);
+
+    param->setLabel(kParamWriteBehindLabel);
+    param->setHint(kParamWriteBehindHint);
+    param->setEvaluateOnChange(false);
+    param->setAnimates(false);
+    param->setDefault(0);
+    param->setRange(0, 64);
+    param->setDisplayRange(0, 8);
+    if (page) {
+        page->addChild(*param);
+    }
+}
+
 NAMESPACE_OFX_IO_EXIT
 NAMESPACE_OFX_EXIT
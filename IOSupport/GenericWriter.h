@@ -25,11 +25,17 @@
 #ifndef Io_GenericWriter_h
 #define Io_GenericWriter_h
 
+#include "IOProfiler.h"
 #include "IOUtility.h"
 #include "ofxsCopier.h" // for copyPixels
 #include "ofxsMacros.h"
 #include "ofxsPixelProcessor.h" // for getImageData
+#include "tinythread.h" // for tthread::thread and tthread::condition_variable
+#include <cstddef>
+#include <list>
 #include <memory>
+#include <string>
+#include <vector>
 #include <ofxsImageEffect.h>
 #include <ofxsMultiPlane.h>
 
@@ -158,6 +164,7 @@ namespace IO {
          * false colors or sub-par performances in the case the end-user has to prepend a color-space conversion
          * effect her/himself.
          *
+         * @param user_data The data returned by allocateEncodeUserData() for this frame
          * @param filename The output file to write to
          * @param time The frame number
          * @param viewName The name of the view to render
@@ -175,7 +182,8 @@ namespace IO {
          * You don't need to check this yourself.
          * The source image has been correctly color-converted
          **/
-        virtual void encode(const std::string& filename,
+        virtual void encode(void* user_data,
+                            const std::string& filename,
                             const OfxTime time,
                             const std::string& viewName,
                             const float* pixelData,
@@ -192,6 +200,16 @@ namespace IO {
 
         virtual void endEncode(const OFX::EndSequenceRenderArguments& /*args*/) { }
 
+        friend class EncodeLocalData_RAII;
+        /**
+         * @brief Used to allocate/free the userdata passed to encode(), e.g. the parameter values used by the encoder.
+         * allocateEncodeUserData() is always called from render(), whereas encode() may run in a writer thread (see
+         * GenericWriterDescribeWriteBehind()), and destroyEncodeUserData() is called after encode().
+         **/
+        virtual void* allocateEncodeUserData(OfxTime /*time*/) { return (void*)0; }
+
+        virtual void destroyEncodeUserData(void* /*data*/) { }
+
         friend class EncodePlanesLocalData_RAII;
         /// Used to allocate/free userdata passed to beginEncodePlanes,endEncodePlanes and encodePlane
         virtual void* allocateEncodePlanesUserData() { return (void*)0; }
@@ -245,6 +263,21 @@ namespace IO {
          **/
         virtual bool displayWindowSupportedByFormat(const std::string& /*filename*/) const { return false; }
 
+        /**
+         * @brief Report an error from encode(): set the error message and throw.
+         * If the writer supports write-behind (see GenericWriterDescribeWriteBehind()), encode() may run in a writer
+         * thread, where the message suite cannot be used: the error is then reported by a later render() or by
+         * endSequenceRender().
+         **/
+        void throwEncodeError(const std::string& message, OfxStatus status = kOfxStatFailed);
+
+        /**
+         * @brief Stop the writer threads, discarding the frames that were not written.
+         * A writer that supports write-behind must call it from its destructor, since the writer threads call the
+         * virtual functions encode() and destroyEncodeUserData().
+         **/
+        void stopWriteBehind();
+
         OFX::Clip* _inputClip; //< Mantated input clip
         OFX::Clip* _outputClip; //< Mandated output clip
         OFX::StringParam* _fileParam; //< The output file
@@ -268,6 +301,7 @@ namespace IO {
         OFX::BooleanParam* _outputSpaceSet;
         auto_ptr<GenericOCIO> _ocio;
 #endif
+        auto_ptr<Profiler> _profiler; //!< timings and counters of this instance, NULL unless profiling is enabled
 
         const std::vector<std::string>& _extensions;
         bool _supportsRGBA;
@@ -278,17 +312,49 @@ namespace IO {
         std::vector<OFX::PixelComponentEnum> _outputComponentsTable;
 
     private:
+        /**
+         * @brief Aligned buffers for the intermediate images of the render, reused across frames, so that writing
+         * a sequence of large images does not allocate and free hundreds of megabytes for each frame.
+         * The unused buffers are freed by clear(), and when there are more than kScratchBufferPoolMaxFree of them.
+         **/
+        class ScratchBufferPool {
+        public:
+            ScratchBufferPool();
+            ~ScratchBufferPool();
+
+            /// a buffer of at least size bytes, or NULL if it cannot be allocated
+            void* acquire(std::size_t size);
+            void release(void* data);
+
+            /// free the buffers which are not in use
+            void clear();
+
+        private:
+            struct Buffer {
+                void* data;
+                std::size_t size;
+                bool inUse;
+            };
+
+            tthread::mutex _mutex;
+            std::list<Buffer> _buffers; // the most recently released first
+        };
+
         class InputImagesHolder {
             std::list<const OFX::Image*> _imgs;
-            std::list<OFX::ImageMemory*> _mems;
+            std::list<void*> _scratch;
+            ScratchBufferPool& _pool;
 
         public:
-            InputImagesHolder();
+            explicit InputImagesHolder(ScratchBufferPool& pool);
             void addImage(const OFX::Image* img);
-            void addMemory(OFX::ImageMemory* mem);
+            /// a scratch buffer from the pool, released when the holder is destroyed, or NULL if out of memory
+            float* allocate(std::size_t size);
             ~InputImagesHolder();
         };
 
+        ScratchBufferPool _scratchBuffers;
+
         /*
          * @brief Fetch the given plane for the given view at the given time and convert into suited color-space
          * using OCIO if needed.
@@ -299,9 +365,9 @@ namespace IO {
          * Post-condition:
          * - srcImgsHolder had the srcImg appended to it so it gets correctly released when it is
          * destroyed.
-         * - tmpMemPtr is never NULL and points to either srcImg buffer or tmpMem buffer
-         * - If a color-space conversion occurred, tmpMem/tmpMemPtr is non-null and tmpMem was added to srcImgsHolder
-         * so it gets correctly released upon destruction.
+         * - tmpMemPtr is never NULL and points to either the srcImg buffer, or a scratch buffer allocated from srcImgsHolder
+         * if a conversion or packing was needed, so it gets correctly released upon destruction.
+         * - bounds is the render window.
          *
          * This function MAY throw exceptions aborting the action, that is why we use the InputImagesHolder RAII style class
          * that will properly release resources.
@@ -323,7 +389,6 @@ namespace IO {
                                       const bool alphaOK,
                                       InputImagesHolder* srcImgsHolder,
                                       OfxRectI* bounds,
-                                      OFX::ImageMemory** tmpMem,
                                       const OFX::Image** inputImage,
                                       float** tmpMemPtr,
                                       int* rowBytes,
@@ -495,6 +560,75 @@ namespace IO {
         void getPackingOptions(bool* allCheckboxHidden, std::vector<int>* packingMapping) const;
 
         void outputFileChanged(OFX::InstanceChangeReason reason, bool restoreExistingWriter, bool throwErrors);
+
+        // Write-behind: render() copies the frame to a WriteBehindJob, and encode() is called by a writer thread.
+        struct WriteBehindJob {
+            std::string filename;
+            OfxTime time;
+            std::string viewName;
+            void* userData; // from allocateEncodeUserData()
+            float* pixelData; // a buffer from _scratchBuffers, with packed rows
+            OfxRectI bounds;
+            float pixelAspectRatio;
+            int pixelDataNComps;
+            int dstNCompsStartIndex;
+            int dstNComps;
+            int rowBytes;
+        };
+
+        bool queueWriteBehind(void* userData, const std::string& filename, OfxTime time, const std::string& viewName, const float* pixelData, const OfxRectI& bounds,
+                              float pixelAspectRatio, int pixelDataNComps, int dstNCompsStartIndex, int dstNComps, int rowBytes);
+        bool isWritingBehind(const std::string& filename) const;
+        static void writeBehindThreadFunction(void* arg);
+        void writeBehindLoop();
+        void waitForWriteBehind();
+        void releaseWriteBehindJob(WriteBehindJob& job);
+        void reportWriteBehindError();
+
+        OFX::IntParam* _writeBehind; //!< max number of frames written asynchronously, NULL if the writer does not support write-behind
+
+        // all members below are protected by _writeBehindMutex
+        std::vector<tthread::thread*> _writeBehindThreads;
+        mutable tthread::mutex _writeBehindMutex;
+        tthread::condition_variable _writeBehindCond; // signaled when a job is queued, started or done
+        std::list<WriteBehindJob> _writeBehindQueue;
+        std::list<std::string> _writeBehindBusy; // the files being written by the writer threads
+        std::string _writeBehindError; // the first error since the last report
+        bool _writeBehindQuit; // the writer threads should exit
+        int _sequenceRenders; // number of sequence renders in progress
+    };
+
+    class EncodeLocalData_RAII {
+        GenericWriterPlugin* _w;
+        void* data;
+
+    public:
+        EncodeLocalData_RAII(GenericWriterPlugin* w,
+                             OfxTime time)
+            : _w(w)
+            , data(NULL)
+        {
+            data = w->allocateEncodeUserData(time);
+        }
+
+        ~EncodeLocalData_RAII()
+        {
+            if (data) {
+                _w->destroyEncodeUserData(data);
+            }
+        }
+
+        void* getData() const { return data; }
+
+        /// the caller now owns the data, e.g. a write-behind job
+        void* release()
+        {
+            void* d = data;
+
+            data = NULL;
+
+            return d;
+        }
     };
 
     class EncodePlanesLocalData_RAII {
@@ -538,6 +672,14 @@ namespace IO {
                                            OFX::ContextEnum context,
                                            OFX::PageParamDescriptor* defaultPage);
 
+    /**
+     * @brief Add the write-behind parameter, to encode image sequences in writer threads while the host renders the next frames.
+     * Call from describeInContext() only if encode() may run in any thread: it must not use the OFX suites (the
+     * parameter values must be read by allocateEncodeUserData()), and must report errors with throwEncodeError().
+     **/
+    void GenericWriterDescribeWriteBehind(OFX::ImageEffectDescriptor& desc,
+                                          OFX::PageParamDescriptor* page);
+
 // the load() member has to be provided, and it should fill the _extensions list of valid file extensions
 #define mDeclareWriterPluginFactory(CLASS, UNLOADFUNCDEF, ISVIDEOSTREAM)                                 \
     class CLASS                                                                                          \
@@ -0,0 +1,432 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-io <https://github.com/NatronGitHub/openfx-io>,
+ * (C) 2018-2021 The Natron Developers
+ * (C) 2013-2018 INRIA
+ *
+ * openfx-io is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-io is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-io.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+/*
+ * OFX I/O LRU cache.
+ * A thread-safe cache that evicts the least recently used entries, shared by the caches of the plugins.
+ */
+
+#ifndef IO_LRUCache_h
+#define IO_LRUCache_h
+
+#include <chrono>
+#include <cstddef>
+#include <list>
+#include <map>
+
+#include "ofxsMacros.h"
+#include "ofxsMultiThread.h"
+#ifndef OFX_USE_MULTITHREAD_MUTEX
+// some OFX hosts do not have mutex handling in the MT-Suite (e.g. Sony Catalyst Edit)
+// prefer using the fast mutex by Marcus Geelnard http://tinythreadpp.bitsnbites.eu/
+#include "fast_mutex.h"
+#endif
+
+#include "IOMemoryGovernor.h"
+#include "IOUtility.h"
+
+NAMESPACE_OFX_ENTER
+NAMESPACE_OFX_IO_ENTER
+
+/// The default InUse policy of LRUCache: any entry may be evicted.
+struct LRUCacheNeverInUse {
+    template <typename Value>
+    bool operator()(const Value&) const { return false; }
+};
+
+/**
+ * @brief A thread-safe map from Key (which must have operator<) to Value, that evicts the least recently used
+ * entries when it holds more than maxEntries entries or more than maxBytes bytes (0 means no limit).
+ *
+ * Values are usually shared pointers to immutable data, so that an entry may be evicted while a render still
+ * uses it: the data is freed when the last user releases it. Values that are slow to compute are computed
+ * between get() and insert(), without holding the lock of the cache. Two threads may then compute the same
+ * value, and insert() returns the value that was inserted first, so that both use the same data.
+ *
+ * The entries for which InUse()(value) is true are never evicted, e.g. files that are being read.
+ *
+ * If a name is given, the cache is a client of the MemoryGovernor, so that its entries also count in the memory
+ * budget shared by the caches of all the plugins.
+ */
+template <typename Key, typename Value, typename InUse = LRUCacheNeverInUse>
+class LRUCache
+    : private MemoryGovernor::Client {
+public:
+    struct Stats {
+        std::size_t entries;
+        std::size_t bytes;
+        unsigned long long hits;
+        unsigned long long misses;
+        unsigned long long evictions;
+    };
+
+    LRUCache(std::size_t maxEntries,
+             std::size_t maxBytes,
+             const char* governorName = NULL,
+             MemoryGovernor::PriorityEnum priority = MemoryGovernor::ePriorityNormal)
+        : _lock()
+        , _entries()
+        , _map()
+        , _maxEntries(maxEntries)
+        , _maxBytes(maxBytes)
+        , _bytes(0)
+        , _hits(0)
+        , _misses(0)
+        , _evictions(0)
+        , _governed(governorName != NULL)
+    {
+        if (_governed) {
+            MemoryGovernor::instance().add(this, governorName, priority);
+        }
+    }
+
+    virtual ~LRUCache()
+    {
+        if (_governed) {
+            MemoryGovernor::instance().remove(this);
+        }
+    }
+
+    /// get the value for the key and mark it as the most recently used, false if there is none
+    bool get(const Key& key,
+             Value* value)
+    {
+        return getIf(key, value, AcceptAll());
+    }
+
+    /// same as get(), but if accept(value) is false the entry is outdated (e.g. the file was modified): it is
+    /// removed, and the lookup is a miss
+    template <typename Predicate>
+    bool getIf(const Key& key,
+               Value* value,
+               Predicate accept)
+    {
+        AutoMutex guard(_lock);
+        typename EntryMap::iterator found = _map.find(key);
+
+        if ( found == _map.end() ) {
+            ++_misses;
+
+            return false;
+        }
+        if ( !accept(found->second->value) ) {
+            if ( !InUse()(found->second->value) ) {
+                removeLocked(found->second);
+            }
+            ++_misses;
+
+            return false;
+        }
+        ++_hits;
+        _entries.splice(_entries.begin(), _entries, found->second);
+        found->second->lastUse = std::chrono::steady_clock::now();
+        *value = found->second->value;
+
+        return true;
+    }
+
+    /// insert the value if there is no entry for the key, and return the value of the entry
+    Value insert(const Key& key,
+                 const Value& value,
+                 std::size_t bytes = 0)
+    {
+        return insertIf(key, value, bytes, ReplaceNone());
+    }
+
+    /// insert the value, replacing the entry for the key if replace(value of the entry) is true, and return
+    /// the value of the entry. The least recently used entries are evicted to fit the limits, never this one.
+    template <typename Predicate>
+    Value insertIf(const Key& key,
+                   const Value& value,
+                   std::size_t bytes,
+                   Predicate replace)
+    {
+        {
+            AutoMutex guard(_lock);
+            typename EntryMap::iterator found = _map.find(key);
+            if ( found != _map.end() ) {
+                if ( !replace(found->second->value) || InUse()(found->second->value) ) {
+                    return found->second->value;
+                }
+                removeLocked(found->second);
+            }
+            Entry entry;
+            entry.key = key;
+            entry.value = value;
+            entry.bytes = bytes;
+            entry.lastUse = std::chrono::steady_clock::now();
+            _entries.push_front(entry);
+            _map[key] = _entries.begin();
+            _bytes += bytes;
+            evictLocked();
+        }
+        if (_governed && (bytes > 0)) {
+            // the governor may evict entries from this cache: call it without holding _lock
+            MemoryGovernor::instance().grew(bytes);
+        }
+
+        return value;
+    }
+
+    /// set the memory used by the entry, e.g. once the value was loaded
+    void setBytes(const Key& key,
+                  std::size_t bytes)
+    {
+        std::size_t grown = 0;
+        {
+            AutoMutex guard(_lock);
+            typename EntryMap::iterator found = _map.find(key);
+            if ( found == _map.end() ) {
+                return;
+            }
+            grown = (bytes > found->second->bytes) ? (bytes - found->second->bytes) : 0;
+            _bytes += bytes;
+            _bytes -= found->second->bytes;
+            found->second->bytes = bytes;
+            found->second->lastUse = std::chrono::steady_clock::now();
+            // the entry is now the most recently used: it is evicted last
+            _entries.splice(_entries.begin(), _entries, found->second);
+            evictLocked();
+        }
+        if (_governed && (grown > 0)) {
+            MemoryGovernor::instance().grew(grown);
+        }
+    }
+
+    /// remove the entry for the key, even if it is in use
+    void erase(const Key& key)
+    {
+        AutoMutex guard(_lock);
+        typename EntryMap::iterator found = _map.find(key);
+
+        if ( found != _map.end() ) {
+            removeLocked(found->second);
+        }
+    }
+
+    /// remove the entries for which predicate(key, value) is true, even if they are in use
+    template <typename Predicate>
+    void eraseIf(Predicate predicate)
+    {
+        AutoMutex guard(_lock);
+        typename EntryList::iterator it = _entries.begin();
+
+        while ( it != _entries.end() ) {
+            if ( predicate(it->key, it->value) ) {
+                it = removeLocked(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    /// remove the entries that were not used since the given time and are not in use
+    void evictUnusedSince(std::chrono::steady_clock::time_point time)
+    {
+        AutoMutex guard(_lock);
+        typename EntryList::iterator it = _entries.end();
+
+        while ( it != _entries.begin() ) {
+            --it;
+            if (it->lastUse >= time) {
+                // the entries before are more recent
+                break;
+            }
+            if ( !InUse()(it->value) ) {
+                it = removeLocked(it);
+                ++_evictions;
+            }
+        }
+    }
+
+    /// evict the least recently used entries that are not in use until the cache fits its limits, e.g. once
+    /// entries that were in use when the cache grew are released
+    void trim()
+    {
+        AutoMutex guard(_lock);
+
+        evictLocked();
+    }
+
+    /// remove all the entries, even if they are in use
+    void clear()
+    {
+        AutoMutex guard(_lock);
+
+        _entries.clear();
+        _map.clear();
+        _bytes = 0;
+    }
+
+    /// remove all the entries that are not in use (also called by the MemoryGovernor)
+    virtual void purge() OVERRIDE FINAL
+    {
+        AutoMutex guard(_lock);
+        typename EntryList::iterator it = _entries.begin();
+
+        while ( it != _entries.end() ) {
+            if ( InUse()(it->value) ) {
+                ++it;
+            } else {
+                it = removeLocked(it);
+            }
+        }
+    }
+
+    std::size_t getMaxBytes() const
+    {
+        return _maxBytes;
+    }
+
+    Stats getStats()
+    {
+        AutoMutex guard(_lock);
+        Stats stats;
+
+        stats.entries = _entries.size();
+        stats.bytes = _bytes;
+        stats.hits = _hits;
+        stats.misses = _misses;
+        stats.evictions = _evictions;
+
+        return stats;
+    }
+
+private:
+#ifdef OFX_USE_MULTITHREAD_MUTEX
+    typedef OFX::MultiThread::Mutex Mutex;
+    typedef OFX::MultiThread::AutoMutex AutoMutex;
+#else
+    typedef tthread::fast_mutex Mutex;
+    typedef OFX::MultiThread::AutoMutexT<tthread::fast_mutex> AutoMutex;
+#endif
+
+    struct AcceptAll {
+        bool operator()(const Value&) const { return true; }
+    };
+
+    struct ReplaceNone {
+        bool operator()(const Value&) const { return false; }
+    };
+
+    struct Entry {
+        Key key;
+        Value value;
+        std::size_t bytes;
+        std::chrono::steady_clock::time_point lastUse;
+    };
+
+    typedef std::list<Entry> EntryList; // most recently used first
+    typedef std::map<Key, typename EntryList::iterator> EntryMap;
+
+    // remove the entry and return the next one (the caller must hold _lock)
+    typename EntryList::iterator removeLocked(typename EntryList::iterator it)
+    {
+        _bytes -= it->bytes;
+        _map.erase(it->key);
+
+        return _entries.erase(it);
+    }
+
+    bool fitsLocked() const
+    {
+        return ( (_maxEntries == 0) || (_entries.size() <= _maxEntries) ) && ( (_maxBytes == 0) || (_bytes <= _maxBytes) );
+    }
+
+    // evict the least recently used entries that are not in use, except the first one, until the cache
+    // fits its limits (the caller must hold _lock)
+    void evictLocked()
+    {
+        typename EntryList::iterator it = _entries.end();
+
+        while ( !fitsLocked() && (it != _entries.begin()) ) {
+            --it;
+            if ( ( it != _entries.begin() ) && !InUse()(it->value) ) {
+                it = removeLocked(it);
+                ++_evictions;
+            }
+        }
+    }
+
+    // the least recently used entry that is not in use, _entries.end() if there is none (the caller must hold _lock)
+    typename EntryList::iterator findOldestUnusedLocked()
+    {
+        typename EntryList::iterator it = _entries.end();
+
+        while ( it != _entries.begin() ) {
+            --it;
+            if ( !InUse()(it->value) ) {
+                return it;
+            }
+        }
+
+        return _entries.end();
+    }
+
+    virtual std::size_t getMemoryBytes() OVERRIDE FINAL
+    {
+        AutoMutex guard(_lock);
+
+        return _bytes;
+    }
+
+    virtual bool getOldestUse(std::chrono::steady_clock::time_point* lastUse) OVERRIDE FINAL
+    {
+        AutoMutex guard(_lock);
+        typename EntryList::iterator oldest = findOldestUnusedLocked();
+
+        if ( oldest == _entries.end() ) {
+            return false;
+        }
+        *lastUse = oldest->lastUse;
+
+        return true;
+    }
+
+    virtual std::size_t evictOldest() OVERRIDE FINAL
+    {
+        AutoMutex guard(_lock);
+        typename EntryList::iterator oldest = findOldestUnusedLocked();
+
+        if ( oldest == _entries.end() ) {
+            return 0;
+        }
+        const std::size_t bytes = oldest->bytes;
+        removeLocked(oldest);
+        ++_evictions;
+
+        return bytes;
+    }
+
+    Mutex _lock;
+    EntryList _entries;
+    EntryMap _map;
+    std::size_t _maxEntries;
+    std::size_t _maxBytes;
+    std::size_t _bytes;
+    unsigned long long _hits;
+    unsigned long long _misses;
+    unsigned long long _evictions;
+    bool _governed;
+};
+
+NAMESPACE_OFX_IO_EXIT
+NAMESPACE_OFX_EXIT
+
+#endif // IO_LRUCache_h
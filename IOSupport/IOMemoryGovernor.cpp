@@ -0,0 +1,326 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-io <https://github.com/NatronGitHub/openfx-io>,
+ * (C) 2018-2021 The Natron Developers
+ * (C) 2013-2018 INRIA
+ *
+ * openfx-io is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-io is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-io.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+/*
+ * OFX I/O memory governor.
+ * A memory budget shared by the caches of all the plugins of the bundle.
+ */
+
+#include "IOMemoryGovernor.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <set>
+#include <sstream>
+#if defined(_WIN32) || defined(__WIN32__) || defined(WIN32)
+#include <windows.h> // for GlobalMemoryStatusEx()
+#else
+#include <unistd.h> // for sysconf()
+#endif
+
+#define kMemoryGovernorDefaultMinFreeMB 512
+#define kMemoryGovernorDefaultBudgetMB 4096 // if the physical memory is unknown
+#define kMemoryGovernorSystemCheckSeconds 1 // the available system memory is checked at most once per second
+#define kMemoryGovernorLowWaterPercent 90 // when the budget is exceeded, entries are evicted down to this part of the budget
+
+using std::string;
+
+NAMESPACE_OFX_ENTER
+NAMESPACE_OFX_IO_ENTER
+
+namespace {
+// the physical memory in bytes, 0 if unknown
+std::size_t
+getPhysicalMemory()
+{
+#if defined(_WIN32) || defined(__WIN32__) || defined(WIN32)
+    MEMORYSTATUSEX status;
+    status.dwLength = sizeof(status);
+    if (GlobalMemoryStatusEx(&status)) {
+        return (std::size_t)status.ullTotalPhys;
+    }
+
+    return 0;
+#elif defined(_SC_PHYS_PAGES) && defined(_SC_PAGESIZE)
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long pageSize = sysconf(_SC_PAGESIZE);
+
+    return ((pages > 0) && (pageSize > 0)) ? (std::size_t)pages * (std::size_t)pageSize : 0;
+#else
+    return 0;
+#endif
+}
+
+// the memory available to the processes without swapping, false if unknown
+bool
+getAvailableMemory(std::size_t* bytes)
+{
+#if defined(_WIN32) || defined(__WIN32__) || defined(WIN32)
+    MEMORYSTATUSEX status;
+    status.dwLength = sizeof(status);
+    if (GlobalMemoryStatusEx(&status)) {
+        *bytes = (std::size_t)status.ullAvailPhys;
+
+        return true;
+    }
+
+    return false;
+#elif defined(__linux__)
+    // MemAvailable includes the page cache that can be reclaimed, unlike _SC_AVPHYS_PAGES
+    std::FILE* file = std::fopen("/proc/meminfo", "r");
+    if (!file) {
+        return false;
+    }
+    char line[256];
+    bool found = false;
+    while (std::fgets(line, sizeof(line), file)) {
+        unsigned long long kb;
+        if (std::sscanf(line, "MemAvailable: %llu kB", &kb) == 1) {
+            *bytes = (std::size_t)(kb << 10);
+            found = true;
+            break;
+        }
+    }
+    std::fclose(file);
+
+    return found;
+#else
+    (void)bytes;
+
+    return false;
+#endif
+}
+
+std::size_t
+getEnvMB(const char* name,
+         std::size_t defaultBytes)
+{
+    const char* value = std::getenv(name);
+
+    if (!value || (value[0] == '\0')) {
+        return defaultBytes;
+    }
+    long mb = std::atol(value);
+
+    return (mb > 0) ? ((std::size_t)mb << 20) : 0;
+}
+}
+
+MemoryGovernor::MemoryGovernor()
+    : _lock()
+    , _clients()
+    , _budget(0)
+    , _minFree(0)
+    , _total(0)
+    , _lastSystemCheck(0)
+    , _systemShortage(0)
+{
+    const std::size_t physicalMemory = getPhysicalMemory();
+
+    _budget = getEnvMB("OFX_IO_MEMORY_BUDGET", physicalMemory ? (physicalMemory / 4) : ((std::size_t)kMemoryGovernorDefaultBudgetMB << 20));
+    _minFree = getEnvMB("OFX_IO_MEMORY_MIN_FREE", (std::size_t)kMemoryGovernorDefaultMinFreeMB << 20);
+}
+
+MemoryGovernor&
+MemoryGovernor::instance()
+{
+    // never destroyed, so that the clients that are static objects can remove themselves at exit
+    static MemoryGovernor* governor = new MemoryGovernor;
+
+    return *governor;
+}
+
+void
+MemoryGovernor::add(Client* client,
+                    const string& name,
+                    PriorityEnum priority)
+{
+    AutoMutex guard(_lock);
+    ClientInfo info;
+
+    info.client = client;
+    info.name = name;
+    info.priority = priority;
+    info.evictions = 0;
+    info.evictedBytes = 0;
+    _clients.push_back(info);
+}
+
+void
+MemoryGovernor::remove(Client* client)
+{
+    AutoMutex guard(_lock);
+
+    for (std::list<ClientInfo>::iterator it = _clients.begin(); it != _clients.end(); ++it) {
+        if (it->client == client) {
+            _clients.erase(it);
+
+            return;
+        }
+    }
+}
+
+std::size_t
+MemoryGovernor::getBudget() const
+{
+    return _budget;
+}
+
+bool
+MemoryGovernor::isSystemCheckDue() const
+{
+    const long long now = (long long)std::chrono::steady_clock::now().time_since_epoch().count();
+    const long long period = (long long)std::chrono::steady_clock::duration( std::chrono::seconds(kMemoryGovernorSystemCheckSeconds) ).count();
+
+    return now - _lastSystemCheck.load() >= period;
+}
+
+std::size_t
+MemoryGovernor::getSystemShortage()
+{
+    if ( isSystemCheckDue() ) {
+        // also the time of the last retry to fit in the budget, see grew()
+        _lastSystemCheck = (long long)std::chrono::steady_clock::now().time_since_epoch().count();
+        std::size_t available;
+        _systemShortage = ( (_minFree > 0) && getAvailableMemory(&available) && (available < _minFree) ) ? (_minFree - available) : 0;
+    }
+
+    return _systemShortage;
+}
+
+void
+MemoryGovernor::grew(std::size_t bytes)
+{
+    // This is called for each insertion in the caches (e.g. for each grain tile), so the global lock is
+    // only taken when the total exceeds the budget, or when the system memory should be checked again.
+    // update() evicts down to the low-water mark, so the budget is not exceeded again by the next insertions.
+    const std::size_t total = _total.fetch_add(bytes) + bytes;
+    const bool overBudget = (_budget > 0) && (total > _budget);
+
+    if ( overBudget && (total - bytes <= _budget) ) {
+        update();
+
+        return;
+    }
+    // if the entries were in use, the total may stay over the budget: retry at most once per check period
+    if ( ( (_minFree > 0) || overBudget ) && isSystemCheckDue() ) {
+        update();
+    }
+}
+
+void
+MemoryGovernor::update()
+{
+    AutoMutex guard(_lock);
+    const std::size_t shortage = getSystemShortage();
+
+    if ((_budget == 0) && (shortage == 0)) {
+        return;
+    }
+    std::size_t total = 0;
+    for (std::list<ClientInfo>::iterator it = _clients.begin(); it != _clients.end(); ++it) {
+        total += it->client->getMemoryBytes();
+    }
+    std::size_t target = total;
+    if ( (_budget > 0) && (total > _budget) ) {
+        // evict down to the low-water mark, so that each of the next insertions does not walk the clients again
+        target = _budget / 100 * kMemoryGovernorLowWaterPercent;
+    }
+    if (shortage > 0) {
+        target = (std::min)(target, (total > shortage) ? (total - shortage) : 0);
+        // the shortage is taken care of until the next check
+        _systemShortage = 0;
+    }
+
+    const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    std::set<Client*> exhausted; // the clients that could not free anything
+    while (total > target) {
+        // Cross-cache LRU: evict the entry that was unused for the longest time, where the age of the
+        // entries of a cache is halved for each priority level, so that e.g. a decoded frame is kept
+        // longer than a grain tile that was used at the same time.
+        ClientInfo* oldest = NULL;
+        double oldestAge = -1.;
+        for (std::list<ClientInfo>::iterator it = _clients.begin(); it != _clients.end(); ++it) {
+            std::chrono::steady_clock::time_point lastUse;
+            if ( exhausted.count(it->client) || !it->client->getOldestUse(&lastUse) ) {
+                continue;
+            }
+            const double age = std::chrono::duration<double>(now - lastUse).count() / (double)(1 << (int)it->priority);
+            if (age > oldestAge) {
+                oldest = &*it;
+                oldestAge = age;
+            }
+        }
+        if (!oldest) {
+            // everything left is in use
+            break;
+        }
+        const std::size_t freed = oldest->client->evictOldest();
+        if (freed == 0) {
+            exhausted.insert(oldest->client);
+            continue;
+        }
+        ++oldest->evictions;
+        oldest->evictedBytes += freed;
+        total -= (std::min)(freed, total);
+    }
+    _total = total;
+} // MemoryGovernor::update
+
+void
+MemoryGovernor::purgeAll()
+{
+    AutoMutex guard(_lock);
+
+    for (std::list<ClientInfo>::iterator it = _clients.begin(); it != _clients.end(); ++it) {
+        it->client->purge();
+    }
+}
+
+string
+MemoryGovernor::getStatistics()
+{
+    AutoMutex guard(_lock);
+    std::ostringstream ss;
+    std::size_t total = 0;
+
+    ss << "Memory used by the caches of all the plugins:\n";
+    for (std::list<ClientInfo>::iterator it = _clients.begin(); it != _clients.end(); ++it) {
+        const std::size_t bytes = it->client->getMemoryBytes();
+        total += bytes;
+        ss << it->name << ": " << (bytes >> 20) << " MB";
+        if (it->evictions > 0) {
+            ss << " (" << it->evictions << " evictions, " << (it->evictedBytes >> 20) << " MB, to fit in the budget)";
+        }
+        ss << '\n';
+    }
+    ss << "Total: " << (total >> 20) << " MB";
+    if (_budget > 0) {
+        ss << " / " << (_budget >> 20) << " MB";
+    } else {
+        ss << " (no budget)";
+    }
+
+    return ss.str();
+}
+
+NAMESPACE_OFX_IO_EXIT
+NAMESPACE_OFX_EXIT
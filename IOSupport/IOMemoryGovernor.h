@@ -0,0 +1,153 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-io <https://github.com/NatronGitHub/openfx-io>,
+ * (C) 2018-2021 The Natron Developers
+ * (C) 2013-2018 INRIA
+ *
+ * openfx-io is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-io is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-io.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+/*
+ * OFX I/O memory governor.
+ * A memory budget shared by the caches of all the plugins of the bundle.
+ */
+
+#ifndef IO_MemoryGovernor_h
+#define IO_MemoryGovernor_h
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <list>
+#include <string>
+
+#include "ofxsMultiThread.h"
+#ifndef OFX_USE_MULTITHREAD_MUTEX
+// some OFX hosts do not have mutex handling in the MT-Suite (e.g. Sony Catalyst Edit)
+// prefer using the fast mutex by Marcus Geelnard http://tinythreadpp.bitsnbites.eu/
+#include "fast_mutex.h"
+#endif
+
+#include "IOUtility.h"
+
+NAMESPACE_OFX_ENTER
+NAMESPACE_OFX_IO_ENTER
+
+/**
+ * @brief Process-wide memory budget of the caches of the plugins (decoded frames, open files, decoders, LUTs, grain...).
+ * Each cache keeps its own limit, but together they could exhaust the memory of a render node that also runs the
+ * cache of the host.
+ *
+ * The caches register as a Client, and call grew() with the number of bytes they added. The governor keeps a running
+ * total, so that grew() is cheap on the render threads: the clients are only walked when the total exceeds the budget.
+ * Then the least recently used entries are evicted across all caches, starting with the caches of lowest priority,
+ * until the total is below 90% of the budget, so that the next insertions do not exceed it again. If the entries
+ * are in use, the total may stay over the budget, and eviction is retried at most once per second.
+ * The system memory is also checked at most once per second, and purgeAll() is called when the host asks a plugin to
+ * purge its caches.
+ *
+ * The budget (in megabytes) can be set with the OFX_IO_MEMORY_BUDGET environment variable (default is a quarter of the
+ * physical memory, 0 disables the budget). The caches also free memory when the available system memory is below
+ * OFX_IO_MEMORY_MIN_FREE megabytes (default is 512).
+ */
+class MemoryGovernor {
+public:
+    enum PriorityEnum {
+        ePriorityLow = 0, // cheap to recompute (e.g. grain tiles)
+        ePriorityNormal,
+        ePriorityHigh, // expensive to recompute (e.g. decoded frames, opened decoders)
+    };
+
+    /**
+     * @brief The interface of a cache to the governor.
+     * The governor calls these with its lock held: a client must never call the governor while holding its own lock.
+     */
+    class Client {
+    public:
+        virtual ~Client() {}
+
+        /// the memory used by the cache, in bytes
+        virtual std::size_t getMemoryBytes() = 0;
+
+        /// the last use of the least recently used entry that could be evicted, false if there is none
+        virtual bool getOldestUse(std::chrono::steady_clock::time_point* lastUse) = 0;
+
+        /// evict the least recently used entry, and return the number of bytes freed
+        virtual std::size_t evictOldest() = 0;
+
+        /// evict all the entries that are not in use
+        virtual void purge() = 0;
+    };
+
+    static MemoryGovernor& instance();
+
+    void add(Client* client, const std::string& name, PriorityEnum priority);
+
+    /// must be called before the client is destroyed
+    void remove(Client* client);
+
+    /// the total budget in bytes, 0 if unlimited
+    std::size_t getBudget() const;
+
+    /// a client added the given number of bytes: evict entries if the caches may not fit in the budget anymore
+    void grew(std::size_t bytes);
+
+    /// evict entries until the caches fit in the budget, down to a low-water mark, and the system is not low on memory
+    void update();
+
+    /// evict all the entries that are not in use, e.g. when the host is low on memory
+    void purgeAll();
+
+    /// a human-readable report of the memory used by each cache, suitable for a message dialog
+    std::string getStatistics();
+
+private:
+#ifdef OFX_USE_MULTITHREAD_MUTEX
+    typedef OFX::MultiThread::Mutex Mutex;
+    typedef OFX::MultiThread::AutoMutex AutoMutex;
+#else
+    typedef tthread::fast_mutex Mutex;
+    typedef OFX::MultiThread::AutoMutexT<tthread::fast_mutex> AutoMutex;
+#endif
+
+    struct ClientInfo {
+        Client* client;
+        std::string name;
+        PriorityEnum priority;
+        unsigned long evictions;
+        std::size_t evictedBytes;
+    };
+
+    MemoryGovernor();
+
+    // true if the available system memory was not checked for kMemoryGovernorSystemCheckSeconds
+    bool isSystemCheckDue() const;
+
+    // the number of bytes that should be freed because the system is low on memory (the caller must hold _lock)
+    std::size_t getSystemShortage();
+
+    Mutex _lock;
+    std::list<ClientInfo> _clients;
+    std::size_t _budget;
+    std::size_t _minFree;
+    // the memory used by all the clients at the last update(), plus what they reported with grew() since then:
+    // this may be more than the actual total, since the clients also evict entries by themselves
+    std::atomic<std::size_t> _total;
+    std::atomic<long long> _lastSystemCheck; // steady_clock ticks
+    std::size_t _systemShortage;
+};
+
+NAMESPACE_OFX_IO_EXIT
+NAMESPACE_OFX_EXIT
+
+#endif // IO_MemoryGovernor_h
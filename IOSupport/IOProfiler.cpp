@@ -0,0 +1,231 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-io <https://github.com/NatronGitHub/openfx-io>,
+ * (C) 2018-2021 The Natron Developers
+ * (C) 2013-2018 INRIA
+ *
+ * openfx-io is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-io is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-io.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+/*
+ * OFX I/O profiling.
+ * Opt-in timings and counters of the reader and writer stages.
+ */
+
+#include "IOProfiler.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <thread>
+#if defined(_WIN32) || defined(__WIN32__) || defined(WIN32)
+#include <process.h> // for _getpid
+#define getpid _getpid
+#else
+#include <unistd.h> // for getpid
+#endif
+
+using std::string;
+
+NAMESPACE_OFX_ENTER
+NAMESPACE_OFX_IO_ENTER
+
+namespace {
+#ifdef OFX_USE_MULTITHREAD_MUTEX
+typedef OFX::MultiThread::Mutex Mutex;
+typedef OFX::MultiThread::AutoMutex AutoMutex;
+#else
+typedef tthread::fast_mutex Mutex;
+typedef OFX::MultiThread::AutoMutexT<tthread::fast_mutex> AutoMutex;
+#endif
+
+// the profiler of the render in progress on each thread
+thread_local Profiler* gCurrentProfiler = NULL;
+
+// The Chrome trace file given by OFX_IO_PROFILE_TRACE, written as events are recorded.
+// The JSON array is closed when the plugin is unloaded, but the trace viewers also accept
+// a truncated file, e.g. if the host crashed.
+class TraceFile {
+public:
+    static TraceFile& instance()
+    {
+        static TraceFile trace;
+
+        return trace;
+    }
+
+    bool isOpen() const { return _file != NULL; }
+
+    void write(const string& category,
+               const char* name,
+               std::chrono::steady_clock::time_point start,
+               std::chrono::steady_clock::time_point end)
+    {
+        const long long ts = std::chrono::duration_cast<std::chrono::microseconds>( start - _origin ).count();
+        const long long dur = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+        const unsigned int tid = (unsigned int)std::hash<std::thread::id>()( std::this_thread::get_id() );
+        AutoMutex guard(_lock);
+
+        std::fprintf(_file, "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":%d,\"tid\":%u}",
+                     _first ? "" : ",\n", name, category.c_str(), ts, dur, (int)getpid(), tid);
+        _first = false;
+    }
+
+private:
+    TraceFile()
+        : _file(NULL)
+        , _first(true)
+        , _origin( std::chrono::steady_clock::now() )
+        , _lock()
+    {
+        const char* filename = std::getenv("OFX_IO_PROFILE_TRACE");
+
+        if ( Profiler::isEnabled() && filename && (filename[0] != '\0') ) {
+            _file = std::fopen(filename, "w");
+            if (_file) {
+                std::fputs("[\n", _file);
+            }
+        }
+    }
+
+    ~TraceFile()
+    {
+        if (_file) {
+            std::fputs("\n]\n", _file);
+            std::fclose(_file);
+        }
+    }
+
+    std::FILE* _file;
+    bool _first;
+    const std::chrono::steady_clock::time_point _origin;
+    Mutex _lock;
+};
+}
+
+Profiler::Profiler(const string& name)
+    : _name(name)
+    , _lock()
+    , _stages()
+    , _counters()
+{
+}
+
+bool
+Profiler::isEnabled()
+{
+    static const bool enabled = []() {
+        const char* value = std::getenv("OFX_IO_PROFILE");
+
+        return value && (value[0] != '\0') && (std::strcmp(value, "0") != 0);
+    }();
+
+    return enabled;
+}
+
+Profiler*
+Profiler::current()
+{
+    return gCurrentProfiler;
+}
+
+void
+Profiler::addTime(const char* stage,
+                  std::chrono::steady_clock::time_point start,
+                  std::chrono::steady_clock::time_point end)
+{
+    const double seconds = std::chrono::duration<double>(end - start).count();
+    {
+        AutoMutex guard(_lock);
+        StageStats& stats = _stages[stage];
+        ++stats.count;
+        stats.total += seconds;
+        if (seconds > stats.max) {
+            stats.max = seconds;
+        }
+    }
+
+    TraceFile& trace = TraceFile::instance();
+    if ( trace.isOpen() ) {
+        trace.write(_name, stage, start, end);
+    }
+}
+
+void
+Profiler::addCount(const char* counter,
+                   double value)
+{
+    AutoMutex guard(_lock);
+
+    _counters[counter] += value;
+}
+
+string
+Profiler::getStatistics() const
+{
+    AutoMutex guard(_lock);
+    string msg = "Profile of " + _name + " (stage times include the nested stages):\n";
+
+    if ( _stages.empty() && _counters.empty() ) {
+        msg += "Nothing rendered yet.\n";
+
+        return msg;
+    }
+
+    char line[512];
+    for (std::map<string, StageStats>::const_iterator it = _stages.begin(); it != _stages.end(); ++it) {
+        const StageStats& stats = it->second;
+        std::snprintf(line, sizeof(line), "%s: %lu calls, %.3f s total, %.2f ms mean, %.2f ms max\n",
+                      it->first.c_str(), stats.count, stats.total, 1000. * stats.total / stats.count, 1000. * stats.max);
+        msg += line;
+    }
+    for (std::map<string, double>::const_iterator it = _counters.begin(); it != _counters.end(); ++it) {
+        std::snprintf(line, sizeof(line), "%s: %.0f\n", it->first.c_str(), it->second);
+        msg += line;
+    }
+
+    return msg;
+}
+
+void
+Profiler::reset()
+{
+    AutoMutex guard(_lock);
+
+    _stages.clear();
+    _counters.clear();
+}
+
+ProfilerRenderScope::ProfilerRenderScope(Profiler* profiler,
+                                         const char* stage)
+    : _previous(gCurrentProfiler)
+    , _profiler(profiler)
+    , _stage(stage)
+{
+    if (_profiler) {
+        gCurrentProfiler = _profiler;
+        _start = std::chrono::steady_clock::now();
+    }
+}
+
+ProfilerRenderScope::~ProfilerRenderScope()
+{
+    if (_profiler) {
+        _profiler->addTime( _stage, _start, std::chrono::steady_clock::now() );
+        gCurrentProfiler = _previous;
+    }
+}
+
+NAMESPACE_OFX_IO_EXIT
+NAMESPACE_OFX_EXIT
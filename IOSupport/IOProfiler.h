@@ -0,0 +1,162 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-io <https://github.com/NatronGitHub/openfx-io>,
+ * (C) 2018-2021 The Natron Developers
+ * (C) 2013-2018 INRIA
+ *
+ * openfx-io is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-io is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-io.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+/*
+ * OFX I/O profiling.
+ * Opt-in timings and counters of the reader and writer stages.
+ */
+
+#ifndef IO_Profiler_h
+#define IO_Profiler_h
+
+#include <chrono>
+#include <map>
+#include <string>
+
+#include "ofxsMultiThread.h"
+#ifndef OFX_USE_MULTITHREAD_MUTEX
+// some OFX hosts do not have mutex handling in the MT-Suite (e.g. Sony Catalyst Edit)
+// prefer using the fast mutex by Marcus Geelnard http://tinythreadpp.bitsnbites.eu/
+#include "fast_mutex.h"
+#endif
+
+#include "IOUtility.h"
+
+NAMESPACE_OFX_ENTER
+NAMESPACE_OFX_IO_ENTER
+
+/**
+ * @brief Per-instance wall time of each stage of the render, and counters (bytes, seeks, cache hits...).
+ *
+ * Profiling is enabled by setting the OFX_IO_PROFILE environment variable to a non-zero value.
+ * If OFX_IO_PROFILE_TRACE is set to a file name, each timed stage is also written to that file
+ * as an event in the Chrome trace format, which can be loaded in chrome://tracing or Perfetto.
+ *
+ * While a Profiler is current on a thread (see ProfilerRenderScope), ProfileScope and profileCount()
+ * record into it, so that the code called by the render (e.g. GenericOCIO::apply() or the FFmpeg
+ * decoder) does not need to know the instance it works for.
+ */
+class Profiler {
+public:
+    explicit Profiler(const std::string& name);
+
+    /// true if OFX_IO_PROFILE is set
+    static bool isEnabled();
+
+    /// the profiler of the render in progress on this thread, or NULL
+    static Profiler* current();
+
+    void addTime(const char* stage, std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end);
+
+    void addCount(const char* counter, double value);
+
+    /// a human-readable report, suitable for a message dialog
+    std::string getStatistics() const;
+
+    void reset();
+
+private:
+#ifdef OFX_USE_MULTITHREAD_MUTEX
+    typedef OFX::MultiThread::Mutex Mutex;
+    typedef OFX::MultiThread::AutoMutex AutoMutex;
+#else
+    typedef tthread::fast_mutex Mutex;
+    typedef OFX::MultiThread::AutoMutexT<tthread::fast_mutex> AutoMutex;
+#endif
+
+    struct StageStats {
+        unsigned long count;
+        double total; // seconds
+        double max; // seconds
+
+        StageStats()
+            : count(0)
+            , total(0.)
+            , max(0.)
+        {
+        }
+    };
+
+    const std::string _name;
+    mutable Mutex _lock;
+    std::map<std::string, StageStats> _stages;
+    std::map<std::string, double> _counters;
+};
+
+/**
+ * @brief Makes a profiler current on this thread, and times the whole scope as the "render" stage.
+ * Does nothing if profiler is NULL.
+ */
+class ProfilerRenderScope {
+public:
+    explicit ProfilerRenderScope(Profiler* profiler, const char* stage = "render");
+
+    ~ProfilerRenderScope();
+
+private:
+    Profiler* _previous;
+    Profiler* _profiler;
+    const char* _stage;
+    std::chrono::steady_clock::time_point _start;
+};
+
+/**
+ * @brief Times a stage of the render in progress on this thread, if it is profiled.
+ * Stage times include the nested stages.
+ */
+class ProfileScope {
+public:
+    explicit ProfileScope(const char* stage)
+        : _profiler( Profiler::current() )
+        , _stage(stage)
+    {
+        if (_profiler) {
+            _start = std::chrono::steady_clock::now();
+        }
+    }
+
+    ~ProfileScope()
+    {
+        if (_profiler) {
+            _profiler->addTime( _stage, _start, std::chrono::steady_clock::now() );
+        }
+    }
+
+private:
+    Profiler* _profiler;
+    const char* _stage;
+    std::chrono::steady_clock::time_point _start;
+};
+
+/// Add value to a counter of the render in progress on this thread, if it is profiled.
+inline void
+profileCount(const char* counter,
+             double value = 1.)
+{
+    Profiler* profiler = Profiler::current();
+
+    if (profiler) {
+        profiler->addCount(counter, value);
+    }
+}
+
+NAMESPACE_OFX_IO_EXIT
+NAMESPACE_OFX_EXIT
+
+#endif // IO_Profiler_h
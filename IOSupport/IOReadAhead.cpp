@@ -0,0 +1,243 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-io <https://github.com/NatronGitHub/openfx-io>,
+ * (C) 2018-2021 The Natron Developers
+ * (C) 2013-2018 INRIA
+ *
+ * openfx-io is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-io is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-io.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+/*
+ * OFX I/O read-ahead.
+ * Prefetches the files of the next frames of an image sequence into the system file cache.
+ */
+
+#include "IOReadAhead.h"
+
+#include <cfloat> // DBL_MAX
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#if defined(__linux__)
+#include <fcntl.h> // for posix_fadvise
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include "ofxsFileOpen.h"
+#endif
+
+#define kReadAheadMaxStep 4 // successive renders further apart than this many frames are not considered as playback
+#define kReadAheadMaxDone 64 // number of prefetched files remembered, so that they are not read again
+
+using std::string;
+
+NAMESPACE_OFX_ENTER
+NAMESPACE_OFX_IO_ENTER
+
+ReadAhead::ReadAhead()
+    : _thread(NULL)
+    , _mutex()
+    , _cond()
+    , _queue()
+    , _next(0)
+    , _bytes(0)
+    , _generation(0)
+    , _quit(false)
+    , _lastTime(-DBL_MAX)
+    , _direction(0)
+    , _done()
+{
+}
+
+ReadAhead::~ReadAhead()
+{
+    stopThread();
+}
+
+int
+ReadAhead::getDirection(double time,
+                        bool isPlayback)
+{
+    tthread::lock_guard<tthread::mutex> guard(_mutex);
+    const double step = time - _lastTime;
+
+    if (step != 0.) {
+        if (std::abs(step) <= kReadAheadMaxStep) {
+            _direction = (step > 0.) ? 1 : -1;
+        } else if (!isPlayback) {
+            // a jump: wait for the next render to guess the direction
+            _direction = 0;
+        }
+        _lastTime = time;
+    }
+    if (isPlayback && (_direction == 0)) {
+        _direction = 1;
+    }
+
+    return _direction;
+}
+
+void
+ReadAhead::prefetch(const std::vector<string>& filenames)
+{
+    tthread::lock_guard<tthread::mutex> guard(_mutex);
+
+    if (filenames == _queue) {
+        // e.g. the same frame is rendered in several tiles
+        return;
+    }
+    _queue = filenames;
+    _next = 0;
+    _bytes = 0;
+    ++_generation;
+    if ( !_thread && !_queue.empty() ) {
+        _thread = new tthread::thread(threadFunction, this);
+    }
+    _cond.notify_all();
+}
+
+std::size_t
+ReadAhead::getMaxBytes()
+{
+    static const std::size_t maxBytes = []() {
+        const char* size = std::getenv("OFX_IO_READ_AHEAD_SIZE");
+        long mb = size ? std::atol(size) : 256;
+
+        return (std::size_t)( (mb > 0) ? mb : 0 ) << 20;
+    }();
+
+    return maxBytes;
+}
+
+void
+ReadAhead::threadFunction(void* arg)
+{
+    ReadAhead* readAhead = static_cast<ReadAhead*>(arg);
+
+    readAhead->loop();
+}
+
+// Prefetch the files of the queue in order, until the size budget is spent or the queue is replaced.
+void
+ReadAhead::loop()
+{
+    const std::size_t maxBytes = getMaxBytes();
+
+    for (;;) {
+        string filename;
+        unsigned long generation;
+        {
+            tthread::lock_guard<tthread::mutex> guard(_mutex);
+            while ( (_next >= _queue.size()) && !_quit ) {
+                _cond.wait(guard);
+            }
+            if (_quit) {
+                return;
+            }
+            filename = _queue[_next];
+            generation = _generation;
+        }
+
+        // the files are read outside of the lock, so that the render is never blocked by the file server
+        long long size = -1;
+        bool found = false;
+        for (std::list<std::pair<string, long long> >::iterator it = _done.begin(); it != _done.end(); ++it) {
+            if (it->first == filename) {
+                // still in the system cache: only count its size
+                size = it->second;
+                _done.splice(_done.begin(), _done, it);
+                found = true;
+                break;
+            }
+        }
+        if (!found) {
+            size = prefetchFile(filename);
+            // files that could not be read are not remembered: they may be written later
+            if (size >= 0) {
+                _done.push_front( std::make_pair(filename, size) );
+                if (_done.size() > kReadAheadMaxDone) {
+                    _done.pop_back();
+                }
+            }
+        }
+
+        tthread::lock_guard<tthread::mutex> guard(_mutex);
+        if (generation == _generation) {
+            ++_next;
+            if (size > 0) {
+                _bytes += (std::size_t)size;
+            }
+            if (_bytes >= maxBytes) {
+                // enough data ahead of the frame being rendered
+                _next = _queue.size();
+            }
+        }
+    }
+} // ReadAhead::loop
+
+void
+ReadAhead::stopThread()
+{
+    if (!_thread) {
+        return;
+    }
+    {
+        tthread::lock_guard<tthread::mutex> guard(_mutex);
+        _quit = true;
+        _cond.notify_all();
+    }
+    _thread->join();
+    delete _thread;
+    _thread = NULL;
+    _queue.clear();
+    _next = 0;
+    _quit = false;
+}
+
+long long
+ReadAhead::prefetchFile(const string& filename)
+{
+#if defined(__linux__)
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    long long size = -1;
+    struct stat st;
+    if (fstat(fd, &st) == 0) {
+        size = (long long)st.st_size;
+        // the kernel reads the file asynchronously into the page cache
+        (void)posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    }
+    close(fd);
+
+    return size;
+#else
+    std::FILE* file = fopen_utf8(filename.c_str(), "rb");
+    if (!file) {
+        return -1;
+    }
+    std::vector<char> buffer(1 << 20);
+    long long size = 0;
+    std::size_t count;
+    while ( ( count = std::fread(&buffer[0], 1, buffer.size(), file) ) > 0 ) {
+        size += (long long)count;
+    }
+    std::fclose(file);
+
+    return size;
+#endif
+}
+
+NAMESPACE_OFX_IO_EXIT
+NAMESPACE_OFX_EXIT
@@ -0,0 +1,92 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-io <https://github.com/NatronGitHub/openfx-io>,
+ * (C) 2018-2021 The Natron Developers
+ * (C) 2013-2018 INRIA
+ *
+ * openfx-io is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-io is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-io.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+/*
+ * OFX I/O read-ahead.
+ * Prefetches the files of the next frames of an image sequence into the system file cache.
+ */
+
+#ifndef IO_ReadAhead_h
+#define IO_ReadAhead_h
+
+#include <cstddef>
+#include <list>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "tinythread.h" // for tthread::thread and tthread::condition_variable
+
+#include "IOUtility.h"
+
+NAMESPACE_OFX_ENTER
+NAMESPACE_OFX_IO_ENTER
+
+/**
+ * @brief Reads the files of the next frames in a background thread, so that they are in the system
+ * file cache when the decoder opens them. This hides the latency of network storage during playback.
+ *
+ * The files are only read into the system cache, so that all decoders benefit from it without
+ * modification. On Linux, the kernel is asked to read the file asynchronously (posix_fadvise),
+ * elsewhere the file is read and the data is discarded.
+ *
+ * At most getMaxBytes() of files are prefetched ahead of the frame being rendered. This can be set
+ * (in megabytes) with the OFX_IO_READ_AHEAD_SIZE environment variable (default is 256).
+ */
+class ReadAhead {
+public:
+    ReadAhead();
+
+    ~ReadAhead();
+
+    /// Guess the playback direction from the successive render times: 1 (forward), -1 (backward),
+    /// or 0 if the frames are not rendered in sequence.
+    int getDirection(double time, bool isPlayback);
+
+    /// Replace the files to prefetch by filenames, in the order they will be read.
+    void prefetch(const std::vector<std::string>& filenames);
+
+    static std::size_t getMaxBytes();
+
+private:
+    static void threadFunction(void* arg);
+    void loop();
+    void stopThread();
+
+    // read the file into the system cache, and return its size (or -1 if it cannot be read)
+    static long long prefetchFile(const std::string& filename);
+
+    // all members are protected by _mutex, except _done, which is only used by the thread
+    tthread::thread* _thread;
+    tthread::mutex _mutex;
+    tthread::condition_variable _cond; // signaled when the queue is replaced or the thread should quit
+    std::vector<std::string> _queue;
+    std::size_t _next; // index of the next file to prefetch in _queue
+    std::size_t _bytes; // size of the files of _queue that were already prefetched
+    unsigned long _generation; // incremented each time _queue is replaced
+    bool _quit;
+    double _lastTime;
+    int _direction;
+    std::list<std::pair<std::string, long long> > _done; // recently prefetched files and their sizes, most recent first
+};
+
+NAMESPACE_OFX_IO_EXIT
+NAMESPACE_OFX_EXIT
+
+#endif // IO_ReadAhead_h
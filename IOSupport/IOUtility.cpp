@@ -0,0 +1,75 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-io <https://github.com/NatronGitHub/openfx-io>,
+ * (C) 2018-2021 The Natron Developers
+ * (C) 2013-2018 INRIA
+ *
+ * openfx-io is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-io is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-io.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+/*
+ * OFX I/O utility functions that depend on the platform.
+ */
+
+#include "IOUtility.h"
+
+#include <sys/stat.h> // for stat()
+#include <sys/types.h>
+#if defined(_WIN32) || defined(__WIN32__) || defined(WIN32)
+#include <windows.h> // for MultiByteToWideChar()
+#endif
+
+using std::string;
+
+NAMESPACE_OFX_ENTER
+NAMESPACE_OFX_IO_ENTER
+
+#if defined(_WIN32) || defined(__WIN32__) || defined(WIN32)
+std::wstring
+utf8ToUtf16(const string& str)
+{
+    std::wstring native;
+
+    native.resize(MultiByteToWideChar(CP_UTF8, 0, str.c_str(), -1, NULL, 0));
+    MultiByteToWideChar(CP_UTF8, 0, str.c_str(), -1, &native[0], (int)native.size());
+
+    return native;
+}
+
+#endif
+
+bool
+getFileStamp(const string& path,
+             long long* mtime,
+             long long* size)
+{
+#if defined(_WIN32) || defined(__WIN32__) || defined(WIN32)
+    struct _stat64 st;
+    if (_wstat64(utf8ToUtf16(path).c_str(), &st) != 0) {
+        return false;
+    }
+#else
+    // on Unix platforms passing in UTF-8 works
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        return false;
+    }
+#endif
+    *mtime = (long long)st.st_mtime;
+    *size = (long long)st.st_size;
+
+    return true;
+}
+
+NAMESPACE_OFX_IO_EXIT
+NAMESPACE_OFX_EXIT
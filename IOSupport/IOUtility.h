@@ -98,6 +98,17 @@ extension(const std::string& filename)
     return ext;
 }
 
+#if defined(_WIN32) || defined(__WIN32__) || defined(WIN32)
+/// Convert an UTF-8 string (e.g. a file name) to UTF-16, for the wide-character Windows API.
+std::wstring utf8ToUtf16(const std::string& str);
+#endif
+
+/**
+ * @brief Get the modification time and size of a file, which the caches of the plug-ins use
+ * to notice that a file was overwritten in place. Returns false if the file can not be stat'ed.
+ **/
+bool getFileStamp(const std::string& path, long long* mtime, long long* size);
+
 /// numvals should be 256 for byte, 65536 for 16-bits, etc.
 template <int numvals>
 float
@@ -24,6 +24,8 @@
 
 #ifdef OFX_IO_USING_OCIO
 
+#include <algorithm>
+#include <cmath>
 #include <cstdio> // fopen...
 #include <fstream> // std::ofstream
 
@@ -99,6 +101,19 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kParamDirectionOptionForward "Forward", "", "forward"
 #define kParamDirectionOptionInverse "Inverse", "", "inverse"
 
+#define kParamStyle "style"
+#define kParamStyleLabel "Style"
+#define kParamStyleHint "Clamping behavior of the CDL, as in the OpenColorIO CDLTransform style."
+#define kParamStyleOptionASC "ASC", "ASC CDL v1.2: values are clamped to [0,1] after the slope/offset and after the saturation.", "asc"
+#define kParamStyleOptionNoClamp "No Clamp", "No value is clamped, and negative values are passed unchanged through the power function.", "noclamp"
+
+enum CDLStyleEnum
+{
+    eCDLStyleASC = 0,
+    eCDLStyleNoClamp,
+    eCDLStyleLegacy, // OCIO 1: only the power function clamps negative values, and only if it is not the identity
+};
+
 #define kParamReadFromFile "readFromFile"
 #define kParamReadFromFileLabel "Read from file"
 #define kParamReadFromFileHint \
@@ -129,6 +144,226 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 
 static bool gHostIsNatron = false; // TODO: generate a CCCId choice param kParamCCCIDChoice from available IDs
 
+// The CDL parameters at a given time, read once per render.
+struct CDLValues
+{
+    double slope[3];
+    double offset[3];
+    double power[3];
+    double saturation;
+    int direction;
+    CDLStyleEnum style;
+
+    CDLValues()
+        : saturation(-1)
+        , direction(-1)
+        , style(eCDLStyleASC)
+    {
+        for (int c = 0; c < 3; ++c) {
+            slope[c] = offset[c] = power[c] = -1;
+        }
+    }
+
+    bool operator==(const CDLValues& other) const
+    {
+        for (int c = 0; c < 3; ++c) {
+            if ((slope[c] != other.slope[c]) || (offset[c] != other.offset[c]) || (power[c] != other.power[c])) {
+                return false;
+            }
+        }
+
+        return saturation == other.saturation && direction == other.direction && style == other.style;
+    }
+
+    bool operator!=(const CDLValues& other) const { return !(*this == other); }
+
+    bool isPowerIdentity() const
+    {
+        return power[0] == 1. && power[1] == 1. && power[2] == 1.;
+    }
+
+    // a CDL with the ASC style always clamps, even with identity values
+    bool isIdentity() const
+    {
+        return (style != eCDLStyleASC
+                && slope[0] == 1. && slope[1] == 1. && slope[2] == 1.
+                && offset[0] == 0. && offset[1] == 0. && offset[2] == 0.
+                && isPowerIdentity()
+                && saturation == 1.);
+    }
+};
+
+// Native ASC CDL kernel: this is the same formula as the OCIO CDLTransform
+// (Rec.709 luma weights for the saturation), without building an OCIO processor
+// each time an animated grade changes.
+template <int nComponents>
+class CDLProcessor
+    : public PixelProcessor {
+public:
+    CDLProcessor(ImageEffect& instance)
+        : PixelProcessor(instance)
+        , _inverse(false)
+        , _style(eCDLStyleASC)
+        , _applyPower(false)
+        , _sat(1.f)
+    {
+        for (int c = 0; c < 3; ++c) {
+            _slope[c] = 1.f;
+            _offset[c] = 0.f;
+            _power[c] = 1.f;
+        }
+    }
+
+    // degenerate values (zero slope, power or saturation) cannot be inverted, and their inverse is set to zero
+    void setValues(const CDLValues& values)
+    {
+        _inverse = (values.direction != 0);
+        _style = values.style;
+        _applyPower = !values.isPowerIdentity();
+        for (int c = 0; c < 3; ++c) {
+            _offset[c] = (float)values.offset[c];
+            if (_inverse) {
+                _slope[c] = values.slope[c] != 0. ? (float)(1. / values.slope[c]) : 0.f;
+                _power[c] = values.power[c] != 0. ? (float)(1. / values.power[c]) : 0.f;
+            } else {
+                _slope[c] = (float)values.slope[c];
+                _power[c] = (float)values.power[c];
+            }
+        }
+        if (_inverse) {
+            _sat = values.saturation != 0. ? (float)(1. / values.saturation) : 0.f;
+        } else {
+            _sat = (float)values.saturation;
+        }
+    }
+
+private:
+    void multiThreadProcessImages(const OfxRectI& procWindow, const OfxPointD& rs) OVERRIDE FINAL
+    {
+        unused(rs);
+        assert(_dstBounds.x1 <= procWindow.x1 && procWindow.x1 <= procWindow.x2 && procWindow.x2 <= _dstBounds.x2);
+        assert(_dstBounds.y1 <= procWindow.y1 && procWindow.y1 <= procWindow.y2 && procWindow.y2 <= _dstBounds.y2);
+        switch (_style) {
+        case eCDLStyleASC:
+            _inverse ? processRows<eCDLStyleASC, true>(procWindow) : processRows<eCDLStyleASC, false>(procWindow);
+            break;
+        case eCDLStyleNoClamp:
+            _inverse ? processRows<eCDLStyleNoClamp, true>(procWindow) : processRows<eCDLStyleNoClamp, false>(procWindow);
+            break;
+        case eCDLStyleLegacy:
+            _inverse ? processRows<eCDLStyleLegacy, true>(procWindow) : processRows<eCDLStyleLegacy, false>(procWindow);
+            break;
+        }
+    }
+
+    template <CDLStyleEnum style, bool inverse>
+    void processRows(const OfxRectI& procWindow)
+    {
+        const int width = procWindow.x2 - procWindow.x1;
+
+        for (int y = procWindow.y1; y < procWindow.y2; ++y) {
+            if (_effect.abort()) {
+                break;
+            }
+
+            float* pix = (float*)((char*)_dstPixelData + (size_t)(y - _dstBounds.y1) * _dstRowBytes + (size_t)(procWindow.x1 - _dstBounds.x1) * nComponents * sizeof(float));
+            if (_applyPower) {
+                processRow<style, inverse, true>(pix, width);
+            } else {
+                processRow<style, inverse, false>(pix, width);
+            }
+        }
+    }
+
+    static float clamp01(float v)
+    {
+        return (std::min)((std::max)(v, 0.f), 1.f);
+    }
+
+    template <CDLStyleEnum style, bool applyPower>
+    static float power(float v, float p)
+    {
+        if (!applyPower) {
+            return v;
+        }
+        switch (style) {
+        case eCDLStyleASC:
+            return std::pow(v, p); // input is already in [0,1]
+        case eCDLStyleNoClamp:
+            return v > 0.f ? std::pow(v, p) : v;
+        case eCDLStyleLegacy:
+            return std::pow((std::max)(v, 0.f), p);
+        }
+
+        return v;
+    }
+
+    template <CDLStyleEnum style, bool inverse, bool applyPower>
+    void processRow(float* pix, int width)
+    {
+        const bool clamp = (style == eCDLStyleASC);
+        const float slope0 = _slope[0], slope1 = _slope[1], slope2 = _slope[2];
+        const float offset0 = _offset[0], offset1 = _offset[1], offset2 = _offset[2];
+        const float power0 = _power[0], power1 = _power[1], power2 = _power[2];
+        const float sat = _sat;
+
+        for (int x = 0; x < width; ++x, pix += nComponents) {
+            float r = pix[0];
+            float g = pix[1];
+            float b = pix[2];
+            if (!inverse) {
+                // slope, offset, power, saturation
+                r = r * slope0 + offset0;
+                g = g * slope1 + offset1;
+                b = b * slope2 + offset2;
+                if (clamp) {
+                    r = clamp01(r);
+                    g = clamp01(g);
+                    b = clamp01(b);
+                }
+                r = power<style, applyPower>(r, power0);
+                g = power<style, applyPower>(g, power1);
+                b = power<style, applyPower>(b, power2);
+            } else if (clamp) {
+                r = clamp01(r);
+                g = clamp01(g);
+                b = clamp01(b);
+            }
+            const float luma = 0.2126f * r + 0.7152f * g + 0.0722f * b;
+            r = luma + sat * (r - luma);
+            g = luma + sat * (g - luma);
+            b = luma + sat * (b - luma);
+            if (clamp) {
+                r = clamp01(r);
+                g = clamp01(g);
+                b = clamp01(b);
+            }
+            if (inverse) {
+                // inverse saturation, power, offset and slope
+                r = (power<style, applyPower>(r, power0) - offset0) * slope0;
+                g = (power<style, applyPower>(g, power1) - offset1) * slope1;
+                b = (power<style, applyPower>(b, power2) - offset2) * slope2;
+                if (clamp) {
+                    r = clamp01(r);
+                    g = clamp01(g);
+                    b = clamp01(b);
+                }
+            }
+            pix[0] = r;
+            pix[1] = g;
+            pix[2] = b;
+        }
+    }
+
+    bool _inverse;
+    CDLStyleEnum _style;
+    bool _applyPower;
+    float _slope[3]; // inverted for the inverse direction
+    float _offset[3];
+    float _power[3]; // inverted for the inverse direction
+    float _sat; // inverted for the inverse direction
+};
+
 class OCIOCDLTransformPlugin
     : public OCIOPluginBase {
 public:
@@ -170,7 +405,15 @@ private:
     void renderGPU(const RenderArguments& args);
 #endif
 
-    OCIO::ConstProcessorRcPtr getProcessor(OfxTime time);
+    // load the CDL file on the first render, if it was not already done by changedParam() or beginEdit()
+    void loadCDLFromFileIfFirstLoad();
+
+    void getValuesAtTime(double time, CDLValues* values);
+
+    static OCIO::CDLTransformRcPtr createCDLTransform(const CDLValues& values);
+
+    // the OCIO processor is only used by the OpenGL render
+    OCIO::ConstProcessorRcPtr getProcessor(const CDLValues& values);
 
     void refreshKnobEnabledState(bool readFromFile);
 
@@ -226,7 +469,7 @@ private:
                        BitDepthEnum dstBitDepth,
                        int dstRowBytes);
 
-    void apply(double time, const OfxRectI& renderWindow, const OfxPointD& renderScale, float* pixelData, const OfxRectI& bounds, PixelComponentEnum pixelComponents, int pixelComponentCount, int rowBytes);
+    void apply(const CDLValues& values, const OfxRectI& renderWindow, const OfxPointD& renderScale, float* pixelData, const OfxRectI& bounds, PixelComponentEnum pixelComponents, int pixelComponentCount, int rowBytes);
 
     void setupAndCopy(PixelProcessorFilterBase& processor,
                       double time,
@@ -256,6 +499,7 @@ private:
     RGBParam* _power;
     DoubleParam* _saturation;
     ChoiceParam* _direction;
+    ChoiceParam* _style;
     BooleanParam* _readFromFile;
     StringParam* _file;
     IntParam* _version;
@@ -267,17 +511,7 @@ private:
 
     GenericOCIO::Mutex _procMutex;
     OCIO::ConstProcessorRcPtr _proc;
-    double _procSlope_r;
-    double _procSlope_g;
-    double _procSlope_b;
-    double _procOffset_r;
-    double _procOffset_g;
-    double _procOffset_b;
-    double _procPower_r;
-    double _procPower_g;
-    double _procPower_b;
-    double _procSaturation;
-    int _procDirection;
+    CDLValues _procValues;
 
 #if defined(OFX_SUPPORTS_OPENGLRENDER)
     OCIOOpenGLContextData* _openGLContextData; // (OpenGL-only) - the single openGL context, in case the host does not support kNatronOfxImageEffectPropOpenGLContextData
@@ -295,6 +529,7 @@ OCIOCDLTransformPlugin::OCIOCDLTransformPlugin(OfxImageEffectHandle handle)
     , _power(NULL)
     , _saturation(NULL)
     , _direction(NULL)
+    , _style(NULL)
     , _readFromFile(NULL)
     , _file(NULL)
     , _version(NULL)
@@ -303,17 +538,7 @@ OCIOCDLTransformPlugin::OCIOCDLTransformPlugin(OfxImageEffectHandle handle)
     , _mix(NULL)
     , _maskApply(NULL)
     , _maskInvert(NULL)
-    , _procSlope_r(-1)
-    , _procSlope_g(-1)
-    , _procSlope_b(-1)
-    , _procOffset_r(-1)
-    , _procOffset_g(-1)
-    , _procOffset_b(-1)
-    , _procPower_r(-1)
-    , _procPower_g(-1)
-    , _procPower_b(-1)
-    , _procSaturation(-1)
-    , _procDirection(-1)
+    , _procValues()
 #if defined(OFX_SUPPORTS_OPENGLRENDER)
     , _openGLContextData(NULL)
 #endif
@@ -329,6 +554,7 @@ OCIOCDLTransformPlugin::OCIOCDLTransformPlugin(OfxImageEffectHandle handle)
     _power = fetchRGBParam(kParamPower);
     _saturation = fetchDoubleParam(kParamSaturation);
     _direction = fetchChoiceParam(kParamDirection);
+    _style = paramExists(kParamStyle) ? fetchChoiceParam(kParamStyle) : NULL;
     _readFromFile = fetchBooleanParam(kParamReadFromFile);
     _file = fetchStringParam(kParamFile);
     _version = fetchIntParam(kParamVersion);
@@ -501,8 +727,8 @@ OCIOCDLTransformPlugin::copyPixelData(bool unpremult,
     }
 } // OCIOCDLTransformPlugin::copyPixelData
 
-OCIO::ConstProcessorRcPtr
-OCIOCDLTransformPlugin::getProcessor(OfxTime time)
+void
+OCIOCDLTransformPlugin::loadCDLFromFileIfFirstLoad()
 {
     if (_firstLoad) {
         _firstLoad = false;
@@ -512,69 +738,79 @@ OCIOCDLTransformPlugin::getProcessor(OfxTime time)
             loadCDLFromFile();
         }
     }
+}
 
-    double slope_r, slope_g, slope_b;
-    _slope->getValueAtTime(time, slope_r, slope_g, slope_b);
-    double offset_r, offset_g, offset_b;
-    _offset->getValueAtTime(time, offset_r, offset_g, offset_b);
-    double power_r, power_g, power_b;
-    _power->getValueAtTime(time, power_r, power_g, power_b);
-    double saturation = _saturation->getValueAtTime(time);
-    int directioni = _direction->getValueAtTime(time);
+void
+OCIOCDLTransformPlugin::getValuesAtTime(double time,
+                                        CDLValues* values)
+{
+    _slope->getValueAtTime(time, values->slope[0], values->slope[1], values->slope[2]);
+    _offset->getValueAtTime(time, values->offset[0], values->offset[1], values->offset[2]);
+    _power->getValueAtTime(time, values->power[0], values->power[1], values->power[2]);
+    values->saturation = _saturation->getValueAtTime(time);
+    values->direction = _direction->getValueAtTime(time);
+#if OCIO_VERSION_HEX >= 0x02000000
+    values->style = _style ? (CDLStyleEnum)_style->getValueAtTime(time) : eCDLStyleNoClamp;
+#else
+    values->style = eCDLStyleLegacy;
+#endif
+}
 
-    try {
-        GenericOCIO::AutoMutex guard(_procMutex);
-        if (!_proc || (_procSlope_r != slope_r) || (_procSlope_g != slope_g) || (_procSlope_b != slope_b) || (_procOffset_r != offset_r) || (_procOffset_g != offset_g) || (_procOffset_b != offset_b) || (_procPower_r != power_r) || (_procPower_g != power_g) || (_procPower_b != power_b) || (_procSaturation != saturation) || (_procDirection != directioni)) {
-            AutoSetAndRestoreThreadLocale locale;
-            OCIO::ConstConfigRcPtr config = OCIO::GetCurrentConfig();
-            assert(config);
-            OCIO::CDLTransformRcPtr cc = OCIO::CDLTransform::Create();
+OCIO::CDLTransformRcPtr
+OCIOCDLTransformPlugin::createCDLTransform(const CDLValues& values)
+{
+    OCIO::CDLTransformRcPtr cc = OCIO::CDLTransform::Create();
 #if OCIO_VERSION_HEX >= 0x02000000
-            double sop[9] = {
-                slope_r,
-                slope_g,
-                slope_b,
-                offset_r,
-                offset_g,
-                offset_b,
-                power_r,
-                power_g,
-                power_b
-            };
+    double sop[9] = {
+        values.slope[0],
+        values.slope[1],
+        values.slope[2],
+        values.offset[0],
+        values.offset[1],
+        values.offset[2],
+        values.power[0],
+        values.power[1],
+        values.power[2]
+    };
 #else
-            float sop[9] = {
-                (float)slope_r,
-                (float)slope_g,
-                (float)slope_b,
-                (float)offset_r,
-                (float)offset_g,
-                (float)offset_b,
-                (float)power_r,
-                (float)power_g,
-                (float)power_b
-            };
+    float sop[9] = {
+        (float)values.slope[0],
+        (float)values.slope[1],
+        (float)values.slope[2],
+        (float)values.offset[0],
+        (float)values.offset[1],
+        (float)values.offset[2],
+        (float)values.power[0],
+        (float)values.power[1],
+        (float)values.power[2]
+    };
+#endif
+    cc->setSOP(sop);
+    cc->setSat((float)values.saturation);
+#if OCIO_VERSION_HEX >= 0x02000000
+    cc->setStyle(values.style == eCDLStyleASC ? OCIO::CDL_ASC : OCIO::CDL_NO_CLAMP);
 #endif
-            cc->setSOP(sop);
-            cc->setSat((float)saturation);
 
-            if (directioni == 0) {
-                cc->setDirection(OCIO::TRANSFORM_DIR_FORWARD);
-            } else {
-                cc->setDirection(OCIO::TRANSFORM_DIR_INVERSE);
-            }
+    if (values.direction == 0) {
+        cc->setDirection(OCIO::TRANSFORM_DIR_FORWARD);
+    } else {
+        cc->setDirection(OCIO::TRANSFORM_DIR_INVERSE);
+    }
+
+    return cc;
+}
 
-            _proc = config->getProcessor(cc);
-            _procSlope_r = slope_r;
-            _procSlope_g = slope_g;
-            _procSlope_b = slope_b;
-            _procOffset_r = offset_r;
-            _procOffset_g = offset_g;
-            _procOffset_b = offset_b;
-            _procPower_r = power_r;
-            _procPower_g = power_g;
-            _procPower_b = power_b;
-            _procSaturation = saturation;
-            _procDirection = directioni;
+OCIO::ConstProcessorRcPtr
+OCIOCDLTransformPlugin::getProcessor(const CDLValues& values)
+{
+    try {
+        GenericOCIO::AutoMutex guard(_procMutex);
+        if (!_proc || (_procValues != values)) {
+            AutoSetAndRestoreThreadLocale locale;
+            OCIO::ConstConfigRcPtr config = OCIO::GetCurrentConfig();
+            assert(config);
+            _proc = config->getProcessor(createCDLTransform(values));
+            _procValues = values;
         }
     } catch (const OCIO::Exception& e) {
         setPersistentMessage(Message::eMessageError, "", e.what());
@@ -585,7 +821,7 @@ OCIOCDLTransformPlugin::getProcessor(OfxTime time)
 } // getProecssor
 
 void
-OCIOCDLTransformPlugin::apply(double time,
+OCIOCDLTransformPlugin::apply(const CDLValues& values,
                               const OfxRectI& renderWindow,
                               const OfxPointD& renderScale,
                               float* pixelData,
@@ -598,21 +834,22 @@ OCIOCDLTransformPlugin::apply(double time,
     if ((renderWindow.x1 < bounds.x1) || (renderWindow.x1 >= bounds.x2) || (renderWindow.y1 < bounds.y1) || (renderWindow.y1 >= bounds.y2) || (renderWindow.x2 <= bounds.x1) || (renderWindow.x2 > bounds.x2) || (renderWindow.y2 <= bounds.y1) || (renderWindow.y2 > bounds.y2)) {
         throw std::runtime_error("OCIO: render window outside of image bounds");
     }
-    if ((pixelComponents != ePixelComponentRGBA) && (pixelComponents != ePixelComponentRGB)) {
+
+    if (pixelComponents == ePixelComponentRGBA) {
+        CDLProcessor<4> processor(*this);
+        processor.setDstImg(pixelData, bounds, pixelComponents, pixelComponentCount, eBitDepthFloat, rowBytes);
+        processor.setValues(values);
+        processor.setRenderWindow(renderWindow, renderScale);
+        processor.process();
+    } else if (pixelComponents == ePixelComponentRGB) {
+        CDLProcessor<3> processor(*this);
+        processor.setDstImg(pixelData, bounds, pixelComponents, pixelComponentCount, eBitDepthFloat, rowBytes);
+        processor.setValues(values);
+        processor.setRenderWindow(renderWindow, renderScale);
+        processor.process();
+    } else {
         throw std::runtime_error("OCIO: invalid components (only RGB and RGBA are supported)");
     }
-
-    OCIOProcessor processor(*this);
-    // set the images
-    processor.setDstImg(pixelData, bounds, pixelComponents, pixelComponentCount, eBitDepthFloat, rowBytes);
-
-    processor.setProcessor(getProcessor(time));
-
-    // set the render window
-    processor.setRenderWindow(renderWindow, renderScale);
-
-    // Call the base class process member, this will call the derived templated process code
-    processor.process();
 }
 
 #if defined(OFX_SUPPORTS_OPENGLRENDER)
@@ -748,7 +985,10 @@ OCIOCDLTransformPlugin::renderGPU(const RenderArguments& args)
         throwSuiteStatusException(kOfxStatFailed);
     }
 
-    OCIO::ConstProcessorRcPtr proc = getProcessor(args.time);
+    loadCDLFromFileIfFirstLoad();
+    CDLValues values;
+    getValuesAtTime(args.time, &values);
+    OCIO::ConstProcessorRcPtr proc = getProcessor(values);
     assert(proc);
 
     GenericOCIO::applyGL(srcImg.get(), proc, contextData);
@@ -848,7 +1088,10 @@ OCIOCDLTransformPlugin::render(const RenderArguments& args)
     copyPixelData(premult, false, false, args.time, args.renderWindow, args.renderScale, srcPixelData, bounds, pixelComponents, pixelComponentCount, bitDepth, srcRowBytes, tmpPixelData, args.renderWindow, pixelComponents, pixelComponentCount, bitDepth, tmpRowBytes);
 
     /// do the color-space conversion
-    apply(args.time, args.renderWindow, args.renderScale, tmpPixelData, args.renderWindow, pixelComponents, pixelComponentCount, tmpRowBytes);
+    loadCDLFromFileIfFirstLoad();
+    CDLValues values;
+    getValuesAtTime(args.time, &values);
+    apply(values, args.renderWindow, args.renderScale, tmpPixelData, args.renderWindow, pixelComponents, pixelComponentCount, tmpRowBytes);
 
     // copy the color-converted window
     copyPixelData(false, premult, true, args.time, args.renderWindow, args.renderScale, tmpPixelData, args.renderWindow, pixelComponents, pixelComponentCount, bitDepth, tmpRowBytes, dstImg.get());
@@ -861,72 +1104,12 @@ OCIOCDLTransformPlugin::isIdentity(const IsIdentityArguments& args,
                                    ,
                                    int& /*view*/, std::string& /*plane*/)
 {
-    const double time = args.time;
-    double saturation;
-    double slope_r, slope_g, slope_b;
-    _slope->getValueAtTime(time, slope_r, slope_g, slope_b);
-    double offset_r, offset_g, offset_b;
-    _offset->getValueAtTime(time, offset_r, offset_g, offset_b);
-    double power_r, power_g, power_b;
-    _power->getValueAtTime(time, power_r, power_g, power_b);
-    _saturation->getValueAtTime(time, saturation);
-    int _directioni;
-    _direction->getValueAtTime(time, _directioni);
-    string file;
-    _file->getValueAtTime(time, file);
-    string cccid;
-    _cccid->getValueAtTime(time, cccid);
-
-    try {
-        AutoSetAndRestoreThreadLocale locale;
-        OCIO::ConstConfigRcPtr config = OCIO::GetCurrentConfig();
-        if (!config) {
-            throw std::runtime_error("OCIO: no current config");
-        }
-        OCIO::CDLTransformRcPtr cc = OCIO::CDLTransform::Create();
-#if OCIO_VERSION_HEX >= 0x02000000
-        double sop[9] = {
-            slope_r,
-            slope_g,
-            slope_b,
-            offset_r,
-            offset_g,
-            offset_b,
-            power_r,
-            power_g,
-            power_b
-        };
-#else
-        float sop[9] = {
-            (float)slope_r,
-            (float)slope_g,
-            (float)slope_b,
-            (float)offset_r,
-            (float)offset_g,
-            (float)offset_b,
-            (float)power_r,
-            (float)power_g,
-            (float)power_b
-        };
-#endif
-        cc->setSOP(sop);
-        cc->setSat((float)saturation);
-
-        if (_directioni == 0) {
-            cc->setDirection(OCIO::TRANSFORM_DIR_FORWARD);
-        } else {
-            cc->setDirection(OCIO::TRANSFORM_DIR_INVERSE);
-        }
-
-        OCIO::ConstProcessorRcPtr proc = config->getProcessor(cc);
-        if (proc->isNoOp()) {
-            identityClip = _srcClip;
+    CDLValues values;
+    getValuesAtTime(args.time, &values);
+    if (values.isIdentity()) {
+        identityClip = _srcClip;
 
-            return true;
-        }
-    } catch (const std::exception& e) {
-        setPersistentMessage(Message::eMessageError, "", e.what());
-        throwSuiteStatusException(kOfxStatFailed);
+        return true;
     }
 
     double mix;
@@ -1068,17 +1251,8 @@ OCIOCDLTransformPlugin::changedParam(const InstanceChangedArgs& args,
                 std::fclose(file);
                 sendMessage(Message::eMessageError, "", string("File ") + exportName + " already exists, please select another filename");
             } else {
-                const double time = args.time;
-                double slope_r, slope_g, slope_b;
-                _slope->getValueAtTime(time, slope_r, slope_g, slope_b);
-                double offset_r, offset_g, offset_b;
-                _offset->getValueAtTime(time, offset_r, offset_g, offset_b);
-                double power_r, power_g, power_b;
-                _power->getValueAtTime(time, power_r, power_g, power_b);
-                double saturation;
-                _saturation->getValueAtTime(time, saturation);
-                int _directioni;
-                _direction->getValueAtTime(time, _directioni);
+                CDLValues values;
+                getValuesAtTime(args.time, &values);
 
                 try {
                     AutoSetAndRestoreThreadLocale locale;
@@ -1086,43 +1260,11 @@ OCIOCDLTransformPlugin::changedParam(const InstanceChangedArgs& args,
                     if (!config) {
                         throw std::runtime_error("OCIO: no current config");
                     }
-                    OCIO::CDLTransformRcPtr cc = OCIO::CDLTransform::Create();
-#if OCIO_VERSION_HEX >= 0x02000000
-                    double sop[9] = {
-                        slope_r,
-                        slope_g,
-                        slope_b,
-                        offset_r,
-                        offset_g,
-                        offset_b,
-                        power_r,
-                        power_g,
-                        power_b
-                    };
-#else
-                    float sop[9] = {
-                        (float)slope_r,
-                        (float)slope_g,
-                        (float)slope_b,
-                        (float)offset_r,
-                        (float)offset_g,
-                        (float)offset_b,
-                        (float)power_r,
-                        (float)power_g,
-                        (float)power_b
-                    };
-#endif
-                    cc->setSOP(sop);
-                    cc->setSat((float)saturation);
-
-                    if (_directioni == 0) {
-                        cc->setDirection(OCIO::TRANSFORM_DIR_FORWARD);
-                    } else {
-                        cc->setDirection(OCIO::TRANSFORM_DIR_INVERSE);
-                    }
+                    OCIO::CDLTransformRcPtr cc = createCDLTransform(values);
 
 #if OCIO_VERSION_HEX >= 0x02000000
                     OCIO::GroupTransformRcPtr g = OCIO::GroupTransform::Create();
+                    g->appendTransform(cc);
                     std::ofstream ofs;
                     ofs.open(exportName.c_str(), std::ofstream::out);
                     if (!ofs.is_open()) {
@@ -1288,6 +1430,21 @@ OCIOCDLTransformPluginFactory::describeInContext(ImageEffectDescriptor& desc,
             page->addChild(*param);
         }
     }
+#if OCIO_VERSION_HEX >= 0x02000000
+    {
+        ChoiceParamDescriptor* param = desc.defineChoiceParam(kParamStyle);
+        param->setLabel(kParamStyleLabel);
+        param->setHint(kParamStyleHint);
+        assert(param->getNOptions() == eCDLStyleASC);
+        param->appendOption(kParamStyleOptionASC);
+        assert(param->getNOptions() == eCDLStyleNoClamp);
+        param->appendOption(kParamStyleOptionNoClamp);
+        param->setDefault(eCDLStyleNoClamp); // the OCIO CDLTransform default
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+#endif
     {
         BooleanParamDescriptor* param = desc.defineBooleanParam(kParamReadFromFile);
         param->setLabel(kParamReadFromFileLabel);
@@ -759,6 +759,7 @@ OCIOColorSpacePluginFactory::describeInContext(ImageEffectDescriptor& desc,
     GenericOCIO::describeInContextInput(desc, context, page, OCIO::ROLE_REFERENCE);
     GenericOCIO::describeInContextOutput(desc, context, page, OCIO::ROLE_REFERENCE);
     GenericOCIO::describeInContextContext(desc, context, page);
+    GenericOCIO::describeInContextPrecision(desc, context, page);
     {
         PushButtonParamDescriptor* param = desc.definePushButtonParam(kOCIOHelpButton);
         param->setLabel(kOCIOHelpButtonLabel);
@@ -780,6 +780,7 @@ OCIODisplayPlugin::apply(double time,
     processor.setDstImg(pixelData, bounds, pixelComponents, pixelComponentCount, eBitDepthFloat, rowBytes);
 
     processor.setProcessor(getProcessor(time));
+    processor.setLutSize(_ocio->getLutSize(time));
 
     // set the render window
     processor.setRenderWindow(renderWindow, renderScale);
@@ -1276,6 +1277,7 @@ OCIODisplayPluginFactory::describeInContext(ImageEffectDescriptor& desc,
 #endif
 
     GenericOCIO::describeInContextContext(desc, context, page);
+    GenericOCIO::describeInContextPrecision(desc, context, page);
     {
         PushButtonParamDescriptor* param = desc.definePushButtonParam(kOCIOHelpDisplaysButton);
         param->setLabel(kOCIOHelpButtonLabel);
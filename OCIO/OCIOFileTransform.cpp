@@ -35,8 +35,14 @@
 #ifdef DEBUG
 #include <cstdio>
 #endif
+#include <algorithm>
+#include <cstdlib> // getenv
+#include <list>
+#include <set>
+#include <sstream>
 
 #include "GenericOCIO.h"
+#include "IOLRUCache.h"
 #include "IOUtility.h"
 #include "OCIOPluginBase.h"
 #include "ofxNatron.h"
@@ -45,6 +51,7 @@
 #include "ofxsMacros.h"
 #include "ofxsProcessing.H"
 #include "ofxsThreadSuite.h"
+#include "tinythread.h" // for tthread::thread and tthread::condition_variable
 
 namespace OCIO = OCIO_NAMESPACE;
 
@@ -85,6 +92,10 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kParamReloadHint "Reloads specified files"
 #define kParamVersion "version"
 
+#define kParamCacheInfo "lutCacheInfo"
+#define kParamCacheInfoLabel "Cache Info..."
+#define kParamCacheInfoHint "Display statistics (hits, misses, memory usage) about the LUT cache shared by all OCIOFileTransform nodes."
+
 #define kParamCCCID "cccId"
 #define kParamCCCIDLabel "CCC Id"
 #define kParamCCCIDHint "If the source file is an ASC CDL CCC (color correction collection), " \
@@ -107,6 +118,290 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 
 static bool gHostIsNatron = false; // TODO: generate a CCCId choice param kParamCCCIDChoice from available IDs
 
+/**
+ * @brief A process-wide cache of the processors built from transform files, shared by all instances.
+ *
+ * Holding the processor keeps the parsed file alive, so that OCIO::ClearAllCaches() (called when any
+ * OCIO node purges its caches or reloads a file) does not force every OCIOFileTransform to parse its LUT
+ * again. Entries are keyed by the OCIO config, the file path, the CCC Id, the direction and the
+ * interpolation, and they are validated by the file modification time and size. The memory used by an
+ * entry is estimated by the size of the file. Entries are evicted in LRU order when the budget is
+ * exceeded. The budget (in megabytes) can be set with the OFX_IO_OCIO_LUT_CACHE_SIZE environment variable.
+ * The cache also shares the budget of the MemoryGovernor with the other caches of the plugins.
+ **/
+class LUTCache {
+public:
+    static LUTCache& instance()
+    {
+        static LUTCache cache;
+
+        return cache;
+    }
+
+    // Return the processor for the given file transform, parsing the file if it is not in the cache.
+    // If another thread is already parsing the same file, wait for it instead of parsing it twice.
+    // Throws OCIO::Exception or std::exception on error.
+    OCIO::ConstProcessorRcPtr get(const string& file,
+                                  const string& cccid,
+                                  int directioni,
+                                  int interpolationi)
+    {
+        AutoSetAndRestoreThreadLocale locale;
+        OCIO::ConstConfigRcPtr config = OCIO::GetCurrentConfig();
+
+        if (!config) {
+            throw std::runtime_error("OCIO: No current config");
+        }
+        long long mtime = -1;
+        long long size = 0;
+        getFileStamp(file, &mtime, &size); // if the file can not be stat'ed (e.g. it is found in the config search path), the entry is never invalidated
+        std::ostringstream ss;
+        ss << config->getCacheID() << '|' << file << '|' << cccid << '|' << directioni << '|' << interpolationi;
+        const string key = ss.str();
+        {
+            tthread::lock_guard<tthread::mutex> guard(_mutex);
+            while ( _loading.count(key) ) {
+                _loadedCond.wait(guard);
+            }
+            Entry e;
+            if ( _entries.getIf(key, &e, [mtime, size](const Entry& cached) {
+                // else the file was modified
+                return (cached.mtime == mtime) && (cached.size == size);
+            }) ) {
+                return e.proc;
+            }
+            _loading.insert(key);
+        }
+
+        Entry e;
+        try {
+            e.proc = config->getProcessor(createTransform(file, cccid, directioni, interpolationi), OCIO::TRANSFORM_DIR_FORWARD);
+        } catch (...) {
+            tthread::lock_guard<tthread::mutex> guard(_mutex);
+            _loading.erase(key);
+            _loadedCond.notify_all();
+            throw;
+        }
+        e.file = file;
+        e.mtime = mtime;
+        e.size = size;
+        _entries.insert(key, e, (size_t)size);
+        {
+            tthread::lock_guard<tthread::mutex> guard(_mutex);
+            _loading.erase(key);
+            _loadedCond.notify_all();
+        }
+
+        return e.proc;
+    } // get
+
+    // forget all the processors built from this file, e.g. when the user asks to reload it
+    void erase(const string& file)
+    {
+        _entries.eraseIf([&file](const string&, const Entry& e) {
+            return e.file == file;
+        });
+    }
+
+    string getStatistics()
+    {
+        const EntryLRUCache::Stats stats = _entries.getStats();
+        std::ostringstream ss;
+        unsigned long long lookups = stats.hits + stats.misses;
+
+        ss << "LUT cache (shared by all OCIOFileTransform nodes):\n";
+        ss << "Hits: " << stats.hits << '\n';
+        ss << "Misses: " << stats.misses << '\n';
+        if (lookups > 0) {
+            ss << "Hit ratio: " << (int)(100. * stats.hits / lookups + 0.5) << "%\n";
+        }
+        ss << "Files: " << stats.entries << '\n';
+        ss << "Memory (estimated from the file sizes): " << (stats.bytes >> 20) << " MB / " << (_maxBytes >> 20) << " MB";
+
+        return ss.str();
+    }
+
+    static OCIO::FileTransformRcPtr createTransform(const string& file,
+                                                    const string& cccid,
+                                                    int directioni,
+                                                    int interpolationi)
+    {
+        OCIO::FileTransformRcPtr transform = OCIO::FileTransform::Create();
+
+        transform->setSrc(file.c_str());
+        transform->setCCCId(cccid.c_str());
+
+        if (directioni == 0) {
+            transform->setDirection(OCIO::TRANSFORM_DIR_FORWARD);
+        } else {
+            transform->setDirection(OCIO::TRANSFORM_DIR_INVERSE);
+        }
+
+        if (interpolationi == 0) {
+            transform->setInterpolation(OCIO::INTERP_NEAREST);
+        } else if (interpolationi == 1) {
+            transform->setInterpolation(OCIO::INTERP_LINEAR);
+        } else if (interpolationi == 2) {
+            transform->setInterpolation(OCIO::INTERP_TETRAHEDRAL);
+        } else if (interpolationi == 3) {
+            transform->setInterpolation(OCIO::INTERP_BEST);
+        } else {
+            // Should never happen
+            throw std::runtime_error("OCIO Interpolation value out of bounds");
+        }
+
+        return transform;
+    }
+
+private:
+    struct Entry {
+        string file;
+        long long mtime;
+        long long size;
+        OCIO::ConstProcessorRcPtr proc;
+    };
+
+    typedef LRUCache<string, Entry> EntryLRUCache;
+
+    LUTCache()
+        : _mutex()
+        , _loadedCond()
+        , _loading()
+        , _maxBytes( getMaxBytes() )
+        , _entries(_maxBytes ? 0 : 1, _maxBytes, "LUT files (OCIOFileTransform)", MemoryGovernor::ePriorityNormal) // a budget of 0 only keeps the last file
+    {
+    }
+
+    static size_t getMaxBytes()
+    {
+        const char* size = std::getenv("OFX_IO_OCIO_LUT_CACHE_SIZE");
+
+        if (size) {
+            long mb = std::atol(size);
+            if (mb >= 0) {
+                return (size_t)mb << 20;
+            }
+        }
+
+        return (size_t)512 << 20;
+    }
+
+    tthread::mutex _mutex; // protects _loading
+    tthread::condition_variable _loadedCond; // signaled when a file has finished loading
+    std::set<string> _loading; // the keys of the files that are being parsed
+    size_t _maxBytes;
+    EntryLRUCache _entries;
+};
+
+// a file to parse in the background, before the first render
+struct PreloadArgs {
+    string file;
+    string cccid;
+    int directioni;
+    int interpolationi;
+
+    bool operator==(const PreloadArgs& other) const
+    {
+        return (file == other.file) && (cccid == other.cccid) && (directioni == other.directioni) && (interpolationi == other.interpolationi);
+    }
+};
+
+/**
+ * @brief A background thread, shared by all instances, that parses the files given to push(), so that
+ * they are in the LUTCache at the first render.
+ *
+ * push() never waits for the previous file to be parsed, since it is called from changedParam on the main
+ * thread, and a large LUT on a network drive may take seconds to parse. A render that needs a file being
+ * parsed waits for it in LUTCache::get().
+ **/
+class LUTPreloader {
+public:
+    static LUTPreloader& instance()
+    {
+        static LUTPreloader preloader;
+
+        return preloader;
+    }
+
+    void push(const PreloadArgs& args)
+    {
+        tthread::lock_guard<tthread::mutex> guard(_mutex);
+
+        if (std::find(_queue.begin(), _queue.end(), args) != _queue.end()) {
+            return;
+        }
+        _queue.push_back(args);
+        if (!_thread) {
+            _thread = new tthread::thread(threadFunction, this);
+        }
+        _cond.notify_all();
+    }
+
+private:
+    LUTPreloader()
+        : _mutex()
+        , _cond()
+        , _queue()
+        , _thread(NULL)
+        , _quit(false)
+    {
+        // construct the cache first, so that it is destroyed after the thread that uses it
+        (void)LUTCache::instance();
+    }
+
+    ~LUTPreloader()
+    {
+        {
+            tthread::lock_guard<tthread::mutex> guard(_mutex);
+            _queue.clear();
+            _quit = true;
+            _cond.notify_all();
+        }
+        if (_thread) {
+            _thread->join();
+            delete _thread;
+        }
+    }
+
+    static void threadFunction(void* arg)
+    {
+        static_cast<LUTPreloader*>(arg)->loop();
+    }
+
+    void loop()
+    {
+        for (;;) {
+            PreloadArgs args;
+            {
+                tthread::lock_guard<tthread::mutex> guard(_mutex);
+                while (_queue.empty() && !_quit) {
+                    _cond.wait(guard);
+                }
+                if (_quit) {
+                    return;
+                }
+                args = _queue.front();
+                _queue.pop_front();
+            }
+            try {
+                OCIO::ConstProcessorRcPtr proc = LUTCache::instance().get(args.file, args.cccid, args.directioni, args.interpolationi);
+#if OCIO_VERSION_HEX >= 0x02000000
+                // also build the CPU processor, which each render would otherwise build
+                GenericOCIO::getCachedCPUProcessor(proc);
+#endif
+            } catch (...) {
+                // errors are reported by the render
+            }
+        }
+    }
+
+    tthread::mutex _mutex; // protects all the members below
+    tthread::condition_variable _cond; // signaled when a file is pushed, or when the thread should quit
+    std::list<PreloadArgs> _queue;
+    tthread::thread* _thread;
+    bool _quit;
+};
+
 class OCIOFileTransformPlugin
     : public OCIOPluginBase {
 public:
@@ -147,6 +442,9 @@ private:
 
     OCIO::ConstProcessorRcPtr getProcessor(OfxTime time);
 
+    // parse the file in the background, so that it is in the LUT cache at the first render
+    void preload();
+
     void updateCCCId();
 
     void copyPixelData(bool unpremult,
@@ -228,17 +526,11 @@ private:
     StringParam* _cccid;
     ChoiceParam* _direction;
     ChoiceParam* _interpolation;
+    ChoiceParam* _precision;
     DoubleParam* _mix;
     BooleanParam* _maskApply;
     BooleanParam* _maskInvert;
 
-    GenericOCIO::Mutex _procMutex;
-    OCIO::ConstProcessorRcPtr _proc;
-    string _procFile;
-    string _procCCCId;
-    int _procDirection;
-    int _procInterpolation;
-
 #if defined(OFX_SUPPORTS_OPENGLRENDER)
     OCIOOpenGLContextData* _openGLContextData; // (OpenGL-only) - the single openGL context, in case the host does not support kNatronOfxImageEffectPropOpenGLContextData
 #endif
@@ -254,11 +546,10 @@ OCIOFileTransformPlugin::OCIOFileTransformPlugin(OfxImageEffectHandle handle)
     , _cccid(NULL)
     , _direction(NULL)
     , _interpolation(NULL)
+    , _precision(NULL)
     , _mix(NULL)
     , _maskApply(NULL)
     , _maskInvert(NULL)
-    , _procDirection(-1)
-    , _procInterpolation(-1)
 #if defined(OFX_SUPPORTS_OPENGLRENDER)
     , _openGLContextData(NULL)
 #endif
@@ -274,7 +565,8 @@ OCIOFileTransformPlugin::OCIOFileTransformPlugin(OfxImageEffectHandle handle)
     _cccid = fetchStringParam(kParamCCCID);
     _direction = fetchChoiceParam(kParamDirection);
     _interpolation = fetchChoiceParam(kParamInterpolation);
-    assert(_file && _version && _cccid && _direction && _interpolation);
+    _precision = fetchChoiceParam(kOCIOParamPrecision);
+    assert(_file && _version && _cccid && _direction && _interpolation && _precision);
     _mix = fetchDoubleParam(kParamMix);
     _maskApply = paramExists(kParamMaskApply) ? fetchBooleanParam(kParamMaskApply) : 0;
     _maskInvert = fetchBooleanParam(kParamMaskInvert);
@@ -284,12 +576,28 @@ OCIOFileTransformPlugin::OCIOFileTransformPlugin(OfxImageEffectHandle handle)
 #endif
 
     updateCCCId();
+    preload();
 }
 
 OCIOFileTransformPlugin::~OCIOFileTransformPlugin()
 {
 }
 
+void
+OCIOFileTransformPlugin::preload()
+{
+    PreloadArgs args;
+
+    _file->getValue(args.file);
+    if (args.file.empty()) {
+        return;
+    }
+    _cccid->getValue(args.cccid);
+    _direction->getValue(args.directioni);
+    _interpolation->getValue(args.interpolationi);
+    LUTPreloader::instance().push(args);
+}
+
 /* set up and run a copy processor */
 void
 OCIOFileTransformPlugin::setupAndCopy(PixelProcessorFilterBase& processor,
@@ -447,52 +755,15 @@ OCIOFileTransformPlugin::getProcessor(OfxTime time)
     int directioni = _direction->getValueAtTime(time);
     int interpolationi = _interpolation->getValueAtTime(time);
 
+    OCIO::ConstProcessorRcPtr proc;
     try {
-        AutoSetAndRestoreThreadLocale locale;
-        OCIO::ConstConfigRcPtr config = OCIO::GetCurrentConfig();
-        if (!config) {
-            throw std::runtime_error("OCIO: No current config");
-        }
-        GenericOCIO::AutoMutex guard(_procMutex);
-        if (!_proc || (_procFile != file) || (_procCCCId != cccid) || (_procDirection != directioni) || (_procInterpolation != interpolationi)) {
-            OCIO::FileTransformRcPtr transform = OCIO::FileTransform::Create();
-            transform->setSrc(file.c_str());
-            transform->setCCCId(cccid.c_str());
-
-            if (directioni == 0) {
-                transform->setDirection(OCIO::TRANSFORM_DIR_FORWARD);
-            } else {
-                transform->setDirection(OCIO::TRANSFORM_DIR_INVERSE);
-            }
-
-            if (interpolationi == 0) {
-                transform->setInterpolation(OCIO::INTERP_NEAREST);
-            } else if (interpolationi == 1) {
-                transform->setInterpolation(OCIO::INTERP_LINEAR);
-            } else if (interpolationi == 2) {
-                transform->setInterpolation(OCIO::INTERP_TETRAHEDRAL);
-            } else if (interpolationi == 3) {
-                transform->setInterpolation(OCIO::INTERP_BEST);
-            } else {
-                // Should never happen
-                setPersistentMessage(Message::eMessageError, "", "OCIO Interpolation value out of bounds");
-                throwSuiteStatusException(kOfxStatFailed);
-
-                return _proc;
-            }
-
-            _proc = config->getProcessor(transform, OCIO::TRANSFORM_DIR_FORWARD);
-            _procFile = file;
-            _procCCCId = cccid;
-            _procDirection = directioni;
-            _procInterpolation = interpolationi;
-        }
+        proc = LUTCache::instance().get(file, cccid, directioni, interpolationi);
     } catch (const std::exception& e) {
         setPersistentMessage(Message::eMessageError, "", e.what());
         throwSuiteStatusException(kOfxStatFailed);
     }
 
-    return _proc;
+    return proc;
 } // getProcessor
 
 void
@@ -521,6 +792,7 @@ OCIOFileTransformPlugin::apply(double time,
     processor.setRenderWindow(renderWindow, renderScale);
 
     processor.setProcessor(getProcessor(time));
+    processor.setLutSize(GenericOCIO::getLutSize(_precision, time));
 
     // Call the base class process member, this will call the derived templated process code
     processor.process();
@@ -836,9 +1108,18 @@ OCIOFileTransformPlugin::changedParam(const InstanceChangedArgs& args,
     // are shown
     if (paramName == kParamFile) {
         updateCCCId();
+        preload();
+    } else if (((paramName == kParamCCCID) || (paramName == kParamDirection) || (paramName == kParamInterpolation)) && (args.reason == eChangeUserEdit)) {
+        preload();
     } else if ((paramName == kParamReload) && (args.reason == eChangeUserEdit)) {
+        string file;
+        _file->getValue(file);
+        LUTCache::instance().erase(file);
         _version->setValue(_version->getValue() + 1); // invalidate the node cache
         OCIO::ClearAllCaches();
+        preload();
+    } else if (paramName == kParamCacheInfo) {
+        sendMessage(Message::eMessageMessage, "", LUTCache::instance().getStatistics());
 #ifdef OFX_SUPPORTS_OPENGLRENDER
     } else if (paramEffectsOpenGLAndTileSupport(paramName) || paramName == kParamPremult) {
         setSupportsOpenGLAndTileInfoAtTime(args.time);
@@ -952,6 +1233,15 @@ OCIOFileTransformPluginFactory::describeInContext(ImageEffectDescriptor& desc,
         PushButtonParamDescriptor* param = desc.definePushButtonParam(kParamReload);
         param->setLabel(kParamReloadLabel);
         param->setHint(kParamReloadHint);
+        param->setLayoutHint(eLayoutHintNoNewLine, 1);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+    {
+        PushButtonParamDescriptor* param = desc.definePushButtonParam(kParamCacheInfo);
+        param->setLabel(kParamCacheInfoLabel);
+        param->setHint(kParamCacheInfoHint);
         if (page) {
             page->addChild(*param);
         }
@@ -995,6 +1285,7 @@ OCIOFileTransformPluginFactory::describeInContext(ImageEffectDescriptor& desc,
             page->addChild(*param);
         }
     }
+    GenericOCIO::describeInContextPrecision(desc, context, page);
 
 #if defined(OFX_SUPPORTS_OPENGLRENDER)
     OCIOPluginBase::defineEnableGPUParam(desc, page);
@@ -556,6 +556,7 @@ OCIOLookTransformPlugin::apply(double time,
     }
 
     processor.setProcessor(getProcessor(time, singleLook, lookCombination));
+    processor.setLutSize(_ocio->getLutSize(time));
 
     // set the images
     processor.setDstImg(pixelData, bounds, pixelComponents, pixelComponentCount, eBitDepthFloat, rowBytes);
@@ -1058,6 +1059,7 @@ OCIOLookTransformPluginFactory::describeInContext(ImageEffectDescriptor& desc,
     }
     GenericOCIO::describeInContextOutput(desc, context, page, OCIO::ROLE_REFERENCE);
     GenericOCIO::describeInContextContext(desc, context, page);
+    GenericOCIO::describeInContextPrecision(desc, context, page);
     {
         PushButtonParamDescriptor* param = desc.definePushButtonParam(kOCIOHelpLooksButton);
         param->setLabel(kOCIOHelpButtonLabel);
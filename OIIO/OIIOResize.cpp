@@ -24,7 +24,13 @@
 
 #include <algorithm>
 #include <cfloat> // DBL_MAX
+#include <climits> // INT_MAX
+#include <cmath>
+#include <cstring>
 #include <limits>
+#include <memory>
+#include <sstream>
+#include <vector>
 
 #include "ofxsMacros.h"
 
@@ -49,9 +55,11 @@ GCC_DIAG_ON(unused-parameter)
 #include "ofxsCoords.h"
 #include "ofxsCopier.h"
 #include "ofxsFormatResolution.h"
+#include "ofxsMultiThread.h"
 #include "ofxsProcessing.H"
 #include "ofxsThreadSuite.h"
 
+#include "IOLRUCache.h"
 #include "IOUtility.h"
 
 using namespace OFX;
@@ -62,19 +70,20 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 
 #define kPluginName "ResizeOIIO"
 #define kPluginGrouping "Transform"
-#define kPluginDescription "Resize input stream, using OpenImageIO.\n"                                                                                                                                                                                                                                               \
-                           "Note that only full images can be rendered, so it may be slower for interactive editing than the Reformat plugin.\n"                                                                                                                                                                     \
-                           "However, the rendering algorithms are different between Reformat and Resize: Resize applies 1-dimensional filters in the horizontal and vertical directins, whereas Reformat resamples the image, so in some cases this plugin may give more visually pleasant results than Reformat.\n" \
+#define kPluginDescription "Resize input stream, using OpenImageIO filters.\n"                                                                                                                                                                                                                                       \
+                           "Separable filters are applied by a tiled resize engine, which only renders the requested region; other filters need the full source image, so they may be slower for interactive editing than the Reformat plugin.\n"                                                                 \
+                           "The rendering algorithms are different between Reformat and Resize: Resize applies 1-dimensional filters in the horizontal and vertical directins, whereas Reformat resamples the image, so in some cases this plugin may give more visually pleasant results than Reformat.\n" \
                            "This plugin does not concatenate transforms (as opposed to Reformat)."
 
 #define kPluginIdentifier "fr.inria.openfx.OIIOResize"
 // History:
 // version 1.0: initial version
 // version 2.0: add the "default" filter, which is blackman-harris when increasing resolution, lanczos3 when decreasing resolution
+// version 2.1: tiled rendering with separable filters, support render scale
 #define kPluginVersionMajor 2 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 1 // Increment this when you have fixed a bug or made it faster.
 
-#define kSupportsTiles 0
+#define kSupportsTiles 1
 #define kSupportsMultiResolution 1
 #define kSupportsRenderScale 1
 #define kRenderThreadSafety eRenderFullySafe
@@ -120,6 +129,325 @@ enum ResizeTypeEnum {
 
 OIIO_NAMESPACE_USING
 
+// Names of the OIIO filters, indexed like the filter choice (minus the "impulse" option),
+// so that render does not loop over Filter2D::get_filterdesc each time
+static std::vector<FilterDesc>
+buildFilterDescs()
+{
+    const int num_filters = Filter2D::num_filters();
+    std::vector<FilterDesc> descs(num_filters);
+    for (int i = 0; i < num_filters; ++i) {
+        Filter2D::get_filterdesc(i, &descs[i]);
+    }
+
+    return descs;
+}
+
+static const std::vector<FilterDesc>&
+getFilterDescs()
+{
+    static const std::vector<FilterDesc> descs = buildFilterDescs();
+
+    return descs;
+}
+
+// Get the filter description for the filter choice (which includes "impulse" and "default").
+// Returns false for the impulse filter.
+static bool
+getFilter(int filter,
+          float wratio,
+          float hratio,
+          FilterDesc* fd)
+{
+    if (filter == 0) {
+        return false;
+    }
+    const std::vector<FilterDesc>& descs = getFilterDescs();
+    filter -= 1;
+    if (filter < (int)descs.size()) {
+        *fd = descs[filter];
+
+        return true;
+    }
+    // "default" filter
+    // No filter name supplied -- pick a good default
+    // see imgbufalgo_xform.cpp:477
+    const char* filtername = (wratio > 1.0f || hratio > 1.0f) ? "blackman-harris" : "lanczos3";
+    for (std::size_t i = 0; i < descs.size(); ++i) {
+        if (!strcmp(descs[i].name, filtername)) {
+            *fd = descs[i];
+
+            return true;
+        }
+    }
+    assert(!descs.empty());
+    *fd = descs[0];
+
+    return true;
+}
+
+/**
+ * @brief The 1D filter weights of a resize in one direction: each destination pixel is the
+ * weighted sum of consecutive source pixels. The source pixels are clamped to the source RoD.
+ **/
+struct ResizeWeights {
+    int dstBegin; // first destination pixel
+    std::vector<int> first; // for each destination pixel, the first source pixel
+    std::vector<int> count; // for each destination pixel, the number of source pixels
+    std::vector<std::size_t> offset; // for each destination pixel, the index of its first weight
+    std::vector<float> weights;
+};
+
+typedef std::shared_ptr<const ResizeWeights> ResizeWeightsPtr;
+
+// Compute the weights to resize the pixel range [srcBegin,srcEnd) to [dstBegin,dstEnd).
+// If filterName is NULL, use the nearest pixel (impulse filter).
+static ResizeWeightsPtr
+computeResizeWeights(const char* filterName,
+                     float filterWidth,
+                     int srcBegin,
+                     int srcEnd,
+                     int dstBegin,
+                     int dstEnd)
+{
+    assert(srcBegin < srcEnd && dstBegin < dstEnd);
+    std::shared_ptr<ResizeWeights> w = std::make_shared<ResizeWeights>();
+    const int n = dstEnd - dstBegin;
+    w->dstBegin = dstBegin;
+    w->first.resize(n);
+    w->count.resize(n);
+    w->offset.resize(n);
+
+    const double ratio = double(dstEnd - dstBegin) / double(srcEnd - srcBegin); // > 1 when increasing resolution
+    auto_ptr<Filter1D> filter;
+    if (filterName) {
+        filter.reset(Filter1D::create(filterName, filterWidth));
+    }
+    // the filter width is in destination pixels, convert the radius to source pixels
+    const double radius = filter.get() ? filterWidth / (2. * ratio) : 0.;
+    std::vector<float> taps;
+    for (int i = 0; i < n; ++i) {
+        // center of the destination pixel in source pixel coordinates
+        const double s = srcBegin + (i + 0.5) / ratio;
+        w->offset[i] = w->weights.size();
+        if (!filter.get()) {
+            w->first[i] = (std::max)(srcBegin, (std::min)((int)std::floor(s), srcEnd - 1));
+            w->count[i] = 1;
+            w->weights.push_back(1.f);
+            continue;
+        }
+        const int i1 = (std::max)(srcBegin, (std::min)((int)std::floor(s - radius), srcEnd - 1));
+        const int i2 = (std::max)(srcBegin, (std::min)((int)std::ceil(s + radius), srcEnd - 1));
+        taps.assign(i2 - i1 + 1, 0.f);
+        double total = 0.;
+        for (int j = (int)std::floor(s - radius); j <= (int)std::ceil(s + radius); ++j) {
+            const float weight = (*filter)((float)((j + 0.5 - s) * ratio));
+            if (weight == 0.f) {
+                continue;
+            }
+            // clamp to the edge pixels
+            const int k = (std::max)(srcBegin, (std::min)(j, srcEnd - 1)) - i1;
+            taps[k] += weight;
+            total += weight;
+        }
+        if (total == 0.) {
+            // may happen with very narrow filters: use the nearest pixel
+            w->first[i] = (std::max)(srcBegin, (std::min)((int)std::floor(s), srcEnd - 1));
+            w->count[i] = 1;
+            w->weights.push_back(1.f);
+            continue;
+        }
+        w->first[i] = i1;
+        w->count[i] = (int)taps.size();
+        for (std::size_t k = 0; k < taps.size(); ++k) {
+            w->weights.push_back((float)(taps[k] / total));
+        }
+    }
+
+    return w;
+} // computeResizeWeights
+
+/**
+ * @brief A process-wide cache of the resize weights, so that the same kernels are not recomputed
+ * for each frame, each render window and each direction of the resize.
+ **/
+class ResizeWeightsCache {
+public:
+    static ResizeWeightsCache& instance()
+    {
+        static ResizeWeightsCache cache;
+
+        return cache;
+    }
+
+    ResizeWeightsPtr get(const char* filterName,
+                         float filterWidth,
+                         int srcBegin,
+                         int srcEnd,
+                         int dstBegin,
+                         int dstEnd)
+    {
+        std::ostringstream ss;
+        ss << (filterName ? filterName : "impulse") << '|' << filterWidth << '|' << srcBegin << '|' << srcEnd << '|' << dstBegin << '|' << dstEnd;
+        const string key = ss.str();
+        ResizeWeightsPtr weights;
+        if ( _entries.get(key, &weights) ) {
+            return weights;
+        }
+
+        return _entries.insert( key, computeResizeWeights(filterName, filterWidth, srcBegin, srcEnd, dstBegin, dstEnd) );
+    }
+
+private:
+    ResizeWeightsCache()
+        : _entries(kMaxEntries, 0)
+    {
+    }
+
+    static const std::size_t kMaxEntries = 64;
+
+    IO::LRUCache<string, ResizeWeightsPtr> _entries;
+};
+
+// Horizontal pass of the separable resize: from the source image to a float buffer
+// covering the render window columns and the source rows needed by the vertical pass.
+template <typename PIX, int nComps>
+class ResizeRowsProcessor
+    : public PixelProcessor {
+public:
+    ResizeRowsProcessor(ImageEffect& instance)
+        : PixelProcessor(instance)
+        , _srcPixelData(NULL)
+        , _srcBounds()
+        , _srcRowBytes(0)
+        , _weights(NULL)
+    {
+    }
+
+    void setValues(const void* srcPixelData,
+                   const OfxRectI& srcBounds,
+                   int srcRowBytes,
+                   const ResizeWeights* weights)
+    {
+        _srcPixelData = srcPixelData;
+        _srcBounds = srcBounds;
+        _srcRowBytes = srcRowBytes;
+        _weights = weights;
+    }
+
+private:
+    void multiThreadProcessImages(const OfxRectI& procWindow, const OfxPointD& rs) OVERRIDE FINAL
+    {
+        unused(rs);
+        assert(_dstBounds.x1 <= procWindow.x1 && procWindow.x1 <= procWindow.x2 && procWindow.x2 <= _dstBounds.x2);
+        assert(_dstBounds.y1 <= procWindow.y1 && procWindow.y1 <= procWindow.y2 && procWindow.y2 <= _dstBounds.y2);
+        for (int y = procWindow.y1; y < procWindow.y2; ++y) {
+            if (_effect.abort()) {
+                break;
+            }
+
+            const PIX* srcRow = (const PIX*)((const char*)_srcPixelData + (size_t)(y - _srcBounds.y1) * _srcRowBytes);
+            float* dstPix = (float*)((char*)_dstPixelData + (size_t)(y - _dstBounds.y1) * _dstRowBytes + (size_t)(procWindow.x1 - _dstBounds.x1) * nComps * sizeof(float));
+            for (int x = procWindow.x1; x < procWindow.x2; ++x, dstPix += nComps) {
+                const int i = x - _weights->dstBegin;
+                const int first = _weights->first[i];
+                const int count = _weights->count[i];
+                const float* w = &_weights->weights[_weights->offset[i]];
+                float acc[nComps];
+                for (int c = 0; c < nComps; ++c) {
+                    acc[c] = 0.f;
+                }
+                for (int k = 0; k < count; ++k) {
+                    // the source image should cover the RoI, but clamp to its bounds anyway
+                    const int sx = (std::max)(_srcBounds.x1, (std::min)(first + k, _srcBounds.x2 - 1));
+                    const PIX* srcPix = srcRow + (size_t)(sx - _srcBounds.x1) * nComps;
+                    for (int c = 0; c < nComps; ++c) {
+                        acc[c] += w[k] * srcPix[c];
+                    }
+                }
+                for (int c = 0; c < nComps; ++c) {
+                    dstPix[c] = acc[c];
+                }
+            }
+        }
+    }
+
+    const void* _srcPixelData;
+    OfxRectI _srcBounds;
+    int _srcRowBytes;
+    const ResizeWeights* _weights;
+};
+
+// Vertical pass of the separable resize: from the float buffer of the horizontal pass to the destination image.
+template <typename PIX, int nComps, int maxValue>
+class ResizeColumnsProcessor
+    : public PixelProcessor {
+public:
+    ResizeColumnsProcessor(ImageEffect& instance)
+        : PixelProcessor(instance)
+        , _tmpPixelData(NULL)
+        , _tmpBounds()
+        , _tmpRowBytes(0)
+        , _weights(NULL)
+    {
+    }
+
+    void setValues(const float* tmpPixelData,
+                   const OfxRectI& tmpBounds,
+                   int tmpRowBytes,
+                   const ResizeWeights* weights)
+    {
+        _tmpPixelData = tmpPixelData;
+        _tmpBounds = tmpBounds;
+        _tmpRowBytes = tmpRowBytes;
+        _weights = weights;
+    }
+
+private:
+    void multiThreadProcessImages(const OfxRectI& procWindow, const OfxPointD& rs) OVERRIDE FINAL
+    {
+        unused(rs);
+        assert(_dstBounds.x1 <= procWindow.x1 && procWindow.x1 <= procWindow.x2 && procWindow.x2 <= _dstBounds.x2);
+        assert(_dstBounds.y1 <= procWindow.y1 && procWindow.y1 <= procWindow.y2 && procWindow.y2 <= _dstBounds.y2);
+        assert(_tmpBounds.x1 <= procWindow.x1 && procWindow.x2 <= _tmpBounds.x2);
+        const int width = procWindow.x2 - procWindow.x1;
+        std::vector<float> acc((size_t)width * nComps);
+        for (int y = procWindow.y1; y < procWindow.y2; ++y) {
+            if (_effect.abort()) {
+                break;
+            }
+
+            const int i = y - _weights->dstBegin;
+            const int first = _weights->first[i];
+            const int count = _weights->count[i];
+            const float* w = &_weights->weights[_weights->offset[i]];
+            std::fill(acc.begin(), acc.end(), 0.f);
+            for (int k = 0; k < count; ++k) {
+                const int sy = (std::max)(_tmpBounds.y1, (std::min)(first + k, _tmpBounds.y2 - 1));
+                const float* tmpPix = (const float*)((const char*)_tmpPixelData + (size_t)(sy - _tmpBounds.y1) * _tmpRowBytes) + (size_t)(procWindow.x1 - _tmpBounds.x1) * nComps;
+                const float wk = w[k];
+                for (int j = 0; j < width * nComps; ++j) {
+                    acc[j] += wk * tmpPix[j];
+                }
+            }
+            PIX* dstPix = (PIX*)((char*)_dstPixelData + (size_t)(y - _dstBounds.y1) * _dstRowBytes) + (size_t)(procWindow.x1 - _dstBounds.x1) * nComps;
+            for (int j = 0; j < width * nComps; ++j) {
+                if (maxValue == 1) {
+                    dstPix[j] = (PIX)acc[j];
+                } else {
+                    // round and clamp integer values
+                    dstPix[j] = (PIX)(std::max)(0.f, (std::min)(acc[j] + 0.5f, (float)maxValue));
+                }
+            }
+        }
+    }
+
+    const float* _tmpPixelData;
+    OfxRectI _tmpBounds;
+    int _tmpRowBytes;
+    const ResizeWeights* _weights;
+};
+
 class OIIOResizePlugin
     : public ImageEffect {
 public:
@@ -148,9 +476,12 @@ public:
     virtual void getClipPreferences(ClipPreferencesSetter& clipPreferences) OVERRIDE FINAL;
 
 private:
-    template <typename PIX, int nComps>
+    template <typename PIX, int nComps, int maxValue>
     void renderInternal(const RenderArguments& args, TypeDesc srcType, const Image* srcImg, TypeDesc dstType, Image* dstImg);
 
+    // the output RoD
+    bool computeRoD(double time, OfxRectD& rod);
+
     void fillWithBlack(PixelProcessorFilterBase& processor,
                        const OfxRectI& renderWindow,
                        const OfxPointD& renderScale,
@@ -265,15 +596,15 @@ OIIOResizePlugin::render(const RenderArguments& args)
         if (dstComponents == ePixelComponentRGBA) {
             switch (dstBitDepth) {
             case eBitDepthUByte: {
-                renderInternal<unsigned char, 4>(args, TypeDesc::UCHAR, src.get(), TypeDesc::UCHAR, dst.get());
+                renderInternal<unsigned char, 4, 255>(args, TypeDesc::UCHAR, src.get(), TypeDesc::UCHAR, dst.get());
                 break;
             }
             case eBitDepthUShort: {
-                renderInternal<unsigned short, 4>(args, TypeDesc::USHORT, src.get(), TypeDesc::USHORT, dst.get());
+                renderInternal<unsigned short, 4, 65535>(args, TypeDesc::USHORT, src.get(), TypeDesc::USHORT, dst.get());
                 break;
             }
             case eBitDepthFloat: {
-                renderInternal<float, 4>(args, TypeDesc::FLOAT, src.get(), TypeDesc::FLOAT, dst.get());
+                renderInternal<float, 4, 1>(args, TypeDesc::FLOAT, src.get(), TypeDesc::FLOAT, dst.get());
                 break;
             }
             default:
@@ -284,15 +615,15 @@ OIIOResizePlugin::render(const RenderArguments& args)
         } else if (dstComponents == ePixelComponentRGB) {
             switch (dstBitDepth) {
             case eBitDepthUByte: {
-                renderInternal<unsigned char, 3>(args, TypeDesc::UCHAR, src.get(), TypeDesc::UCHAR, dst.get());
+                renderInternal<unsigned char, 3, 255>(args, TypeDesc::UCHAR, src.get(), TypeDesc::UCHAR, dst.get());
                 break;
             }
             case eBitDepthUShort: {
-                renderInternal<unsigned short, 3>(args, TypeDesc::USHORT, src.get(), TypeDesc::USHORT, dst.get());
+                renderInternal<unsigned short, 3, 65535>(args, TypeDesc::USHORT, src.get(), TypeDesc::USHORT, dst.get());
                 break;
             }
             case eBitDepthFloat: {
-                renderInternal<float, 3>(args, TypeDesc::FLOAT, src.get(), TypeDesc::FLOAT, dst.get());
+                renderInternal<float, 3, 1>(args, TypeDesc::FLOAT, src.get(), TypeDesc::FLOAT, dst.get());
                 break;
             }
             default:
@@ -304,15 +635,15 @@ OIIOResizePlugin::render(const RenderArguments& args)
             assert(dstComponents == ePixelComponentAlpha);
             switch (dstBitDepth) {
             case eBitDepthUByte: {
-                renderInternal<unsigned char, 1>(args, TypeDesc::UCHAR, src.get(), TypeDesc::UCHAR, dst.get());
+                renderInternal<unsigned char, 1, 255>(args, TypeDesc::UCHAR, src.get(), TypeDesc::UCHAR, dst.get());
                 break;
             }
             case eBitDepthUShort: {
-                renderInternal<unsigned short, 1>(args, TypeDesc::USHORT, src.get(), TypeDesc::USHORT, dst.get());
+                renderInternal<unsigned short, 1, 65535>(args, TypeDesc::USHORT, src.get(), TypeDesc::USHORT, dst.get());
                 break;
             }
             case eBitDepthFloat: {
-                renderInternal<float, 1>(args, TypeDesc::FLOAT, src.get(), TypeDesc::FLOAT, dst.get());
+                renderInternal<float, 1, 1>(args, TypeDesc::FLOAT, src.get(), TypeDesc::FLOAT, dst.get());
                 break;
             }
             default:
@@ -403,88 +734,144 @@ OIIOResizePlugin::render(const RenderArguments& args)
     }
 } // OIIOResizePlugin::render
 
-template <typename PIX, int nComps>
+template <typename PIX, int nComps, int maxValue>
 void
-OIIOResizePlugin::renderInternal(const RenderArguments& /*args*/,
+OIIOResizePlugin::renderInternal(const RenderArguments& args,
                                  TypeDesc srcType,
                                  const Image* srcImg,
                                  TypeDesc dstType,
                                  Image* dstImg)
 {
-    ImageSpec srcSpec(srcType);
     const OfxRectI srcBounds = srcImg->getBounds();
-
-    srcSpec.x = srcBounds.x1;
-    srcSpec.y = srcBounds.y1;
-    srcSpec.width = srcBounds.x2 - srcBounds.x1;
-    srcSpec.height = srcBounds.y2 - srcBounds.y1;
-    srcSpec.nchannels = nComps;
-    srcSpec.full_x = srcSpec.x;
-    srcSpec.full_y = srcSpec.y;
-    srcSpec.full_width = srcSpec.width;
-    srcSpec.full_height = srcSpec.height;
-    srcSpec.default_channel_names();
-
-    const ImageBuf srcBuf("src", srcSpec, const_cast<void*>(srcImg->getPixelAddress(srcBounds.x1, srcBounds.y1)));
-
-    /// This code assumes that the dstImg has the target size hence that we don't support tiles
     const OfxRectI dstBounds = dstImg->getBounds();
-    ImageSpec dstSpec(dstType);
-    dstSpec.x = dstBounds.x1;
-    dstSpec.y = dstBounds.y1;
-    dstSpec.width = dstBounds.x2 - dstBounds.x1;
-    dstSpec.height = dstBounds.y2 - dstBounds.y1;
-    dstSpec.nchannels = nComps;
-    dstSpec.full_x = dstSpec.x;
-    dstSpec.full_y = dstSpec.y;
-    dstSpec.full_width = dstSpec.width;
-    dstSpec.full_height = dstSpec.height;
-    dstSpec.default_channel_names();
-
-    ImageBuf dstBuf("dst", dstSpec, dstImg->getPixelAddress(dstBounds.x1, dstBounds.y1));
-    int filter;
-    _filter->getValue(filter);
+    const PixelComponentEnum dstComponents = dstImg->getPixelComponents();
+    const BitDepthEnum dstBitDepth = dstImg->getPixelDepth();
 
-    if (filter == 0) {
-        /// Use nearest neighboor
-        if (!ImageBufAlgo::resample(dstBuf, srcBuf, /*interpolate*/ false, ROI::All(), MultiThread::getNumCPUs())) {
-            setPersistentMessage(Message::eMessageError, "", dstBuf.geterror());
+    // The resize maps the source RoD to the output RoD, in pixel coordinates at the render scale
+    OfxRectI srcRoDPixel, dstRoDPixel;
+    {
+        const OfxRectD srcRoD = _srcClip->getRegionOfDefinition(args.time);
+        Coords::toPixelEnclosing(srcRoD, args.renderScale, _srcClip->getPixelAspectRatio(), &srcRoDPixel);
+        OfxRectD dstRoD;
+        if (!computeRoD(args.time, dstRoD)) {
+            throwSuiteStatusException(kOfxStatFailed);
+
+            return;
         }
-    } else {
-        assert(srcSpec.full_width && srcSpec.full_height);
-        float wratio = float(dstSpec.full_width) / float(srcSpec.full_width);
-        float hratio = float(dstSpec.full_height) / float(srcSpec.full_height);
-        const int num_filters = Filter2D::num_filters();
-        /// interpolate using the selected filter
-        FilterDesc fd;
-        filter -= 1;
-        if (filter < num_filters) {
-            Filter2D::get_filterdesc(filter, &fd);
-        } else {
-            string filtername;
-            // "default" filter
-            // No filter name supplied -- pick a good default
-            // see imgbufalgo_xform.cpp:477
-            if (wratio > 1.0f || hratio > 1.0f) {
-                filtername = "blackman-harris";
-            } else {
-                filtername = "lanczos3";
-            }
-            filter = 0;
-            Filter2D::get_filterdesc(filter, &fd);
-            while (fd.name != filtername) {
-                ++filter;
-                Filter2D::get_filterdesc(filter, &fd);
-            }
+        Coords::toPixelEnclosing(dstRoD, args.renderScale, _dstClip->getPixelAspectRatio(), &dstRoDPixel);
+    }
+    OfxRectI renderWindow;
+    const bool hasSource = (srcRoDPixel.x1 < srcRoDPixel.x2) && (srcRoDPixel.y1 < srcRoDPixel.y2) &&
+                           (srcBounds.x1 < srcBounds.x2) && (srcBounds.y1 < srcBounds.y2);
+    if (!hasSource || !Coords::rectIntersection<OfxRectI>(args.renderWindow, dstRoDPixel, &renderWindow) ||
+        (renderWindow.x1 != args.renderWindow.x1) || (renderWindow.x2 != args.renderWindow.x2) ||
+        (renderWindow.y1 != args.renderWindow.y1) || (renderWindow.y2 != args.renderWindow.y2)) {
+        // pixels outside of the output RoD are black
+        BlackFiller<PIX> proc(*this, nComps);
+        fillWithBlack(proc, args.renderWindow, args.renderScale, dstImg->getPixelData(), dstBounds, dstComponents, nComps, dstBitDepth, dstImg->getRowBytes());
+        if (!hasSource || (renderWindow.x1 >= renderWindow.x2) || (renderWindow.y1 >= renderWindow.y2)) {
+            return;
         }
+    }
+
+    const float wratio = float(dstRoDPixel.x2 - dstRoDPixel.x1) / float(srcRoDPixel.x2 - srcRoDPixel.x1);
+    const float hratio = float(dstRoDPixel.y2 - dstRoDPixel.y1) / float(srcRoDPixel.y2 - srcRoDPixel.y1);
+    int filter_i;
+    _filter->getValue(filter_i);
+    FilterDesc fd;
+    const bool hasFilter = getFilter(filter_i, wratio, hratio, &fd);
+
+    if (hasFilter && !fd.separable) {
+        // Non-separable filters are applied by OIIO, on the region to render, from the full source image (see getRegionsOfInterest())
+        ImageSpec srcSpec(srcType);
+        srcSpec.x = srcBounds.x1;
+        srcSpec.y = srcBounds.y1;
+        srcSpec.width = srcBounds.x2 - srcBounds.x1;
+        srcSpec.height = srcBounds.y2 - srcBounds.y1;
+        srcSpec.nchannels = nComps;
+        srcSpec.full_x = srcRoDPixel.x1;
+        srcSpec.full_y = srcRoDPixel.y1;
+        srcSpec.full_width = srcRoDPixel.x2 - srcRoDPixel.x1;
+        srcSpec.full_height = srcRoDPixel.y2 - srcRoDPixel.y1;
+        srcSpec.default_channel_names();
+
+        const ImageBuf srcBuf("src", srcSpec, const_cast<void*>(srcImg->getPixelAddress(srcBounds.x1, srcBounds.y1)));
+
+        ImageSpec dstSpec(dstType);
+        dstSpec.x = dstBounds.x1;
+        dstSpec.y = dstBounds.y1;
+        dstSpec.width = dstBounds.x2 - dstBounds.x1;
+        dstSpec.height = dstBounds.y2 - dstBounds.y1;
+        dstSpec.nchannels = nComps;
+        dstSpec.full_x = dstRoDPixel.x1;
+        dstSpec.full_y = dstRoDPixel.y1;
+        dstSpec.full_width = dstRoDPixel.x2 - dstRoDPixel.x1;
+        dstSpec.full_height = dstRoDPixel.y2 - dstRoDPixel.y1;
+        dstSpec.default_channel_names();
+
+        ImageBuf dstBuf("dst", dstSpec, dstImg->getPixelAddress(dstBounds.x1, dstBounds.y1));
+
         // older versions of OIIO 1.2 don't have ImageBufAlgo::resize(dstBuf, srcBuf, fd.name, fd.width)
         float w = fd.width * (std::max)(1.0f, wratio);
         float h = fd.width * (std::max)(1.0f, hratio);
         auto_ptr<Filter2D> filter(Filter2D::create(fd.name, w, h));
 
-        if (!ImageBufAlgo::resize(dstBuf, srcBuf, filter.get(), ROI::All(), MultiThread::getNumCPUs())) {
+        ROI roi(renderWindow.x1, renderWindow.x2, renderWindow.y1, renderWindow.y2, 0, 1, 0, nComps);
+        if (!ImageBufAlgo::resize(dstBuf, srcBuf, filter.get(), roi, MultiThread::getNumCPUs())) {
             setPersistentMessage(Message::eMessageError, "", dstBuf.geterror());
         }
+
+        return;
+    }
+
+    // Separable resize: horizontal pass from the source rows needed by the render window to a float buffer,
+    // then vertical pass to the destination. The filter weights are cached (see ResizeWeightsCache).
+    const char* filterName = hasFilter ? fd.name : NULL;
+    ResizeWeightsPtr xWeights = ResizeWeightsCache::instance().get(filterName, hasFilter ? fd.width * (std::max)(1.0f, wratio) : 0.f,
+                                                                   srcRoDPixel.x1, srcRoDPixel.x2, dstRoDPixel.x1, dstRoDPixel.x2);
+    ResizeWeightsPtr yWeights = ResizeWeightsCache::instance().get(filterName, hasFilter ? fd.width * (std::max)(1.0f, hratio) : 0.f,
+                                                                   srcRoDPixel.y1, srcRoDPixel.y2, dstRoDPixel.y1, dstRoDPixel.y2);
+
+    // the source rows needed by the render window
+    OfxRectI tmpBounds;
+    tmpBounds.x1 = renderWindow.x1;
+    tmpBounds.x2 = renderWindow.x2;
+    tmpBounds.y1 = INT_MAX;
+    tmpBounds.y2 = INT_MIN;
+    for (int y = renderWindow.y1; y < renderWindow.y2; ++y) {
+        const int i = y - yWeights->dstBegin;
+        tmpBounds.y1 = (std::min)(tmpBounds.y1, yWeights->first[i]);
+        tmpBounds.y2 = (std::max)(tmpBounds.y2, yWeights->first[i] + yWeights->count[i]);
+    }
+    // the source image should cover the RoI, but clamp to its bounds anyway
+    tmpBounds.y1 = (std::max)(tmpBounds.y1, srcBounds.y1);
+    tmpBounds.y2 = (std::min)(tmpBounds.y2, srcBounds.y2);
+    if (tmpBounds.y1 >= tmpBounds.y2) {
+        tmpBounds.y1 = srcBounds.y1;
+        tmpBounds.y2 = srcBounds.y1 + 1;
+    }
+
+    const PixelComponentEnum tmpComponents = (nComps == 4) ? ePixelComponentRGBA : (nComps == 3) ? ePixelComponentRGB : ePixelComponentAlpha;
+    const int tmpRowBytes = (tmpBounds.x2 - tmpBounds.x1) * nComps * (int)sizeof(float);
+    ImageMemory mem((size_t)(tmpBounds.y2 - tmpBounds.y1) * tmpRowBytes, this);
+    float* tmpPixelData = (float*)mem.lock();
+
+    {
+        ResizeRowsProcessor<PIX, nComps> processor(*this);
+        processor.setDstImg(tmpPixelData, tmpBounds, tmpComponents, nComps, eBitDepthFloat, tmpRowBytes);
+        processor.setValues(srcImg->getPixelData(), srcBounds, srcImg->getRowBytes(), xWeights.get());
+        processor.setRenderWindow(tmpBounds, args.renderScale);
+        processor.process();
+    }
+    if (abort()) {
+        return;
+    }
+    {
+        ResizeColumnsProcessor<PIX, nComps, maxValue> processor(*this);
+        processor.setDstImg(dstImg->getPixelData(), dstBounds, dstComponents, nComps, dstBitDepth, dstImg->getRowBytes());
+        processor.setValues(tmpPixelData, tmpBounds, tmpRowBytes, yWeights.get());
+        processor.setRenderWindow(renderWindow, args.renderScale);
+        processor.process();
     }
 } // OIIOResizePlugin::renderInternal
 
@@ -648,8 +1035,8 @@ OIIOResizePlugin::changedClip(const InstanceChangedArgs& args,
 }
 
 bool
-OIIOResizePlugin::getRegionOfDefinition(const RegionOfDefinitionArguments& args,
-                                        OfxRectD& rod)
+OIIOResizePlugin::computeRoD(double time,
+                             OfxRectD& rod)
 {
     int type_i;
 
@@ -680,7 +1067,7 @@ OIIOResizePlugin::getRegionOfDefinition(const RegionOfDefinitionArguments& args,
         bool preservePar;
         _preservePAR->getValue(preservePar);
         if (preservePar) {
-            OfxRectD srcRoD = _srcClip->getRegionOfDefinition(args.time);
+            OfxRectD srcRoD = _srcClip->getRegionOfDefinition(time);
             double srcW = srcRoD.x2 - srcRoD.x1;
             double srcH = srcRoD.y2 - srcRoD.y1;
 
@@ -705,7 +1092,7 @@ OIIOResizePlugin::getRegionOfDefinition(const RegionOfDefinitionArguments& args,
 
     case eResizeTypeScale: {
         // scaled
-        OfxRectD srcRoD = _srcClip->getRegionOfDefinition(args.time);
+        OfxRectD srcRoD = _srcClip->getRegionOfDefinition(time);
         double sx, sy;
         _scale->getValue(sx, sy);
         srcRoD.x1 *= sx;
@@ -721,22 +1108,68 @@ OIIOResizePlugin::getRegionOfDefinition(const RegionOfDefinitionArguments& args,
     } // switch
 
     return true;
-} // OIIOResizePlugin::getRegionOfDefinition
+} // OIIOResizePlugin::computeRoD
+
+bool
+OIIOResizePlugin::getRegionOfDefinition(const RegionOfDefinitionArguments& args,
+                                        OfxRectD& rod)
+{
+    return computeRoD(args.time, rod);
+}
 
 // override the roi call
 void
 OIIOResizePlugin::getRegionsOfInterest(const RegionsOfInterestArguments& args,
                                        RegionOfInterestSetter& rois)
 {
-    if (!kSupportsTiles) {
+    if (!_srcClip || !_srcClip->isConnected()) {
+        return;
+    }
+    const OfxRectD srcRoD = _srcClip->getRegionOfDefinition(args.time);
+    OfxRectD dstRoD;
+    const double srcW = srcRoD.x2 - srcRoD.x1;
+    const double srcH = srcRoD.y2 - srcRoD.y1;
+    if (!kSupportsTiles || !computeRoD(args.time, dstRoD) || (srcW <= 0) || (srcH <= 0) ||
+        (dstRoD.x2 <= dstRoD.x1) || (dstRoD.y2 <= dstRoD.y1)) {
         // The effect requires full images to render any region
+        rois.setRegionOfInterest(*_srcClip, srcRoD);
 
-        if (_srcClip && _srcClip->isConnected()) {
-            OfxRectD srcRoD = _srcClip->getRegionOfDefinition(args.time);
-            rois.setRegionOfInterest(*_srcClip, srcRoD);
-        }
+        return;
     }
-}
+    const double dstW = dstRoD.x2 - dstRoD.x1;
+    const double dstH = dstRoD.y2 - dstRoD.y1;
+    const double srcPAR = _srcClip->getPixelAspectRatio();
+    const double dstPAR = _dstClip->getPixelAspectRatio();
+    const float wratio = (float)((dstW / dstPAR) / (srcW / srcPAR));
+    const float hratio = (float)(dstH / srcH);
+    int filter_i;
+    _filter->getValue(filter_i);
+    FilterDesc fd;
+    const bool hasFilter = getFilter(filter_i, wratio, hratio, &fd);
+    if (hasFilter && !fd.separable) {
+        // non-separable filters are applied by OIIO from the full image
+        rois.setRegionOfInterest(*_srcClip, srcRoD);
+
+        return;
+    }
+
+    // the filter radius in source pixels, plus one pixel for rounding
+    const double rx = (hasFilter ? fd.width / 2. * (std::max)(1., 1. / wratio) : 0.) + 1.;
+    const double ry = (hasFilter ? fd.width / 2. * (std::max)(1., 1. / hratio) : 0.) + 1.;
+    OfxRectD roi;
+    roi.x1 = srcRoD.x1 + (args.regionOfInterest.x1 - dstRoD.x1) * srcW / dstW - rx * srcPAR / args.renderScale.x;
+    roi.x2 = srcRoD.x1 + (args.regionOfInterest.x2 - dstRoD.x1) * srcW / dstW + rx * srcPAR / args.renderScale.x;
+    roi.y1 = srcRoD.y1 + (args.regionOfInterest.y1 - dstRoD.y1) * srcH / dstH - ry / args.renderScale.y;
+    roi.y2 = srcRoD.y1 + (args.regionOfInterest.y2 - dstRoD.y1) * srcH / dstH + ry / args.renderScale.y;
+    if (!Coords::rectIntersection<OfxRectD>(roi, srcRoD, &roi)) {
+        // outside of the source: ask for a minimal region
+        roi.x1 = srcRoD.x1;
+        roi.x2 = srcRoD.x1 + 1;
+        roi.y1 = srcRoD.y1;
+        roi.y2 = srcRoD.y1 + 1;
+    }
+    rois.setRegionOfInterest(*_srcClip, roi);
+} // OIIOResizePlugin::getRegionsOfInterest
 
 void
 OIIOResizePlugin::getClipPreferences(ClipPreferencesSetter& clipPreferences)
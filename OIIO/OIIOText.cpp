@@ -22,7 +22,11 @@
  * Write text on images using OIIO.
  */
 
+#include <algorithm>
 #include <cfloat> // DBL_MAX
+#include <memory>
+#include <sstream>
+#include <vector>
 
 #include "ofxsMacros.h"
 
@@ -49,6 +53,7 @@ GCC_DIAG_ON(unused-parameter)
 #include "ofxsProcessing.H"
 #include "ofxsThreadSuite.h"
 
+#include "IOLRUCache.h"
 #include "IOUtility.h"
 #include "ofxNatron.h"
 
@@ -63,15 +68,9 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 
 #define kPluginIdentifier "fr.inria.openfx.OIIOText"
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 1 // Increment this when you have fixed a bug or made it faster.
 
-#ifdef DEBUG
 #define kSupportsTiles 1
-#pragma message WARN("TextOIIO: tiles support is buggy - enabled in DEBUG mode")
-#else
-#define kSupportsTiles 0
-#pragma message WARN("TextOIIO: tiles support is buggy - disabled in  RELEASE mode")
-#endif
 #define kSupportsMultiResolution 1
 #define kSupportsRenderScale 1
 #define kRenderThreadSafety eRenderFullySafe
@@ -111,6 +110,211 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 
 static bool gHostSupportsDefaultCoordinateSystem = true; // for kParamDefaultsNormalised
 
+// The coverage of a rasterized text, in OIIO coordinates (y down) relative to the origin of the baseline.
+// The coverage does not depend on the text color or position, so that a moving text or a color change
+// does not need to rasterize the glyphs again.
+struct TextRaster {
+    int x; // column of the first coverage pixel
+    int y; // row of the first coverage pixel (negative above the baseline)
+    int width;
+    int height;
+    std::vector<float> coverage;
+};
+
+typedef std::shared_ptr<const TextRaster> TextRasterPtr;
+
+static TextRasterPtr
+rasterizeText(const string& text,
+              int fontSize,
+              const string& fontName,
+              const OfxRectI& maxBounds,
+              string* error)
+{
+    std::shared_ptr<TextRaster> raster = std::make_shared<TextRaster>();
+    raster->x = raster->y = raster->width = raster->height = 0;
+    const float one[1] = { 1.f };
+#if OIIO_VERSION >= 10800
+    unused(maxBounds);
+    OIIO::ROI roi = OIIO::ImageBufAlgo::text_size(text, fontSize, fontName);
+    if (!roi.defined() || (roi.width() <= 0) || (roi.height() <= 0)) {
+        return raster;
+    }
+    OIIO::ImageSpec spec(roi.width(), roi.height(), 1, OIIO::TypeDesc::FLOAT);
+    spec.x = roi.xbegin;
+    spec.y = roi.ybegin;
+    raster->coverage.assign((size_t)roi.width() * roi.height(), 0.f);
+    OIIO::ImageBuf buf("text", spec, &raster->coverage[0]);
+    if (!OIIO::ImageBufAlgo::render_text(buf, 0, 0, text, fontSize, fontName, one)) {
+        *error = buf.geterror();
+    }
+    raster->x = roi.xbegin;
+    raster->y = roi.ybegin;
+    raster->width = roi.width();
+    raster->height = roi.height();
+#else
+    // text_size() is not available: rasterize over the largest possible area, and keep the non-zero region
+    const int width = maxBounds.x2 - maxBounds.x1;
+    const int height = maxBounds.y2 - maxBounds.y1;
+    if ((width <= 0) || (height <= 0)) {
+        return raster;
+    }
+    OIIO::ImageSpec spec(width, height, 1, OIIO::TypeDesc::FLOAT);
+    spec.x = maxBounds.x1;
+    spec.y = maxBounds.y1;
+    std::vector<float> full((size_t)width * height, 0.f);
+    OIIO::ImageBuf buf("text", spec, &full[0]);
+    if (!OIIO::ImageBufAlgo::render_text(buf, 0, 0, text, fontSize, fontName, one)) {
+        *error = buf.geterror();
+    }
+    OIIO::ROI roi = OIIO::ImageBufAlgo::nonzero_region(buf);
+    if (!roi.defined() || (roi.width() <= 0) || (roi.height() <= 0)) {
+        return raster;
+    }
+    raster->x = roi.xbegin;
+    raster->y = roi.ybegin;
+    raster->width = roi.width();
+    raster->height = roi.height();
+    raster->coverage.resize((size_t)roi.width() * roi.height());
+    for (int j = 0; j < roi.height(); ++j) {
+        std::copy(&full[(size_t)(roi.ybegin + j - spec.y) * width + (roi.xbegin - spec.x)],
+                  &full[(size_t)(roi.ybegin + j - spec.y) * width + (roi.xbegin - spec.x)] + roi.width(),
+                  &raster->coverage[(size_t)j * roi.width()]);
+    }
+#endif
+
+    return raster;
+} // rasterizeText
+
+// Process-wide cache of rasterized texts, shared by all instances: slates and burn-ins
+// are usually the same on every frame, or change only by position or color.
+class TextRasterCache {
+public:
+    static TextRasterCache& instance()
+    {
+        static TextRasterCache cache;
+
+        return cache;
+    }
+
+    TextRasterPtr get(const string& text,
+                      int fontSize,
+                      const string& fontName,
+                      const OfxRectI& maxBounds,
+                      string* error)
+    {
+        std::ostringstream ss;
+        ss << fontSize << '|' << fontName << '|';
+#if OIIO_VERSION < 10800
+        // the raster is clipped to the area it was computed on
+        ss << maxBounds.x1 << '|' << maxBounds.y1 << '|' << maxBounds.x2 << '|' << maxBounds.y2 << '|';
+#endif
+        ss << text;
+        const string key = ss.str();
+        TextRasterPtr raster;
+        if ( _entries.get(key, &raster) ) {
+            return raster;
+        }
+        raster = rasterizeText(text, fontSize, fontName, maxBounds, error);
+        if ( !error->empty() ) {
+            // do not cache failures, e.g. a font that could not be found
+            return raster;
+        }
+
+        return _entries.insert(key, raster);
+    }
+
+private:
+    TextRasterCache()
+        : _entries(kMaxEntries, 0)
+    {
+    }
+
+    static const std::size_t kMaxEntries = 32;
+
+    IO::LRUCache<string, TextRasterPtr> _entries;
+};
+
+// Copies the source to the destination, and composites the text color over the pixels covered by the text.
+// OIIO's render_text does out = coverage * color + (1 - coverage) * in on each channel, and so does this.
+template <int nComps>
+class TextCompositeProcessor
+    : public PixelProcessor {
+public:
+    TextCompositeProcessor(ImageEffect& instance)
+        : PixelProcessor(instance)
+        , _srcImg(NULL)
+        , _raster(NULL)
+        , _originX(0)
+        , _originY(0)
+    {
+        for (int c = 0; c < 4; ++c) {
+            _color[c] = 0.f;
+        }
+    }
+
+    // originX, originY: the pixel of the baseline origin, in OFX pixel coordinates
+    void setValues(const Image* srcImg,
+                   const TextRaster* raster,
+                   int originX,
+                   int originY,
+                   const float color[4])
+    {
+        _srcImg = srcImg;
+        _raster = raster;
+        _originX = originX;
+        _originY = originY;
+        for (int c = 0; c < 4; ++c) {
+            _color[c] = color[c];
+        }
+    }
+
+private:
+    void multiThreadProcessImages(const OfxRectI& procWindow, const OfxPointD& rs) OVERRIDE FINAL
+    {
+        unused(rs);
+        // the text color, for the channels of the image
+        float color[nComps];
+        if (nComps == 1) {
+            color[0] = _color[3];
+        } else {
+            for (int c = 0; c < nComps; ++c) {
+                color[c] = _color[c];
+            }
+        }
+        for (int y = procWindow.y1; y < procWindow.y2; ++y) {
+            if (_effect.abort()) {
+                break;
+            }
+
+            float* dstPix = (float*)getDstPixelAddress(procWindow.x1, y);
+            assert(dstPix);
+            // the coverage row, if the text covers this line
+            const int j = (_originY - y) - _raster->y;
+            const float* coverageRow = ((_raster->height > 0) && (0 <= j) && (j < _raster->height)) ? &_raster->coverage[(size_t)j * _raster->width] : NULL;
+            for (int x = procWindow.x1; x < procWindow.x2; ++x, dstPix += nComps) {
+                const float* srcPix = (const float*)(_srcImg ? _srcImg->getPixelAddress(x, y) : NULL);
+                float alpha = 0.f;
+                if (coverageRow) {
+                    const int i = x - _originX - _raster->x;
+                    if ((0 <= i) && (i < _raster->width)) {
+                        alpha = coverageRow[i];
+                    }
+                }
+                for (int c = 0; c < nComps; ++c) {
+                    const float in = srcPix ? srcPix[c] : 0.f;
+                    dstPix[c] = (alpha == 0.f) ? in : (alpha * color[c] + (1.f - alpha) * in);
+                }
+            }
+        }
+    }
+
+    const Image* _srcImg;
+    const TextRaster* _raster;
+    int _originX;
+    int _originY;
+    float _color[4];
+};
+
 class OIIOTextPlugin
     : public ImageEffect {
 public:
@@ -137,7 +341,9 @@ public:
     // virtual void getRegionsOfInterest(const RegionsOfInterestArguments &args, RegionOfInterestSetter &rois) OVERRIDE FINAL;
 
 private:
-private:
+    template <int nComps>
+    void setupAndProcess(TextCompositeProcessor<nComps>& processor, const RenderArguments& args, const Image* srcImg, Image* dstImg, const TextRaster* raster, int originX, int originY, const float textColor[4]);
+
     // do not need to delete these, the ImageEffect is managing them for us
     Clip* _dstClip;
     Clip* _srcClip;
@@ -191,62 +397,6 @@ OIIOTextPlugin::~OIIOTextPlugin()
 {
 }
 
-static OIIO::ImageSpec
-imageSpecFromOFXImage(const OfxRectI& rod,
-                      const OfxRectI& bounds,
-                      PixelComponentEnum pixelComponents,
-                      BitDepthEnum bitDepth)
-{
-    OIIO::TypeDesc format;
-    switch (bitDepth) {
-    case eBitDepthUByte:
-        format = OIIO::TypeDesc::UINT8;
-        break;
-    case eBitDepthUShort:
-        format = OIIO::TypeDesc::UINT16;
-        break;
-    case eBitDepthHalf:
-        format = OIIO::TypeDesc::HALF;
-        break;
-    case eBitDepthFloat:
-        format = OIIO::TypeDesc::FLOAT;
-        break;
-    default:
-        throwSuiteStatusException(kOfxStatErrFormat);
-        break;
-    }
-    int nchannels = 0, alpha_channel = -1;
-    switch (pixelComponents) {
-    case ePixelComponentAlpha:
-        nchannels = 1;
-        alpha_channel = 0;
-        break;
-    case ePixelComponentRGB:
-        nchannels = 3;
-        break;
-    case ePixelComponentRGBA:
-        nchannels = 4;
-        alpha_channel = 3;
-        break;
-    default:
-        throwSuiteStatusException(kOfxStatErrFormat);
-        break;
-    }
-    OIIO::ImageSpec spec(format);
-    spec.x = bounds.x1;
-    spec.y = rod.y2 - bounds.y2;
-    spec.width = bounds.x2 - bounds.x1;
-    spec.height = bounds.y2 - bounds.y1;
-    spec.full_x = rod.x1;
-    spec.full_y = 0;
-    spec.full_width = rod.x2 - rod.x1;
-    spec.full_height = rod.y2 - rod.y1;
-    spec.nchannels = nchannels;
-    spec.alpha_channel = alpha_channel;
-
-    return spec;
-} // imageSpecFromOFXImage
-
 /* Override the render */
 void
 OIIOTextPlugin::render(const RenderArguments& args)
@@ -299,52 +449,11 @@ OIIOTextPlugin::render(const RenderArguments& args)
         // throw std::runtime_error("render window outside of image bounds");
     }
 
-    OfxRectI srcRod;
-    OfxRectI srcBounds;
-    PixelComponentEnum pixelComponents = ePixelComponentNone;
-    int pixelComponentCount = 0;
-    BitDepthEnum bitDepth = eBitDepthNone;
-    OIIO::ImageSpec srcSpec;
-    auto_ptr<const OIIO::ImageBuf> srcBuf;
-    OfxRectI dstRod = dstImg->getRegionOfDefinition();
     if (!srcImg.get()) {
         setPersistentMessage(Message::eMessageError, "", "Source needs to be connected");
         throwSuiteStatusException(kOfxStatFailed);
 
         return;
-    } else {
-        srcRod = srcImg->getRegionOfDefinition();
-        srcBounds = srcImg->getBounds();
-        pixelComponents = srcImg->getPixelComponents();
-        pixelComponentCount = srcImg->getPixelComponentCount();
-        bitDepth = srcImg->getPixelDepth();
-        srcSpec = imageSpecFromOFXImage(srcRod, srcBounds, pixelComponents, bitDepth);
-        srcBuf.reset(new OIIO::ImageBuf("src", srcSpec, const_cast<void*>(srcImg->getPixelData())));
-
-        if (!kSupportsTiles) {
-            // http://openfx.sourceforge.net/Documentation/1.3/ofxProgrammingReference.html#kOfxImageEffectPropSupportsTiles
-            //  If a clip or plugin does not support tiled images, then the host should supply full RoD images to the effect whenever it fetches one.
-            assert(srcRod.x1 == srcBounds.x1);
-            assert(srcRod.x2 == srcBounds.x2);
-            assert(srcRod.y1 == srcBounds.y1);
-            assert(srcRod.y2 == srcBounds.y2); // crashes on Natron if kSupportsTiles=0 & kSupportsMultiResolution=1
-            assert(dstRod.x1 == dstBounds.x1);
-            assert(dstRod.x2 == dstBounds.x2);
-            assert(dstRod.y1 == dstBounds.y1);
-            assert(dstRod.y2 == dstBounds.y2); // crashes on Natron if kSupportsTiles=0 & kSupportsMultiResolution=1
-        }
-        if (!kSupportsMultiResolution) {
-            // http://openfx.sourceforge.net/Documentation/1.3/ofxProgrammingReference.html#kOfxImageEffectPropSupportsMultiResolution
-            //   Multiple resolution images mean...
-            //    input and output images can be of any size
-            //    input and output images can be offset from the origin
-            assert(srcRod.x1 == 0);
-            assert(srcRod.y1 == 0);
-            assert(srcRod.x1 == dstRod.x1);
-            assert(srcRod.x2 == dstRod.x2);
-            assert(srcRod.y1 == dstRod.y1);
-            assert(srcRod.y2 == dstRod.y2); // crashes on Natron if kSupportsMultiResolution=0
-        }
     }
 
     double x, y;
@@ -363,91 +472,70 @@ OIIOTextPlugin::render(const RenderArguments& args)
     textColor[2] = (float)b;
     textColor[3] = (float)a;
 
-    // allocate temporary image
-    int pixelBytes = pixelComponentCount * getComponentBytes(bitDepth);
-    int tmpRowBytes = (args.renderWindow.x2 - args.renderWindow.x1) * pixelBytes;
-    size_t memSize = (args.renderWindow.y2 - args.renderWindow.y1) * tmpRowBytes;
-    ImageMemory mem(memSize, this);
-    float* tmpPixelData = (float*)mem.lock();
-    const bool flipit = true;
-    OIIO::ImageSpec tmpSpec = imageSpecFromOFXImage(srcImg.get() ? srcRod : args.renderWindow, args.renderWindow, pixelComponents, bitDepth);
-    assert(tmpSpec.width == args.renderWindow.x2 - args.renderWindow.x1);
-    assert(tmpSpec.width == args.renderWindow.x2 - args.renderWindow.x1);
-    assert(tmpSpec.height == args.renderWindow.y2 - args.renderWindow.y1);
-    OIIO::ROI srcRoi(tmpSpec.x, tmpSpec.x + tmpSpec.width, tmpSpec.y, tmpSpec.y + tmpSpec.height);
-    int ytext = int(y * args.renderScale.y);
-    if (flipit) {
-        // from the OIIO 1.5 release notes:
-        // Fixes, minor enhancements, and performance improvements:
-        // * ImageBufAlgo:
-        //   * flip(), flop(), flipflop() have been rewritten to work more
-        //     sensibly for cropped images. In particular, the transformation now
-        //     happens with respect to the display (full) window, rather than
-        //     simply flipping or flopping within the data window. (1.5.2)
-#if OIIO_VERSION >= 10502
-        // the transformation happens with respect to the display (full) window
-        tmpSpec.y = ((tmpSpec.full_y + tmpSpec.full_height - 1) - tmpSpec.y) - (tmpSpec.height - 1);
-        tmpSpec.full_y = 0;
-        ytext = (tmpSpec.full_y + tmpSpec.full_height - 1) - ytext;
-#else
-        // only the data window is flipped
-        ytext = tmpSpec.y + ((tmpSpec.y + tmpSpec.height - 1) - ytext);
-#endif
-    }
-    assert(tmpSpec.width == args.renderWindow.x2 - args.renderWindow.x1);
-    assert(tmpSpec.height == args.renderWindow.y2 - args.renderWindow.y1);
-    OIIO::ImageBuf tmpBuf("tmp", tmpSpec, tmpPixelData);
-
-    // do we have to flip the image?
-    if (!srcImg.get()) {
-        OIIO::ImageBufAlgo::zero(tmpBuf);
-    } else {
-        if (flipit) {
-            bool ok = OIIO::ImageBufAlgo::flip(tmpBuf, *srcBuf, srcRoi);
-            if (!ok) {
-                setPersistentMessage(Message::eMessageError, "", tmpBuf.geterror().c_str());
-                throwSuiteStatusException(kOfxStatFailed);
-            }
-        } else {
-            // copy the renderWindow from src to a temp buffer
-            tmpBuf.copy_pixels(*srcBuf);
-        }
-    }
-
-    // render text in the temp buffer
-    {
-        bool ok = OIIO::ImageBufAlgo::render_text(tmpBuf, int(x * args.renderScale.x), ytext, text, int(fontSize * args.renderScale.y), fontName, textColor);
-        if (!ok) {
-            setPersistentMessage(Message::eMessageError, "", tmpBuf.geterror().c_str());
+    // the origin of the baseline, in pixel coordinates at the current render scale
+    const int originX = int(x * args.renderScale.x);
+    const int originY = int(y * args.renderScale.y);
+
+    // the text is rasterized once for all tiles and frames (see TextRasterCache), and only the render window is composited
+    TextRasterPtr raster;
+    if (!text.empty()) {
+        // the area the text may cover, relative to the origin of the baseline, in OIIO coordinates (y down)
+        const OfxRectI dstRod = dstImg->getRegionOfDefinition();
+        OfxRectI maxBounds;
+        maxBounds.x1 = dstRod.x1 - originX;
+        maxBounds.x2 = dstRod.x2 - originX;
+        maxBounds.y1 = originY - dstRod.y2 + 1;
+        maxBounds.y2 = originY - dstRod.y1 + 1;
+        string error;
+        raster = TextRasterCache::instance().get(text, int(fontSize * args.renderScale.y), fontName, maxBounds, &error);
+        if (!error.empty()) {
+            setPersistentMessage(Message::eMessageError, "", error);
             // throwSuiteStatusException(kOfxStatFailed);
         }
     }
-    OIIO::ImageSpec dstSpec = imageSpecFromOFXImage(dstRod, dstBounds, pixelComponents, bitDepth);
-    OIIO::ImageBuf dstBuf("dst", dstSpec, dstImg->getPixelData());
-
-    OIIO::ROI tmpRoi(tmpSpec.x, tmpSpec.x + tmpSpec.width, tmpSpec.y, tmpSpec.y + tmpSpec.height);
-    // do we have to flip the image?
-    if (flipit) {
-        bool ok = OIIO::ImageBufAlgo::flip(dstBuf, tmpBuf, tmpRoi);
-        if (!ok) {
-            setPersistentMessage(Message::eMessageError, "", tmpBuf.geterror().c_str());
-            throwSuiteStatusException(kOfxStatFailed);
-        }
-    } else {
-        // copy the temp buffer to dstImg
-        // dstBuf.copy_pixels(tmpBuf); // erases everything out of tmpBuf!
-        bool ok = OIIO::ImageBufAlgo::paste(dstBuf, args.renderWindow.x1, srcRod.y2 - args.renderWindow.y2, 0, 0, tmpBuf, tmpRoi);
-        if (!ok) {
-            setPersistentMessage(Message::eMessageError, "", tmpBuf.geterror().c_str());
-            throwSuiteStatusException(kOfxStatFailed);
-        }
+    if (!raster) {
+        raster = std::make_shared<TextRaster>();
     }
 
-    // TODO: answer questions:
-    // - can we support tiling?
-    // - can we support multiresolution by just scaling the coordinates and the font size?
+    switch (dstImg->getPixelComponentCount()) {
+    case 1: {
+        TextCompositeProcessor<1> processor(*this);
+        setupAndProcess(processor, args, srcImg.get(), dstImg.get(), raster.get(), originX, originY, textColor);
+        break;
+    }
+    case 3: {
+        TextCompositeProcessor<3> processor(*this);
+        setupAndProcess(processor, args, srcImg.get(), dstImg.get(), raster.get(), originX, originY, textColor);
+        break;
+    }
+    case 4: {
+        TextCompositeProcessor<4> processor(*this);
+        setupAndProcess(processor, args, srcImg.get(), dstImg.get(), raster.get(), originX, originY, textColor);
+        break;
+    }
+    default:
+        throwSuiteStatusException(kOfxStatErrFormat);
+        break;
+    }
 } // OIIOTextPlugin::render
 
+template <int nComps>
+void
+OIIOTextPlugin::setupAndProcess(TextCompositeProcessor<nComps>& processor,
+                                const RenderArguments& args,
+                                const Image* srcImg,
+                                Image* dstImg,
+                                const TextRaster* raster,
+                                int originX,
+                                int originY,
+                                const float textColor[4])
+{
+    processor.setDstImg(dstImg);
+    processor.setValues(srcImg, raster, originX, originY, textColor);
+    processor.setRenderWindow(args.renderWindow, args.renderScale);
+    processor.process();
+}
+
 bool
 OIIOTextPlugin::isIdentity(const IsIdentityArguments& args,
                            Clip*& identityClip,
@@ -544,8 +632,8 @@ OIIOTextPluginFactory::describe(ImageEffectDescriptor& desc)
     desc.addSupportedBitDepth(eBitDepthHalf);
     desc.addSupportedBitDepth(eBitDepthFloat);
 
-    desc.setSupportsTiles(kSupportsTiles); // may be switched to true later?
-    desc.setSupportsMultiResolution(kSupportsMultiResolution); // may be switch to true later? don't forget to reduce font size too
+    desc.setSupportsTiles(kSupportsTiles);
+    desc.setSupportsMultiResolution(kSupportsMultiResolution);
     desc.setRenderThreadSafety(kRenderThreadSafety);
 
     desc.setOverlayInteractDescriptor(new PositionOverlayDescriptor<PositionInteractParam>);
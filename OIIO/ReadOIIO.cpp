@@ -23,9 +23,12 @@
  */
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <climits>
 #include <cmath>
 #include <cstddef>
+#include <cstdlib> // getenv
 #include <cstring> // memset
 #include <fstream>
 #include <iostream>
@@ -76,6 +79,7 @@ GCC_DIAG_ON(deprecated-declarations)
 
 #include "GenericOCIO.h"
 #include "GenericReader.h"
+#include "IOMemoryGovernor.h"
 #include "IOUtility.h"
 
 #include "ofxsMultiThread.h"
@@ -348,6 +352,17 @@ enum EdgePixelsEnum {
 #define kParamLibraryInfo "libraryInfo"
 #define kParamLibraryInfoLabel "OpenImageIO Info...", "Display information about the underlying library."
 
+#define kParamCacheInfo "cacheInfo"
+#define kParamCacheInfoLabel "Cache Info...", "Display statistics (memory, files, tiles, hits and misses) about the OpenImageIO ImageCache, which is used to read only the tiles covering the requested region of tiled images (e.g. tiled EXR or TIFF), and to keep them in memory.\n" \
+    "The cache is shared by all ReadOIIO nodes, so its settings are process-wide and are set with environment variables: " \
+    "OFX_IO_OIIO_CACHE_SIZE is the maximum amount of memory used by the cached tiles, in megabytes (default is 1024), " \
+    "OFX_IO_OIIO_CACHE_OPEN_FILES is the maximum number of files kept open by the cache (default is 100), " \
+    "and if OFX_IO_OIIO_CACHE_AUTOTILE is nonzero, untiled (scanline) images are also read through the cache, in tiles of this size (a power of 2, e.g. 64 or 128; default is 0, which means that only tiled images are read through the cache, since an untiled image would be cached as a whole)."
+
+#define kCacheMaxMemoryDefault 1024
+#define kCacheMaxOpenFilesDefault 100
+#define kCacheAutoTileDefault 0
+
 template <typename T>
 static inline void
 unused(const T&)
@@ -446,7 +461,8 @@ private:
                         const OfxRectI& bounds,
                         PixelComponentEnum pixelComponents,
                         int pixelComponentCount,
-                        int rowBytes) OVERRIDE FINAL
+                        int rowBytes,
+                        FusedColorConversion* /*colorConversion*/) OVERRIDE FINAL
     {
         string rawComps;
 
@@ -472,12 +488,28 @@ private:
                              PixelComponentEnum pixelComponents, PixelComponentEnum remappedComponents,
                              int pixelComponentCount, const string& rawComponents, int rowBytes) OVERRIDE FINAL;
 
+    virtual void decodePlanes(const string& filename, OfxTime time, int view, bool isPlayback, const OfxPointD& renderScale, const std::vector<PlaneToDecode>& planes) OVERRIDE FINAL;
+
+    // should the file be read through the ImageCache?
+    bool useCacheForFile(const string& filename, bool isPlayback) const;
+
+    // throws if the components cannot be read by this plugin
+    void checkPlaneComponents(PixelComponentEnum pixelComponents);
+
+    // get the subimage and the channels of the file to read for the given plane
+    void getPlaneChannels(const string& filename, int view, const vector<ImageSpec>& subimages, PixelComponentEnum pixelComponents, const string& rawComponents, vector<int>& channels, int& numChannels, int& subImageIndex);
+
+    // read the given channels of a subimage (see getPlaneChannels()) into pixelData
+    void decodeChannels(const string& filename, ImageInput* img, vector<ImageSpec>& subimages, int subImageIndex, int mipLevel, bool useCache, const OfxRectI& renderWindow, float* pixelData, const OfxRectI& bounds, int rowBytes, const vector<int>& channels, int numChannels);
+
     void getOIIOChannelIndexesFromLayerName(const string& filename, int view, const string& layerName, PixelComponentEnum pixelComponents, const vector<ImageSpec>& subimages, vector<int>& channels, int& numChannels, int& subImageIndex);
 
     void openFile(const string& filename, bool useCache, ImageInputPtr* img, vector<ImageSpec>* subimages);
 
     virtual bool getFrameBounds(const string& filename, OfxTime time, int view, OfxRectI* bounds, OfxRectI* format, double* par, string* error, int* tile_width, int* tile_height) OVERRIDE FINAL;
 
+    virtual unsigned int getNativeDecodeLevels(const string& filename, OfxTime time, int view, unsigned int levels) OVERRIDE FINAL;
+
     string metadata(const string& filename);
 
     void getSpecsFromImageInput(const ImageInputPtr& img, vector<ImageSpec>* subimages) const;
@@ -498,8 +530,11 @@ private:
     // retrieve the config used to open the file
     void getConfig(ImageSpec* config) const;
 
+    virtual void getDecodeCacheKey(double time, string* key) const OVERRIDE FINAL;
+
     //// OIIO image cache
     ImageCache* _cache;
+    bool _cacheAllFiles; // read all files through the cache, not only the tiled ones (e.g. Natron < 2.2)
 
     BooleanParam* _rawAutoBright;
     BooleanParam* _rawUseCameraWB;
@@ -536,6 +571,124 @@ private:
     LayersUnionVect _outputLayerMenu;
 };
 
+#ifdef OFX_READ_OIIO_USES_CACHE
+static int
+getEnvInt(const char* name,
+          int defaultValue)
+{
+    const char* value = std::getenv(name);
+
+    if ( !value || (value[0] == '\0') ) {
+        return defaultValue;
+    }
+
+    return std::atoi(value);
+}
+
+// The ImageCache settings apply to the whole process (the cache is shared by all instances,
+// and possibly by other plug-ins), so they are read from environment variables, and set once
+// when the plug-in is loaded.
+static void
+setCacheAttributes(ImageCache* cache)
+{
+    cache->attribute( "max_memory_MB", (float)(std::max)( 16, getEnvInt("OFX_IO_OIIO_CACHE_SIZE", kCacheMaxMemoryDefault) ) );
+    cache->attribute( "max_open_files", (std::max)( 1, getEnvInt("OFX_IO_OIIO_CACHE_OPEN_FILES", kCacheMaxOpenFilesDefault) ) );
+    cache->attribute( "autotile", (std::max)( 0, getEnvInt("OFX_IO_OIIO_CACHE_AUTOTILE", kCacheAutoTileDefault) ) );
+}
+#endif
+
+#ifdef OFX_READ_OIIO_SHARED_CACHE
+// The shared ImageCache as a client of the MemoryGovernor: OIIO keeps the tiles under max_memory_MB by
+// itself, but they also count in the memory budget shared with the caches of the other plug-ins.
+// The ImageCache does not tell which tiles are the least recently used, so it is flushed as a whole.
+class ImageCacheGovernorClient
+    : public MemoryGovernor::Client
+{
+public:
+    ImageCacheGovernorClient()
+        : _cache(NULL)
+        , _lastUse(0)
+        , _reportedBytes(0)
+    {
+    }
+
+    void init(ImageCache* cache)
+    {
+        _cache = cache;
+        MemoryGovernor::instance().add(this, "Tiles (ReadOIIO ImageCache)", MemoryGovernor::ePriorityNormal);
+    }
+
+    void deinit()
+    {
+        MemoryGovernor::instance().remove(this);
+        _cache = NULL;
+    }
+
+    // call after reading pixels through the cache, to report the tiles it loaded
+    void used()
+    {
+        _lastUse = (long long)std::chrono::steady_clock::now().time_since_epoch().count();
+        const std::size_t bytes = getMemoryBytes();
+        const std::size_t reportedBytes = _reportedBytes.exchange(bytes);
+        if (bytes > reportedBytes) {
+            MemoryGovernor::instance().grew(bytes - reportedBytes);
+        }
+    }
+
+    virtual std::size_t getMemoryBytes() OVERRIDE FINAL
+    {
+        long long bytes = 0;
+
+        if ( !_cache || !_cache->getattribute("stat:cache_memory_used", TypeDesc::INT64, &bytes) ) {
+            return 0;
+        }
+
+        return (bytes > 0) ? (std::size_t)bytes : 0;
+    }
+
+    virtual bool getOldestUse(std::chrono::steady_clock::time_point* lastUse) OVERRIDE FINAL
+    {
+        const long long ticks = _lastUse;
+
+        if ( (ticks == 0) || (getMemoryBytes() == 0) ) {
+            return false;
+        }
+        *lastUse = std::chrono::steady_clock::time_point( std::chrono::steady_clock::duration(ticks) );
+
+        return true;
+    }
+
+    virtual std::size_t evictOldest() OVERRIDE FINAL
+    {
+        const std::size_t bytes = getMemoryBytes();
+
+        if (bytes > 0) {
+            // safe even if tiles are being read: they are freed when released, and read again if needed
+            _cache->invalidate_all(true);
+        }
+        _reportedBytes = getMemoryBytes();
+
+        return (bytes > _reportedBytes) ? (bytes - _reportedBytes) : 0;
+    }
+
+    virtual void purge() OVERRIDE FINAL
+    {
+        if (_cache) {
+            _cache->invalidate_all(true);
+            _reportedBytes = getMemoryBytes();
+        }
+    }
+
+private:
+    ImageCache* _cache;
+    std::atomic<long long> _lastUse; // steady_clock ticks of the last read, 0 if never used
+    std::atomic<std::size_t> _reportedBytes; // the memory used at the last report to the governor
+};
+
+static ImageCacheGovernorClient gImageCacheGovernorClient;
+#endif
+
+
 ReadOIIOPlugin::ReadOIIOPlugin(OfxImageEffectHandle handle,
                                const vector<string>& extensions,
                                bool useOIIOCache) // does the host prefer images to be cached by OIIO (e.g. Natron < 2.2)?
@@ -547,6 +700,7 @@ ReadOIIOPlugin::ReadOIIOPlugin(OfxImageEffectHandle handle,
 #endif
                           )
     , _cache(NULL)
+    , _cacheAllFiles(useOIIOCache)
     , _outputLayer(NULL)
     , _outputLayerString(NULL)
     , _availableViews(NULL)
@@ -558,19 +712,20 @@ ReadOIIOPlugin::ReadOIIOPlugin(OfxImageEffectHandle handle,
     , _outputLayerMenu()
 {
 #ifdef OFX_READ_OIIO_USES_CACHE
-    if (useOIIOCache) {
+    // The cache is always used for tiled images, so that only the tiles covering the render window are read.
+    // Other images are only read through the cache if the host prefers it (useOIIOCache) or if autotile is set.
 #ifdef OFX_READ_OIIO_SHARED_CACHE
-        _cache = ImageCache::create(true); // shared cache
+    _cache = ImageCache::create(true); // shared cache
 #else
-        _cache = ImageCache::create(false); // non-shared cache
+    _cache = ImageCache::create(false); // non-shared cache
+    setCacheAttributes(_cache);
 #endif
-        // Always keep unassociated alpha.
-        // Don't let OIIO premultiply, because if the image is 8bits,
-        // it multiplies in 8bits (see TIFFInput::unassalpha_to_assocalpha()),
-        // which causes a lot of precision loss.
-        // see also https://github.com/OpenImageIO/oiio/issues/960
-        _cache->attribute("unassociatedalpha", 1);
-    }
+    // Always keep unassociated alpha.
+    // Don't let OIIO premultiply, because if the image is 8bits,
+    // it multiplies in 8bits (see TIFFInput::unassalpha_to_assocalpha()),
+    // which causes a lot of precision loss.
+    // see also https://github.com/OpenImageIO/oiio/issues/960
+    _cache->attribute("unassociatedalpha", 1);
 #endif
 
     if (gHostSupportsDynamicChoices && gHostSupportsMultiPlane) {
@@ -694,6 +849,12 @@ ReadOIIOPlugin::changedParam(const InstanceChangedArgs& args,
             ss << "Impossible to read image info:\nCould not read file " << filename << " corresponding to time " << args.time << '.';
         }
         sendMessage(Message::eMessageMessage, "", ss.str());
+    } else if (paramName == kParamCacheInfo) {
+        if (_cache) {
+            sendMessage(Message::eMessageMessage, "", _cache->getstats(2));
+        } else {
+            sendMessage(Message::eMessageMessage, "", "The OpenImageIO ImageCache is not used.");
+        }
     } else if (_outputLayerString && (paramName == kParamChannelOutputLayer)) {
         int index;
         _outputLayer->getValue(index);
@@ -1842,6 +2003,23 @@ ReadOIIOPlugin::guessParamsFromFilename(const string& filename,
     return true;
 } // ReadOIIOPlugin::guessParamsFromFilename
 
+void
+ReadOIIOPlugin::getDecodeCacheKey(double time,
+                                  string* key) const
+{
+    // the raw development settings and the display window handling change the decoded image
+    ImageSpec config;
+    std::ostringstream ss;
+
+    getConfig(&config);
+    for (ImageIOParameterList::const_iterator p = config.extra_attribs.begin(); p != config.extra_attribs.end(); ++p) {
+        ss << p->name() << '=' << config.metadata_val(*p) << ';';
+    }
+    ss << "offsetNegativeDispWindow=" << _offsetNegativeDispWindow->getValueAtTime(time) << ';';
+    ss << "edgePixels=" << _edgePixels->getValueAtTime(time) << ';';
+    *key += ss.str();
+}
+
 void
 ReadOIIOPlugin::getConfig(ImageSpec* config) const
 {
@@ -2205,73 +2383,57 @@ ReadOIIOPlugin::getOIIOChannelIndexesFromLayerName(const string& filename,
     } // switch
 } // ReadOIIOPlugin::getOIIOChannelIndexesFromLayerName
 
-void
-ReadOIIOPlugin::decodePlane(const string& filename,
-                            OfxTime /*time*/,
-                            int view,
-                            bool isPlayback,
-                            const OfxRectI& renderWindow,
-                            const OfxPointD& renderScale,
-                            float* pixelData,
-                            const OfxRectI& bounds,
-                            PixelComponentEnum pixelComponents,
-                            PixelComponentEnum remappedComponents,
-                            int pixelComponentCount,
-                            const string& rawComponents,
-                            int rowBytes)
+bool
+ReadOIIOPlugin::useCacheForFile(const string& filename,
+                                bool isPlayback) const
 {
-    assert(renderScale.x == 1. && renderScale.y == 1.);
-    unused(renderScale);
-    unused(pixelComponentCount);
 #if OIIO_VERSION >= 10605
     // Use cache only if not during playback because the OIIO cache eats too much RAM when playing scaline-based EXRs.
     // Do not use cache in OIIO 1.5.x because it does not support channel ranges correctly.
-    const bool useCache = _cache && !isPlayback;
+    bool useCache = _cache && !isPlayback;
+    if (useCache && !_cacheAllFiles) {
+        // Read tiled images through the cache, so that only the tiles covering the render window are read,
+        // and kept for the next render windows. Untiled images would be cached as a whole, unless autotile is set.
+        int autotile = 0;
+        _cache->getattribute("autotile", autotile);
+        if (autotile == 0) {
+            vector<ImageSpec> cachedSpecs;
+            getSpecsFromCache(filename, &cachedSpecs);
+            useCache = !cachedSpecs.empty() && (cachedSpecs[0].tile_width != 0);
+        }
+    }
 #else
+    unused(filename);
+    unused(isPlayback);
     const bool useCache = false;
 #endif
 
-    // assert(kSupportsTiles || (renderWindow.x1 == 0 && renderWindow.x2 == spec.full_width && renderWindow.y1 == 0 && renderWindow.y2 == spec.full_height));
-    // assert((renderWindow.x2 - renderWindow.x1) <= spec.width && (renderWindow.y2 - renderWindow.y1) <= spec.height);
-    assert(bounds.x1 <= renderWindow.x1 && renderWindow.x1 <= renderWindow.x2 && renderWindow.x2 <= bounds.x2);
-    assert(bounds.y1 <= renderWindow.y1 && renderWindow.y1 <= renderWindow.y2 && renderWindow.y2 <= bounds.y2);
+    return useCache;
+}
 
+void
+ReadOIIOPlugin::checkPlaneComponents(PixelComponentEnum pixelComponents)
+{
     // we only support RGBA, RGB or Alpha output clip on the color plane
     if ((pixelComponents != ePixelComponentRGBA) && (pixelComponents != ePixelComponentRGB) && (pixelComponents != ePixelComponentXY) && (pixelComponents != ePixelComponentAlpha)
         && (pixelComponents != ePixelComponentCustom)) {
         setPersistentMessage(Message::eMessageError, "", "OIIO: can only read RGBA, RGB, RG, Alpha or custom components images");
         throwSuiteStatusException(kOfxStatErrFormat);
-
-        return;
-    }
-
-    vector<int> channels;
-    int numChannels = 0;
-#if OIIO_PLUGIN_VERSION >= 22
-    ImageInputPtr img;
-#else
-    auto_ptr<ImageInput> img;
-#endif
-    vector<ImageSpec> subimages;
-
-    ImageInputPtr rawImg = 0;
-    openFile(filename, useCache, &rawImg, &subimages);
-    if (rawImg) {
-#if OIIO_PLUGIN_VERSION >= 22
-        img.swap(rawImg);
-#else
-        img.reset(rawImg);
-#endif
-    }
-
-    if (subimages.empty()) {
-        setPersistentMessage(Message::eMessageError, "", string("Cannot open file ") + filename);
-        throwSuiteStatusException(kOfxStatFailed);
-
-        return;
     }
+}
 
-    int subImageIndex = 0;
+void
+ReadOIIOPlugin::getPlaneChannels(const string& filename,
+                                 int view,
+                                 const vector<ImageSpec>& subimages,
+                                 PixelComponentEnum pixelComponents,
+                                 const string& rawComponents,
+                                 vector<int>& channels,
+                                 int& numChannels,
+                                 int& subImageIndex)
+{
+    subImageIndex = 0;
+    numChannels = 0;
     if (pixelComponents != ePixelComponentCustom) {
         if (!_outputLayer) { // host is not multilayer nor anything, just use basic indexes
             switch (pixelComponents) {
@@ -2365,8 +2527,27 @@ ReadOIIOPlugin::decodePlane(const string& filename,
         }
     }
 #endif
+#ifndef OFX_EXTENSIONS_NATRON
+    unused(rawComponents);
+#endif
+} // ReadOIIOPlugin::getPlaneChannels
 
-    if (img.get() && !img->seek_subimage(subImageIndex, 0, subimages[0])) {
+void
+ReadOIIOPlugin::decodeChannels(const string& filename,
+                               ImageInput* img,
+                               vector<ImageSpec>& subimages,
+                               int subImageIndex,
+                               int mipLevel,
+                               bool useCache,
+                               const OfxRectI& renderWindow,
+                               float* pixelData,
+                               const OfxRectI& bounds,
+                               int rowBytes,
+                               const vector<int>& channels,
+                               int numChannels)
+{
+    ImageSpec subImageSpec;
+    if (img && !img->seek_subimage(subImageIndex, 0, subImageSpec)) {
         stringstream ss;
         ss << "Cannot seek subimage " << subImageIndex << " in " << filename;
         setPersistentMessage(Message::eMessageError, "", ss.str());
@@ -2378,8 +2559,22 @@ ReadOIIOPlugin::decodePlane(const string& filename,
     bool offsetNegativeDisplayWindow;
     _offsetNegativeDispWindow->getValue(offsetNegativeDisplayWindow);
 
+    // the spec of the mipmap level, whose pixel coordinates are those of the renderWindow
+    ImageSpec mipSpec;
+    if (mipLevel > 0) {
+        bool gotMipSpec = img ? img->seek_subimage(subImageIndex, mipLevel, mipSpec) : _cache->get_imagespec(ustring(filename), mipSpec, subImageIndex, mipLevel);
+        if (!gotMipSpec) {
+            stringstream ss;
+            ss << "Cannot seek mipmap level " << mipLevel << " of subimage " << subImageIndex << " in " << filename;
+            setPersistentMessage(Message::eMessageError, "", ss.str());
+            throwSuiteStatusException(kOfxStatFailed);
+
+            return;
+        }
+    }
+
     // Non const because ImageSpec::valid_tile_range is not const...
-    ImageSpec& spec = subimages[subImageIndex];
+    ImageSpec& spec = (mipLevel > 0) ? mipSpec : subimages[subImageIndex];
 
     // Compute X offset as done in getFrameBounds
     int dataOffset = 0;
@@ -2519,7 +2714,7 @@ ReadOIIOPlugin::decodePlane(const string& filename,
             if (_cache && useCache) {
                 gotPixels = _cache->get_pixels(ustring(filename),
                                                subImageIndex, // subimage
-                                               0, // miplevel
+                                               mipLevel, // miplevel
                                                xbegin, // x begin
                                                xend, // x end
                                                ybegin, // y begin
@@ -2545,6 +2740,9 @@ ReadOIIOPlugin::decodePlane(const string& filename,
 
                     return;
                 }
+#ifdef OFX_READ_OIIO_SHARED_CACHE
+                gImageCacheGovernorClient.used();
+#endif
             }
             if (!gotPixels) { // !useCache
                 assert(kSupportsTiles || (!kSupportsTiles && (renderWindow.x2 - renderWindow.x1) == spec.width && (renderWindow.y2 - renderWindow.y1) == spec.height));
@@ -2692,12 +2890,259 @@ ReadOIIOPlugin::decodePlane(const string& filename,
             } // !useCache
         } // if (channels[i] < kXChannelFirst) {
     } // for (std::size_t i = 0; i < channels.size(); i+=incr) {
+} // ReadOIIOPlugin::decodeChannels
+
+void
+ReadOIIOPlugin::decodePlane(const string& filename,
+                            OfxTime /*time*/,
+                            int view,
+                            bool isPlayback,
+                            const OfxRectI& renderWindow,
+                            const OfxPointD& renderScale,
+                            float* pixelData,
+                            const OfxRectI& bounds,
+                            PixelComponentEnum pixelComponents,
+                            PixelComponentEnum /*remappedComponents*/,
+                            int pixelComponentCount,
+                            const string& rawComponents,
+                            int rowBytes)
+{
+    // renderScale is not 1 if getNativeDecodeLevels() returned a mipmap level
+    assert(renderScale.x == renderScale.y);
+    const int mipLevel = (renderScale.x < 1.) ? (int)getLevelFromScale(renderScale.x) : 0;
+    unused(pixelComponentCount);
+    const bool useCache = useCacheForFile(filename, isPlayback);
+
+    // assert(kSupportsTiles || (renderWindow.x1 == 0 && renderWindow.x2 == spec.full_width && renderWindow.y1 == 0 && renderWindow.y2 == spec.full_height));
+    // assert((renderWindow.x2 - renderWindow.x1) <= spec.width && (renderWindow.y2 - renderWindow.y1) <= spec.height);
+    assert(bounds.x1 <= renderWindow.x1 && renderWindow.x1 <= renderWindow.x2 && renderWindow.x2 <= bounds.x2);
+    assert(bounds.y1 <= renderWindow.y1 && renderWindow.y1 <= renderWindow.y2 && renderWindow.y2 <= bounds.y2);
+
+    checkPlaneComponents(pixelComponents);
+
+#if OIIO_PLUGIN_VERSION >= 22
+    ImageInputPtr img;
+#else
+    auto_ptr<ImageInput> img;
+#endif
+    vector<ImageSpec> subimages;
+
+    ImageInputPtr rawImg = 0;
+    openFile(filename, useCache, &rawImg, &subimages);
+    if (rawImg) {
+#if OIIO_PLUGIN_VERSION >= 22
+        img.swap(rawImg);
+#else
+        img.reset(rawImg);
+#endif
+    }
+
+    if (subimages.empty()) {
+        setPersistentMessage(Message::eMessageError, "", string("Cannot open file ") + filename);
+        throwSuiteStatusException(kOfxStatFailed);
+
+        return;
+    }
+
+    vector<int> channels;
+    int numChannels = 0;
+    int subImageIndex = 0;
+    getPlaneChannels(filename, view, subimages, pixelComponents, rawComponents, channels, numChannels, subImageIndex);
+
+    decodeChannels(filename, img.get(), subimages, subImageIndex, mipLevel, useCache, renderWindow, pixelData, bounds, rowBytes, channels, numChannels);
 
     if (!useCache) {
         img->close();
     }
 } // ReadOIIOPlugin::decodePlane
 
+void
+ReadOIIOPlugin::decodePlanes(const string& filename,
+                             OfxTime time,
+                             int view,
+                             bool isPlayback,
+                             const OfxPointD& renderScale,
+                             const std::vector<PlaneToDecode>& planes)
+{
+    if (planes.size() <= 1) {
+        GenericReaderPlugin::decodePlanes(filename, time, view, isPlayback, renderScale, planes);
+
+        return;
+    }
+
+    // renderScale is not 1 if getNativeDecodeLevels() returned a mipmap level
+    assert(renderScale.x == renderScale.y);
+    const int mipLevel = (renderScale.x < 1.) ? (int)getLevelFromScale(renderScale.x) : 0;
+    const bool useCache = useCacheForFile(filename, isPlayback);
+
+    for (std::size_t i = 0; i < planes.size(); ++i) {
+        checkPlaneComponents(planes[i].comps);
+    }
+
+    // open the file once for all planes
+#if OIIO_PLUGIN_VERSION >= 22
+    ImageInputPtr img;
+#else
+    auto_ptr<ImageInput> img;
+#endif
+    vector<ImageSpec> subimages;
+
+    ImageInputPtr rawImg = 0;
+    openFile(filename, useCache, &rawImg, &subimages);
+    if (rawImg) {
+#if OIIO_PLUGIN_VERSION >= 22
+        img.swap(rawImg);
+#else
+        img.reset(rawImg);
+#endif
+    }
+
+    if (subimages.empty()) {
+        setPersistentMessage(Message::eMessageError, "", string("Cannot open file ") + filename);
+        throwSuiteStatusException(kOfxStatFailed);
+
+        return;
+    }
+
+    vector<vector<int> > planeChannels(planes.size());
+    vector<int> planeNumChannels(planes.size(), 0);
+    vector<int> planeSubImage(planes.size(), 0);
+    for (std::size_t i = 0; i < planes.size(); ++i) {
+        getPlaneChannels(filename, view, subimages, planes[i].comps, planes[i].rawComps, planeChannels[i], planeNumChannels[i], planeSubImage[i]);
+    }
+
+    // The planes that are in the same subimage and have the same render window are decoded together:
+    // the union of their channel ranges is read once into a temporary buffer (so that each chunk of the file
+    // is decompressed only once), and the channels are then distributed to the buffer of each plane.
+    vector<bool> decoded(planes.size(), false);
+    for (std::size_t i = 0; i < planes.size(); ++i) {
+        if (decoded[i]) {
+            continue;
+        }
+        const OfxRectI& renderWindow = planes[i].renderWindow;
+        const int subImageIndex = planeSubImage[i];
+        vector<std::size_t> group;
+        int chbegin = INT_MAX; // first file channel of the group
+        int chend = 0; // last file channel of the group + 1
+        for (std::size_t j = i; j < planes.size(); ++j) {
+            const OfxRectI& rw = planes[j].renderWindow;
+            if (decoded[j] || (planeSubImage[j] != subImageIndex) ||
+                (rw.x1 != renderWindow.x1) || (rw.y1 != renderWindow.y1) || (rw.x2 != renderWindow.x2) || (rw.y2 != renderWindow.y2)) {
+                continue;
+            }
+            group.push_back(j);
+            decoded[j] = true;
+            for (std::size_t c = 0; c < planeChannels[j].size(); ++c) {
+                if (planeChannels[j][c] >= kXChannelFirst) {
+                    chbegin = (std::min)(chbegin, planeChannels[j][c] - kXChannelFirst);
+                    chend = (std::max)(chend, planeChannels[j][c] - kXChannelFirst + 1);
+                }
+            }
+        }
+
+        if ((group.size() == 1) || (chend <= chbegin)) {
+            // nothing to share: decode directly to the plane buffers
+            for (std::size_t g = 0; g < group.size(); ++g) {
+                const PlaneToDecode& plane = planes[group[g]];
+                decodeChannels(filename, img.get(), subimages, subImageIndex, mipLevel, useCache, plane.renderWindow, plane.pixelData, plane.bounds, plane.rowBytes, planeChannels[group[g]], planeNumChannels[group[g]]);
+            }
+            continue;
+        }
+
+        const int numChannels = chend - chbegin;
+        vector<int> channels(numChannels);
+        for (int c = 0; c < numChannels; ++c) {
+            channels[c] = chbegin + c + kXChannelFirst;
+        }
+        const int tmpRowBytes = (renderWindow.x2 - renderWindow.x1) * numChannels * (int)sizeof(float);
+        const size_t memSize = (size_t)(renderWindow.y2 - renderWindow.y1) * (size_t)tmpRowBytes;
+        ImageMemory mem(memSize, this);
+        float* tmpPixelData = (float*)mem.lock();
+        decodeChannels(filename, img.get(), subimages, subImageIndex, mipLevel, useCache, renderWindow, tmpPixelData, renderWindow, tmpRowBytes, channels, numChannels);
+        if (abort()) {
+            break;
+        }
+
+        // distribute the channels to the planes
+        for (std::size_t g = 0; g < group.size(); ++g) {
+            const PlaneToDecode& plane = planes[group[g]];
+            const vector<int>& planeChans = planeChannels[group[g]];
+            const int planeNumChans = planeNumChannels[group[g]];
+            for (int y = renderWindow.y1; y < renderWindow.y2; ++y) {
+                const float* srcPix = (const float*)((const char*)tmpPixelData + (size_t)(y - renderWindow.y1) * tmpRowBytes);
+                float* dstPix = (float*)((char*)plane.pixelData + (size_t)(y - plane.bounds.y1) * plane.rowBytes) + (size_t)(renderWindow.x1 - plane.bounds.x1) * planeNumChans;
+                for (int x = renderWindow.x1; x < renderWindow.x2; ++x, srcPix += numChannels, dstPix += planeNumChans) {
+                    for (int c = 0; c < planeNumChans; ++c) {
+                        const int chan = planeChans[c];
+                        dstPix[c] = (chan < kXChannelFirst) ? float(chan) : srcPix[chan - kXChannelFirst - chbegin];
+                    }
+                }
+            }
+        }
+    }
+
+    if (!useCache) {
+        img->close();
+    }
+} // ReadOIIOPlugin::decodePlanes
+
+unsigned int
+ReadOIIOPlugin::getNativeDecodeLevels(const string& filename,
+                                      OfxTime /*time*/,
+                                      int /*view*/,
+                                      unsigned int levels)
+{
+    // Read a mipmap level stored in the file (e.g. in tiled TIFF or EXR textures) if its pixel coordinates are
+    // exactly those of the downscaled frame, i.e. the data window is the display window, both start at (0,0),
+    // and level sizes are rounded up.
+    vector<ImageSpec> subimages;
+    getSpecs(filename, &subimages);
+    if (subimages.size() != 1) {
+        return 0;
+    }
+    const ImageSpec& spec0 = subimages[0];
+    if ((spec0.x != 0) || (spec0.y != 0) || (spec0.full_x != 0) || (spec0.full_y != 0) ||
+        (spec0.width != spec0.full_width) || (spec0.height != spec0.full_height)) {
+        return 0;
+    }
+
+#if OIIO_PLUGIN_VERSION >= 22
+    ImageInputPtr img;
+#else
+    auto_ptr<ImageInput> img;
+#endif
+    if (!_cache) {
+        ImageSpec config;
+        getConfig(&config);
+#if OIIO_PLUGIN_VERSION >= 22
+        img = ImageInput::open(filename, &config);
+#else
+        img.reset(ImageInput::open(filename, &config));
+#endif
+        if (!img.get()) {
+            return 0;
+        }
+    }
+
+    unsigned int level = levels;
+    for (; level > 0; --level) {
+        ImageSpec spec;
+        bool gotSpec = img.get() ? img->seek_subimage(0, level, spec) : _cache->get_imagespec(ustring(filename), spec, 0, level);
+        const int round = (1 << level) - 1;
+        if (gotSpec &&
+            (spec.x == 0) && (spec.y == 0) && (spec.full_x == 0) && (spec.full_y == 0) &&
+            (spec.width == spec.full_width) && (spec.height == spec.full_height) &&
+            (spec.width == ((spec0.width + round) >> level)) && (spec.height == ((spec0.height + round) >> level))) {
+            break;
+        }
+    }
+    if (img.get()) {
+        img->close();
+    }
+
+    return level;
+}
+
 bool
 ReadOIIOPlugin::getFrameBounds(const string& filename,
                                OfxTime /*time*/,
@@ -3042,6 +3487,15 @@ public:
 void
 ReadOIIOPluginFactory::load()
 {
+#ifdef OFX_READ_OIIO_SHARED_CACHE
+    {
+        ImageCache* sharedcache = ImageCache::create(true);
+        setCacheAttributes(sharedcache);
+        // the shared cache is never torn down, so the governor client can keep it until unload()
+        gImageCacheGovernorClient.init(sharedcache);
+        ImageCache::destroy(sharedcache);
+    }
+#endif
     {
         int i = 0;
 #if LIBRAW_VERSION >= LIBRAW_MAKE_VERSION(0, 19, 0)
@@ -3146,6 +3600,7 @@ ReadOIIOPluginFactory::unload()
 #ifdef OFX_READ_OIIO_SHARED_CACHE
     // get the shared image cache (may be shared with other plugins using OIIO)
     ImageCache* sharedcache = ImageCache::create(true);
+    gImageCacheGovernorClient.deinit();
     // purge it
     // teardown is dangerous if there are other users
     ImageCache::destroy(sharedcache);
@@ -3542,6 +3997,14 @@ ReadOIIOPluginFactory::describeInContext(ImageEffectDescriptor& desc,
         }
     }
 
+    {
+        PushButtonParamDescriptor* param = desc.definePushButtonParam(kParamCacheInfo);
+        param->setLabelAndHint(kParamCacheInfoLabel);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+
     GenericReaderDescribeInContextEnd(desc, context, page, "scene_linear", "scene_linear");
 } // ReadOIIOPluginFactory::describeInContext
 
@@ -22,7 +22,10 @@
  * Writes an image using the OpenImageIO library.
  */
 
+#include <algorithm>
 #include <cfloat> // DBL_MAX
+#include <list>
+#include <vector>
 
 #include "ofxsMacros.h"
 
@@ -40,6 +43,8 @@ GCC_DIAG_ON(unused-parameter)
 #include <ofxsCoords.h>
 #include <ofxsMultiPlane.h>
 
+#include "tinythread.h"
+
 using namespace OFX;
 using namespace OFX::IO;
 #ifdef OFX_IO_USING_OCIO
@@ -229,6 +234,15 @@ enum EParamTileSize {
     eParamTileSize512
 };
 
+#define kParamMipmap "mipmap"
+#define kParamMipmapLabel "MIP-Map"
+#define kParamMipmapHint "For tiled files in formats that support it (EXR, TIFF), also write the successive half-resolution levels of each part, so that readers can directly fetch a reduced resolution. Ignored if the Tile Size is Scan-Line Based."
+
+#define kParamThreads "threads"
+#define kParamThreadsLabel "Threads"
+#define kParamThreadsHint "Number of threads used to convert the pixels to the file bit depth and to encode them. " \
+    "Each part (view or layer) is converted while the previous one is being compressed and written, so that the parts of a multi-part file overlap in time. 0 means one thread per core."
+
 #define kParamProcessAllLayers "processAllLayers"
 #define kParamProcessAllLayersLabel "All Layers"
 #define kParamProcessAllLayersHint "When checked, all layers will be written to the file"
@@ -292,7 +306,8 @@ private:
      **/
     virtual bool supportsAlpha(const std::string&) const OVERRIDE FINAL;
 
-    virtual void encode(const string& filename,
+    virtual void encode(void* /*user_data*/,
+                        const string& filename,
                         const OfxTime time,
                         const string& viewName,
                         const float* pixelData,
@@ -373,6 +388,8 @@ private:
     ChoiceParam* _orientation;
     ChoiceParam* _compression;
     ChoiceParam* _tileSize;
+    BooleanParam* _mipmap;
+    IntParam* _threads;
     ChoiceParam* _outputLayers;
     ChoiceParam* _parts;
     ChoiceParam* _views;
@@ -390,6 +407,8 @@ WriteOIIOPlugin::WriteOIIOPlugin(OfxImageEffectHandle handle,
     , _orientation(NULL)
     , _compression(NULL)
     , _tileSize(NULL)
+    , _mipmap(NULL)
+    , _threads(NULL)
     , _outputLayers(NULL)
     , _parts(NULL)
     , _views(NULL)
@@ -404,6 +423,9 @@ WriteOIIOPlugin::WriteOIIOPlugin(OfxImageEffectHandle handle,
     _orientation = fetchChoiceParam(kParamOutputOrientation);
     _compression = fetchChoiceParam(kParamOutputCompression);
     _tileSize = fetchChoiceParam(kParamTileSize);
+    _mipmap = fetchBooleanParam(kParamMipmap);
+    _threads = fetchIntParam(kParamThreads);
+    assert(_mipmap && _threads);
     if (gIsMultiplanarV2) {
         _outputLayers = fetchChoiceParam(kParamOutputChannels);
 
@@ -503,7 +525,7 @@ WriteOIIOPlugin::changedParam(const InstanceChangedArgs& args,
         }
         string msg = oiio_versions() + "\nAll supported formats and extensions: " + extensions_pretty;
         sendMessage(Message::eMessageMessage, "", msg);
-    } else if ((paramName == kParamOutputCompression) && (args.reason == eChangeUserEdit)) {
+    } else if (((paramName == kParamOutputCompression) || (paramName == kParamTileSize)) && (args.reason == eChangeUserEdit)) {
         string filename;
         _fileParam->getValue(filename);
         refreshParamsVisibility(filename);
@@ -812,6 +834,13 @@ WriteOIIOPlugin::refreshParamsVisibility(const string& filename)
 #endif
     if (output.get()) {
         _tileSize->setIsSecretAndDisabled(!output->supports("tiles"));
+        _mipmap->setIsSecretAndDisabled(!output->supports("tiles") || !output->supports("mipmap"));
+        if (output->supports("tiles") && output->supports("mipmap")) {
+            // MIP-maps are only written in tiled files
+            int tileSize_i;
+            _tileSize->getValue(tileSize_i);
+            _mipmap->setEnabled((EParamTileSize)tileSize_i != eParamTileSizeScanLineBased);
+        }
         //_outputLayers->setIsSecretAndDisabled(!output->supports("nchannels"));
 
         // hasQuality: search for uses of decode_compression_metadata() in OIIO source code.
@@ -848,6 +877,7 @@ WriteOIIOPlugin::refreshParamsVisibility(const string& filename)
         }
     } else {
         _tileSize->setIsSecretAndDisabled(true);
+        _mipmap->setIsSecretAndDisabled(true);
         //_outputLayers->setIsSecretAndDisabled(true);
         _quality->setIsSecretAndDisabled(true);
         _dwaCompressionLevel->setIsSecretAndDisabled(true);
@@ -861,15 +891,186 @@ WriteOIIOPlugin::refreshParamsVisibility(const string& filename)
     }
 }
 
+// a part converted to the file bit depth by encodePart(), waiting to be written by the writer thread
+struct WriteOIIOPendingPart {
+    int partIndex;
+    TypeDesc format;
+    vector<unsigned char> pixels; // contiguous, top scan-line first
+};
+
+// Maximum number of converted parts waiting to be written, to bound the memory used
+#define kWriteOIIOMaxPendingParts 2
+
 struct WriteOIIOEncodePlanesData {
 #if OIIO_PLUGIN_VERSION >= 22
     ImageOutputPtr output;
 #else
     auto_ptr<ImageOutput> output;
 #endif
+    string filename;
     vector<ImageSpec> specs;
+    int nThreads; // 0 means one per core
+    bool mipmap; // also write the MIP-map levels of each part
+
+    // The parts are written in order by a writer thread, while the next part is converted by encodePart()
+    tthread::thread* writer;
+    tthread::mutex mutex;
+    tthread::condition_variable cond;
+    std::list<WriteOIIOPendingPart*> pending;
+    bool finished; // no more parts will be queued
+    string error; // set by the writer thread if writing failed
+
+    WriteOIIOEncodePlanesData()
+        : output()
+        , filename()
+        , specs()
+        , nThreads(0)
+        , mipmap(false)
+        , writer(NULL)
+        , mutex()
+        , cond()
+        , pending()
+        , finished(false)
+        , error()
+    {
+    }
+
+    ~WriteOIIOEncodePlanesData()
+    {
+        // may happen if an exception was thrown while encoding
+        joinWriter();
+        for (std::list<WriteOIIOPendingPart*>::iterator it = pending.begin(); it != pending.end(); ++it) {
+            delete *it;
+        }
+    }
+
+    void joinWriter()
+    {
+        if (!writer) {
+            return;
+        }
+        {
+            tthread::lock_guard<tthread::mutex> guard(mutex);
+            finished = true;
+        }
+        cond.notify_all();
+        writer->join();
+        delete writer;
+        writer = NULL;
+    }
 };
 
+// write a part and, if requested, its MIP-map levels (the part was converted to FLOAT in that case)
+static bool
+writeOIIOPart(WriteOIIOEncodePlanesData* data,
+              const WriteOIIOPendingPart& part,
+              string* error)
+{
+    ImageOutput* output = data->output.get();
+    const ImageSpec& partSpec = data->specs[part.partIndex];
+    if (part.partIndex != 0) {
+        if (!output->open(data->filename, partSpec, ImageOutput::AppendSubimage)) {
+            *error = output->geterror();
+
+            return false;
+        }
+    }
+    if (!output->write_image(part.format, &part.pixels[0])) {
+        *error = output->geterror();
+
+        return false;
+    }
+    if (!data->mipmap) {
+        return true;
+    }
+
+    // box-filter each level from the previous one, until a 1x1 level is reached. The level sizes are rounded up,
+    // and the 2x2 footprint is clamped to the previous level, so that the last column and row of odd sizes are kept.
+    const int nchannels = partSpec.nchannels;
+    ImageSpec levelSpec = partSpec;
+    vector<float> level((const float*)&part.pixels[0], (const float*)&part.pixels[0] + (size_t)partSpec.width * partSpec.height * nchannels);
+    while (levelSpec.width > 1 || levelSpec.height > 1) {
+        const int w = levelSpec.width;
+        const int h = levelSpec.height;
+        const int nw = (w + 1) / 2;
+        const int nh = (h + 1) / 2;
+        vector<float> next((size_t)nw * nh * nchannels);
+        for (int y = 0; y < nh; ++y) {
+            const int y0 = (std::min)(2 * y, h - 1);
+            const int y1 = (std::min)(2 * y + 1, h - 1);
+            for (int x = 0; x < nw; ++x) {
+                const int x0 = (std::min)(2 * x, w - 1);
+                const int x1 = (std::min)(2 * x + 1, w - 1);
+                const float* p00 = &level[((size_t)y0 * w + x0) * nchannels];
+                const float* p01 = &level[((size_t)y0 * w + x1) * nchannels];
+                const float* p10 = &level[((size_t)y1 * w + x0) * nchannels];
+                const float* p11 = &level[((size_t)y1 * w + x1) * nchannels];
+                float* dst = &next[((size_t)y * nw + x) * nchannels];
+                for (int c = 0; c < nchannels; ++c) {
+                    dst[c] = 0.25f * (p00[c] + p01[c] + p10[c] + p11[c]);
+                }
+            }
+        }
+        levelSpec.x /= 2;
+        levelSpec.y /= 2;
+        levelSpec.width = nw;
+        levelSpec.height = nh;
+        levelSpec.full_x /= 2;
+        levelSpec.full_y /= 2;
+        levelSpec.full_width = (levelSpec.full_width + 1) / 2;
+        levelSpec.full_height = (levelSpec.full_height + 1) / 2;
+        if (!output->open(data->filename, levelSpec, ImageOutput::AppendMIPLevel) ||
+            !output->write_image(TypeDesc::FLOAT, &next[0])) {
+            *error = output->geterror();
+
+            return false;
+        }
+        level.swap(next);
+    }
+
+    return true;
+} // writeOIIOPart
+
+static void
+writeOIIOThreadFunction(void* arg)
+{
+    WriteOIIOEncodePlanesData* data = (WriteOIIOEncodePlanesData*)arg;
+
+    for (;;) {
+        WriteOIIOPendingPart* part = NULL;
+        {
+            tthread::lock_guard<tthread::mutex> guard(data->mutex);
+            while (data->pending.empty() && !data->finished) {
+                data->cond.wait(guard);
+            }
+            if (data->pending.empty()) {
+                // finished
+                return;
+            }
+            part = data->pending.front();
+            data->pending.pop_front();
+        }
+        // let encodePart() queue the next part
+        data->cond.notify_all();
+
+        string error;
+        bool ok = writeOIIOPart(data, *part, &error);
+        delete part;
+        if (!ok) {
+            tthread::lock_guard<tthread::mutex> guard(data->mutex);
+            data->error = error.empty() ? string("Cannot write image") : error;
+            for (std::list<WriteOIIOPendingPart*>::iterator it = data->pending.begin(); it != data->pending.end(); ++it) {
+                delete *it;
+            }
+            data->pending.clear();
+            data->finished = true;
+            data->cond.notify_all();
+
+            return;
+        }
+    }
+}
+
 void*
 WriteOIIOPlugin::allocateEncodePlanesUserData()
 {
@@ -916,6 +1117,12 @@ WriteOIIOPlugin::beginEncodeParts(void* user_data,
         return;
     }
 
+    data->filename = filename;
+    _threads->getValue(data->nThreads);
+#if OIIO_VERSION >= 10800
+    data->output->threads(data->nThreads);
+#endif
+
     if (!data->output->supports("multiimage") && (partsSplitting != eLayerViewsSinglePart)) {
         stringstream ss;
         ss << data->output->format_name() << " does not support writing multiple views/layers into a single file.";
@@ -1206,6 +1413,19 @@ WriteOIIOPlugin::beginEncodeParts(void* user_data,
         default:
             break;
         }
+
+        // same condition as the visibility of the param in refreshParamsVisibility(), but from the format
+        bool mipmap = false;
+        if (data->output->supports("tiles") && data->output->supports("mipmap")) {
+            _mipmap->getValue(mipmap);
+        }
+        data->mipmap = mipmap && (spec.tile_width > 0);
+        if (data->mipmap && isEXR) {
+            // the OpenEXR writer only declares the MIP-map levels in the header of textures
+            spec.attribute("textureformat", "Plain Texture");
+            // the levels are rounded up, as in writeOIIOPart()
+            spec.attribute("openexr:roundingmode", 1);
+        }
     }
 
     assert(!planes.empty());
@@ -1417,6 +1637,8 @@ WriteOIIOPlugin::beginEncodeParts(void* user_data,
 
         return;
     }
+
+    data->writer = new tthread::thread(writeOIIOThreadFunction, data);
 } // WriteOIIOPlugin::beginEncodeParts
 
 void
@@ -1429,32 +1651,87 @@ WriteOIIOPlugin::encodePart(void* user_data,
 {
     assert(user_data);
     WriteOIIOEncodePlanesData* data = (WriteOIIOEncodePlanesData*)user_data;
-    if (planeIndex != 0) {
-        if (!data->output->open(filename, data->specs[planeIndex], ImageOutput::AppendSubimage)) {
-            setPersistentMessage(Message::eMessageError, "", data->output->geterror());
-            throwSuiteStatusException(kOfxStatFailed);
+    assert(planeIndex >= 0 && planeIndex < (int)data->specs.size());
+    const ImageSpec& partSpec = data->specs[planeIndex];
 
-            return;
-        }
+    // Convert the part to the file bit depth (or to contiguous float for the MIP-map levels), while the writer
+    // thread compresses the previous part. The conversion is the one OIIO does in write_image(), so the file is the same.
+    WriteOIIOPendingPart* part = new WriteOIIOPendingPart;
+    part->partIndex = planeIndex;
+    part->format = data->mipmap ? TypeDesc(TypeDesc::FLOAT) : partSpec.format;
+    part->pixels.resize((size_t)partSpec.width * partSpec.height * partSpec.nchannels * part->format.size());
+
+    // do not use auto-stride as the buffer may have more components that what we want to write
+    const TypeDesc format = TypeDesc::FLOAT;
+    const stride_t xStride = format.size() * pixelDataNComps;
+#if OIIO_VERSION >= 10600
+    const bool converted = parallel_convert_image(partSpec.nchannels, partSpec.width, partSpec.height, 1,
+                                                  (char*)pixelData + (partSpec.height - 1) * rowBytes, // invert y
+                                                  format,
+                                                  xStride, // xstride
+                                                  -rowBytes, // ystride
+                                                  AutoStride, // zstride
+                                                  &part->pixels[0],
+                                                  part->format,
+                                                  AutoStride,
+                                                  AutoStride,
+                                                  AutoStride,
+#if OIIO_VERSION < 20000
+                                                  -1, // alpha channel
+                                                  -1, // z channel
+#endif
+                                                  data->nThreads);
+#else
+    const bool converted = convert_image(partSpec.nchannels, partSpec.width, partSpec.height, 1,
+                                         (char*)pixelData + (partSpec.height - 1) * rowBytes, // invert y
+                                         format, xStride, -rowBytes, AutoStride,
+                                         &part->pixels[0], part->format, AutoStride, AutoStride, AutoStride);
+#endif
+    if (!converted) {
+        delete part;
+        setPersistentMessage(Message::eMessageError, "", string("Cannot convert image to write ") + filename);
+        throwSuiteStatusException(kOfxStatFailed);
+
+        return;
     }
 
-    TypeDesc format = TypeDesc::FLOAT;
+    string error;
+    {
+        tthread::lock_guard<tthread::mutex> guard(data->mutex);
+        while ((int)data->pending.size() >= kWriteOIIOMaxPendingParts && data->error.empty()) {
+            data->cond.wait(guard);
+        }
+        error = data->error;
+        if (error.empty()) {
+            data->pending.push_back(part);
+            part = NULL;
+        }
+    }
+    if (part) {
+        // the writer thread failed
+        delete part;
+        setPersistentMessage(Message::eMessageError, "", error);
+        throwSuiteStatusException(kOfxStatFailed);
 
-    // do not use auto-stride as the buffer may have more components that what we want to write
-    std::size_t xStride = format.size() * pixelDataNComps;
-    data->output->write_image(format,
-                              (char*)pixelData + (data->specs[planeIndex].height - 1) * rowBytes, // invert y
-                              xStride, // xstride
-                              -rowBytes, // ystride
-                              AutoStride // zstride
-    );
-}
+        return;
+    }
+    data->cond.notify_all();
+} // WriteOIIOPlugin::encodePart
 
 void
 WriteOIIOPlugin::endEncodeParts(void* user_data)
 {
     assert(user_data);
     WriteOIIOEncodePlanesData* data = (WriteOIIOEncodePlanesData*)user_data;
+    // wait until all parts are written
+    data->joinWriter();
+    if (!data->error.empty()) {
+        data->output->close();
+        setPersistentMessage(Message::eMessageError, "", data->error);
+        throwSuiteStatusException(kOfxStatFailed);
+
+        return;
+    }
     data->output->close();
 }
 
@@ -1606,6 +1883,27 @@ WriteOIIOPluginFactory::describeInContext(ImageEffectDescriptor& desc,
             page->addChild(*param);
         }
     }
+    {
+        BooleanParamDescriptor* param = desc.defineBooleanParam(kParamMipmap);
+        param->setLabel(kParamMipmapLabel);
+        param->setHint(kParamMipmapHint);
+        param->setDefault(false);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+    {
+        IntParamDescriptor* param = desc.defineIntParam(kParamThreads);
+        param->setLabel(kParamThreadsLabel);
+        param->setHint(kParamThreadsHint);
+        param->setRange(0, 64);
+        param->setDisplayRange(0, 16);
+        param->setDefault(0);
+        param->setAnimates(false);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
     {
         ChoiceParamDescriptor* param = desc.defineChoiceParam(kParamBitDepth);
         param->setLabel(kParamBitDepthLabel);
@@ -24,9 +24,17 @@
 
 #include <algorithm>
 #include <cstdio> // fopen, fread...
+#include <cstring> // memcpy
+#if defined(_WIN32) || defined(__WIN32__) || defined(WIN32)
+#include <windows.h>
+#else
+#include <sys/types.h> // off_t
+#endif
 
 #include "GenericOCIO.h"
 #include "GenericReader.h"
+#include "IOLRUCache.h"
+#include "IOUtility.h"
 #include "ofxsFileOpen.h"
 #include "ofxsMacros.h"
 
@@ -48,14 +56,14 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kPluginDescription "Read PFM (Portable Float Map) files."
 #define kPluginIdentifier "fr.inria.openfx.ReadPFM"
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 1 // Increment this when you have fixed a bug or made it faster.
 #define kPluginEvaluation 92 // better than ReadOIIO
 
 #define kSupportsRGBA true
 #define kSupportsRGB true
 #define kSupportsXY false
 #define kSupportsAlpha true
-#define kSupportsTiles false
+#define kSupportsTiles true
 
 class ReadPFMPlugin
     : public GenericReaderPlugin {
@@ -67,7 +75,7 @@ public:
 private:
     virtual bool isVideoStream(const string& /*filename*/) OVERRIDE FINAL { return false; }
 
-    virtual void decode(const string& filename, OfxTime time, int view, bool isPlayback, const OfxRectI& renderWindow, const OfxPointD& renderScale, float* pixelData, const OfxRectI& bounds, PixelComponentEnum pixelComponents, int pixelComponentCount, int rowBytes) OVERRIDE FINAL;
+    virtual void decode(const string& filename, OfxTime time, int view, bool isPlayback, const OfxRectI& renderWindow, const OfxPointD& renderScale, float* pixelData, const OfxRectI& bounds, PixelComponentEnum pixelComponents, int pixelComponentCount, int rowBytes, FusedColorConversion* colorConversion) OVERRIDE FINAL;
     virtual bool getFrameBounds(const string& filename, OfxTime time, int view, OfxRectI* bounds, OfxRectI* format, double* par, string* error, int* tile_width, int* tile_height) OVERRIDE FINAL;
 
     /**
@@ -136,6 +144,149 @@ invert_endianness(T* const buffer,
     }
 }
 
+struct PFMHeader {
+    char type; // 'F' (RGB) or 'f' (grayscale)
+    int width;
+    int height;
+    int nComps;
+    double scale; // negative for little-endian data
+    bool hasScale;
+    long long dataOffset; // offset of the first (bottom) row in the file
+};
+
+/// Read the PFM header. Returns false and sets error if the file is not a valid PFM file.
+static bool
+readPFMHeader(std::FILE* nfile,
+              const string& filename,
+              PFMHeader* header,
+              string* error)
+{
+    char pfm_type = 0;
+    char item[1024] = { 0 };
+    int W = 0;
+    int H = 0;
+    int err = 0;
+    double scale = 0.0;
+    while ((err = std::fscanf(nfile, "%1023[^\n]", item)) != EOF && (*item == '#' || !err)) {
+        int c = std::fgetc(nfile);
+        (void)c;
+    }
+    if (std::sscanf(item, " P%c", &pfm_type) != 1) {
+        *error = string("PFM header not found in file \"") + filename + "\".";
+
+        return false;
+    }
+    while ((err = std::fscanf(nfile, " %1023[^\n]", item)) != EOF && (*item == '#' || !err)) {
+        int c = std::fgetc(nfile);
+        (void)c;
+    }
+    if (std::sscanf(item, " %d %d", &W, &H) != 2) {
+        *error = string("WIDTH and HEIGHT fields are undefined in file \"") + filename + "\".";
+
+        return false;
+    }
+    if ((W <= 0) || (H <= 0) || (0xffff < W) || (0xffff < H)) {
+        *error = string("invalid WIDTH or HEIGHT fields in file \"") + filename + "\".";
+
+        return false;
+    }
+    while ((err = std::fscanf(nfile, " %1023[^\n]", item)) != EOF && (*item == '#' || !err)) {
+        int c = std::fgetc(nfile);
+        (void)c;
+    }
+    header->hasScale = (std::sscanf(item, "%lf", &scale) == 1);
+    {
+        int c = std::fgetc(nfile);
+        (void)c;
+    }
+    header->type = pfm_type;
+    header->width = W;
+    header->height = H;
+    header->nComps = (pfm_type == 'F') ? 3 : 1;
+    header->scale = scale;
+    header->dataOffset = (long long)std::ftell(nfile);
+
+    return true;
+} // readPFMHeader
+
+/// The headers of the files read recently, shared by all instances: getFrameBounds(),
+/// guessParamsFromFilename() and decode() are called on the same file and would parse it three times.
+class PFMHeaderCache {
+public:
+    static PFMHeaderCache& instance()
+    {
+        static PFMHeaderCache cache;
+
+        return cache;
+    }
+
+    bool get(const string& filename,
+             PFMHeader* header,
+             string* error)
+    {
+        long long mtime = -1;
+        long long size = -1;
+        const bool stamped = getFileStamp(filename, &mtime, &size);
+        Entry e;
+        if ( stamped && _entries.getIf(filename, &e, [mtime, size](const Entry& cached) {
+            // else the file was overwritten
+            return (cached.mtime == mtime) && (cached.size == size);
+        }) ) {
+            *header = e.header;
+
+            return true;
+        }
+
+        std::FILE* const nfile = fopen_utf8(filename.c_str(), "rb");
+        if (!nfile) {
+            *error = string("Cannot open file \"") + filename + "\".";
+
+            return false;
+        }
+        const bool ok = readPFMHeader(nfile, filename, header, error);
+        std::fclose(nfile);
+        if (!ok || !stamped) {
+            return ok;
+        }
+        e.mtime = mtime;
+        e.size = size;
+        e.header = *header;
+        _entries.insert(filename, e);
+
+        return true;
+    }
+
+private:
+    PFMHeaderCache()
+        : _entries(kMaxEntries, 0)
+    {
+    }
+
+    struct Entry {
+        long long mtime;
+        long long size;
+        PFMHeader header;
+    };
+
+    static const std::size_t kMaxEntries = 64;
+
+    LRUCache<string, Entry> _entries;
+};
+
+/// Set the position of the file to offset, which may be beyond 2GB (long is 32 bits on Windows).
+static bool
+seekFile(std::FILE* file,
+         long long offset)
+{
+#if defined(_WIN32) || defined(__WIN32__) || defined(WIN32)
+
+    return _fseeki64(file, offset, SEEK_SET) == 0;
+#else
+
+    return fseeko(file, (off_t)offset, SEEK_SET) == 0;
+#endif
+}
+
 ReadPFMPlugin::ReadPFMPlugin(OfxImageEffectHandle handle,
                              const vector<string>& extensions)
     : GenericReaderPlugin(handle, extensions, kSupportsRGBA, kSupportsRGB, kSupportsXY, kSupportsAlpha, kSupportsTiles, false)
@@ -148,7 +299,7 @@ ReadPFMPlugin::~ReadPFMPlugin()
 
 template <class PIX, int srcC, int dstC>
 static void
-copyLine(PIX* image,
+copyLine(const PIX* image,
          int x1,
          int x2,
          int C,
@@ -186,6 +337,32 @@ copyLine(PIX* image,
     }
 }
 
+template <int srcC>
+static void
+copyLineForComponents(const float* image,
+                      int x1,
+                      int x2,
+                      int pixelComponentCount,
+                      float* dstPix)
+{
+    switch (pixelComponentCount) {
+    case 1:
+        copyLine<float, srcC, 1>(image, x1, x2, srcC, dstPix);
+        break;
+    case 2:
+        copyLine<float, srcC, 2>(image, x1, x2, srcC, dstPix);
+        break;
+    case 3:
+        copyLine<float, srcC, 3>(image, x1, x2, srcC, dstPix);
+        break;
+    case 4:
+        copyLine<float, srcC, 4>(image, x1, x2, srcC, dstPix);
+        break;
+    default:
+        break;
+    }
+}
+
 void
 ReadPFMPlugin::decode(const string& filename,
                       OfxTime /*time*/,
@@ -197,7 +374,8 @@ ReadPFMPlugin::decode(const string& filename,
                       const OfxRectI& bounds,
                       PixelComponentEnum pixelComponents,
                       int pixelComponentCount,
-                      int rowBytes)
+                      int rowBytes,
+                      FusedColorConversion* /*colorConversion*/)
 {
     assert(renderScale.x == 1. && renderScale.y == 1.);
     unused(renderScale);
@@ -209,74 +387,52 @@ ReadPFMPlugin::decode(const string& filename,
     }
 
     // read PFM header
-    std::FILE* const nfile = fopen_utf8(filename.c_str(), "rb");
-
-    char pfm_type, item[1024] = { 0 };
-    int W = 0;
-    int H = 0;
-    int C = 0;
-    int err = 0;
-    double scale = 0.0;
-    while ((err = std::fscanf(nfile, "%1023[^\n]", item)) != EOF && (*item == '#' || !err)) {
-        int c = std::fgetc(nfile);
-        (void)c;
-    }
-    if (std::sscanf(item, " P%c", &pfm_type) != 1) {
-        std::fclose(nfile);
-        setPersistentMessage(Message::eMessageError, "", string("PFM header not found in file \"") + filename + "\".");
+    PFMHeader header;
+    string error;
+    if (!PFMHeaderCache::instance().get(filename, &header, &error)) {
+        setPersistentMessage(Message::eMessageError, "", error);
         throwSuiteStatusException(kOfxStatFailed);
 
         return;
     }
-    while ((err = std::fscanf(nfile, " %1023[^\n]", item)) != EOF && (*item == '#' || !err)) {
-        int c = std::fgetc(nfile);
-        (void)c;
-    }
-    if (std::sscanf(item, " %d %d", &W, &H) != 2) {
-        std::fclose(nfile);
-        setPersistentMessage(Message::eMessageError, "", string("WIDTH and HEIGHT fields are undefined in file \"") + filename + "\".");
-        throwSuiteStatusException(kOfxStatFailed);
-
-        return;
-    }
-    if ((W <= 0) || (H <= 0) || (0xffff < W) || (0xffff < H)) {
-        std::fclose(nfile);
-        setPersistentMessage(Message::eMessageError, "", string("invalid WIDTH or HEIGHT fields in file \"") + filename + "\".");
-        throwSuiteStatusException(kOfxStatFailed);
-
-        return;
-    }
-
     clearPersistentMessage();
-    while ((err = std::fscanf(nfile, " %1023[^\n]", item)) != EOF && (*item == '#' || !err)) {
-        int c = std::fgetc(nfile);
-        (void)c;
-    }
-    if (std::sscanf(item, "%lf", &scale) != 1) {
+    if (!header.hasScale) {
         setPersistentMessage(Message::eMessageWarning, "", string("SCALE field is undefined in file \"") + filename + "\".");
     }
 
-    {
-        int c = std::fgetc(nfile);
-        (void)c;
-    }
-
-    const bool is_inverted = (scale > 0) != endianness();
-    if (pfm_type == 'F') {
-        C = 3;
-    } else {
-        C = 1;
-    }
-
-    std::size_t numpixels = W * C;
-    vector<float> image(numpixels);
+    const bool is_inverted = (header.scale > 0) != endianness();
+    const int W = header.width;
+    const int H = header.height;
+    const int C = header.nComps;
+    unused(H);
 
     assert(0 <= renderWindow.x1 && renderWindow.x2 <= W && 0 <= renderWindow.y1 && renderWindow.y2 <= H);
     const int x1 = renderWindow.x1;
     const int x2 = renderWindow.x2;
 
+    // PFM rows are stored bottom to top with a fixed size, so that only the rows of the render window are read.
+    // The file is not mapped in memory: it may be truncated while it is read (e.g. a sequence being written),
+    // which would crash the host, whereas fread() just fails.
+    const std::size_t numpixels = (std::size_t)W * C;
+    const long long rowsOffset = header.dataOffset + (long long)renderWindow.y1 * (long long)numpixels * (long long)sizeof(float);
+    std::FILE* nfile = fopen_utf8(filename.c_str(), "rb");
+    if ( !nfile || !seekFile(nfile, rowsOffset) ) {
+        if (nfile) {
+            std::fclose(nfile);
+        }
+        setPersistentMessage(Message::eMessageError, "", "could not read all the image samples needed");
+        throwSuiteStatusException(kOfxStatFailed);
+
+        return;
+    }
+    // whole rows in the native byte order with the same components are read directly into the output
+    const bool inPlace = !is_inverted && (pixelComponentCount == C) && (x1 == 0) && (x2 == W) && (bounds.x1 == 0);
+    vector<float> image(inPlace ? 0 : numpixels);
+
     for (int y = renderWindow.y1; y < renderWindow.y2; ++y) {
-        std::size_t numread = std::fread(&image.front(), 4, numpixels, nfile);
+        float* dstPix = (float*)((char*)pixelData + (y - bounds.y1) * rowBytes);
+        float* row = inPlace ? dstPix : &image.front();
+        std::size_t numread = std::fread(row, 4, numpixels, nfile);
         if (numread < numpixels) {
             std::fclose(nfile);
             setPersistentMessage(Message::eMessageError, "", "could not read all the image samples needed");
@@ -284,47 +440,18 @@ ReadPFMPlugin::decode(const string& filename,
 
             return;
         }
-
+        if (inPlace) {
+            continue;
+        }
         if (is_inverted) {
-            invert_endianness(&image.front(), numpixels);
+            invert_endianness(&image[(std::size_t)x1 * C], (unsigned int)((x2 - x1) * C));
         }
 
         // now copy to the dstImg
-        float* dstPix = (float*)((char*)pixelData + (y - bounds.y1) * rowBytes);
         if (C == 1) {
-            switch (pixelComponentCount) {
-            case 1:
-                copyLine<float, 1, 1>(&image.front(), x1, x2, C, dstPix);
-                break;
-            case 2:
-                copyLine<float, 1, 2>(&image.front(), x1, x2, C, dstPix);
-                break;
-            case 3:
-                copyLine<float, 1, 3>(&image.front(), x1, x2, C, dstPix);
-                break;
-            case 4:
-                copyLine<float, 1, 4>(&image.front(), x1, x2, C, dstPix);
-                break;
-            default:
-                break;
-            }
+            copyLineForComponents<1>(row, x1, x2, pixelComponentCount, dstPix);
         } else if (C == 3) {
-            switch (pixelComponentCount) {
-            case 1:
-                copyLine<float, 3, 1>(&image.front(), x1, x2, C, dstPix);
-                break;
-            case 2:
-                copyLine<float, 3, 2>(&image.front(), x1, x2, C, dstPix);
-                break;
-            case 3:
-                copyLine<float, 3, 3>(&image.front(), x1, x2, C, dstPix);
-                break;
-            case 4:
-                copyLine<float, 3, 4>(&image.front(), x1, x2, C, dstPix);
-                break;
-            default:
-                break;
-            }
+            copyLineForComponents<3>(row, x1, x2, pixelComponentCount, dstPix);
         }
     }
     std::fclose(nfile);
@@ -343,53 +470,24 @@ ReadPFMPlugin::getFrameBounds(const string& filename,
 {
     assert(bounds && par);
     // read PFM header
-    std::FILE* const nfile = std::fopen(filename.c_str(), "rb");
-
-    char pfm_type, item[1024] = { 0 };
-    int W = 0;
-    int H = 0;
-    int err = 0;
-    double scale = 0.0;
-    while ((err = std::fscanf(nfile, "%1023[^\n]", item)) != EOF && (*item == '#' || !err)) {
-        int c = std::fgetc(nfile);
-        (void)c;
-    }
-    if (std::sscanf(item, " P%c", &pfm_type) != 1) {
-        std::fclose(nfile);
-        if (error) {
-            *error = string("PFM header not found in file \"") + filename + "\".";
-        }
-
-        return false;
-    }
-    while ((err = std::fscanf(nfile, " %1023[^\n]", item)) != EOF && (*item == '#' || !err)) {
-        int c = std::fgetc(nfile);
-        (void)c;
-    }
-    if ((err = std::sscanf(item, " %d %d", &W, &H)) < 2) {
-        std::fclose(nfile);
+    PFMHeader header;
+    string headerError;
+    if (!PFMHeaderCache::instance().get(filename, &header, &headerError)) {
         if (error) {
-            *error = string("WIDTH and HEIGHT fields are undefined in file \"") + filename + "\".";
+            *error = headerError;
         }
 
         return false;
     }
-    if (err == 2) {
-        clearPersistentMessage();
-        while ((err = std::fscanf(nfile, " %1023[^\n]", item)) != EOF && (*item == '#' || !err)) {
-            int c = std::fgetc(nfile);
-            (void)c;
-        }
-        if (std::sscanf(item, "%lf", &scale) != 1) {
-            setPersistentMessage(Message::eMessageWarning, "", string("SCALE field is undefined in file \"") + filename + "\".");
-        }
+    clearPersistentMessage();
+    if (!header.hasScale) {
+        setPersistentMessage(Message::eMessageWarning, "", string("SCALE field is undefined in file \"") + filename + "\".");
     }
-    std::fclose(nfile);
 
     bounds->x1 = 0;
-    bounds->x2 = W;
+    bounds->x2 = header.width;
     bounds->y1 = 0;
-    bounds->y2 = H;
+    bounds->y2 = header.height;
     *format = *bounds;
     *par = 1.;
     *tile_width = *tile_height = 0;
@@ -434,25 +532,14 @@ ReadPFMPlugin::guessParamsFromFilename(const string& /*newFile*/,
     if ((st != kOfxStatOK) || filename.empty()) {
         return false;
     }
-    stringstream ss;
-
     // read PFM header
-    std::FILE* const nfile = std::fopen(filename.c_str(), "rb");
-
-    char pfm_type = 0;
-    char item[1024] = { 0 };
-    int err = 0;
-    while ((err = std::fscanf(nfile, "%1023[^\n]", item)) != EOF && (*item == '#' || !err)) {
-        int c = std::fgetc(nfile);
-        (void)c;
-    }
-    if (std::sscanf(item, " P%c", &pfm_type) != 1) {
-        std::fclose(nfile);
-
-        // setPersistentMessage(Message::eMessageWarning, "", string("PFM header not found in file \"") + filename + "\".");
+    PFMHeader header;
+    string error;
+    if (!PFMHeaderCache::instance().get(filename, &header, &error)) {
+        // setPersistentMessage(Message::eMessageWarning, "", error);
         return false;
     }
-    std::fclose(nfile);
+    const char pfm_type = header.type;
 
     // set the components of _outputClip
     *components = ePixelComponentNone;
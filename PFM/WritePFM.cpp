@@ -48,7 +48,7 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kPluginDescription "Write PFM (Portable Float Map) files."
 #define kPluginIdentifier "fr.inria.openfx.WritePFM"
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 1 // Increment this when you have fixed a bug or made it faster.
 #define kPluginEvaluation 40 // plugin quality from 0 (bad) to 100 (perfect) or -1 if not evaluated
 
 #define kSupportsRGBA true
@@ -56,6 +56,9 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kSupportsXY false
 #define kSupportsAlpha true
 
+// size of the blocks written by each fwrite() call
+#define kWriteBatchBytes (1024 * 1024)
+
 /**
    \return \c false for "Little Endian", \c true for "Big Endian".
  **/
@@ -75,7 +78,8 @@ public:
     virtual ~WritePFMPlugin();
 
 private:
-    virtual void encode(const string& filename,
+    virtual void encode(void* user_data,
+                        const string& filename,
                         const OfxTime time,
                         const string& viewName,
                         const float* pixelData,
@@ -104,6 +108,7 @@ WritePFMPlugin::WritePFMPlugin(OfxImageEffectHandle handle,
 
 WritePFMPlugin::~WritePFMPlugin()
 {
+    stopWriteBehind();
 }
 
 template <class PIX, int srcC, int dstC>
@@ -141,7 +146,8 @@ copyLine(const PIX* pixelData,
 }
 
 void
-WritePFMPlugin::encode(const string& filename,
+WritePFMPlugin::encode(void* /*user_data*/,
+                       const string& filename,
                        const OfxTime /*time*/,
                        const string& /*viewName*/,
                        const float* pixelData,
@@ -153,8 +159,7 @@ WritePFMPlugin::encode(const string& filename,
                        const int rowBytes)
 {
     if ((dstNComps != 4) && (dstNComps != 3) && (dstNComps != 1)) {
-        setPersistentMessage(Message::eMessageError, "", "PFM: can only write RGBA, RGB or Alpha components images");
-        throwSuiteStatusException(kOfxStatErrFormat);
+        throwEncodeError("PFM: can only write RGBA, RGB or Alpha components images", kOfxStatErrFormat);
 
         return;
     }
@@ -167,37 +172,54 @@ WritePFMPlugin::encode(const string& filename,
 
     std::FILE* const nfile = fopen_utf8(filename.c_str(), "wb");
     if (!nfile) {
-        setPersistentMessage(Message::eMessageError, "", "Cannot open file \"" + filename + "\"");
-        throwSuiteStatusException(kOfxStatFailed);
+        throwEncodeError("Cannot open file \"" + filename + "\"");
 
         return;
     }
     int width = (bounds.x2 - bounds.x1);
     int height = (bounds.y2 - bounds.y1);
     const int depth = (dstNComps == 1 ? 1 : 3);
-    const unsigned int buf_size = width * depth;
-    vector<float> buffer(buf_size);
-    std::fill(buffer.begin(), buffer.end(), 0.);
+    const std::size_t buf_size = (std::size_t)width * depth;
 
     std::fprintf(nfile, "P%c\n%u %u\n%d.0\n", (dstNComps == 1 ? 'f' : 'F'), width, height, endianness() ? 1 : -1);
 
-    for (int y = 0; y < height; ++y) {
-        // now copy to the dstImg
-        if (depth == 1) {
-            assert(dstNComps == 1);
-            copyLine<float, 1, 1>(pixelData, rowBytes, width, height, dstNCompsStartIndex, pixelDataNComps, y, &buffer.front());
-        } else if (depth == 3) {
-            assert(dstNComps == 3 || dstNComps == 4);
-            if (dstNComps == 3) {
-                copyLine<float, 3, 3>(pixelData, rowBytes, width, height, dstNCompsStartIndex, pixelDataNComps, y, &buffer.front());
-            } else if (dstNComps == 4) {
-                copyLine<float, 4, 3>(pixelData, rowBytes, width, height, dstNCompsStartIndex, pixelDataNComps, y, &buffer.front());
+    bool ok = true;
+    if ((pixelDataNComps == depth) && (dstNCompsStartIndex == 0) && (rowBytes == (int)(buf_size * sizeof(float)))) {
+        // the image buffer has the layout of the file: write it directly
+        ok = (std::fwrite(pixelData, sizeof(float) * buf_size, height, nfile) == (std::size_t)height);
+    } else {
+        // convert batches of rows, so that each fwrite() call writes a large block
+        const int batchRows = (std::max)(1, (std::min)(height, (int)(kWriteBatchBytes / (buf_size * sizeof(float)))));
+        vector<float> buffer(buf_size * batchRows, 0.f);
+
+        for (int y = 0; ok && y < height; y += batchRows) {
+            const int nRows = (std::min)(batchRows, height - y);
+            for (int i = 0; i < nRows; ++i) {
+                float* image = &buffer[(std::size_t)i * buf_size];
+                // now copy to the dstImg
+                if (depth == 1) {
+                    assert(dstNComps == 1);
+                    copyLine<float, 1, 1>(pixelData, rowBytes, width, height, dstNCompsStartIndex, pixelDataNComps, y + i, image);
+                } else if (depth == 3) {
+                    assert(dstNComps == 3 || dstNComps == 4);
+                    if (dstNComps == 3) {
+                        copyLine<float, 3, 3>(pixelData, rowBytes, width, height, dstNCompsStartIndex, pixelDataNComps, y + i, image);
+                    } else if (dstNComps == 4) {
+                        copyLine<float, 4, 3>(pixelData, rowBytes, width, height, dstNCompsStartIndex, pixelDataNComps, y + i, image);
+                    }
+                }
             }
-        }
 
-        std::fwrite(&buffer.front(), sizeof(float), buf_size, nfile);
+            ok = (std::fwrite(&buffer.front(), sizeof(float) * buf_size, nRows, nfile) == (std::size_t)nRows);
+        }
+    }
+    if (std::fclose(nfile) != 0) {
+        ok = false;
+    }
+    if (!ok) {
+        OFX::remove_utf8(filename.c_str());
+        throwEncodeError("Cannot write file \"" + filename + "\"");
     }
-    std::fclose(nfile);
 }
 
 bool
@@ -249,6 +271,7 @@ WritePFMPluginFactory::describeInContext(ImageEffectDescriptor& desc,
                                                                     kSupportsAlpha,
                                                                     "scene_linear", "scene_linear", false);
 
+    GenericWriterDescribeWriteBehind(desc, page);
     GenericWriterDescribeInContextEnd(desc, context, page);
 }
 
@@ -55,7 +55,7 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kPluginDescription "Read PNG files."
 #define kPluginIdentifier "fr.inria.openfx.ReadPNG"
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 1 // Increment this when you have fixed a bug or made it faster.
 #define kPluginEvaluation 92 // better than ReadOIIO
 
 #define kParamShowMetadata "showMetadata"
@@ -85,6 +85,11 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kSupportsAlpha false
 #define kSupportsTiles false
 
+// size of the row batches decoded before conversion, small enough to stay in the CPU cache
+#define kDecodeBatchBytes (256 * 1024)
+// size of the stdio buffer used to read the file
+#define kFileBufferSize (256 * 1024)
+
 #define OFX_IO_LIBPNG_VERSION (PNG_LIBPNG_VER_MAJOR * 10000 + PNG_LIBPNG_VER_MINOR * 100 + PNG_LIBPNG_VER_RELEASE)
 
 // Try to deduce endianness
@@ -575,7 +580,7 @@ private:
     virtual void changedParam(const InstanceChangedArgs& args, const string& paramName) OVERRIDE FINAL;
     virtual bool isVideoStream(const string& /*filename*/) OVERRIDE FINAL { return false; }
 
-    virtual void decode(const string& filename, OfxTime time, int view, bool isPlayback, const OfxRectI& renderWindow, const OfxPointD& renderScale, float* pixelData, const OfxRectI& bounds, PixelComponentEnum pixelComponents, int pixelComponentCount, int rowBytes) OVERRIDE FINAL;
+    virtual void decode(const string& filename, OfxTime time, int view, bool isPlayback, const OfxRectI& renderWindow, const OfxPointD& renderScale, float* pixelData, const OfxRectI& bounds, PixelComponentEnum pixelComponents, int pixelComponentCount, int rowBytes, FusedColorConversion* colorConversion) OVERRIDE FINAL;
     virtual bool getFrameBounds(const string& filename, OfxTime time, int view, OfxRectI* bounds, OfxRectI* format, double* par, string* error, int* tile_width, int* tile_height) OVERRIDE FINAL;
 
     /**
@@ -1044,6 +1049,8 @@ ReadPNGPlugin::openFile(const string& filename,
     if (!*file) {
         throw std::runtime_error("Could not open file: " + filename);
     }
+    // libpng reads the file through small fread() calls: use a larger stdio buffer to reduce the number of system calls
+    std::setvbuf(*file, NULL, _IOFBF, kFileBufferSize);
 
     unsigned char sig[8];
     if (std::fread(sig, 1, sizeof(sig), *file) != sizeof(sig)) {
@@ -1094,7 +1101,8 @@ ReadPNGPlugin::decode(const string& filename,
                       const OfxRectI& bounds,
                       PixelComponentEnum pixelComponents,
                       int /*pixelComponentCount*/,
-                      int rowBytes)
+                      int rowBytes,
+                      FusedColorConversion* colorConversion)
 {
     if ((pixelComponents != ePixelComponentRGBA) && (pixelComponents != ePixelComponentRGB) && (pixelComponents != ePixelComponentXY) && (pixelComponents != ePixelComponentAlpha)) {
         setPersistentMessage(Message::eMessageError, "", "PNG: can only read RGBA, RGB or Alpha components images");
@@ -1120,24 +1128,69 @@ ReadPNGPlugin::decode(const string& filename,
     int realbitdepth;
     int colorType;
     double par;
-    getPNGInfo(png, info, &x1, &y1, &width, &height, &par, &nChannels, &bitdepth, &realbitdepth, &colorType, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    int interlaceType;
+    getPNGInfo(png, info, &x1, &y1, &width, &height, &par, &nChannels, &bitdepth, &realbitdepth, &colorType, 0, 0, &interlaceType, 0, 0, 0, 0, 0, 0, 0, 0);
 
     assert(renderWindow.x1 >= x1 && renderWindow.y1 >= y1 && renderWindow.x2 <= x1 + width && renderWindow.y2 <= y1 + height);
 
+    PixelComponentEnum srcComponents;
+    switch (nChannels) {
+    case 1:
+        srcComponents = ePixelComponentAlpha;
+        break;
+    case 2:
+        srcComponents = ePixelComponentXY;
+        break;
+    case 3:
+        srcComponents = ePixelComponentRGB;
+        break;
+    case 4:
+        srcComponents = ePixelComponentRGBA;
+        break;
+    default:
+        png_destroy_read_struct(&png, &info, NULL);
+        std::fclose(file);
+        setPersistentMessage(Message::eMessageError, "", "This plug-in only supports images with 1 to 4 channels");
+        throwSuiteStatusException(kOfxStatErrFormat);
+
+        return;
+    }
+
     std::size_t pngRowBytes = nChannels * width;
     if (bitdepth == eBitDepthUShort) {
         pngRowBytes *= sizeof(unsigned short);
     }
 
-    RamBuffer scratchBuffer(pngRowBytes * height);
+    OfxRectI srcBounds;
+    srcBounds.x1 = x1;
+    srcBounds.y1 = y1;
+    srcBounds.x2 = x1 + width;
+    srcBounds.y2 = y1 + height;
+
+    // Interlaced images need all passes before any row is complete: decode the full image.
+    // Other images are decoded by batches of rows, which are converted to the output buffer
+    // while they are still in the CPU cache, and decoding stops after the last row of the render window.
+    const int batchRows = (interlaceType == PNG_INTERLACE_NONE) ? (std::max)(1, (std::min)(height, (int)(kDecodeBatchBytes / pngRowBytes))) : height;
+
+    RamBuffer scratchBuffer(pngRowBytes * batchRows);
     unsigned char* tmpData = scratchBuffer.getData();
+    if (!tmpData) {
+        png_destroy_read_struct(&png, &info, NULL);
+        std::fclose(file);
+        throwSuiteStatusException(kOfxStatErrMemory);
+
+        return;
+    }
 
-    // if (interlace_type != 0) {
-    vector<unsigned char*> row_pointers(height);
-    for (int i = 0; i < height; ++i) {
+    vector<unsigned char*> row_pointers(batchRows);
+    for (int i = 0; i < batchRows; ++i) {
         row_pointers[i] = tmpData + i * pngRowBytes;
     }
 
+    // the file rows (top to bottom) needed by the render window. The conversion flips the image, see PixelConverterProcessor
+    const int firstRow = bounds.y2 - renderWindow.y2 - y1;
+    const int lastRow = bounds.y2 - 1 - renderWindow.y1 - y1;
+
     // Must call this setjmp in every function that does PNG reads
     if (setjmp(png_jmpbuf(png))) {
         png_destroy_read_struct(&png, &info, NULL);
@@ -1147,57 +1200,36 @@ ReadPNGPlugin::decode(const string& filename,
 
         return;
     }
-    png_read_image(png, &row_pointers[0]);
-    png_read_end(png, NULL);
-    /*
-       } else {
-        for (int y = 0; y < height; ++y) {
-            // Must call this setjmp in every function that does PNG reads
-            if (setjmp (png_jmpbuf (png))) {
-                png_destroy_read_struct(&png, &info, NULL);
-                std::fclose(file);
-                setPersistentMessage(Message::eMessageError, "", "PNG library error");
-                throwSuiteStatusException(kOfxStatErrFormat);
-
-                return;
+    if (batchRows == height) {
+        png_read_image(png, &row_pointers[0]);
+        png_read_end(png, NULL);
+        convertDepthAndComponents(tmpData, renderWindow, renderScale, srcBounds, srcComponents, bitdepth, pngRowBytes, pixelData, bounds, pixelComponents, rowBytes, colorConversion);
+    } else {
+        for (int row = 0; row <= lastRow && row < height; row += batchRows) {
+            const int nRows = (std::min)(batchRows, height - row);
+            png_read_rows(png, &row_pointers[0], NULL, nRows);
+            if (row + nRows <= firstRow) {
+                // rows above the render window
+                continue;
+            }
+            if (abort()) {
+                break;
             }
-            png_read_row (png, (png_bytep)tmpData + y * pngRowBytes, NULL);
+            // the part of the render window covered by this batch
+            OfxRectI batchWindow = renderWindow;
+            batchWindow.y1 = (std::max)(renderWindow.y1, bounds.y2 - y1 - row - nRows);
+            batchWindow.y2 = (std::min)(renderWindow.y2, bounds.y2 - y1 - row);
+            // the bounds of the batch buffer, as if it were the full image buffer starting at this row
+            OfxRectI batchBounds = srcBounds;
+            batchBounds.y1 = y1 + row;
+            convertDepthAndComponents(tmpData, batchWindow, renderScale, batchBounds, srcComponents, bitdepth, pngRowBytes, pixelData, bounds, pixelComponents, rowBytes, colorConversion);
         }
-       }
-     */
+        // the end of the file, if any, is not needed
+    }
 
     png_destroy_read_struct(&png, &info, NULL);
     std::fclose(file);
     file = NULL;
-
-    OfxRectI srcBounds;
-    srcBounds.x1 = x1;
-    srcBounds.y1 = y1;
-    srcBounds.x2 = x1 + width;
-    srcBounds.y2 = y1 + height;
-
-    PixelComponentEnum srcComponents;
-    switch (nChannels) {
-    case 1:
-        srcComponents = ePixelComponentAlpha;
-        break;
-    case 2:
-        srcComponents = ePixelComponentXY;
-        break;
-    case 3:
-        srcComponents = ePixelComponentRGB;
-        break;
-    case 4:
-        srcComponents = ePixelComponentRGBA;
-        break;
-    default:
-        setPersistentMessage(Message::eMessageError, "", "This plug-in only supports images with 1 to 4 channels");
-        throwSuiteStatusException(kOfxStatErrFormat);
-
-        return;
-    }
-
-    convertDepthAndComponents(tmpData, renderWindow, renderScale, srcBounds, srcComponents, bitdepth, pngRowBytes, pixelData, bounds, pixelComponents, rowBytes);
 } // ReadPNGPlugin::decode
 
 bool
@@ -24,6 +24,7 @@
 
 #include <algorithm>
 #include <cstdio> // fopen, fwrite...
+#include <cstdlib> // abs
 #include <vector>
 
 #include <png.h>
@@ -53,7 +54,7 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kPluginDescription "Write PNG files."
 #define kPluginIdentifier "fr.inria.openfx.WritePNG"
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 1 // Increment this when you have fixed a bug or made it faster.
 #define kPluginEvaluation 92 // plugin quality from 0 (bad) to 100 (perfect) or -1 if not evaluated. Better than WriteOIIO
 
 #define kSupportsRGBA true
@@ -163,6 +164,15 @@ swap_endian(T* f,
     }
 }
 
+/// The error handler of libpng: throw instead of calling longjmp(), so that the destructors of the C++ objects
+/// that are alive when libpng fails (buffers, processors) are called.
+static void
+pngErrorThrow(png_structp /*png*/,
+              png_const_charp message)
+{
+    throw std::runtime_error(string("PNG library error: ") + message);
+}
+
 /// Initializes a PNG write struct.
 /// \return empty string on success, C-string error message on failure.
 ///
@@ -189,7 +199,7 @@ create_write_struct(png_structp& sp,
         throw std::runtime_error("PNG only supports 1-4 channels");
     }
 
-    sp = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    sp = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, pngErrorThrow, NULL);
     if (!sp) {
         throw std::runtime_error("Could not create PNG write structure");
     }
@@ -198,11 +208,6 @@ create_write_struct(png_structp& sp,
     if (!ip) {
         throw std::runtime_error("Could not create PNG info structure");
     }
-
-    // Must call this setjmp in every function that does PNG writes
-    if (setjmp(png_jmpbuf(sp))) {
-        throw std::runtime_error("PNG library error");
-    }
 }
 
 /// Helper function - finalizes writing the image.
@@ -211,11 +216,6 @@ inline void
 finish_image(png_structp& sp,
              png_infop& ip)
 {
-    // Must call this setjmp in every function that does PNG writes
-    if (setjmp(png_jmpbuf(sp))) {
-        // error ("PNG library error");
-        return;
-    }
     png_write_end(sp, ip);
 }
 
@@ -341,6 +341,237 @@ convertPseudoRandomHashToRange(unsigned int lastRandomHash,
     return ((double)lastRandomHash / (double)0x100000000LL) * (max - min) + min;
 }
 
+// size of the input of each parallel deflate band. As in pigz, smaller bands compress worse.
+#define kDeflateBandMinBytes (256 * 1024)
+// the preset dictionary of a band is the end of the previous band, up to the deflate window size
+#define kDeflateWindowBytes 32768
+
+inline int
+paethPredictor(int a,
+               int b,
+               int c)
+{
+    const int p = a + b - c;
+    const int pa = std::abs(p - a);
+    const int pb = std::abs(p - b);
+    const int pc = std::abs(p - c);
+
+    if ((pa <= pb) && (pa <= pc)) {
+        return a;
+    }
+    if (pb <= pc) {
+        return b;
+    }
+
+    return c;
+}
+
+/// Filters a PNG row, and writes the filter type byte followed by the filtered bytes to out.
+/// All five filters are evaluated in a single pass over the row, and the one with the
+/// smallest sum of absolute (signed) values is used, which is the heuristic recommended by the
+/// PNG specification and used by libpng.
+static void
+filterPNGRow(const unsigned char* row,
+             const unsigned char* prevRow, // NULL for the first row
+             std::size_t rowBytes,
+             int bpp,
+             unsigned char* out)
+{
+    enum {
+        eFilterNone = 0, eFilterSub, eFilterUp, eFilterAverage, eFilterPaeth, eFilterCount
+    };
+
+    unsigned long sums[eFilterCount] = { 0, 0, 0, 0, 0 };
+    for (std::size_t i = 0; i < rowBytes; ++i) {
+        const int x = row[i];
+        const int a = (i >= (std::size_t)bpp) ? row[i - bpp] : 0;
+        const int b = prevRow ? prevRow[i] : 0;
+        const int c = (prevRow && i >= (std::size_t)bpp) ? prevRow[i - bpp] : 0;
+        // the filtered byte, seen as a signed value
+        sums[eFilterNone] += std::abs((int)(signed char)(unsigned char)x);
+        sums[eFilterSub] += std::abs((int)(signed char)(unsigned char)(x - a));
+        sums[eFilterUp] += std::abs((int)(signed char)(unsigned char)(x - b));
+        sums[eFilterAverage] += std::abs((int)(signed char)(unsigned char)(x - ((a + b) >> 1)));
+        sums[eFilterPaeth] += std::abs((int)(signed char)(unsigned char)(x - paethPredictor(a, b, c)));
+    }
+    int filter = eFilterNone;
+    for (int f = eFilterSub; f < eFilterCount; ++f) {
+        if (sums[f] < sums[filter]) {
+            filter = f;
+        }
+    }
+
+    out[0] = (unsigned char)filter;
+    ++out;
+    for (std::size_t i = 0; i < rowBytes; ++i) {
+        const int x = row[i];
+        const int a = (i >= (std::size_t)bpp) ? row[i - bpp] : 0;
+        const int b = prevRow ? prevRow[i] : 0;
+        const int c = (prevRow && i >= (std::size_t)bpp) ? prevRow[i - bpp] : 0;
+        int predictor = 0;
+        switch (filter) {
+        case eFilterSub:
+            predictor = a;
+            break;
+        case eFilterUp:
+            predictor = b;
+            break;
+        case eFilterAverage:
+            predictor = (a + b) >> 1;
+            break;
+        case eFilterPaeth:
+            predictor = paethPredictor(a, b, c);
+            break;
+        default:
+            break;
+        }
+        out[i] = (unsigned char)(x - predictor);
+    }
+} // filterPNGRow
+
+/// Filters the rows of the image in parallel.
+/// The rows of the source buffer are bottom-up, and the filtered rows are top-down, as in the file.
+class PNGFilterProcessor
+    : public MultiThread::Processor {
+public:
+    PNGFilterProcessor(const unsigned char* rows,
+                       std::size_t rowBytes,
+                       int height,
+                       int bpp,
+                       unsigned char* filtered)
+        : _rows(rows)
+        , _rowBytes(rowBytes)
+        , _height(height)
+        , _bpp(bpp)
+        , _filtered(filtered)
+    {
+    }
+
+    virtual void multiThreadFunction(unsigned int threadID,
+                                     unsigned int nThreads) OVERRIDE FINAL
+    {
+        const int r1 = (int)(((long long)_height * threadID) / nThreads);
+        const int r2 = (int)(((long long)_height * (threadID + 1)) / nThreads);
+        for (int r = r1; r < r2; ++r) {
+            const unsigned char* row = _rows + (std::size_t)(_height - 1 - r) * _rowBytes;
+            const unsigned char* prevRow = (r > 0) ? (row + _rowBytes) : NULL;
+            filterPNGRow(row, prevRow, _rowBytes, _bpp, _filtered + (std::size_t)r * (_rowBytes + 1));
+        }
+    }
+
+private:
+    const unsigned char* _rows;
+    std::size_t _rowBytes;
+    int _height;
+    int _bpp;
+    unsigned char* _filtered;
+};
+
+/// Compresses bands of the filtered data in parallel, each band as a separate raw deflate stream
+/// ending on a byte boundary (Z_SYNC_FLUSH), using the end of the previous band as preset dictionary.
+/// The concatenation of the bands is a single valid deflate stream, as done by pigz.
+class PNGDeflateProcessor
+    : public MultiThread::Processor {
+public:
+    PNGDeflateProcessor(const unsigned char* data,
+                        const vector<std::size_t>& bandStarts, // nBands + 1 offsets
+                        int level,
+                        int strategy)
+        : _data(data)
+        , _bandStarts(bandStarts)
+        , _level(level)
+        , _strategy(strategy)
+        , _bands(bandStarts.size() - 1)
+        , _adlers(bandStarts.size() - 1, 0)
+        , _ok(bandStarts.size() - 1, 0)
+    {
+    }
+
+    virtual void multiThreadFunction(unsigned int threadID,
+                                     unsigned int nThreads) OVERRIDE FINAL
+    {
+        for (std::size_t band = threadID; band < _bands.size(); band += nThreads) {
+            _ok[band] = compressBand(band);
+        }
+    }
+
+    bool ok() const
+    {
+        return std::find(_ok.begin(), _ok.end(), 0) == _ok.end();
+    }
+
+    const vector<vector<unsigned char> >& bands() const { return _bands; }
+
+    /// The Adler-32 checksum of all the data, as required by the zlib trailer
+    uLong adler() const
+    {
+        uLong adler = _adlers[0];
+        for (std::size_t band = 1; band < _bands.size(); ++band) {
+            adler = adler32_combine(adler, _adlers[band], (z_off_t)(_bandStarts[band + 1] - _bandStarts[band]));
+        }
+
+        return adler;
+    }
+
+private:
+    bool compressBand(std::size_t band)
+    {
+        const std::size_t start = _bandStarts[band];
+        const std::size_t length = _bandStarts[band + 1] - start;
+        const bool last = (band + 1 == _bands.size());
+
+        _adlers[band] = adler32(adler32(0L, Z_NULL, 0), _data + start, (uInt)length);
+
+        z_stream zs;
+        zs.zalloc = Z_NULL;
+        zs.zfree = Z_NULL;
+        zs.opaque = Z_NULL;
+        // negative window bits: raw deflate, the zlib header and trailer are written by the caller
+        if (deflateInit2(&zs, _level, Z_DEFLATED, -15, 8, _strategy) != Z_OK) {
+            return false;
+        }
+        if (band > 0) {
+            const std::size_t dictLength = (std::min)(start, (std::size_t)kDeflateWindowBytes);
+            deflateSetDictionary(&zs, _data + start - dictLength, (uInt)dictLength);
+        }
+        vector<unsigned char>& out = _bands[band];
+        // room for the sync flush marker and some slack
+        out.resize(deflateBound(&zs, (uLong)length) + 16);
+        zs.next_in = const_cast<Bytef*>(_data + start);
+        zs.avail_in = (uInt)length;
+        zs.next_out = &out[0];
+        zs.avail_out = (uInt)out.size();
+        const int flush = last ? Z_FINISH : Z_SYNC_FLUSH;
+        int ret;
+        for (;;) {
+            ret = deflate(&zs, flush);
+            if ((ret == Z_STREAM_END) || ((ret == Z_OK) && (zs.avail_in == 0) && (zs.avail_out > 0) && !last)) {
+                break;
+            }
+            if ((ret != Z_OK) && (ret != Z_BUF_ERROR)) {
+                break;
+            }
+            // the output buffer is full: grow it
+            const std::size_t used = out.size() - zs.avail_out;
+            out.resize(out.size() * 2);
+            zs.next_out = &out[used];
+            zs.avail_out = (uInt)(out.size() - used);
+        }
+        out.resize(zs.total_out);
+        deflateEnd(&zs);
+
+        return (ret == Z_STREAM_END) || (ret == Z_OK);
+    } // compressBand
+
+    const unsigned char* _data;
+    const vector<std::size_t>& _bandStarts;
+    int _level;
+    int _strategy;
+    vector<vector<unsigned char> > _bands;
+    vector<uLong> _adlers;
+    vector<char> _ok;
+};
+
 class WritePNGPlugin
     : public GenericWriterPlugin {
 public:
@@ -349,7 +580,8 @@ public:
     virtual ~WritePNGPlugin();
 
 private:
-    virtual void encode(const string& filename,
+    virtual void encode(void* user_data,
+                        const string& filename,
                         const OfxTime time,
                         const string& viewName,
                         const float* pixelData,
@@ -389,19 +621,19 @@ private:
                     PNGBitDepthEnum bitdepth);
 
     template <int srcNComps, int dstNComps>
-    void add_dither_for_components(OfxTime time,
-                                   unsigned int seed,
+    void add_dither_for_components(const unsigned int* rowHashes,
                                    const float* src_pixels,
-                                   const OfxRectI& bounds,
+                                   int width,
+                                   int nRows,
                                    unsigned char* dst_pixels,
                                    int srcRowElements,
                                    int dstRowElements,
                                    int dstNCompsStartIndex);
 
-    void add_dither(OfxTime time,
-                    unsigned int seed,
+    void add_dither(const unsigned int* rowHashes,
                     const float* src_pixels,
-                    const OfxRectI& bounds,
+                    int width,
+                    int nRows,
                     unsigned char* dst_pixels,
                     int srcRowElements,
                     int dstRowElements,
@@ -409,6 +641,61 @@ private:
                     int srcNComps,
                     int dstNComps);
 
+    /// The conversion of the float buffer to the buffer used by PNG
+    struct ConvertArgs {
+        const float* pixelData;
+        int width;
+        int srcRowElements;
+        int pixelDataNComps;
+        int dstNCompsStartIndex;
+        int dstNComps;
+        PNGBitDepthEnum pngDepth;
+        bool dither;
+        const unsigned int* rowHashes; // the dither hash of each row
+        unsigned char* dstPixelData;
+        std::size_t pngRowBytes;
+    };
+
+    /// convert rows [y1, y2) (relative to the bottom of the image)
+    void convertRows(const ConvertArgs& args, int y1, int y2);
+
+    class ConvertProcessor
+        : public MultiThread::Processor {
+    public:
+        ConvertProcessor(WritePNGPlugin& plugin,
+                         const ConvertArgs& args,
+                         int height)
+            : _plugin(plugin)
+            , _args(args)
+            , _height(height)
+        {
+        }
+
+        virtual void multiThreadFunction(unsigned int threadID,
+                                         unsigned int nThreads) OVERRIDE FINAL
+        {
+            const int y1 = (int)(((long long)_height * threadID) / nThreads);
+            const int y2 = (int)(((long long)_height * (threadID + 1)) / nThreads);
+            _plugin.convertRows(_args, y1, y2);
+        }
+
+    private:
+        WritePNGPlugin& _plugin;
+        const ConvertArgs& _args;
+        int _height;
+    };
+
+    /// Writes the image data as IDAT chunks, filtering and compressing bands of rows in parallel.
+    /// Returns false if compression failed, in which case nothing was written.
+    bool writeParallel(png_structp png,
+                       const unsigned char* pngPixelData,
+                       std::size_t pngRowBytes,
+                       int height,
+                       int bpp,
+                       int compressionLevel,
+                       int compressionStrategy,
+                       unsigned int nThreads);
+
     ChoiceParam* _compression;
     IntParam* _compressionLevel;
     ChoiceParam* _bitdepth;
@@ -584,28 +871,37 @@ WritePNGPlugin::write_info(png_structp& sp,
     png_set_packing(sp); // Pack 1, 2, 4 bit into bytes
 }
 
+// Quantize n values as floatToInt<numvals>() does (NaN gives 0). The loop has no branch, so that the compiler
+// vectorizes it.
+template <int numvals, typename PIX>
+static void
+quantize(const float* src,
+         int n,
+         PIX* dst)
+{
+    for (int i = 0; i < n; ++i) {
+        const float value = (std::min)((std::max)(0.f, src[i]), 1.f);
+        dst[i] = (PIX)(int)(value * (numvals - 1) + 0.5f);
+    }
+}
+
 template <int srcNComps, int dstNComps>
 void
-WritePNGPlugin::add_dither_for_components(OfxTime time,
-                                          unsigned int seed,
+WritePNGPlugin::add_dither_for_components(const unsigned int* rowHashes,
                                           const float* src_pixels,
-                                          const OfxRectI& bounds,
+                                          int width,
+                                          int nRows,
                                           unsigned char* dst_pixels,
                                           int srcRowElements,
                                           int dstRowElements,
                                           int dstNCompsStartIndex)
 {
-    unsigned int randHash = pseudoRandomHashSeed(time, seed);
-
     assert(srcNComps >= 3 && dstNComps >= 3);
 
-    int width = bounds.x2 - bounds.x1;
-
-    for (int y = bounds.y1; y < bounds.y2; ++y,
+    for (int y = 0; y < nRows; ++y,
              src_pixels += srcRowElements,
              dst_pixels += dstRowElements) {
-        randHash = generatePseudoRandomHash(randHash);
-        int start = convertPseudoRandomHashToRange(randHash, 0, (bounds.x2 - bounds.x1));
+        int start = convertPseudoRandomHashToRange(rowHashes[y], 0, width);
 
         for (int backward = 0; backward < 2; ++backward) {
             int index = backward ? start - 1 : start;
@@ -641,10 +937,10 @@ WritePNGPlugin::add_dither_for_components(OfxTime time,
 }
 
 void
-WritePNGPlugin::add_dither(OfxTime time,
-                           unsigned int seed,
+WritePNGPlugin::add_dither(const unsigned int* rowHashes,
                            const float* src_pixels,
-                           const OfxRectI& bounds,
+                           int width,
+                           int nRows,
                            unsigned char* dst_pixels,
                            int srcRowElements,
                            int dstRowElements,
@@ -654,21 +950,147 @@ WritePNGPlugin::add_dither(OfxTime time,
 {
     if (srcNComps == 3) {
         if (dstNComps == 3) {
-            add_dither_for_components<3, 3>(time, seed, src_pixels, bounds, dst_pixels, srcRowElements, dstRowElements, dstNCompsStartIndex);
+            add_dither_for_components<3, 3>(rowHashes, src_pixels, width, nRows, dst_pixels, srcRowElements, dstRowElements, dstNCompsStartIndex);
         } else if (dstNComps == 4) {
-            add_dither_for_components<3, 4>(time, seed, src_pixels, bounds, dst_pixels, srcRowElements, dstRowElements, dstNCompsStartIndex);
+            add_dither_for_components<3, 4>(rowHashes, src_pixels, width, nRows, dst_pixels, srcRowElements, dstRowElements, dstNCompsStartIndex);
         }
     } else if (srcNComps == 4) {
         if (dstNComps == 3) {
-            add_dither_for_components<4, 3>(time, seed, src_pixels, bounds, dst_pixels, srcRowElements, dstRowElements, dstNCompsStartIndex);
+            add_dither_for_components<4, 3>(rowHashes, src_pixels, width, nRows, dst_pixels, srcRowElements, dstRowElements, dstNCompsStartIndex);
         } else if (dstNComps == 4) {
-            add_dither_for_components<4, 4>(time, seed, src_pixels, bounds, dst_pixels, srcRowElements, dstRowElements, dstNCompsStartIndex);
+            add_dither_for_components<4, 4>(rowHashes, src_pixels, width, nRows, dst_pixels, srcRowElements, dstRowElements, dstNCompsStartIndex);
         }
     }
 }
 
 void
-WritePNGPlugin::encode(const string& filename,
+WritePNGPlugin::convertRows(const ConvertArgs& args,
+                            int y1,
+                            int y2)
+{
+    if (y1 >= y2) {
+        return;
+    }
+    const int nComps = (std::min)(args.dstNComps, args.pixelDataNComps);
+    const int dstRowElements = args.width * args.dstNComps;
+    const float* src_row = args.pixelData + (std::size_t)y1 * args.srcRowElements;
+    // the rows have the same components as the PNG: quantize them as flat arrays
+    const bool contiguous = (args.pixelDataNComps == args.dstNComps) && (args.dstNCompsStartIndex == 0);
+
+    if (args.pngDepth == ePNGBitDepthUByte) {
+        unsigned char* dst_row = args.dstPixelData + (std::size_t)y1 * args.pngRowBytes;
+        if (!args.dither || (nComps < 3)) {
+            // no dither
+            for (int y = y1; y < y2; ++y, src_row += args.srcRowElements, dst_row += args.pngRowBytes) {
+                if (contiguous) {
+                    quantize<256>(src_row, dstRowElements, dst_row);
+                    continue;
+                }
+                const float* src_pixels = src_row;
+                unsigned char* dst_pixels = dst_row;
+                for (int x = 0; x < args.width; ++x, dst_pixels += args.dstNComps, src_pixels += args.pixelDataNComps) {
+                    for (int c = 0; c < nComps; ++c) {
+                        dst_pixels[c] = floatToInt<256>(src_pixels[args.dstNCompsStartIndex + c]);
+                    }
+                }
+            }
+        } else {
+            add_dither(args.rowHashes + y1, src_row, args.width, y2 - y1, dst_row, args.srcRowElements, dstRowElements, args.dstNCompsStartIndex, args.pixelDataNComps, args.dstNComps);
+        }
+    } else {
+        assert(args.pngDepth == ePNGBitDepthUShort);
+        for (int y = y1; y < y2; ++y, src_row += args.srcRowElements) {
+            const float* src_pixels = src_row;
+            unsigned short* dst_row = reinterpret_cast<unsigned short*>(args.dstPixelData + (std::size_t)y * args.pngRowBytes);
+            unsigned short* dst_pixels = dst_row;
+            if (contiguous) {
+                quantize<65536>(src_row, dstRowElements, dst_row);
+            } else {
+                for (int x = 0; x < args.width; ++x, dst_pixels += args.dstNComps, src_pixels += args.pixelDataNComps) {
+                    for (int c = 0; c < nComps; ++c) {
+                        dst_pixels[c] = floatToInt<65536>(src_pixels[args.dstNCompsStartIndex + c]);
+                    }
+                }
+            }
+            // PNG is always big endian
+            if (littleendian()) {
+                swap_endian(dst_row, (std::size_t)dstRowElements);
+            }
+        }
+    }
+} // WritePNGPlugin::convertRows
+
+bool
+WritePNGPlugin::writeParallel(png_structp png,
+                              const unsigned char* pngPixelData,
+                              std::size_t pngRowBytes,
+                              int height,
+                              int bpp,
+                              int compressionLevel,
+                              int compressionStrategy,
+                              unsigned int nThreads)
+{
+    // filter all rows
+    const std::size_t filteredRowBytes = pngRowBytes + 1;
+    const std::size_t filteredBytes = filteredRowBytes * height;
+    RamBuffer filteredBuffer(filteredBytes);
+    unsigned char* filtered = filteredBuffer.getData();
+    if (!filtered) {
+        return false;
+    }
+    {
+        PNGFilterProcessor processor(pngPixelData, pngRowBytes, height, bpp, filtered);
+        processor.multiThread(nThreads);
+    }
+
+    // split into bands of whole rows
+    const int nBands = (int)(std::min)((std::size_t)height, (std::max)((std::size_t)1, (std::min)((std::size_t)nThreads * 4, filteredBytes / kDeflateBandMinBytes)));
+    vector<std::size_t> bandStarts(nBands + 1);
+    for (int band = 0; band <= nBands; ++band) {
+        bandStarts[band] = (std::size_t)(((long long)height * band) / nBands) * filteredRowBytes;
+    }
+    PNGDeflateProcessor processor(filtered, bandStarts, compressionLevel, compressionStrategy);
+    processor.multiThread((std::min)(nThreads, (unsigned int)nBands));
+    if (!processor.ok()) {
+        return false;
+    }
+
+    // zlib header, see RFC 1950. FLEVEL is computed as in deflate.c.
+    const int level = (compressionLevel == Z_DEFAULT_COMPRESSION) ? 6 : compressionLevel;
+    const unsigned int flevel = ( (compressionStrategy >= Z_HUFFMAN_ONLY) || (level < 2) ) ? 0 : (level < 6) ? 1 : (level == 6) ? 2 : 3;
+    unsigned int header = (0x78 << 8) + (flevel << 6);
+    header += 31 - (header % 31);
+    const unsigned char zlibHeader[2] = { (unsigned char)(header >> 8), (unsigned char)(header & 0xff) };
+    const uLong adler = processor.adler();
+    const unsigned char zlibTrailer[4] = { (unsigned char)(adler >> 24), (unsigned char)((adler >> 16) & 0xff), (unsigned char)((adler >> 8) & 0xff), (unsigned char)(adler & 0xff) };
+
+    // one IDAT chunk per band
+    const vector<vector<unsigned char> >& bands = processor.bands();
+    for (int band = 0; band < nBands; ++band) {
+        const bool first = (band == 0);
+        const bool last = (band + 1 == nBands);
+        const std::size_t length = bands[band].size() + (first ? sizeof(zlibHeader) : 0) + (last ? sizeof(zlibTrailer) : 0);
+        png_write_chunk_start(png, (png_bytep)"IDAT", (png_uint_32)length);
+        if (first) {
+            png_write_chunk_data(png, (png_bytep)zlibHeader, sizeof(zlibHeader));
+        }
+        if (!bands[band].empty()) {
+            png_write_chunk_data(png, (png_bytep)&bands[band][0], bands[band].size());
+        }
+        if (last) {
+            png_write_chunk_data(png, (png_bytep)zlibTrailer, sizeof(zlibTrailer));
+        }
+        png_write_chunk_end(png);
+    }
+    // png_write_end() would complain that no IDAT was written through libpng: write IEND ourselves
+    png_write_chunk(png, (png_bytep)"IEND", NULL, 0);
+
+    return true;
+} // WritePNGPlugin::writeParallel
+
+void
+WritePNGPlugin::encode(void* /*user_data*/,
+                       const string& filename,
                        const OfxTime time,
                        const string& /*viewName*/,
                        const float* pixelData,
@@ -692,43 +1114,31 @@ WritePNGPlugin::encode(const string& filename,
         OFX::remove_utf8(filename.c_str());
     }
 
-    png_structp png = NULL;
-    png_infop info = NULL;
-    FILE* file = NULL;
-    int color_type = PNG_COLOR_TYPE_GRAY;
-    try {
-        openFile(filename, dstNComps, &png, &info, &file, &color_type);
-    } catch (const std::exception& e) {
-        setPersistentMessage(Message::eMessageError, "", e.what());
-        throwSuiteStatusException(kOfxStatFailed);
-    }
-
-    png_init_io(png, file);
-
+    // read the parameters before creating the file
     int compressionLevelParam;
     _compressionLevel->getValue(compressionLevelParam);
     assert(compressionLevelParam >= 0 && compressionLevelParam <= 9);
     int compressionLevel = (std::max)((std::min)(compressionLevelParam, Z_BEST_COMPRESSION), Z_NO_COMPRESSION);
-    png_set_compression_level(png, compressionLevel);
 
     int compression_i;
     _compression->getValue(compression_i);
+    int compressionStrategy;
     switch (compression_i) {
     case 1:
-        png_set_compression_strategy(png, Z_FILTERED);
+        compressionStrategy = Z_FILTERED;
         break;
     case 2:
-        png_set_compression_strategy(png, Z_HUFFMAN_ONLY);
+        compressionStrategy = Z_HUFFMAN_ONLY;
         break;
     case 3:
-        png_set_compression_strategy(png, Z_RLE);
+        compressionStrategy = Z_RLE;
         break;
     case 4:
-        png_set_compression_strategy(png, Z_FIXED);
+        compressionStrategy = Z_FIXED;
         break;
     case 0:
     default:
-        png_set_compression_strategy(png, Z_DEFAULT_STRATEGY);
+        compressionStrategy = Z_DEFAULT_STRATEGY;
         break;
     }
 
@@ -737,82 +1147,94 @@ WritePNGPlugin::encode(const string& filename,
 #ifdef OFX_IO_USING_OCIO
     _ocio->getOutputColorspace(ocioColorspace);
 #endif
-    write_info(png, info, color_type, bounds.x1, bounds.y1, bounds.x2 - bounds.x1, bounds.y2 - bounds.y1, pixelAspectRatio, ocioColorspace, pngDepth);
+    const bool ditherEnabled = (pngDepth == ePNGBitDepthUByte) && _ditherEnabled->getValue();
 
-    int bitDepthSize = ((pngDepth == ePNGBitDepthUShort) ? sizeof(unsigned short) : sizeof(unsigned char));
+    png_structp png = NULL;
+    png_infop info = NULL;
+    FILE* file = NULL;
+    int color_type = PNG_COLOR_TYPE_GRAY;
+    try {
+        openFile(filename, dstNComps, &png, &info, &file, &color_type);
+    } catch (const std::exception& e) {
+        setPersistentMessage(Message::eMessageError, "", e.what());
+        throwSuiteStatusException(kOfxStatFailed);
+    }
 
-    // Convert the float buffer to the buffer used by PNG
-    int dstRowElements = (bounds.x2 - bounds.x1) * dstNComps;
-    std::size_t pngRowBytes = dstRowElements * bitDepthSize;
-    std::size_t scratchBufBytes = (bounds.y2 - bounds.y1) * pngRowBytes;
+    // libpng errors are thrown by pngErrorThrow()
+    string error;
+    try {
+        png_init_io(png, file);
+        png_set_compression_level(png, compressionLevel);
+        png_set_compression_strategy(png, compressionStrategy);
+        write_info(png, info, color_type, bounds.x1, bounds.y1, bounds.x2 - bounds.x1, bounds.y2 - bounds.y1, pixelAspectRatio, ocioColorspace, pngDepth);
 
-    RamBuffer scratchBuffer(scratchBufBytes);
-    int nComps = (std::min)(dstNComps, pixelDataNComps);
-    const int srcRowElements = rowBytes / sizeof(float);
-    const size_t numPixels = (size_t)(bounds.x2 - bounds.x1) * (size_t)(bounds.y2 - bounds.y1);
+        int bitDepthSize = ((pngDepth == ePNGBitDepthUShort) ? sizeof(unsigned short) : sizeof(unsigned char));
 
-    assert(srcRowElements == (bounds.x2 - bounds.x1) * pixelDataNComps);
-    assert(scratchBufBytes == numPixels * dstNComps * bitDepthSize);
+        // Convert the float buffer to the buffer used by PNG
+        const int width = bounds.x2 - bounds.x1;
+        const int height = bounds.y2 - bounds.y1;
+        int dstRowElements = width * dstNComps;
+        std::size_t pngRowBytes = dstRowElements * bitDepthSize;
+        std::size_t scratchBufBytes = height * pngRowBytes;
 
-    const float* src_pixels = pixelData;
+        RamBuffer scratchBuffer(scratchBufBytes);
+        const int srcRowElements = rowBytes / sizeof(float);
 
-    if (pngDepth == ePNGBitDepthUByte) {
-        bool ditherEnabled = _ditherEnabled->getValue();
+        assert(srcRowElements == width * pixelDataNComps);
 
-        unsigned char* dstPixelData = scratchBuffer.getData();
-        unsigned char* dst_pixels = dstPixelData;
+        const unsigned int nThreads = MultiThread::getNumCPUs();
 
-        // no dither
-        if (!ditherEnabled || (nComps < 3)) {
-            for (size_t i = 0; i < numPixels; ++i,
-                        dst_pixels += dstNComps,
-                        src_pixels += pixelDataNComps) {
-                assert(src_pixels == pixelData + i * pixelDataNComps);
-                assert(dst_pixels == dstPixelData + i * dstNComps);
-                for (int c = 0; c < nComps; ++c) {
-                    dst_pixels[c] = floatToInt<256>(src_pixels[dstNCompsStartIndex + c]);
-                }
-            }
-        } else {
-            assert(nComps >= 3);
+        // the dither hash of each row, which depends on the previous row
+        vector<unsigned int> rowHashes;
+        if (ditherEnabled) {
             const unsigned int ditherSeed = 2000;
-            add_dither(time, ditherSeed, src_pixels, bounds, dst_pixels, srcRowElements, dstRowElements, dstNCompsStartIndex, pixelDataNComps, dstNComps);
-        }
-    } else {
-        assert(pngDepth == ePNGBitDepthUShort);
-
-        unsigned short* dstPixelData = reinterpret_cast<unsigned short*>(scratchBuffer.getData());
-        unsigned short* dst_pixels = dstPixelData;
-
-        for (size_t i = 0; i < numPixels; ++i,
-                    dst_pixels += dstNComps,
-                    src_pixels += pixelDataNComps) {
-            assert(src_pixels == pixelData + i * pixelDataNComps);
-            assert(dst_pixels == dstPixelData + i * dstNComps);
-            for (int c = 0; c < nComps; ++c) {
-                dst_pixels[c] = floatToInt<65536>(src_pixels[dstNCompsStartIndex + c]);
+            unsigned int randHash = pseudoRandomHashSeed(time, ditherSeed);
+            rowHashes.resize(height);
+            for (int y = 0; y < height; ++y) {
+                randHash = generatePseudoRandomHash(randHash);
+                rowHashes[y] = randHash;
             }
         }
-        // PNG is always big endian
-        if (littleendian()) {
-            swap_endian(dstPixelData, numPixels * dstNComps);
+        {
+            ConvertArgs convertArgs;
+            convertArgs.pixelData = pixelData;
+            convertArgs.width = width;
+            convertArgs.srcRowElements = srcRowElements;
+            convertArgs.pixelDataNComps = pixelDataNComps;
+            convertArgs.dstNCompsStartIndex = dstNCompsStartIndex;
+            convertArgs.dstNComps = dstNComps;
+            convertArgs.pngDepth = pngDepth;
+            convertArgs.dither = ditherEnabled;
+            convertArgs.rowHashes = rowHashes.empty() ? NULL : &rowHashes[0];
+            convertArgs.dstPixelData = scratchBuffer.getData();
+            convertArgs.pngRowBytes = pngRowBytes;
+            ConvertProcessor processor(*this, convertArgs, height);
+            processor.multiThread((std::min)(nThreads, (unsigned int)(std::max)(1, height)));
         }
-    }
 
-    // Y is top down in PNG, so invert it now
-    for (int y = (bounds.y2 - bounds.y1 - 1); y >= 0; --y) {
-        if (setjmp(png_jmpbuf(png))) {
-            destroy_write_struct(png, info);
-            std::fclose(file);
-            setPersistentMessage(Message::eMessageError, "", "PNG library error");
-            throwSuiteStatusException(kOfxStatFailed);
+        if ((nThreads > 1) && (scratchBufBytes >= 2 * kDeflateBandMinBytes)) {
+            // Large images are filtered and compressed by bands of rows in parallel.
+            // Y is top down in PNG, the rows are inverted by the filter.
+            if (!writeParallel(png, scratchBuffer.getData(), pngRowBytes, height, dstNComps * bitDepthSize, compressionLevel, compressionStrategy, nThreads)) {
+                error = "PNG: compression failed";
+            }
+        } else {
+            // Y is top down in PNG, so invert it now
+            for (int y = (height - 1); y >= 0; --y) {
+                png_write_row(png, (png_byte*)scratchBuffer.getData() + y * pngRowBytes);
+            }
+            finish_image(png, info);
         }
-        png_write_row(png, (png_byte*)scratchBuffer.getData() + y * pngRowBytes);
+    } catch (const std::exception& e) {
+        error = e.what();
     }
-
-    finish_image(png, info);
     destroy_write_struct(png, info);
     std::fclose(file);
+    if (!error.empty()) {
+        OFX::remove_utf8(filename.c_str());
+        setPersistentMessage(Message::eMessageError, "", error);
+        throwSuiteStatusException(kOfxStatFailed);
+    }
 } // WritePNGPlugin::encode
 
 bool
@@ -27,6 +27,7 @@
 #include "RunScript.h"
 #include "ofxsMacros.h"
 
+#include <algorithm>
 #include <cfloat> // DBL_MAX
 #undef DEBUG
 #ifdef DEBUG
@@ -36,6 +37,8 @@
 #define DBG(x) (void)0
 #endif
 #include <cstdlib>
+#include <list>
+#include <signal.h>
 #include <sstream>
 #include <stdio.h> // for snprintf & _snprintf
 #include <string>
@@ -52,6 +55,7 @@
 #include "ofxsCopier.h"
 
 #include "pstream.h"
+#include "tinythread.h" // for tthread::thread and tthread::condition_variable
 
 using namespace OFX;
 
@@ -109,8 +113,11 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
     "This plugin uses pstream (http://pstreams.sourceforge.net), which is distributed under the Boost Software License, Version 1.0.\n"
 
 #define kPluginIdentifier "fr.inria.openfx.RunScript"
+// History:
+// version 1.0: initial version
+// version 1.1: persistent script process and asynchronous execution
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 1 // Increment this when you have fixed a bug or made it faster.
 
 #define kSupportsTiles 0
 #define kSupportsMultiResolution 0
@@ -120,6 +127,9 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kRunScriptPluginSourceClipCount 10
 #define kRunScriptPluginArgumentsCount 10
 
+#define kRunScriptWorkerExitTimeout 2000 // milliseconds given to the persistent process to exit after its standard input was closed
+#define kRunScriptWorkerTermTimeout 1000 // milliseconds given to the persistent process to exit after SIGTERM, before SIGKILL
+
 #define kGroupRunScriptPlugin "scriptParameters"
 #define kGroupRunScriptPluginLabel "Script Parameters"
 #define kGroupRunScriptPluginHint "The list of command-line parameters passed to the script."
@@ -151,6 +161,28 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
     "Contents of the script. Under Unix, the script should begin with a traditional shebang line, e.g. '#!/bin/sh' or '#!/usr/bin/env python'\n" \
     "The arguments can be accessed as usual from the script (in a Unix shell-script, argument 1 would be accessed as \"$1\" - use double quotes to avoid problems with spaces)."
 
+#define kParamPersistent "persistent"
+#define kParamPersistentLabel "Persistent Process"
+#define kParamPersistentHint                                                                                                      \
+    "Start the script only once, and keep it running to process all the frames, instead of starting it for each frame.\n"          \
+    "The script is started without arguments. For each frame, it receives on its standard input one line with the frame number " \
+    "followed by the parameters, separated by tabs (tabs, newlines and backslashes within a parameter are written as \\t, \\n "  \
+    "and \\\\), and it must write one line on its standard output when the frame is done: an empty line or \"ok\" on success, "    \
+    "else the line is reported as an error.\n"                                                                                    \
+    "Its standard input is closed when the script is edited or the effect is deleted, and it should then exit."
+#define kParamPersistentDefault false
+
+#define kParamJobQueueSize "jobQueueSize"
+#define kParamJobQueueSizeLabel "Asynchronous Jobs"
+#define kParamJobQueueSizeHint                                                                                                \
+    "Maximum number of frames for which the script may still be running when the render returns. When non-zero, the script " \
+    "is executed by a separate thread, in frame order, and the render only waits when that many frames are pending. All "   \
+    "pending frames are processed before the end of the sequence render, and errors are reported then or on the next "      \
+    "render. Only use this if the files produced by the script are not read while rendering the same sequence.\n"          \
+    "0 waits for the script to finish before returning from the render."
+#define kParamJobQueueSizeDefault 0
+#define kParamJobQueueSizeMax 16
+
 #define kParamValidate "validate"
 #define kParamValidateLabel "Validate"
 #define kParamValidateHint "Validate the script contents and execute it on next render. This locks the script and all its parameters."
@@ -176,6 +208,72 @@ unsignedToString(unsigned i)
     return nb;
 }
 
+// Write the script to a new executable temporary file, and return its name, or an empty string on error.
+static string
+writeScriptFile(const string& script)
+{
+    char scriptname[] = "/tmp/runscriptXXXXXX";
+    // Coverity suggests to call umask here for compatibility with POSIX<2008 systems,
+    // but umask affects the whole process. We prefer to ignore this.
+    // coverity[secure_temp]
+    int fd = mkstemp(scriptname); // modifies template
+    if (fd < 0) {
+        return string();
+    }
+    ssize_t s = write(fd, script.c_str(), script.size());
+    close(fd);
+    if (s < 0) {
+        (void)unlink(scriptname);
+
+        return string();
+    }
+
+    // make the script executable
+    int stat = chmod(scriptname, S_IRWXU);
+    if (stat != 0) {
+        (void)unlink(scriptname);
+
+        return string();
+    }
+
+    return scriptname;
+}
+
+// Escape a parameter sent to a persistent script, so that it fits in a tab-separated line.
+static string
+escapeArgument(const string& arg)
+{
+    string escaped;
+
+    escaped.reserve(arg.size());
+    for (string::const_iterator it = arg.begin(); it != arg.end(); ++it) {
+        switch (*it) {
+        case '\\':
+            escaped += "\\\\";
+            break;
+        case '\t':
+            escaped += "\\t";
+            break;
+        case '\n':
+            escaped += "\\n";
+            break;
+        default:
+            escaped += *it;
+            break;
+        }
+    }
+
+    return escaped;
+}
+
+// One execution of the script, for a given frame.
+struct ScriptJob {
+    double time;
+    string script;
+    vector<string> args; // the parameters, without the script name
+    bool persistent;
+};
+
 ////////////////////////////////////////////////////////////////////////////////
 /** @brief The plugin that does our work */
 class RunScriptPlugin
@@ -184,9 +282,14 @@ public:
     /** @brief ctor */
     RunScriptPlugin(OfxImageEffectHandle handle);
 
+    virtual ~RunScriptPlugin();
+
     /* Override the render */
     virtual void render(const RenderArguments& args) OVERRIDE FINAL;
 
+    /* override end sequence render */
+    virtual void endSequenceRender(const EndSequenceRenderArguments& args) OVERRIDE FINAL;
+
     /* override is identity */
     virtual bool isIdentity(const IsIdentityArguments& /*args*/,
                             Clip*& /*identityClip*/,
@@ -213,6 +316,26 @@ public:
 private:
     void updateVisibility(void);
 
+    // Run the script for one frame, and return false (and an error message) on failure.
+    bool runJob(const ScriptJob& job, string* errmsg);
+
+    // Start or reuse the persistent process running the given script.
+    bool startWorker(const string& script, string* errmsg);
+
+    // Close the standard input of the persistent process, and wait for it to exit,
+    // terminating it if it does not exit in time.
+    void stopWorker();
+
+    static void jobThreadFunction(void* arg);
+
+    void jobLoop();
+
+    // Wait until all the queued jobs have been run, and return the first error, if any.
+    string waitForJobs();
+
+    // Stop the job thread, after running the queued jobs, and return the first error, if any.
+    string stopJobThread();
+
 private:
     Clip* _srcClip[kRunScriptPluginSourceClipCount];
     Clip* _dstClip;
@@ -223,11 +346,33 @@ private:
     DoubleParam* _double[kRunScriptPluginArgumentsCount];
     IntParam* _int[kRunScriptPluginArgumentsCount];
     StringParam* _script;
+    BooleanParam* _persistent;
+    IntParam* _jobQueueSize;
     BooleanParam* _validate;
+
+    // The persistent process, and the temporary script file it runs, protected by _workerMutex.
+    tthread::mutex _workerMutex;
+    redi::pstream* _worker;
+    string _workerScript;
+    string _workerScriptName;
+
+    // Asynchronous execution: render() pushes jobs to _jobQueue, and _jobThread runs them in order.
+    // All members below are protected by _jobQueueMutex.
+    tthread::thread* _jobThread;
+    tthread::mutex _jobQueueMutex;
+    tthread::condition_variable _jobQueueCond; // signaled when a job is pushed, popped or done
+    std::list<ScriptJob> _jobQueue;
+    bool _jobBusy; // the job thread is running a job that was popped
+    bool _jobQuit; // the job thread should exit
+    string _jobError; // the first error since the last waitForJobs()
 };
 
 RunScriptPlugin::RunScriptPlugin(OfxImageEffectHandle handle)
     : ImageEffect(handle)
+    , _worker(NULL)
+    , _jobThread(NULL)
+    , _jobBusy(false)
+    , _jobQuit(false)
 {
     if (getContext() != eContextGenerator) {
         for (int i = 0; i < kRunScriptPluginSourceClipCount; ++i) {
@@ -255,13 +400,261 @@ RunScriptPlugin::RunScriptPlugin(OfxImageEffectHandle handle)
         assert(_type[i] && _filename[i] && _string[i] && _double[i] && _int[i]);
     }
     _script = fetchStringParam(kParamScript);
+    _persistent = fetchBooleanParam(kParamPersistent);
+    _jobQueueSize = fetchIntParam(kParamJobQueueSize);
     _validate = fetchBooleanParam(kParamValidate);
-    assert(_script && _validate);
+    assert(_script && _persistent && _jobQueueSize && _validate);
 
     // finally
     syncPrivateData();
 }
 
+RunScriptPlugin::~RunScriptPlugin()
+{
+    // the frames were reported as rendered, so the pending jobs are still run (an error cannot be reported anymore)
+    (void)stopJobThread();
+    stopWorker();
+}
+
+bool
+RunScriptPlugin::startWorker(const string& script,
+                             string* errmsg)
+{
+    if ( _worker && (_workerScript == script) && !_worker->rdbuf()->exited() ) {
+        return true;
+    }
+    stopWorker();
+
+    _workerScriptName = writeScriptFile(script);
+    if ( _workerScriptName.empty() ) {
+        *errmsg = "Cannot create the script file.";
+
+        return false;
+    }
+    vector<string> argv;
+    argv.push_back(_workerScriptName);
+    // stderr is not redirected, so that the script may use it for logging
+    _worker = new redi::pstream(_workerScriptName, argv, redi::pstreambuf::pstdin | redi::pstreambuf::pstdout);
+    if ( !_worker->is_open() ) {
+        *errmsg = "Cannot start the script.";
+        stopWorker();
+
+        return false;
+    }
+    _workerScript = script;
+
+    return true;
+}
+
+// wait at most timeout milliseconds for the process to exit
+static bool
+waitForExit(redi::pstreambuf* process,
+            int timeout)
+{
+    const int step = 10;
+
+    for (int elapsed = 0; elapsed < timeout; elapsed += step) {
+        if ( process->exited() ) {
+            return true;
+        }
+        usleep(step * 1000);
+    }
+
+    return process->exited();
+}
+
+void
+RunScriptPlugin::stopWorker()
+{
+    if (_worker) {
+        // closing its standard input tells the script to exit
+        redi::peof(*_worker);
+        // this is called from the UI thread: do not wait forever for a script that ignores EOF
+        if ( !waitForExit(_worker->rdbuf(), kRunScriptWorkerExitTimeout) ) {
+            _worker->rdbuf()->kill(SIGTERM);
+            if ( !waitForExit(_worker->rdbuf(), kRunScriptWorkerTermTimeout) ) {
+                _worker->rdbuf()->kill(SIGKILL);
+            }
+        }
+        _worker->close();
+        delete _worker;
+        _worker = NULL;
+    }
+    if ( !_workerScriptName.empty() ) {
+        (void)unlink( _workerScriptName.c_str() );
+        _workerScriptName.clear();
+    }
+    _workerScript.clear();
+}
+
+bool
+RunScriptPlugin::runJob(const ScriptJob& job,
+                        string* errmsg)
+{
+    if (!job.persistent) {
+        // create the script
+        string scriptname = writeScriptFile(job.script);
+        if ( scriptname.empty() ) {
+            *errmsg = "Cannot create the script file.";
+
+            return false;
+        }
+
+        // build the command-line
+        vector<string> argv;
+        argv.push_back(scriptname);
+        argv.insert( argv.end(), job.args.begin(), job.args.end() );
+
+        // execute the script
+        vector<string> errors;
+        redi::ipstream in(scriptname, argv, redi::pstreambuf::pstderr | redi::pstreambuf::pstderr);
+        string line;
+        while ( std::getline(in, line) ) {
+            errors.push_back(line);
+            DBG(std::cout << "output: " << line << std::endl);
+        }
+
+        // remove the script
+        (void)unlink( scriptname.c_str() );
+
+        return true;
+    }
+
+    tthread::lock_guard<tthread::mutex> guard(_workerMutex);
+    if ( !startWorker(job.script, errmsg) ) {
+        return false;
+    }
+
+    char name[256];
+    snprintf(name, sizeof(name), "%g", job.time);
+    string line = name;
+    for (vector<string>::const_iterator it = job.args.begin(); it != job.args.end(); ++it) {
+        line += '\t';
+        line += escapeArgument(*it);
+    }
+    line += '\n';
+
+    // If the script exited, writing to the pipe raises SIGPIPE, which would kill the host:
+    // block it in this thread during the write, and discard it if it was raised.
+    sigset_t sigpipeSet, pendingSet, oldSet;
+    sigemptyset(&sigpipeSet);
+    sigaddset(&sigpipeSet, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &sigpipeSet, &oldSet);
+    sigpending(&pendingSet);
+    const bool sigpipeWasPending = sigismember(&pendingSet, SIGPIPE);
+    *_worker << line << std::flush;
+    sigpending(&pendingSet);
+    if ( !sigpipeWasPending && sigismember(&pendingSet, SIGPIPE) ) {
+        int sig;
+        sigwait(&sigpipeSet, &sig);
+    }
+    pthread_sigmask(SIG_SETMASK, &oldSet, NULL);
+
+    string reply;
+    if ( !*_worker || !std::getline(*_worker, reply) ) {
+        // the script exited: it is started again for the next frame
+        *errmsg = "The script exited before processing frame " + string(name) + ".";
+        stopWorker();
+
+        return false;
+    }
+    DBG(std::cout << "reply: " << reply << std::endl);
+    if ( !reply.empty() && (reply != "ok") ) {
+        *errmsg = "Frame " + string(name) + ": " + reply;
+
+        return false;
+    }
+
+    return true;
+} // RunScriptPlugin::runJob
+
+void
+RunScriptPlugin::jobThreadFunction(void* arg)
+{
+    RunScriptPlugin* instance = static_cast<RunScriptPlugin*>(arg);
+
+    instance->jobLoop();
+}
+
+// Pop jobs from the queue and run them, until asked to quit.
+// After an error, the remaining jobs are discarded, and the error is reported by the next render.
+void
+RunScriptPlugin::jobLoop()
+{
+    for (;;) {
+        ScriptJob job;
+        {
+            tthread::lock_guard<tthread::mutex> guard(_jobQueueMutex);
+            while ( _jobQueue.empty() && !_jobQuit ) {
+                _jobQueueCond.wait(guard);
+            }
+            if ( _jobQueue.empty() ) {
+                // quit, and nothing left to run
+                return;
+            }
+            job = _jobQueue.front();
+            _jobQueue.pop_front();
+            _jobBusy = true;
+            _jobQueueCond.notify_all();
+        }
+        string errmsg;
+        bool ok = runJob(job, &errmsg);
+        {
+            tthread::lock_guard<tthread::mutex> guard(_jobQueueMutex);
+            _jobBusy = false;
+            if (!ok) {
+                _jobQueue.clear();
+                if ( _jobError.empty() ) {
+                    _jobError = errmsg;
+                }
+            }
+            _jobQueueCond.notify_all();
+        }
+    }
+}
+
+string
+RunScriptPlugin::waitForJobs()
+{
+    tthread::lock_guard<tthread::mutex> guard(_jobQueueMutex);
+    while ( !_jobQueue.empty() || _jobBusy ) {
+        _jobQueueCond.wait(guard);
+    }
+    string errmsg = _jobError;
+    _jobError.clear();
+
+    return errmsg;
+}
+
+string
+RunScriptPlugin::stopJobThread()
+{
+    if (!_jobThread) {
+        // keep the error for the next render
+        return string();
+    }
+    {
+        tthread::lock_guard<tthread::mutex> guard(_jobQueueMutex);
+        _jobQuit = true;
+        _jobQueueCond.notify_all();
+    }
+    _jobThread->join();
+    delete _jobThread;
+    _jobThread = NULL;
+    string errmsg;
+    {
+        tthread::lock_guard<tthread::mutex> guard(_jobQueueMutex);
+        _jobQueue.clear();
+        _jobBusy = false;
+        _jobQuit = false;
+        // the last jobs were run by join()
+        errmsg = _jobError;
+        _jobError.clear();
+    }
+
+    return errmsg;
+}
+
 void
 RunScriptPlugin::render(const RenderArguments& args)
 {
@@ -313,38 +706,11 @@ RunScriptPlugin::render(const RenderArguments& args)
     }
     checkBadRenderScaleOrField(dstImg, args);
 
-    // create the script
-    char scriptname[] = "/tmp/runscriptXXXXXX";
-    // Coverity suggests to call umask here for compatibility with POSIX<2008 systems,
-    // but umask affects the whole process. We prefer to ignore this.
-    // coverity[secure_temp]
-    int fd = mkstemp(scriptname); // modifies template
-    if (fd < 0) {
-        throwSuiteStatusException(kOfxStatFailed);
-
-        return;
-    }
-    string script;
-    _script->getValue(script);
-    ssize_t s = write(fd, script.c_str(), script.size());
-    close(fd);
-    if (s < 0) {
-        throwSuiteStatusException(kOfxStatFailed);
-
-        return;
-    }
-
-    // make the script executable
-    int stat = chmod(scriptname, S_IRWXU);
-    if (stat != 0) {
-        throwSuiteStatusException(kOfxStatFailed);
-
-        return;
-    }
-
     // build the command-line
-    vector<string> argv;
-    argv.push_back(scriptname);
+    ScriptJob job;
+    job.time = args.time;
+    _script->getValue(job.script);
+    job.persistent = _persistent->getValue();
 
     int param_count;
     _param_count->getValue(param_count);
@@ -361,7 +727,7 @@ RunScriptPlugin::render(const RenderArguments& args)
             _filename[i]->getValue(s);
             p = _filename[i];
             DBG(std::cout << p->getName() << "=" << s);
-            argv.push_back(s);
+            job.args.push_back(s);
             break;
         }
         case eRunScriptPluginParamTypeString: {
@@ -369,7 +735,7 @@ RunScriptPlugin::render(const RenderArguments& args)
             _string[i]->getValue(s);
             p = _string[i];
             DBG(std::cout << p->getName() << "=" << s);
-            argv.push_back(s);
+            job.args.push_back(s);
             break;
         }
         case eRunScriptPluginParamTypeDouble: {
@@ -378,7 +744,7 @@ RunScriptPlugin::render(const RenderArguments& args)
             p = _double[i];
             DBG(std::cout << p->getName() << "=" << v);
             snprintf(name, sizeof(name), "%g", v);
-            argv.push_back(name);
+            job.args.push_back(name);
             break;
         }
         case eRunScriptPluginParamTypeInteger: {
@@ -387,7 +753,7 @@ RunScriptPlugin::render(const RenderArguments& args)
             p = _int[i];
             DBG(std::cout << p->getName() << "=" << v);
             snprintf(name, sizeof(name), "%d", v);
-            argv.push_back(name);
+            job.args.push_back(name);
             break;
         }
         }
@@ -400,16 +766,44 @@ RunScriptPlugin::render(const RenderArguments& args)
     }
 
     // execute the script
-    vector<string> errors;
-    redi::ipstream in(scriptname, argv, redi::pstreambuf::pstderr | redi::pstreambuf::pstderr);
-    string errmsg;
-    while (std::getline(in, errmsg)) {
-        errors.push_back(errmsg);
-        DBG(std::cout << "output: " << errmsg << std::endl);
-    }
+    const int jobQueueSize = (std::max)(0, _jobQueueSize->getValue());
+    if (jobQueueSize > 0) {
+        if (!_jobThread) {
+            _jobThread = new tthread::thread(jobThreadFunction, this);
+        }
+        string errmsg;
+        {
+            tthread::lock_guard<tthread::mutex> guard(_jobQueueMutex);
+            while ( _jobError.empty() && ( (int)_jobQueue.size() >= jobQueueSize ) ) {
+                _jobQueueCond.wait(guard);
+            }
+            errmsg = _jobError;
+            _jobError.clear();
+            if ( errmsg.empty() ) {
+                _jobQueue.push_back(job);
+                _jobQueueCond.notify_all();
+            }
+        }
+        if ( !errmsg.empty() ) {
+            // an error occurred while running the script for a previous frame
+            setPersistentMessage(Message::eMessageError, "", errmsg);
+            throwSuiteStatusException(kOfxStatFailed);
 
-    // remove the script
-    (void)unlink(scriptname);
+            return;
+        }
+    } else {
+        // finish the jobs queued while asynchronous execution was on
+        string errmsg = waitForJobs();
+        if ( errmsg.empty() && !runJob(job, &errmsg) && errmsg.empty() ) {
+            errmsg = "Cannot run the script.";
+        }
+        if ( !errmsg.empty() ) {
+            setPersistentMessage(Message::eMessageError, "", errmsg);
+            throwSuiteStatusException(kOfxStatFailed);
+
+            return;
+        }
+    }
 
     // now copy the first input to output
 
@@ -436,6 +830,25 @@ RunScriptPlugin::render(const RenderArguments& args)
     }
 } // RunScriptPlugin::render
 
+void
+RunScriptPlugin::endSequenceRender(const EndSequenceRenderArguments& args)
+{
+    if (!kSupportsRenderScale && ((args.renderScale.x != 1.) || (args.renderScale.y != 1.))) {
+        throwSuiteStatusException(kOfxStatFailed);
+
+        return;
+    }
+
+    // the sequence is only rendered when the script was run for all frames
+    string errmsg = waitForJobs();
+    if ( !errmsg.empty() ) {
+        setPersistentMessage(Message::eMessageError, "", errmsg);
+        throwSuiteStatusException(kOfxStatFailed);
+
+        return;
+    }
+}
+
 void
 RunScriptPlugin::changedParam(const InstanceChangedArgs& args,
                               const string& paramName)
@@ -476,7 +889,26 @@ RunScriptPlugin::changedParam(const InstanceChangedArgs& args,
         }
         _script->setEnabled(!validated);
         _script->setEvaluateOnChange(validated);
-        clearPersistentMessage();
+        _persistent->setEnabled(!validated);
+        _persistent->setEvaluateOnChange(validated);
+        _jobQueueSize->setEnabled(!validated);
+        _jobQueueSize->setEvaluateOnChange(validated);
+        if (!validated) {
+            // the script may be edited: run the pending jobs, and let the persistent process exit
+            string errmsg = stopJobThread();
+            {
+                tthread::lock_guard<tthread::mutex> guard(_workerMutex);
+                stopWorker();
+            }
+            if ( !errmsg.empty() ) {
+                // the script failed for one of the last rendered frames
+                setPersistentMessage(Message::eMessageError, "", errmsg);
+            } else {
+                clearPersistentMessage();
+            }
+        } else {
+            clearPersistentMessage();
+        }
     } else {
         for (int i = 0; i < param_count; ++i) {
             if ((paramName == _type[i]->getName()) && (args.reason == eChangeUserEdit)) {
@@ -816,6 +1248,30 @@ RunScriptPluginFactory::describeInContext(ImageEffectDescriptor& desc,
         }
     }
 
+    {
+        BooleanParamDescriptor* param = desc.defineBooleanParam(kParamPersistent);
+        param->setLabel(kParamPersistentLabel);
+        param->setHint(kParamPersistentHint);
+        param->setDefault(kParamPersistentDefault);
+        param->setAnimates(false);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+
+    {
+        IntParamDescriptor* param = desc.defineIntParam(kParamJobQueueSize);
+        param->setLabel(kParamJobQueueSizeLabel);
+        param->setHint(kParamJobQueueSizeHint);
+        param->setDefault(kParamJobQueueSizeDefault);
+        param->setRange(0, kParamJobQueueSizeMax);
+        param->setDisplayRange(0, kParamJobQueueSizeMax);
+        param->setAnimates(false);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+
     {
         BooleanParamDescriptor* param = desc.defineBooleanParam(kParamValidate);
         param->setLabel(kParamValidateLabel);
@@ -25,6 +25,7 @@
 #include <algorithm>
 #include <cfloat> // DBL_MAX
 #include <limits>
+#include <list>
 #include <set>
 #include <vector>
 
@@ -51,6 +52,11 @@
 #include "ofxsMacros.h"
 #include "ofxsMultiThread.h"
 #include "ofxsRectangleInteract.h"
+#ifndef OFX_USE_MULTITHREAD_MUTEX
+// some OFX hosts do not have mutex handling in the MT-Suite (e.g. Sony Catalyst Edit)
+// prefer using the fast mutex by Marcus Geelnard http://tinythreadpp.bitsnbites.eu/
+#include "fast_mutex.h"
+#endif
 
 #define SEEXPR2
 #ifdef SEEXPR2
@@ -98,6 +104,14 @@ using std::vector;
 
 OFXS_NAMESPACE_ANONYMOUS_ENTER
 
+#ifdef OFX_USE_MULTITHREAD_MUTEX
+typedef MultiThread::Mutex Mutex;
+typedef MultiThread::AutoMutex AutoMutex;
+#else
+typedef tthread::fast_mutex Mutex;
+typedef MultiThread::AutoMutexT<tthread::fast_mutex> AutoMutex;
+#endif
+
 #define kPluginName "SeExpr"
 #define kPluginNameSimple "SeExprSimple"
 #define kPluginGrouping "Merge"
@@ -280,10 +294,13 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kPluginIdentifier "fr.inria.openfx.SeExpr"
 #define kPluginIdentifierSimple "fr.inria.openfx.SeExprSimple"
 #define kPluginVersionMajor 2 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 3 // Increment this when you have fixed a bug or made it faster.
 // History:
 // version 1: initial version
 // version 2: $scale replaced with $scalex, $scaley; added $par, $cx, $cy; getPixel replaced by cpixel/apixel
+// version 2.1: parsed expressions are kept across renders, rendering uses the multi-thread suite
+// version 2.2: expressions are evaluated by scanlines, and only once per row or tile when they do not depend on x or y
+// version 2.3: user parameters are read once per render instead of being locked at each evaluation
 
 #define kSupportsTiles 1
 #define kSupportsMultiResolution 1
@@ -291,6 +308,8 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kRenderThreadSafety eRenderFullySafe
 
 #define kSourceClipCount 10
+#define kTileHeight 16 // height of the bands of the render window given to the render threads
+#define kMaxThreadedPasses 2 // max number of multi-threaded passes that find images to fetch, before rendering on a single thread
 #define kParamsCount 10
 
 #define kSeExprCPixelFuncName "cpixel"
@@ -463,6 +482,7 @@ isSpaces(const string& s)
 }
 
 class SeExprProcessorBase;
+class OFXSeExpressionSet;
 
 ////////////////////////////////////////////////////////////////////////////////
 /** @brief The plugin that does our work */
@@ -472,6 +492,8 @@ public:
     /** @brief ctor */
     SeExprPlugin(OfxImageEffectHandle handle, bool simple);
 
+    virtual ~SeExprPlugin();
+
     /* Override the render */
     virtual void render(const RenderArguments& args) OVERRIDE FINAL;
 
@@ -495,11 +517,19 @@ public:
         return _srcClip[index];
     }
 
-    DoubleParam** getDoubleParams() { return _doubleParams; }
+    bool isSimple() const { return _simple; }
 
-    Double2DParam** getDouble2DParams() { return _double2DParams; }
+    /** @brief Get a set of parsed expressions for the given scripts, to be used by a single thread.
+        The set is taken from the cache if these scripts were already parsed, else it is created.
+        MT-safe. */
+    OFXSeExpressionSet* acquireExpressionSet(const string& rExpr,
+                                             const string& gExpr,
+                                             const string& bExpr,
+                                             const string& rgbExpr,
+                                             const string& alphaExpr);
 
-    RGBParam** getRGBParams() { return _colorParams; }
+    /** @brief Give back a set obtained by acquireExpressionSet() to the cache. MT-safe. */
+    void releaseExpressionSet(OFXSeExpressionSet* exprSet);
 
 private:
     void setupAndProcess(SeExprProcessorBase& processor, const RenderArguments& args);
@@ -536,6 +566,10 @@ private:
     Double2DParam* _size;
     BooleanParam* _interactive;
     ChoiceParam* _outputComponents;
+
+    // parsed expressions that are not in use by a render thread, most recently released first
+    std::list<OFXSeExpressionSet*> _exprSets;
+    Mutex _exprSetsMutex;
 };
 
 PixelComponentEnum
@@ -550,17 +584,36 @@ SeExprPlugin::getOutputComponents() const
 
 class OFXSeExpression;
 
-// Base class for processor, note that we do not use the multi-thread suite.
-class SeExprProcessorBase {
+/** @brief The values of the user parameters at the render time.
+    They are read once per render, before rendering, and copied to the variables of each
+    expression, so that evaluation needs no synchronization. */
+struct SeExprParamValues {
+    double doubles[kParamsCount];
+    double double2Ds[kParamsCount][2];
+    double colors[kParamsCount][3];
+};
+
+// Base class for processor. The render window is split into bands of rows, which are
+// rendered by the multi-thread suite, each thread using its own set of expressions.
+class SeExprProcessorBase
+    : public MultiThread::Processor {
 protected:
     OfxTime _renderTime;
     int _renderView;
     SeExprPlugin* _plugin;
-    OFXSeExpression* _rExpr;
-    OFXSeExpression* _gExpr;
-    OFXSeExpression* _bExpr;
-    OFXSeExpression* _rgbExpr;
-    OFXSeExpression* _alphaExpr;
+    string _rScript;
+    string _gScript;
+    string _bScript;
+    string _rgbScript;
+    string _alphaScript;
+    OfxRectI _dstPixelRod;
+    OfxPointD _renderScale;
+    double _par;
+    OfxPointI _inputSizes[kSourceClipCount];
+    OfxPointI _outputSize;
+    SeExprParamValues _paramValues;
+    OfxRectI _renderWindow;
+    bool _threadFailed;
     const Image* _srcCurTime[kSourceClipCount];
     int _nSrcComponents[kSourceClipCount];
     Image* _dstImg;
@@ -573,6 +626,9 @@ protected:
     typedef map<OfxTime, const Image*> FetchedImagesForClipMap;
     typedef map<int, FetchedImagesForClipMap> FetchedImagesMap;
     FetchedImagesMap _images;
+    bool _fetchAllowed; // false while the render threads run: the images are only fetched by the render action
+    std::set<pair<int, OfxTime> > _missingImages; // the images the render threads needed, but could not fetch
+    Mutex _mutex; // protects _images, _fetchAllowed, _missingImages and _threadFailed
 
 public:
     SeExprProcessorBase(SeExprPlugin* instance);
@@ -598,6 +654,8 @@ public:
 
     void doMasking(bool v) { _doMasking = v; }
 
+    void setParamValues(const SeExprParamValues& paramValues) { _paramValues = paramValues; }
+
     void setValues(OfxTime time,
                    int view,
                    double mix,
@@ -624,72 +682,63 @@ public:
 
     bool isExprOk(string* error);
 
-    void prefetchImage(int inputIndex,
-                       OfxTime time)
+    /** @brief Get the image of an input at the given time, fetching it if necessary. MT-safe.
+        In the render threads, an image that was not fetched yet is recorded as missing (see process()), and NULL is returned. */
+    const Image* getImage(int inputIndex,
+                          OfxTime time)
     {
+        AutoMutex l(&_mutex);
         // find or create input
         FetchedImagesForClipMap& foundInput = _images[inputIndex];
 
         FetchedImagesForClipMap::iterator foundImage = foundInput.find(time);
         if (foundImage != foundInput.end()) {
             // image already fetched
-            return;
+            return foundImage->second;
+        }
+        if (!_fetchAllowed) {
+            _missingImages.insert(make_pair(inputIndex, time));
+
+            return NULL;
         }
 
         Clip* clip = _plugin->getClip(inputIndex);
         assert(clip);
 
-        if (!clip->isConnected()) {
-            // clip is not connected, image is NULL
-            return;
-        }
-
-        Image* img = clip->fetchImage(time);
-        if (!img) {
-            return;
-        }
+        // if the clip is not connected or there is no image, NULL is also kept, so that the render threads find it
+        Image* img = clip->isConnected() ? clip->fetchImage(time) : NULL;
         pair<FetchedImagesForClipMap::iterator, bool> ret = foundInput.insert(make_pair(time, img));
         assert(ret.second);
+
+        return img;
     }
 
-    const Image* getImage(int inputIndex,
-                          OfxTime time)
-    {
-        // find or create input
-        FetchedImagesForClipMap& foundInput = _images[inputIndex];
+    /** @brief Render the given window, using the multi-thread suite. */
+    void process(const OfxRectI& renderWindow);
 
-        FetchedImagesForClipMap::iterator foundImage = foundInput.find(time);
-        if (foundImage != foundInput.end()) {
-            return foundImage->second;
-        }
+private:
+    virtual void multiThreadFunction(unsigned int threadID, unsigned int nThreads) OVERRIDE FINAL;
 
-        return NULL;
+    bool hasMissingImages()
+    {
+        AutoMutex l(&_mutex);
+
+        return !_missingImages.empty();
     }
 
-    virtual void process(OfxRectI procWindow) = 0;
+    OFXSeExpressionSet* acquireExpressionSet();
 
-private:
-    void setExprs(OfxTime time,
-                  const string& rgbExpr,
-                  const string& alphaExpr,
-                  const OfxRectI& dstPixelRod,
-                  const OfxPointD& renderScale,
-                  double par);
-
-    void setExprsSimple(OfxTime time,
-                        const string& rExpr,
-                        const string& gExpr,
-                        const string& bExpr,
-                        const string& aExpr,
-                        const OfxRectI& dstPixelRod,
-                        const OfxPointD& renderScale,
-                        double par);
+    // render a band of the render window, using a set of expressions owned by the calling thread
+    virtual void processTile(const OfxRectI& procWindow, OFXSeExpressionSet& exprSet) = 0;
 
     void setValuesOther(OfxTime time,
                         int view,
                         double mix,
+                        const OfxRectI& dstPixelRod,
                         OfxPointI* inputSizes,
-                        const OfxPointI& outputSize);
+                        const OfxPointI& outputSize,
+                        const OfxPointD& renderScale,
+                        double par);
 };
 
 // implementation of the "apixel" function
@@ -802,14 +851,17 @@ class PixelFuncX
     SeExprProcessorBase* _processor;
 
 public:
-    PixelFuncX(SeExprProcessorBase* processor)
+    PixelFuncX()
         : SeExpr2::ExprFuncX(true) // Thread Safe
-        , _processor(processor)
+        , _processor(NULL)
     {
     }
 
     virtual ~PixelFuncX() { }
 
+    /** the processor of the current render, which provides the images */
+    void setProcessor(SeExprProcessorBase* processor) { _processor = processor; }
+
 private:
     virtual bool prep(SeExpr2::ExprFuncNode* node,
                       bool /*wantVec*/)
@@ -890,7 +942,7 @@ private:
 
             return;
         }
-        _processor->prefetchImage(inputIndex, frame);
+        assert(_processor);
         const Image* img = _processor->getImage(inputIndex, frame);
         if (!img) {
             // be black and transparent
@@ -915,126 +967,6 @@ private:
     } // eval
 };
 
-class DoubleParamVarRef
-    : public SeExprVarRef {
-    // Used to call getValue only once per expression evaluation and not once per pixel
-    // Using SeExpr lock is faster than calling the multi-thread suite to get a mutex
-    SeExprInternal::Mutex _lock;
-    bool _varSet;
-    double _value;
-    DoubleParam* _param;
-
-public:
-    DoubleParamVarRef(DoubleParam* param)
-        : SeExprVarRef()
-        , _lock()
-        , _varSet(false)
-        , _value(0)
-        , _param(param)
-    {
-    }
-
-    virtual ~DoubleParamVarRef() { }
-
-    //! returns true for a vector type, false for a scalar type
-    virtual bool isVec() { return false; }
-
-    //! returns this variable's value by setting result, node refers to
-    //! where in the parse tree the evaluation is occurring
-    virtual void eval(const SeExprVarNode* /*node*/,
-                      SeExpr2::Vec3d& result)
-    {
-        SeExprInternal::AutoLock<SeExprInternal::Mutex> locker(_lock);
-        if (!_varSet) {
-            _param->getValue(_value);
-            _varSet = true;
-        } else {
-            result[0] = _value;
-        }
-    }
-};
-
-class Double2DParamVarRef
-    : public SeExprVarRef {
-    // Used to call getValue only once per expression evaluation and not once per pixel
-    // Using SeExpr lock is faster than calling the multi-thread suite to get a mutex
-    SeExprInternal::Mutex _lock;
-    bool _varSet;
-    double _value[2];
-    Double2DParam* _param;
-
-public:
-    Double2DParamVarRef(Double2DParam* param)
-        : SeExprVarRef()
-        , _lock()
-        , _varSet(false)
-        , _value()
-        , _param(param)
-    {
-    }
-
-    virtual ~Double2DParamVarRef() { }
-
-    //! returns true for a vector type, false for a scalar type
-    virtual bool isVec() { return true; }
-
-    //! returns this variable's value by setting result, node refers to
-    //! where in the parse tree the evaluation is occurring
-    virtual void eval(const SeExprVarNode* /*node*/,
-                      SeExpr2::Vec3d& result)
-    {
-        SeExprInternal::AutoLock<SeExprInternal::Mutex> locker(_lock);
-        if (!_varSet) {
-            _param->getValue(_value[0], _value[1]);
-            _varSet = true;
-        } else {
-            result[0] = _value[0];
-            result[1] = _value[1];
-        }
-    }
-};
-
-class ColorParamVarRef
-    : public SeExprVarRef {
-    // Used to call getValue only once per expression evaluation and not once per pixel
-    // Using SeExpr lock is faster than calling the multi-thread suite to get a mutex
-    SeExprInternal::Mutex _lock;
-    bool _varSet;
-    double _value[3];
-    RGBParam* _param;
-
-public:
-    ColorParamVarRef(RGBParam* param)
-        : SeExprVarRef()
-        , _lock()
-        , _varSet(false)
-        , _value()
-        , _param(param)
-    {
-    }
-
-    virtual ~ColorParamVarRef() { }
-
-    //! returns true for a vector type, false for a scalar type
-    virtual bool isVec() { return true; }
-
-    //! returns this variable's value by setting result, node refers to
-    //! where in the parse tree the evaluation is occurring
-    virtual void eval(const SeExprVarNode* /*node*/,
-                      SeExpr2::Vec3d& result)
-    {
-        SeExprInternal::AutoLock<SeExprInternal::Mutex> locker(_lock);
-        if (!_varSet) {
-            _param->getValue(_value[0], _value[1], _value[2]);
-            _varSet = true;
-        } else {
-            result[0] = _value[0];
-            result[1] = _value[1];
-            result[2] = _value[2];
-        }
-    }
-};
-
 class SimpleScalar
     : public SeExprVarRef {
 public:
@@ -1179,19 +1111,18 @@ class OFXSeExpression
     SimpleScalar _inputB[kSourceClipCount];
     SimpleVec _inputColors[kSourceClipCount];
     SimpleScalar _inputAlphas[kSourceClipCount];
-    DoubleParamVarRef* _doubleRef[kParamsCount];
-    Double2DParamVarRef* _double2DRef[kParamsCount];
-    ColorParamVarRef* _colorRef[kParamsCount];
+    SimpleScalar _doubleParams[kParamsCount];
+    SimpleVec _double2DParams[kParamsCount];
+    SimpleVec _colorParams[kParamsCount];
+    // what the expression depends on, set while resolving the variables and functions during prep
+    mutable bool _dependsOnX;
+    mutable bool _dependsOnY;
+    mutable bool _usesInput[kSourceClipCount];
 
 public:
-    OFXSeExpression(SeExprProcessorBase* processor,
-                    const string& expr,
+    OFXSeExpression(const string& expr,
                     bool wantVec,
-                    bool simple,
-                    OfxTime time,
-                    const OfxPointD& renderScale,
-                    double par,
-                    const OfxRectI& outputRod);
+                    bool simple);
 
     virtual ~OFXSeExpression();
 
@@ -1201,20 +1132,50 @@ public:
     /** override resolveFunc to add external functions */
     virtual SeExprFunc* resolveFunc(const string& name) const OVERRIDE FINAL;
 
+    /** set the variables that are constant over a render, and the processor that provides the images.
+        NOT MT-SAFE, this object is to be used PER-THREAD */
+    void setRenderValues(SeExprProcessorBase* processor,
+                         OfxTime time,
+                         const OfxPointD& renderScale,
+                         double par,
+                         const OfxRectI& outputRod,
+                         const SeExprParamValues& paramValues);
+
     /** NOT MT-SAFE, this object is to be used PER-THREAD*/
     void setXY(int x,
                int y)
     {
-        _xCoord._value = x;
+        setY(y);
+        setX(x);
+    }
+
+    /** set the variables that only depend on the row, NOT MT-SAFE */
+    void setY(int y)
+    {
         _yCoord._value = y;
-        assert(_dstPixelRod.x2 - _dstPixelRod.x1);
         assert(_dstPixelRod.y2 - _dstPixelRod.y1);
-        _uCoord._value = (x + 0.5 - _dstPixelRod.x1) / (_dstPixelRod.x2 - _dstPixelRod.x1);
         _vCoord._value = (y + 0.5 - _dstPixelRod.y1) / (_dstPixelRod.y2 - _dstPixelRod.y1);
-        _xCanCoord._value = (x + 0.5) * _par._value / _scalex._value;
         _yCanCoord._value = (y + 0.5) / _scaley._value;
     }
 
+    /** set the variables that only depend on the column, NOT MT-SAFE */
+    void setX(int x)
+    {
+        _xCoord._value = x;
+        assert(_dstPixelRod.x2 - _dstPixelRod.x1);
+        _uCoord._value = (x + 0.5 - _dstPixelRod.x1) / (_dstPixelRod.x2 - _dstPixelRod.x1);
+        _xCanCoord._value = (x + 0.5) * _par._value / _scalex._value;
+    }
+
+    /** true if the result may change along a row. Only valid once the expression is prepared (see isValid()) */
+    bool dependsOnX() const { return _dependsOnX; }
+
+    /** true if the result may change from row to row */
+    bool dependsOnY() const { return _dependsOnY; }
+
+    /** true if the expression reads the color or alpha of the given input at the current pixel */
+    bool usesInput(int inputIndex) const { return _usesInput[inputIndex]; }
+
     void setRGBA(int inputIndex,
                  float r,
                  float g,
@@ -1246,21 +1207,16 @@ public:
     }
 };
 
-OFXSeExpression::OFXSeExpression(SeExprProcessorBase* processor,
-                                 const string& expr,
+OFXSeExpression::OFXSeExpression(const string& expr,
                                  bool wantVec,
-                                 bool simple,
-                                 OfxTime time,
-                                 const OfxPointD& renderScale,
-                                 double par,
-                                 const OfxRectI& outputRod)
+                                 bool simple)
     : SeExpression(expr, wantVec)
     , _simple(simple)
-    , _cpixel(processor)
+    , _cpixel()
     , _cpixelFunction(_cpixel, 4, 5)
-    , _apixel(processor)
+    , _apixel()
     , _apixelFunction(_apixel, 4, 5)
-    , _dstPixelRod(outputRod)
+    , _dstPixelRod()
     , _variables()
     , _scalex()
     , _scaley()
@@ -1278,19 +1234,22 @@ OFXSeExpression::OFXSeExpression(SeExprProcessorBase* processor,
     , _inputHeights()
     , _inputColors()
     , _inputAlphas()
-    , _doubleRef()
-    , _double2DRef()
-    , _colorRef()
+    , _doubleParams()
+    , _double2DParams()
+    , _colorParams()
+    , _dependsOnX(false)
+    , _dependsOnY(false)
 {
-    _dstPixelRod = outputRod;
+    std::fill(_usesInput, _usesInput + kSourceClipCount, false);
+    _dstPixelRod.x1 = _dstPixelRod.y1 = 0;
+    _dstPixelRod.x2 = _dstPixelRod.y2 = 1;
 
-    _scalex._value = renderScale.x;
+    _scalex._value = 1.;
     _variables[kSeExprRenderScaleXVarName] = &_scalex;
 
-    _scaley._value = renderScale.y;
+    _scaley._value = 1.;
     _variables[kSeExprRenderScaleYVarName] = &_scaley;
 
-    _curTime._value = time;
     _variables[kSeExprCurrentTimeVarName] = &_curTime;
 
     _variables[kSeExprXCoordVarName] = &_xCoord;
@@ -1301,7 +1260,7 @@ OFXSeExpression::OFXSeExpression(SeExprProcessorBase* processor,
 
     _variables[kSeExprVCoordVarName] = &_vCoord;
 
-    _par._value = par;
+    _par._value = 1.;
     _variables[kSeExprPARVarName] = &_par;
 
     _variables[kSeExprXCanCoordVarName] = &_xCanCoord;
@@ -1339,29 +1298,40 @@ OFXSeExpression::OFXSeExpression(SeExprProcessorBase* processor,
         }
     }
 
-    assert(processor);
-    SeExprPlugin* plugin = processor->getPlugin();
-    DoubleParam** doubleParams = plugin->getDoubleParams();
-    Double2DParam** double2DParams = plugin->getDouble2DParams();
-    RGBParam** colorParams = plugin->getRGBParams();
-
     for (int i = 0; i < kParamsCount; ++i) {
-        _doubleRef[i] = new DoubleParamVarRef(doubleParams[i]);
-        _double2DRef[i] = new Double2DParamVarRef(double2DParams[i]);
-        _colorRef[i] = new ColorParamVarRef(colorParams[i]);
         const string istr = unsignedToString(i + 1);
-        _variables[kParamDouble + istr] = _doubleRef[i];
-        _variables[kParamDouble2D + istr] = _double2DRef[i];
-        _variables[kParamColor + istr] = _colorRef[i];
+        _variables[kParamDouble + istr] = &_doubleParams[i];
+        _variables[kParamDouble2D + istr] = &_double2DParams[i];
+        _variables[kParamColor + istr] = &_colorParams[i];
     }
 }
 
 OFXSeExpression::~OFXSeExpression()
 {
+}
+
+void
+OFXSeExpression::setRenderValues(SeExprProcessorBase* processor,
+                                 OfxTime time,
+                                 const OfxPointD& renderScale,
+                                 double par,
+                                 const OfxRectI& outputRod,
+                                 const SeExprParamValues& paramValues)
+{
+    _cpixel.setProcessor(processor);
+    _apixel.setProcessor(processor);
+    _dstPixelRod = outputRod;
+    _scalex._value = renderScale.x;
+    _scaley._value = renderScale.y;
+    _curTime._value = time;
+    _par._value = par;
     for (int i = 0; i < kParamsCount; ++i) {
-        delete _doubleRef[i];
-        delete _double2DRef[i];
-        delete _colorRef[i];
+        _doubleParams[i]._value = paramValues.doubles[i];
+        _double2DParams[i]._value[0] = paramValues.double2Ds[i][0];
+        _double2DParams[i]._value[1] = paramValues.double2Ds[i][1];
+        _colorParams[i]._value[0] = paramValues.colors[i][0];
+        _colorParams[i]._value[1] = paramValues.colors[i][1];
+        _colorParams[i]._value[2] = paramValues.colors[i][2];
     }
 }
 
@@ -1373,12 +1343,30 @@ OFXSeExpression::resolveVar(const string& varName) const
         return 0;
     }
 
+    const SeExprVarRef* var = found->second;
+    if ((var == &_xCoord) || (var == &_uCoord) || (var == &_xCanCoord)) {
+        _dependsOnX = true;
+    } else if ((var == &_yCoord) || (var == &_vCoord) || (var == &_yCanCoord)) {
+        _dependsOnY = true;
+    } else {
+        for (int i = 0; i < kSourceClipCount; ++i) {
+            if ((var == &_inputR[i]) || (var == &_inputG[i]) || (var == &_inputB[i]) || (var == &_inputColors[i]) || (var == &_inputAlphas[i])) {
+                _usesInput[i] = true;
+                _dependsOnX = _dependsOnY = true;
+            }
+        }
+    }
+
     return found->second;
 }
 
 SeExprFunc*
 OFXSeExpression::resolveFunc(const string& funcName) const
 {
+    if (funcName == "rand") {
+        // rand() without a seed gives a different value at each call
+        _dependsOnX = _dependsOnY = true;
+    }
     // check if it is builtin so we get proper behavior
     if (SeExprFunc::lookup(funcName)) {
         return 0;
@@ -1488,15 +1476,218 @@ StubSeExpression::resolveFunc(const string& funcName) const
     return 0;
 }
 
+/**
+ * @brief The parsed expressions for all output channels, used by a single thread at a time.
+ *
+ * Parsing and preparing the expressions is expensive, so the sets are kept by the plugin
+ * instance across renders, and only rebuilt when the scripts change.
+ **/
+struct OFXSeExpressionSet {
+    const string key;
+    OFXSeExpression* const rExpr;
+    OFXSeExpression* const gExpr;
+    OFXSeExpression* const bExpr;
+    OFXSeExpression* const rgbExpr;
+    OFXSeExpression* const alphaExpr;
+
+    OFXSeExpressionSet(SeExprPlugin* plugin,
+                       const string& key_,
+                       const string& rScript,
+                       const string& gScript,
+                       const string& bScript,
+                       const string& rgbScript,
+                       const string& alphaScript)
+        : key(key_)
+        , rExpr(newExpression(plugin, rScript, /*wantVec=*/false))
+        , gExpr(newExpression(plugin, gScript, /*wantVec=*/false))
+        , bExpr(newExpression(plugin, bScript, /*wantVec=*/false))
+        , rgbExpr(newExpression(plugin, rgbScript, /*wantVec=*/true))
+        , alphaExpr(newExpression(plugin, alphaScript, /*wantVec=*/false))
+    {
+        // parse and prepare now, so that the dependencies of the expressions are known before rendering
+        string error;
+        (void)isValid(&error);
+    }
+
+    ~OFXSeExpressionSet()
+    {
+        delete rExpr;
+        delete gExpr;
+        delete bExpr;
+        delete rgbExpr;
+        delete alphaExpr;
+    }
+
+    static string makeKey(const string& rScript,
+                          const string& gScript,
+                          const string& bScript,
+                          const string& rgbScript,
+                          const string& alphaScript)
+    {
+        string k = rScript;
+        k += '\0';
+        k += gScript;
+        k += '\0';
+        k += bScript;
+        k += '\0';
+        k += rgbScript;
+        k += '\0';
+        k += alphaScript;
+
+        return k;
+    }
+
+    bool isValid(string* error) const
+    {
+        OFXSeExpression* const exprs[5] = { rExpr, gExpr, bExpr, rgbExpr, alphaExpr };
+        for (int i = 0; i < 5; ++i) {
+            if (exprs[i] && !exprs[i]->isValid()) {
+                *error = exprs[i]->parseError();
+
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    void evaluate() const
+    {
+        OFXSeExpression* const exprs[5] = { rExpr, gExpr, bExpr, rgbExpr, alphaExpr };
+        for (int i = 0; i < 5; ++i) {
+            if (exprs[i]) {
+                (void)exprs[i]->evaluate();
+            }
+        }
+    }
+
+    void setRenderValues(SeExprProcessorBase* processor,
+                         OfxTime time,
+                         const OfxPointD& renderScale,
+                         double par,
+                         const OfxRectI& outputRod,
+                         const OfxPointI* inputSizes,
+                         const OfxPointI& outputSize,
+                         const SeExprParamValues& paramValues) const
+    {
+        OFXSeExpression* const exprs[5] = { rExpr, gExpr, bExpr, rgbExpr, alphaExpr };
+        for (int e = 0; e < 5; ++e) {
+            if (!exprs[e]) {
+                continue;
+            }
+            exprs[e]->setRenderValues(processor, time, renderScale, par, outputRod, paramValues);
+            for (int i = 0; i < kSourceClipCount; ++i) {
+                exprs[e]->setSize(i, inputSizes[i].x, inputSizes[i].y);
+            }
+            exprs[e]->setSize(-1, outputSize.x, outputSize.y);
+        }
+    }
+
+private:
+    static OFXSeExpression* newExpression(SeExprPlugin* plugin,
+                                          const string& script,
+                                          bool wantVec)
+    {
+        if (isSpaces(script)) {
+            return NULL;
+        }
+
+        return new OFXSeExpression(script, wantVec, plugin->isSimple());
+    }
+};
+
+/** @brief Holds a set of expressions acquired from the plugin, and gives it back when going out of scope */
+class OFXSeExpressionSetHolder {
+    SeExprPlugin* _plugin;
+    OFXSeExpressionSet* _exprSet;
+
+public:
+    OFXSeExpressionSetHolder(SeExprPlugin* plugin,
+                             OFXSeExpressionSet* exprSet)
+        : _plugin(plugin)
+        , _exprSet(exprSet)
+    {
+    }
+
+    ~OFXSeExpressionSetHolder()
+    {
+        _plugin->releaseExpressionSet(_exprSet);
+    }
+
+    OFXSeExpressionSet& operator*() const { return *_exprSet; }
+
+    OFXSeExpressionSet* operator->() const { return _exprSet; }
+
+private:
+    OFXSeExpressionSetHolder(const OFXSeExpressionSetHolder&);
+    OFXSeExpressionSetHolder& operator=(const OFXSeExpressionSetHolder&);
+};
+
+OFXSeExpressionSet*
+SeExprPlugin::acquireExpressionSet(const string& rExpr,
+                                   const string& gExpr,
+                                   const string& bExpr,
+                                   const string& rgbExpr,
+                                   const string& alphaExpr)
+{
+    const string key = OFXSeExpressionSet::makeKey(rExpr, gExpr, bExpr, rgbExpr, alphaExpr);
+    {
+        AutoMutex l(&_exprSetsMutex);
+        for (std::list<OFXSeExpressionSet*>::iterator it = _exprSets.begin(); it != _exprSets.end(); ++it) {
+            if ((*it)->key == key) {
+                OFXSeExpressionSet* exprSet = *it;
+                _exprSets.erase(it);
+
+                return exprSet;
+            }
+        }
+    }
+
+    // not found (the scripts changed, or all the sets are in use by other threads): parse outside of the lock
+    return new OFXSeExpressionSet(this, key, rExpr, gExpr, bExpr, rgbExpr, alphaExpr);
+}
+
+void
+SeExprPlugin::releaseExpressionSet(OFXSeExpressionSet* exprSet)
+{
+    if (!exprSet) {
+        return;
+    }
+    std::list<OFXSeExpressionSet*> expired;
+    {
+        AutoMutex l(&_exprSetsMutex);
+        // sets parsed from other scripts are obsolete
+        for (std::list<OFXSeExpressionSet*>::iterator it = _exprSets.begin(); it != _exprSets.end();) {
+            if ((*it)->key != exprSet->key) {
+                expired.push_back(*it);
+                it = _exprSets.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        _exprSets.push_front(exprSet);
+    }
+    for (std::list<OFXSeExpressionSet*>::iterator it = expired.begin(); it != expired.end(); ++it) {
+        delete *it;
+    }
+}
+
 SeExprProcessorBase::SeExprProcessorBase(SeExprPlugin* instance)
     : _renderTime(0.)
     , _renderView(0)
     , _plugin(instance)
-    , _rExpr(NULL)
-    , _gExpr(NULL)
-    , _bExpr(NULL)
-    , _rgbExpr(NULL)
-    , _alphaExpr(NULL)
+    , _rScript()
+    , _gScript()
+    , _bScript()
+    , _rgbScript()
+    , _alphaScript()
+    , _dstPixelRod()
+    , _renderScale()
+    , _par(1.)
+    , _outputSize()
+    , _paramValues()
+    , _renderWindow()
+    , _threadFailed(false)
     , _srcCurTime()
     , _dstImg(NULL)
     , _maskInvert(false)
@@ -1504,8 +1695,13 @@ SeExprProcessorBase::SeExprProcessorBase(SeExprPlugin* instance)
     , _doMasking(false)
     , _mix(0.)
     , _images()
+    , _fetchAllowed(true)
+    , _missingImages()
+    , _mutex()
 {
+    _renderScale.x = _renderScale.y = 1.;
     for (int i = 0; i < kSourceClipCount; ++i) {
+        _inputSizes[i].x = _inputSizes[i].y = 0;
         _srcCurTime[i] = 0;
         _nSrcComponents[i] = 0;
     }
@@ -1513,11 +1709,6 @@ SeExprProcessorBase::SeExprProcessorBase(SeExprPlugin* instance)
 
 SeExprProcessorBase::~SeExprProcessorBase()
 {
-    delete _rExpr;
-    delete _gExpr;
-    delete _bExpr;
-    delete _rgbExpr;
-    delete _alphaExpr;
     for (FetchedImagesMap::iterator it = _images.begin(); it != _images.end(); ++it) {
         for (FetchedImagesForClipMap::iterator it2 = it->second.begin(); it2 != it->second.end(); ++it2) {
             delete it2->second;
@@ -1537,8 +1728,9 @@ SeExprProcessorBase::setValues(OfxTime time,
                                const OfxPointD& renderScale,
                                double par)
 {
-    setExprs(time, rgbExpr, alphaExpr, dstPixelRod, renderScale, par);
-    setValuesOther(time, view, mix, inputSizes, outputSize);
+    _rgbScript = rgbExpr;
+    _alphaScript = alphaExpr;
+    setValuesOther(time, view, mix, dstPixelRod, inputSizes, outputSize, renderScale, par);
 }
 
 void
@@ -1555,146 +1747,61 @@ SeExprProcessorBase::setValuesSimple(OfxTime time,
                                      const OfxPointD& renderScale,
                                      double par)
 {
-    setExprsSimple(time, rExpr, gExpr, bExpr, aExpr, dstPixelRod, renderScale, par);
-    setValuesOther(time, view, mix, inputSizes, outputSize);
-}
-
-void
-SeExprProcessorBase::setExprs(OfxTime time,
-                              const string& rgbExpr,
-                              const string& alphaExpr,
-                              const OfxRectI& dstPixelRod,
-                              const OfxPointD& renderScale,
-                              double par)
-{
-    if (!isSpaces(rgbExpr)) {
-        _rgbExpr = new OFXSeExpression(this, rgbExpr, /*wantVec=*/true, /*simple=*/false, time, renderScale, par, dstPixelRod);
-    }
-    if (!isSpaces(alphaExpr)) {
-        _alphaExpr = new OFXSeExpression(this, alphaExpr, /*wantVec=*/false, /*simple=*/false, time, renderScale, par, dstPixelRod);
-    }
-}
-
-void
-SeExprProcessorBase::setExprsSimple(OfxTime time,
-                                    const string& rExpr,
-                                    const string& gExpr,
-                                    const string& bExpr,
-                                    const string& aExpr,
-                                    const OfxRectI& dstPixelRod,
-                                    const OfxPointD& renderScale,
-                                    double par)
-{
-    if (!isSpaces(rExpr)) {
-        _rExpr = new OFXSeExpression(this, rExpr, /*wantVec=*/false, /*simple=*/true, time, renderScale, par, dstPixelRod);
-    }
-    if (!isSpaces(gExpr)) {
-        _gExpr = new OFXSeExpression(this, gExpr, /*wantVec=*/false, /*simple=*/true, time, renderScale, par, dstPixelRod);
-    }
-    if (!isSpaces(bExpr)) {
-        _bExpr = new OFXSeExpression(this, bExpr, /*wantVec=*/false, /*simple=*/true, time, renderScale, par, dstPixelRod);
-    }
-    if (!isSpaces(aExpr)) {
-        _alphaExpr = new OFXSeExpression(this, aExpr, /*wantVec=*/false, /*simple=*/true, time, renderScale, par, dstPixelRod);
-    }
+    _rScript = rExpr;
+    _gScript = gExpr;
+    _bScript = bExpr;
+    _alphaScript = aExpr;
+    setValuesOther(time, view, mix, dstPixelRod, inputSizes, outputSize, renderScale, par);
 }
 
 void
 SeExprProcessorBase::setValuesOther(OfxTime time,
                                     int view,
                                     double mix,
+                                    const OfxRectI& dstPixelRod,
                                     OfxPointI* inputSizes,
-                                    const OfxPointI& outputSize)
+                                    const OfxPointI& outputSize,
+                                    const OfxPointD& renderScale,
+                                    double par)
 {
     _renderTime = time;
     _renderView = view;
-
+    _dstPixelRod = dstPixelRod;
     for (int i = 0; i < kSourceClipCount; ++i) {
-        if (_rExpr) {
-            _rExpr->setSize(i, inputSizes[i].x, inputSizes[i].y);
-        }
-        if (_gExpr) {
-            _gExpr->setSize(i, inputSizes[i].x, inputSizes[i].y);
-        }
-        if (_bExpr) {
-            _bExpr->setSize(i, inputSizes[i].x, inputSizes[i].y);
-        }
-        if (_rgbExpr) {
-            _rgbExpr->setSize(i, inputSizes[i].x, inputSizes[i].y);
-        }
-        if (_alphaExpr) {
-            _alphaExpr->setSize(i, inputSizes[i].x, inputSizes[i].y);
-        }
-    }
-    if (_rExpr) {
-        _rExpr->setSize(-1, outputSize.x, outputSize.y);
-    }
-    if (_gExpr) {
-        _gExpr->setSize(-1, outputSize.x, outputSize.y);
-    }
-    if (_bExpr) {
-        _bExpr->setSize(-1, outputSize.x, outputSize.y);
+        _inputSizes[i] = inputSizes[i];
     }
-    if (_rgbExpr) {
-        _rgbExpr->setSize(-1, outputSize.x, outputSize.y);
-    }
-    if (_alphaExpr) {
-        _alphaExpr->setSize(-1, outputSize.x, outputSize.y);
-    }
-    // assert(_alphaExpr || _rgbExpr); // both may be empty!
+    _outputSize = outputSize;
+    _renderScale = renderScale;
+    _par = par;
     _mix = mix;
 }
 
-bool
-SeExprProcessorBase::isExprOk(string* error)
+OFXSeExpressionSet*
+SeExprProcessorBase::acquireExpressionSet()
 {
-    if (_rExpr && !_rExpr->isValid()) {
-        *error = _rExpr->parseError();
+    OFXSeExpressionSet* exprSet = _plugin->acquireExpressionSet(_rScript, _gScript, _bScript, _rgbScript, _alphaScript);
 
-        return false;
-    }
-    if (_gExpr && !_gExpr->isValid()) {
-        *error = _gExpr->parseError();
-
-        return false;
-    }
-    if (_bExpr && !_bExpr->isValid()) {
-        *error = _bExpr->parseError();
-
-        return false;
-    }
-    if (_rgbExpr && !_rgbExpr->isValid()) {
-        *error = _rgbExpr->parseError();
+    exprSet->setRenderValues(this, _renderTime, _renderScale, _par, _dstPixelRod, _inputSizes, _outputSize, _paramValues);
 
-        return false;
-    }
-    if (_alphaExpr && !_alphaExpr->isValid()) {
-        *error = _alphaExpr->parseError();
+    return exprSet;
+}
 
-        return false;
-    }
+bool
+SeExprProcessorBase::isExprOk(string* error)
+{
+    {
+        OFXSeExpressionSetHolder exprSet(_plugin, acquireExpressionSet());
+        if (!exprSet->isValid(error)) {
+            return false;
+        }
 
-    // Run the expression once to initialize all the images fields before multi-threading
-    if (_rExpr) {
-        (void)_rExpr->evaluate();
-    }
-    if (_gExpr) {
-        (void)_gExpr->evaluate();
-    }
-    if (_bExpr) {
-        (void)_bExpr->evaluate();
-    }
-    if (_rgbExpr) {
-        (void)_rgbExpr->evaluate();
-    }
-    if (_alphaExpr) {
-        (void)_alphaExpr->evaluate();
+        // Run the expression once to initialize all the images fields before multi-threading
+        exprSet->evaluate();
     }
 
     // Ensure the image of the input 0 at the current time exists for the mix
 
     for (int i = 0; i < kSourceClipCount; ++i) {
-        prefetchImage(i, _renderTime);
         _srcCurTime[i] = getImage(i, _renderTime);
         _nSrcComponents[i] = _srcCurTime[i] ? _srcCurTime[i]->getPixelComponentCount() : 0;
     }
@@ -1702,6 +1809,73 @@ SeExprProcessorBase::isExprOk(string* error)
     return true;
 } // SeExprProcessorBase::isExprOk
 
+void
+SeExprProcessorBase::process(const OfxRectI& renderWindow)
+{
+    if ((renderWindow.x2 <= renderWindow.x1) || (renderWindow.y2 <= renderWindow.y1)) {
+        return;
+    }
+    _renderWindow = renderWindow;
+    _threadFailed = false;
+
+    // each thread renders every nThreads-th band, so that the cost of the expression is evenly spread
+    const unsigned int nTiles = (unsigned int)(renderWindow.y2 - renderWindow.y1 + kTileHeight - 1) / kTileHeight;
+    const unsigned int nThreads = (std::min)(MultiThread::getNumCPUs(), nTiles);
+    // The images used at the first pixel were fetched by isExprOk(), but cpixel() and apixel() may use a frame
+    // that depends on the pixel. The render threads must not fetch images: they stop at the first image that
+    // is missing, which is then fetched here, and the window is rendered again. If the images keep changing,
+    // the window is rendered by this thread, which fetches them as needed.
+    for (int pass = 0; !_threadFailed && !_plugin->abort(); ++pass) {
+        if ((nThreads <= 1) || (pass == kMaxThreadedPasses)) {
+            multiThreadFunction(0, 1);
+            break;
+        }
+        {
+            AutoMutex l(&_mutex);
+            _fetchAllowed = false;
+        }
+        multiThread(nThreads);
+        std::set<pair<int, OfxTime> > missingImages;
+        {
+            AutoMutex l(&_mutex);
+            _fetchAllowed = true;
+            missingImages.swap(_missingImages);
+        }
+        if ( missingImages.empty() ) {
+            break;
+        }
+        for (std::set<pair<int, OfxTime> >::const_iterator it = missingImages.begin(); it != missingImages.end(); ++it) {
+            getImage(it->first, it->second);
+        }
+    }
+    if (_threadFailed) {
+        throwSuiteStatusException(kOfxStatFailed);
+    }
+}
+
+void
+SeExprProcessorBase::multiThreadFunction(unsigned int threadID,
+                                         unsigned int nThreads)
+{
+    try {
+        // the expressions hold the pixel variables, so each thread needs its own set
+        OFXSeExpressionSetHolder exprSet(_plugin, acquireExpressionSet());
+        for (int y1 = _renderWindow.y1 + (int)threadID * kTileHeight; y1 < _renderWindow.y2; y1 += (int)nThreads * kTileHeight) {
+            if ( _plugin->abort() || hasMissingImages() ) {
+                break;
+            }
+            OfxRectI tile = _renderWindow;
+            tile.y1 = y1;
+            tile.y2 = (std::min)(y1 + kTileHeight, _renderWindow.y2);
+            processTile(tile, *exprSet);
+        }
+    } catch (...) {
+        // exceptions must not leave the multi-thread suite
+        AutoMutex l(&_mutex);
+        _threadFailed = true;
+    }
+}
+
 // template to do the RGBA processing
 template <class PIX, int nComponents, int maxValue>
 class SeExprProcessor
@@ -1715,133 +1889,225 @@ public:
     }
 
 private:
-    // and do some processing
-    virtual void process(OfxRectI procWindow) OVERRIDE FINAL
+    // and do some processing.
+    // The tile is processed by scanlines: the source pixels of a row are first converted, then each
+    // expression is evaluated over the whole row, and the results are finally mixed into the output.
+    // Expressions that do not depend on x are evaluated once per row, or once per tile if they
+    // do not depend on y either.
+    virtual void processTile(const OfxRectI& procWindow,
+                             OFXSeExpressionSet& exprSet) OVERRIDE FINAL
     {
         assert((nComponents == 4 /*&& _rgbExpr && _alphaExpr*/) || (nComponents == 3 /*&& _rgbExpr && !_alphaExpr*/) || (nComponents == 1 /*&& !_rgbExpr && _alphaExpr*/));
 
+        enum {
+            eR = 0,
+            eG,
+            eB,
+            eRGB,
+            eAlpha,
+            eExprCount
+        };
+        OFXSeExpression* const exprs[eExprCount] = { exprSet.rExpr, exprSet.gExpr, exprSet.bExpr, exprSet.rgbExpr, exprSet.alphaExpr };
+        const int width = procWindow.x2 - procWindow.x1;
+
+        // inputs whose pixel values are read by an expression. The first input is always needed for the mix.
+        bool usedInput[kSourceClipCount];
+        usedInput[0] = true;
+        for (int i = 1; i < kSourceClipCount; ++i) {
+            usedInput[i] = false;
+            for (int e = 0; e < eExprCount; ++e) {
+                usedInput[i] = usedInput[i] || (exprs[e] && exprs[e]->usesInput(i));
+            }
+        }
+
+        // one row of source pixels per used input, in [0,maxValue] and normalized
+        vector<PIX> srcRows[kSourceClipCount];
+        vector<float> srcRowsNormalized[kSourceClipCount];
+        for (int i = 0; i < kSourceClipCount; ++i) {
+            if (usedInput[i]) {
+                srcRows[i].resize((std::size_t)width * 4);
+                srcRowsNormalized[i].resize((std::size_t)width * 4);
+            }
+        }
+
+        // results for the row (stride 3), or a single value for expressions that do not depend on x (stride 0)
+        vector<double> results[eExprCount];
+        bool evaluatedOnce[eExprCount];
+        for (int e = 0; e < eExprCount; ++e) {
+            evaluatedOnce[e] = false;
+            if (exprs[e]) {
+                results[e].resize(exprs[e]->dependsOnX() ? (std::size_t)width * 3 : 3);
+            }
+        }
+
         float tmpPix[4];
-        PIX srcPixels[kSourceClipCount][4];
 
         for (int y = procWindow.y1; y < procWindow.y2; ++y) {
             if (_plugin->abort()) {
                 break;
             }
 
-            PIX* dstPix = (PIX*)_dstImg->getPixelAddress(procWindow.x1, y);
+            for (int i = 0; i < kSourceClipCount; ++i) {
+                if (usedInput[i]) {
+                    fillSourceRow(i, procWindow.x1, procWindow.x2, y, &srcRows[i][0], &srcRowsNormalized[i][0]);
+                }
+            }
 
-            for (int x = procWindow.x1; x < procWindow.x2; ++x) {
-                for (int i = kSourceClipCount - 1; i >= 0; --i) {
-                    const PIX* src_pixels = _srcCurTime[i] ? (const PIX*)_srcCurTime[i]->getPixelAddress(x, y) : 0;
-                    if (_nSrcComponents[i] == 4) {
-                        for (int k = 0; k < 4; ++k) {
-                            srcPixels[i][k] = src_pixels ? src_pixels[k] : 0;
-                        }
-                    } else if (_nSrcComponents[i] == 3) {
-                        for (int k = 0; k < 3; ++k) {
-                            srcPixels[i][k] = src_pixels ? src_pixels[k] : 0;
-                        }
-                        srcPixels[i][3] = src_pixels ? 1 : 0;
-                    } else if (_nSrcComponents[i] == 2) {
-                        for (int k = 0; k < 2; ++k) {
-                            srcPixels[i][k] = src_pixels ? src_pixels[k] : 0;
-                        }
-                        srcPixels[i][2] = 0;
-                        srcPixels[i][3] = src_pixels ? 1 : 0;
-                    } else {
-                        for (int k = 0; k < 3; ++k) {
-                            srcPixels[i][k] = 0;
-                        }
-                        srcPixels[i][3] = src_pixels ? src_pixels[0] : 0;
-                    }
-                    float r = srcPixels[i][0] / (float)maxValue;
-                    float g = srcPixels[i][1] / (float)maxValue;
-                    float b = srcPixels[i][2] / (float)maxValue;
-                    float a = srcPixels[i][3] / (float)maxValue;
-                    if (_rExpr) {
-                        _rExpr->setRGBA(i, r, g, b, a);
-                    }
-                    if (_gExpr) {
-                        _gExpr->setRGBA(i, r, g, b, a);
-                    }
-                    if (_bExpr) {
-                        _bExpr->setRGBA(i, r, g, b, a);
-                    }
-                    if (_rgbExpr) {
-                        _rgbExpr->setRGBA(i, r, g, b, a);
+            // execute the valid expressions
+            for (int e = 0; e < eExprCount; ++e) {
+                OFXSeExpression* expr = exprs[e];
+                if (!expr) {
+                    continue;
+                }
+                double* result = &results[e][0];
+                if (!expr->dependsOnX()) {
+                    if (evaluatedOnce[e] && !expr->dependsOnY()) {
+                        continue;
                     }
-                    if (_alphaExpr) {
-                        _alphaExpr->setRGBA(i, r, g, b, a);
+                    expr->setXY(procWindow.x1, y);
+                    SeExpr2::Vec3d v = expr->evaluate();
+                    result[0] = v[0];
+                    result[1] = v[1];
+                    result[2] = v[2];
+                    evaluatedOnce[e] = true;
+                    continue;
+                }
+                expr->setY(y);
+                for (int x = procWindow.x1; x < procWindow.x2; ++x, result += 3) {
+                    const std::size_t k = (std::size_t)(x - procWindow.x1) * 4;
+                    for (int i = 0; i < kSourceClipCount; ++i) {
+                        if (expr->usesInput(i)) {
+                            const float* rgba = &srcRowsNormalized[i][k];
+                            expr->setRGBA(i, rgba[0], rgba[1], rgba[2], rgba[3]);
+                        }
                     }
+                    expr->setX(x);
+                    SeExpr2::Vec3d v = expr->evaluate();
+                    result[0] = v[0];
+                    result[1] = v[1];
+                    result[2] = v[2];
                 }
+            }
 
+            const double* rResult = exprs[eR] ? &results[eR][0] : NULL;
+            const double* gResult = exprs[eG] ? &results[eG][0] : NULL;
+            const double* bResult = exprs[eB] ? &results[eB][0] : NULL;
+            const double* rgbResult = exprs[eRGB] ? &results[eRGB][0] : NULL;
+            const double* alphaResult = exprs[eAlpha] ? &results[eAlpha][0] : NULL;
+            const int rStride = (exprs[eR] && exprs[eR]->dependsOnX()) ? 3 : 0;
+            const int gStride = (exprs[eG] && exprs[eG]->dependsOnX()) ? 3 : 0;
+            const int bStride = (exprs[eB] && exprs[eB]->dependsOnX()) ? 3 : 0;
+            const int rgbStride = (exprs[eRGB] && exprs[eRGB]->dependsOnX()) ? 3 : 0;
+            const int alphaStride = (exprs[eAlpha] && exprs[eAlpha]->dependsOnX()) ? 3 : 0;
+
+            PIX* dstPix = (PIX*)_dstImg->getPixelAddress(procWindow.x1, y);
+            const PIX* srcPix = &srcRows[0][0];
+
+            for (int x = procWindow.x1; x < procWindow.x2; ++x) {
                 // initialize with values from first input (some expressions may be empty)
                 if (nComponents == 1) {
-                    tmpPix[0] = srcPixels[0][3];
+                    tmpPix[0] = srcPix[3];
                 }
                 if (nComponents >= 3) {
-                    tmpPix[0] = srcPixels[0][0];
-                    tmpPix[1] = srcPixels[0][1];
-                    tmpPix[2] = srcPixels[0][2];
+                    tmpPix[0] = srcPix[0];
+                    tmpPix[1] = srcPix[1];
+                    tmpPix[2] = srcPix[2];
                 }
                 if (nComponents == 4) {
-                    tmpPix[3] = srcPixels[0][3];
+                    tmpPix[3] = srcPix[3];
                 }
 
-                // execute the valid expressions
-                if (_rExpr) {
-                    _rExpr->setXY(x, y);
-                    SeExpr2::Vec3d result = _rExpr->evaluate();
+                if (rResult) {
                     if (nComponents >= 3) {
-                        tmpPix[0] = result[0] * maxValue;
+                        tmpPix[0] = rResult[0] * maxValue;
                     }
+                    rResult += rStride;
                 }
-                if (_gExpr) {
-                    _gExpr->setXY(x, y);
-                    SeExpr2::Vec3d result = _gExpr->evaluate();
+                if (gResult) {
                     if (nComponents >= 3) {
-                        tmpPix[1] = result[0] * maxValue;
+                        tmpPix[1] = gResult[0] * maxValue;
                     }
+                    gResult += gStride;
                 }
-                if (_bExpr) {
-                    _bExpr->setXY(x, y);
-                    SeExpr2::Vec3d result = _bExpr->evaluate();
+                if (bResult) {
                     if (nComponents >= 3) {
-                        tmpPix[2] = result[0] * maxValue;
+                        tmpPix[2] = bResult[0] * maxValue;
                     }
+                    bResult += bStride;
                 }
-                if (_rgbExpr) {
-                    _rgbExpr->setXY(x, y);
-                    SeExpr2::Vec3d result = _rgbExpr->evaluate();
+                if (rgbResult) {
                     if (nComponents >= 3) {
-                        tmpPix[0] = result[0] * maxValue;
-                        tmpPix[1] = result[1] * maxValue;
-                        tmpPix[2] = result[2] * maxValue;
+                        tmpPix[0] = rgbResult[0] * maxValue;
+                        tmpPix[1] = rgbResult[1] * maxValue;
+                        tmpPix[2] = rgbResult[2] * maxValue;
                     }
+                    rgbResult += rgbStride;
                 }
-                if (_alphaExpr) {
-                    _alphaExpr->setXY(x, y);
-                    SeExpr2::Vec3d result = _alphaExpr->evaluate();
+                if (alphaResult) {
                     if (nComponents == 4) {
-                        tmpPix[3] = result[0] * maxValue;
+                        tmpPix[3] = alphaResult[0] * maxValue;
                     } else if (nComponents == 1) {
-                        tmpPix[0] = result[0] * maxValue;
+                        tmpPix[0] = alphaResult[0] * maxValue;
                     }
+                    alphaResult += alphaStride;
                 }
 
-                ofxsMaskMixPix<PIX, nComponents, maxValue, true>(tmpPix, x, y, srcPixels[0], _doMasking, _maskImg, (float)_mix, _maskInvert, dstPix);
+                ofxsMaskMixPix<PIX, nComponents, maxValue, true>(tmpPix, x, y, srcPix, _doMasking, _maskImg, (float)_mix, _maskInvert, dstPix);
 
-                // increment the dst pixel
+                // increment the src and dst pixels
+                srcPix += 4;
                 dstPix += nComponents;
             }
         }
-    } // process
+    } // processTile
+
+    // read one row of an input as RGBA, both in [0,maxValue] and normalized
+    void fillSourceRow(int inputIndex,
+                       int x1,
+                       int x2,
+                       int y,
+                       PIX* srcRow,
+                       float* srcRowNormalized) const
+    {
+        const Image* img = _srcCurTime[inputIndex];
+        const int nSrcComponents = _nSrcComponents[inputIndex];
+
+        for (int x = x1; x < x2; ++x, srcRow += 4, srcRowNormalized += 4) {
+            const PIX* src_pixels = img ? (const PIX*)img->getPixelAddress(x, y) : 0;
+            if (nSrcComponents == 4) {
+                for (int k = 0; k < 4; ++k) {
+                    srcRow[k] = src_pixels ? src_pixels[k] : 0;
+                }
+            } else if (nSrcComponents == 3) {
+                for (int k = 0; k < 3; ++k) {
+                    srcRow[k] = src_pixels ? src_pixels[k] : 0;
+                }
+                srcRow[3] = src_pixels ? 1 : 0;
+            } else if (nSrcComponents == 2) {
+                for (int k = 0; k < 2; ++k) {
+                    srcRow[k] = src_pixels ? src_pixels[k] : 0;
+                }
+                srcRow[2] = 0;
+                srcRow[3] = src_pixels ? 1 : 0;
+            } else {
+                for (int k = 0; k < 3; ++k) {
+                    srcRow[k] = 0;
+                }
+                srcRow[3] = src_pixels ? src_pixels[0] : 0;
+            }
+            for (int k = 0; k < 4; ++k) {
+                srcRowNormalized[k] = srcRow[k] / (float)maxValue;
+            }
+        }
+    }
 };
 
 SeExprPlugin::SeExprPlugin(OfxImageEffectHandle handle,
                            bool simple)
     : ImageEffect(handle)
     , _simple(simple)
+    , _exprSets()
+    , _exprSetsMutex()
 {
     if (getContext() != eContextGenerator) {
         for (int i = 0; i < kSourceClipCount; ++i) {
@@ -1945,6 +2211,13 @@ SeExprPlugin::SeExprPlugin(OfxImageEffectHandle handle,
     }
 }
 
+SeExprPlugin::~SeExprPlugin()
+{
+    for (std::list<OFXSeExpressionSet*>::iterator it = _exprSets.begin(); it != _exprSets.end(); ++it) {
+        delete *it;
+    }
+}
+
 void
 SeExprPlugin::setupAndProcess(SeExprProcessorBase& processor,
                               const RenderArguments& args)
@@ -1995,6 +2268,15 @@ SeExprPlugin::setupAndProcess(SeExprProcessorBase& processor,
     double mix;
     _mix->getValue(mix);
 
+    // read the user parameters once, the expressions only see this snapshot
+    SeExprParamValues paramValues;
+    for (int i = 0; i < kParamsCount; ++i) {
+        _doubleParams[i]->getValueAtTime(time, paramValues.doubles[i]);
+        _double2DParams[i]->getValueAtTime(time, paramValues.double2Ds[i][0], paramValues.double2Ds[i][1]);
+        _colorParams[i]->getValueAtTime(time, paramValues.colors[i][0], paramValues.colors[i][1], paramValues.colors[i][2]);
+    }
+    processor.setParamValues(paramValues);
+
     processor.setDstImg(dst.get());
 
     // auto ptr for the mask.
@@ -3025,7 +3307,7 @@ SeExprPluginFactory<simple>::describe(ImageEffectDescriptor& desc)
 
     // set a few flags
     desc.setSingleInstance(false);
-    desc.setHostFrameThreading(true);
+    desc.setHostFrameThreading(false);
     desc.setSupportsTiles(kSupportsTiles);
     desc.setSupportsMultiResolution(kSupportsMultiResolution);
     desc.setRenderThreadSafety(kRenderThreadSafety);
@@ -25,6 +25,8 @@
 #include <cfloat> // DBL_MAX
 #include <cmath>
 //#include <iostream>
+#include <memory>
+#include <vector>
 #if defined(_WIN32) || defined(__WIN32__) || defined(WIN32)
 #define NOMINMAX 1
 // windows - defined for both Win32 and Win64
@@ -72,14 +74,17 @@ typedef SeVec3d Vec3d;
 #include "ofxsCoords.h"
 #include "ofxsMaskMix.h"
 #include "ofxsMatrix2D.h"
+#include "ofxsMultiThread.h"
 #include "ofxsProcessing.H"
 #include "ofxsRamp.h"
 #include "ofxsThreadSuite.h"
 #include "ofxsTransformInteract.h"
+#include "IOLRUCache.h"
 
 using namespace OFX;
 
 using std::string;
+using std::vector;
 
 OFXS_NAMESPACE_ANONYMOUS_ENTER
 
@@ -96,8 +101,9 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kPluginIdentifier "net.sf.openfx.SeGrain"
 // History:
 // version 1.0: initial version
+// version 1.1: cache of the grain fields
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 1 // Increment this when you have fixed a bug or made it faster.
 
 #define kSupportsTiles 1
 #define kSupportsMultiResolution 1
@@ -115,6 +121,11 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kParamStaticSeedLabel "Static Seed"
 #define kParamStaticSeedHint "When enabled, the seed is not combined with the frame number, and thus the effect is the same for all frames for a given seed number."
 
+#define kParamGrainCache "grainCache"
+#define kParamGrainCacheLabel "Cache Grain"
+#define kParamGrainCacheHint "When Static Seed is checked, keep the computed grain in memory (up to 256 MB, shared by all instances), so that it is only looked up when rendering again with the same seed, size and irregularity, e.g. on every frame, or after changing the input, the intensity or the correlation. The grain changes on every frame if Static Seed is not checked, so it is never cached. The result is the same with or without the cache, up to float precision."
+#define kParamGrainCacheDefault true
+
 #define kParamPresets "grainPresets"
 #define kParamPresetsLabel "Presets"
 #define kParamPresetsHint "Presets for common types of film."
@@ -122,6 +133,9 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 
 #define kSizeMin 0.001 // minimum grain size
 
+#define kGrainTileSize 64 // width and height of the cached grain tiles, in pixels
+#define kGrainCacheMaxBytes ((std::size_t)256 * 1024 * 1024)
+
 struct PresetStruct {
     // Size:
     double red_size;
@@ -233,6 +247,154 @@ static struct PresetStruct gPresets[NUMPRESETS] = {
 
 static bool gHostIsNatron = false;
 
+// the grain of the three channels at pixel (x, y), for the transforms computed by SeGrainProcessorBase::setValues
+static inline void
+computeGrain(const Matrix3x3 invtransform[3],
+             int x,
+             int y,
+             double result[3])
+{
+    const int octaves = 2;
+    const double lacunarity = 2.;
+    const double gain = 0.5;
+    Point3D p(x + 0.5, y + 0.5, 1);
+
+    for (int c = 0; c < 3; ++c) {
+        Point3D pc = invtransform[c] * p;
+        double args[3] = { pc.x, pc.y, pc.z };
+        // double fbm(int n, const SeVec3d* args) in SeExprBuiltins.cpp
+        SeExpr2::FBM<3, 1, false>(args, &result[c], octaves, lacunarity, gain);
+    }
+}
+
+static inline int
+floorDiv(int a,
+         int b)
+{
+    return (a >= 0) ? (a / b) : -((-a + b - 1) / b);
+}
+
+// The grain of the three channels over a tile of kGrainTileSize x kGrainTileSize pixels, interleaved.
+// The grain is stored as float, which is the precision of the output.
+typedef vector<float> GrainTile;
+typedef std::shared_ptr<const GrainTile> GrainTilePtr;
+
+static GrainTilePtr
+computeGrainTile(const Matrix3x3 invtransform[3],
+                 int tx,
+                 int ty)
+{
+    std::shared_ptr<GrainTile> tile = std::make_shared<GrainTile>((std::size_t)kGrainTileSize * kGrainTileSize * 3);
+    float* values = &(*tile)[0];
+
+    for (int y = ty * kGrainTileSize; y < (ty + 1) * kGrainTileSize; ++y) {
+        for (int x = tx * kGrainTileSize; x < (tx + 1) * kGrainTileSize; ++x, values += 3) {
+            double result[3];
+            computeGrain(invtransform, x, y, result);
+            values[0] = (float)result[0];
+            values[1] = (float)result[1];
+            values[2] = (float)result[2];
+        }
+    }
+
+    return tile;
+}
+
+// The values the grain field depends on (seed, size, irregularity and frame for each channel, and render scale),
+// and the position of the tile.
+struct GrainTileKey {
+    double field[10];
+    int tx;
+    int ty;
+
+    bool operator<(const GrainTileKey& other) const
+    {
+        if (tx != other.tx) {
+            return tx < other.tx;
+        }
+        if (ty != other.ty) {
+            return ty < other.ty;
+        }
+
+        return std::lexicographical_compare(field, field + 10, other.field, other.field + 10);
+    }
+};
+
+// Process-wide cache of grain tiles, shared by all instances and limited to kGrainCacheMaxBytes.
+// The grain only depends on its parameters and the frame, not on the input.
+// The tiles are cheap to recompute, so they are the first to be evicted by the MemoryGovernor.
+class GrainTileCache {
+public:
+    static GrainTileCache& instance()
+    {
+        static GrainTileCache cache;
+
+        return cache;
+    }
+
+    GrainTilePtr find(const GrainTileKey& key)
+    {
+        GrainTilePtr tile;
+        _tiles.get(key, &tile);
+
+        return tile;
+    }
+
+    void insert(const GrainTileKey& key,
+                const GrainTilePtr& tile)
+    {
+        // a tile that is being used by a render is only freed when that render releases it
+        _tiles.insert(key, tile, tile->size() * sizeof(GrainTile::value_type));
+    }
+
+private:
+    GrainTileCache()
+        : _tiles(0, kGrainCacheMaxBytes, "Grain tiles (SeGrain)", IO::MemoryGovernor::ePriorityLow)
+    {
+    }
+
+    IO::LRUCache<GrainTileKey, GrainTilePtr> _tiles;
+};
+
+// Computes the grain tiles that are missing from the cache, each thread computing whole tiles.
+class GrainTileProcessor
+    : public MultiThread::Processor {
+public:
+    GrainTileProcessor(ImageEffect& effect,
+                       const Matrix3x3 invtransform[3],
+                       const vector<GrainTileKey>& keys)
+        : _effect(effect)
+        , _invtransform(invtransform)
+        , _keys(keys)
+        , _tiles(keys.size())
+    {
+    }
+
+    virtual void multiThreadFunction(unsigned int threadID,
+                                     unsigned int nThreads) OVERRIDE FINAL
+    {
+        for (std::size_t i = threadID; i < _keys.size(); i += nThreads) {
+            if (_effect.abort()) {
+                return;
+            }
+            try {
+                _tiles[i] = computeGrainTile(_invtransform, _keys[i].tx, _keys[i].ty);
+            } catch (...) {
+                // e.g. out of memory: the grain of this tile is computed directly when rendering
+                _tiles[i].reset();
+            }
+        }
+    }
+
+    const vector<GrainTilePtr>& getTiles() const { return _tiles; }
+
+private:
+    ImageEffect& _effect;
+    const Matrix3x3* _invtransform;
+    const vector<GrainTileKey>& _keys;
+    vector<GrainTilePtr> _tiles;
+};
+
 class SeGrainProcessorBase
     : public ImageProcessor {
 protected:
@@ -251,6 +413,12 @@ protected:
     double _black[3];
     double _minimum[3];
     Matrix3x3 _invtransform[3];
+    double _field[10]; // the values the grain field depends on, see GrainTileKey
+    // the grain tiles covering the render window, if the cache is used
+    vector<GrainTilePtr> _tiles;
+    int _tileX1;
+    int _tileY1;
+    int _tileCountX;
 
 public:
     SeGrainProcessorBase(ImageEffect& instance,
@@ -265,7 +433,12 @@ public:
         , _time(args.time)
         , _seed(0.)
         , _colorCorr(0.)
+        , _tiles()
+        , _tileX1(0)
+        , _tileY1(0)
+        , _tileCountX(0)
     {
+        std::fill(_field, _field + 10, 0.);
     }
 
     void setSrcImg(const Image* v) { _srcImg = v; }
@@ -313,7 +486,75 @@ public:
                            sa, 0, ca,
                            ca, 0, -sa);
             _invtransform[c] = rotY * rotX * sizeMat;
+            _field[3 * c + 0] = (std::max)(size[c], kSizeMin);
+            _field[3 * c + 1] = irregularity[c];
+            _field[3 * c + 2] = (staticSeed ? 0. : _time) + (1 + c) * seed + irregularity[c] / 2.;
         }
+        _field[9] = _renderScale.x;
+    }
+
+    /** @brief Get the grain tiles covering the render window from the cache, and compute the missing ones.
+        Must be called after setValues(). */
+    void fetchGrainTiles(const OfxRectI& renderWindow)
+    {
+        _tiles.clear();
+        if ((renderWindow.x2 <= renderWindow.x1) || (renderWindow.y2 <= renderWindow.y1)) {
+            return;
+        }
+        _tileX1 = floorDiv(renderWindow.x1, kGrainTileSize);
+        _tileY1 = floorDiv(renderWindow.y1, kGrainTileSize);
+        _tileCountX = floorDiv(renderWindow.x2 - 1, kGrainTileSize) + 1 - _tileX1;
+        const int tileCountY = floorDiv(renderWindow.y2 - 1, kGrainTileSize) + 1 - _tileY1;
+        _tiles.resize((std::size_t)_tileCountX * tileCountY);
+
+        GrainTileCache& cache = GrainTileCache::instance();
+        GrainTileKey key;
+        std::copy(_field, _field + 10, key.field);
+        vector<GrainTileKey> missingKeys;
+        vector<std::size_t> missingIndices;
+        for (int j = 0; j < tileCountY; ++j) {
+            for (int i = 0; i < _tileCountX; ++i) {
+                key.tx = _tileX1 + i;
+                key.ty = _tileY1 + j;
+                const std::size_t index = (std::size_t)j * _tileCountX + i;
+                _tiles[index] = cache.find(key);
+                if (!_tiles[index]) {
+                    missingKeys.push_back(key);
+                    missingIndices.push_back(index);
+                }
+            }
+        }
+        if (missingKeys.empty()) {
+            return;
+        }
+
+        GrainTileProcessor processor(_effect, _invtransform, missingKeys);
+        processor.multiThread((std::min)(MultiThread::getNumCPUs(), (unsigned int)missingKeys.size()));
+        const vector<GrainTilePtr>& computed = processor.getTiles();
+        for (std::size_t k = 0; k < computed.size(); ++k) {
+            if (computed[k]) {
+                _tiles[missingIndices[k]] = computed[k];
+                cache.insert(missingKeys[k], computed[k]);
+            }
+        }
+    }
+
+protected:
+    // the cached grain at pixel (x, y), or NULL if it must be computed
+    const float* getCachedGrain(int x,
+                                 int y) const
+    {
+        if (_tiles.empty()) {
+            return NULL;
+        }
+        const int tx = floorDiv(x, kGrainTileSize);
+        const int ty = floorDiv(y, kGrainTileSize);
+        const GrainTile* tile = _tiles[(std::size_t)(ty - _tileY1) * _tileCountX + (tx - _tileX1)].get();
+        if (!tile) {
+            return NULL;
+        }
+
+        return &(*tile)[((std::size_t)(y - ty * kGrainTileSize) * kGrainTileSize + (x - tx * kGrainTileSize)) * 3];
     }
 };
 
@@ -334,9 +575,6 @@ public:
     {
         // renderScale is handled upstream, see sizeMat
         unused(rs);
-        const int octaves = 2;
-        const double lacunarity = 2.;
-        const double gain = 0.5;
         float unpPix[4];
 
         for (int y = procWindow.y1; y < procWindow.y2; y++) {
@@ -346,17 +584,17 @@ public:
 
             PIX* dstPix = (PIX*)_dstImg->getPixelAddress(procWindow.x1, y);
             for (int x = procWindow.x1; x < procWindow.x2; x++) {
-                Point3D p(x + 0.5, y + 0.5, 1);
                 const PIX* srcPix = (const PIX*)(_srcImg ? _srcImg->getPixelAddress(x, y) : 0);
                 ofxsToRGBA<PIX, nComponents, maxValue>(srcPix, unpPix);
 
                 double result[3];
-                for (int c = 0; c < 3; ++c) {
-                    Point3D pc = _invtransform[c] * p;
-                    double args[3] = { pc.x, pc.y, pc.z };
-                    // process the pixel (the actual computation goes here)
-                    // double fbm(int n, const SeVec3d* args) in SeExprBuiltins.cpp
-                    SeExpr2::FBM<3, 1, false>(args, &result[c], octaves, lacunarity, gain);
+                const float* cached = getCachedGrain(x, y);
+                if (cached) {
+                    result[0] = cached[0];
+                    result[1] = cached[1];
+                    result[2] = cached[2];
+                } else {
+                    computeGrain(_invtransform, x, y, result);
                 }
                 if (_colorCorr != 0.) {
                     // apply color correction:
@@ -409,6 +647,7 @@ public:
 
         _seed = fetchDoubleParam(kParamSeed);
         _staticSeed = fetchBooleanParam(kParamStaticSeed);
+        _grainCache = fetchBooleanParam(kParamGrainCache);
         _presets = fetchChoiceParam(kParamPresets);
         _sizeAll = fetchDoubleParam(kParamSizeAll);
         _size[0] = fetchDoubleParam(kParamSizeRed);
@@ -423,7 +662,7 @@ public:
         _colorCorr = fetchDoubleParam(kParamColorCorr);
         _intensityBlack = fetchRGBParam(kParamIntensityBlack);
         _intensityMinimum = fetchRGBParam(kParamIntensityMinimum);
-        assert(_seed && _staticSeed && _presets && _sizeAll && _size[0] && _size[1] && _size[2] && _irregularity[0] && _irregularity[1] && _irregularity[2] && _intensity[0] && _intensity[1] && _intensity[2] && _colorCorr && _intensityBlack && _intensityMinimum);
+        assert(_seed && _staticSeed && _grainCache && _presets && _sizeAll && _size[0] && _size[1] && _size[2] && _irregularity[0] && _irregularity[1] && _irregularity[2] && _intensity[0] && _intensity[1] && _intensity[2] && _colorCorr && _intensityBlack && _intensityMinimum);
         _sublabel = fetchStringParam(kNatronOfxParamStringSublabelName);
         assert(_sublabel);
 
@@ -475,6 +714,7 @@ private:
     BooleanParam* _maskInvert;
     DoubleParam* _seed;
     BooleanParam* _staticSeed;
+    BooleanParam* _grainCache;
     ChoiceParam* _presets;
     DoubleParam* _sizeAll;
     DoubleParam* _size[3];
@@ -557,6 +797,10 @@ SeGrainPlugin::setupAndProcess(SeGrainProcessorBase& processor,
     _intensityMinimum->getValueAtTime(time, minimum[0], minimum[1], minimum[2]);
 
     processor.setValues(mix, seed, staticSeed, size, irregularity, intensity, colorCorr, black, minimum);
+    // without a static seed the grain depends on the frame, so that the tiles would never be used again
+    if ( staticSeed && _grainCache->getValueAtTime(time) ) {
+        processor.fetchGrainTiles(args.renderWindow);
+    }
     processor.process();
 } // SeGrainPlugin::setupAndProcess
 
@@ -805,6 +1049,18 @@ SeGrainPluginFactory::describeInContext(ImageEffectDescriptor& desc,
         }
     }
 
+    {
+        BooleanParamDescriptor* param = desc.defineBooleanParam(kParamGrainCache);
+        param->setLabel(kParamGrainCacheLabel);
+        param->setHint(kParamGrainCacheHint);
+        param->setDefault(kParamGrainCacheDefault);
+        param->setAnimates(false);
+        param->setEvaluateOnChange(false); // does not change the result
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+
     {
         ChoiceParamDescriptor* param = desc.defineChoiceParam(kParamPresets);
         param->setLabel(kParamPresetsLabel);
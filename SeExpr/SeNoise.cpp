@@ -28,6 +28,7 @@
 #include <cfloat> // DBL_MAX
 #include <cmath>
 //#include <iostream>
+#include <vector>
 #if defined(_WIN32) || defined(__WIN32__) || defined(WIN32)
 #define NOMINMAX 1
 // windows - defined for both Win32 and Win64
@@ -124,8 +125,9 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kPluginIdentifier "net.sf.openfx.SeNoise"
 // History:
 // version 1.0: initial version
+// version 1.1: per-row noise coordinates, skip pixels hidden by the mask
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 1 // Increment this when you have fixed a bug or made it faster.
 
 #define kSupportsTiles 1
 #define kSupportsMultiResolution 1
@@ -409,87 +411,86 @@ public:
         assert((!processR && !processG && !processB) || (nComponents == 3 || nComponents == 4));
         assert(!processA || (nComponents == 1 || nComponents == 4));
         assert(nComponents == 3 || nComponents == 4);
+        const int width = procWindow.x2 - procWindow.x1;
+        if (width <= 0) {
+            return;
+        }
         float unpPix[4];
         float tmpPix[4];
 #ifdef SENOISE_VORONOI
         SeExpr2::VoronoiPointData voronoiPointData;
+        // the arguments of voronoi that do not depend on the pixel
+        SeExpr2::Vec3d vargs[7];
+        vargs[1][0] = (int)_voronoiType + 1;
+        vargs[2][0] = _jitter;
+        vargs[3][0] = _fbmScale;
+        vargs[4][0] = _octaves;
+        vargs[5][0] = _lacunarity;
+        vargs[6][0] = _gain;
 #endif
         const double norm2 = (_point1.x - _point0.x) * (_point1.x - _point0.x) + (_point1.y - _point0.y) * (_point1.y - _point0.y);
         const double nx = norm2 == 0. ? 0. : (_point1.x - _point0.x) / norm2;
         const double ny = norm2 == 0. ? 0. : (_point1.y - _point0.y) / norm2;
-        int noiseComponents = _noiseColored ? 3 : 1;
+        const int noiseComponents = _noiseColored ? 3 : 1;
+
+        // The noise coordinates are p = _invtransform * (x + 0.5, y + 0.5, 1), i.e.
+        // p = col0 * (x + 0.5) + col1 * (y + 0.5) + col2. The x terms are computed once for the
+        // window and the y terms once per row, and they are summed in the same order as in the
+        // matrix product, so that the noise stays exactly the same.
+        const Point3D col0 = _invtransform * Point3D(1., 0., 0.);
+        const Point3D col1 = _invtransform * Point3D(0., 1., 0.);
+        const Point3D col2 = _invtransform * Point3D(0., 0., 1.);
+        std::vector<double> xTerms((std::size_t)width * 3);
+        for (int k = 0; k < width; ++k) {
+            const double px = procWindow.x1 + k + 0.5;
+            xTerms[3 * k + 0] = col0.x * px;
+            xTerms[3 * k + 1] = col0.y * px;
+            xTerms[3 * k + 2] = col0.z * px;
+        }
+        // noise values of the current row, and which pixels are not hidden by the mask
+        std::vector<double> noiseRow((std::size_t)width * 3);
+        std::vector<char> visibleRow(width);
 
         for (int y = procWindow.y1; y < procWindow.y2; y++) {
             if (_effect.abort()) {
                 break;
             }
 
+            // first pass: compute the noise over the row
+            const double py = y + 0.5;
+            const double yTerms[3] = { col1.x * py, col1.y * py, col1.z * py };
+            for (int k = 0; k < width; ++k) {
+                visibleRow[k] = !isMaskedOut(procWindow.x1 + k, y);
+                if (!visibleRow[k]) {
+                    continue;
+                }
+                double args[3] = { (xTerms[3 * k + 0] + yTerms[0]) + col2.x,
+                                   (xTerms[3 * k + 1] + yTerms[1]) + col2.y,
+                                   (xTerms[3 * k + 2] + yTerms[2]) + col2.z };
+#ifdef SENOISE_VORONOI
+                computeNoise(args, noiseComponents, &noiseRow[3 * k], voronoiPointData, vargs);
+#else
+                computeNoise(args, noiseComponents, &noiseRow[3 * k]);
+#endif
+            }
+
+            // second pass: combine with the ramp and the source
             PIX* dstPix = (PIX*)_dstImg->getPixelAddress(procWindow.x1, y);
             for (int x = procWindow.x1; x < procWindow.x2; x++) {
+                const int k = x - procWindow.x1;
                 const PIX* srcPix = (const PIX*)(_srcImg ? _srcImg->getPixelAddress(x, y) : 0);
                 ofxsToRGBA<PIX, nComponents, maxValue>(srcPix, unpPix);
+                if (!visibleRow[k]) {
+                    // the mask is zero: the result is the source pixel, whatever the noise
+                    ofxsMaskMixPix<PIX, nComponents, maxValue, true>(unpPix, x, y, srcPix, _doMasking, _maskImg, (float)_mix, _maskInvert, dstPix);
+                    dstPix += nComponents;
+                    continue;
+                }
                 double t_r = _replace ? 0. : unpPix[0];
                 double t_g = _replace ? 0. : unpPix[1];
                 double t_b = _replace ? 0. : unpPix[2];
                 double t_a = _replace ? 0. : unpPix[3];
-                Point3D p(x + 0.5, y + 0.5, 1);
-                p = _invtransform * p;
-                double args[3] = { p.x, p.y, p.z };
-                // process the pixel (the actual computation goes here)
-                double resultComps[3];
-                for (int i = 0; i < noiseComponents; ++i) {
-                    switch (_noiseType) {
-                    case eNoiseTypeCellNoise: {
-                        // double cellnoise(const Vec3d& p)
-                        SeExpr2::CellNoise<3, 1>(args, &resultComps[i]);
-                        break;
-                    }
-                    case eNoiseTypeNoise: {
-                        // double noise(int n, const Vec3d* args)
-                        SeExpr2::Noise<3, 1>(args, &resultComps[i]);
-                        resultComps[i] = .5 * resultComps[i] + .5;
-                        break;
-                    }
-#ifdef SENOISE_PERLIN
-                    case eNoiseTypePerlin: {
-                        n = SeExpr::perlin(1, &p);
-                        break;
-                    }
-#endif
-                    case eNoiseTypeFBM: {
-                        // double fbm(int n, const Vec3d* args) in SeExprBuiltins.cpp
-                        SeExpr2::FBM<3, 1, false>(args, &resultComps[i], _octaves, _lacunarity, _gain);
-                        resultComps[i] = .5 * resultComps[i] + .5;
-                        break;
-                    }
-                    case eNoiseTypeTurbulence: {
-                        // double turbulence(int n, const Vec3d* args)
-                        SeExpr2::FBM<3, 1, true>(args, &resultComps[i], _octaves, _lacunarity, _gain);
-                        break;
-                        // resultComps = .5*resultComps+.5;
-                    }
-#ifdef SENOISE_VORONOI
-                    case eNoiseTypeVoronoi: {
-                        SeExpr2::Vec3d vargs[7];
-                        vargs[0] = SeExpr2::Vec3d(args[0], args[1], args[2]);
-                        vargs[1][0] = (int)_voronoiType + 1;
-                        vargs[2][0] = _jitter;
-                        vargs[3][0] = _fbmScale;
-                        vargs[4][0] = _octaves;
-                        vargs[5][0] = _lacunarity;
-                        vargs[6][0] = _gain;
-                        resultComps[i] = SeExpr2::voronoiFn(voronoiPointData, 7, vargs)[0];
-                        break;
-                    }
-#endif
-                    }
-                    // resultComps = resultComps*resultComps; // gamma = 0.5 (TODO: gamma param)
-                    //  shift xyz for next component by some large enough pseudo-random integer number
-                    //  (so that cell noise still works).
-                    args[0] -= 17853;
-                    args[1] += 15707;
-                    args[2] -= 31415;
-                }
+                const double* resultComps = &noiseRow[3 * k];
                 OfxRGBAColourD result;
                 if (_noiseColored) {
                     result.r = resultComps[0];
@@ -531,6 +532,81 @@ public:
             }
         }
     } // multiThreadProcessImages
+
+private:
+    // true if the mask hides the pixel completely, in which case the output is the source pixel
+    bool isMaskedOut(int x,
+                     int y) const
+    {
+        if (!_doMasking || !_maskImg) {
+            return false;
+        }
+        const PIX* maskPix = (const PIX*)_maskImg->getPixelAddress(x, y);
+        if (!maskPix) {
+            return false;
+        }
+
+        return _maskInvert ? (*maskPix == maxValue) : (*maskPix == 0);
+    }
+
+    // compute the noise at the given position, for each noise component
+    void computeNoise(double args[3],
+                      int noiseComponents,
+                      double* resultComps
+#ifdef SENOISE_VORONOI
+                      ,
+                      SeExpr2::VoronoiPointData& voronoiPointData,
+                      SeExpr2::Vec3d vargs[7]
+#endif
+                      ) const
+    {
+        for (int i = 0; i < noiseComponents; ++i) {
+            switch (_noiseType) {
+            case eNoiseTypeCellNoise: {
+                // double cellnoise(const Vec3d& p)
+                SeExpr2::CellNoise<3, 1>(args, &resultComps[i]);
+                break;
+            }
+            case eNoiseTypeNoise: {
+                // double noise(int n, const Vec3d* args)
+                SeExpr2::Noise<3, 1>(args, &resultComps[i]);
+                resultComps[i] = .5 * resultComps[i] + .5;
+                break;
+            }
+#ifdef SENOISE_PERLIN
+            case eNoiseTypePerlin: {
+                n = SeExpr::perlin(1, &p);
+                break;
+            }
+#endif
+            case eNoiseTypeFBM: {
+                // double fbm(int n, const Vec3d* args) in SeExprBuiltins.cpp
+                SeExpr2::FBM<3, 1, false>(args, &resultComps[i], _octaves, _lacunarity, _gain);
+                resultComps[i] = .5 * resultComps[i] + .5;
+                break;
+            }
+            case eNoiseTypeTurbulence: {
+                // double turbulence(int n, const Vec3d* args)
+                SeExpr2::FBM<3, 1, true>(args, &resultComps[i], _octaves, _lacunarity, _gain);
+                break;
+                // resultComps = .5*resultComps+.5;
+            }
+#ifdef SENOISE_VORONOI
+            case eNoiseTypeVoronoi: {
+                vargs[0] = SeExpr2::Vec3d(args[0], args[1], args[2]);
+                resultComps[i] = SeExpr2::voronoiFn(voronoiPointData, 7, vargs)[0];
+                break;
+            }
+#endif
+            }
+            // resultComps = resultComps*resultComps; // gamma = 0.5 (TODO: gamma param)
+            //  shift xyz for next component by some large enough pseudo-random integer number
+            //  (so that cell noise still works).
+            args[0] -= 17853;
+            args[1] += 15707;
+            args[2] -= 31415;
+        }
+    }
 };
 
 ////////////////////////////////////////////////////////////////////////////////